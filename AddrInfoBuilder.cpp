@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "AddrInfoBuilder.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "resolv_private.h"
+
+namespace android::net {
+
+namespace {
+
+// get_ai() gives every node a sockaddr_union, which DNS64 synthesis may turn into a sockaddr_in6
+// in place; so does a block.
+static_assert(sizeof(sockaddr_union) == sizeof(sockaddr_in6));
+
+size_t nodesOffset(size_t count) {
+    const size_t size = count * sizeof(sockaddr_union);
+    return (size + alignof(addrinfo) - 1) / alignof(addrinfo) * alignof(addrinfo);
+}
+
+}  // namespace
+
+void AddrInfoBuilder::add(const addrinfo& ai, const sockaddr* addr, socklen_t addrlen) {
+    Entry& entry = mEntries.emplace_back();
+    entry.ai = ai;
+    entry.ai.ai_addrlen = std::min<socklen_t>(addrlen, sizeof(entry.addr));
+    entry.ai.ai_canonname = nullptr;
+    entry.ai.ai_addr = nullptr;
+    entry.ai.ai_next = nullptr;
+    memset(&entry.addr, 0, sizeof(entry.addr));
+    memcpy(&entry.addr, addr, entry.ai.ai_addrlen);
+    entry.canonname = 0;
+}
+
+void AddrInfoBuilder::setCanonName(size_t index, const char* name) {
+    mEntries[index].canonname = mNames.size() + 1;
+    mNames.append(name);
+    mNames.push_back('\0');
+}
+
+void AddrInfoBuilder::reorder(std::span<const size_t> order) {
+    std::vector<Entry> entries;
+    entries.reserve(order.size());
+    for (size_t index : order) entries.push_back(mEntries[index]);
+    mEntries = std::move(entries);
+}
+
+addrinfo* AddrInfoBuilder::release() {
+    const size_t count = mEntries.size();
+    if (count == 0) return nullptr;
+    const size_t namesOffset = nodesOffset(count) + count * sizeof(addrinfo);
+    auto* const block = static_cast<uint8_t*>(malloc(namesOffset + mNames.size()));
+    if (block == nullptr) {
+        mEntries.clear();
+        mNames.clear();
+        return nullptr;
+    }
+
+    auto* const addrs = reinterpret_cast<sockaddr_union*>(block);
+    auto* const nodes = reinterpret_cast<addrinfo*>(block + nodesOffset(count));
+    char* const names = reinterpret_cast<char*>(block + namesOffset);
+    memcpy(names, mNames.data(), mNames.size());
+    for (size_t i = 0; i < count; i++) {
+        const Entry& entry = mEntries[i];
+        memcpy(&addrs[i], &entry.addr, sizeof(addrs[i]));
+        nodes[i] = entry.ai;
+        nodes[i].ai_addr = &addrs[i].sa;
+        nodes[i].ai_canonname = entry.canonname ? names + entry.canonname - 1 : nullptr;
+        nodes[i].ai_next = i + 1 < count ? &nodes[i + 1] : nullptr;
+    }
+    mEntries.clear();
+    mNames.clear();
+    return nodes;
+}
+
+bool AddrInfoBuilder::isBlock(const addrinfo* ai) {
+    return ai->ai_addr != nullptr &&
+           reinterpret_cast<uintptr_t>(ai->ai_addr) < reinterpret_cast<uintptr_t>(ai);
+}
+
+addrinfo* AddrInfoBuilder::freeBlock(addrinfo* ai) {
+    void* const block = ai->ai_addr;
+    // The padding before the nodes is smaller than an address.
+    const size_t count = (reinterpret_cast<uintptr_t>(ai) - reinterpret_cast<uintptr_t>(block)) /
+                         sizeof(sockaddr_union);
+    addrinfo* const next = ai[count - 1].ai_next;
+    free(block);
+    return next;
+}
+
+}  // namespace android::net
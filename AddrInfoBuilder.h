@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace android::net {
+
+// Collects getaddrinfo() results, then allocates their addrinfo chain, addresses and canonical
+// names in a single block, which freeaddrinfo() frees. Results built one get_ai() at a time take
+// an allocation each, and another for a canonical name.
+//
+// In a block the addresses come first, then the nodes, so that a node's ai_addr points below it
+// where a get_ai() node's points right past it. That is how freeaddrinfo() tells them apart, and
+// how it counts the nodes of a block from the first. Other chains may be linked after a chain
+// handed out by release(), and its addresses may be modified in place, but its own nodes must
+// stay linked in order.
+class AddrInfoBuilder {
+  public:
+    // Appends a result with the flags, family, type and protocol of |ai| and the address |addr|
+    // of |addrlen| bytes, which is at most a sockaddr_in6.
+    void add(const addrinfo& ai, const sockaddr* addr, socklen_t addrlen);
+    // Sets the canonical name of the result at |index|.
+    void setCanonName(size_t index, const char* name);
+
+    size_t size() const { return mEntries.size(); }
+    bool empty() const { return mEntries.empty(); }
+    // The address of the result at |index|.
+    const sockaddr* addr(size_t index) const {
+        return reinterpret_cast<const sockaddr*>(&mEntries[index].addr);
+    }
+    // Rearranges the results so that the result at order[i] comes i-th.
+    void reorder(std::span<const size_t> order);
+    // Drops the results from |size| on.
+    void truncate(size_t size) { mEntries.resize(std::min(size, mEntries.size())); }
+
+    // Returns the chain and leaves the builder empty. Returns nullptr if there's no result or
+    // no memory.
+    addrinfo* release();
+
+    // Whether |ai| is the first node of a block made by release().
+    static bool isBlock(const addrinfo* ai);
+    // Frees the block starting at |ai| and returns what followed its last node.
+    static addrinfo* freeBlock(addrinfo* ai);
+
+  private:
+    struct Entry {
+        addrinfo ai;
+        sockaddr_in6 addr;
+        // 1 + the offset of the canonical name in mNames, or 0 if there's none.
+        size_t canonname;
+    };
+
+    std::vector<Entry> mEntries;
+    // The canonical names, each terminated by a NUL.
+    std::string mNames;
+};
+
+}  // namespace android::net
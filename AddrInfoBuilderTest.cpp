@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "AddrInfoBuilder.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class AddrInfoBuilderTest : public ResolvTestBase {
+  protected:
+    static void addV4(AddrInfoBuilder* builder, const char* addr, int socktype = SOCK_STREAM) {
+        sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(53)};
+        ASSERT_EQ(1, inet_pton(AF_INET, addr, &sin.sin_addr));
+        const addrinfo ai = {.ai_family = AF_INET, .ai_socktype = socktype};
+        builder->add(ai, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    }
+
+    static void addV6(AddrInfoBuilder* builder, const char* addr) {
+        sockaddr_in6 sin6 = {.sin6_family = AF_INET6, .sin6_port = htons(53)};
+        ASSERT_EQ(1, inet_pton(AF_INET6, addr, &sin6.sin6_addr));
+        const addrinfo ai = {.ai_flags = AI_CANONNAME, .ai_family = AF_INET6};
+        builder->add(ai, reinterpret_cast<sockaddr*>(&sin6), sizeof(sin6));
+    }
+
+    static std::vector<std::string> addresses(const addrinfo* ai) {
+        std::vector<std::string> result;
+        for (; ai; ai = ai->ai_next) {
+            char buf[INET6_ADDRSTRLEN];
+            const void* addr =
+                    ai->ai_family == AF_INET
+                            ? static_cast<const void*>(
+                                      &reinterpret_cast<const sockaddr_in*>(ai->ai_addr)->sin_addr)
+                            : &reinterpret_cast<const sockaddr_in6*>(ai->ai_addr)->sin6_addr;
+            result.push_back(inet_ntop(ai->ai_family, addr, buf, sizeof(buf)));
+        }
+        return result;
+    }
+};
+
+TEST_F(AddrInfoBuilderTest, Release) {
+    AddrInfoBuilder builder;
+    EXPECT_EQ(nullptr, builder.release());
+
+    addV6(&builder, "2001:db8::1");
+    addV4(&builder, "192.0.2.1", SOCK_DGRAM);
+    addV4(&builder, "192.0.2.2");
+    builder.setCanonName(0, "hello.example.com");
+    builder.setCanonName(2, "other.example.com");
+    EXPECT_EQ(3U, builder.size());
+
+    addrinfo* const result = builder.release();
+    ASSERT_NE(nullptr, result);
+    EXPECT_TRUE(builder.empty());
+    EXPECT_TRUE(AddrInfoBuilder::isBlock(result));
+
+    EXPECT_EQ((std::vector<std::string>{"2001:db8::1", "192.0.2.1", "192.0.2.2"}),
+              addresses(result));
+    EXPECT_EQ(AI_CANONNAME, result->ai_flags);
+    EXPECT_EQ(static_cast<socklen_t>(sizeof(sockaddr_in6)), result->ai_addrlen);
+    EXPECT_EQ(AF_INET6, result->ai_addr->sa_family);
+    EXPECT_STREQ("hello.example.com", result->ai_canonname);
+    const addrinfo* second = result->ai_next;
+    EXPECT_EQ(SOCK_DGRAM, second->ai_socktype);
+    EXPECT_EQ(static_cast<socklen_t>(sizeof(sockaddr_in)), second->ai_addrlen);
+    EXPECT_EQ(htons(53), reinterpret_cast<const sockaddr_in*>(second->ai_addr)->sin_port);
+    EXPECT_EQ(nullptr, second->ai_canonname);
+    EXPECT_STREQ("other.example.com", second->ai_next->ai_canonname);
+    freeaddrinfo(result);
+}
+
+TEST_F(AddrInfoBuilderTest, ReorderAndTruncate) {
+    AddrInfoBuilder builder;
+    addV4(&builder, "192.0.2.1");
+    addV4(&builder, "192.0.2.2");
+    addV4(&builder, "192.0.2.3");
+    builder.setCanonName(0, "first");
+    const size_t order[] = {2, 0, 1};
+    builder.reorder(order);
+    EXPECT_EQ(AF_INET, builder.addr(0)->sa_family);
+    builder.truncate(2);
+
+    addrinfo* const result = builder.release();
+    EXPECT_EQ((std::vector<std::string>{"192.0.2.3", "192.0.2.1"}), addresses(result));
+    // The canonical name follows its result.
+    EXPECT_EQ(nullptr, result->ai_canonname);
+    EXPECT_STREQ("first", result->ai_next->ai_canonname);
+    freeaddrinfo(result);
+}
+
+TEST_F(AddrInfoBuilderTest, FreeMixedChains) {
+    // Blocks followed by other blocks and by nodes allocated one by one, as get_ai() does.
+    AddrInfoBuilder builder;
+    addV4(&builder, "192.0.2.1");
+    addrinfo* const first = builder.release();
+    for (const char* addr : {"192.0.2.2", "192.0.2.3"}) addV4(&builder, addr);
+    addrinfo* const second = builder.release();
+    first->ai_next = second;
+
+    auto* const single = static_cast<addrinfo*>(calloc(1, sizeof(addrinfo) + sizeof(sockaddr_in6)));
+    ASSERT_NE(nullptr, single);
+    single->ai_family = AF_INET6;
+    single->ai_addr = reinterpret_cast<sockaddr*>(single + 1);
+    single->ai_addr->sa_family = AF_INET6;
+    single->ai_addrlen = sizeof(sockaddr_in6);
+    single->ai_canonname = strdup("single");
+    EXPECT_FALSE(AddrInfoBuilder::isBlock(single));
+    second->ai_next->ai_next = single;
+
+    EXPECT_EQ((std::vector<std::string>{"192.0.2.1", "192.0.2.2", "192.0.2.3", "::"}),
+              addresses(first));
+    // Anything leaked or freed twice fails under the sanitizers.
+    freeaddrinfo(first);
+}
+
+}  // namespace android::net
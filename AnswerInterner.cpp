@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "AnswerInterner.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <string.h>
+
+#include "DnsMessageIndex.h"
+
+namespace android::net {
+
+const AnswerInterner::Payload* AnswerInterner::intern(std::span<const uint8_t> answer,
+                                                      std::string_view question,
+                                                      std::vector<uint32_t>* ttls) {
+    DnsMessageIndex index;
+    if (!index.parse(answer)) return nullptr;
+    const auto questions = index.section(ns_s_qd);
+    if (questions.size() != 1 || question.size() <= 2 * NS_INT16SZ ||
+        questions[0].rdataOffset - questions[0].nameOffset != question.size() ||
+        memcmp(answer.data() + questions[0].nameOffset, question.data(), question.size()) != 0) {
+        return nullptr;
+    }
+
+    auto payload = std::make_unique<Payload>();
+    payload->mBytes.assign(answer.begin(), answer.end());
+    uint8_t* const bytes = payload->mBytes.data();
+    memset(bytes, 0, NS_INT16SZ);
+    // Only the name: the type and class that follow may look like letters.
+    uint8_t* const name = bytes + questions[0].nameOffset;
+    for (size_t i = 0; i < question.size() - 2 * NS_INT16SZ; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z') name[i] |= 0x20;
+    }
+    ttls->clear();
+    for (const ns_sect sect : {ns_s_an, ns_s_ns, ns_s_ar}) {
+        for (const DnsMessageIndex::Record& rr : index.section(sect)) {
+            if (rr.type == ns_t_opt) continue;
+            // The TTL field sits right before the 16-bit RDLENGTH that precedes the RDATA.
+            const uint16_t offset = rr.rdataOffset - NS_INT16SZ - NS_INT32SZ;
+            payload->mTtlOffsets.push_back(offset);
+            ttls->push_back(rr.ttl);
+            memset(bytes + offset, 0, NS_INT32SZ);
+        }
+    }
+
+    std::lock_guard guard(mMutex);
+    const std::string_view key(reinterpret_cast<const char*>(bytes), payload->mBytes.size());
+    auto [it, inserted] = mPayloads.try_emplace(key, nullptr);
+    if (inserted) {
+        it->second = std::move(payload);
+        mStats.payloads++;
+        mStats.bytes += answer.size();
+    }
+    it->second->mRefs++;
+    mStats.references++;
+    mStats.referencedBytes += answer.size();
+    return it->second.get();
+}
+
+void AnswerInterner::release(const Payload* payload) {
+    std::lock_guard guard(mMutex);
+    const size_t size = payload->mBytes.size();
+    mStats.references--;
+    mStats.referencedBytes -= size;
+    const auto it = mPayloads.find(
+            {reinterpret_cast<const char*>(payload->mBytes.data()), payload->mBytes.size()});
+    if (--it->second->mRefs > 0) return;
+    mPayloads.erase(it);
+    mStats.payloads--;
+    mStats.bytes -= size;
+}
+
+void AnswerInterner::materialize(const Payload& payload, uint16_t id, std::string_view question,
+                                 std::span<const uint32_t> ttls, std::span<uint8_t> out) {
+    memcpy(out.data(), payload.mBytes.data(), payload.mBytes.size());
+    const uint16_t nid = htons(id);
+    memcpy(out.data(), &nid, sizeof(nid));
+    memcpy(out.data() + NS_HFIXEDSZ, question.data(), question.size());
+    for (size_t i = 0; i < payload.mTtlOffsets.size(); i++) {
+        const uint32_t nttl = htonl(ttls[i]);
+        memcpy(out.data() + payload.mTtlOffsets[i], &nttl, sizeof(nttl));
+    }
+}
+
+AnswerInterner::Stats AnswerInterner::stats() const {
+    std::lock_guard guard(mMutex);
+    return mStats;
+}
+
+void AnswerInterner::dump(netdutils::DumpWriter& dw) const {
+    const Stats s = stats();
+    if (s.references == 0) return;
+    dw.println("Interned cache answers: %zu payloads of %zu bytes for %zu entries of %zu bytes",
+               s.payloads, s.bytes, s.references, s.referencedBytes);
+}
+
+}  // namespace android::net
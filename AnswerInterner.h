@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/DumpWriter.h>
+
+namespace android::net {
+
+// Shares the bytes of identical answers between the entries of all the DNS caches. An answer is
+// interned in a normalized form: ID zeroed, the TTL of every record but the EDNS OPT
+// pseudo-record zeroed, and its question name in lowercase. The same answer cached by several
+// networks, at different times or for case variants of the same name is thus stored once, and
+// each entry keeps only what tells its copy apart: the ID, the record TTLs, and the question,
+// which is that of its query.
+//
+// Payloads are reference counted, and their bytes never change, so they can be read without
+// holding any lock. This class is thread-safe.
+class AnswerInterner {
+  public:
+    class Payload {
+      public:
+        std::span<const uint8_t> bytes() const { return mBytes; }
+        // The number of record TTLs that materialize() takes.
+        size_t ttlCount() const { return mTtlOffsets.size(); }
+
+      private:
+        friend class AnswerInterner;
+        std::vector<uint8_t> mBytes;
+        // Where the TTL field of each record is, in the order of the records.
+        std::vector<uint16_t> mTtlOffsets;
+        size_t mRefs = 0;
+    };
+
+    struct Stats {
+        size_t payloads = 0;
+        size_t references = 0;
+        // Held by the payloads, and what the references would take if each had its own copy.
+        size_t bytes = 0;
+        size_t referencedBytes = 0;
+    };
+
+    AnswerInterner() = default;
+    AnswerInterner(const AnswerInterner&) = delete;
+    AnswerInterner& operator=(const AnswerInterner&) = delete;
+
+    static AnswerInterner& getInstance() {
+        static AnswerInterner instance;
+        return instance;
+    }
+
+    // Returns the payload of |answer| with a reference taken, and stores its record TTLs in
+    // |ttls|. |question| is the question of the query |answer| answers, in wire format. Returns
+    // nullptr if |answer| can't be parsed, or its question isn't exactly |question|: then it
+    // can't be restored from the query, and is best stored as it is.
+    const Payload* intern(std::span<const uint8_t> answer, std::string_view question,
+                          std::vector<uint32_t>* ttls) EXCLUDES(mMutex);
+    // Drops a reference that intern() returned.
+    void release(const Payload* payload) EXCLUDES(mMutex);
+
+    // Writes to |out|, which must hold payload.bytes().size() bytes, the answer that |payload|
+    // was interned from, with |id|, |question| and |ttls| in it.
+    static void materialize(const Payload& payload, uint16_t id, std::string_view question,
+                            std::span<const uint32_t> ttls, std::span<uint8_t> out);
+
+    Stats stats() const EXCLUDES(mMutex);
+    void dump(netdutils::DumpWriter& dw) const EXCLUDES(mMutex);
+
+  private:
+    mutable std::mutex mMutex;
+    // Keyed by the bytes of the payloads.
+    std::unordered_map<std::string_view, std::unique_ptr<Payload>> mPayloads GUARDED_BY(mMutex);
+    Stats mStats GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/nameser.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "AnswerInterner.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+namespace {
+
+const std::string kName("\7example\3com\0", 13);
+const std::string kMixedCaseName("\7ExAmPle\3com\0", 13);
+
+// The question of an A query for |name|, in wire format.
+std::string question(const std::string& name) {
+    return name + std::string("\0\1\0\1", 4);
+}
+
+// An answer to |question| with |id|, holding an A record with |ttl| that points to the question.
+std::vector<uint8_t> answer(uint16_t id, const std::string& question, uint32_t ttl) {
+    std::vector<uint8_t> bytes = {uint8_t(id >> 8), uint8_t(id), 0x81, 0x80, 0, 1, 0, 1, 0, 0,
+                                  0, 0};
+    bytes.insert(bytes.end(), question.begin(), question.end());
+    bytes.insert(bytes.end(), {0xc0, NS_HFIXEDSZ, 0, ns_t_a, 0, ns_c_in});
+    bytes.insert(bytes.end(), {uint8_t(ttl >> 24), uint8_t(ttl >> 16), uint8_t(ttl >> 8),
+                               uint8_t(ttl)});
+    bytes.insert(bytes.end(), {0, 4, 192, 0, 2, 1});
+    return bytes;
+}
+
+}  // namespace
+
+class AnswerInternerTest : public ResolvTestBase {
+  protected:
+    std::vector<uint8_t> materialize(const AnswerInterner::Payload* payload, uint16_t id,
+                                     const std::string& question,
+                                     const std::vector<uint32_t>& ttls) {
+        std::vector<uint8_t> out(payload->bytes().size());
+        AnswerInterner::materialize(*payload, id, question, ttls, out);
+        return out;
+    }
+
+    AnswerInterner mInterner;
+};
+
+TEST_F(AnswerInternerTest, SharesVariants) {
+    const std::string lower = question(kName);
+    const std::string mixed = question(kMixedCaseName);
+    const std::vector<uint8_t> first = answer(0x1234, lower, 300);
+    const std::vector<uint8_t> second = answer(0x5678, mixed, 120);
+
+    std::vector<uint32_t> ttls1, ttls2;
+    const AnswerInterner::Payload* p1 = mInterner.intern(first, lower, &ttls1);
+    const AnswerInterner::Payload* p2 = mInterner.intern(second, mixed, &ttls2);
+    ASSERT_NE(nullptr, p1);
+    EXPECT_EQ(p1, p2);
+    EXPECT_EQ(std::vector<uint32_t>{300}, ttls1);
+    EXPECT_EQ(std::vector<uint32_t>{120}, ttls2);
+
+    // Each comes back as it was.
+    EXPECT_EQ(first, materialize(p1, 0x1234, lower, ttls1));
+    EXPECT_EQ(second, materialize(p2, 0x5678, mixed, ttls2));
+
+    AnswerInterner::Stats stats = mInterner.stats();
+    EXPECT_EQ(1U, stats.payloads);
+    EXPECT_EQ(2U, stats.references);
+    EXPECT_EQ(first.size(), stats.bytes);
+    EXPECT_EQ(2 * first.size(), stats.referencedBytes);
+
+    mInterner.release(p1);
+    EXPECT_EQ(1U, mInterner.stats().payloads);
+    mInterner.release(p2);
+    stats = mInterner.stats();
+    EXPECT_EQ(0U, stats.payloads);
+    EXPECT_EQ(0U, stats.bytes);
+}
+
+TEST_F(AnswerInternerTest, DifferentRecords) {
+    const std::string q = question(kName);
+    std::vector<uint8_t> other = answer(1, q, 300);
+    other.back() = 2;
+    std::vector<uint32_t> ttls;
+    const AnswerInterner::Payload* p1 = mInterner.intern(answer(1, q, 300), q, &ttls);
+    const AnswerInterner::Payload* p2 = mInterner.intern(other, q, &ttls);
+    EXPECT_NE(p1, p2);
+    EXPECT_EQ(2U, mInterner.stats().payloads);
+    mInterner.release(p1);
+    mInterner.release(p2);
+}
+
+TEST_F(AnswerInternerTest, RejectsWhatCantBeRestored) {
+    const std::string q = question(kName);
+    std::vector<uint32_t> ttls;
+    // The question of the answer isn't that of the query.
+    EXPECT_EQ(nullptr, mInterner.intern(answer(1, q, 300), question(kMixedCaseName), &ttls));
+    // Truncated.
+    std::vector<uint8_t> truncated = answer(1, q, 300);
+    truncated.pop_back();
+    EXPECT_EQ(nullptr, mInterner.intern(truncated, q, &ttls));
+    EXPECT_EQ(0U, mInterner.stats().references);
+}
+
+}  // namespace android::net
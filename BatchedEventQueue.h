@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Hands events to |deliver| on a thread of its own, so that whoever pushes them doesn't wait for
+// the delivery. Events pushed while a batch is being delivered are delivered together in the next
+// one, in the order they were pushed. At most |capacity| events wait at a time: when a slow
+// consumer lets it fill up, new events are dropped and counted. This class is thread-safe.
+template <typename T>
+class BatchedEventQueue {
+  public:
+    using Deliver = std::function<void(std::vector<T>& batch)>;
+
+    struct Stats {
+        uint64_t delivered = 0;
+        uint64_t dropped = 0;
+        uint64_t batches = 0;
+        size_t queued = 0;
+    };
+
+    BatchedEventQueue(size_t capacity, Deliver deliver)
+        : mCapacity(capacity), mDeliver(std::move(deliver)) {
+        mThread = std::thread(&BatchedEventQueue::loop, this);
+    }
+
+    // Delivers the events still queued, then stops the thread.
+    ~BatchedEventQueue() {
+        {
+            std::lock_guard guard(mLock);
+            mStopping = true;
+        }
+        mCv.notify_one();
+        mThread.join();
+    }
+
+    BatchedEventQueue(const BatchedEventQueue&) = delete;
+    BatchedEventQueue& operator=(const BatchedEventQueue&) = delete;
+
+    // Returns false if |event| was dropped because the queue is full.
+    bool push(T event) EXCLUDES(mLock) {
+        {
+            std::lock_guard guard(mLock);
+            if (mQueue.size() >= mCapacity) {
+                mStats.dropped++;
+                return false;
+            }
+            mQueue.push_back(std::move(event));
+        }
+        mCv.notify_one();
+        return true;
+    }
+
+    Stats getStats() const EXCLUDES(mLock) {
+        std::lock_guard guard(mLock);
+        Stats stats = mStats;
+        stats.queued = mQueue.size();
+        return stats;
+    }
+
+  private:
+    void loop() EXCLUDES(mLock) {
+        std::vector<T> batch;
+        std::unique_lock lock(mLock);
+        while (true) {
+            mCv.wait(lock, [&]() REQUIRES(mLock) { return mStopping || !mQueue.empty(); });
+            if (mQueue.empty()) return;
+            batch.swap(mQueue);
+            lock.unlock();
+            mDeliver(batch);
+            const size_t delivered = batch.size();
+            batch.clear();
+            lock.lock();
+            mStats.delivered += delivered;
+            mStats.batches++;
+        }
+    }
+
+    mutable std::mutex mLock;
+    std::condition_variable mCv;
+    std::vector<T> mQueue GUARDED_BY(mLock);
+    Stats mStats GUARDED_BY(mLock);
+    bool mStopping GUARDED_BY(mLock) = false;
+    const size_t mCapacity;
+    const Deliver mDeliver;
+    std::thread mThread;
+};
+
+}  // namespace android::net
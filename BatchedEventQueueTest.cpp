@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <future>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "BatchedEventQueue.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class BatchedEventQueueTest : public ResolvTestBase {};
+
+TEST_F(BatchedEventQueueTest, DeliversInOrder) {
+    std::vector<int> delivered;
+    {
+        BatchedEventQueue<int> queue(1000, [&](std::vector<int>& batch) {
+            delivered.insert(delivered.end(), batch.begin(), batch.end());
+        });
+        for (int i = 0; i < 100; i++) EXPECT_TRUE(queue.push(i));
+    }
+    ASSERT_EQ(100U, delivered.size());
+    for (int i = 0; i < 100; i++) EXPECT_EQ(i, delivered[i]);
+}
+
+TEST_F(BatchedEventQueueTest, BatchesAndDropsBehindSlowConsumer) {
+    std::promise<void> blocked;
+    std::promise<void> unblock;
+    std::shared_future<void> unblocked = unblock.get_future().share();
+    std::vector<size_t> batchSizes;
+    {
+        BatchedEventQueue<int> queue(3, [&](std::vector<int>& batch) {
+            if (batchSizes.empty()) {
+                blocked.set_value();
+                unblocked.wait();
+            }
+            batchSizes.push_back(batch.size());
+        });
+        EXPECT_TRUE(queue.push(0));
+        blocked.get_future().wait();
+
+        // While the first event is being delivered, the next three wait and the rest are dropped.
+        for (int i = 1; i <= 5; i++) EXPECT_EQ(i <= 3, queue.push(i));
+        BatchedEventQueue<int>::Stats stats = queue.getStats();
+        EXPECT_EQ(0U, stats.delivered);
+        EXPECT_EQ(2U, stats.dropped);
+        EXPECT_EQ(3U, stats.queued);
+
+        unblock.set_value();
+        while (queue.getStats().delivered < 4) std::this_thread::yield();
+        stats = queue.getStats();
+        EXPECT_EQ(2U, stats.batches);
+        EXPECT_EQ(0U, stats.queued);
+    }
+    EXPECT_EQ((std::vector<size_t>{1, 3}), batchSizes);
+}
+
+}  // namespace android::net
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "CancellationToken.h"
+
+#include <poll.h>
+
+#include <android-base/logging.h>
+#include <sysutils/SocketClient.h>
+
+#include "Experiments.h"
+
+namespace android::net {
+
+namespace {
+
+thread_local std::shared_ptr<CancellationToken> tCurrentToken;
+std::atomic<uint64_t> sCancelledCount = 0;
+
+}  // namespace
+
+CancellationToken::CancellationToken(SocketClient* client) : mClient(client) {
+    mClient->incRef();
+}
+
+CancellationToken::~CancellationToken() {
+    mClient->decRef();
+}
+
+bool CancellationToken::isCancelled() {
+    if (mCancelled.load(std::memory_order_relaxed)) return true;
+    // Only a full hangup cancels: a client that shut down its writing side still reads answers.
+    pollfd fds = {.fd = mClient->getSocket(), .events = 0};
+    if (poll(&fds, 1, 0) <= 0 || !(fds.revents & (POLLHUP | POLLERR | POLLNVAL))) {
+        return false;
+    }
+    if (!mCancelled.exchange(true, std::memory_order_relaxed)) {
+        sCancelledCount.fetch_add(1, std::memory_order_relaxed);
+        LOG(INFO) << "Client of pid " << mClient->getPid() << " hung up, cancelling its queries";
+    }
+    return true;
+}
+
+std::shared_ptr<CancellationToken> CancellationToken::current() {
+    return tCurrentToken;
+}
+
+uint64_t CancellationToken::getCancelledCount() {
+    return sCancelledCount.load(std::memory_order_relaxed);
+}
+
+ScopedCancellationToken::ScopedCancellationToken(SocketClient* client)
+    : mPrevious(std::move(tCurrentToken)) {
+    if (Experiments::getInstance()->getFlag("cancel_on_client_hangup", 0) == 1) {
+        tCurrentToken = std::make_shared<CancellationToken>(client);
+    }
+}
+
+ScopedCancellationToken::~ScopedCancellationToken() {
+    tCurrentToken = std::move(mPrevious);
+}
+
+}  // namespace android::net
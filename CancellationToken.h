@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+class SocketClient;
+
+namespace android::net {
+
+// Tells whether the client a DnsProxyListener request is resolved for has hung up, so that no
+// more queries are sent for an answer nobody will read. Queries already sent are still waited
+// for, so that their answers get cached. This class is thread-safe.
+class CancellationToken {
+  public:
+    // Keeps a reference to |client|, so that its socket stays open for as long as the token.
+    explicit CancellationToken(SocketClient* client);
+    ~CancellationToken();
+    CancellationToken(const CancellationToken&) = delete;
+    CancellationToken& operator=(const CancellationToken&) = delete;
+
+    // Checks the client's socket without blocking, until it has hung up.
+    bool isCancelled();
+
+    // The token of the request this thread is handling, or nullptr.
+    static std::shared_ptr<CancellationToken> current();
+
+    // How many tokens have seen their client hang up, for the dump.
+    static uint64_t getCancelledCount();
+
+  private:
+    SocketClient* const mClient;
+    std::atomic<bool> mCancelled = false;
+};
+
+// Makes a token for |client| current on this thread during its lifetime, if the
+// "cancel_on_client_hangup" flag is set.
+class ScopedCancellationToken {
+  public:
+    explicit ScopedCancellationToken(SocketClient* client);
+    ~ScopedCancellationToken();
+    ScopedCancellationToken(const ScopedCancellationToken&) = delete;
+    ScopedCancellationToken& operator=(const ScopedCancellationToken&) = delete;
+
+  private:
+    std::shared_ptr<CancellationToken> mPrevious;
+};
+
+}  // namespace android::net
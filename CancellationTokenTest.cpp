@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <sysutils/SocketClient.h>
+
+#include "CancellationToken.h"
+#include "Experiments.h"
+#include "resolv_private.h"
+#include "tests/resolv_test_base.h"
+#include "tests/resolv_test_utils.h"
+
+namespace android::net {
+
+class CancellationTokenTest : public ResolvTestBase {
+  protected:
+    void SetUp() override {
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, mFds));
+        mClient = new SocketClient(mFds[0], true);
+    }
+    void TearDown() override {
+        mClient->decRef();
+        if (mFds[1] != -1) close(mFds[1]);
+    }
+
+    void hangUp() {
+        close(mFds[1]);
+        mFds[1] = -1;
+    }
+
+    int mFds[2] = {-1, -1};
+    SocketClient* mClient = nullptr;
+};
+
+TEST_F(CancellationTokenTest, ClientHangup) {
+    CancellationToken token(mClient);
+    EXPECT_FALSE(token.isCancelled());
+    // Pending data from the client isn't a hangup.
+    ASSERT_EQ(1, write(mFds[1], "x", 1));
+    EXPECT_FALSE(token.isCancelled());
+
+    const uint64_t cancelled = CancellationToken::getCancelledCount();
+    hangUp();
+    EXPECT_TRUE(token.isCancelled());
+    EXPECT_TRUE(token.isCancelled());
+    EXPECT_EQ(cancelled + 1, CancellationToken::getCancelledCount());
+}
+
+TEST_F(CancellationTokenTest, HalfCloseIsNotHangup) {
+    CancellationToken token(mClient);
+    // A client may send its request, shut down writing and wait for the answer.
+    ASSERT_EQ(0, shutdown(mFds[1], SHUT_WR));
+    EXPECT_FALSE(token.isCancelled());
+
+    hangUp();
+    EXPECT_TRUE(token.isCancelled());
+}
+
+TEST_F(CancellationTokenTest, DisabledByDefault) {
+    ScopedCancellationToken scoped(mClient);
+    EXPECT_EQ(nullptr, CancellationToken::current());
+    const android_net_context netcontext = {};
+    ResState res(&netcontext, nullptr);
+    hangUp();
+    EXPECT_FALSE(res.isCancelled());
+}
+
+TEST_F(CancellationTokenTest, ResStateFollowsCurrentToken) {
+    ScopedSystemProperties flag("persist.device_config.netd_native.cancel_on_client_hangup", "1");
+    Experiments::getInstance()->update();
+    {
+        ScopedCancellationToken scoped(mClient);
+        ASSERT_NE(nullptr, CancellationToken::current());
+        const android_net_context netcontext = {};
+        ResState res(&netcontext, nullptr);
+        ResState copy = res.clone();
+        EXPECT_FALSE(res.isCancelled());
+        hangUp();
+        EXPECT_TRUE(res.isCancelled());
+        EXPECT_TRUE(copy.isCancelled());
+    }
+    EXPECT_EQ(nullptr, CancellationToken::current());
+    Experiments::getInstance()->update();
+}
+
+}  // namespace android::net
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "CircuitBreaker.h"
+
+#include <arpa/nameser.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <netdutils/ThreadUtil.h>
+#include <private/android_filesystem_config.h>  // AID_DNS
+
+#include "Experiments.h"
+#include "resolv_private.h"
+#include "util.h"
+
+namespace android::net {
+
+using android::base::unique_fd;
+using netdutils::IPSockAddr;
+using std::chrono::milliseconds;
+
+namespace {
+
+const char* stateToString(CircuitBreaker::State state) {
+    switch (state) {
+        case CircuitBreaker::State::CLOSED:
+            return "closed";
+        case CircuitBreaker::State::OPEN:
+            return "open";
+        case CircuitBreaker::State::HALF_OPEN:
+            return "half-open";
+    }
+}
+
+const char* protocolToString(Protocol protocol) {
+    return protocol == PROTO_TCP ? "TCP" : "UDP";
+}
+
+// Waits up to |deadline| for |events| on |fd|.
+bool waitFor(int fd, short events, std::chrono::steady_clock::time_point deadline) {
+    const auto left = std::chrono::duration_cast<milliseconds>(deadline -
+                                                               std::chrono::steady_clock::now());
+    if (left <= milliseconds(0)) return false;
+    pollfd fds = {.fd = fd, .events = events};
+    return TEMP_FAILURE_RETRY(poll(&fds, 1, left.count())) == 1 && (fds.revents & events);
+}
+
+}  // namespace
+
+CircuitBreaker::CircuitBreaker(Prober prober, milliseconds initialBackoff, TimerService& timers)
+    : mProber(std::move(prober)), mInitialBackoff(initialBackoff), mTimers(timers) {}
+
+CircuitBreaker::~CircuitBreaker() {
+    std::unique_lock lock(mMutex);
+    mStopping = true;
+    for (auto& [_, breaker] : mBreakers) {
+        // A timer that can't be cancelled anymore is about to call startProbe().
+        if (breaker.timer != 0 && !mTimers.cancel(breaker.timer)) mProbesInFlight++;
+    }
+    mBreakers.clear();
+    mProbesDone.wait(lock, [this]() REQUIRES(mMutex) { return mProbesInFlight == 0; });
+}
+
+int CircuitBreaker::timeoutsToOpen() {
+    return std::max(0, Experiments::getInstance()->getFlag("circuit_breaker_timeouts", 0));
+}
+
+bool CircuitBreaker::probe(unsigned mark, const IPSockAddr& server, Protocol protocol) {
+    const bool tcp = protocol == PROTO_TCP;
+    // A query for the root NS records, which any recursive server answers from its cache.
+    uint8_t query[] = {0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, ns_t_ns, 0, ns_c_in};
+    arc4random_buf(query, 2);
+
+    const sockaddr_storage ss = server;
+    const sockaddr* nsap = reinterpret_cast<const sockaddr*>(&ss);
+    unique_fd fd(socket(nsap->sa_family,
+                        (tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    if (fd == -1) return false;
+    resolv_tag_socket(fd.get(), AID_DNS, NET_CONTEXT_INVALID_PID);
+    if (setsockopt(fd.get(), SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) != 0) return false;
+
+    const auto deadline = std::chrono::steady_clock::now() + kProbeTimeout;
+    if (connect(fd.get(), nsap, sockaddrSize(nsap)) != 0) {
+        if (errno != EINPROGRESS || !waitFor(fd.get(), POLLOUT, deadline)) return false;
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(fd.get(), SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+            return false;
+        }
+    }
+
+    std::vector<uint8_t> msg;
+    if (tcp) msg = {0, sizeof(query)};
+    msg.insert(msg.end(), std::begin(query), std::end(query));
+    if (send(fd.get(), msg.data(), msg.size(), MSG_NOSIGNAL) != ssize_t(msg.size())) return false;
+
+    // Any answer to the query will do, whatever its rcode: the server is up.
+    uint8_t buf[NS_HFIXEDSZ + 2];
+    const size_t offset = tcp ? 2 : 0;
+    while (waitFor(fd.get(), POLLIN, deadline)) {
+        // The answer is longer than the buffer, which only the header of it is read into.
+        const ssize_t n = recv(fd.get(), buf, sizeof(buf), tcp ? MSG_WAITALL : 0);
+        if (n < 0) return false;
+        if (size_t(n) >= offset + 2 && buf[offset] == query[0] && buf[offset + 1] == query[1]) {
+            return true;
+        }
+        if (tcp) return false;
+    }
+    return false;
+}
+
+bool CircuitBreaker::allows(unsigned netid, const IPSockAddr& server, Protocol protocol) const {
+    return state(netid, server, protocol) == State::CLOSED;
+}
+
+CircuitBreaker::State CircuitBreaker::state(unsigned netid, const IPSockAddr& server,
+                                            Protocol protocol) const {
+    std::lock_guard guard(mMutex);
+    const auto it = mBreakers.find({netid, server, protocol});
+    return it == mBreakers.end() ? State::CLOSED : it->second.state;
+}
+
+void CircuitBreaker::onAnswer(unsigned netid, const IPSockAddr& server, Protocol protocol) {
+    std::lock_guard guard(mMutex);
+    const auto it = mBreakers.find({netid, server, protocol});
+    if (it == mBreakers.end()) return;
+    // A query that was sent before the breaker opened may still be answered.
+    if (it->second.timer != 0) mTimers.cancel(it->second.timer);
+    if (it->second.state != State::CLOSED) {
+        LOG(INFO) << "Circuit breaker of " << server.toString() << " over "
+                  << protocolToString(protocol) << " closed by an answer";
+    }
+    mBreakers.erase(it);
+}
+
+void CircuitBreaker::onTimeout(unsigned netid, const IPSockAddr& server, Protocol protocol,
+                               unsigned mark, int timeoutsToOpen) {
+    if (timeoutsToOpen <= 0) return;
+    std::lock_guard guard(mMutex);
+    const Key key = {netid, server, protocol};
+    Breaker& breaker = mBreakers[key];
+    breaker.mark = mark;
+    if (breaker.state != State::CLOSED || ++breaker.timeouts < timeoutsToOpen) return;
+
+    LOG(WARNING) << "Circuit breaker of " << server.toString() << " over "
+                 << protocolToString(protocol) << " opened after " << breaker.timeouts
+                 << " timeouts in a row";
+    breaker.state = State::OPEN;
+    breaker.generation = mNextGeneration++;
+    breaker.backoff = mInitialBackoff;
+    scheduleProbe(key, breaker);
+}
+
+void CircuitBreaker::scheduleProbe(const Key& key, Breaker& breaker) {
+    const uint64_t generation = breaker.generation;
+    breaker.timer = mTimers.schedule(breaker.backoff,
+                                     [this, key, generation] { startProbe(key, generation); });
+    breaker.backoff = std::min(breaker.backoff * 2, kMaxBackoff);
+}
+
+void CircuitBreaker::startProbe(const Key& key, uint64_t generation) {
+    unsigned mark;
+    {
+        std::lock_guard guard(mMutex);
+        if (mStopping) {
+            // The destructor counted this timer as a probe.
+            if (--mProbesInFlight == 0) mProbesDone.notify_all();
+            return;
+        }
+        const auto it = mBreakers.find(key);
+        if (it == mBreakers.end() || it->second.generation != generation) return;
+        it->second.state = State::HALF_OPEN;
+        it->second.timer = 0;
+        mark = it->second.mark;
+        mProbesInFlight++;
+    }
+
+    // Timer callbacks must not block.
+    std::thread([this, key, generation, mark] {
+        netdutils::setThreadName("CircuitProbe");
+        const bool answered = mProber(mark, std::get<IPSockAddr>(key), std::get<Protocol>(key));
+        onProbeResult(key, generation, answered);
+    }).detach();
+}
+
+void CircuitBreaker::onProbeResult(const Key& key, uint64_t generation, bool answered) {
+    std::lock_guard guard(mMutex);
+    if (const auto it = mBreakers.find(key);
+        !mStopping && it != mBreakers.end() && it->second.generation == generation) {
+        const auto& [netid, server, protocol] = key;
+        if (answered) {
+            LOG(INFO) << "Circuit breaker of " << server.toString() << " over "
+                      << protocolToString(protocol) << " closed by a probe";
+            mBreakers.erase(it);
+        } else {
+            it->second.state = State::OPEN;
+            scheduleProbe(key, it->second);
+        }
+    }
+    if (--mProbesInFlight == 0) mProbesDone.notify_all();
+}
+
+void CircuitBreaker::clear(unsigned netid) {
+    std::lock_guard guard(mMutex);
+    std::erase_if(mBreakers, [this, netid](const auto& entry) {
+        const auto& [key, breaker] = entry;
+        if (std::get<unsigned>(key) != netid) return false;
+        // A probe that goes ahead regardless finds its breaker gone.
+        if (breaker.timer != 0) mTimers.cancel(breaker.timer);
+        return true;
+    });
+}
+
+void CircuitBreaker::dump(netdutils::DumpWriter& dw, unsigned netid) const {
+    // Copied, so that the lock isn't held while writing to the dump.
+    std::vector<std::pair<Key, Breaker>> breakers;
+    {
+        std::lock_guard guard(mMutex);
+        for (const auto& [key, breaker] : mBreakers) {
+            if (std::get<unsigned>(key) == netid && breaker.state != State::CLOSED) {
+                breakers.emplace_back(key, breaker);
+            }
+        }
+    }
+    if (breakers.empty()) return;
+    dw.println("Circuit breakers:");
+    netdutils::ScopedIndent indent(dw);
+    for (const auto& [key, breaker] : breakers) {
+        const auto& [_, server, protocol] = key;
+        dw.println("%s over %s: %s, next backoff %lldms", server.toString().c_str(),
+                   protocolToString(protocol), stateToString(breaker.state),
+                   static_cast<long long>(breaker.backoff.count()));
+    }
+}
+
+}  // namespace android::net
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/DumpWriter.h>
+#include <netdutils/InternetAddresses.h>
+
+#include "TimerService.h"
+#include "stats.pb.h"
+
+namespace android::net {
+
+// Keeps the queries of res_nsend() off cleartext servers that stopped answering, per network,
+// server and protocol. A server whose queries timed out that many times in a row is skipped
+// (OPEN) instead of being waited on by every query until DnsStats or res_stats catch up, and a
+// single probe in the background (HALF_OPEN) tests whether it answers again, first after
+// kInitialBackoff, then twice as long after each failure, up to kMaxBackoff. Once a probe or a
+// query gets an answer, the server is used again (CLOSED).
+//
+// This class is thread-safe.
+class CircuitBreaker {
+  public:
+    enum class State { CLOSED, OPEN, HALF_OPEN };
+
+    // Sends a query to |server| over |protocol| from a socket with |mark|, and returns whether
+    // it got an answer. It may block, for up to kProbeTimeout.
+    using Prober = std::function<bool(unsigned mark, const netdutils::IPSockAddr& server,
+                                      Protocol protocol)>;
+
+    static constexpr std::chrono::milliseconds kInitialBackoff{1000};
+    static constexpr std::chrono::milliseconds kMaxBackoff{5 * 60 * 1000};
+    static constexpr std::chrono::milliseconds kProbeTimeout{2000};
+
+    explicit CircuitBreaker(Prober prober = probe,
+                            std::chrono::milliseconds initialBackoff = kInitialBackoff,
+                            TimerService& timers = TimerService::getInstance());
+    // Cancels the probes not sent yet and waits for those in flight.
+    ~CircuitBreaker();
+    CircuitBreaker(const CircuitBreaker&) = delete;
+    CircuitBreaker& operator=(const CircuitBreaker&) = delete;
+
+    static CircuitBreaker& getInstance() {
+        static CircuitBreaker instance;
+        return instance;
+    }
+
+    // The "circuit_breaker_timeouts" flag: the timeouts in a row that take a server out of use,
+    // or 0 if none does.
+    static int timeoutsToOpen();
+
+    // Sends the query for the root NS records that the probes of the servers consist of.
+    static bool probe(unsigned mark, const netdutils::IPSockAddr& server, Protocol protocol);
+
+    // Whether queries may be sent to |server| over |protocol|.
+    bool allows(unsigned netid, const netdutils::IPSockAddr& server, Protocol protocol) const
+            EXCLUDES(mMutex);
+    State state(unsigned netid, const netdutils::IPSockAddr& server, Protocol protocol) const
+            EXCLUDES(mMutex);
+
+    // Records that a query to |server| over |protocol| got an answer.
+    void onAnswer(unsigned netid, const netdutils::IPSockAddr& server, Protocol protocol)
+            EXCLUDES(mMutex);
+    // Records that a query to |server| over |protocol| timed out, which takes it out of use if it
+    // was the |timeoutsToOpen|th in a row. The probes are then sent from a socket with |mark|.
+    void onTimeout(unsigned netid, const netdutils::IPSockAddr& server, Protocol protocol,
+                   unsigned mark, int timeoutsToOpen) EXCLUDES(mMutex);
+
+    // Forgets the servers of network |netid|, and cancels their probes.
+    void clear(unsigned netid) EXCLUDES(mMutex);
+
+    void dump(netdutils::DumpWriter& dw, unsigned netid) const EXCLUDES(mMutex);
+
+  private:
+    using Key = std::tuple<unsigned, netdutils::IPSockAddr, Protocol>;
+
+    struct Breaker {
+        State state = State::CLOSED;
+        int timeouts = 0;
+        unsigned mark = 0;
+        // How long until the next probe, once the current one fails.
+        std::chrono::milliseconds backoff{0};
+        // Tells the probes of a breaker that was cleared and opened again apart.
+        uint64_t generation = 0;
+        // The timer of the next probe, while OPEN.
+        TimerService::Id timer = 0;
+    };
+
+    // Schedules the probe of |breaker| in |breaker.backoff|, and doubles that.
+    void scheduleProbe(const Key& key, Breaker& breaker) REQUIRES(mMutex);
+    // Sends the probe of |key| on a thread of its own, unless the breaker changed meanwhile.
+    void startProbe(const Key& key, uint64_t generation) EXCLUDES(mMutex);
+    void onProbeResult(const Key& key, uint64_t generation, bool answered) EXCLUDES(mMutex);
+
+    const Prober mProber;
+    const std::chrono::milliseconds mInitialBackoff;
+    TimerService& mTimers;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mProbesDone;
+    // Servers that got an answer to their last query aren't in it.
+    std::map<Key, Breaker> mBreakers GUARDED_BY(mMutex);
+    uint64_t mNextGeneration GUARDED_BY(mMutex) = 1;
+    // Probes in flight, and timers that were running when the destructor couldn't cancel them.
+    int mProbesInFlight GUARDED_BY(mMutex) = 0;
+    bool mStopping GUARDED_BY(mMutex) = false;
+};
+
+}  // namespace android::net
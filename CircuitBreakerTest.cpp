@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "CircuitBreaker.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using netdutils::IPSockAddr;
+using namespace std::chrono_literals;
+using State = CircuitBreaker::State;
+
+namespace {
+
+constexpr unsigned kNetId = 31;
+constexpr unsigned kMark = 0x1234;
+constexpr int kTimeoutsToOpen = 3;
+const IPSockAddr kServer1 = IPSockAddr::toIPSockAddr("127.0.0.1", 53);
+const IPSockAddr kServer2 = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+
+}  // namespace
+
+class CircuitBreakerTest : public ResolvTestBase {
+  protected:
+    // Waits up to 2 seconds for the breaker of |server| over UDP to be in |state|.
+    bool waitForState(const IPSockAddr& server, State state) {
+        for (int i = 0; i < 200; i++) {
+            if (mBreaker.state(kNetId, server, PROTO_UDP) == state) return true;
+            std::this_thread::sleep_for(10ms);
+        }
+        return false;
+    }
+
+    void timeOut(const IPSockAddr& server, int times) {
+        for (int i = 0; i < times; i++) {
+            mBreaker.onTimeout(kNetId, server, PROTO_UDP, kMark, kTimeoutsToOpen);
+        }
+    }
+
+    std::atomic<bool> mAnswers = false;
+    std::atomic<int> mProbes = 0;
+    std::atomic<unsigned> mProbeMark = 0;
+    // Declared after what the prober uses, so that it waits for the probes before that goes.
+    TimerService mTimers;
+    CircuitBreaker mBreaker{[this](unsigned mark, const IPSockAddr&, Protocol) {
+                                mProbeMark = mark;
+                                mProbes++;
+                                return mAnswers.load();
+                            },
+                            50ms, mTimers};
+};
+
+TEST_F(CircuitBreakerTest, OpensAfterTimeoutsInARow) {
+    timeOut(kServer1, kTimeoutsToOpen - 1);
+    EXPECT_TRUE(mBreaker.allows(kNetId, kServer1, PROTO_UDP));
+    // An answer starts the count over.
+    mBreaker.onAnswer(kNetId, kServer1, PROTO_UDP);
+    timeOut(kServer1, kTimeoutsToOpen - 1);
+    EXPECT_TRUE(mBreaker.allows(kNetId, kServer1, PROTO_UDP));
+
+    timeOut(kServer1, 1);
+    EXPECT_FALSE(mBreaker.allows(kNetId, kServer1, PROTO_UDP));
+    EXPECT_TRUE(mBreaker.allows(kNetId, kServer1, PROTO_TCP));
+    EXPECT_TRUE(mBreaker.allows(kNetId, kServer2, PROTO_UDP));
+    EXPECT_TRUE(mBreaker.allows(kNetId + 1, kServer1, PROTO_UDP));
+
+    // Off when there's no threshold.
+    mBreaker.onTimeout(kNetId, kServer2, PROTO_UDP, kMark, 0);
+    EXPECT_EQ(State::CLOSED, mBreaker.state(kNetId, kServer2, PROTO_UDP));
+}
+
+TEST_F(CircuitBreakerTest, ProbesUntilAnswered) {
+    timeOut(kServer1, kTimeoutsToOpen);
+    EXPECT_EQ(State::OPEN, mBreaker.state(kNetId, kServer1, PROTO_UDP));
+
+    // Probes fail, and the breaker stays open.
+    while (mProbes < 2) std::this_thread::sleep_for(10ms);
+    EXPECT_FALSE(mBreaker.allows(kNetId, kServer1, PROTO_UDP));
+    EXPECT_EQ(kMark, mProbeMark);
+
+    mAnswers = true;
+    EXPECT_TRUE(waitForState(kServer1, State::CLOSED));
+    const int probes = mProbes;
+    std::this_thread::sleep_for(300ms);
+    EXPECT_EQ(probes, mProbes);
+}
+
+TEST_F(CircuitBreakerTest, BacksOff) {
+    timeOut(kServer1, kTimeoutsToOpen);
+    // After 50ms, then 100ms, then 200ms: three probes in 350ms, but not four in 500ms.
+    std::this_thread::sleep_for(500ms);
+    EXPECT_GE(mProbes, 3);
+    EXPECT_LT(mProbes, 5);
+}
+
+TEST_F(CircuitBreakerTest, AnswerCloses) {
+    timeOut(kServer1, kTimeoutsToOpen);
+    mBreaker.onAnswer(kNetId, kServer1, PROTO_UDP);
+    EXPECT_TRUE(mBreaker.allows(kNetId, kServer1, PROTO_UDP));
+    std::this_thread::sleep_for(200ms);
+    EXPECT_EQ(0, mProbes);
+}
+
+TEST_F(CircuitBreakerTest, Clear) {
+    timeOut(kServer1, kTimeoutsToOpen);
+    timeOut(kServer2, kTimeoutsToOpen - 1);
+    mBreaker.clear(kNetId);
+    EXPECT_TRUE(mBreaker.allows(kNetId, kServer1, PROTO_UDP));
+    timeOut(kServer2, 1);
+    EXPECT_TRUE(mBreaker.allows(kNetId, kServer2, PROTO_UDP));
+    std::this_thread::sleep_for(200ms);
+    EXPECT_EQ(0, mProbes);
+}
+
+}  // namespace android::net
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "ClientShards.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <set>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include "util.h"
+
+namespace android::net {
+
+using android::base::StringPrintf;
+
+namespace {
+
+constexpr int kMaxEvents = 64;
+
+}  // namespace
+
+ClientShards::ClientShards(size_t numShards, Server server) : mServer(std::move(server)) {
+    for (size_t i = 0; i < numShards; i++) {
+        auto shard = std::make_unique<Shard>();
+        shard->epoll.reset(epoll_create1(EPOLL_CLOEXEC));
+        shard->wakeup.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        epoll_event event = {.events = EPOLLIN, .data = {.ptr = nullptr}};
+        if (!shard->epoll.ok() || !shard->wakeup.ok() ||
+            epoll_ctl(shard->epoll, EPOLL_CTL_ADD, shard->wakeup, &event) != 0) {
+            PLOG(ERROR) << __func__ << ": failed to set up shard " << i;
+            // Clients are only handed over to the shards that run.
+            break;
+        }
+        mShards.push_back(std::move(shard));
+    }
+    for (size_t i = 0; i < mShards.size(); i++) {
+        mShards[i]->thread = std::thread(&ClientShards::loop, this, i);
+    }
+}
+
+ClientShards::~ClientShards() {
+    mStopping = true;
+    for (const auto& shard : mShards) eventfd_write(shard->wakeup, 1);
+    for (const auto& shard : mShards) shard->thread.join();
+}
+
+void ClientShards::adopt(SocketClient* c) {
+    c->incRef();
+    Shard* target = nullptr;
+    size_t fewest = SIZE_MAX;
+    for (const auto& shard : mShards) {
+        std::lock_guard guard(shard->mutex);
+        if (shard->stats.clients < fewest) {
+            fewest = shard->stats.clients;
+            target = shard.get();
+        }
+    }
+    {
+        std::lock_guard guard(target->mutex);
+        target->adopted.push_back(c);
+        target->stats.clients++;
+        target->stats.adopted++;
+    }
+    if (eventfd_write(target->wakeup, 1) != 0) PLOG(WARNING) << __func__ << ": eventfd_write";
+}
+
+void ClientShards::loop(size_t index) {
+    pthread_setname_np(pthread_self(), StringPrintf("DnsShard%zu", index).c_str());
+    if (pinToAllowedCore(index) < 0) LOG(INFO) << "Shard " << index << " isn't pinned";
+
+    Shard& shard = *mShards[index];
+    std::set<SocketClient*> clients;
+    size_t dropped = 0;
+    const auto drop = [&](SocketClient* c) {
+        epoll_ctl(shard.epoll, EPOLL_CTL_DEL, c->getSocket(), nullptr);
+        clients.erase(c);
+        c->decRef();
+        dropped++;
+    };
+    epoll_event events[kMaxEvents];
+    std::vector<SocketClient*> adopted;
+    while (!mStopping) {
+        const int n = epoll_wait(shard.epoll, events, kMaxEvents, -1);
+        if (n < 0 && errno != EINTR) PLOG(ERROR) << __func__ << ": epoll_wait";
+
+        size_t served = 0;
+        for (int i = 0; i < n; i++) {
+            auto* const c = static_cast<SocketClient*>(events[i].data.ptr);
+            if (c == nullptr) {
+                eventfd_t value;
+                eventfd_read(shard.wakeup, &value);
+                continue;
+            }
+            served++;
+            if (!mServer(c, index)) drop(c);
+        }
+
+        {
+            std::lock_guard guard(shard.mutex);
+            adopted.swap(shard.adopted);
+            shard.stats.served += served;
+            shard.stats.clients -= dropped;
+        }
+        dropped = 0;
+        for (SocketClient* c : adopted) {
+            epoll_event event = {.events = EPOLLIN, .data = {.ptr = c}};
+            clients.insert(c);
+            if (epoll_ctl(shard.epoll, EPOLL_CTL_ADD, c->getSocket(), &event) != 0) {
+                PLOG(ERROR) << __func__ << ": can't poll client of UID " << c->getUid();
+                drop(c);
+            }
+        }
+        adopted.clear();
+    }
+
+    std::lock_guard guard(shard.mutex);
+    for (SocketClient* c : shard.adopted) clients.insert(c);
+    shard.adopted.clear();
+    for (SocketClient* c : clients) c->decRef();
+    shard.stats.clients = 0;
+}
+
+std::vector<ClientShards::ShardStats> ClientShards::getStats() const {
+    std::vector<ShardStats> stats;
+    for (const auto& shard : mShards) {
+        std::lock_guard guard(shard->mutex);
+        stats.push_back(shard->stats);
+    }
+    return stats;
+}
+
+void ClientShards::dump(netdutils::DumpWriter& dw) const {
+    const std::vector<ShardStats> stats = getStats();
+    dw.println("Listener shards: %zu", stats.size());
+    netdutils::ScopedIndent indent(dw);
+    for (size_t i = 0; i < stats.size(); i++) {
+        dw.println("shard %zu: %zu clients, %" PRIu64 " adopted, %" PRIu64 " served", i,
+                   stats[i].clients, stats[i].adopted, stats[i].served);
+    }
+}
+
+}  // namespace android::net
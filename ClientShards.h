@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <netdutils/DumpWriter.h>
+#include <sysutils/SocketClient.h>
+
+namespace android::net {
+
+// Serves the clients of a SocketListener on several threads instead of its one. The listener
+// thread only hands each new client over to the shard with the fewest clients, which then polls it
+// and serves what it sends until it goes: clients never move between shards.
+//
+// Shard i is pinned to the i-th core netd may run on, so that the requests of a client are parsed,
+// looked up in the cache and counted by the limiter on one core, instead of all of them going
+// through one thread and the cache lines it touches bouncing between the cores of the clients.
+// When netd may only run on some of the cores, the shards are left to the scheduler. This class
+// is thread-safe.
+class ClientShards {
+  public:
+    // Serves what |c| sent, on shard |shard|. Returns false to drop the client, like
+    // SocketListener::onDataAvailable().
+    using Server = std::function<bool(SocketClient* c, size_t shard)>;
+
+    struct ShardStats {
+        size_t clients = 0;
+        uint64_t adopted = 0;
+        // Times the shard served a client that had sent something.
+        uint64_t served = 0;
+    };
+
+    ClientShards(size_t numShards, Server server);
+    // Stops the shards, and drops their clients.
+    ~ClientShards();
+
+    // Takes a reference to |c|, which is served on a shard from now on.
+    void adopt(SocketClient* c);
+
+    size_t size() const { return mShards.size(); }
+    std::vector<ShardStats> getStats() const;
+    void dump(netdutils::DumpWriter& dw) const;
+
+  private:
+    struct Shard {
+        mutable std::mutex mutex;
+        // Handed over, and not polled yet.
+        std::vector<SocketClient*> adopted GUARDED_BY(mutex);
+        ShardStats stats GUARDED_BY(mutex);
+        // Polls the clients of the shard, and |wakeup|.
+        base::unique_fd epoll;
+        // Wakes the shard up, for new clients or to stop.
+        base::unique_fd wakeup;
+        std::thread thread;
+    };
+
+    void loop(size_t index);
+
+    const Server mServer;
+    std::vector<std::unique_ptr<Shard>> mShards;
+    std::atomic<bool> mStopping = false;
+};
+
+}  // namespace android::net
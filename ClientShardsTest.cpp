@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "ClientShards.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using android::base::unique_fd;
+using namespace std::chrono_literals;
+
+class ClientShardsTest : public ResolvTestBase {
+  protected:
+    // Hands over a new client to |shards|, and returns the peer of its socket.
+    unique_fd connect(ClientShards& shards) {
+        int fds[2];
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+        auto* c = new SocketClient(fds[0], true, false);
+        shards.adopt(c);
+        // The shard holds the only reference now.
+        c->decRef();
+        return unique_fd(fds[1]);
+    }
+
+    // Waits up to 2 seconds for |predicate| to hold.
+    template <typename Predicate>
+    bool waitFor(Predicate predicate) {
+        for (int i = 0; i < 200; i++) {
+            if (predicate()) return true;
+            std::this_thread::sleep_for(10ms);
+        }
+        return false;
+    }
+
+    // Reads a byte sent by a client, and records where it was served.
+    bool serve(SocketClient* c, size_t shard) {
+        char byte;
+        if (read(c->getSocket(), &byte, 1) != 1) return false;
+        mShard = shard;
+        mCpu = sched_getcpu();
+        mServed++;
+        return true;
+    }
+
+    std::atomic<size_t> mShard = SIZE_MAX;
+    std::atomic<int> mCpu = -1;
+    std::atomic<int> mServed = 0;
+};
+
+TEST_F(ClientShardsTest, ServesUntilClosed) {
+    ClientShards shards(1, [this](SocketClient* c, size_t shard) { return serve(c, shard); });
+    ASSERT_EQ(1U, shards.size());
+    unique_fd peer = connect(shards);
+
+    ASSERT_EQ(1, write(peer.get(), "a", 1));
+    ASSERT_TRUE(waitFor([&] { return mServed == 1; }));
+    EXPECT_EQ(0U, mShard);
+    // On the core of the shard, unless the test may only run on some cores, and the shard isn't
+    // pinned.
+    cpu_set_t allowed;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+    if (CPU_COUNT(&allowed) == sysconf(_SC_NPROCESSORS_ONLN)) EXPECT_EQ(0, mCpu);
+    ASSERT_EQ(1, write(peer.get(), "b", 1));
+    ASSERT_TRUE(waitFor([&] { return mServed == 2; }));
+
+    // Closed, the client is dropped, and so is its socket.
+    peer.reset();
+    ASSERT_TRUE(waitFor([&] { return shards.getStats()[0].clients == 0; }));
+    const ClientShards::ShardStats stats = shards.getStats()[0];
+    EXPECT_EQ(1U, stats.adopted);
+    EXPECT_EQ(3U, stats.served);
+}
+
+TEST_F(ClientShardsTest, SpreadsClients) {
+    std::vector<unique_fd> peers;
+    {
+        ClientShards shards(2, [this](SocketClient* c, size_t shard) { return serve(c, shard); });
+        ASSERT_EQ(2U, shards.size());
+        for (int i = 0; i < 4; i++) peers.push_back(connect(shards));
+        for (const ClientShards::ShardStats& stats : shards.getStats()) {
+            EXPECT_EQ(2U, stats.clients);
+        }
+    }
+    // The clients left are dropped when the shards stop.
+    for (const unique_fd& peer : peers) {
+        char byte;
+        EXPECT_EQ(0, read(peer.get(), &byte, 1));
+    }
+}
+
+}  // namespace android::net
@@ -19,20 +19,29 @@
 #include "Dns64Configuration.h"
 
 #include <android-base/logging.h>
+#include <android/multinetwork.h>  // ResNsendFlags
 #include <netdb.h>
 #include <netdutils/BackoffSequence.h>
 #include <netdutils/DumpWriter.h>
 #include <netdutils/InternetAddresses.h>
 #include <netdutils/ThreadUtil.h>
 #include <utils/StrongPointer.h>
+#include <condition_variable>
+#include <optional>
 #include <thread>
 #include <utility>
 
 #include <arpa/inet.h>
+#include <arpa/nameser.h>
 
+#include "DnsMessageIndex.h"
 #include "DnsResolver.h"
+#include "Experiments.h"
+#include "TimerService.h"
 #include "getaddrinfo.h"
 #include "netd_resolv/resolv.h"
+#include "resolv_cache.h"
+#include "resolv_private.h"
 #include "stats.pb.h"
 
 namespace android {
@@ -41,6 +50,7 @@ using android::sp;
 using netdutils::DumpWriter;
 using netdutils::IPAddress;
 using netdutils::IPPrefix;
+using netdutils::IPSockAddr;
 using netdutils::ScopedAddrinfo;
 using netdutils::setThreadName;
 
@@ -62,85 +72,112 @@ void Dns64Configuration::startPrefixDiscovery(unsigned netId) {
     Dns64Config cfg(getNextId(), netId);
     // Emplace a copy of |cfg| in the map.
     mDns64Configs.emplace(std::make_pair(netId, cfg));
+    publishPrefixes();
+
+    auto backoff = std::make_shared<netdutils::BackoffSequence<>>(
+            netdutils::BackoffSequence<>::Builder()
+                    .withInitialRetransmissionTime(std::chrono::seconds(1))
+                    .withMaximumRetransmissionTime(std::chrono::seconds(3600))
+                    .build());
+    runPrefixDiscovery(cfg, std::move(backoff));
+}
 
+void Dns64Configuration::runPrefixDiscovery(const Dns64Config& cfg,
+                                            std::shared_ptr<netdutils::BackoffSequence<>> backoff) {
     const sp<Dns64Configuration> thiz = this;
     // Note that capturing |cfg| in this lambda creates a copy.
-    std::thread discovery_thread([thiz, cfg, netId] {
-        setThreadName(fmt::format("Nat64Pfx_{}", netId));
+    std::thread discovery_thread([thiz, cfg, backoff = std::move(backoff)] {
+        setThreadName(fmt::format("Nat64Pfx_{}", cfg.netId));
 
         // Make a mutable copy rather than mark the whole lambda mutable.
         // No particular reason.
         Dns64Config evalCfg(cfg);
 
-        auto backoff = netdutils::BackoffSequence<>::Builder()
-                               .withInitialRetransmissionTime(std::chrono::seconds(1))
-                               .withMaximumRetransmissionTime(std::chrono::seconds(3600))
-                               .build();
-
-        while (true) {
-            if (!thiz->shouldContinueDiscovery(evalCfg)) break;
-
-            android_net_context netcontext{};
-            thiz->mGetNetworkContextCallback(evalCfg.netId, 0, &netcontext);
-
-            // Prefix discovery must bypass private DNS because in strict mode
-            // the server generally won't know the NAT64 prefix.
-            netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
-            if (doRfc7050PrefixDiscovery(netcontext, &evalCfg)) {
-                thiz->recordDns64Config(evalCfg);
-                break;
-            }
-
-            if (!thiz->shouldContinueDiscovery(evalCfg)) break;
-
-            if (!backoff.hasNextTimeout()) break;
-            {
-                std::unique_lock<std::mutex> cvGuard(thiz->mMutex);
-                // TODO: Consider some chrono math, combined with wait_until()
-                // perhaps, to prevent early re-resolves from the removal of
-                // other netids with IPv6-only nameservers.
-                thiz->mCv.wait_for(cvGuard, backoff.getNextTimeout());
-            }
+        if (!thiz->shouldContinueDiscovery(evalCfg)) return;
+
+        android_net_context netcontext{};
+        thiz->mGetNetworkContextCallback(evalCfg.netId, 0, &netcontext);
+
+        // Prefix discovery must bypass private DNS because in strict mode
+        // the server generally won't know the NAT64 prefix.
+        netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
+        const bool race = Experiments::getInstance()->getFlag("dns64_parallel_discovery", 0) == 1;
+        if (race ? raceRfc7050PrefixDiscovery(netcontext, &evalCfg)
+                 : doRfc7050PrefixDiscovery(netcontext, &evalCfg)) {
+            thiz->recordDns64Config(evalCfg);
+            return;
         }
+
+        if (backoff->hasNextTimeout()) thiz->schedulePrefixDiscovery(cfg, backoff);
     });
     discovery_thread.detach();
 }
 
+void Dns64Configuration::schedulePrefixDiscovery(
+        const Dns64Config& cfg, std::shared_ptr<netdutils::BackoffSequence<>> backoff) {
+    std::lock_guard guard(mMutex);
+    if (!isDiscoveryInProgress(cfg)) return;
+    const sp<Dns64Configuration> thiz = this;
+    mDiscoveryRetries[cfg.netId] = TimerService::getInstance().schedule(
+            backoff->getNextTimeout(),
+            [thiz, cfg, backoff] { thiz->runPrefixDiscovery(cfg, backoff); });
+}
+
 void Dns64Configuration::stopPrefixDiscovery(unsigned netId) {
     std::lock_guard guard(mMutex);
     removeDns64Config(netId);
-    mCv.notify_all();
+    publishPrefixes();
 }
 
-IPPrefix Dns64Configuration::getPrefix64Locked(unsigned netId) const REQUIRES(mMutex) {
-    const auto& iter = mDns64Configs.find(netId);
-    if (iter != mDns64Configs.end()) return iter->second.prefix64;
+IPPrefix Dns64Configuration::getPrefix64(unsigned netId) const {
+    in6_addr prefix;
+    if (!getPrefix64(netId, &prefix)) return IPPrefix{};
+    return IPPrefix(IPAddress(prefix), 96);
+}
 
-    return IPPrefix{};
+bool Dns64Configuration::getPrefix64(unsigned netId, in6_addr* prefix) const {
+    const auto prefixes = std::atomic_load(&mPrefixes);
+    const auto iter = prefixes->find(netId);
+    if (iter == prefixes->end()) return false;
+    *prefix = iter->second;
+    return true;
 }
 
-IPPrefix Dns64Configuration::getPrefix64(unsigned netId) const {
-    std::lock_guard guard(mMutex);
-    return getPrefix64Locked(netId);
+void Dns64Configuration::publishPrefixes() {
+    auto prefixes = std::make_shared<std::unordered_map<unsigned, in6_addr>>();
+    for (const auto& [netId, cfg] : mDns64Configs) {
+        // Only /96 prefixes are discovered or can be set.
+        if (cfg.prefix64.length() == 96) prefixes->emplace(netId, cfg.prefix64.ip().v6());
+    }
+    std::atomic_store(&mPrefixes,
+                      std::shared_ptr<const std::unordered_map<unsigned, in6_addr>>(prefixes));
 }
 
 void Dns64Configuration::dump(DumpWriter& dw, unsigned netId) {
     static const char kLabel[] = "DNS64 config";
 
-    std::lock_guard guard(mMutex);
-
-    const auto& iter = mDns64Configs.find(netId);
-    if (iter == mDns64Configs.end()) {
+    // Copied, so that the lock isn't held while writing to the dump.
+    std::optional<Dns64Config> config;
+    {
+        std::lock_guard guard(mMutex);
+        const auto& iter = mDns64Configs.find(netId);
+        if (iter != mDns64Configs.end()) config.emplace(iter->second);
+    }
+    if (!config) {
         dw.println("%s: none", kLabel);
         return;
     }
 
-    const Dns64Config& cfg = iter->second;
+    const Dns64Config& cfg = *config;
     if (cfg.prefix64.length() == 0) {
         dw.println("%s: no prefix yet discovered", kLabel);
     } else {
         dw.println("%s: %s prefix %s", kLabel, cfg.isFromPrefixDiscovery() ? "discovered" : "set",
                    cfg.prefix64.toString().c_str());
+        if (cfg.isFromPrefixDiscovery()) {
+            dw.println("%s: discovered in %lld ms", kLabel,
+                       static_cast<long long>(cfg.discoveryLatency.count()));
+        }
     }
 }
 
@@ -192,6 +229,86 @@ bool Dns64Configuration::doRfc7050PrefixDiscovery(const android_net_context& net
     return true;
 }
 
+namespace {
+
+// The first AAAA record in the answer section of |answer|.
+std::optional<in6_addr> firstAaaaRecord(std::span<const uint8_t> answer) {
+    DnsMessageIndex index;
+    if (!index.parse(answer)) return std::nullopt;
+    for (const DnsMessageIndex::Record& rr : index.section(ns_s_an)) {
+        if (rr.type != ns_t_aaaa || rr.rclass != ns_c_in || rr.rdlen != sizeof(in6_addr)) continue;
+        in6_addr addr;
+        memcpy(&addr, index.rdata(rr).data(), sizeof(addr));
+        return addr;
+    }
+    return std::nullopt;
+}
+
+}  // namespace
+
+bool Dns64Configuration::raceRfc7050PrefixDiscovery(const android_net_context& netcontext,
+                                                    Dns64Config* cfg) {
+    std::vector<IPSockAddr> servers;
+    {
+        NetworkDnsEventReported event;
+        ResState res(&netcontext, &event);
+        resolv_populate_res_for_net(&res);
+        servers = res.nsaddrs;
+    }
+    if (servers.size() < 2) return doRfc7050PrefixDiscovery(netcontext, cfg);
+
+    LOG(WARNING) << "(" << cfg->netId << ", " << cfg->discoveryId << ") Detecting NAT64 prefix from "
+                 << servers.size() << " nameservers...";
+    std::vector<uint8_t> query(NS_PACKETSZ);
+    const int n = res_nmkquery(QUERY, kIPv4OnlyHost, ns_c_in, ns_t_aaaa, {}, query,
+                               netcontext.flags);
+    if (n <= 0) return false;
+    query.resize(n);
+
+    // Shared with the threads querying each server, which may outlive this call.
+    struct Race {
+        std::mutex lock;
+        std::condition_variable cv;
+        // Both guarded by |lock|.
+        size_t pending;
+        std::optional<in6_addr> prefix;
+    };
+    const auto race = std::make_shared<Race>();
+    race->pending = servers.size();
+    for (const IPSockAddr& server : servers) {
+        std::thread([race, netcontext, server, query] {
+            setThreadName(fmt::format("Nat64Pfx_{}", netcontext.dns_netid));
+            NetworkDnsEventReported event;
+            ResState res(&netcontext, &event);
+            res.pinned_server = server;
+            resolv_populate_res_for_net(&res);
+            std::vector<uint8_t> answer(MAXPACKET);
+            int rcode = 0;
+            // Each server must be asked, rather than the first answer be taken from the cache.
+            const int len = res_nsend(&res, query, answer, &rcode, ANDROID_RESOLV_NO_CACHE_STORE);
+            const std::optional<in6_addr> prefix =
+                    len > 0 ? firstAaaaRecord(std::span(answer).first(len)) : std::nullopt;
+            std::lock_guard guard(race->lock);
+            race->pending--;
+            if (prefix && !race->prefix) race->prefix = prefix;
+            race->cv.notify_all();
+        }).detach();
+    }
+
+    std::unique_lock guard(race->lock);
+    race->cv.wait(guard, [&] { return race->prefix || race->pending == 0; });
+    if (!race->prefix) {
+        LOG(WARNING) << "(" << cfg->netId << ", " << cfg->discoveryId << ") plat_prefix/dns("
+                     << kIPv4OnlyHost << ") no AAAA record from any nameserver";
+        return false;
+    }
+    // Only /96 DNS64 prefixes are supported at this time.
+    cfg->prefix64 = IPPrefix(IPAddress(*race->prefix), 96);
+    LOG(WARNING) << "(" << cfg->netId << ", " << cfg->discoveryId << ") Detected NAT64 prefix "
+                 << cfg->prefix64.toString();
+    return true;
+}
+
 bool Dns64Configuration::isDiscoveryInProgress(const Dns64Config& cfg) const REQUIRES(mMutex) {
     const auto& iter = mDns64Configs.find(cfg.netId);
     if (iter == mDns64Configs.end()) return false;
@@ -222,6 +339,11 @@ void Dns64Configuration::removeDns64Config(unsigned netId) REQUIRES(mMutex) {
 
     Dns64Config cfg = iter->second;
     mDns64Configs.erase(iter);
+    // A discovery waiting to retry is stopped.
+    if (const auto retry = mDiscoveryRetries.find(netId); retry != mDiscoveryRetries.end()) {
+        TimerService::getInstance().cancel(retry->second);
+        mDiscoveryRetries.erase(retry);
+    }
 
     // Only report a prefix removed event if the prefix was discovered, not if it was set.
     if (cfg.isFromPrefixDiscovery() && !cfg.prefix64.isUninitialized()) {
@@ -234,7 +356,12 @@ void Dns64Configuration::recordDns64Config(const Dns64Config& cfg) {
     if (!isDiscoveryInProgress(cfg)) return;
 
     removeDns64Config(cfg.netId);
-    mDns64Configs.emplace(std::make_pair(cfg.netId, cfg));
+    auto [iter, _] = mDns64Configs.emplace(std::make_pair(cfg.netId, cfg));
+    iter->second.discoveryLatency = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - cfg.started);
+    publishPrefixes();
+    LOG(INFO) << "(" << cfg.netId << ", " << cfg.discoveryId << ") NAT64 prefix discovered in "
+              << iter->second.discoveryLatency.count() << " ms";
 
     reportNat64PrefixStatus(cfg.netId, PREFIX_ADDED, cfg.prefix64);
 }
@@ -246,19 +373,24 @@ int Dns64Configuration::setPrefix64(unsigned netId, const IPPrefix& pfx) {
 
     std::lock_guard guard(mMutex);
 
-    // This method may only be called if prefix discovery has been stopped or was never started.
+    // This method may only be called if prefix discovery has been stopped or was never started,
+    // unless a prefix set from a Router Advertisement (RFC 8781) is preferred. Then it stops the
+    // discovery.
     auto iter = mDns64Configs.find(netId);
     if (iter != mDns64Configs.end()) {
-        if (iter->second.isFromPrefixDiscovery()) {
-            return -EEXIST;
-        } else {
+        if (!iter->second.isFromPrefixDiscovery()) {
             mDns64Configs.erase(iter);
+        } else if (Experiments::getInstance()->getFlag("dns64_ra_prefix_preferred", 0) == 1) {
+            removeDns64Config(netId);
+        } else {
+            return -EEXIST;
         }
     }
 
     Dns64Config cfg(kNoDiscoveryId, netId);
     cfg.prefix64 = pfx;
     mDns64Configs.emplace(std::make_pair(netId, cfg));
+    publishPrefixes();
 
     return 0;
 }
@@ -272,6 +404,7 @@ int Dns64Configuration::clearPrefix64(unsigned netId) {
     }
 
     mDns64Configs.erase(iter);
+    publishPrefixes();
 
     return 0;
 }
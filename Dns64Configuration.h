@@ -18,12 +18,14 @@
 #define DNS_DNS64CONFIGURATION_H_
 
 #include <netinet/in.h>
-#include <condition_variable>
+#include <chrono>
 #include <cstdlib>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
 
 #include <android-base/thread_annotations.h>
+#include <netdutils/BackoffSequence.h>
 #include <netdutils/DumpWriter.h>
 #include <netdutils/InternetAddresses.h>
 #include <utils/RefBase.h>
@@ -46,7 +48,8 @@ namespace net {
  * being reset.
  *
  * Thread-safety: All public methods in this class MUST be thread-safe.
- * (In other words: this class handles all its locking privately.)
+ * (In other words: this class handles all its locking privately.) The prefixes are read on every
+ * query that may be synthesized, so they're also published in a snapshot read without the lock.
  */
 class Dns64Configuration : virtual public RefBase {
   public:
@@ -82,6 +85,8 @@ class Dns64Configuration : virtual public RefBase {
     void startPrefixDiscovery(unsigned netId);
     void stopPrefixDiscovery(unsigned netId);
     netdutils::IPPrefix getPrefix64(unsigned netId) const;
+    // The /96 prefix of |netId|, if it has one, as synthesized addresses start with.
+    bool getPrefix64(unsigned netId, in6_addr* prefix) const;
 
     int setPrefix64(unsigned netId, const netdutils::IPPrefix& pfx) EXCLUDES(mMutex);
     int clearPrefix64(unsigned netId) EXCLUDES(mMutex);
@@ -98,6 +103,9 @@ class Dns64Configuration : virtual public RefBase {
         const unsigned int discoveryId;
         const unsigned int netId;
         netdutils::IPPrefix prefix64{};
+        const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        // From |started| until the prefix was discovered, retries included.
+        std::chrono::milliseconds discoveryLatency{};
 
         bool isFromPrefixDiscovery() const { return discoveryId != kNoDiscoveryId; }
     };
@@ -107,23 +115,39 @@ class Dns64Configuration : virtual public RefBase {
     enum { PREFIX_REMOVED, PREFIX_ADDED };
 
     static bool doRfc7050PrefixDiscovery(const android_net_context& netcontext, Dns64Config* cfg);
+    // Same as above, but queries all the nameservers of the network at once, and takes the first
+    // prefix any of them answers with.
+    static bool raceRfc7050PrefixDiscovery(const android_net_context& netcontext,
+                                           Dns64Config* cfg);
 
     // Picks the next discovery ID. Never returns kNoDiscoveryId.
     unsigned getNextId() REQUIRES(mMutex) { return ++mNextId ? mNextId : ++mNextId; }
 
-    netdutils::IPPrefix getPrefix64Locked(unsigned netId) const REQUIRES(mMutex);
+    // Publishes the prefixes in mDns64Configs to mPrefixes. Called whenever they change.
+    void publishPrefixes() REQUIRES(mMutex);
     bool isDiscoveryInProgress(const Dns64Config& cfg) const REQUIRES(mMutex);
     bool reportNat64PrefixStatus(unsigned netId, bool added, const netdutils::IPPrefix& pfx)
             REQUIRES(mMutex);
 
+    // Runs a discovery attempt for |cfg| on a thread of its own. If it fails, the next attempt is
+    // scheduled on the TimerService after the next timeout of |backoff|, with no thread waiting.
+    void runPrefixDiscovery(const Dns64Config& cfg,
+                            std::shared_ptr<netdutils::BackoffSequence<>> backoff);
+    void schedulePrefixDiscovery(const Dns64Config& cfg,
+                                 std::shared_ptr<netdutils::BackoffSequence<>> backoff)
+            EXCLUDES(mMutex);
     bool shouldContinueDiscovery(const Dns64Config& cfg);
     void recordDns64Config(const Dns64Config& cfg);
     void removeDns64Config(unsigned netId) REQUIRES(mMutex);
 
     mutable std::mutex mMutex;
-    std::condition_variable mCv;
     unsigned int mNextId GUARDED_BY(mMutex);
     std::unordered_map<unsigned, Dns64Config> mDns64Configs GUARDED_BY(mMutex);
+    // The TimerService timer of the next attempt of each discovery that failed.
+    std::unordered_map<unsigned, uint64_t> mDiscoveryRetries GUARDED_BY(mMutex);
+    // Accessed with std::atomic_load() and std::atomic_store().
+    std::shared_ptr<const std::unordered_map<unsigned, in6_addr>> mPrefixes =
+            std::make_shared<const std::unordered_map<unsigned, in6_addr>>();
     const GetNetworkContextCallback mGetNetworkContextCallback;
     const Nat64PrefixCallback mPrefixCallback;
 };
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Dns64Synthesis.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+
+namespace android::net {
+
+namespace {
+
+void synthesize(const in6_addr& prefix, in_addr addr, in6_addr* out) {
+    *out = prefix;
+    out->s6_addr32[3] = addr.s_addr;
+}
+
+// Undoes synthesizeNat64() on the addresses from |first| to just before |last|.
+void restore(addrinfo* first, const addrinfo* last) {
+    for (addrinfo* ai = first; ai != last; ai = ai->ai_next) {
+        const sockaddr_in6 sin6 = *reinterpret_cast<sockaddr_in6*>(ai->ai_addr);
+        sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(ai->ai_addr);
+        memset(ai->ai_addr, 0, sizeof(sockaddr_in6));
+        sin->sin_family = AF_INET;
+        sin->sin_port = sin6.sin6_port;
+        sin->sin_addr.s_addr = sin6.sin6_addr.s6_addr32[3];
+        ai->ai_addrlen = sizeof(sockaddr_in);
+        ai->ai_family = AF_INET;
+    }
+}
+
+}  // namespace
+
+bool isSpecialUseIPv4Address(const in_addr& ia) {
+    const uint32_t addr = ntohl(ia.s_addr);
+
+    // Only check necessary IP ranges in RFC 5735 section 4
+    return ((addr & 0xff000000) == 0x00000000) ||  // "This" Network
+           ((addr & 0xff000000) == 0x7f000000) ||  // Loopback
+           ((addr & 0xffff0000) == 0xa9fe0000) ||  // Link Local
+           ((addr & 0xf0000000) == 0xe0000000) ||  // Multicast
+           (addr == INADDR_BROADCAST);             // Limited Broadcast
+}
+
+// Both of these rewrite each address as they check it, since answers that can't be synthesized
+// are rare, and undo what they've done if they find one.
+bool synthesizeNat64(const in6_addr& prefix, addrinfo* result) {
+    if (result == nullptr) return false;
+    for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+        if (ai->ai_family != AF_INET) {
+            restore(result, ai);
+            return false;
+        }
+        const sockaddr_in sin = *reinterpret_cast<sockaddr_in*>(ai->ai_addr);
+        if (isSpecialUseIPv4Address(sin.sin_addr)) {
+            restore(result, ai);
+            return false;
+        }
+        sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(ai->ai_addr);
+        memset(sin6, 0, sizeof(*sin6));
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = sin.sin_port;
+        synthesize(prefix, sin.sin_addr, &sin6->sin6_addr);
+        ai->ai_addrlen = sizeof(*sin6);
+        ai->ai_family = AF_INET6;
+    }
+    return true;
+}
+
+bool synthesizeNat64(const in6_addr& prefix, hostent* hp) {
+    if (hp == nullptr || hp->h_addrtype != AF_INET) return false;
+    for (int i = 0; hp->h_addr_list[i] != nullptr; i++) {
+        const in_addr addr = *reinterpret_cast<in_addr*>(hp->h_addr_list[i]);
+        if (isSpecialUseIPv4Address(addr)) {
+            for (int j = 0; j < i; j++) {
+                // The IPv4 address is the last 4 bytes of the synthesized one.
+                memmove(hp->h_addr_list[j], hp->h_addr_list[j] + 12, sizeof(in_addr));
+            }
+            return false;
+        }
+        synthesize(prefix, addr, reinterpret_cast<in6_addr*>(hp->h_addr_list[i]));
+    }
+    hp->h_addrtype = AF_INET6;
+    hp->h_length = sizeof(in6_addr);
+    return true;
+}
+
+}  // namespace android::net
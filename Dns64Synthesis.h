@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netdb.h>
+#include <netinet/in.h>
+
+namespace android::net {
+
+// Whether |addr| is in one of the special-use ranges of RFC 5735 section 4 that aren't reached
+// through NAT64, so answers containing it aren't synthesized.
+bool isSpecialUseIPv4Address(const in_addr& addr);
+
+// Rewrites the IPv4 addresses in |result| in place as IPv6 addresses in the /96 NAT64 |prefix|
+// (RFC 6052). Returns false, leaving |result| as it was, if any of them is special-use or isn't
+// IPv4. The addresses have room for an IPv6 address: get_ai() and AddrInfoBuilder reserve it.
+bool synthesizeNat64(const in6_addr& prefix, addrinfo* result);
+
+// As above, for the addresses of |hp|, for which gethnamaddr.cpp and sethostent.cpp reserve the
+// room.
+bool synthesizeNat64(const in6_addr& prefix, hostent* hp);
+
+}  // namespace android::net
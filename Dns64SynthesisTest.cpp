@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Dns64Synthesis.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class Dns64SynthesisTest : public ResolvTestBase {
+  protected:
+    void SetUp() override { ASSERT_EQ(1, inet_pton(AF_INET6, "64:ff9b::", &mPrefix)); }
+
+    // An addrinfo chain of |addrs|, each with room for an IPv6 address as get_ai() leaves.
+    struct Chain {
+        struct Node {
+            addrinfo ai;
+            sockaddr_in6 addr;
+        };
+        std::vector<Node> nodes;
+
+        explicit Chain(const std::vector<std::string>& addrs) : nodes(addrs.size()) {
+            for (size_t i = 0; i < addrs.size(); i++) {
+                Node& node = nodes[i];
+                node.ai.ai_next = i + 1 < addrs.size() ? &nodes[i + 1].ai : nullptr;
+                node.ai.ai_addr = reinterpret_cast<sockaddr*>(&node.addr);
+                sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&node.addr);
+                if (inet_pton(AF_INET, addrs[i].c_str(), &sin->sin_addr) == 1) {
+                    sin->sin_family = node.ai.ai_family = AF_INET;
+                    sin->sin_port = htons(80);
+                    node.ai.ai_addrlen = sizeof(sockaddr_in);
+                } else {
+                    EXPECT_EQ(1, inet_pton(AF_INET6, addrs[i].c_str(), &node.addr.sin6_addr));
+                    node.addr.sin6_family = node.ai.ai_family = AF_INET6;
+                    node.ai.ai_addrlen = sizeof(sockaddr_in6);
+                }
+            }
+        }
+        addrinfo* get() { return &nodes[0].ai; }
+    };
+
+    static std::vector<std::string> addresses(const addrinfo* ai) {
+        std::vector<std::string> result;
+        for (; ai; ai = ai->ai_next) {
+            char buf[INET6_ADDRSTRLEN];
+            const sockaddr* sa = ai->ai_addr;
+            const void* addr =
+                    ai->ai_family == AF_INET
+                            ? static_cast<const void*>(
+                                      &reinterpret_cast<const sockaddr_in*>(sa)->sin_addr)
+                            : &reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr;
+            EXPECT_EQ(ai->ai_family, sa->sa_family);
+            EXPECT_EQ(ai->ai_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6),
+                      ai->ai_addrlen);
+            result.push_back(inet_ntop(ai->ai_family, addr, buf, sizeof(buf)));
+        }
+        return result;
+    }
+
+    in6_addr mPrefix;
+};
+
+TEST_F(Dns64SynthesisTest, AddrInfo) {
+    Chain chain({"192.0.2.1", "198.51.100.7"});
+    ASSERT_TRUE(synthesizeNat64(mPrefix, chain.get()));
+    EXPECT_EQ((std::vector<std::string>{"64:ff9b::c000:201", "64:ff9b::c633:6407"}),
+              addresses(chain.get()));
+    EXPECT_EQ(htons(80), chain.nodes[1].addr.sin6_port);
+
+    EXPECT_FALSE(synthesizeNat64(mPrefix, static_cast<addrinfo*>(nullptr)));
+}
+
+TEST_F(Dns64SynthesisTest, AddrInfoLeftAlone) {
+    // The loopback address, or an IPv6 one, anywhere in the chain stops the synthesis, and the
+    // addresses rewritten before it are restored.
+    for (const char* other : {"127.0.0.1", "0.1.2.3", "169.254.1.1", "224.0.0.1",
+                              "255.255.255.255", "2001:db8::1"}) {
+        SCOPED_TRACE(other);
+        const std::vector<std::string> addrs = {"192.0.2.1", "198.51.100.7", other};
+        Chain chain(addrs);
+        const Chain before(addrs);
+        EXPECT_FALSE(synthesizeNat64(mPrefix, chain.get()));
+        EXPECT_EQ(addrs, addresses(chain.get()));
+        EXPECT_EQ(0, memcmp(&before.nodes[0].addr, &chain.nodes[0].addr, sizeof(sockaddr_in)));
+        EXPECT_EQ(htons(80), reinterpret_cast<sockaddr_in*>(&chain.nodes[1].addr)->sin_port);
+    }
+}
+
+TEST_F(Dns64SynthesisTest, HostEnt) {
+    in6_addr storage[3] = {};
+    char* list[4] = {};
+    const char* const addrs[] = {"192.0.2.1", "198.51.100.7", "127.0.0.1"};
+    hostent hp = {.h_addrtype = AF_INET, .h_length = sizeof(in_addr), .h_addr_list = list};
+    for (size_t i = 0; i < std::size(addrs); i++) {
+        list[i] = reinterpret_cast<char*>(&storage[i]);
+        ASSERT_EQ(1, inet_pton(AF_INET, addrs[i], list[i]));
+    }
+
+    EXPECT_FALSE(synthesizeNat64(mPrefix, &hp));
+    EXPECT_EQ(AF_INET, hp.h_addrtype);
+    char buf[INET6_ADDRSTRLEN];
+    for (size_t i = 0; i < std::size(addrs); i++) {
+        EXPECT_STREQ(addrs[i], inet_ntop(AF_INET, list[i], buf, sizeof(buf)));
+    }
+
+    list[2] = nullptr;
+    ASSERT_TRUE(synthesizeNat64(mPrefix, &hp));
+    EXPECT_EQ(AF_INET6, hp.h_addrtype);
+    EXPECT_EQ(static_cast<int>(sizeof(in6_addr)), hp.h_length);
+    EXPECT_STREQ("64:ff9b::c000:201", inet_ntop(AF_INET6, list[0], buf, sizeof(buf)));
+    EXPECT_STREQ("64:ff9b::c633:6407", inet_ntop(AF_INET6, list[1], buf, sizeof(buf)));
+
+    // Already IPv6.
+    EXPECT_FALSE(synthesizeNat64(mPrefix, &hp));
+}
+
+}  // namespace android::net
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsEventArena.h"
+
+#include <google/protobuf/arena.h>
+
+namespace android::net {
+
+namespace {
+
+// Room for an event with a handful of queries and their stage timings.
+constexpr size_t kInitialBlockSize = 4096;
+
+struct ThreadArena {
+    ThreadArena() : arena(options(block)) {}
+
+    static google::protobuf::ArenaOptions options(char* initialBlock) {
+        google::protobuf::ArenaOptions options;
+        options.initial_block = initialBlock;
+        options.initial_block_size = kInitialBlockSize;
+        return options;
+    }
+
+    // Declared before |arena|, which is made in it.
+    alignas(8) char block[kInitialBlockSize];
+    google::protobuf::Arena arena;
+    // The events of this thread made in |arena| that are still alive.
+    int events = 0;
+};
+
+thread_local ThreadArena tArena;
+
+}  // namespace
+
+ScopedDnsEvent::ScopedDnsEvent()
+    : mEvent(google::protobuf::Arena::CreateMessage<NetworkDnsEventReported>(&tArena.arena)) {
+    tArena.events++;
+}
+
+ScopedDnsEvent::~ScopedDnsEvent() {
+    // The event itself is destroyed along with the arena, without freeing anything.
+    if (--tArena.events == 0) tArena.arena.Reset();
+}
+
+uint64_t ScopedDnsEvent::heapBytes() {
+    const uint64_t allocated = tArena.arena.SpaceAllocated();
+    return allocated > kInitialBlockSize ? allocated - kInitialBlockSize : 0;
+}
+
+}  // namespace android::net
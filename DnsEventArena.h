@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "stats.pb.h"
+
+namespace android::net {
+
+// The NetworkDnsEventReported of a lookup, made in a protobuf arena of the thread handling the
+// lookup. The arena keeps its first block from one lookup to the next, so that an event that fits
+// in it, as most do, is built without any heap allocation. The arena is reset once the last event
+// of the thread is destroyed, so an event must be destroyed on the thread that made it, and
+// nothing that refers to its contents may outlive it.
+class ScopedDnsEvent {
+  public:
+    ScopedDnsEvent();
+    ~ScopedDnsEvent();
+    ScopedDnsEvent(const ScopedDnsEvent&) = delete;
+    ScopedDnsEvent& operator=(const ScopedDnsEvent&) = delete;
+
+    NetworkDnsEventReported* get() const { return mEvent; }
+    NetworkDnsEventReported& operator*() const { return *mEvent; }
+    NetworkDnsEventReported* operator->() const { return mEvent; }
+
+    // For testing.
+    // The bytes the arena of this thread has taken from the heap since it was last reset.
+    static uint64_t heapBytes();
+
+  private:
+    NetworkDnsEventReported* const mEvent;
+};
+
+}  // namespace android::net
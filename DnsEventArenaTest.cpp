@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "DnsEventArena.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class DnsEventArenaTest : public ResolvTestBase {};
+
+namespace {
+
+void addQueries(NetworkDnsEventReported* event, int count) {
+    for (int i = 0; i < count; i++) {
+        DnsQueryEvent* query = event->mutable_dns_query_events()->add_dns_query_event();
+        query->set_latency_micros(i);
+        query->set_cache_hit(CS_FOUND);
+    }
+}
+
+}  // namespace
+
+TEST_F(DnsEventArenaTest, SmallEventsStayOffTheHeap) {
+    for (int i = 0; i < 100; i++) {
+        ScopedDnsEvent event;
+        event->set_latency_micros(i);
+        addQueries(event.get(), 3);
+        EXPECT_EQ(3, event->dns_query_events().dns_query_event_size());
+        EXPECT_EQ(0U, ScopedDnsEvent::heapBytes());
+    }
+}
+
+TEST_F(DnsEventArenaTest, ResetOnceTheLastEventIsGone) {
+    {
+        ScopedDnsEvent outer;
+        {
+            ScopedDnsEvent inner;
+            addQueries(inner.get(), 500);
+            EXPECT_LT(0U, ScopedDnsEvent::heapBytes());
+        }
+        // |outer| is still there, and so is what |inner| took.
+        addQueries(outer.get(), 1);
+        EXPECT_EQ(1, outer->dns_query_events().dns_query_event_size());
+        EXPECT_LT(0U, ScopedDnsEvent::heapBytes());
+    }
+    ScopedDnsEvent event;
+    EXPECT_EQ(0U, ScopedDnsEvent::heapBytes());
+}
+
+TEST_F(DnsEventArenaTest, MergeFromAnotherArena) {
+    NetworkDnsEventReported onHeap;
+    addQueries(&onHeap, 2);
+    ScopedDnsEvent event;
+    event->MergeFrom(onHeap);
+    EXPECT_EQ(2, event->dns_query_events().dns_query_event_size());
+}
+
+}  // namespace android::net
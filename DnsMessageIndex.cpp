@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsMessageIndex.h"
+
+#include <algorithm>
+#include <optional>
+#include <utility>
+
+#include "res_comp.h"
+
+namespace android::net {
+
+namespace {
+
+// The smallest question and resource record: a root name and the fixed fields.
+constexpr size_t kMinQuestionSize = 1 + 2 * NS_INT16SZ;
+constexpr size_t kMinRecordSize = 1 + 3 * NS_INT16SZ + NS_INT32SZ;
+
+uint16_t get16(std::span<const uint8_t> msg, size_t offset) {
+    return (msg[offset] << 8) | msg[offset + 1];
+}
+
+uint32_t get32(std::span<const uint8_t> msg, size_t offset) {
+    return (uint32_t{get16(msg, offset)} << 16) | get16(msg, offset + 2);
+}
+
+// Returns the offset just past the name at |offset| where it's written, or 0 if the name is
+// malformed. Compression pointers are followed to check the whole name; like dn_expand(), a name
+// that takes more steps than the message has bytes is a loop.
+size_t checkName(std::span<const uint8_t> msg, size_t offset) {
+    size_t end = 0;
+    size_t length = 1;  // In wire format, with the root label.
+    size_t checked = 0;
+    for (size_t p = offset; p < msg.size();) {
+        const uint8_t n = msg[p];
+        if ((n & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+            if (msg.size() - p < NS_INT16SZ) return 0;
+            if (end == 0) end = p + NS_INT16SZ;
+            p = get16(msg, p) & ~(NS_CMPRSFLGS << 8);
+            checked += NS_INT16SZ;
+            if (checked >= msg.size()) return 0;
+        } else if ((n & NS_CMPRSFLGS) != 0) {
+            // The extended label types are obsolete.
+            return 0;
+        } else if (n == 0) {
+            return end != 0 ? end : p + 1;
+        } else {
+            length += n + 1;
+            if (length > NS_MAXCDNAME || msg.size() - p <= n) return 0;
+            p += n + 1;
+            checked += n + 1;
+        }
+    }
+    return 0;
+}
+
+}  // namespace
+
+bool DnsMessageIndex::parse(std::span<const uint8_t> msg) {
+    mMsg = {};
+    mSectionStart = {};
+    mOverflow.clear();
+    if (msg.size() < NS_HFIXEDSZ || msg.size() > UINT16_MAX) return false;
+
+    std::array<size_t, ns_s_max> counts;
+    size_t total = 0;
+    for (int sect = ns_s_qd; sect < ns_s_max; sect++) {
+        counts[sect] = get16(msg, 4 + sect * NS_INT16SZ);
+        total += counts[sect];
+    }
+    // Counts that can't possibly fit must not make us allocate.
+    if (counts[ns_s_qd] * kMinQuestionSize + (total - counts[ns_s_qd]) * kMinRecordSize >
+        msg.size() - NS_HFIXEDSZ) {
+        return false;
+    }
+    if (total > kInlineRecords) mOverflow.resize(total);
+    Record* const out = total > kInlineRecords ? mOverflow.data() : mInline.data();
+
+    size_t p = NS_HFIXEDSZ;
+    uint32_t i = 0;
+    for (int sect = ns_s_qd; sect < ns_s_max; sect++) {
+        mSectionStart[sect] = i;
+        for (size_t n = 0; n < counts[sect]; n++, i++) {
+            Record& rr = out[i];
+            rr.nameOffset = p;
+            p = checkName(msg, p);
+            const size_t fixed = sect == ns_s_qd ? 2 * NS_INT16SZ : 3 * NS_INT16SZ + NS_INT32SZ;
+            if (p == 0 || msg.size() - p < fixed) {
+                mOverflow.clear();
+                return false;
+            }
+            rr.type = get16(msg, p);
+            rr.rclass = get16(msg, p + NS_INT16SZ);
+            rr.ttl = sect == ns_s_qd ? 0 : get32(msg, p + 2 * NS_INT16SZ);
+            rr.rdlen = sect == ns_s_qd ? 0 : get16(msg, p + 2 * NS_INT16SZ + NS_INT32SZ);
+            p += fixed;
+            rr.rdataOffset = p;
+            if (msg.size() - p < rr.rdlen) {
+                mOverflow.clear();
+                return false;
+            }
+            p += rr.rdlen;
+        }
+    }
+    if (p != msg.size()) {
+        mOverflow.clear();
+        return false;
+    }
+    mSectionStart[ns_s_max] = i;
+    mMsg = msg;
+    return true;
+}
+
+int DnsMessageIndex::getFlag(ns_flag flag) const {
+    // The mask and shift of each field of the second header word, in ns_flag order.
+    static constexpr std::pair<uint16_t, int> kFields[ns_f_max] = {
+            {0x8000, 15}, {0x7800, 11}, {0x0400, 10}, {0x0200, 9}, {0x0100, 8},
+            {0x0080, 7},  {0x0040, 6},  {0x0020, 5},  {0x0010, 4}, {0x000f, 0},
+    };
+    if (mMsg.empty() || flag < 0 || flag >= ns_f_max) return 0;
+    const auto [mask, shift] = kFields[flag];
+    return (get16(mMsg, NS_INT16SZ) & mask) >> shift;
+}
+
+std::span<const DnsMessageIndex::Record> DnsMessageIndex::section(ns_sect sect) const {
+    // Before a successful parse(), every section starts and ends at 0.
+    const uint32_t start = mSectionStart[sect];
+    const uint32_t end = mMsg.empty() ? start : mSectionStart[sect + 1];
+    return {records() + start, end - start};
+}
+
+bool DnsMessageIndex::expandName(size_t offset, char* buf, size_t len) const {
+    if (offset >= mMsg.size()) return false;
+    return dn_expand(mMsg.data(), mMsg.data() + mMsg.size(), mMsg.data() + offset, buf,
+                     static_cast<int>(len)) >= 0;
+}
+
+uint32_t DnsMessageIndex::negativeTtl() const {
+    std::optional<uint32_t> result;
+    for (const Record& rr : section(ns_s_ns)) {
+        if (rr.type != ns_t_soa) continue;
+        // Skip the server and admin names to the serial number, refresh interval, retry
+        // interval, expiry and MINIMUM-TTL fields.
+        const size_t end = DnsMessageIndex::end(rr);
+        size_t p = checkName(mMsg, rr.rdataOffset);
+        if (p != 0 && p <= end) p = checkName(mMsg, p);
+        if (p == 0 || p > end || end - p != 5 * NS_INT32SZ) continue;
+        const uint32_t minimum = get32(mMsg, p + 4 * NS_INT32SZ);
+        result = std::min({result.value_or(UINT32_MAX), rr.ttl, minimum});
+    }
+    return result.value_or(0);
+}
+
+uint32_t DnsMessageIndex::cacheTtl() const {
+    const auto answers = section(ns_s_an);
+    if (answers.empty()) return negativeTtl();
+    uint32_t result = UINT32_MAX;
+    for (const Record& rr : answers) result = std::min(result, rr.ttl);
+    return result;
+}
+
+}  // namespace android::net
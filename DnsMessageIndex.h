@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <arpa/nameser.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <span>
+#include <vector>
+
+namespace android::net {
+
+// The records of a DNS message, found in a single bounds-checked pass that doesn't expand any
+// name. Built once per message, it replaces ns_initparse() and the ns_parserr() calls that expand
+// the owner name of every record they return. Messages of up to kInlineRecords records are
+// indexed without allocating.
+//
+// The index refers to the message, which must outlive it and not be resized.
+class DnsMessageIndex {
+  public:
+    // A question or resource record. Offsets are from the start of the message.
+    struct Record {
+        uint16_t nameOffset;
+        uint16_t type;
+        uint16_t rclass;
+        // 0 for questions, which have no RDATA either: |rdataOffset| is where the question ends.
+        uint32_t ttl;
+        uint16_t rdataOffset;
+        uint16_t rdlen;
+    };
+
+    static constexpr size_t kInlineRecords = 32;
+
+    // Indexes |msg|. Returns false, leaving the index empty, if it isn't a well-formed message:
+    // a record or name runs past its end, a name is too long or loops, or bytes follow the last
+    // record. That is as strict as ns_initparse() and dn_expand() together.
+    bool parse(std::span<const uint8_t> msg);
+
+    std::span<const uint8_t> message() const { return mMsg; }
+    // Returns a field of the header, as ns_msg_getflag() does.
+    int getFlag(ns_flag flag) const;
+
+    // Returns the records of |sect|, one of ns_s_qd, ns_s_an, ns_s_ns or ns_s_ar, in order.
+    std::span<const Record> section(ns_sect sect) const;
+    std::span<const uint8_t> rdata(const Record& rr) const {
+        return mMsg.subspan(rr.rdataOffset, rr.rdlen);
+    }
+    // The offset just past |rr|, which is where the next record starts.
+    static size_t end(const Record& rr) { return rr.rdataOffset + rr.rdlen; }
+
+    // Expands the name at |offset| to text, as dn_expand() does. Returns false if |buf| is too
+    // small.
+    bool expandName(size_t offset, char* buf, size_t len) const;
+
+    // The negative TTL of an answer: the lowest of the TTLs and MINIMUM fields of the SOA records
+    // in its authority section (RFC 2308 section 5). Returns 0 if there's none.
+    uint32_t negativeTtl() const;
+    // How long the answer may be cached: the lowest TTL of its answer records if it has any, else
+    // its negative TTL. Returns 0 if it can't be cached.
+    uint32_t cacheTtl() const;
+
+  private:
+    const Record* records() const { return mOverflow.empty() ? mInline.data() : mOverflow.data(); }
+
+    std::span<const uint8_t> mMsg;
+    // Where each section starts in the records, and where the last ends.
+    std::array<uint32_t, ns_s_max + 1> mSectionStart = {};
+    std::array<Record, kInlineRecords> mInline;
+    std::vector<Record> mOverflow;
+};
+
+}  // namespace android::net
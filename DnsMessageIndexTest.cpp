@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/nameser.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsMessageIndex.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class DnsMessageIndexTest : public ResolvTestBase {
+  protected:
+    // Builds messages record by record. Names are in wire format.
+    struct Message {
+        std::vector<uint8_t> bytes = std::vector<uint8_t>(NS_HFIXEDSZ);
+
+        Message& header(uint16_t flags, uint16_t qd, uint16_t an, uint16_t ns, uint16_t ar) {
+            // The ID is left 0.
+            const uint16_t words[] = {flags, qd, an, ns, ar};
+            for (size_t i = 0; i < std::size(words); i++) {
+                bytes[NS_INT16SZ * (i + 1)] = words[i] >> 8;
+                bytes[NS_INT16SZ * (i + 1) + 1] = words[i] & 0xff;
+            }
+            return *this;
+        }
+        Message& put16(uint16_t value) {
+            bytes.push_back(value >> 8);
+            bytes.push_back(value & 0xff);
+            return *this;
+        }
+        Message& put32(uint32_t value) { return put16(value >> 16).put16(value & 0xffff); }
+        Message& name(const std::string& wire) {
+            bytes.insert(bytes.end(), wire.begin(), wire.end());
+            return *this;
+        }
+        Message& question(const std::string& wire, uint16_t type) {
+            return name(wire).put16(type).put16(ns_c_in);
+        }
+        Message& record(const std::string& wire, uint16_t type, uint32_t ttl,
+                        const std::vector<uint8_t>& rdata) {
+            name(wire).put16(type).put16(ns_c_in).put32(ttl).put16(rdata.size());
+            bytes.insert(bytes.end(), rdata.begin(), rdata.end());
+            return *this;
+        }
+    };
+
+    // "hello.example.com", and a pointer to it as written right after the header.
+    static inline const std::string kHello = std::string("\5hello\7example\3com\0", 19);
+    static inline const std::string kPointer = std::string("\xc0\x0c", 2);
+
+    static std::vector<uint8_t> soa(uint32_t minimum) {
+        Message rdata;
+        rdata.bytes.clear();
+        rdata.name(kPointer).name(kPointer);
+        for (uint32_t value : {1U, 2U, 3U, 4U}) rdata.put32(value);
+        rdata.put32(minimum);
+        return rdata.bytes;
+    }
+};
+
+TEST_F(DnsMessageIndexTest, Parse) {
+    Message msg;
+    msg.header(0x8180, 1, 2, 0, 1)
+            .question(kHello, ns_t_a)
+            .record(kPointer, ns_t_cname, 300, {3, 'w', 'w', 'w', 0xc0, 0x0c})
+            .record(std::string("\3www\xc0\x0c", 6), ns_t_a, 60, {192, 0, 2, 1})
+            .record(std::string(1, '\0'), ns_t_opt, 0, {});
+
+    DnsMessageIndex index;
+    ASSERT_TRUE(index.parse(msg.bytes));
+    EXPECT_EQ(ns_r_noerror, index.getFlag(ns_f_rcode));
+    EXPECT_EQ(1, index.getFlag(ns_f_rd));
+    EXPECT_EQ(0, index.getFlag(ns_f_tc));
+
+    ASSERT_EQ(1U, index.section(ns_s_qd).size());
+    const DnsMessageIndex::Record& question = index.section(ns_s_qd)[0];
+    EXPECT_EQ(NS_HFIXEDSZ, question.nameOffset);
+    EXPECT_EQ(ns_t_a, question.type);
+    EXPECT_EQ(NS_HFIXEDSZ + kHello.size() + 4, DnsMessageIndex::end(question));
+
+    const auto answers = index.section(ns_s_an);
+    ASSERT_EQ(2U, answers.size());
+    EXPECT_EQ(DnsMessageIndex::end(question), answers[0].nameOffset);
+    EXPECT_EQ(ns_t_cname, answers[0].type);
+    EXPECT_EQ(300U, answers[0].ttl);
+    EXPECT_EQ(DnsMessageIndex::end(answers[0]), answers[1].nameOffset);
+    const auto rdata = index.rdata(answers[1]);
+    EXPECT_EQ((std::vector<uint8_t>{192, 0, 2, 1}),
+              std::vector<uint8_t>(rdata.begin(), rdata.end()));
+    EXPECT_TRUE(index.section(ns_s_ns).empty());
+    ASSERT_EQ(1U, index.section(ns_s_ar).size());
+    EXPECT_EQ(ns_t_opt, index.section(ns_s_ar)[0].type);
+
+    char name[NS_MAXDNAME];
+    ASSERT_TRUE(index.expandName(answers[1].nameOffset, name, sizeof(name)));
+    EXPECT_STREQ("www.hello.example.com", name);
+    ASSERT_TRUE(index.expandName(answers[0].rdataOffset, name, sizeof(name)));
+    EXPECT_STREQ("www.hello.example.com", name);
+    EXPECT_FALSE(index.expandName(answers[1].nameOffset, name, 4));
+
+    EXPECT_EQ(60U, index.cacheTtl());
+}
+
+TEST_F(DnsMessageIndexTest, ManyRecords) {
+    constexpr int kRecords = DnsMessageIndex::kInlineRecords * 2;
+    Message msg;
+    msg.header(0x8180, 1, kRecords, 0, 0).question(kHello, ns_t_a);
+    for (int i = 0; i < kRecords; i++) {
+        msg.record(kPointer, ns_t_a, 1000 - i, {192, 0, 2, static_cast<uint8_t>(i)});
+    }
+
+    DnsMessageIndex index;
+    ASSERT_TRUE(index.parse(msg.bytes));
+    const auto answers = index.section(ns_s_an);
+    ASSERT_EQ(static_cast<size_t>(kRecords), answers.size());
+    EXPECT_EQ(kRecords - 1, index.rdata(answers.back())[3]);
+    EXPECT_EQ(1001U - kRecords, index.cacheTtl());
+
+    // Parsing again reuses the index.
+    Message small;
+    small.header(0x8180, 1, 0, 0, 0).question(kHello, ns_t_a);
+    ASSERT_TRUE(index.parse(small.bytes));
+    EXPECT_EQ(1U, index.section(ns_s_qd).size());
+    EXPECT_TRUE(index.section(ns_s_an).empty());
+}
+
+TEST_F(DnsMessageIndexTest, NegativeTtl) {
+    Message msg;
+    msg.header(0x8183, 1, 0, 3, 0)
+            .question(kHello, ns_t_a)
+            .record(kPointer, ns_t_ns, 10, {0xc0, 0x0c})
+            .record(kPointer, ns_t_soa, 900, soa(600))
+            .record(kPointer, ns_t_soa, 500, soa(700));
+
+    DnsMessageIndex index;
+    ASSERT_TRUE(index.parse(msg.bytes));
+    EXPECT_EQ(ns_r_nxdomain, index.getFlag(ns_f_rcode));
+    // The lowest of every TTL and MINIMUM field, even when the first record isn't an SOA.
+    EXPECT_EQ(500U, index.negativeTtl());
+    EXPECT_EQ(500U, index.cacheTtl());
+
+    // A malformed SOA record doesn't count.
+    std::vector<uint8_t> bad = soa(100);
+    bad.pop_back();
+    Message malformed;
+    malformed.header(0x8183, 1, 0, 1, 0)
+            .question(kHello, ns_t_a)
+            .record(kPointer, ns_t_soa, 900, bad);
+    ASSERT_TRUE(index.parse(malformed.bytes));
+    EXPECT_EQ(0U, index.cacheTtl());
+}
+
+TEST_F(DnsMessageIndexTest, Malformed) {
+    Message good;
+    good.header(0x8180, 1, 1, 0, 0)
+            .question(kHello, ns_t_a)
+            .record(kPointer, ns_t_a, 60, {192, 0, 2, 1});
+    DnsMessageIndex index;
+    ASSERT_TRUE(index.parse(good.bytes));
+
+    auto parses = [&](std::vector<uint8_t> bytes) {
+        const bool ok = index.parse(bytes);
+        if (!ok) {
+            EXPECT_TRUE(index.message().empty());
+            EXPECT_TRUE(index.section(ns_s_qd).empty());
+            EXPECT_TRUE(index.section(ns_s_an).empty());
+            EXPECT_EQ(0, index.getFlag(ns_f_rcode));
+        }
+        return ok;
+    };
+
+    EXPECT_FALSE(parses({}));
+    EXPECT_FALSE(parses(std::vector<uint8_t>(NS_HFIXEDSZ - 1)));
+    // Truncated anywhere.
+    for (size_t size = NS_HFIXEDSZ; size < good.bytes.size(); size++) {
+        EXPECT_FALSE(parses({good.bytes.begin(), good.bytes.begin() + size})) << size;
+    }
+    // Trailing bytes.
+    std::vector<uint8_t> trailing = good.bytes;
+    trailing.push_back(0);
+    EXPECT_FALSE(parses(trailing));
+    // Counts far beyond what fits.
+    Message counts;
+    counts.header(0x8180, 1, 0xffff, 0xffff, 0xffff).question(kHello, ns_t_a);
+    EXPECT_FALSE(parses(counts.bytes));
+
+    // A pointer to itself, a pointer past the end and an extended label type.
+    for (const std::string& name :
+         {std::string("\xc0\x0c", 2), std::string("\xc0\xff", 2), std::string("\x41\0", 2)}) {
+        Message msg;
+        msg.header(0x8180, 1, 0, 0, 0).question(name, ns_t_a);
+        EXPECT_FALSE(parses(msg.bytes));
+    }
+    // A name longer than 255 bytes.
+    std::string longName;
+    for (int i = 0; i < 5; i++) longName += std::string(1, 63) + std::string(63, 'a');
+    Message tooLong;
+    tooLong.header(0x8180, 1, 0, 0, 0).question(longName + std::string(1, '\0'), ns_t_a);
+    EXPECT_FALSE(parses(tooLong.bytes));
+
+    EXPECT_TRUE(parses(good.bytes));
+}
+
+}  // namespace android::net
@@ -14,9 +14,12 @@
  * limitations under the License.
  */
 
+#define ATRACE_TAG ATRACE_TAG_NETWORK
+
 #include "DnsProxyListener.h"
 
 #include <arpa/inet.h>
+#include <arpa/nameser.h>
 #include <dirent.h>
 #include <errno.h>
 #include <linux/if.h>
@@ -32,11 +35,22 @@
 #define LOG_TAG "resolv"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <vector>
 
+#include <android-base/strings.h>
+#include <android-base/thread_annotations.h>
 #include <android/multinetwork.h>  // ResNsendFlags
 #include <cutils/misc.h>           // FIRST_APPLICATION_UID
 #include <cutils/multiuser.h>
+#include <google/protobuf/arena.h>
 #include <netdutils/InternetAddresses.h>
 #include <netdutils/ResponseCode.h>
 #include <netdutils/Stopwatch.h>
@@ -44,12 +58,22 @@
 #include <private/android_filesystem_config.h>  // AID_SYSTEM
 #include <statslog_resolv.h>
 #include <sysutils/SocketClient.h>
+#include <utils/Trace.h>
 
+#include "CancellationToken.h"
+#include "Dns64Synthesis.h"
+#include "DnsEventArena.h"
+#include "DnsMessageIndex.h"
 #include "DnsResolver.h"
 #include "Experiments.h"
 #include "NetdPermissions.h"
-#include "OperationLimiter.h"
+#include "PacketBuffer.h"
 #include "PrivateDnsConfiguration.h"
+#include "QueryLimiter.h"
+#include "QueryPriority.h"
+#include "QueryThreadPool.h"
+#include "QueryTrace.h"
+#include "ResolvTrace.h"
 #include "ResolverEventReporter.h"
 #include "dnsproxyd_protocol/DnsProxydProtocol.h"  // NETID_USE_LOCAL_NAMESERVERS
 #include "getaddrinfo.h"
@@ -73,10 +97,74 @@ using netdutils::Stopwatch;
 namespace net {
 namespace {
 
-// Limits the number of outstanding DNS queries by client UID.
-constexpr int MAX_QUERIES_PER_UID = 256;
+netdutils::OperationLimiter<uid_t>& queryLimiter = getQueryLimiter();
+
+// The most lookups of a batch command that go on at once, past the cache.
+constexpr size_t kMaxConcurrentBatchLookups = 4;
+
+// Runs job(0) to job(count - 1), at most kMaxConcurrentBatchLookups at a time: on the calling
+// thread, and on helpers from the QueryThreadPool, or threads of their own if there's no pool.
+// Returns once all of them are done. A helper that starts after the jobs ran out leaves without
+// touching the caller's stack, so the caller doesn't wait for it.
+void runBatchLookups(size_t count, const std::function<void(size_t)>& job,
+                     const std::string& threadName) {
+    struct State {
+        std::atomic<size_t> next = 0;
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t done = 0;
+    };
+    const auto state = std::make_shared<State>();
+    const auto work = [state, count, &job] {
+        for (size_t i; (i = state->next++) < count;) {
+            job(i);
+            std::lock_guard guard(state->mutex);
+            if (++state->done == count) state->cv.notify_one();
+        }
+    };
+
+    QueryThreadPool* pool = QueryThreadPool::getInstance();
+    for (size_t i = 1; i < std::min(count, kMaxConcurrentBatchLookups); i++) {
+        // The jobs of a helper that couldn't start are left to the others.
+        if (pool != nullptr) {
+            pool->execute(work, threadName);
+        } else {
+            std::thread(work).detach();
+        }
+    }
+    work();
+    std::unique_lock lock(state->mutex);
+    state->cv.wait(lock, [&] { return state->done == count; });
+}
+
+std::mutex sInflightMutex;
+std::map<unsigned, int> sInflightQueries GUARDED_BY(sInflightMutex);
+
+// While tracing, counts the queries in flight on a network, as the "dns inflight netId=<netId>"
+// counter. Queries started before tracing was turned on are left out, so it never goes negative.
+class ScopedInflightQuery {
+  public:
+    explicit ScopedInflightQuery(unsigned netId) : mNetId(netId), mTraced(ATRACE_ENABLED()) {
+        if (mTraced) update(1);
+    }
+    ~ScopedInflightQuery() {
+        if (mTraced) update(-1);
+    }
+    ScopedInflightQuery(const ScopedInflightQuery&) = delete;
+    ScopedInflightQuery& operator=(const ScopedInflightQuery&) = delete;
+
+  private:
+    void update(int delta) EXCLUDES(sInflightMutex) {
+        std::lock_guard guard(sInflightMutex);
+        const int inflight = sInflightQueries[mNetId] += delta;
+        if (inflight <= 0) sInflightQueries.erase(mNetId);
+        const std::string name = "dns inflight netId=" + std::to_string(mNetId);
+        ATRACE_INT(name.c_str(), inflight);
+    }
 
-android::netdutils::OperationLimiter<uid_t> queryLimiter(MAX_QUERIES_PER_UID);
+    const unsigned mNetId;
+    const bool mTraced;
+};
 
 void logArguments(int argc, char** argv) {
     if (!WOULD_LOG(VERBOSE)) return;
@@ -98,10 +186,11 @@ constexpr bool requestingUseLocalNameservers(unsigned flags) {
 }
 
 bool queryingViaTls(unsigned dns_netid) {
-    const auto privateDnsStatus = PrivateDnsConfiguration::getInstance().getStatus(dns_netid);
-    switch (privateDnsStatus.mode) {
+    const auto privateDnsStatus =
+            PrivateDnsConfiguration::getInstance().getStatusSnapshot(dns_netid);
+    switch (privateDnsStatus->mode) {
         case PrivateDnsMode::OPPORTUNISTIC:
-            return !privateDnsStatus.validatedServers().empty();
+            return !privateDnsStatus->validatedServers().empty();
         case PrivateDnsMode::STRICT:
             return true;
         default:
@@ -149,17 +238,16 @@ void addIpAddrWithinLimit(std::vector<std::string>* ip_addrs, const sockaddr* ad
 int extractResNsendAnswers(std::span<const uint8_t> answer, int ipType,
                            std::vector<std::string>* ip_addrs) {
     int total_ip_addr_count = 0;
-    ns_msg handle;
-    if (ns_initparse(answer.data(), answer.size(), &handle) < 0) {
+    DnsMessageIndex index;
+    if (!index.parse(answer)) {
         return 0;
     }
-    int ancount = ns_msg_count(handle, ns_s_an);
-    ns_rr rr;
-    for (int i = 0; i < ancount; i++) {
-        if (ns_parserr(&handle, ns_s_an, i, &rr) < 0) {
+    for (const DnsMessageIndex::Record& rr : index.section(ns_s_an)) {
+        // Skip the CNAMEs leading to the addresses.
+        if (rr.type != ipType || rr.rdlen != (ipType == ns_t_a ? NS_INADDRSZ : NS_IN6ADDRSZ)) {
             continue;
         }
-        const uint8_t* rdata = ns_rr_rdata(rr);
+        const uint8_t* rdata = index.rdata(rr).data();
         if (ipType == ns_t_a) {
             sockaddr_in sin = {.sin_family = AF_INET};
             memcpy(&sin.sin_addr, rdata, sizeof(sin.sin_addr));
@@ -275,7 +363,7 @@ bool parseQuery(span<const uint8_t> msg, uint16_t* query_id, int* rr_type, std::
 // Note: Even if it returns PDM_OFF, it doesn't mean there's no DoT stats in the message
 // because Private DNS mode can change at any time.
 PrivateDnsModes getPrivateDnsModeForMetrics(uint32_t netId) {
-    switch (PrivateDnsConfiguration::getInstance().getStatus(netId).mode) {
+    switch (PrivateDnsConfiguration::getInstance().getStatusSnapshot(netId)->mode) {
         case PrivateDnsMode::OFF:
             // It can also be due to netId not found.
             return PrivateDnsModes::PDM_OFF;
@@ -299,16 +387,29 @@ void initDnsEvent(NetworkDnsEventReported* event, const android_net_context& net
     //     resolv_res_nsend,res_nsend will do nothing special by the setting.
     event->set_hints_ai_flags(-1);
     event->set_res_nsend_flags(-1);
+    // Whether the event may be sampled is drawn as the query arrives, so that the events that
+    // can't be don't get what only statsd needs.
+    const uint32_t drawnDenom = resolv_cache_draw_event_sample(netContext.dns_netid);
+    event->set_sampling_rate_denom(drawnDenom);
+    if (drawnDenom == 0) return;
     event->set_private_dns_modes(getPrivateDnsModeForMetrics(netContext.dns_netid));
 }
 
+// Whether initDnsEvent() drew |event| for sampling. Events it didn't initialize may be sampled.
+bool mayBeSampled(const NetworkDnsEventReported& event) {
+    return !event.has_sampling_rate_denom() || event.sampling_rate_denom() != 0;
+}
+
 // Return 0 if the event should not be logged.
 // Otherwise, return subsampling_denom
-uint32_t getDnsEventSubsamplingRate(int netid, int returnCode, bool isMdns) {
+uint32_t getDnsEventSubsamplingRate(int netid, int returnCode, bool isMdns,
+                                    const NetworkDnsEventReported& event) {
     uint32_t subsampling_denom = resolv_cache_get_subsampling_denom(netid, returnCode, isMdns);
     if (subsampling_denom == 0) return 0;
-    // Sample the event with a chance of 1 / denom.
-    return (arc4random_uniform(subsampling_denom) == 0) ? subsampling_denom : 0;
+    // Sample the event with a chance of 1 / denom. initDnsEvent() already drew it with a chance
+    // of 1 / drawnDenom, where drawnDenom <= denom, so that leaves a chance of drawnDenom / denom.
+    const uint32_t drawnDenom = event.has_sampling_rate_denom() ? event.sampling_rate_denom() : 1;
+    return (arc4random_uniform(subsampling_denom) < drawnDenom) ? subsampling_denom : 0;
 }
 
 void maybeLogQuery(int eventType, const android_net_context& netContext,
@@ -332,13 +433,22 @@ void maybeLogQuery(int eventType, const android_net_context& netContext,
 void reportDnsEvent(int eventType, const android_net_context& netContext, int latencyUs,
                     int returnCode, NetworkDnsEventReported& event, const std::string& query_name,
                     const std::vector<std::string>& ip_addrs = {}, int total_ip_addr_count = 0) {
-    uint32_t rate =
-            (query_name.ends_with(".local") && is_mdns_supported_network(netContext.dns_netid) &&
-             android::net::Experiments::getInstance()->getFlag("mdns_resolution", 1))
-                    ? getDnsEventSubsamplingRate(netContext.dns_netid, returnCode, true)
-                    : getDnsEventSubsamplingRate(netContext.dns_netid, returnCode, false);
+    uint32_t rate = 0;
+    if (mayBeSampled(event)) {
+        if (const QueryTrace* trace = QueryTrace::current(); trace != nullptr) {
+            trace->report(event.mutable_dns_query_events()->mutable_stages());
+        }
+        const bool isMdns = query_name.ends_with(".local") &&
+                            is_mdns_supported_network(netContext.dns_netid) &&
+                            android::net::Experiments::getInstance()->getFlag("mdns_resolution", 1);
+        rate = getDnsEventSubsamplingRate(netContext.dns_netid, returnCode, isMdns, event);
+    }
 
     if (rate) {
+        if (DnsCacheStats cacheStats;
+            resolv_cache_get_stats_report(netContext.dns_netid, &cacheStats)) {
+            *event.mutable_dns_query_events()->mutable_cache_stats() = std::move(cacheStats);
+        }
         const std::string& dnsQueryStats = event.dns_query_events().SerializeAsString();
         stats::BytesField dnsQueryBytesField{dnsQueryStats.c_str(), dnsQueryStats.size()};
         event.set_return_code(static_cast<ReturnCode>(returnCode));
@@ -352,27 +462,21 @@ void reportDnsEvent(int eventType, const android_net_context& netContext, int la
 
     maybeLogQuery(eventType, netContext, event, query_name, ip_addrs);
 
-    const auto& listeners = ResolverEventReporter::getInstance().getListeners();
-    if (listeners.empty()) {
-        LOG(ERROR) << __func__
-                   << ": DNS event not sent since no INetdEventListener receiver is available.";
-    }
-    const int latencyMs = latencyUs / 1000;
-    for (const auto& it : listeners) {
-        it->onDnsEvent(netContext.dns_netid, eventType, returnCode, latencyMs, query_name, ip_addrs,
-                       total_ip_addr_count, netContext.uid);
-    }
-
-    const auto& unsolEventListeners = ResolverEventReporter::getInstance().getUnsolEventListeners();
-
+    ResolverEventReporter::DnsEvent dnsEvent = {
+            .netId = static_cast<int32_t>(netContext.dns_netid),
+            .eventType = eventType,
+            .returnCode = returnCode,
+            .latencyMs = latencyUs / 1000,
+            .hostname = query_name,
+            .ipAddresses = ip_addrs,
+            .ipAddressesCount = total_ip_addr_count,
+            .uid = static_cast<int32_t>(netContext.uid),
+    };
     if (returnCode == NETD_RESOLV_TIMEOUT) {
-        const DnsHealthEventParcel dnsHealthEvent = {
+        dnsEvent.healthEvent = DnsHealthEventParcel{
                 .netId = static_cast<int32_t>(netContext.dns_netid),
                 .healthResult = IDnsResolverUnsolicitedEventListener::DNS_HEALTH_RESULT_TIMEOUT,
         };
-        for (const auto& it : unsolEventListeners) {
-            it->onDnsHealthEvent(dnsHealthEvent);
-        }
     } else if (returnCode == NOERROR) {
         DnsHealthEventParcel dnsHealthEvent = {
                 .netId = static_cast<int32_t>(netContext.dns_netid),
@@ -385,11 +489,17 @@ void reportDnsEvent(int eventType, const android_net_context& netContext, int la
         }
 
         if (!dnsHealthEvent.successRttMicros.empty()) {
-            for (const auto& it : unsolEventListeners) {
-                it->onDnsHealthEvent(dnsHealthEvent);
-            }
+            dnsEvent.healthEvent = std::move(dnsHealthEvent);
         }
     }
+
+    ResolverEventReporter& reporter = ResolverEventReporter::getInstance();
+    if (Experiments::getInstance()->getFlag("async_dns_event_reporting", 0)) {
+        // Dropped events are counted in the dump.
+        reporter.queueDnsEvent(std::move(dnsEvent));
+    } else {
+        reporter.sendDnsEvents({std::move(dnsEvent)});
+    }
 }
 
 bool onlyIPv4Answers(const addrinfo* res) {
@@ -401,45 +511,6 @@ bool onlyIPv4Answers(const addrinfo* res) {
     return true;
 }
 
-bool isSpecialUseIPv4Address(const struct in_addr& ia) {
-    const uint32_t addr = ntohl(ia.s_addr);
-
-    // Only check necessary IP ranges in RFC 5735 section 4
-    return ((addr & 0xff000000) == 0x00000000) ||  // "This" Network
-           ((addr & 0xff000000) == 0x7f000000) ||  // Loopback
-           ((addr & 0xffff0000) == 0xa9fe0000) ||  // Link Local
-           ((addr & 0xf0000000) == 0xe0000000) ||  // Multicast
-           (addr == INADDR_BROADCAST);             // Limited Broadcast
-}
-
-bool isSpecialUseIPv4Address(const struct sockaddr* sa) {
-    if (sa->sa_family != AF_INET) return false;
-
-    return isSpecialUseIPv4Address(((struct sockaddr_in*)sa)->sin_addr);
-}
-
-bool onlyNonSpecialUseIPv4Addresses(struct hostent* hp) {
-    // Null hostent pointer isn't checked because the caller doesn't pass null pointer.
-
-    if (hp->h_addrtype != AF_INET) return false;
-
-    for (int i = 0; hp->h_addr_list[i] != nullptr; i++)
-        if (isSpecialUseIPv4Address(*(struct in_addr*)hp->h_addr_list[i])) return false;
-
-    return true;
-}
-
-bool onlyNonSpecialUseIPv4Addresses(const addrinfo* res) {
-    // Null addrinfo pointer isn't checked because the caller doesn't pass null pointer.
-
-    for (const addrinfo* ai = res; ai; ai = ai->ai_next) {
-        if (ai->ai_family != AF_INET) return false;
-        if (isSpecialUseIPv4Address(ai->ai_addr)) return false;
-    }
-
-    return true;
-}
-
 void logDnsQueryResult(const struct hostent* hp) {
     if (!WOULD_LOG(DEBUG)) return;
     if (hp == nullptr) return;
@@ -476,90 +547,29 @@ void logDnsQueryResult(const addrinfo* res) {
     }
 }
 
-bool isValidNat64Prefix(const netdutils::IPPrefix prefix) {
-    if (prefix.family() != AF_INET6) {
-        LOG(ERROR) << __func__ << ": Only IPv6 NAT64 prefixes are supported " << prefix.family();
-        return false;
-    }
-    if (prefix.length() != 96) {
-        LOG(ERROR) << __func__ << ": Only /96 NAT64 prefixes are supported " << prefix.length();
-        return false;
-    }
-    return true;
+bool getDns64Prefix(unsigned netId, in6_addr* prefix) {
+    return gDnsResolv->resolverCtrl.getPrefix64(netId, prefix);
 }
 
-bool synthesizeNat64PrefixWithARecord(const netdutils::IPPrefix& prefix, struct hostent* hp) {
-    if (hp == nullptr) return false;
-    if (!onlyNonSpecialUseIPv4Addresses(hp)) return false;
-    if (!isValidNat64Prefix(prefix)) return false;
-
-    struct sockaddr_storage ss = netdutils::IPSockAddr(prefix.ip());
-    struct sockaddr_in6* v6prefix = (struct sockaddr_in6*)&ss;
-    for (int i = 0; hp->h_addr_list[i] != nullptr; i++) {
-        struct in_addr iaOriginal = *(struct in_addr*)hp->h_addr_list[i];
-        struct in6_addr* ia6 = (struct in6_addr*)hp->h_addr_list[i];
-        memset(ia6, 0, sizeof(struct in6_addr));
-
-        // Synthesize /96 NAT64 prefix in place. The space has reserved by getanswer() and
-        // _hf_gethtbyname2() in system/netd/resolv/gethnamaddr.cpp and
-        // system/netd/resolv/sethostent.cpp.
-        *ia6 = v6prefix->sin6_addr;
-        ia6->s6_addr32[3] = iaOriginal.s_addr;
-
-        if (WOULD_LOG(VERBOSE)) {
-            char buf[INET6_ADDRSTRLEN];  // big enough for either IPv4 or IPv6
-            inet_ntop(AF_INET, &iaOriginal.s_addr, buf, sizeof(buf));
-            LOG(VERBOSE) << __func__ << ": DNS A record: " << buf;
-            inet_ntop(AF_INET6, &v6prefix->sin6_addr, buf, sizeof(buf));
-            LOG(VERBOSE) << __func__ << ": NAT64 prefix: " << buf;
-            inet_ntop(AF_INET6, ia6, buf, sizeof(buf));
-            LOG(VERBOSE) << __func__ << ": DNS64 Synthesized AAAA record: " << buf;
-        }
-    }
-    hp->h_addrtype = AF_INET6;
-    hp->h_length = sizeof(in6_addr);
-
-    logDnsQueryResult(hp);
-    return true;
+// Background requests only get part of the global query limit.
+bool isBackgroundQuery(uid_t uid) {
+    return QueryPriorities::forUid(uid) == QueryPriority::BACKGROUND;
 }
 
-bool synthesizeNat64PrefixWithARecord(const netdutils::IPPrefix& prefix, addrinfo* result) {
-    if (result == nullptr) return false;
-    if (!onlyNonSpecialUseIPv4Addresses(result)) return false;
-    if (!isValidNat64Prefix(prefix)) return false;
-
-    struct sockaddr_storage ss = netdutils::IPSockAddr(prefix.ip());
-    struct sockaddr_in6* v6prefix = (struct sockaddr_in6*)&ss;
-    for (addrinfo* ai = result; ai; ai = ai->ai_next) {
-        struct sockaddr_in sinOriginal = *(struct sockaddr_in*)ai->ai_addr;
-        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)ai->ai_addr;
-        memset(sin6, 0, sizeof(sockaddr_in6));
-
-        // Synthesize /96 NAT64 prefix in place. The space has reserved by get_ai() in
-        // system/netd/resolv/getaddrinfo.cpp.
-        sin6->sin6_addr = v6prefix->sin6_addr;
-        sin6->sin6_addr.s6_addr32[3] = sinOriginal.sin_addr.s_addr;
-        sin6->sin6_family = AF_INET6;
-        sin6->sin6_port = sinOriginal.sin_port;
-        ai->ai_addrlen = sizeof(struct sockaddr_in6);
-        ai->ai_family = AF_INET6;
-
-        if (WOULD_LOG(VERBOSE)) {
-            char buf[INET6_ADDRSTRLEN];  // big enough for either IPv4 or IPv6
-            inet_ntop(AF_INET, &sinOriginal.sin_addr.s_addr, buf, sizeof(buf));
-            LOG(VERBOSE) << __func__ << ": DNS A record: " << buf;
-            inet_ntop(AF_INET6, &v6prefix->sin6_addr, buf, sizeof(buf));
-            LOG(VERBOSE) << __func__ << ": NAT64 prefix: " << buf;
-            inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof(buf));
-            LOG(VERBOSE) << __func__ << ": DNS64 Synthesized AAAA record: " << buf;
-        }
-    }
-    logDnsQueryResult(result);
-    return true;
+// Whether this thread is answering from the cache alone, and a query missed it.
+bool missedCache() {
+    const ScopedCacheOnlyLookup* cacheOnly = ScopedCacheOnlyLookup::current();
+    return cacheOnly != nullptr && cacheOnly->missed();
 }
 
-bool getDns64Prefix(unsigned netId, netdutils::IPPrefix* prefix) {
-    return !gDnsResolv->resolverCtrl.getPrefix64(netId, prefix);
+// Ends a query started with queryLimiter.start(). One that missed the cache on the listener
+// thread is started again on a worker thread, so it gives its token back.
+void finishQuery(uid_t uid) {
+    if (missedCache()) {
+        queryLimiter.cancel(uid);
+    } else {
+        queryLimiter.finish(uid);
+    }
 }
 
 std::string makeThreadName(unsigned netId, uint32_t uid) {
@@ -569,16 +579,61 @@ std::string makeThreadName(unsigned netId, uint32_t uid) {
 
 }  // namespace
 
+netdutils::OperationLimiter<uid_t>& getQueryLimiter() {
+    // Limits the number of outstanding DNS queries by client UID.
+    constexpr int MAX_QUERIES_PER_UID = 256;
+    static netdutils::OperationLimiter<uid_t> limiter(MAX_QUERIES_PER_UID);
+    return limiter;
+}
+
 DnsProxyListener::DnsProxyListener() : FrameworkListener(SOCKET_NAME) {
-    registerCmd(new GetAddrInfoCmd());
-    registerCmd(new GetHostByAddrCmd());
-    registerCmd(new GetHostByNameCmd());
-    registerCmd(new ResNSendCommand());
-    registerCmd(new GetDnsNetIdCommand());
+    for (FrameworkCommand* cmd : makeCommands()) registerCmd(cmd);
+
+    const int numShards =
+            std::min<int>(Experiments::getInstance()->getFlag("listener_shards", 0),
+                          std::thread::hardware_concurrency());
+    if (numShards <= 0) return;
+    for (int i = 0; i < numShards; i++) {
+        mDispatchers.push_back(std::make_unique<CommandDispatcher>());
+    }
+    mShards = std::make_unique<ClientShards>(numShards, [this](SocketClient* c, size_t shard) {
+        return serve(c, mDispatchers[shard].get());
+    });
+    if (mShards->size() == 0) mShards.reset();
+}
+
+DnsProxyListener::CommandDispatcher::CommandDispatcher() : FrameworkListener(SOCKET_NAME) {
+    for (FrameworkCommand* cmd : makeCommands()) registerCmd(cmd);
+}
+
+std::vector<FrameworkCommand*> DnsProxyListener::makeCommands() {
+    return {
+            new GetAddrInfoCmd(),
+            new GetAddrInfoBatchCmd(),
+            new GetHostByAddrCmd(),
+            new GetHostByAddrBatchCmd(),
+            new GetHostByNameCmd(),
+            new ResNSendCommand(false),
+            new ResNSendCommand(true),
+            new GetDnsNetIdCommand(),
+    };
+}
+
+void DnsProxyListener::dump(netdutils::DumpWriter& dw) const {
+    if (mShards != nullptr) mShards->dump(dw);
 }
 
 void DnsProxyListener::Handler::spawn() {
-    const int rval = netdutils::threadLaunch(this);
+    const int rval = [this] {
+        QueryThreadPool* pool = QueryThreadPool::getInstance();
+        if (pool == nullptr) return netdutils::threadLaunch(this);
+        return pool->execute(
+                [this] {
+                    run();
+                    delete this;
+                },
+                threadName(), QueryPriorities::forUid(mClient->getUid()));
+    }();
     if (rval == 0) {
         return;
     }
@@ -590,6 +645,13 @@ void DnsProxyListener::Handler::spawn() {
     delete this;
 }
 
+bool DnsProxyListener::Handler::runFromCache() {
+    if (Experiments::getInstance()->getFlag("listener_cache_fast_path", 0) != 1) return false;
+    ScopedCacheOnlyLookup cacheOnly;
+    run();
+    return !cacheOnly.missed();
+}
+
 DnsProxyListener::GetAddrInfoHandler::GetAddrInfoHandler(SocketClient* c, std::string host,
                                                          std::string service,
                                                          std::unique_ptr<addrinfo> hints,
@@ -610,41 +672,53 @@ static bool sendBE32(SocketClient* c, uint32_t data) {
     return c->sendData(&be_data, sizeof(be_data)) == 0;
 }
 
-// Sends 4 bytes of big-endian length, followed by the data.
-// Returns true on success.
-static bool sendLenAndData(SocketClient* c, const int len, const void* data) {
-    return sendBE32(c, len) && (len == 0 || c->sendData(data, len) == 0);
+// Appends 4 bytes of big-endian |data| to |buf|.
+static void appendBE32(std::vector<uint8_t>* buf, uint32_t data) {
+    const uint32_t be_data = htonl(data);
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&be_data);
+    buf->insert(buf->end(), bytes, bytes + sizeof(be_data));
 }
 
-// Returns true on success
-static bool sendhostent(SocketClient* c, hostent* hp) {
-    bool success = true;
-    int i;
+// Appends 4 bytes of big-endian length, followed by the data, to |buf|.
+static void appendLenAndData(std::vector<uint8_t>* buf, const int len, const void* data) {
+    appendBE32(buf, len);
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    if (len > 0) buf->insert(buf->end(), bytes, bytes + len);
+}
+
+// Appends |hp| to |buf|, field by field.
+static void appendhostent(std::vector<uint8_t>* buf, const hostent* hp) {
     if (hp->h_name != nullptr) {
-        success &= sendLenAndData(c, strlen(hp->h_name) + 1, hp->h_name);
+        appendLenAndData(buf, strlen(hp->h_name) + 1, hp->h_name);
     } else {
-        success &= sendLenAndData(c, 0, "") == 0;
+        appendLenAndData(buf, 0, "");
     }
 
-    for (i = 0; hp->h_aliases[i] != nullptr; i++) {
-        success &= sendLenAndData(c, strlen(hp->h_aliases[i]) + 1, hp->h_aliases[i]);
+    for (int i = 0; hp->h_aliases[i] != nullptr; i++) {
+        appendLenAndData(buf, strlen(hp->h_aliases[i]) + 1, hp->h_aliases[i]);
     }
-    success &= sendLenAndData(c, 0, "");  // null to indicate we're done
-
-    uint32_t buf = htonl(hp->h_addrtype);
-    success &= c->sendData(&buf, sizeof(buf)) == 0;
+    appendLenAndData(buf, 0, "");  // null to indicate we're done
 
-    buf = htonl(hp->h_length);
-    success &= c->sendData(&buf, sizeof(buf)) == 0;
+    appendBE32(buf, hp->h_addrtype);
+    appendBE32(buf, hp->h_length);
 
-    for (i = 0; hp->h_addr_list[i] != nullptr; i++) {
-        success &= sendLenAndData(c, 16, hp->h_addr_list[i]);
+    for (int i = 0; hp->h_addr_list[i] != nullptr; i++) {
+        appendLenAndData(buf, 16, hp->h_addr_list[i]);
     }
-    success &= sendLenAndData(c, 0, "");  // null to indicate we're done
-    return success;
+    appendLenAndData(buf, 0, "");  // null to indicate we're done
 }
 
-static bool sendaddrinfo(SocketClient* c, addrinfo* ai) {
+// Returns true on success
+static bool sendhostent(SocketClient* c, hostent* hp) {
+    // The whole hostent goes out in one write rather than one per field.
+    std::vector<uint8_t> buf;
+    buf.reserve(256);
+    appendhostent(&buf, hp);
+    return c->sendData(buf.data(), buf.size()) == 0;
+}
+
+// Appends a list of addrinfo to |buf|, each preceded by a 1 and the last followed by a 0.
+static void appendaddrinfo(std::vector<uint8_t>* buf, const addrinfo* ai) {
     // struct addrinfo {
     //      int     ai_flags;       /* AI_PASSIVE, AI_CANONNAME, AI_NUMERICHOST */
     //      int     ai_family;      /* PF_xxx */
@@ -655,26 +729,30 @@ static bool sendaddrinfo(SocketClient* c, addrinfo* ai) {
     //      struct  sockaddr *ai_addr;      /* binary address */
     //      struct  addrinfo *ai_next;      /* next structure in linked list */
     // };
-
-    // Write the struct piece by piece because we might be a 64-bit netd
-    // talking to a 32-bit process.
-    bool success = sendBE32(c, ai->ai_flags) && sendBE32(c, ai->ai_family) &&
-                   sendBE32(c, ai->ai_socktype) && sendBE32(c, ai->ai_protocol);
-    if (!success) {
-        return false;
-    }
-
-    // ai_addrlen and ai_addr.
-    if (!sendLenAndData(c, ai->ai_addrlen, ai->ai_addr)) {
-        return false;
-    }
-
-    // strlen(ai_canonname) and ai_canonname.
-    if (!sendLenAndData(c, ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0, ai->ai_canonname)) {
-        return false;
-    }
-
-    return true;
+    size_t size = sizeof(uint32_t);
+    for (const addrinfo* p = ai; p; p = p->ai_next) {
+        size += 7 * sizeof(uint32_t) + p->ai_addrlen +
+                (p->ai_canonname ? strlen(p->ai_canonname) + 1 : 0);
+    }
+    buf->reserve(buf->size() + size);
+
+    for (; ai; ai = ai->ai_next) {
+        appendBE32(buf, 1);
+        // Write the struct piece by piece because we might be a 64-bit netd
+        // talking to a 32-bit process.
+        appendBE32(buf, ai->ai_flags);
+        appendBE32(buf, ai->ai_family);
+        appendBE32(buf, ai->ai_socktype);
+        appendBE32(buf, ai->ai_protocol);
+
+        // ai_addrlen and ai_addr.
+        appendLenAndData(buf, ai->ai_addrlen, ai->ai_addr);
+
+        // strlen(ai_canonname) and ai_canonname.
+        appendLenAndData(buf, ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0,
+                         ai->ai_canonname);
+    }
+    appendBE32(buf, 0);
 }
 
 void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinfo** res,
@@ -687,7 +765,7 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
         return;
     }
 
-    netdutils::IPPrefix prefix{};
+    in6_addr prefix;
     if (!getDns64Prefix(mNetContext.dns_netid, &prefix)) {
         return;
     }
@@ -695,14 +773,19 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
     if (ipv6WantedButNoData) {
         // If caller wants IPv6 answers but no data, try to query IPv4 answers for synthesis
         const uid_t uid = mClient->getUid();
-        if (queryLimiter.start(uid)) {
+        if (queryLimiter.start(uid, isBackgroundQuery(uid))) {
             const char* host = mHost.starts_with('^') ? nullptr : mHost.c_str();
             const char* service = mService.starts_with('^') ? nullptr : mService.c_str();
             mHints->ai_family = AF_INET;
             // Don't need to do freeaddrinfo(res) before starting new DNS lookup because previous
             // DNS lookup is failed with error EAI_NODATA.
             *rv = resolv_getaddrinfo(host, service, mHints.get(), &mNetContext, res, event);
-            queryLimiter.finish(uid);
+            finishQuery(uid);
+            if (missedCache()) {
+                // Looked up again from the start, with the hints the client asked for.
+                mHints->ai_family = AF_INET6;
+                return;
+            }
             if (*rv) {
                 *rv = EAI_NODATA;  // return original error code
                 return;
@@ -713,7 +796,9 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
         }
     }
 
-    if (!synthesizeNat64PrefixWithARecord(prefix, *res)) {
+    if (synthesizeNat64(prefix, *res)) {
+        logDnsQueryResult(*res);
+    } else {
         if (ipv6WantedButNoData) {
             // If caller wants IPv6 answers but no data and failed to synthesize IPv6 answers,
             // don't return the IPv4 answers.
@@ -726,27 +811,27 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
     }
 }
 
-void DnsProxyListener::GetAddrInfoHandler::run() {
+int32_t DnsProxyListener::GetAddrInfoHandler::resolve(addrinfo** result,
+                                                      NetworkDnsEventReported* event) {
     LOG(DEBUG) << "GetAddrInfoHandler::run: {" << mNetContext.app_netid << " "
                << mNetContext.app_mark << " " << mNetContext.dns_netid << " "
                << mNetContext.dns_mark << " " << mNetContext.uid << " " << mNetContext.flags << "}";
 
-    addrinfo* result = nullptr;
     Stopwatch s;
     maybeFixupNetContext(&mNetContext, mClient->getPid());
+    ScopedInflightQuery inflight(mNetContext.dns_netid);
     const uid_t uid = mClient->getUid();
     int32_t rv = 0;
-    NetworkDnsEventReported event;
-    initDnsEvent(&event, mNetContext);
-    if (queryLimiter.start(uid)) {
+    initDnsEvent(event, mNetContext);
+    if (queryLimiter.start(uid, isBackgroundQuery(uid))) {
         const char* host = mHost.starts_with('^') ? nullptr : mHost.c_str();
         const char* service = mService.starts_with('^') ? nullptr : mService.c_str();
         if (evaluate_domain_name(mNetContext, host)) {
-            rv = resolv_getaddrinfo(host, service, mHints.get(), &mNetContext, &result, &event);
+            rv = resolv_getaddrinfo(host, service, mHints.get(), &mNetContext, result, event);
         } else {
             rv = EAI_SYSTEM;
         }
-        queryLimiter.finish(uid);
+        finishQuery(uid);
     } else {
         // Note that this error code is currently not passed down to the client.
         // android_getaddrinfo_proxy() returns EAI_NODATA on any error.
@@ -755,35 +840,56 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
                    << ", max concurrent queries reached";
     }
 
-    doDns64Synthesis(&rv, &result, &event);
-    const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
-    event.set_latency_micros(latencyUs);
-    event.set_event_type(EVENT_GETADDRINFO);
-    event.set_hints_ai_flags((mHints ? mHints->ai_flags : 0));
+    if (!missedCache()) {
+        ScopedStageTimer timer(QueryStage::DNS64);
+        doDns64Synthesis(&rv, result, event);
+    }
+    event->set_latency_micros(saturate_cast<int32_t>(s.timeTakenUs()));
+    event->set_event_type(EVENT_GETADDRINFO);
+    event->set_hints_ai_flags((mHints ? mHints->ai_flags : 0));
+    return rv;
+}
+
+void DnsProxyListener::GetAddrInfoHandler::report(int32_t rv, const addrinfo* result,
+                                                  NetworkDnsEventReported& event) {
+    std::vector<std::string> ip_addrs;
+    const int total_ip_addr_count = extractGetAddrInfoAnswers(result, &ip_addrs);
+    reportDnsEvent(INetdEventListener::EVENT_GETADDRINFO, mNetContext, event.latency_micros(), rv,
+                   event, mHost, ip_addrs, total_ip_addr_count);
+}
+
+void DnsProxyListener::GetAddrInfoHandler::run() {
+    ATRACE_CALL();
+    ScopedQueryTrace trace;
+    ScopedCancellationToken cancellation(mClient);
+    addrinfo* result = nullptr;
+    ScopedDnsEvent event;
+    const int32_t rv = resolve(&result, event.get());
+    if (missedCache()) {
+        // What was found is left for the worker thread to look up again.
+        freeaddrinfo(result);
+        return;
+    }
 
     bool success = true;
     if (rv) {
         // getaddrinfo failed
+        ScopedStageTimer timer(QueryStage::RESPONSE_WRITE);
         success = !mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
     } else {
-        success = !mClient->sendCode(ResponseCode::DnsProxyQueryResult);
-        addrinfo* ai = result;
-        while (ai && success) {
-            success = sendBE32(mClient, 1) && sendaddrinfo(mClient, ai);
-            ai = ai->ai_next;
-        }
-        success = success && sendBE32(mClient, 0);
+        std::vector<uint8_t> buf;
+        appendaddrinfo(&buf, result);
+        ScopedStageTimer timer(QueryStage::RESPONSE_WRITE);
+        success = !mClient->sendCode(ResponseCode::DnsProxyQueryResult) &&
+                  !mClient->sendData(buf.data(), buf.size());
     }
 
     if (!success) {
-        PLOG(WARNING) << "GetAddrInfoHandler::run: Error writing DNS result to client uid " << uid
-                      << " pid " << mClient->getPid();
+        PLOG(WARNING) << "GetAddrInfoHandler::run: Error writing DNS result to client uid "
+                      << mClient->getUid() << " pid " << mClient->getPid();
     }
 
-    std::vector<std::string> ip_addrs;
-    const int total_ip_addr_count = extractGetAddrInfoAnswers(result, &ip_addrs);
-    reportDnsEvent(INetdEventListener::EVENT_GETADDRINFO, mNetContext, latencyUs, rv, event, mHost,
-                   ip_addrs, total_ip_addr_count);
+    report(rv, result, *event);
     freeaddrinfo(result);
 }
 
@@ -848,23 +954,158 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient* cli, int argc, ch
         hints->ai_protocol = ai_protocol;
     }
 
-    (new GetAddrInfoHandler(cli, name, service, move(hints), netcontext))->spawn();
+    auto* handler = new GetAddrInfoHandler(cli, name, service, move(hints), netcontext);
+    if (handler->runFromCache()) {
+        delete handler;
+        return 0;
+    }
+    handler->spawn();
     return 0;
 }
 
+/*******************************************************
+ *                  GetAddrInfoBatch                   *
+ *******************************************************/
+DnsProxyListener::GetAddrInfoBatchCmd::GetAddrInfoBatchCmd()
+    : FrameworkCommand("getaddrinfobatch") {}
+
+int DnsProxyListener::GetAddrInfoBatchCmd::runCommand(SocketClient* cli, int argc, char** argv) {
+    logArguments(argc, argv);
+
+    constexpr int kFixedArgs = 7;
+    if (argc <= kFixedArgs || argc > kFixedArgs + DNSPROXYD_MAX_BATCH_HOSTS) {
+        char* msg = nullptr;
+        asprintf(&msg, "Invalid number of arguments to getaddrinfobatch: %i", argc);
+        LOG(WARNING) << "GetAddrInfoBatchCmd::runCommand: " << (msg ? msg : "null");
+        cli->sendMsg(ResponseCode::CommandParameterError, msg, false);
+        free(msg);
+        return -1;
+    }
+
+    const std::string service = argv[1];
+    int ai_flags = strtol(argv[2], nullptr, 10);
+    int ai_family = strtol(argv[3], nullptr, 10);
+    int ai_socktype = strtol(argv[4], nullptr, 10);
+    int ai_protocol = strtol(argv[5], nullptr, 10);
+    unsigned netId = strtoul(argv[6], nullptr, 10);
+    const bool useLocalNameservers = checkAndClearUseLocalNameserversFlag(&netId);
+    const uid_t uid = cli->getUid();
+
+    android_net_context netcontext;
+    gResNetdCallbacks.get_network_context(netId, uid, &netcontext);
+
+    if (useLocalNameservers) {
+        netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
+    }
+
+    std::unique_ptr<addrinfo> hints;
+    if (ai_flags != -1 || ai_family != -1 || ai_socktype != -1 || ai_protocol != -1) {
+        hints.reset((addrinfo*)calloc(1, sizeof(addrinfo)));
+        hints->ai_flags = ai_flags;
+        hints->ai_family = ai_family;
+        hints->ai_socktype = ai_socktype;
+        hints->ai_protocol = ai_protocol;
+    }
+
+    std::vector<std::string> hosts(argv + kFixedArgs, argv + argc);
+    (new GetAddrInfoBatchHandler(cli, std::move(hosts), service, std::move(hints), netcontext))
+            ->spawn();
+    return 0;
+}
+
+DnsProxyListener::GetAddrInfoBatchHandler::GetAddrInfoBatchHandler(
+        SocketClient* c, std::vector<std::string> hosts, std::string service,
+        std::unique_ptr<addrinfo> hints, const android_net_context& netcontext)
+    : Handler(c),
+      mHosts(std::move(hosts)),
+      mService(std::move(service)),
+      mHints(std::move(hints)),
+      mNetContext(netcontext) {}
+
+void DnsProxyListener::GetAddrInfoBatchHandler::run() {
+    if (mClient->sendCode(ResponseCode::DnsProxyQueryResult)) {
+        PLOG(WARNING) << "GetAddrInfoBatchHandler::run: Error writing DNS result to client uid "
+                      << mClient->getUid() << " pid " << mClient->getPid();
+        return;
+    }
+
+    // The hosts are looked up a few at a time, so that a large batch neither takes a thread per
+    // host nor most of the query limit of its app.
+    runBatchLookups(mHosts.size(), [this](size_t i) { resolveOne(i); }, threadName());
+}
+
+void DnsProxyListener::GetAddrInfoBatchHandler::resolveOne(uint32_t index) {
+    ScopedCancellationToken cancellation(mClient);
+    // Each lookup gets hints of its own, as DNS64 synthesis may change them.
+    std::unique_ptr<addrinfo> hints;
+    if (mHints) {
+        hints.reset((addrinfo*)calloc(1, sizeof(addrinfo)));
+        *hints = *mHints;
+    }
+    GetAddrInfoHandler handler(mClient, mHosts[index], mService, std::move(hints), mNetContext);
+    addrinfo* result = nullptr;
+    ScopedDnsEvent event;
+    const int32_t rv = handler.resolve(&result, event.get());
+
+    // One write per result, so that those of concurrent lookups don't interleave.
+    std::vector<uint8_t> buf;
+    appendBE32(&buf, index);
+    appendBE32(&buf, rv);
+    if (rv == 0) appendaddrinfo(&buf, result);
+    if (mClient->sendData(buf.data(), buf.size())) {
+        PLOG(WARNING) << "GetAddrInfoBatchHandler::run: Error writing DNS result to client uid "
+                      << mClient->getUid() << " pid " << mClient->getPid();
+    }
+
+    handler.report(rv, result, *event);
+    freeaddrinfo(result);
+}
+
+std::string DnsProxyListener::GetAddrInfoBatchHandler::threadName() {
+    return makeThreadName(mNetContext.dns_netid, mClient->getUid());
+}
+
 /*******************************************************
  *                  ResNSendCommand                    *
  *******************************************************/
-DnsProxyListener::ResNSendCommand::ResNSendCommand() : FrameworkCommand("resnsend") {}
+namespace {
+
+// Sends |err| as the answer to a resnsend query, preceded by its tag, if it has one.
+bool sendResNSendError(SocketClient* c, std::optional<uint32_t> tag, int err) {
+    std::vector<uint8_t> buf;
+    if (tag) appendBE32(&buf, *tag);
+    appendBE32(&buf, err);
+    return c->sendData(buf.data(), buf.size()) == 0;
+}
+
+}  // namespace
+
+DnsProxyListener::ResNSendCommand::ResNSendCommand(bool tagged)
+    : FrameworkCommand(tagged ? "resnsendtagged" : "resnsend"), mTagged(tagged) {}
 
 int DnsProxyListener::ResNSendCommand::runCommand(SocketClient* cli, int argc, char** argv) {
     logArguments(argc, argv);
 
     const uid_t uid = cli->getUid();
+    std::optional<uint32_t> tag;
+    if (mTagged) {
+        uint32_t id;
+        if (argc < 2 || !simpleStrtoul(argv[1], &id) || id == DNSPROXYD_INVALID_TAG) {
+            LOG(WARNING) << "ResNSendCommand::runCommand: resnsendtagged: from UID " << uid
+                         << ", invalid tag";
+            sendResNSendError(cli, DNSPROXYD_INVALID_TAG, -EINVAL);
+            return -1;
+        }
+        tag = id;
+        // The rest is a resnsend command.
+        argc--;
+        argv++;
+    }
+
     if (argc != 4) {
         LOG(WARNING) << "ResNSendCommand::runCommand: resnsend: from UID " << uid
                      << ", invalid number of arguments to resnsend: " << argc;
-        sendBE32(cli, -EINVAL);
+        sendResNSendError(cli, tag, -EINVAL);
         return -1;
     }
 
@@ -872,7 +1113,7 @@ int DnsProxyListener::ResNSendCommand::runCommand(SocketClient* cli, int argc, c
     if (!simpleStrtoul(argv[1], &netId)) {
         LOG(WARNING) << "ResNSendCommand::runCommand: resnsend: from UID " << uid
                      << ", invalid netId";
-        sendBE32(cli, -EINVAL);
+        sendResNSendError(cli, tag, -EINVAL);
         return -1;
     }
 
@@ -880,121 +1121,274 @@ int DnsProxyListener::ResNSendCommand::runCommand(SocketClient* cli, int argc, c
     if (!simpleStrtoul(argv[2], &flags)) {
         LOG(WARNING) << "ResNSendCommand::runCommand: resnsend: from UID " << uid
                      << ", invalid flags";
-        sendBE32(cli, -EINVAL);
+        sendResNSendError(cli, tag, -EINVAL);
         return -1;
     }
 
+    // Base64 decodes to fewer bytes than it's made of.
+    std::vector<uint8_t> msg(strlen(argv[3]));
+    const int msgLen = b64_pton(argv[3], msg.data(), msg.size());
+    if (msgLen == -1) {
+        sendResNSendError(cli, tag, -EILSEQ);
+        return -1;
+    }
+    msg.resize(msgLen);
+
+    startResNSend(cli, netId, flags, std::move(msg), tag);
+    return 0;
+}
+
+void DnsProxyListener::startResNSend(SocketClient* c, unsigned netId, uint32_t flags,
+                                     std::vector<uint8_t> query, std::optional<uint32_t> tag) {
     const bool useLocalNameservers = checkAndClearUseLocalNameserversFlag(&netId);
 
     android_net_context netcontext;
-    gResNetdCallbacks.get_network_context(netId, uid, &netcontext);
+    gResNetdCallbacks.get_network_context(netId, c->getUid(), &netcontext);
 
     if (useLocalNameservers) {
         netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
     }
 
-    (new ResNSendHandler(cli, argv[3], flags, netcontext))->spawn();
-    return 0;
+    auto* handler = new ResNSendHandler(c, std::move(query), flags, netcontext, tag);
+    if (handler->runFromCache()) {
+        delete handler;
+        return;
+    }
+    handler->spawn();
 }
 
-DnsProxyListener::ResNSendHandler::ResNSendHandler(SocketClient* c, std::string msg, uint32_t flags,
-                                                   const android_net_context& netcontext)
-    : Handler(c), mMsg(std::move(msg)), mFlags(flags), mNetContext(netcontext) {}
+bool DnsProxyListener::onDataAvailable(SocketClient* c) {
+    if (mShards != nullptr) {
+        // The listener forgets the client without closing it, as the shard holds a reference.
+        // What the client sent is left for the shard to read.
+        mShards->adopt(c);
+        return false;
+    }
+    return serve(c, nullptr);
+}
+
+bool DnsProxyListener::serve(SocketClient* c, CommandDispatcher* dispatcher) {
+    std::vector<uint8_t> buf;
+    bool framed = false;
+    {
+        std::lock_guard guard(mPartialFramesMutex);
+        if (auto node = mPartialFrames.extract(c); !node.empty()) {
+            buf = std::move(node.mapped());
+            framed = true;
+        }
+    }
+    if (!framed) {
+        // No command starts with a byte that isn't ASCII.
+        uint8_t first;
+        if (TEMP_FAILURE_RETRY(recv(c->getSocket(), &first, 1, MSG_PEEK | MSG_DONTWAIT)) != 1 ||
+            first != DNSPROXYD_RESNSEND_FRAME_MAGIC) {
+            return dispatcher != nullptr ? dispatcher->dispatch(c)
+                                         : FrameworkListener::onDataAvailable(c);
+        }
+    }
+    const bool open = readFrames(c, &buf);
+    // A client is only tracked while it's in the middle of a frame, so that a new client that
+    // gets the address of one that's gone doesn't inherit its state.
+    if (open && !buf.empty()) {
+        std::lock_guard guard(mPartialFramesMutex);
+        mPartialFrames[c] = std::move(buf);
+    }
+    return open;
+}
+
+bool DnsProxyListener::readFrames(SocketClient* c, std::vector<uint8_t>* buf) {
+    constexpr size_t kReadSize = DNSPROXYD_RESNSEND_FRAME_HEADER_SIZE + DNSPROXYD_MAX_FRAMED_QUERY;
+    const size_t partial = buf->size();
+    buf->resize(partial + kReadSize);
+    const ssize_t n =
+            TEMP_FAILURE_RETRY(recv(c->getSocket(), buf->data() + partial, kReadSize, 0));
+    if (n <= 0) return false;
+    buf->resize(partial + n);
+
+    size_t pos = 0;
+    while (buf->size() - pos >= DNSPROXYD_RESNSEND_FRAME_HEADER_SIZE) {
+        const uint8_t* const frame = buf->data() + pos;
+        if (frame[0] != DNSPROXYD_RESNSEND_FRAME_MAGIC || frame[1] != 0) {
+            LOG(WARNING) << __func__ << ": from UID " << c->getUid() << ", bad frame magic";
+            return false;
+        }
+        const size_t queryLen = ns_get16(frame + 2);
+        const uint32_t tag = ns_get32(frame + 4);
+        if (queryLen > DNSPROXYD_MAX_FRAMED_QUERY || tag == DNSPROXYD_INVALID_TAG) {
+            LOG(WARNING) << __func__ << ": from UID " << c->getUid() << ", bad frame of length "
+                         << queryLen;
+            sendResNSendError(c, tag, -EINVAL);
+            return false;
+        }
+        const size_t frameLen = DNSPROXYD_RESNSEND_FRAME_HEADER_SIZE + queryLen;
+        if (buf->size() - pos < frameLen) break;
+        startResNSend(c, ns_get32(frame + 8), ns_get32(frame + 12),
+                      {frame + DNSPROXYD_RESNSEND_FRAME_HEADER_SIZE, frame + frameLen}, tag);
+        pos += frameLen;
+    }
+    buf->erase(buf->begin(), buf->begin() + pos);
+    return true;
+}
+
+DnsProxyListener::ResNSendHandler::ResNSendHandler(SocketClient* c, std::vector<uint8_t> msg,
+                                                   uint32_t flags,
+                                                   const android_net_context& netcontext,
+                                                   std::optional<uint32_t> tag)
+    : Handler(c), mMsg(std::move(msg)), mFlags(flags), mNetContext(netcontext), mTag(tag) {}
+
+namespace {
+
+// The client's end of a resnsend query, which outlives its handler when the query is answered
+// asynchronously.
+struct ResNSendReply {
+    ResNSendReply(SocketClient* c, const android_net_context& netcontext, uint32_t flags,
+                  std::optional<uint32_t> tag)
+        : client(c), netContext(netcontext), flags(flags), tag(tag) {
+        client->incRef();
+    }
+    ~ResNSendReply() { client->decRef(); }
+    ResNSendReply(const ResNSendReply&) = delete;
+    ResNSendReply& operator=(const ResNSendReply&) = delete;
+
+    // Sends the answer, or the error, to the client and reports the query.
+    void send(int ansLen, int rcode);
+
+    SocketClient* const client;
+    android_net_context netContext;
+    const uint32_t flags;
+    const std::optional<uint32_t> tag;
+    Stopwatch stopwatch;
+    int rrType = 0;
+    std::string rrName;
+    uint16_t originalQueryId = 0;
+    // The reply may be sent from another thread than the one that made it, so its event has an
+    // arena of its own rather than that of the thread.
+    google::protobuf::Arena arena;
+    NetworkDnsEventReported* const event =
+            google::protobuf::Arena::CreateMessage<NetworkDnsEventReported>(&arena);
+    PacketBuffer ansBuf;
+    // Until the answer is sent, whichever thread sends it.
+    std::optional<ScopedInflightQuery> inflight;
+};
+
+void ResNSendReply::send(int ansLen, int rcode) {
+    const uid_t uid = client->getUid();
+    const int32_t latencyUs = saturate_cast<int32_t>(stopwatch.timeTakenUs());
+    event->set_latency_micros(latencyUs);
+    event->set_event_type(EVENT_RES_NSEND);
+    event->set_res_nsend_flags(static_cast<ResNsendFlags>(flags));
+
+    // Fail, send -errno
+    if (ansLen < 0) {
+        bool sent;
+        {
+            ScopedStageTimer timer(QueryStage::RESPONSE_WRITE);
+            sent = sendResNSendError(client, tag, ansLen);
+        }
+        if (!sent) {
+            PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send errno to uid " << uid
+                          << " pid " << client->getPid();
+        }
+        if (rrType == ns_t_a || rrType == ns_t_aaaa) {
+            reportDnsEvent(INetdEventListener::EVENT_RES_NSEND, netContext, latencyUs,
+                           resNSendToAiError(ansLen, rcode), *event, rrName);
+        }
+        return;
+    }
+
+    // Restore query id, then send rcode and answer in one write, so that the answers to other
+    // queries on the same socket can't come in between.
+    const bool restored = setQueryId({ansBuf.data(), ansLen}, originalQueryId);
+    std::vector<uint8_t> buf;
+    if (tag) appendBE32(&buf, *tag);
+    appendBE32(&buf, rcode);
+    appendLenAndData(&buf, ansLen, ansBuf.data());
+    bool sent = false;
+    if (restored) {
+        ScopedStageTimer timer(QueryStage::RESPONSE_WRITE);
+        sent = client->sendData(buf.data(), buf.size()) == 0;
+    }
+    if (!sent) {
+        PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send answer to uid " << uid
+                      << " pid " << client->getPid();
+        return;
+    }
+
+    if (rrType == ns_t_a || rrType == ns_t_aaaa) {
+        std::vector<std::string> ip_addrs;
+        const int total_ip_addr_count =
+                extractResNsendAnswers({ansBuf.data(), ansLen}, rrType, &ip_addrs);
+        reportDnsEvent(INetdEventListener::EVENT_RES_NSEND, netContext, latencyUs,
+                       resNSendToAiError(ansLen, rcode), *event, rrName, ip_addrs,
+                       total_ip_addr_count);
+    }
+}
+
+}  // namespace
 
 void DnsProxyListener::ResNSendHandler::run() {
     LOG(DEBUG) << "ResNSendHandler::run: " << mFlags << " / {" << mNetContext.app_netid << " "
                << mNetContext.app_mark << " " << mNetContext.dns_netid << " "
                << mNetContext.dns_mark << " " << mNetContext.uid << " " << mNetContext.flags << "}";
 
-    Stopwatch s;
-    maybeFixupNetContext(&mNetContext, mClient->getPid());
+    ATRACE_CALL();
+    ScopedQueryTrace trace;
+    ScopedCancellationToken cancellation(mClient);
+    auto reply = std::make_unique<ResNSendReply>(mClient, mNetContext, mFlags, mTag);
+    maybeFixupNetContext(&reply->netContext, mClient->getPid());
+    reply->inflight.emplace(reply->netContext.dns_netid);
 
-    // Decode
-    std::vector<uint8_t> msg(MAXPACKET, 0);
-
-    // Max length of mMsg is less than 1024 since the CMD_BUF_SIZE in FrameworkListener is 1024
-    int msgLen = b64_pton(mMsg.c_str(), msg.data(), MAXPACKET);
-    if (msgLen == -1) {
-        // Decode fail
-        sendBE32(mClient, -EILSEQ);
-        return;
-    }
+    // Kept until the query is answered, as res_nsend() doesn't copy it. A copy, since the ID of
+    // the query is changed and run() may be called again if the cache misses.
+    auto msg = std::make_shared<std::vector<uint8_t>>(mMsg);
+    const int msgLen = msg->size();
 
     const uid_t uid = mClient->getUid();
-    int rr_type = 0;
-    std::string rr_name;
-    uint16_t original_query_id = 0;
 
     // TODO: Handle the case which is msg contains more than one query
-    if (!parseQuery({msg.data(), msgLen}, &original_query_id, &rr_type, &rr_name) ||
-        !setQueryId({msg.data(), msgLen}, arc4random_uniform(65536))) {
+    if (!parseQuery({msg->data(), msgLen}, &reply->originalQueryId, &reply->rrType,
+                    &reply->rrName) ||
+        !setQueryId({msg->data(), msgLen}, arc4random_uniform(65536))) {
         // If the query couldn't be parsed, block the request.
         LOG(WARNING) << "ResNSendHandler::run: resnsend: from UID " << uid << ", invalid query";
-        sendBE32(mClient, -EINVAL);
+        sendResNSendError(mClient, mTag, -EINVAL);
         return;
     }
 
     // Send DNS query
-    std::vector<uint8_t> ansBuf(MAXPACKET, 0);
     int rcode = ns_r_noerror;
     int ansLen = -1;
-    NetworkDnsEventReported event;
-    initDnsEvent(&event, mNetContext);
-    if (queryLimiter.start(uid)) {
-        if (evaluate_domain_name(mNetContext, rr_name.c_str())) {
-            ansLen = resolv_res_nsend(&mNetContext, {msg.data(), msgLen}, ansBuf, &rcode,
-                                      static_cast<ResNsendFlags>(mFlags), &event);
+    initDnsEvent(reply->event, reply->netContext);
+    if (queryLimiter.start(uid, isBackgroundQuery(uid))) {
+        if (evaluate_domain_name(reply->netContext, reply->rrName.c_str())) {
+            if (Experiments::getInstance()->getFlag("async_resnsend", 0) == 1 &&
+                ScopedCacheOnlyLookup::current() == nullptr) {
+                // Whoever answers the query, it now owns the reply.
+                ResNSendReply* pending = reply.get();
+                if (resolv_res_nsend_async(&pending->netContext, {msg->data(), msgLen},
+                                           pending->ansBuf, pending->flags, pending->event,
+                                           [pending, msg, uid](int resplen, int rcode) {
+                                               std::unique_ptr<ResNSendReply> owned(pending);
+                                               queryLimiter.finish(uid);
+                                               owned->send(resplen, rcode);
+                                           })) {
+                    reply.release();
+                    return;
+                }
+            }
+            ansLen = resolv_res_nsend(&reply->netContext, {msg->data(), msgLen}, reply->ansBuf,
+                                      &rcode, static_cast<ResNsendFlags>(mFlags), reply->event);
         } else {
             ansLen = -EAI_SYSTEM;
         }
-        queryLimiter.finish(uid);
+        finishQuery(uid);
     } else {
         LOG(WARNING) << "ResNSendHandler::run: resnsend: from UID " << uid
                      << ", max concurrent queries reached";
         ansLen = -EBUSY;
     }
-
-    const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
-    event.set_latency_micros(latencyUs);
-    event.set_event_type(EVENT_RES_NSEND);
-    event.set_res_nsend_flags(static_cast<ResNsendFlags>(mFlags));
-
-    // Fail, send -errno
-    if (ansLen < 0) {
-        if (!sendBE32(mClient, ansLen)) {
-            PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send errno to uid " << uid
-                          << " pid " << mClient->getPid();
-        }
-        if (rr_type == ns_t_a || rr_type == ns_t_aaaa) {
-            reportDnsEvent(INetdEventListener::EVENT_RES_NSEND, mNetContext, latencyUs,
-                           resNSendToAiError(ansLen, rcode), event, rr_name);
-        }
-        return;
-    }
-
-    // Send rcode
-    if (!sendBE32(mClient, rcode)) {
-        PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send rcode to uid " << uid
-                      << " pid " << mClient->getPid();
-        return;
-    }
-
-    // Restore query id and send answer
-    if (!setQueryId({ansBuf.data(), ansLen}, original_query_id) ||
-        !sendLenAndData(mClient, ansLen, ansBuf.data())) {
-        PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send answer to uid " << uid
-                      << " pid " << mClient->getPid();
-        return;
-    }
-
-    if (rr_type == ns_t_a || rr_type == ns_t_aaaa) {
-        std::vector<std::string> ip_addrs;
-        const int total_ip_addr_count =
-                extractResNsendAnswers({ansBuf.data(), ansLen}, rr_type, &ip_addrs);
-        reportDnsEvent(INetdEventListener::EVENT_RES_NSEND, mNetContext, latencyUs,
-                       resNSendToAiError(ansLen, rcode), event, rr_name, ip_addrs,
-                       total_ip_addr_count);
-    }
+    if (missedCache()) return;
+    reply->send(ansLen, rcode);
 }
 
 std::string DnsProxyListener::ResNSendHandler::threadName() {
@@ -1102,14 +1496,14 @@ void DnsProxyListener::GetHostByNameHandler::doDns64Synthesis(int32_t* rv, hoste
         return;
     }
 
-    netdutils::IPPrefix prefix{};
+    in6_addr prefix;
     if (!getDns64Prefix(mNetContext.dns_netid, &prefix)) {
         return;
     }
 
     // If caller wants IPv6 answers but no data, try to query IPv4 answers for synthesis
     const uid_t uid = mClient->getUid();
-    if (queryLimiter.start(uid)) {
+    if (queryLimiter.start(uid, isBackgroundQuery(uid))) {
         const char* name = mName.starts_with('^') ? nullptr : mName.c_str();
         *rv = resolv_gethostbyname(name, AF_INET, hbuf, buf, buflen, &mNetContext, hpp, event);
         queryLimiter.finish(uid);
@@ -1122,7 +1516,9 @@ void DnsProxyListener::GetHostByNameHandler::doDns64Synthesis(int32_t* rv, hoste
         return;
     }
 
-    if (!synthesizeNat64PrefixWithARecord(prefix, *hpp)) {
+    if (synthesizeNat64(prefix, *hpp)) {
+        logDnsQueryResult(*hpp);
+    } else {
         // If caller wants IPv6 answers but no data and failed to synthesize IPv4 answers,
         // don't return the IPv4 answers.
         *hpp = nullptr;
@@ -1130,20 +1526,24 @@ void DnsProxyListener::GetHostByNameHandler::doDns64Synthesis(int32_t* rv, hoste
 }
 
 void DnsProxyListener::GetHostByNameHandler::run() {
+    ATRACE_CALL();
+    ScopedQueryTrace trace;
+    ScopedCancellationToken cancellation(mClient);
     Stopwatch s;
     maybeFixupNetContext(&mNetContext, mClient->getPid());
+    ScopedInflightQuery inflight(mNetContext.dns_netid);
     const uid_t uid = mClient->getUid();
     hostent* hp = nullptr;
     hostent hbuf;
     char tmpbuf[MAXPACKET];
     int32_t rv = 0;
-    NetworkDnsEventReported event;
-    initDnsEvent(&event, mNetContext);
-    if (queryLimiter.start(uid)) {
+    ScopedDnsEvent event;
+    initDnsEvent(event.get(), mNetContext);
+    if (queryLimiter.start(uid, isBackgroundQuery(uid))) {
         const char* name = mName.starts_with('^') ? nullptr : mName.c_str();
         if (evaluate_domain_name(mNetContext, name)) {
             rv = resolv_gethostbyname(name, mAf, &hbuf, tmpbuf, sizeof tmpbuf, &mNetContext, &hp,
-                                      &event);
+                                      event.get());
         } else {
             rv = EAI_SYSTEM;
         }
@@ -1154,10 +1554,13 @@ void DnsProxyListener::GetHostByNameHandler::run() {
                    << ", max concurrent queries reached";
     }
 
-    doDns64Synthesis(&rv, &hbuf, tmpbuf, sizeof tmpbuf, &hp, &event);
+    {
+        ScopedStageTimer timer(QueryStage::DNS64);
+        doDns64Synthesis(&rv, &hbuf, tmpbuf, sizeof tmpbuf, &hp, event.get());
+    }
     const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
-    event.set_latency_micros(latencyUs);
-    event.set_event_type(EVENT_GETHOSTBYNAME);
+    event->set_latency_micros(latencyUs);
+    event->set_event_type(EVENT_GETHOSTBYNAME);
 
     if (rv) {
         LOG(DEBUG) << "GetHostByNameHandler::run: result failed: " << gai_strerror(rv);
@@ -1166,9 +1569,11 @@ void DnsProxyListener::GetHostByNameHandler::run() {
     bool success = true;
     if (hp) {
         // hp is not nullptr iff. rv is 0.
+        ScopedStageTimer timer(QueryStage::RESPONSE_WRITE);
         success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
         success &= sendhostent(mClient, hp);
     } else {
+        ScopedStageTimer timer(QueryStage::RESPONSE_WRITE);
         success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, nullptr, 0) == 0;
     }
 
@@ -1179,7 +1584,7 @@ void DnsProxyListener::GetHostByNameHandler::run() {
 
     std::vector<std::string> ip_addrs;
     const int total_ip_addr_count = extractGetHostByNameAnswers(hp, &ip_addrs);
-    reportDnsEvent(INetdEventListener::EVENT_GETHOSTBYNAME, mNetContext, latencyUs, rv, event,
+    reportDnsEvent(INetdEventListener::EVENT_GETHOSTBYNAME, mNetContext, latencyUs, rv, *event,
                    mName, ip_addrs, total_ip_addr_count);
 }
 
@@ -1251,36 +1656,30 @@ void DnsProxyListener::GetHostByAddrHandler::doDns64ReverseLookup(hostent* hbuf,
         return;
     }
 
-    netdutils::IPPrefix prefix{};
+    in6_addr prefix;
     if (!getDns64Prefix(mNetContext.dns_netid, &prefix)) {
         return;
     }
 
-    if (!isValidNat64Prefix(prefix)) {
-        return;
-    }
-
-    struct sockaddr_storage ss = netdutils::IPSockAddr(prefix.ip());
-    struct sockaddr_in6* v6prefix = (struct sockaddr_in6*)&ss;
     struct in6_addr v6addr = mAddress;
     // Check if address has NAT64 prefix. Only /96 IPv6 NAT64 prefixes are supported
-    if ((v6addr.s6_addr32[0] != v6prefix->sin6_addr.s6_addr32[0]) ||
-        (v6addr.s6_addr32[1] != v6prefix->sin6_addr.s6_addr32[1]) ||
-        (v6addr.s6_addr32[2] != v6prefix->sin6_addr.s6_addr32[2])) {
+    if ((v6addr.s6_addr32[0] != prefix.s6_addr32[0]) ||
+        (v6addr.s6_addr32[1] != prefix.s6_addr32[1]) ||
+        (v6addr.s6_addr32[2] != prefix.s6_addr32[2])) {
         return;
     }
 
     const uid_t uid = mClient->getUid();
-    if (queryLimiter.start(uid)) {
+    if (queryLimiter.start(uid, isBackgroundQuery(uid))) {
         // Remove NAT64 prefix and do reverse DNS query
         struct in_addr v4addr = {.s_addr = v6addr.s6_addr32[3]};
         resolv_gethostbyaddr(&v4addr, sizeof(v4addr), AF_INET, hbuf, buf, buflen, &mNetContext, hpp,
                              event);
-        queryLimiter.finish(uid);
+        finishQuery(uid);
         if (*hpp) {
             // Replace IPv4 address with original queried IPv6 address in place. The space has
-            // reserved by dns_gethtbyaddr() and netbsd_gethostent_r() in
-            // system/netd/resolv/gethnamaddr.cpp.
+            // reserved by dns_gethtbyaddr() in system/netd/resolv/gethnamaddr.cpp and
+            // hostent_from_entry() in system/netd/resolv/sethostent.cpp.
             // Note that resolv_gethostbyaddr() returns only one entry in result.
             memcpy((*hpp)->h_addr_list[0], &v6addr, sizeof(v6addr));
             (*hpp)->h_addrtype = AF_INET6;
@@ -1291,55 +1690,193 @@ void DnsProxyListener::GetHostByAddrHandler::doDns64ReverseLookup(hostent* hbuf,
     }
 }
 
-void DnsProxyListener::GetHostByAddrHandler::run() {
+int32_t DnsProxyListener::GetHostByAddrHandler::resolve(hostent* hbuf, char* buf, size_t buflen,
+                                                        hostent** hpp,
+                                                        NetworkDnsEventReported* event) {
     Stopwatch s;
     maybeFixupNetContext(&mNetContext, mClient->getPid());
+    ScopedInflightQuery inflight(mNetContext.dns_netid);
     const uid_t uid = mClient->getUid();
-    hostent* hp = nullptr;
-    hostent hbuf;
-    char tmpbuf[MAXPACKET];
     int32_t rv = 0;
-    NetworkDnsEventReported event;
-    initDnsEvent(&event, mNetContext);
-    if (queryLimiter.start(uid)) {
-        rv = resolv_gethostbyaddr(&mAddress, mAddressLen, mAddressFamily, &hbuf, tmpbuf,
-                                  sizeof tmpbuf, &mNetContext, &hp, &event);
-        queryLimiter.finish(uid);
+    initDnsEvent(event, mNetContext);
+    if (queryLimiter.start(uid, isBackgroundQuery(uid))) {
+        rv = resolv_gethostbyaddr(&mAddress, mAddressLen, mAddressFamily, hbuf, buf, buflen,
+                                  &mNetContext, hpp, event);
+        finishQuery(uid);
     } else {
         rv = EAI_MEMORY;
         LOG(ERROR) << "GetHostByAddrHandler::run: from UID " << uid
                    << ", max concurrent queries reached";
     }
 
-    doDns64ReverseLookup(&hbuf, tmpbuf, sizeof tmpbuf, &hp, &event);
-    const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
-    event.set_latency_micros(latencyUs);
-    event.set_event_type(EVENT_GETHOSTBYADDR);
+    {
+        ScopedStageTimer timer(QueryStage::DNS64);
+        doDns64ReverseLookup(hbuf, buf, buflen, hpp, event);
+    }
+    event->set_latency_micros(saturate_cast<int32_t>(s.timeTakenUs()));
+    event->set_event_type(EVENT_GETHOSTBYADDR);
 
     if (rv) {
         LOG(DEBUG) << "GetHostByAddrHandler::run: result failed: " << gai_strerror(rv);
     }
+    return rv;
+}
+
+void DnsProxyListener::GetHostByAddrHandler::report(int32_t rv, const hostent* hp,
+                                                    NetworkDnsEventReported& event) {
+    reportDnsEvent(INetdEventListener::EVENT_GETHOSTBYADDR, mNetContext, event.latency_micros(),
+                   rv, event, (hp && hp->h_name) ? hp->h_name : "null", {}, 0);
+}
+
+void DnsProxyListener::GetHostByAddrHandler::run() {
+    ATRACE_CALL();
+    ScopedQueryTrace trace;
+    ScopedCancellationToken cancellation(mClient);
+    hostent* hp = nullptr;
+    hostent hbuf;
+    char tmpbuf[MAXPACKET];
+    ScopedDnsEvent event;
+    const int32_t rv = resolve(&hbuf, tmpbuf, sizeof tmpbuf, &hp, event.get());
 
     bool success = true;
     if (hp) {
+        ScopedStageTimer timer(QueryStage::RESPONSE_WRITE);
         success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
         success &= sendhostent(mClient, hp);
     } else {
+        ScopedStageTimer timer(QueryStage::RESPONSE_WRITE);
         success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, nullptr, 0) == 0;
     }
 
     if (!success) {
-        PLOG(WARNING) << "GetHostByAddrHandler::run: Error writing DNS result to client uid " << uid
-                      << " pid " << mClient->getPid();
+        PLOG(WARNING) << "GetHostByAddrHandler::run: Error writing DNS result to client uid "
+                      << mClient->getUid() << " pid " << mClient->getPid();
     }
 
-    reportDnsEvent(INetdEventListener::EVENT_GETHOSTBYADDR, mNetContext, latencyUs, rv, event,
-                   (hp && hp->h_name) ? hp->h_name : "null", {}, 0);
+    report(rv, hp, *event);
 }
 
 std::string DnsProxyListener::GetHostByAddrHandler::threadName() {
     return makeThreadName(mNetContext.dns_netid, mClient->getUid());
 }
 
+/*******************************************************
+ *                  GetHostByAddrBatch                 *
+ *******************************************************/
+DnsProxyListener::GetHostByAddrBatchCmd::GetHostByAddrBatchCmd()
+    : FrameworkCommand("gethostbyaddrbatch") {}
+
+int DnsProxyListener::GetHostByAddrBatchCmd::runCommand(SocketClient* cli, int argc,
+                                                        char** argv) {
+    logArguments(argc, argv);
+
+    if (argc != 3) {
+        char* msg = nullptr;
+        asprintf(&msg, "Invalid number of arguments to gethostbyaddrbatch: %i", argc);
+        LOG(WARNING) << "GetHostByAddrBatchCmd::runCommand: " << (msg ? msg : "null");
+        cli->sendMsg(ResponseCode::CommandParameterError, msg, false);
+        free(msg);
+        return -1;
+    }
+
+    unsigned netId = strtoul(argv[1], nullptr, 10);
+    const bool useLocalNameservers = checkAndClearUseLocalNameserversFlag(&netId);
+
+    std::vector<GetHostByAddrBatchHandler::Address> addresses;
+    for (const std::string& addrStr : android::base::Split(argv[2], ",")) {
+        GetHostByAddrBatchHandler::Address address = {};
+        if (inet_pton(AF_INET, addrStr.c_str(), &address.addr) == 1) {
+            address.len = sizeof(in_addr);
+            address.family = AF_INET;
+        } else if (inet_pton(AF_INET6, addrStr.c_str(), &address.addr) == 1) {
+            address.len = sizeof(in6_addr);
+            address.family = AF_INET6;
+        } else {
+            address.family = AF_UNSPEC;
+        }
+        if (address.family == AF_UNSPEC || addresses.size() == DNSPROXYD_MAX_BATCH_ADDRS) {
+            char* msg = nullptr;
+            asprintf(&msg, "Invalid address \"%s\", or more than %d", addrStr.c_str(),
+                     DNSPROXYD_MAX_BATCH_ADDRS);
+            LOG(WARNING) << "GetHostByAddrBatchCmd::runCommand: " << (msg ? msg : "null");
+            cli->sendMsg(ResponseCode::CommandParameterError, msg, false);
+            free(msg);
+            return -1;
+        }
+        addresses.push_back(address);
+    }
+
+    android_net_context netcontext;
+    gResNetdCallbacks.get_network_context(netId, cli->getUid(), &netcontext);
+
+    if (useLocalNameservers) {
+        netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
+    }
+
+    (new GetHostByAddrBatchHandler(cli, std::move(addresses), netcontext))->spawn();
+    return 0;
+}
+
+DnsProxyListener::GetHostByAddrBatchHandler::GetHostByAddrBatchHandler(
+        SocketClient* c, std::vector<Address> addresses, const android_net_context& netcontext)
+    : Handler(c), mAddresses(std::move(addresses)), mNetContext(netcontext) {}
+
+void DnsProxyListener::GetHostByAddrBatchHandler::run() {
+    ATRACE_CALL();
+    if (mClient->sendCode(ResponseCode::DnsProxyQueryResult)) {
+        PLOG(WARNING) << "GetHostByAddrBatchHandler::run: Error writing DNS result to client uid "
+                      << mClient->getUid() << " pid " << mClient->getPid();
+        return;
+    }
+
+    // What the hosts file and the cache know goes out first, without a thread per address.
+    std::vector<uint32_t> misses;
+    for (uint32_t i = 0; i < mAddresses.size(); i++) {
+        ScopedCacheOnlyLookup cacheOnly;
+        if (!resolveOne(i)) misses.push_back(i);
+    }
+
+    // The others are looked up a few at a time, so that a large batch neither takes a thread per
+    // address nor most of the query limit of its app.
+    runBatchLookups(
+            misses.size(), [this, &misses](size_t i) { resolveOne(misses[i]); }, threadName());
+}
+
+bool DnsProxyListener::GetHostByAddrBatchHandler::resolveOne(uint32_t index) {
+    ScopedCancellationToken cancellation(mClient);
+    const Address& address = mAddresses[index];
+    GetHostByAddrHandler handler(mClient, address.addr, address.len, address.family,
+                                 mNetContext);
+    hostent* hp = nullptr;
+    hostent hbuf;
+    char tmpbuf[MAXPACKET];
+    ScopedDnsEvent event;
+    int32_t rv = handler.resolve(&hbuf, tmpbuf, sizeof tmpbuf, &hp, event.get());
+    if (missedCache()) return false;
+    // DNS64 may have found what the lookup of the address itself didn't.
+    if (hp != nullptr) {
+        rv = 0;
+    } else if (rv == 0) {
+        rv = EAI_NODATA;
+    }
+
+    // One write per result, so that those of concurrent lookups don't interleave.
+    std::vector<uint8_t> buf;
+    appendBE32(&buf, index);
+    appendBE32(&buf, rv);
+    if (hp != nullptr) appendhostent(&buf, hp);
+    if (mClient->sendData(buf.data(), buf.size())) {
+        PLOG(WARNING) << "GetHostByAddrBatchHandler::run: Error writing DNS result to client uid "
+                      << mClient->getUid() << " pid " << mClient->getPid();
+    }
+
+    handler.report(rv, hp, *event);
+    return true;
+}
+
+std::string DnsProxyListener::GetHostByAddrBatchHandler::threadName() {
+    return makeThreadName(mNetContext.dns_netid, mClient->getUid());
+}
+
 }  // namespace net
 }  // namespace android
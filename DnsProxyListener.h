@@ -16,12 +16,21 @@
 
 #pragma once
 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <vector>
 
+#include <android-base/thread_annotations.h>
 #include <netd_resolv/resolv.h>  // android_net_context
+#include <netdutils/DumpWriter.h>
 #include <sysutils/FrameworkCommand.h>
 #include <sysutils/FrameworkListener.h>
 
+#include "ClientShards.h"
+
 struct addrinfo;
 struct hostent;
 
@@ -37,17 +46,64 @@ class DnsProxyListener : public FrameworkListener {
 
     static constexpr const char* SOCKET_NAME = "dnsproxyd";
 
+    void dump(netdutils::DumpWriter& dw) const;
+
+  protected:
+    // With the "listener_shards" flag, hands the client over to a shard on its first request;
+    // otherwise serves it on the listener thread.
+    bool onDataAvailable(SocketClient* c) override;
+
   private:
+    // Parses the commands of the clients of a shard. FrameworkListener keeps parsing state across
+    // reads, so each shard has its own. Never started: it only parses what it's given.
+    class CommandDispatcher : public FrameworkListener {
+      public:
+        CommandDispatcher();
+        bool dispatch(SocketClient* c) { return FrameworkListener::onDataAvailable(c); }
+    };
+
+    // The commands that a listener registers.
+    static std::vector<FrameworkCommand*> makeCommands();
+
+    // Reads the resnsend frames of |c| if it sends frames, or its commands, which |dispatcher|
+    // parses, or the listener itself if it's null. Returns false if |c| is to be dropped.
+    bool serve(SocketClient* c, CommandDispatcher* dispatcher);
+
+    // Reads what |c| sent of its frames after the partial frame in |buf|, and starts the queries
+    // of the complete ones. Returns false if |c| closed the socket or sent a bad frame.
+    bool readFrames(SocketClient* c, std::vector<uint8_t>* buf);
+
+    // Answers a resnsend query, from the cache if it can, or on a worker thread.
+    static void startResNSend(SocketClient* c, unsigned netId, uint32_t flags,
+                              std::vector<uint8_t> query, std::optional<uint32_t> tag);
+
+    // What clients sent of frames they haven't finished sending. Each client is served by one
+    // thread at a time, the listener thread or its shard, which takes its entry out meanwhile.
+    std::mutex mPartialFramesMutex;
+    std::map<SocketClient*, std::vector<uint8_t>> mPartialFrames GUARDED_BY(mPartialFramesMutex);
+
+    // With the "listener_shards" flag, a dispatcher per shard, and the shards, which serve the
+    // clients instead of the listener thread. Declared after what they use, so that they stop
+    // first.
+    std::vector<std::unique_ptr<CommandDispatcher>> mDispatchers;
+    std::unique_ptr<ClientShards> mShards;
+
     class Handler {
       public:
         Handler(SocketClient* c) : mClient(c) { mClient->incRef(); }
         virtual ~Handler() { mClient->decRef(); }
         void operator=(const Handler&) = delete;
 
-        // Attept to spawn the worker thread, or return an error to the client.
+        // Attept to spawn the worker thread, or hand the handler to the QueryThreadPool if it's
+        // enabled, or return an error to the client.
         // The Handler instance will self-delete in either case.
         void spawn();
 
+        // With the "listener_cache_fast_path" flag, runs the handler on the calling thread,
+        // answering from the cache alone. Returns false, having sent nothing to the client, if the
+        // cache missed and the handler has to be spawn()ed after all.
+        bool runFromCache();
+
         virtual void run() = 0;
         virtual std::string threadName() = 0;
 
@@ -72,6 +128,12 @@ class DnsProxyListener : public FrameworkListener {
         void run() override;
         std::string threadName() override;
 
+        // Looks up the host, filling in |event|, without replying to the client. Returns 0 or an
+        // EAI_* error.
+        int32_t resolve(addrinfo** result, NetworkDnsEventReported* event);
+        // Reports the outcome of resolve() to the event listeners.
+        void report(int32_t rv, const addrinfo* result, NetworkDnsEventReported& event);
+
       private:
         void doDns64Synthesis(int32_t* rv, addrinfo** res, NetworkDnsEventReported* event);
 
@@ -81,6 +143,35 @@ class DnsProxyListener : public FrameworkListener {
         android_net_context mNetContext;
     };
 
+    /* ------ getaddrinfobatch ------*/
+    class GetAddrInfoBatchCmd : public FrameworkCommand {
+      public:
+        GetAddrInfoBatchCmd();
+        virtual ~GetAddrInfoBatchCmd() {}
+        int runCommand(SocketClient* c, int argc, char** argv) override;
+    };
+
+    // Looks up several hosts with the same service and hints at once, and sends each result as
+    // soon as it's known.
+    class GetAddrInfoBatchHandler : public Handler {
+      public:
+        GetAddrInfoBatchHandler(SocketClient* c, std::vector<std::string> hosts,
+                                std::string service, std::unique_ptr<addrinfo> hints,
+                                const android_net_context& netcontext);
+        ~GetAddrInfoBatchHandler() override = default;
+
+        void run() override;
+        std::string threadName() override;
+
+      private:
+        void resolveOne(uint32_t index);
+
+        std::vector<std::string> mHosts;
+        std::string mService;
+        std::unique_ptr<addrinfo> mHints;
+        android_net_context mNetContext;
+    };
+
     /* ------ gethostbyname ------*/
     class GetHostByNameCmd : public FrameworkCommand {
       public:
@@ -124,6 +215,13 @@ class DnsProxyListener : public FrameworkListener {
         void run() override;
         std::string threadName() override;
 
+        // Looks up the address, filling in |event|, without replying to the client. Returns 0 or
+        // an EAI_* error, and the result in |hpp| if there's one.
+        int32_t resolve(hostent* hbuf, char* buf, size_t buflen, hostent** hpp,
+                        NetworkDnsEventReported* event);
+        // Reports the outcome of resolve() to the event listeners.
+        void report(int32_t rv, const hostent* hp, NetworkDnsEventReported& event);
+
       private:
         void doDns64ReverseLookup(hostent* hbuf, char* buf, size_t buflen, hostent** hpp,
                                   NetworkDnsEventReported* event);
@@ -134,27 +232,67 @@ class DnsProxyListener : public FrameworkListener {
         android_net_context mNetContext;
     };
 
+    /* ------ gethostbyaddrbatch ------*/
+    class GetHostByAddrBatchCmd : public FrameworkCommand {
+      public:
+        GetHostByAddrBatchCmd();
+        virtual ~GetHostByAddrBatchCmd() {}
+        int runCommand(SocketClient* c, int argc, char** argv) override;
+    };
+
+    // Looks up several addresses at once: those that the hosts file or the cache answer right
+    // away, and the others a few at a time, sending each result as soon as it's known.
+    class GetHostByAddrBatchHandler : public Handler {
+      public:
+        struct Address {
+            in6_addr addr;
+            int len;
+            int family;
+        };
+
+        GetHostByAddrBatchHandler(SocketClient* c, std::vector<Address> addresses,
+                                  const android_net_context& netcontext);
+        ~GetHostByAddrBatchHandler() override = default;
+
+        void run() override;
+        std::string threadName() override;
+
+      private:
+        // Looks up address |index| and sends its result. Returns false, having sent nothing, if
+        // it was to be answered from the cache alone and missed it.
+        bool resolveOne(uint32_t index);
+
+        std::vector<Address> mAddresses;
+        android_net_context mNetContext;
+    };
+
     /* ------ resnsend ------*/
     class ResNSendCommand : public FrameworkCommand {
       public:
-        ResNSendCommand();
+        // A tagged command ("resnsendtagged") takes a tag that its answer is sent with, so that
+        // a client can have many queries in flight on one socket.
+        explicit ResNSendCommand(bool tagged);
         virtual ~ResNSendCommand() {}
         int runCommand(SocketClient* c, int argc, char** argv) override;
+
+      private:
+        const bool mTagged;
     };
 
     class ResNSendHandler : public Handler {
       public:
-        ResNSendHandler(SocketClient* c, std::string msg, uint32_t flags,
-                        const android_net_context& netcontext);
+        ResNSendHandler(SocketClient* c, std::vector<uint8_t> msg, uint32_t flags,
+                        const android_net_context& netcontext, std::optional<uint32_t> tag);
         ~ResNSendHandler() override = default;
 
         void run() override;
         std::string threadName() override;
 
       private:
-        std::string mMsg;
+        std::vector<uint8_t> mMsg;
         uint32_t mFlags;
         android_net_context mNetContext;
+        std::optional<uint32_t> mTag;
     };
 
     /* ------ getdnsnetid ------*/
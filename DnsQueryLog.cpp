@@ -17,38 +17,120 @@
 
 #include "DnsQueryLog.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+
 #include "util.h"
 
 namespace android::net {
 
 namespace {
 
-std::string maskHostname(const std::string& hostname) {
-    // Boundary issue is handled in substr().
-    return hostname.substr(0, 1) + "***";
+std::string maskHostname(char initial) {
+    return initial ? std::string(1, initial) + "***" : "***";
 }
 
 // Return the string of masked addresses of the first v4 address and the first v6 address.
-std::string maskIps(const std::vector<std::string>& ips) {
+std::string maskIps(const DnsQueryLog::Record::AddrPrefixes& prefixes) {
     std::string ret;
+    for (const auto& prefix : prefixes) {
+        if (prefix[0] == '\0') break;
+        if (!ret.empty()) ret += ", ";
+        ret += prefix.data();
+        ret += "***";
+    }
+    return ret;
+}
+
+}  // namespace
+
+DnsQueryLog::Record::Record(uint32_t netId, uid_t uid, pid_t pid, std::string_view hostname,
+                            const std::vector<std::string>& addrs, int timeTaken)
+    : netId(netId),
+      uid(uid),
+      pid(pid),
+      timeTaken(timeTaken),
+      timestamp(std::chrono::system_clock::now()),
+      hostnameInitial(hostname.empty() ? '\0' : hostname[0]) {
+    // Keep the first v4 address up to its first '.', and the first v6 address up to its first ':'.
+    size_t found = 0;
     bool v4Found = false, v6Found = false;
-    for (const auto& ip : ips) {
-        if (auto pos = ip.find_first_of(':'); pos != ip.npos && !v6Found) {
-            ret += ip.substr(0, pos + 1) + "***, ";
+    for (const auto& ip : addrs) {
+        size_t pos;
+        if (pos = ip.find_first_of(':'); pos != ip.npos && !v6Found) {
             v6Found = true;
-        } else if (auto pos = ip.find_first_of('.'); pos != ip.npos && !v4Found) {
-            ret += ip.substr(0, pos + 1) + "***, ";
+        } else if (pos = ip.find_first_of('.'); pos != ip.npos && !v4Found) {
             v4Found = true;
+        } else {
+            continue;
         }
-        if (v6Found && v4Found) break;
+        // Valid addresses fit; the prefixes of others are cut short.
+        const size_t len = std::min(pos + 1, kPrefixSize - 1);
+        memcpy(addrPrefixes[found].data(), ip.data(), len);
+        if (++found == addrPrefixes.size()) break;
     }
-    return ret.empty() ? "" : ret.substr(0, ret.length() - 2);
 }
 
-}  // namespace
-
 void DnsQueryLog::push(Record&& record) {
-    mQueue.push(std::move(record));
+    if (mCapacity == 0) return;
+    std::array<uint64_t, kRecordWords> words{};
+    memcpy(words.data(), &record, sizeof(record));
+
+    const uint64_t pos = mNext.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = mSlots[pos % mCapacity];
+    const uint64_t written = 2 * pos + 2;
+    uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+    while (true) {
+        // The log has wrapped around past this record already.
+        if (seq >= written) return;
+        // Only when the log wraps around while a record is being written into this slot.
+        if (seq & 1) {
+            std::this_thread::yield();
+            seq = slot.seq.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (slot.seq.compare_exchange_weak(seq, written - 1, std::memory_order_relaxed)) break;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kRecordWords; i++) {
+        slot.words[i].store(words[i], std::memory_order_relaxed);
+    }
+    slot.seq.store(written, std::memory_order_release);
+}
+
+std::vector<std::pair<uint64_t, DnsQueryLog::Record>> DnsQueryLog::readAll() const {
+    std::vector<std::pair<uint64_t, Record>> records;
+    records.reserve(mCapacity);
+    for (size_t i = 0; i < mCapacity; i++) {
+        const Slot& slot = mSlots[i];
+        // Give up on a slot that keeps being written to. It's the oldest record anyway.
+        for (int attempt = 0; attempt < 3; attempt++) {
+            const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq == 0) break;
+            if (seq & 1) continue;
+            std::array<uint64_t, kRecordWords> words;
+            for (size_t j = 0; j < kRecordWords; j++) {
+                words[j] = slot.words[j].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+            Record record;
+            memcpy(&record, words.data(), sizeof(record));
+            records.emplace_back(seq, record);
+            break;
+        }
+    }
+    return records;
+}
+
+size_t DnsQueryLog::memoryUsage(uint32_t netId) const {
+    const auto records = readAll();
+    return sizeof(Slot) * std::count_if(records.begin(), records.end(), [netId](const auto& r) {
+               return r.second.netId == netId;
+           });
 }
 
 void DnsQueryLog::dump(netdutils::DumpWriter& dw) const {
@@ -56,11 +138,15 @@ void DnsQueryLog::dump(netdutils::DumpWriter& dw) const {
     netdutils::ScopedIndent indentStats(dw);
     const auto now = std::chrono::system_clock::now();
 
-    for (const auto& record : mQueue.copy()) {
+    std::vector<std::pair<uint64_t, Record>> records = readAll();
+    std::sort(records.begin(), records.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    for (const auto& [seq, record] : records) {
         if (now - record.timestamp > mValidityTimeMs) continue;
 
-        const std::string maskedHostname = maskHostname(record.hostname);
-        const std::string maskedIpsStr = maskIps(record.addrs);
+        const std::string maskedHostname = maskHostname(record.hostnameInitial);
+        const std::string maskedIpsStr = maskIps(record.addrPrefixes);
         const std::string time = timestampToString(record.timestamp);
         dw.println("time=%s netId=%u uid=%u pid=%d hostname=%s answer=[%s] (%dms)", time.c_str(),
                    record.netId, record.uid, record.pid, maskedHostname.c_str(),
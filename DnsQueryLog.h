@@ -17,48 +17,81 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <netdutils/DumpWriter.h>
 
-#include "LockedQueue.h"
-
 namespace android::net {
 
-// This class stores query records in a locked ring buffer. It's thread-safe for concurrent access.
+// This class stores query records in a ring buffer. It's thread-safe for concurrent access, and
+// push() doesn't lock or allocate.
 class DnsQueryLog {
   public:
     static constexpr std::string_view DUMP_KEYWORD = "querylog";
 
+    // A fixed-size record of a query. Only what the dump shows of the hostname and the answers is
+    // kept: the first character of the hostname, and the part before the first separator of the
+    // first IPv4 and the first IPv6 address, in the order they were answered.
     struct Record {
-        Record(uint32_t netId, uid_t uid, pid_t pid, const std::string& hostname,
-               const std::vector<std::string>& addrs, int timeTaken)
-            : netId(netId),
-              uid(uid),
-              pid(pid),
-              hostname(hostname),
-              addrs(addrs),
-              timeTaken(timeTaken) {}
-        const uint32_t netId;
-        const uid_t uid;
-        const pid_t pid;
-        const std::chrono::system_clock::time_point timestamp = std::chrono::system_clock::now();
-        const std::string hostname;
-        const std::vector<std::string> addrs;
-        const int timeTaken;
+        static constexpr size_t kPrefixSize = 8;
+        using AddrPrefixes = std::array<std::array<char, kPrefixSize>, 2>;
+
+        Record() = default;
+        Record(uint32_t netId, uid_t uid, pid_t pid, std::string_view hostname,
+               const std::vector<std::string>& addrs, int timeTaken);
+
+        uint32_t netId = 0;
+        uid_t uid = 0;
+        pid_t pid = 0;
+        int timeTaken = 0;
+        std::chrono::system_clock::time_point timestamp;
+        // '\0' if the hostname is empty.
+        char hostnameInitial = '\0';
+        // NUL-terminated, and empty if there are fewer addresses.
+        AddrPrefixes addrPrefixes{};
     };
+    static_assert(std::is_trivially_copyable_v<Record>);
 
     // Allow the tests to set the capacity and the validaty time in milliseconds.
     DnsQueryLog(size_t size = kDefaultLogSize,
                 std::chrono::milliseconds time = kDefaultValidityMinutes)
-        : mQueue(size), mValidityTimeMs(time) {}
+        : mSlots(std::make_unique<Slot[]>(size)), mCapacity(size), mValidityTimeMs(time) {}
 
     void push(Record&& record);
     void dump(netdutils::DumpWriter& dw) const;
 
+    // Bytes of the log taken by the records of network |netId|. The log itself is allocated
+    // whole, whichever networks it holds records of.
+    size_t memoryUsage(uint32_t netId) const;
+
   private:
-    LockedRingBuffer<Record> mQueue;
+    static constexpr size_t kRecordWords = (sizeof(Record) + 7) / 8;
+
+    // A seqlock: |seq| is odd while a record is being written, and twice the record's position
+    // in the log, plus 2, once it's written. The record is kept in atomic words so that a reader
+    // racing with a writer only gets a torn copy, which it then discards.
+    struct Slot {
+        std::atomic<uint64_t> seq = 0;
+        std::array<std::atomic<uint64_t>, kRecordWords> words{};
+    };
+
+    // The records that could be read, with the |seq| of their slot, in no particular order.
+    std::vector<std::pair<uint64_t, Record>> readAll() const;
+
+    const std::unique_ptr<Slot[]> mSlots;
+    const size_t mCapacity;
+    std::atomic<uint64_t> mNext = 0;
     const std::chrono::milliseconds mValidityTimeMs;
 
     // The capacity of the circular buffer.
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <atomic>
 #include <regex>
 #include <thread>
 
@@ -82,6 +83,36 @@ TEST_F(DnsQueryLogTest, Push) {
     verifyDumpOutput(output, {30, 31, 32, 33});
 }
 
+TEST_F(DnsQueryLogTest, MemoryUsage) {
+    DnsQueryLog queryLog;
+    EXPECT_EQ(0U, queryLog.memoryUsage(30));
+    queryLog.push(DnsQueryLog::Record(30, 1000, 1000, "example.com", serversV4, 10));
+    queryLog.push(DnsQueryLog::Record(30, 1000, 1000, "example.com", serversV4, 10));
+    queryLog.push(DnsQueryLog::Record(31, 1000, 1000, "example.com", serversV4, 10));
+
+    const size_t one = queryLog.memoryUsage(31);
+    EXPECT_GT(one, 0U);
+    EXPECT_EQ(2 * one, queryLog.memoryUsage(30));
+    EXPECT_EQ(0U, queryLog.memoryUsage(32));
+}
+
+TEST_F(DnsQueryLogTest, MaskedRecord) {
+    DnsQueryLog queryLog;
+    queryLog.push(DnsQueryLog::Record(30, 1000, 1000, "example.com", serversV4V6, 10));
+    queryLog.push(DnsQueryLog::Record(31, 1000, 1000, "", {"2001:db8::1", "1.2.3.4"}, 10));
+    queryLog.push(DnsQueryLog::Record(32, 1000, 1000, "a", {"123456789abcdef::1"}, 10));
+
+    const std::string output = captureDumpOutput(queryLog);
+    EXPECT_NE(output.find("netId=30 uid=1000 pid=1000 hostname=e*** answer=[127.***, 2001:***]"),
+              std::string::npos);
+    EXPECT_NE(output.find("netId=31 uid=1000 pid=1000 hostname=*** answer=[2001:***, 1.***]"),
+              std::string::npos);
+    // Prefixes longer than any address has are cut short.
+    EXPECT_NE(output.find("netId=32 uid=1000 pid=1000 hostname=a*** answer=[1234567***]"),
+              std::string::npos);
+    EXPECT_EQ(output.find("example"), std::string::npos);
+}
+
 TEST_F(DnsQueryLogTest, PushStressTest) {
     const int threadNum = 100;
     const int pushNum = 1000;
@@ -107,6 +138,32 @@ TEST_F(DnsQueryLogTest, PushStressTest) {
     verifyDumpOutput(output, std::vector(size, 30));
 }
 
+TEST_F(DnsQueryLogTest, DumpWhilePushing) {
+    const size_t size = 10;
+    DnsQueryLog queryLog(size);
+    std::atomic<bool> done = false;
+    std::vector<std::thread> threads(4);
+    for (auto& thread : threads) {
+        thread = std::thread([&]() {
+            while (!done) {
+                queryLog.push(
+                        DnsQueryLog::Record(30, 1000, 1000, "www.example.com", serversV4, 10));
+            }
+        });
+    }
+    // Records being written are skipped, but those shown are whole.
+    for (int i = 0; i < 100; i++) {
+        const std::string output = captureDumpOutput(queryLog);
+        EXPECT_EQ(output.find("netId=30 uid=1000 pid=1000 hostname=w*** answer=[127.***] (10ms)"),
+                  output.find("netId="));
+    }
+    done = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    verifyDumpOutput(captureDumpOutput(queryLog), std::vector(size, 30));
+}
+
 TEST_F(DnsQueryLogTest, ZeroSize) {
     const size_t size = 0;
     DnsQueryLog::Record r1(30, 1000, 1000, "www.example1.com", serversV4V6, 10);
@@ -82,7 +82,6 @@ DnsResolver::DnsResolver() {
     auto& dnsTlsDispatcher = DnsTlsDispatcher::getInstance();
     auto& privateDnsConfiguration = PrivateDnsConfiguration::getInstance();
     privateDnsConfiguration.setObserver(&dnsTlsDispatcher);
-    if (isDoHEnabled()) privateDnsConfiguration.initDoh();
 }
 
 bool DnsResolver::start() {
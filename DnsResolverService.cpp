@@ -18,6 +18,8 @@
 
 #include "DnsResolverService.h"
 
+#include <inttypes.h>
+
 #include <set>
 #include <vector>
 
@@ -28,18 +30,27 @@
 #include <netdutils/DumpWriter.h>
 #include <private/android_filesystem_config.h>  // AID_SYSTEM
 
+#include "AnswerInterner.h"
+#include "CancellationToken.h"
 #include "DnsResolver.h"
+#include "DnsTlsSessionStore.h"
 #include "Experiments.h"
 #include "NetdPermissions.h"  // PERM_*
 #include "PrivateDnsConfiguration.h"
+#include "QueryPriority.h"
+#include "QueryThreadPool.h"
+#include "QueryTrace.h"
 #include "ResolverEventReporter.h"
+#include "TimerService.h"
 #include "resolv_cache.h"
 
 using aidl::android::net::ResolverOptionsParcel;
 using aidl::android::net::ResolverParamsParcel;
+using aidl::android::net::resolv::aidl::CacheWarmupQueryParcel;
 using android::base::Join;
 using android::netdutils::DumpWriter;
 using android::netdutils::IPPrefix;
+using android::netdutils::ScopedIndent;
 
 namespace android {
 namespace net {
@@ -118,8 +129,44 @@ binder_status_t DnsResolverService::dump(int fd, const char** args, uint32_t num
         dw.blankline();
     }
 
+    dw.println("Memory usage (bytes, current/peak):");
+    {
+        ScopedIndent indent(dw);
+        for (auto netId : resolv_list_caches()) {
+            ResolverController::MemoryUsage peak;
+            const auto usage = gDnsResolv->resolverCtrl.getMemoryUsage(netId, &peak);
+            if (!usage) continue;
+            dw.println("NetId %u: cache=%zu/%zu hosts=%zu/%zu stats=%zu/%zu dot=%zu/%zu "
+                       "querylog=%zu/%zu total=%zu",
+                       netId, usage->cache, peak.cache, usage->hosts, peak.hosts, usage->stats,
+                       peak.stats, usage->dot, peak.dot, usage->queryLog, peak.queryLog,
+                       usage->total());
+        }
+        AnswerInterner::getInstance().dump(dw);
+    }
+    dw.blankline();
+
     PrivateDnsConfiguration::getInstance().dump(dw);
     Experiments::getInstance()->dump(dw);
+    if (QueryThreadPool* pool = QueryThreadPool::getInstance(); pool != nullptr) pool->dump(dw);
+    gDnsResolv->dnsProxyListener().dump(dw);
+    if (Experiments::getInstance()->getFlag("query_stage_tracing", 0)) QueryTrace::dump(dw);
+    if (Experiments::getInstance()->getFlag("cancel_on_client_hangup", 0)) {
+        dw.println("Requests cancelled by client hangup: %" PRIu64,
+                   CancellationToken::getCancelledCount());
+    }
+    if (Experiments::getInstance()->getFlag("async_dns_event_reporting", 0)) {
+        const auto stats = ResolverEventReporter::getInstance().getDnsEventQueueStats();
+        dw.println("DNS events: delivered=%" PRIu64 " batches=%" PRIu64 " dropped=%" PRIu64
+                   " queued=%zu",
+                   stats.delivered, stats.batches, stats.dropped, stats.queued);
+    }
+    if (DnsTlsSessionStore* store = DnsTlsSessionStore::getInstance(); store != nullptr) {
+        store->dump(dw);
+    }
+    const auto timers = TimerService::getInstance().stats();
+    dw.println("Timers: wakeups=%" PRIu64 " fired=%" PRIu64 " pending=%zu", timers.wakeups,
+               timers.fired, timers.pending);
     return STATUS_OK;
 }
 
@@ -314,5 +361,43 @@ binder_status_t DnsResolverService::dump(int fd, const char** args, uint32_t num
     return statusFromErrcode(resolv_set_options(netId, options));
 }
 
+::ndk::ScopedAStatus DnsResolverService::warmNetworkCache(
+        int32_t netId, const std::vector<CacheWarmupQueryParcel>& queries) {
+    // Locking happens in res_cache.cpp functions.
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
+
+    int res = gDnsResolv->resolverCtrl.warmNetworkCache(netId, queries);
+
+    return statusFromErrcode(res);
+}
+
+::ndk::ScopedAStatus DnsResolverService::handOverNetworkCache(int32_t fromNetId, int32_t toNetId,
+                                                              int32_t maxQueries) {
+    // Locking happens in res_cache.cpp functions.
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
+
+    int res = gDnsResolv->resolverCtrl.handOverNetworkCache(fromNetId, toNetId, maxQueries);
+
+    return statusFromErrcode(res);
+}
+
+::ndk::ScopedAStatus DnsResolverService::setForegroundUids(const std::vector<int32_t>& uids) {
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
+
+    QueryPriorities::getInstance().setForegroundUids(uids);
+
+    return ::ndk::ScopedAStatus(AStatus_newOk());
+}
+
+::ndk::ScopedAStatus DnsResolverService::getResolverInfoSnapshot(int32_t netId,
+                                                                 std::vector<uint8_t>* snapshot) {
+    // Locking happens in ResolverController, and in res_* functions once a second at most.
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
+
+    int res = gDnsResolv->resolverCtrl.getResolverInfoSnapshot(netId, snapshot);
+
+    return statusFromErrcode(res);
+}
+
 }  // namespace net
 }  // namespace android
@@ -57,6 +57,15 @@ class DnsResolverService : public aidl::android::net::BnDnsResolver {
     ::ndk::ScopedAStatus flushNetworkCache(int32_t netId) override;
     ::ndk::ScopedAStatus setResolverOptions(
             int32_t netId, const aidl::android::net::ResolverOptionsParcel& options) override;
+    ::ndk::ScopedAStatus warmNetworkCache(
+            int32_t netId,
+            const std::vector<aidl::android::net::resolv::aidl::CacheWarmupQueryParcel>& queries)
+            override;
+    ::ndk::ScopedAStatus handOverNetworkCache(int32_t fromNetId, int32_t toNetId,
+                                              int32_t maxQueries) override;
+    ::ndk::ScopedAStatus setForegroundUids(const std::vector<int32_t>& uids) override;
+    ::ndk::ScopedAStatus getResolverInfoSnapshot(int32_t netId,
+                                                 std::vector<uint8_t>* snapshot) override;
 
     // DNS64-related commands
     ::ndk::ScopedAStatus startPrefix64Discovery(int32_t netId) override;
@@ -19,6 +19,9 @@
 
 #include "DnsStats.h"
 
+#include <algorithm>
+#include <bit>
+
 #include <android-base/format.h>
 #include <android-base/logging.h>
 
@@ -96,19 +99,74 @@ std::string StatsData::toString() const {
 }
 
 StatsRecords::StatsRecords(const IPSockAddr& ipSockAddr, size_t size)
-    : mCapacity(size), mStatsData(ipSockAddr) {}
+    : mRcodes(std::bit_ceil(std::max<size_t>(size, 1))),
+      mErrnos(mRcodes.size()),
+      mLatenciesUs(mRcodes.size()),
+      mMask(mRcodes.size() - 1),
+      mCapacity(size),
+      mStatsData(ipSockAddr) {
+    updateScore();
+}
+
+size_t LatencyHistogram::bucketOf(microseconds latency) {
+    const uint64_t us = std::clamp<int64_t>(latency.count(), 0, (int64_t{1} << kMaxBits) - 1);
+    if (us < kSubBuckets) return us;
+    // The highest bit picks the power of two, and the kSubBucketBits below it the bucket in it.
+    const int shift = (63 - __builtin_clzll(us)) - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + (us >> shift) - kSubBuckets;
+}
+
+microseconds LatencyHistogram::upperBoundOf(size_t bucket) {
+    if (bucket < kSubBuckets) return microseconds(bucket);
+    const int shift = bucket / kSubBuckets - 1;
+    const uint64_t sub = bucket % kSubBuckets + kSubBuckets;
+    return microseconds(((sub + 1) << shift) - 1);
+}
+
+std::optional<microseconds> LatencyHistogram::percentile(int percentile) const {
+    if (mTotal == 0) return std::nullopt;
+    // The same rank as std::nth_element() on the sorted samples would take.
+    const int rank = (mTotal - 1) * std::clamp(percentile, 0, 100) / 100;
+    int seen = 0;
+    for (size_t i = 0; i < mCounts.size(); i++) {
+        seen += mCounts[i];
+        if (seen > rank) return upperBoundOf(i);
+    }
+    return upperBoundOf(mCounts.size() - 1);
+}
+
+StatsRecords::Record StatsRecords::recordAt(size_t index) const {
+    return {
+            .rcode = mRcodes[index],
+            .linux_errno = mErrnos[index],
+            .latencyUs = microseconds(mLatenciesUs[index]),
+    };
+}
 
 void StatsRecords::push(const Record& record) {
-    updateStatsData(record, true);
-    mRecords.push_back(record);
+    if (mCapacity > 0) {
+        if (mSize == mCapacity) {
+            const Record oldest = recordAt(mHead);
+            updateStatsData(oldest, false);
+            updateLatencies(oldest, false);
+            mHead = (mHead + 1) & mMask;
+            mSize--;
+        }
 
-    if (mRecords.size() > mCapacity) {
-        updateStatsData(mRecords.front(), false);
-        mRecords.pop_front();
+        const size_t index = (mHead + mSize) & mMask;
+        mRcodes[index] = record.rcode;
+        mErrnos[index] = record.linux_errno;
+        mLatenciesUs[index] = std::clamp<int64_t>(record.latencyUs.count(), 0, UINT32_MAX);
+        mSize++;
+        // What's added is what will be taken away when the record is evicted.
+        const Record stored = recordAt(index);
+        updateStatsData(stored, true);
+        updateLatencies(stored, true);
     }
 
     // Update the quality factors.
     mSkippedCount = 0;
+    updateRttEstimate(record);
 
     // Because failures due to no permission can't prove that the quality of DNS server is bad,
     // skip the penalty update. The average latency, however, has been updated. For short-latency
@@ -119,6 +177,7 @@ void StatsRecords::push(const Record& record) {
     if (record.linux_errno != EPERM) {
         updatePenalty(record);
     }
+    updateScore();
 }
 
 void StatsRecords::updateStatsData(const Record& record, const bool add) {
@@ -135,6 +194,16 @@ void StatsRecords::updateStatsData(const Record& record, const bool add) {
     mStatsData.lastUpdate = std::chrono::steady_clock::now();
 }
 
+void StatsRecords::updateLatencies(const Record& record, const bool add) {
+    // Only answers tell how long the server takes; timeouts and errors would skew it.
+    if (record.rcode != NS_R_NO_ERROR && record.rcode != NS_R_NXDOMAIN) return;
+    if (add) {
+        mLatencies.add(record.latencyUs);
+    } else {
+        mLatencies.remove(record.latencyUs);
+    }
+}
+
 void StatsRecords::updatePenalty(const Record& record) {
     switch (record.rcode) {
         case NS_R_NO_ERROR:
@@ -154,7 +223,7 @@ void StatsRecords::updatePenalty(const Record& record) {
     }
 }
 
-double StatsRecords::score() const {
+void StatsRecords::updateScore() {
     const int avgRtt = mStatsData.averageLatencyMs();
 
     // Set the lower bound to -1 in case of "avgRtt + mPenalty < mSkippedCount"
@@ -163,11 +232,49 @@ double StatsRecords::score() const {
     int quality = std::clamp(avgRtt + mPenalty - mSkippedCount, -1, kMaxQuality);
 
     // Normalization.
-    return static_cast<double>(kMaxQuality - quality) * 100 / kMaxQuality;
+    mScore = static_cast<double>(kMaxQuality - quality) * 100 / kMaxQuality;
+}
+
+void StatsRecords::updateRttEstimate(const Record& record) {
+    switch (record.rcode) {
+        case NS_R_TIMEOUT:
+            // RFC 6298 section 5.5: back off the timer on expiry.
+            mBackoffCount = std::min(mBackoffCount + 1, kMaxBackoffCount);
+            return;
+        case NS_R_INTERNAL_ERROR:
+            // Nothing was heard from the server, so there's no latency to learn from.
+            return;
+        default:
+            break;
+    }
+
+    // RFC 6298 section 2, with alpha = 1/8 and beta = 1/4.
+    const microseconds rtt = record.latencyUs;
+    if (!mSrtt) {
+        mSrtt = rtt;
+        mRttVar = rtt / 2;
+    } else {
+        mRttVar = (3 * mRttVar + (*mSrtt > rtt ? *mSrtt - rtt : rtt - *mSrtt)) / 4;
+        mSrtt = (7 * *mSrtt + rtt) / 8;
+    }
+    mBackoffCount = 0;
+}
+
+std::optional<microseconds> StatsRecords::retransmitTimeoutUs() const {
+    if (!mSrtt) return std::nullopt;
+    return (*mSrtt + 4 * mRttVar) * (1 << mBackoffCount);
+}
+
+size_t StatsRecords::memoryUsage() const {
+    // Each tree node of the rcode counts is counted as its value and four pointers.
+    return mRcodes.capacity() * sizeof(int16_t) + mErrnos.capacity() * sizeof(int16_t) +
+           mLatenciesUs.capacity() * sizeof(uint32_t) +
+           mStatsData.rcodeCounts.size() * (sizeof(std::pair<int, int>) + 4 * sizeof(void*));
 }
 
 void StatsRecords::incrementSkippedCount() {
     mSkippedCount = std::min(mSkippedCount + 1, kMaxQuality);
+    updateScore();
 }
 
 bool DnsStats::setAddrs(const std::vector<netdutils::IPSockAddr>& addrs, Protocol protocol) {
@@ -191,6 +298,8 @@ bool DnsStats::setAddrs(const std::vector<netdutils::IPSockAddr>& addrs, Protoco
 
     cleanup(&statsMap);
 
+    mSortedServers[protocol].clear();
+    updateSortedServers(protocol);
     return true;
 }
 
@@ -212,30 +321,37 @@ bool DnsStats::addStats(const IPSockAddr& ipSockAddr, const DnsQueryEvent& recor
         }
     }
 
+    updateSortedServers(record.protocol());
     return added;
 }
 
-std::vector<IPSockAddr> DnsStats::getSortedServers(Protocol protocol) const {
-    // DoT unsupported. The handshake overhead is expensive, and the connection will hang for a
-    // while. Need to figure out if it is worth doing for DoT servers.
-    if (protocol == PROTO_DOT) return {};
+void DnsStats::updateSortedServers(Protocol protocol) {
+    const StatsMap& statsMap = mStats[protocol];
+    std::vector<IPSockAddr>& sorted = mSortedServers[protocol];
 
-    auto it = mStats.find(protocol);
-    if (it == mStats.end()) return {};
+    // Higher scores first, and servers with the same score in the order of their addresses.
+    const auto ranksBefore = [&](const IPSockAddr& a, const IPSockAddr& b) {
+        const double scoreA = statsMap.at(a).score();
+        const double scoreB = statsMap.at(b).score();
+        return scoreA != scoreB ? scoreA > scoreB : a < b;
+    };
 
-    // Sorting on insertion in decreasing order.
-    std::multimap<double, IPSockAddr, std::greater<double>> sortedData;
-    for (const auto& [ip, statsRecords] : it->second) {
-        sortedData.insert({statsRecords.score(), ip});
+    // Scores move a little with each query, but rarely past those of their neighbors.
+    if (sorted.size() == statsMap.size() &&
+        std::is_sorted(sorted.begin(), sorted.end(), ranksBefore)) {
+        return;
     }
-
-    std::vector<IPSockAddr> ret;
-    ret.reserve(sortedData.size());
-    for (auto& [_, v] : sortedData) {
-        ret.push_back(v);  // IPSockAddr is trivially-copyable.
+    sorted.clear();
+    for (const auto& [addr, _] : statsMap) {
+        sorted.push_back(addr);
     }
+    std::sort(sorted.begin(), sorted.end(), ranksBefore);
+}
 
-    return ret;
+std::vector<IPSockAddr> DnsStats::getSortedServers(Protocol protocol) const {
+    const auto it = mSortedServers.find(protocol);
+    if (it == mSortedServers.end()) return {};
+    return it->second;  // IPSockAddr is trivially-copyable.
 }
 
 std::optional<microseconds> DnsStats::getAverageLatencyUs(Protocol protocol) const {
@@ -252,6 +368,25 @@ std::optional<microseconds> DnsStats::getAverageLatencyUs(Protocol protocol) con
     return sum / count;
 }
 
+std::optional<microseconds> DnsStats::getLatencyPercentileUs(const IPSockAddr& server,
+                                                            Protocol protocol,
+                                                            int percentile) const {
+    const auto it = mStats.find(protocol);
+    if (it == mStats.end()) return std::nullopt;
+    const auto records = it->second.find(server);
+    if (records == it->second.end()) return std::nullopt;
+    return records->second.latencyPercentileUs(percentile);
+}
+
+std::optional<microseconds> DnsStats::getRetransmitTimeoutUs(const IPSockAddr& server,
+                                                            Protocol protocol) const {
+    const auto it = mStats.find(protocol);
+    if (it == mStats.end()) return std::nullopt;
+    const auto records = it->second.find(server);
+    if (records == it->second.end()) return std::nullopt;
+    return records->second.retransmitTimeoutUs();
+}
+
 std::vector<StatsData> DnsStats::getStats(Protocol protocol) const {
     std::vector<StatsData> ret;
 
@@ -263,6 +398,24 @@ std::vector<StatsData> DnsStats::getStats(Protocol protocol) const {
     return ret;
 }
 
+size_t DnsStats::memoryUsage() const {
+    // Each tree node is counted as its value and four pointers.
+    constexpr size_t kNodeOverhead = 4 * sizeof(void*);
+    size_t bytes = 0;
+    for (const auto& [_, statsMap] : mStats) {
+        bytes += sizeof(std::pair<Protocol, StatsMap>) + kNodeOverhead;
+        for (const auto& [_, statsRecords] : statsMap) {
+            bytes += sizeof(std::pair<IPSockAddr, StatsRecords>) + kNodeOverhead +
+                     statsRecords.memoryUsage();
+        }
+    }
+    for (const auto& [_, servers] : mSortedServers) {
+        bytes += sizeof(std::pair<Protocol, std::vector<IPSockAddr>>) + kNodeOverhead +
+                 servers.capacity() * sizeof(IPSockAddr);
+    }
+    return bytes;
+}
+
 void DnsStats::dump(DumpWriter& dw) {
     const auto dumpStatsMap = [&](StatsMap& statsMap) {
         ScopedIndent indentLog(dw);
@@ -274,6 +427,14 @@ void DnsStats::dump(DumpWriter& dw) {
             const StatsData& data = statsRecords.getStatsData();
             std::string str =
                     fmt::format("{} score{{{:.1f}}}", data.toString(), statsRecords.score());
+            // Only for servers which have answered recently.
+            const auto ms = [&](int percentile) {
+                return statsRecords.latencyPercentileUs(percentile)->count() / 1000.0;
+            };
+            if (statsRecords.latencyPercentileUs(50)) {
+                str += fmt::format(" latency{{p50={:.1f}ms p90={:.1f}ms p99={:.1f}ms}}", ms(50),
+                                   ms(90), ms(99));
+            }
             dw.println("%s", str.c_str());
         }
     };
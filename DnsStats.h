@@ -17,9 +17,10 @@
 
 #pragma once
 
+#include <array>
 #include <chrono>
-#include <deque>
 #include <map>
+#include <optional>
 #include <vector>
 
 #include <android-base/thread_annotations.h>
@@ -64,6 +65,41 @@ struct StatsData {
     }
 };
 
+// A log-linear histogram of latencies, in the manner of HdrHistogram: each power of two is split
+// into kSubBuckets buckets of equal width, so that a sample is counted in a bucket no more than
+// 1/kSubBuckets wider than it. It takes fixed memory, and adding or removing a sample is O(1).
+class LatencyHistogram {
+  public:
+    void add(std::chrono::microseconds latency) {
+        mCounts[bucketOf(latency)]++;
+        mTotal++;
+    }
+    void remove(std::chrono::microseconds latency) {
+        mCounts[bucketOf(latency)]--;
+        mTotal--;
+    }
+
+    int total() const { return mTotal; }
+
+    // Returns the upper bound of the bucket holding the |percentile|th percentile, or
+    // std::nullopt if the histogram is empty.
+    std::optional<std::chrono::microseconds> percentile(int percentile) const;
+
+  private:
+    static constexpr int kSubBucketBits = 4;
+    static constexpr int kSubBuckets = 1 << kSubBucketBits;
+    // Latencies are counted up to 2^27 microseconds, about two minutes, and longer ones as that.
+    static constexpr int kMaxBits = 27;
+    static constexpr int kBuckets = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+    static size_t bucketOf(std::chrono::microseconds latency);
+    static std::chrono::microseconds upperBoundOf(size_t bucket);
+
+    // Bounded by the capacity of the StatsRecords.
+    std::array<uint16_t, kBuckets> mCounts = {};
+    int mTotal = 0;
+};
+
 // A circular buffer based class used to store the statistics for a server with a protocol.
 class StatsRecords {
   public:
@@ -80,19 +116,49 @@ class StatsRecords {
     const StatsData& getStatsData() const { return mStatsData; }
 
     // Quantifies the quality based on the current quality factors and the latency, and normalize
-    // the value to a score between 0 to 100.
-    double score() const;
+    // the value to a score between 0 to 100. It's updated whenever a quality factor changes.
+    double score() const { return mScore; }
 
     void incrementSkippedCount();
 
+    // Returns the |percentile|th percentile of the latency of the queries answered by the
+    // server, or std::nullopt if it hasn't answered any recently. It's rounded up, by at most
+    // 1/16th; see LatencyHistogram.
+    std::optional<std::chrono::microseconds> latencyPercentileUs(int percentile) const {
+        return mLatencies.percentile(percentile);
+    }
+
+    // Returns the retransmission timeout computed as in RFC 6298 from the latency of the queries
+    // to the server, or std::nullopt if there's no latency sample yet.
+    std::optional<std::chrono::microseconds> retransmitTimeoutUs() const;
+
+    // Approximate bytes of memory the records hold, besides the object itself.
+    size_t memoryUsage() const;
+
   private:
     void updateStatsData(const Record& record, const bool add);
+    void updateLatencies(const Record& record, const bool add);
     void updatePenalty(const Record& record);
-
-    std::deque<Record> mRecords;
+    void updateRttEstimate(const Record& record);
+    void updateScore();
+
+    // Returns the record in slot |index| of the ring.
+    Record recordAt(size_t index) const;
+
+    // The last mCapacity records, in a ring whose size is the power of two above it, with the
+    // oldest at mHead. Each field is in an array of its own, narrowed to the range it takes.
+    std::vector<int16_t> mRcodes;
+    std::vector<int16_t> mErrnos;
+    std::vector<uint32_t> mLatenciesUs;
+    size_t mMask;
+    size_t mHead = 0;
+    size_t mSize = 0;
     size_t mCapacity;
     StatsData mStatsData;
 
+    // The latencies of the answers among the records.
+    LatencyHistogram mLatencies;
+
     // A quality factor used to distinguish if the server can't be evaluated by latency alone, such
     // as instant failure on connect.
     int mPenalty = 0;
@@ -100,10 +166,21 @@ class StatsRecords {
     // A quality factor used to prevent starvation.
     int mSkippedCount = 0;
 
+    // The smoothed round-trip time and its variation, and the number of times the timeout was
+    // backed off since the last answer.
+    std::optional<std::chrono::microseconds> mSrtt;
+    std::chrono::microseconds mRttVar = {};
+    int mBackoffCount = 0;
+
+    double mScore;
+
     // The maximum of the quantified result. As the sorting is on the basis of server latency, limit
     // the maximal value of the quantity to 10000 in correspondence with the maximal cleartext
     // query timeout 10000 milliseconds. This helps normalize the value of the quality to a score.
     static constexpr int kMaxQuality = 10000;
+
+    // Bounds the backed-off timeout to 64 times the computed one.
+    static constexpr int kMaxBackoffCount = 6;
 };
 
 // DnsStats class manages the statistics of DNS servers or MDNS multicast addresses per netId.
@@ -119,21 +196,39 @@ class DnsStats {
     // Return true if |record| is successfully added into |server|'s stats; otherwise, return false.
     bool addStats(const netdutils::IPSockAddr& server, const DnsQueryEvent& record);
 
+    // Returns the servers of |protocol|, best score first.
     std::vector<netdutils::IPSockAddr> getSortedServers(Protocol protocol) const;
 
     // Returns the average query latency in microseconds.
     std::optional<std::chrono::microseconds> getAverageLatencyUs(Protocol protocol) const;
 
+    // Returns the |percentile|th percentile of the query latency of |server|.
+    std::optional<std::chrono::microseconds> getLatencyPercentileUs(
+            const netdutils::IPSockAddr& server, Protocol protocol, int percentile) const;
+
+    // Returns the retransmission timeout of |server|; see StatsRecords::retransmitTimeoutUs().
+    std::optional<std::chrono::microseconds> getRetransmitTimeoutUs(
+            const netdutils::IPSockAddr& server, Protocol protocol) const;
+
     void dump(netdutils::DumpWriter& dw);
 
     std::vector<StatsData> getStats(Protocol protocol) const;
 
+    // Approximate bytes of memory the statistics hold.
+    size_t memoryUsage() const;
+
     // TODO: Compatible support for getResolverInfo().
 
     static constexpr size_t kLogSize = 128;
 
   private:
+    // Re-sorts mSortedServers[protocol] if any server now ranks before the one ahead of it.
+    void updateSortedServers(Protocol protocol);
+
     std::map<Protocol, StatsMap> mStats;
+
+    // What getSortedServers() returns, kept up to date as the scores change.
+    std::map<Protocol, std::vector<netdutils::IPSockAddr>> mSortedServers;
 };
 
 }  // namespace android::net
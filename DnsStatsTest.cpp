@@ -63,10 +63,44 @@ StatsData makeStatsData(const IPSockAddr& server, const int total, const microse
     return ret;
 }
 
+// Percentiles are rounded up to the end of the histogram bucket of the sample, by at most 1/16th.
+MATCHER_P(IsBucketOf, latency, "") {
+    const microseconds us = latency;
+    return arg.has_value() && *arg >= us && *arg <= us * 17 / 16;
+}
+
 }  // namespace
 
 // TODO: add StatsDataTest to ensure its methods return correct outputs.
 
+class LatencyHistogramTest : public ResolvTestBase {};
+
+TEST_F(LatencyHistogramTest, Percentile) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(histogram.percentile(50), std::nullopt);
+
+    // The smallest latencies are counted exactly.
+    for (int i = 1; i <= 31; i++) histogram.add(microseconds(i));
+    EXPECT_EQ(histogram.percentile(0), microseconds(1));
+    EXPECT_EQ(histogram.percentile(50), microseconds(16));
+    EXPECT_EQ(histogram.percentile(100), microseconds(31));
+
+    histogram.add(microseconds(1'000'000));
+    histogram.add(microseconds(1'000'000));
+    EXPECT_THAT(histogram.percentile(100), IsBucketOf(microseconds(1'000'000)));
+    EXPECT_EQ(33, histogram.total());
+
+    // Latencies too large for the histogram are counted in its last bucket.
+    histogram.add(std::chrono::hours(1));
+    EXPECT_THAT(histogram.percentile(100), IsBucketOf(microseconds((1 << 27) - 1)));
+
+    histogram.remove(std::chrono::hours(1));
+    histogram.remove(microseconds(1'000'000));
+    histogram.remove(microseconds(1'000'000));
+    EXPECT_EQ(histogram.percentile(100), microseconds(31));
+    EXPECT_EQ(31, histogram.total());
+}
+
 class StatsRecordsTest : public ResolvTestBase {};
 
 TEST_F(StatsRecordsTest, PushRecord) {
@@ -121,8 +155,10 @@ class DnsStatsTest : public ResolvTestBase {
                           const std::vector<StatsData>& mdnsData,
                           const std::vector<StatsData>& dohData) {
         // A pattern to capture three matches:
-        //     server address (empty allowed), the statistics, and the score.
-        const std::regex pattern(R"(\s{4,}([0-9a-fA-F:\.\]\[]*)[ ]?([<(].*[>)])[ ]?(\S*))");
+        //     server address (empty allowed), the statistics, and the score, which the latency
+        //     percentiles follow if the server has answered.
+        const std::regex pattern(
+                R"(\s{4,}([0-9a-fA-F:\.\]\[]*)[ ]?([<(].*[>)])[ ]?(\S*)(?: latency\{.*\})?)");
         std::string dumpString = captureDumpOutput();
 
         const auto check = [&](const std::vector<StatsData>& statsData, const std::string& protocol,
@@ -519,6 +555,78 @@ TEST_F(DnsStatsTest, GetServers_SortingByLatency) {
     EXPECT_FALSE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 10ms)));
     EXPECT_THAT(mDnsStats.getSortedServers(PROTO_UDP),
                 testing::ElementsAreArray({server2, server4}));
+
+    // server1 comes back without stats, ahead of server4 but behind server2, which was skipped.
+    EXPECT_TRUE(mDnsStats.setAddrs({server1, server2, server4}, PROTO_UDP));
+    EXPECT_THAT(mDnsStats.getSortedServers(PROTO_UDP),
+                testing::ElementsAreArray({server2, server1, server4}));
+}
+
+TEST_F(DnsStatsTest, GetServers_SortingByLatency_DoT) {
+    const IPSockAddr server1 = IPSockAddr::toIPSockAddr("127.0.0.1", 853);
+    const IPSockAddr server2 = IPSockAddr::toIPSockAddr("127.0.0.2", 853);
+
+    EXPECT_TRUE(mDnsStats.setAddrs({server1, server2}, PROTO_DOT));
+    EXPECT_THAT(mDnsStats.getSortedServers(PROTO_DOT),
+                testing::ElementsAreArray({server1, server2}));
+
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 50ms)));
+    EXPECT_THAT(mDnsStats.getSortedServers(PROTO_DOT),
+                testing::ElementsAreArray({server2, server1}));
+
+    EXPECT_TRUE(mDnsStats.addStats(server2, makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 10ms)));
+    EXPECT_THAT(mDnsStats.getSortedServers(PROTO_DOT),
+                testing::ElementsAreArray({server2, server1}));
+}
+
+TEST_F(DnsStatsTest, GetLatencyPercentile) {
+    const IPSockAddr server1 = IPSockAddr::toIPSockAddr("127.0.0.1", 53);
+    const IPSockAddr server2 = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 90), std::nullopt);
+    EXPECT_TRUE(mDnsStats.setAddrs({server1, server2}, PROTO_UDP));
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 90), std::nullopt);
+
+    for (int i = 1; i <= 10; i++) {
+        EXPECT_TRUE(mDnsStats.addStats(
+                server1, makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, milliseconds(i * 10))));
+    }
+    // Timeouts and errors don't count.
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_TIMEOUT, 5000ms)));
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_SERVFAIL, 900ms)));
+    EXPECT_THAT(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 90), IsBucketOf(90ms));
+    EXPECT_THAT(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 100), IsBucketOf(100ms));
+    EXPECT_THAT(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 0), IsBucketOf(10ms));
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_TCP, 90), std::nullopt);
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server2, PROTO_UDP, 90), std::nullopt);
+}
+
+TEST_F(DnsStatsTest, GetRetransmitTimeout) {
+    const IPSockAddr server = IPSockAddr::toIPSockAddr("127.0.0.1", 53);
+    EXPECT_TRUE(mDnsStats.setAddrs({server}, PROTO_UDP));
+    EXPECT_EQ(mDnsStats.getRetransmitTimeoutUs(server, PROTO_UDP), std::nullopt);
+
+    // No latency is learnt from timeouts and internal errors.
+    EXPECT_TRUE(mDnsStats.addStats(server, makeDnsQueryEvent(PROTO_UDP, NS_R_TIMEOUT, 5000ms)));
+    EXPECT_TRUE(mDnsStats.addStats(server,
+                                   makeDnsQueryEvent(PROTO_UDP, NS_R_INTERNAL_ERROR, 10ms)));
+    EXPECT_EQ(mDnsStats.getRetransmitTimeoutUs(server, PROTO_UDP), std::nullopt);
+
+    // The first sample sets SRTT = R and RTTVAR = R / 2.
+    EXPECT_TRUE(mDnsStats.addStats(server, makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 100ms)));
+    EXPECT_EQ(mDnsStats.getRetransmitTimeoutUs(server, PROTO_UDP), microseconds(300ms));
+    EXPECT_TRUE(mDnsStats.addStats(server, makeDnsQueryEvent(PROTO_UDP, NS_R_NXDOMAIN, 100ms)));
+    EXPECT_EQ(mDnsStats.getRetransmitTimeoutUs(server, PROTO_UDP), microseconds(250ms));
+
+    // Each timeout doubles the timeout, until the next answer.
+    EXPECT_TRUE(mDnsStats.addStats(server, makeDnsQueryEvent(PROTO_UDP, NS_R_TIMEOUT, 250ms)));
+    EXPECT_EQ(mDnsStats.getRetransmitTimeoutUs(server, PROTO_UDP), microseconds(500ms));
+    EXPECT_TRUE(mDnsStats.addStats(server, makeDnsQueryEvent(PROTO_UDP, NS_R_TIMEOUT, 500ms)));
+    EXPECT_EQ(mDnsStats.getRetransmitTimeoutUs(server, PROTO_UDP), microseconds(1000ms));
+    EXPECT_TRUE(mDnsStats.addStats(server, makeDnsQueryEvent(PROTO_UDP, NS_R_SERVFAIL, 100ms)));
+    EXPECT_EQ(mDnsStats.getRetransmitTimeoutUs(server, PROTO_UDP), microseconds(212500));
+
+    // Protocols are estimated separately.
+    EXPECT_EQ(mDnsStats.getRetransmitTimeoutUs(server, PROTO_TCP), std::nullopt);
 }
 
 TEST_F(DnsStatsTest, GetServers_DeprioritizingBadServers) {
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "DnsTcpConnection.h"
+
+#include <arpa/nameser.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <tuple>
+
+#include <android-base/logging.h>
+
+namespace android::net {
+
+using base::ErrnoError;
+using base::Error;
+using base::Result;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+namespace {
+
+// Waits until |fd| is readable or |deadline| has passed.
+Result<void> pollIn(int fd, DnsTcpConnection::clock::time_point deadline) {
+    for (;;) {
+        const auto remaining =
+                duration_cast<milliseconds>(deadline - DnsTcpConnection::clock::now());
+        pollfd pfd = {.fd = fd, .events = POLLIN};
+        const int n = poll(&pfd, 1, std::max<int64_t>(0, remaining.count()));
+        if (n > 0) return {};
+        if (n == 0) return Error(ETIMEDOUT);
+        if (errno != EINTR) return ErrnoError();
+    }
+}
+
+// Reads exactly |buf.size()| bytes.
+Result<void> readAll(int fd, std::span<uint8_t> buf, DnsTcpConnection::clock::time_point deadline) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        if (auto result = pollIn(fd, deadline); !result.ok()) return result;
+        const ssize_t n = recv(fd, buf.data() + done, buf.size() - done, 0);
+        if (n == 0) return Error(ECONNRESET);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return ErrnoError();
+        }
+        done += n;
+    }
+    return {};
+}
+
+}  // namespace
+
+DnsTcpConnection::DnsTcpConnection(base::unique_fd fd)
+    : mFd(std::move(fd)), mNextId(arc4random_uniform(UINT16_MAX + 1)), mLastUsed(clock::now()) {}
+
+int DnsTcpConnection::query(std::span<const uint8_t> query, std::span<uint8_t> answer,
+                            clock::time_point deadline) {
+    if (query.size() < HFIXEDSZ || query.size() > UINT16_MAX) return -EINVAL;
+
+    std::unique_lock lock(mMutex);
+    if (mError != 0) return -mError;
+
+    // Give the query an ID no other query in flight on this connection uses.
+    while (mPending.count(mNextId) != 0) mNextId++;
+    const uint16_t id = mNextId++;
+    Pending pending = {.originalId = static_cast<uint16_t>(query[0] << 8 | query[1])};
+    mPending[id] = &pending;
+    mLastUsed = clock::now();
+    lock.unlock();
+
+    std::vector<uint8_t> message(INT16SZ + query.size());
+    message[0] = query.size() >> 8;
+    message[1] = query.size();
+    std::copy(query.begin(), query.end(), message.begin() + INT16SZ);
+    message[INT16SZ] = id >> 8;
+    message[INT16SZ + 1] = id;
+    // The queries waiting for their answers aren't held up by a write blocked on a full socket.
+    const int sendError = sendMessage(message);
+    lock.lock();
+    if (sendError != 0) breakLocked(sendError);
+
+    while (!pending.done && mError == 0) {
+        if (mReading) {
+            if (mCv.wait_until(lock, deadline) == std::cv_status::timeout) break;
+            continue;
+        }
+
+        // Nobody is reading: read on behalf of everyone until our own answer comes.
+        mReading = true;
+        lock.unlock();
+        auto result = readMessage(deadline);
+        lock.lock();
+        mReading = false;
+        mCv.notify_all();
+        if (result.ok()) {
+            dispatchLocked(std::move(*result));
+        } else if (result.error().code() == ETIMEDOUT) {
+            break;
+        } else {
+            LOG(DEBUG) << __func__ << ": read: " << result.error().message();
+            breakLocked(result.error().code());
+        }
+    }
+
+    mPending.erase(id);
+    mLastUsed = clock::now();
+    if (!pending.done) return mError != 0 ? -mError : -ETIMEDOUT;
+
+    const size_t len = std::min(pending.answer.size(), answer.size());
+    std::copy_n(pending.answer.begin(), len, answer.begin());
+    if (len < pending.answer.size()) {
+        LOG(WARNING) << __func__ << ": answer of " << pending.answer.size()
+                     << " bytes exceeds buf size " << answer.size();
+        reinterpret_cast<HEADER*>(answer.data())->tc = 1;
+    }
+    return len;
+}
+
+int DnsTcpConnection::sendMessage(std::span<const uint8_t> message) {
+    std::lock_guard guard(mWriteMutex);
+    for (size_t sent = 0; sent < message.size();) {
+        const ssize_t n = send(mFd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            PLOG(DEBUG) << __func__ << ": send";
+            return n < 0 ? errno : EPIPE;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+Result<std::vector<uint8_t>> DnsTcpConnection::readMessage(clock::time_point deadline) {
+    uint8_t lenbuf[INT16SZ];
+    if (auto result = pollIn(mFd, deadline); !result.ok()) return result.error();
+    // Once a message has started, the rest must follow even if the caller's deadline has passed,
+    // or the stream would be out of sync.
+    const auto messageDeadline = std::max(deadline, clock::now() + kMessageReadTimeout);
+    if (auto result = readAll(mFd, lenbuf, messageDeadline); !result.ok()) {
+        return Error(result.error().code() == ETIMEDOUT ? EPROTO : result.error().code());
+    }
+    std::vector<uint8_t> message(lenbuf[0] << 8 | lenbuf[1]);
+    if (message.size() < HFIXEDSZ) return Error(EMSGSIZE);
+    if (auto result = readAll(mFd, message, messageDeadline); !result.ok()) {
+        return Error(result.error().code() == ETIMEDOUT ? EPROTO : result.error().code());
+    }
+    return message;
+}
+
+void DnsTcpConnection::dispatchLocked(std::vector<uint8_t> message) {
+    const uint16_t id = message[0] << 8 | message[1];
+    const auto it = mPending.find(id);
+    if (it == mPending.end()) {
+        // The answer to a query that gave up waiting for it.
+        LOG(DEBUG) << __func__ << ": unexpected answer, id " << id;
+        return;
+    }
+    Pending* pending = it->second;
+    message[0] = pending->originalId >> 8;
+    message[1] = pending->originalId;
+    pending->answer = std::move(message);
+    pending->done = true;
+}
+
+void DnsTcpConnection::breakLocked(int error) {
+    if (mError == 0) mError = error != 0 ? error : EIO;
+    shutdown(mFd, SHUT_RDWR);
+    mCv.notify_all();
+}
+
+bool DnsTcpConnection::isExpired(milliseconds idleTimeout) const {
+    std::lock_guard guard(mMutex);
+    return mError != 0 || (mPending.empty() && clock::now() - mLastUsed > idleTimeout);
+}
+
+bool DnsTcpConnectionPool::Key::operator<(const Key& o) const {
+    return std::tie(netid, mark, uid, server) < std::tie(o.netid, o.mark, o.uid, o.server);
+}
+
+std::shared_ptr<DnsTcpConnection> DnsTcpConnectionPool::get(const Key& key,
+                                                            milliseconds idleTimeout) {
+    std::shared_ptr<DnsTcpConnection> connection;
+    {
+        std::lock_guard guard(mMutex);
+        const auto it = mConnections.find(key);
+        if (it == mConnections.end()) return nullptr;
+        connection = it->second;
+    }
+    // Checked without the pool lock, since it waits for the lock of the connection.
+    if (!connection->isExpired(idleTimeout)) return connection;
+    removeIfSame(key, connection);
+    return nullptr;
+}
+
+void DnsTcpConnectionPool::put(const Key& key, std::shared_ptr<DnsTcpConnection> connection,
+                               milliseconds idleTimeout) {
+    // Closes the connections that have expired, which also makes room.
+    std::vector<std::pair<Key, std::shared_ptr<DnsTcpConnection>>> others;
+    {
+        std::lock_guard guard(mMutex);
+        others.assign(mConnections.begin(), mConnections.end());
+    }
+    for (const auto& [otherKey, other] : others) {
+        if (other->isExpired(idleTimeout)) removeIfSame(otherKey, other);
+    }
+
+    std::lock_guard guard(mMutex);
+    if (mConnections.size() >= kMaxConnections && mConnections.count(key) == 0) return;
+    mConnections[key] = std::move(connection);
+}
+
+void DnsTcpConnectionPool::removeIfSame(const Key& key,
+                                        const std::shared_ptr<DnsTcpConnection>& connection) {
+    std::lock_guard guard(mMutex);
+    const auto it = mConnections.find(key);
+    if (it != mConnections.end() && it->second == connection) mConnections.erase(it);
+}
+
+}  // namespace android::net
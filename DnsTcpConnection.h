@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <netdutils/InternetAddresses.h>
+
+namespace android::net {
+
+// A cleartext DNS-over-TCP connection that can be shared by concurrent queries (RFC 7766).
+// Queries are pipelined: each one is sent as soon as it's issued, with an ID unique on the
+// connection, and answers are matched back to their query in whatever order they arrive.
+// There is no reader thread; one of the waiting queries at a time reads from the socket and
+// hands out the answers it gets to the others. All methods are thread-safe.
+class DnsTcpConnection {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // |fd| must be a connected, blocking TCP socket.
+    explicit DnsTcpConnection(base::unique_fd fd);
+
+    // Sends |query| and waits until |deadline| for its answer, which is copied to |answer|. An
+    // answer larger than |answer| is truncated and gets its TC bit set. Returns the answer
+    // length, -ETIMEDOUT if no answer came in time, or another negative errno if the connection
+    // is broken, in which case it can't be used any longer.
+    int query(std::span<const uint8_t> query, std::span<uint8_t> answer, clock::time_point deadline)
+            EXCLUDES(mMutex);
+
+    // Returns true if the connection is broken, or has been idle for longer than |idleTimeout|.
+    bool isExpired(std::chrono::milliseconds idleTimeout) const EXCLUDES(mMutex);
+
+  private:
+    struct Pending {
+        uint16_t originalId;
+        bool done = false;
+        std::vector<uint8_t> answer;
+    };
+
+    // Writes |message| whole. Returns 0 or an errno.
+    int sendMessage(std::span<const uint8_t> message) EXCLUDES(mWriteMutex);
+    // Reads one whole message. Fails with ETIMEDOUT if nothing came by |deadline|.
+    base::Result<std::vector<uint8_t>> readMessage(clock::time_point deadline);
+    void dispatchLocked(std::vector<uint8_t> message) REQUIRES(mMutex);
+    void breakLocked(int error) REQUIRES(mMutex);
+
+    const base::unique_fd mFd;
+    mutable std::mutex mMutex;
+    // Serializes writes, so that messages don't interleave. Never taken with mMutex held.
+    std::mutex mWriteMutex;
+    std::condition_variable mCv;
+    std::map<uint16_t, Pending*> mPending GUARDED_BY(mMutex);
+    uint16_t mNextId GUARDED_BY(mMutex);
+    // Whether a query is reading from the socket on behalf of the others.
+    bool mReading GUARDED_BY(mMutex) = false;
+    // The error that broke the connection, or 0.
+    int mError GUARDED_BY(mMutex) = 0;
+    clock::time_point mLastUsed GUARDED_BY(mMutex);
+
+    // How long the rest of a message may take to arrive once its first bytes were read.
+    static constexpr std::chrono::seconds kMessageReadTimeout{2};
+};
+
+// The TCP connections to DNS servers that are kept open between queries.
+class DnsTcpConnectionPool {
+  public:
+    // Connections are only shared between queries that would set up their sockets the same way.
+    struct Key {
+        unsigned netid;
+        unsigned mark;
+        uid_t uid;
+        netdutils::IPSockAddr server;
+        bool operator<(const Key& o) const;
+    };
+
+    static DnsTcpConnectionPool& getInstance() {
+        static DnsTcpConnectionPool instance;
+        return instance;
+    }
+
+    // Returns the open connection for |key|, or nullptr if there's none. The connection is
+    // closed if it has been idle for longer than |idleTimeout|.
+    std::shared_ptr<DnsTcpConnection> get(const Key& key, std::chrono::milliseconds idleTimeout)
+            EXCLUDES(mMutex);
+
+    // Keeps |connection| open for later queries, unless the pool is full. Connections that have
+    // been idle for longer than |idleTimeout| are closed first.
+    void put(const Key& key, std::shared_ptr<DnsTcpConnection> connection,
+             std::chrono::milliseconds idleTimeout) EXCLUDES(mMutex);
+
+    static constexpr size_t kMaxConnections = 32;
+
+  private:
+    // Connections are checked for expiry without mMutex, so they may have been replaced since.
+    void removeIfSame(const Key& key, const std::shared_ptr<DnsTcpConnection>& connection)
+            EXCLUDES(mMutex);
+
+    std::mutex mMutex;
+    std::map<Key, std::shared_ptr<DnsTcpConnection>> mConnections GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
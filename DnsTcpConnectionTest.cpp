@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <set>
+#include <thread>
+
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "DnsTcpConnection.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using android::base::unique_fd;
+using android::netdutils::IPSockAddr;
+
+namespace {
+
+// A query with ID |id|, told apart from the others by |marker|.
+std::vector<uint8_t> makeQuery(uint16_t id, uint8_t marker) {
+    std::vector<uint8_t> query(HFIXEDSZ + 1);
+    query[0] = id >> 8;
+    query[1] = id;
+    query[HFIXEDSZ] = marker;
+    return query;
+}
+
+// Reads one length-prefixed message from the server end of the connection.
+std::vector<uint8_t> serverRead(int fd) {
+    uint8_t len[2];
+    EXPECT_EQ(2, recv(fd, len, 2, MSG_WAITALL));
+    std::vector<uint8_t> message(len[0] << 8 | len[1]);
+    EXPECT_EQ(static_cast<ssize_t>(message.size()),
+              recv(fd, message.data(), message.size(), MSG_WAITALL));
+    return message;
+}
+
+// Answers |query|, possibly padded up to |size| bytes.
+void serverAnswer(int fd, std::vector<uint8_t> query, size_t size = 0) {
+    query[2] |= 0x80;  // QR
+    if (size > query.size()) query.resize(size);
+    std::vector<uint8_t> message = {static_cast<uint8_t>(query.size() >> 8),
+                                    static_cast<uint8_t>(query.size())};
+    message.insert(message.end(), query.begin(), query.end());
+    EXPECT_EQ(static_cast<ssize_t>(message.size()), send(fd, message.data(), message.size(), 0));
+}
+
+}  // namespace
+
+class DnsTcpConnectionTest : public ResolvTestBase {
+  protected:
+    void SetUp() override {
+        unique_fd listener(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        ASSERT_TRUE(listener.ok());
+        sockaddr_in addr = {.sin_family = AF_INET, .sin_addr = {htonl(INADDR_LOOPBACK)}};
+        socklen_t len = sizeof(addr);
+        ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr*>(&addr), len));
+        ASSERT_EQ(0, listen(listener, 1));
+        ASSERT_EQ(0, getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len));
+
+        unique_fd client(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        ASSERT_EQ(0, connect(client, reinterpret_cast<sockaddr*>(&addr), len));
+        mServer.reset(accept4(listener, nullptr, nullptr, SOCK_CLOEXEC));
+        ASSERT_TRUE(mServer.ok());
+        mConnection = std::make_shared<DnsTcpConnection>(std::move(client));
+    }
+
+    int query(const std::vector<uint8_t>& query, std::vector<uint8_t>* answer,
+              std::chrono::milliseconds timeout = 2s) {
+        answer->resize(PACKETSZ);
+        const int len =
+                mConnection->query(query, *answer, DnsTcpConnection::clock::now() + timeout);
+        answer->resize(std::max(len, 0));
+        return len;
+    }
+
+    unique_fd mServer;
+    std::shared_ptr<DnsTcpConnection> mConnection;
+};
+
+TEST_F(DnsTcpConnectionTest, PipelinedOutOfOrder) {
+    constexpr int kQueries = 3;
+    std::thread server([this]() {
+        std::vector<std::vector<uint8_t>> queries;
+        for (int i = 0; i < kQueries; i++) queries.push_back(serverRead(mServer));
+        // All queries are on the wire before any answer, and they got distinct IDs even though
+        // they were sent with the same one.
+        std::set<uint16_t> ids;
+        for (const auto& q : queries) ids.insert(q[0] << 8 | q[1]);
+        EXPECT_EQ(static_cast<size_t>(kQueries), ids.size());
+        for (int i = kQueries - 1; i >= 0; i--) serverAnswer(mServer, queries[i]);
+    });
+
+    std::vector<std::thread> clients;
+    for (int i = 0; i < kQueries; i++) {
+        clients.emplace_back([this, i]() {
+            std::vector<uint8_t> answer;
+            ASSERT_EQ(HFIXEDSZ + 1, query(makeQuery(0x1234, i), &answer));
+            EXPECT_EQ(0x12, answer[0]);
+            EXPECT_EQ(0x34, answer[1]);
+            EXPECT_EQ(i, answer[HFIXEDSZ]);
+        });
+    }
+    for (auto& client : clients) client.join();
+    server.join();
+    EXPECT_FALSE(mConnection->isExpired(1h));
+}
+
+TEST_F(DnsTcpConnectionTest, Timeout) {
+    std::vector<uint8_t> answer;
+    EXPECT_EQ(-ETIMEDOUT, query(makeQuery(1, 1), &answer, 100ms));
+    const std::vector<uint8_t> late = serverRead(mServer);
+
+    // The late answer is dropped, and the connection keeps working.
+    std::thread server([&]() {
+        const std::vector<uint8_t> next = serverRead(mServer);
+        serverAnswer(mServer, late);
+        serverAnswer(mServer, next);
+    });
+    ASSERT_EQ(HFIXEDSZ + 1, query(makeQuery(2, 2), &answer));
+    EXPECT_EQ(2, answer[1]);
+    EXPECT_EQ(2, answer[HFIXEDSZ]);
+    server.join();
+}
+
+TEST_F(DnsTcpConnectionTest, Truncated) {
+    std::thread server([this]() { serverAnswer(mServer, serverRead(mServer), PACKETSZ + 100); });
+    std::vector<uint8_t> answer;
+    ASSERT_EQ(PACKETSZ, query(makeQuery(1, 1), &answer));
+    EXPECT_TRUE(reinterpret_cast<const HEADER*>(answer.data())->tc);
+    server.join();
+}
+
+TEST_F(DnsTcpConnectionTest, Broken) {
+    std::thread server([this]() {
+        serverRead(mServer);
+        mServer.reset();
+    });
+    std::vector<uint8_t> answer;
+    const int len = query(makeQuery(1, 1), &answer);
+    EXPECT_LT(len, 0);
+    EXPECT_NE(-ETIMEDOUT, len);
+    server.join();
+    EXPECT_TRUE(mConnection->isExpired(1h));
+    EXPECT_EQ(len, query(makeQuery(2, 2), &answer));
+}
+
+TEST_F(DnsTcpConnectionTest, Pool) {
+    DnsTcpConnectionPool pool;
+    const DnsTcpConnectionPool::Key key = {
+            .netid = 30,
+            .mark = 0,
+            .uid = 0,
+            .server = IPSockAddr::toIPSockAddr("127.0.0.1", 53),
+    };
+    DnsTcpConnectionPool::Key otherKey = key;
+    otherKey.uid = 1;
+
+    EXPECT_EQ(nullptr, pool.get(key, 1h));
+    pool.put(key, mConnection, 1h);
+    EXPECT_EQ(mConnection, pool.get(key, 1h));
+    EXPECT_EQ(nullptr, pool.get(otherKey, 1h));
+
+    // Idle connections are closed.
+    std::this_thread::sleep_for(20ms);
+    EXPECT_EQ(nullptr, pool.get(key, 10ms));
+}
+
+}  // namespace android::net
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsTlsBufferPool.h"
+
+namespace android::net {
+
+std::vector<uint8_t> DnsTlsBufferPool::acquire(size_t size) {
+    std::vector<uint8_t> buffer;
+    {
+        std::lock_guard guard(mLock);
+        if (!mFree.empty()) {
+            buffer = std::move(mFree.back());
+            mFree.pop_back();
+        }
+    }
+    if (buffer.capacity() < kBufferSize) buffer.reserve(kBufferSize);
+    buffer.resize(size);
+    return buffer;
+}
+
+void DnsTlsBufferPool::release(std::vector<uint8_t>&& buffer) {
+    if (buffer.capacity() < kBufferSize) return;
+    std::lock_guard guard(mLock);
+    if (mFree.size() >= mMaxBuffers) return;
+    mFree.push_back(std::move(buffer));
+}
+
+size_t DnsTlsBufferPool::size() const {
+    std::lock_guard guard(mLock);
+    return mFree.size();
+}
+
+}  // namespace android::net
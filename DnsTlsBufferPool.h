@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Recycles the buffers that DoT responses are read into. A buffer is filled by the DnsTlsSocket,
+// moved through DnsTlsTransport and DnsTlsQueryMap to the DnsTlsDispatcher, which copies the
+// answer out for the caller and gives the buffer back, so that each response doesn't allocate a
+// new one. This class is thread-safe.
+class DnsTlsBufferPool {
+  public:
+    // Large enough for the responses that DnsTlsSocket keeps.
+    static constexpr size_t kBufferSize = 8192;
+    static constexpr size_t kDefaultMaxBuffers = 64;
+
+    explicit DnsTlsBufferPool(size_t maxBuffers) : mMaxBuffers(maxBuffers) {}
+
+    static DnsTlsBufferPool& getInstance() {
+        static DnsTlsBufferPool instance(kDefaultMaxBuffers);
+        return instance;
+    }
+
+    // Returns a buffer of |size| bytes, recycled if possible. Its contents are unspecified.
+    std::vector<uint8_t> acquire(size_t size) EXCLUDES(mLock);
+    // Keeps |buffer| for reuse, unless the pool is full or it's too small to be worth keeping.
+    void release(std::vector<uint8_t>&& buffer) EXCLUDES(mLock);
+
+    size_t size() const EXCLUDES(mLock);
+
+  private:
+    mutable std::mutex mLock;
+    std::vector<std::vector<uint8_t>> mFree GUARDED_BY(mLock);
+    const size_t mMaxBuffers;
+};
+
+}  // namespace android::net
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsTlsBufferPool.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class DnsTlsBufferPoolTest : public ResolvTestBase {
+  protected:
+    DnsTlsBufferPool mPool{2};
+};
+
+TEST_F(DnsTlsBufferPoolTest, Recycle) {
+    std::vector<uint8_t> buffer = mPool.acquire(100);
+    EXPECT_EQ(100U, buffer.size());
+    EXPECT_GE(buffer.capacity(), DnsTlsBufferPool::kBufferSize);
+    const uint8_t* const data = buffer.data();
+
+    mPool.release(std::move(buffer));
+    EXPECT_EQ(1U, mPool.size());
+    // Without allocating, even if larger.
+    std::vector<uint8_t> again = mPool.acquire(DnsTlsBufferPool::kBufferSize);
+    EXPECT_EQ(data, again.data());
+    EXPECT_EQ(DnsTlsBufferPool::kBufferSize, again.size());
+    EXPECT_EQ(0U, mPool.size());
+}
+
+TEST_F(DnsTlsBufferPoolTest, Bounded) {
+    for (int i = 0; i < 3; i++) mPool.release(mPool.acquire(10));
+    EXPECT_EQ(1U, mPool.size());
+    std::vector<std::vector<uint8_t>> buffers;
+    for (int i = 0; i < 3; i++) buffers.push_back(mPool.acquire(10));
+    for (auto& buffer : buffers) mPool.release(std::move(buffer));
+    EXPECT_EQ(2U, mPool.size());
+
+    // Buffers that didn't come from a pool are too small to be kept.
+    mPool.acquire(10);
+    mPool.release(std::vector<uint8_t>(10));
+    EXPECT_EQ(1U, mPool.size());
+}
+
+}  // namespace android::net
@@ -15,14 +15,25 @@
  */
 
 #define LOG_TAG "resolv"
+#define ATRACE_TAG ATRACE_TAG_NETWORK
 
 #include "DnsTlsDispatcher.h"
 
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
 #include <netdutils/Stopwatch.h>
+#include <utils/Trace.h>
 
+#include "DnsTlsBufferPool.h"
 #include "DnsTlsSocketFactory.h"
 #include "Experiments.h"
 #include "PrivateDnsConfiguration.h"
+#include "ResolvTrace.h"
+#include "ServerLoad.h"
 #include "resolv_cache.h"
 #include "resolv_private.h"
 #include "stats.pb.h"
@@ -36,9 +47,6 @@ using android::netdutils::IPSockAddr;
 using android::netdutils::Stopwatch;
 using netdutils::Slice;
 
-// static
-std::mutex DnsTlsDispatcher::sLock;
-
 DnsTlsDispatcher::DnsTlsDispatcher() {
     mFactory.reset(new DnsTlsSocketFactory());
 }
@@ -48,6 +56,21 @@ DnsTlsDispatcher& DnsTlsDispatcher::getInstance() {
     return instance;
 }
 
+DnsTlsDispatcher::Shard& DnsTlsDispatcher::getShard(const Key& key) {
+    // Only the address, as servers that only differ by name are rare.
+    const sockaddr_storage& ss = key.second.ss;
+    std::string_view address;
+    if (ss.ss_family == AF_INET) {
+        const auto& sin = reinterpret_cast<const sockaddr_in&>(ss);
+        address = {reinterpret_cast<const char*>(&sin.sin_addr), sizeof(sin.sin_addr)};
+    } else if (ss.ss_family == AF_INET6) {
+        const auto& sin6 = reinterpret_cast<const sockaddr_in6&>(ss);
+        address = {reinterpret_cast<const char*>(&sin6.sin6_addr), sizeof(sin6.sin6_addr)};
+    }
+    const size_t hash = std::hash<std::string_view>()(address) ^ (key.first * 0x9e3779b9U);
+    return mShards[hash % kShards];
+}
+
 std::list<DnsTlsServer> DnsTlsDispatcher::getOrderedAndUsableServerList(
         const std::list<DnsTlsServer>& tlsServers, unsigned netId, unsigned mark) {
     // Our preferred DnsTlsServer order is:
@@ -62,39 +85,31 @@ std::list<DnsTlsServer> DnsTlsDispatcher::getOrderedAndUsableServerList(
 
     // Pull out any servers for which we might have existing connections and
     // place them at the from the list of servers to try.
-    {
-        std::lock_guard guard(sLock);
-
-        for (const auto& tlsServer : tlsServers) {
-            const Key key = std::make_pair(mark, tlsServer);
-            if (const Transport* xport = getTransport(key); xport != nullptr) {
-                // DoT revalidation specific feature.
-                if (!xport->usable()) {
-                    // Don't use this xport. It will be removed after timeout
-                    // (IDLE_TIMEOUT minutes).
-                    LOG(DEBUG) << "Skip using DoT server " << tlsServer.toIpString() << " on "
-                               << netId;
-                    continue;
-                }
-
-                switch (tlsServer.ss.ss_family) {
-                    case AF_INET:
-                        existing4.push_back(tlsServer);
-                        break;
-                    case AF_INET6:
-                        existing6.push_back(tlsServer);
-                        break;
-                }
-            } else {
-                switch (tlsServer.ss.ss_family) {
-                    case AF_INET:
-                        new4.push_back(tlsServer);
-                        break;
-                    case AF_INET6:
-                        new6.push_back(tlsServer);
-                        break;
-                }
+    for (const auto& tlsServer : tlsServers) {
+        const Key key = std::make_pair(mark, tlsServer);
+        Shard& shard = getShard(key);
+        bool exists;
+        {
+            std::lock_guard guard(shard.lock);
+            const Transport* xport = getTransport(shard, key);
+            // DoT revalidation specific feature.
+            if (xport != nullptr && !xport->usable()) {
+                // Don't use this xport. It will be removed after timeout
+                // (IDLE_TIMEOUT minutes).
+                LOG(DEBUG) << "Skip using DoT server " << tlsServer.toIpString() << " on "
+                           << netId;
+                continue;
             }
+            exists = xport != nullptr;
+        }
+
+        switch (tlsServer.ss.ss_family) {
+            case AF_INET:
+                (exists ? existing4 : new4).push_back(tlsServer);
+                break;
+            case AF_INET6:
+                (exists ? existing6 : new6).push_back(tlsServer);
+                break;
         }
     }
 
@@ -102,6 +117,31 @@ std::list<DnsTlsServer> DnsTlsDispatcher::getOrderedAndUsableServerList(
     out.splice(out.cend(), existing4);
     out.splice(out.cend(), new6);
     out.splice(out.cend(), new4);
+
+    // Rank the servers by their DnsStats score instead, as sort_nameservers does for cleartext
+    // DNS. A server gains score each time another one is queried, so none starves, and servers
+    // that have never been tried are tried first.
+    if (Experiments::getInstance()->getFlag("dot_sort_servers", 0) == 1) {
+        const auto ranking = resolv_stats_get_sorted_servers(netId, PROTO_DOT);
+        const auto rank = [&ranking](const DnsTlsServer& server) {
+            return std::find(ranking.begin(), ranking.end(), IPSockAddr::toIPSockAddr(server.ss)) -
+                   ranking.begin();
+        };
+        // Stable, so servers that DnsStats doesn't track keep the order above, after the others.
+        out.sort([&rank](const auto& a, const auto& b) { return rank(a) < rank(b); });
+    }
+
+    if (const auto mode = ServerLoad::mode(); mode != ServerLoad::Mode::OFF && out.size() > 1) {
+        std::vector<DnsTlsServer> servers(out.begin(), out.end());
+        std::vector<IPSockAddr> addrs;
+        for (const auto& server : servers) addrs.push_back(IPSockAddr::toIPSockAddr(server.ss));
+        const auto candidates = ServerLoad::getInstance().candidates(
+                netId, addrs, PROTO_DOT, [netId](const IPSockAddr& server) {
+                    return resolv_stats_get_latency_percentile(netId, server, PROTO_DOT, 50);
+                });
+        out.clear();
+        for (size_t i : ServerLoad::order(mode, candidates)) out.push_back(servers[i]);
+    }
     return out;
 }
 
@@ -117,13 +157,19 @@ DnsTlsTransport::Response DnsTlsDispatcher::query(const std::list<DnsTlsServer>&
     DnsTlsTransport::Response code = DnsTlsTransport::Response::internal_error;
     int serverCount = 0;
     for (const auto& server : servers) {
+        // Nobody would read the answer from the next server.
+        if (serverCount > 0 && statp->isCancelled()) break;
         DnsQueryEvent* dnsQueryEvent =
                 statp->event->mutable_dns_query_events()->add_dns_query_event();
 
         bool connectTriggered = false;
         Stopwatch queryStopwatch;
-        code = this->query(server, statp->netid, statp->mark, query, ans, resplen,
-                           &connectTriggered);
+        {
+            ServerLoad::ScopedQuery load(statp->netid, IPSockAddr::toIPSockAddr(server.ss),
+                                         PROTO_DOT);
+            code = this->query(server, statp->netid, statp->mark, query, ans, resplen,
+                               &connectTriggered);
+        }
 
         dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(queryStopwatch.timeTakenUs()));
         dnsQueryEvent->set_dns_server_index(serverCount++);
@@ -166,6 +212,43 @@ DnsTlsTransport::Response DnsTlsDispatcher::query(const std::list<DnsTlsServer>&
     return code;
 }
 
+bool DnsTlsDispatcher::warmUp(const DnsTlsServer& server, unsigned netId, unsigned mark) {
+    const Key key = std::make_pair(mark, server);
+    Shard& shard = getShard(key);
+    Transport* xport;
+    {
+        std::lock_guard guard(shard.lock);
+        if (xport = getTransport(shard, key); xport == nullptr) {
+            xport = addTransport(shard, server, mark, netId);
+        }
+        ++xport->useCount;
+    }
+
+    // The handshake happens without the lock of the shard held, as for queries.
+    const bool connected = xport->transport.warmUp();
+    xport->lastUsed = std::chrono::steady_clock::now();
+    --xport->useCount;
+    return connected;
+}
+
+bool DnsTlsDispatcher::validate(const DnsTlsServer& server, unsigned netId, unsigned mark) {
+    const Key key = std::make_pair(mark, server);
+    Shard& shard = getShard(key);
+    Transport* xport;
+    {
+        std::lock_guard guard(shard.lock);
+        if (xport = getTransport(shard, key); xport == nullptr) {
+            xport = addTransport(shard, server, mark, netId);
+        }
+        ++xport->useCount;
+    }
+
+    const bool success = DnsTlsTransport::validate(server, mark, xport->transport);
+    xport->lastUsed = std::chrono::steady_clock::now();
+    --xport->useCount;
+    return success;
+}
+
 DnsTlsTransport::Response DnsTlsDispatcher::query(const DnsTlsServer& server, unsigned netId,
                                                   unsigned mark, const Slice query, const Slice ans,
                                                   int* resplen, bool* connectTriggered) {
@@ -173,21 +256,24 @@ DnsTlsTransport::Response DnsTlsDispatcher::query(const DnsTlsServer& server, un
     // merely due to different mark, such as the bit explicitlySelected unset.
     // See if we can save them and just create one connection for one DoT server.
     const Key key = std::make_pair(mark, server);
+    Shard& shard = getShard(key);
     Transport* xport;
     {
-        std::lock_guard guard(sLock);
-        if (xport = getTransport(key); xport == nullptr) {
-            xport = addTransport(server, mark, netId);
+        std::lock_guard guard(shard.lock);
+        if (xport = getTransport(shard, key);
+            xport == nullptr || needsAnotherTransport(shard, key, *xport)) {
+            xport = addTransport(shard, server, mark, netId);
         }
         ++xport->useCount;
     }
 
-    // Don't call this function and hold sLock at the same time because of the following reason:
-    // TLS handshake requires a lock which is also needed by this function, if the handshake gets
-    // stuck, this function also gets blocked.
+    // Don't call this function and hold the lock of the shard at the same time because of the
+    // following reason: TLS handshake requires a lock which is also needed by this function, if
+    // the handshake gets stuck, this function also gets blocked.
     const int connectCounter = xport->transport.getConnectCounter();
 
-    const auto& result = queryInternal(*xport, query);
+    const auto start = std::chrono::steady_clock::now();
+    auto result = queryInternal(*xport, query);
     *connectTriggered = (xport->transport.getConnectCounter() > connectCounter);
 
     DnsTlsTransport::Response code = result.code;
@@ -200,44 +286,62 @@ DnsTlsTransport::Response DnsTlsDispatcher::query(const DnsTlsServer& server, un
             *resplen = result.response.size();
             netdutils::copy(ans, netdutils::makeSlice(result.response));
         }
+        DnsTlsBufferPool::getInstance().release(std::move(result.response));
     } else {
         LOG(DEBUG) << "Query failed: " << (unsigned int)code;
     }
 
     auto now = std::chrono::steady_clock::now();
-    {
-        std::lock_guard guard(sLock);
-        --xport->useCount;
-        xport->lastUsed = now;
-
-        // DoT revalidation specific feature.
-        if (xport->checkRevalidationNecessary(code)) {
-            // Even if the revalidation passes, it doesn't guarantee that DoT queries
-            // to the xport can stop failing because revalidation creates a new connection
-            // to probe while the xport still uses an existing connection. So far, there isn't
-            // a feasible way to force the xport to disconnect the connection. If the case
-            // happens, the xport will be marked as unusable and DoT queries won't be sent to
-            // it anymore. Eventually, after IDLE_TIMEOUT, the xport will be destroyed, and
-            // a new xport will be created.
-            const auto result = PrivateDnsConfiguration::getInstance().requestValidation(
-                    netId, PrivateDnsConfiguration::ServerIdentity{server}, mark);
-            LOG(WARNING) << "Requested validation for " << server.toIpString() << " with mark 0x"
-                         << std::hex << mark << ", "
-                         << (result.ok() ? "succeeded" : "failed: " + result.error().message());
-        }
-
-        cleanup(now);
+    xport->lastUsed = now;
+    xport->recordLatency(std::chrono::duration_cast<std::chrono::milliseconds>(now - start));
+    const bool revalidate = xport->checkRevalidationNecessary(code);
+    // Once it is no longer in use, xport may be destroyed at any time.
+    --xport->useCount;
+
+    // DoT revalidation specific feature.
+    if (revalidate) {
+        // Even if the revalidation passes, it doesn't guarantee that DoT queries
+        // to the xport can stop failing because revalidation creates a new connection
+        // to probe while the xport still uses an existing connection. So far, there isn't
+        // a feasible way to force the xport to disconnect the connection. If the case
+        // happens, the xport will be marked as unusable and DoT queries won't be sent to
+        // it anymore. Eventually, after IDLE_TIMEOUT, the xport will be destroyed, and
+        // a new xport will be created.
+        const auto result = PrivateDnsConfiguration::getInstance().requestValidation(
+                netId, PrivateDnsConfiguration::ServerIdentity{server}, mark);
+        LOG(WARNING) << "Requested validation for " << server.toIpString() << " with mark 0x"
+                     << std::hex << mark << ", "
+                     << (result.ok() ? "succeeded" : "failed: " + result.error().message());
     }
+
+    cleanup(shard, now);
     return code;
 }
 
 void DnsTlsDispatcher::forceCleanup(unsigned netId) {
-    std::lock_guard guard(sLock);
-    forceCleanupLocked(netId);
+    for (Shard& shard : mShards) {
+        std::lock_guard guard(shard.lock);
+        forceCleanupLocked(shard, netId);
+    }
+}
+
+size_t DnsTlsDispatcher::getMemoryUsage(unsigned netId) {
+    size_t bytes = 0;
+    for (Shard& shard : mShards) {
+        std::lock_guard guard(shard.lock);
+        for (const auto& [_, pool] : shard.store) {
+            for (const auto& xport : pool) {
+                if (xport->mNetId != netId) continue;
+                bytes += sizeof(Transport) + kConnectionMemoryEstimate;
+            }
+        }
+    }
+    return bytes;
 }
 
 DnsTlsTransport::Result DnsTlsDispatcher::queryInternal(Transport& xport,
                                                         const netdutils::Slice query) {
+    ATRACE_NAME("DnsTlsTransport::query");
     LOG(DEBUG) << "Sending query of length " << query.size();
 
     // If dot_async_handshake is not set, the call might block in some cases; otherwise,
@@ -265,41 +369,40 @@ DnsTlsTransport::Result DnsTlsDispatcher::queryInternal(Transport& xport,
 
 // This timeout effectively controls how long to keep SSL session tickets.
 static constexpr std::chrono::minutes IDLE_TIMEOUT(5);
-void DnsTlsDispatcher::cleanup(std::chrono::time_point<std::chrono::steady_clock> now) {
-    // To avoid scanning mStore after every query, return early if a cleanup has been
+void DnsTlsDispatcher::cleanup(Shard& shard,
+                               std::chrono::time_point<std::chrono::steady_clock> now) {
+    // Queries to this shard don't wait for another thread's cleanup, or for a lookup that will
+    // be done in a moment.
+    std::unique_lock lock(shard.lock, std::try_to_lock);
+    if (!lock.owns_lock()) return;
+    // To avoid scanning the shard after every query, return early if a cleanup has been
     // performed recently.
-    if (now - mLastCleanup < IDLE_TIMEOUT) {
+    if (now - shard.lastCleanup < IDLE_TIMEOUT) {
         return;
     }
-    for (auto it = mStore.begin(); it != mStore.end();) {
-        auto& s = it->second;
-        if (s->useCount == 0 && now - s->lastUsed > IDLE_TIMEOUT) {
-            it = mStore.erase(it);
-        } else {
-            ++it;
-        }
+    for (auto it = shard.store.begin(); it != shard.store.end();) {
+        std::erase_if(it->second, [now](const auto& s) {
+            return s->useCount == 0 && now - s->lastUsed.load() > IDLE_TIMEOUT;
+        });
+        it = it->second.empty() ? shard.store.erase(it) : std::next(it);
     }
-    mLastCleanup = now;
+    shard.lastCleanup = now;
 }
 
 // TODO: unify forceCleanupLocked() and cleanup().
-void DnsTlsDispatcher::forceCleanupLocked(unsigned netId) {
-    for (auto it = mStore.begin(); it != mStore.end();) {
-        auto& s = it->second;
-        if (s->useCount == 0 && s->mNetId == netId) {
-            it = mStore.erase(it);
-        } else {
-            ++it;
-        }
+void DnsTlsDispatcher::forceCleanupLocked(Shard& shard, unsigned netId) {
+    for (auto it = shard.store.begin(); it != shard.store.end();) {
+        std::erase_if(it->second, [netId](const auto& s) {
+            return s->useCount == 0 && s->mNetId == netId;
+        });
+        it = it->second.empty() ? shard.store.erase(it) : std::next(it);
     }
 }
 
-DnsTlsDispatcher::Transport* DnsTlsDispatcher::addTransport(const DnsTlsServer& server,
+DnsTlsDispatcher::Transport* DnsTlsDispatcher::addTransport(Shard& shard,
+                                                            const DnsTlsServer& server,
                                                             unsigned mark, unsigned netId) {
     const Key key = std::make_pair(mark, server);
-    Transport* ret = getTransport(key);
-    if (ret != nullptr) return ret;
-
     const Experiments* const instance = Experiments::getInstance();
     int triggerThr =
             instance->getFlag("dot_revalidation_threshold", Transport::kDotRevalidationThreshold);
@@ -322,33 +425,67 @@ DnsTlsDispatcher::Transport* DnsTlsDispatcher::addTransport(const DnsTlsServer&
         queryTimeout = 1000;
     }
 
-    ret = new Transport(server, mark, netId, mFactory.get(), revalidationEnabled, triggerThr,
-                        unusableThr, queryTimeout);
+    Transport* const ret = new Transport(server, mark, netId, mFactory.get(), revalidationEnabled,
+                                         triggerThr, unusableThr, queryTimeout);
     LOG(DEBUG) << "Transport is initialized with { " << triggerThr << ", " << unusableThr << ", "
                << queryTimeout << "ms }"
                << " for server { " << server.toIpString() << "/" << server.name << " }";
 
-    mStore[key].reset(ret);
+    std::vector<std::unique_ptr<Transport>>& pool = shard.store[key];
+    pool.emplace_back(ret);
+    if (pool.size() > 1) {
+        LOG(INFO) << "Opened connection " << pool.size() << " to " << server.toIpString();
+    }
 
     return ret;
 }
 
-DnsTlsDispatcher::Transport* DnsTlsDispatcher::getTransport(const Key& key) {
-    auto it = mStore.find(key);
-    return (it == mStore.end() ? nullptr : it->second.get());
+DnsTlsDispatcher::Transport* DnsTlsDispatcher::getTransport(Shard& shard, const Key& key) {
+    auto it = shard.store.find(key);
+    if (it == shard.store.end()) return nullptr;
+    Transport* best = nullptr;
+    for (const auto& xport : it->second) {
+        if (best == nullptr || (xport->usable() && !best->usable()) ||
+            (xport->usable() == best->usable() && xport->useCount < best->useCount)) {
+            best = xport.get();
+        }
+    }
+    return best;
+}
+
+bool DnsTlsDispatcher::needsAnotherTransport(Shard& shard, const Key& key,
+                                             const Transport& xport) {
+    const Experiments* const instance = Experiments::getInstance();
+    const int maxConnections =
+            instance->getFlag("dot_max_connections", Transport::kDotMaxConnections);
+    if (shard.store[key].size() >= static_cast<size_t>(std::max(maxConnections, 1))) return false;
+
+    const int depthThr =
+            instance->getFlag("dot_pool_depth_threshold", Transport::kDotPoolDepthThreshold);
+    if (depthThr > 0 && xport.useCount >= depthThr) return true;
+    // Latency only stalls anything when there are queries queued behind a slow one.
+    const int latencyThr = instance->getFlag("dot_pool_latency_threshold_ms",
+                                             Transport::kDotPoolLatencyThresholdMs);
+    return latencyThr > 0 && xport.useCount > 0 && xport.latency.load().count() > latencyThr;
+}
+
+void DnsTlsDispatcher::Transport::recordLatency(std::chrono::milliseconds sample) {
+    auto old = latency.load();
+    while (!latency.compare_exchange_weak(old,
+                                          (old.count() == 0) ? sample : (old * 7 + sample) / 8)) {
+    }
 }
 
 bool DnsTlsDispatcher::Transport::checkRevalidationNecessary(DnsTlsTransport::Response code) {
     if (!revalidationEnabled) return false;
 
-    if (code == DnsTlsTransport::Response::network_error) {
-        continuousfailureCount++;
-    } else {
-        continuousfailureCount = 0;
-    }
+    // Only the query that brings the count to the threshold triggers a validation.
+    const int failures = (code == DnsTlsTransport::Response::network_error)
+                                 ? ++continuousfailureCount
+                                 : (continuousfailureCount = 0);
 
     // triggerThreshold must be greater than 0 because the value of revalidationEnabled is true.
-    if (usable() && continuousfailureCount == triggerThreshold) {
+    if (failures < unusableThreshold && failures == triggerThreshold) {
         return true;
     }
     return false;
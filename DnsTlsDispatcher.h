@@ -17,10 +17,13 @@
 #ifndef _DNS_DNSTLSDISPATCHER_H
 #define _DNS_DNSTLSDISPATCHER_H
 
+#include <array>
+#include <atomic>
 #include <list>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <vector>
 
 #include <android-base/thread_annotations.h>
 #include <netdutils/Slice.h>
@@ -36,6 +39,12 @@ namespace net {
 
 // This is a singleton class that manages the collection of active DnsTlsTransports.
 // Queries made here are dispatched to an existing or newly constructed DnsTlsTransport.
+// Each <mark, server> has a pool of up to "dot_max_connections" transports, each with its own
+// connection, so that a slow response or a retransmit only stalls the queries on one of them.
+// Queries go to the least loaded transport, and another one is added when that one has too many
+// queries in flight or has been responding slowly.
+// The pools are spread over shards, each with its own lock, so that queries to different servers
+// don't contend; the usage of a transport is kept in atomics, so finishing a query takes no lock.
 // TODO: PrivateDnsValidationObserver is not implemented in this class. Remove it.
 class DnsTlsDispatcher : public PrivateDnsValidationObserver {
   public:
@@ -63,19 +72,31 @@ class DnsTlsDispatcher : public PrivateDnsValidationObserver {
                                     const netdutils::Slice query, const netdutils::Slice ans,
                                     int* _Nonnull resplen, bool* _Nonnull connectTriggered);
 
+    // Opens a connection to |server| on the network indicated by |mark|, so that the first query
+    // to it doesn't wait for the handshake. The transport is then kept as if it had just been
+    // used, and the connection closes once idle as any other. Returns whether it's open.
+    bool warmUp(const DnsTlsServer& server, unsigned netId, unsigned mark);
+
+    // Runs DnsTlsTransport::validate() on the transport that queries to |server| would use, so
+    // that the connection and TLS session it sets up are the ones those queries get.
+    bool validate(const DnsTlsServer& server, unsigned netId, unsigned mark);
+
     // Implement PrivateDnsValidationObserver.
     void onValidationStateUpdate(const std::string&, Validation, uint32_t) override{};
 
-    void forceCleanup(unsigned netId) EXCLUDES(sLock);
+    void forceCleanup(unsigned netId);
+
+    // Approximate bytes of memory held by the transports of network |netId|, counting each
+    // connection as kConnectionMemoryEstimate.
+    size_t getMemoryUsage(unsigned netId);
+
+    // What an open TLS connection takes in BoringSSL and socket buffers, roughly: the read and
+    // write buffers of the record layer, the session, and the certificate chain.
+    static constexpr size_t kConnectionMemoryEstimate = 48 * 1024;
 
   private:
     DnsTlsDispatcher();
 
-    // This lock is static so that it can be used to annotate the Transport struct.
-    // DnsTlsDispatcher is a singleton in practice, so making this static does not change
-    // the locking behavior.
-    static std::mutex sLock;
-
     // Key = <mark, server>
     typedef std::pair<unsigned, const DnsTlsServer> Key;
 
@@ -99,26 +120,35 @@ class DnsTlsDispatcher : public PrivateDnsValidationObserver {
         const unsigned mNetId;
 
         // This use counter and timestamp are used to ensure that only idle sessions are
-        // destroyed.
-        int useCount GUARDED_BY(sLock) = 0;
+        // destroyed. useCount is only incremented with the lock of the shard held, which is what
+        // keeps a transport in use from being destroyed, and decrementing it must be the last
+        // access to the transport by a query.
+        std::atomic<int> useCount = 0;
         // lastUsed is only guaranteed to be meaningful after useCount is decremented to zero.
-        std::chrono::time_point<std::chrono::steady_clock> lastUsed GUARDED_BY(sLock);
+        std::atomic<std::chrono::time_point<std::chrono::steady_clock>> lastUsed;
+        // Moving average of how long queries take, which is zero until one has completed.
+        std::atomic<std::chrono::milliseconds> latency{std::chrono::milliseconds(0)};
+
+        void recordLatency(std::chrono::milliseconds sample);
 
         // If DoT revalidation is disabled, it returns true; otherwise, it returns
         // whether or not this Transport is usable.
-        bool usable() const REQUIRES(sLock);
+        bool usable() const;
 
-        bool checkRevalidationNecessary(DnsTlsTransport::Response code) REQUIRES(sLock);
+        bool checkRevalidationNecessary(DnsTlsTransport::Response code);
 
         std::chrono::milliseconds timeout() const { return mTimeout; }
 
         static constexpr int kDotRevalidationThreshold = -1;
         static constexpr int kDotXportUnusableThreshold = -1;
         static constexpr int kDotQueryTimeoutMs = -1;
+        static constexpr int kDotMaxConnections = 1;
+        static constexpr int kDotPoolDepthThreshold = 8;
+        static constexpr int kDotPoolLatencyThresholdMs = 500;
 
       private:
         // Used to track if this Transport is usable.
-        int continuousfailureCount GUARDED_BY(sLock) = 0;
+        std::atomic<int> continuousfailureCount = 0;
 
         // Used to indicate whether DoT revalidation is enabled for this Transport.
         // The value is set to true only if:
@@ -144,27 +174,42 @@ class DnsTlsDispatcher : public PrivateDnsValidationObserver {
         const std::chrono::milliseconds mTimeout;
     };
 
-    Transport* _Nullable addTransport(const DnsTlsServer& server, unsigned mark, unsigned netId)
-            REQUIRES(sLock);
-    Transport* _Nullable getTransport(const Key& key) REQUIRES(sLock);
+    struct Shard {
+        std::mutex lock;
+        // Cache of reusable DnsTlsTransports.  Transports stay in cache as long as
+        // they are in use and for a few minutes after.  Pools are never empty.
+        std::map<Key, std::vector<std::unique_ptr<Transport>>> store GUARDED_BY(lock);
+        // The last time we did a cleanup.  For efficiency, we only perform a cleanup once every
+        // few minutes.
+        std::chrono::time_point<std::chrono::steady_clock> lastCleanup GUARDED_BY(lock);
+    };
+
+    static constexpr size_t kShards = 16;
+    Shard& getShard(const Key& key);
 
-    // Cache of reusable DnsTlsTransports.  Transports stay in cache as long as
-    // they are in use and for a few minutes after.
-    std::map<Key, std::unique_ptr<Transport>> mStore GUARDED_BY(sLock);
+    // Adds a transport to the pool of |server| and |mark|, which is in |shard|.
+    Transport* _Nullable addTransport(Shard& shard, const DnsTlsServer& server, unsigned mark,
+                                      unsigned netId) REQUIRES(shard.lock);
+    // Returns the transport of |key| with the fewest queries in flight, preferring usable ones and
+    // the oldest ones, or nullptr if there is none.
+    Transport* _Nullable getTransport(Shard& shard, const Key& key) REQUIRES(shard.lock);
+    // Whether the pool of |key| should grow, rather than |xport|, its least loaded transport, take
+    // another query.
+    bool needsAnotherTransport(Shard& shard, const Key& key, const Transport& xport)
+            REQUIRES(shard.lock);
 
-    // The last time we did a cleanup.  For efficiency, we only perform a cleanup once every
-    // few minutes.
-    std::chrono::time_point<std::chrono::steady_clock> mLastCleanup GUARDED_BY(sLock);
+    std::array<Shard, kShards> mShards;
 
-    DnsTlsTransport::Result queryInternal(Transport& transport, const netdutils::Slice query)
-            EXCLUDES(sLock);
+    DnsTlsTransport::Result queryInternal(Transport& transport, const netdutils::Slice query);
 
-    // Drop any cache entries whose useCount is zero and which have not been used recently.
-    // This function performs a linear scan of mStore.
-    void cleanup(std::chrono::time_point<std::chrono::steady_clock> now) REQUIRES(sLock);
+    // Drop any cache entries of |shard| whose useCount is zero and which have not been used
+    // recently. Each shard is only scanned when a query to it finishes, and skipped when another
+    // thread holds its lock.
+    void cleanup(Shard& shard, std::chrono::time_point<std::chrono::steady_clock> now)
+            EXCLUDES(shard.lock);
 
-    // Force dropping any Transports whose useCount is zero.
-    void forceCleanupLocked(unsigned netId) REQUIRES(sLock);
+    // Force dropping any Transports of |shard| whose useCount is zero.
+    void forceCleanupLocked(Shard& shard, unsigned netId) REQUIRES(shard.lock);
 
     // Return a sorted list of usable DnsTlsServers in preference order.
     std::list<DnsTlsServer> getOrderedAndUsableServerList(const std::list<DnsTlsServer>& tlsServers,
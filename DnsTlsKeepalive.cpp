@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsTlsKeepalive.h"
+
+#include <arpa/nameser.h>
+
+#include "DnsMessageIndex.h"
+
+namespace android::net {
+
+namespace {
+
+constexpr uint16_t kTcpKeepaliveOption = 11;
+// The timeout is in units of 100 milliseconds.
+constexpr std::chrono::milliseconds kTimeoutUnit{100};
+
+// Returns the data of option |code| in the RDATA of an OPT record, or nullopt if it isn't there.
+std::optional<std::span<const uint8_t>> findOption(std::span<const uint8_t> rdata, uint16_t code) {
+    while (rdata.size() >= 4) {
+        const uint16_t optionCode = (rdata[0] << 8) | rdata[1];
+        const uint16_t optionLen = (rdata[2] << 8) | rdata[3];
+        if (rdata.size() - 4 < optionLen) return std::nullopt;
+        if (optionCode == code) return rdata.subspan(4, optionLen);
+        rdata = rdata.subspan(4 + optionLen);
+    }
+    return std::nullopt;
+}
+
+const DnsMessageIndex::Record* findOpt(const DnsMessageIndex& index) {
+    for (const DnsMessageIndex::Record& rr : index.section(ns_s_ar)) {
+        if (rr.type == ns_t_opt) return &rr;
+    }
+    return nullptr;
+}
+
+}  // namespace
+
+bool addTcpKeepalive(std::vector<uint8_t>* query) {
+    DnsMessageIndex index;
+    if (!index.parse(*query)) return false;
+    const DnsMessageIndex::Record* opt = findOpt(index);
+    if (opt == nullptr) return false;
+    if (findOption(index.rdata(*opt), kTcpKeepaliveOption)) return true;
+
+    const uint8_t option[] = {0, kTcpKeepaliveOption, 0, 0};
+    const size_t rdlen = opt->rdlen + sizeof(option);
+    if (rdlen > UINT16_MAX || query->size() + sizeof(option) > UINT16_MAX) return false;
+    // RDLEN is just before RDATA.
+    (*query)[opt->rdataOffset - 2] = rdlen >> 8;
+    (*query)[opt->rdataOffset - 1] = rdlen;
+    query->insert(query->begin() + DnsMessageIndex::end(*opt), std::begin(option),
+                  std::end(option));
+    return true;
+}
+
+std::optional<std::chrono::milliseconds> getTcpKeepaliveTimeout(
+        std::span<const uint8_t> response) {
+    DnsMessageIndex index;
+    if (!index.parse(response)) return std::nullopt;
+    const DnsMessageIndex::Record* opt = findOpt(index);
+    if (opt == nullptr) return std::nullopt;
+    const auto data = findOption(index.rdata(*opt), kTcpKeepaliveOption);
+    // Servers send the option with a timeout, clients without.
+    if (!data || data->size() != 2) return std::nullopt;
+    return kTimeoutUnit * (((*data)[0] << 8) | (*data)[1]);
+}
+
+}  // namespace android::net
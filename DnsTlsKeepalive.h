@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace android::net {
+
+// The edns-tcp-keepalive option (RFC 7828), with which a DoT server says how long it keeps an
+// idle connection open, so that the client can keep it as long and no longer.
+
+// Adds an empty edns-tcp-keepalive option to the OPT record of |query|, if it has one, as the
+// option can only be sent with EDNS. Returns whether |query| has the option.
+bool addTcpKeepalive(std::vector<uint8_t>* query);
+
+// Returns the idle timeout advertised in |response|, if any.
+std::optional<std::chrono::milliseconds> getTcpKeepaliveTimeout(std::span<const uint8_t> response);
+
+}  // namespace android::net
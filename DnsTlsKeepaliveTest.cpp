@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/nameser.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsTlsKeepalive.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+
+class DnsTlsKeepaliveTest : public ResolvTestBase {
+  protected:
+    // A query for "a.com" A, with an OPT record of the given RDATA if |optRdata| is set.
+    static std::vector<uint8_t> makeQuery(const std::vector<uint8_t>* optRdata) {
+        std::vector<uint8_t> msg = {
+                0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, uint8_t(optRdata ? 1 : 0),
+                1, 'a', 3, 'c', 'o', 'm', 0, 0, ns_t_a, 0, ns_c_in,
+        };
+        if (optRdata) {
+            const uint8_t opt[] = {0, 0, ns_t_opt, 0x10, 0, 0, 0, 0, 0};
+            msg.insert(msg.end(), std::begin(opt), std::end(opt));
+            msg.push_back(optRdata->size() >> 8);
+            msg.push_back(optRdata->size() & 0xff);
+            msg.insert(msg.end(), optRdata->begin(), optRdata->end());
+        }
+        return msg;
+    }
+};
+
+TEST_F(DnsTlsKeepaliveTest, AddToQuery) {
+    const std::vector<uint8_t> cookie = {0, 10, 0, 2, 0xab, 0xcd};
+    std::vector<uint8_t> query = makeQuery(&cookie);
+    ASSERT_TRUE(addTcpKeepalive(&query));
+    std::vector<uint8_t> both = cookie;
+    both.insert(both.end(), {0, 11, 0, 0});
+    EXPECT_EQ(makeQuery(&both), query);
+
+    // Added only once.
+    ASSERT_TRUE(addTcpKeepalive(&query));
+    EXPECT_EQ(makeQuery(&both), query);
+
+    // Without EDNS, the query is left alone.
+    std::vector<uint8_t> plain = makeQuery(nullptr);
+    EXPECT_FALSE(addTcpKeepalive(&plain));
+    EXPECT_EQ(makeQuery(nullptr), plain);
+
+    std::vector<uint8_t> truncated = makeQuery(&cookie);
+    truncated.pop_back();
+    EXPECT_FALSE(addTcpKeepalive(&truncated));
+}
+
+TEST_F(DnsTlsKeepaliveTest, TimeoutFromResponse) {
+    const std::vector<uint8_t> timeout = {0, 10, 0, 0, 0, 11, 0, 2, 0x01, 0x2c};
+    EXPECT_EQ(30s, getTcpKeepaliveTimeout(makeQuery(&timeout)));
+
+    const std::vector<uint8_t> zero = {0, 11, 0, 2, 0, 0};
+    EXPECT_EQ(0ms, getTcpKeepaliveTimeout(makeQuery(&zero)));
+
+    // The option as queries send it, without a timeout.
+    const std::vector<uint8_t> empty = {0, 11, 0, 0};
+    EXPECT_FALSE(getTcpKeepaliveTimeout(makeQuery(&empty)).has_value());
+    // An option running past the record.
+    const std::vector<uint8_t> bad = {0, 11, 0, 4, 0, 1};
+    EXPECT_FALSE(getTcpKeepaliveTimeout(makeQuery(&bad)).has_value());
+    EXPECT_FALSE(getTcpKeepaliveTimeout(makeQuery(nullptr)).has_value());
+}
+
+}  // namespace android::net
@@ -18,9 +18,13 @@
 
 #include "DnsTlsQueryMap.h"
 
+#include <algorithm>
+
 #include <android-base/logging.h>
 
+#include "DnsTlsBufferPool.h"
 #include "Experiments.h"
+#include "util.h"
 
 namespace android {
 namespace net {
@@ -28,6 +32,7 @@ namespace net {
 DnsTlsQueryMap::DnsTlsQueryMap() {
     mMaxTries = Experiments::getInstance()->getFlag("dot_maxtries", kMaxTries);
     if (mMaxTries < 1) mMaxTries = 1;
+    mCoalesce = Experiments::getInstance()->getFlag("dot_coalesce_queries", 0) == 1;
 }
 
 std::unique_ptr<DnsTlsQueryMap::QueryFuture> DnsTlsQueryMap::recordQuery(
@@ -39,6 +44,18 @@ std::unique_ptr<DnsTlsQueryMap::QueryFuture> DnsTlsQueryMap::recordQuery(
         LOG(WARNING) << "Query is too short";
         return nullptr;
     }
+    std::string key;
+    if (mCoalesce) {
+        key = getQueryCoalescingKey(std::span<const uint8_t>(query.base(), query.size()));
+        if (const auto it = mInflight.find(key); !key.empty() && it != mInflight.end()) {
+            QueryPromise* const p = find(it->second);
+            const uint16_t id = query.base()[0] << 8 | query.base()[1];
+            LOG(DEBUG) << "Query " << id << " joins " << p->query.newId;
+            std::promise<Result>& result =
+                    p->joined.emplace_back(id, std::promise<Result>()).second;
+            return std::make_unique<QueryFuture>(p->query, result.get_future(), true);
+        }
+    }
     int32_t newId = getFreeId();
     if (newId < 0) {
         LOG(WARNING) << "All query IDs are in use";
@@ -49,86 +66,114 @@ std::unique_ptr<DnsTlsQueryMap::QueryFuture> DnsTlsQueryMap::recordQuery(
     std::vector<uint8_t> tmp(query.base(), query.base() + query.size());
     Query q = {.newId = static_cast<uint16_t>(newId), .query = std::move(tmp)};
 
-    const auto [it, inserted] = mQueries.try_emplace(newId, q);
-    if (!inserted) {
-        LOG(ERROR) << "Failed to store pending query";
-        return nullptr;
+    QueryPromise& p = insert(q);
+    if (!key.empty()) {
+        mInflight.emplace(key, q.newId);
+        p.key = std::move(key);
     }
-    return std::make_unique<QueryFuture>(q, it->second.result.get_future());
+    return std::make_unique<QueryFuture>(q, p.result.get_future());
 }
 
 void DnsTlsQueryMap::expire(QueryPromise* p) {
-    Result r = { .code = Response::network_error };
-    p->result.set_value(r);
+    complete(p, {.code = Response::network_error});
+}
+
+void DnsTlsQueryMap::complete(QueryPromise* p, Result r) {
+    for (auto& [id, promise] : p->joined) {
+        Result copy = {.code = r.code};
+        if (copy.code == Response::success) {
+            copy.response = DnsTlsBufferPool::getInstance().acquire(r.response.size());
+            std::copy(r.response.begin(), r.response.end(), copy.response.begin());
+            copy.response[0] = id >> 8;
+            copy.response[1] = id;
+        }
+        promise.set_value(std::move(copy));
+    }
+    p->result.set_value(std::move(r));
 }
 
 void DnsTlsQueryMap::markTried(uint16_t newId) {
     std::lock_guard guard(mLock);
-    auto it = mQueries.find(newId);
-    if (it != mQueries.end()) {
-        it->second.tries++;
+    if (QueryPromise* p = find(newId); p != nullptr) {
+        p->tries++;
     }
 }
 
 void DnsTlsQueryMap::cleanup() {
     std::lock_guard guard(mLock);
-    for (auto it = mQueries.begin(); it != mQueries.end();) {
-        auto& p = it->second;
+    forEach([this](QueryPromise& p) REQUIRES(mLock) {
         if (p.tries >= mMaxTries) {
             expire(&p);
-            it = mQueries.erase(it);
-        } else {
-            ++it;
+            erase(p.query.newId);
         }
-    }
+    });
 }
 
 int32_t DnsTlsQueryMap::getFreeId() {
-    if (mQueries.empty()) {
-        return 0;
+    for (size_t i = 0; i < mFullWords.size(); ++i) {
+        if (mFullWords[i] == UINT64_MAX) continue;
+        const size_t word = i * 64 + __builtin_ctzll(~mFullWords[i]);
+        return word * 64 + __builtin_ctzll(~mUsed[word]);
     }
-    uint16_t maxId = mQueries.rbegin()->first;
-    if (maxId < UINT16_MAX) {
-        return maxId + 1;
-    }
-    if (mQueries.size() == UINT16_MAX + 1) {
-        // Map is full.
-        return -1;
+    // Map is full.
+    return -1;
+}
+
+DnsTlsQueryMap::QueryPromise* DnsTlsQueryMap::find(uint16_t newId) {
+    if (!(mUsed[newId / 64] & (1ULL << (newId % 64)))) return nullptr;
+    return &*(*mPages[newId / kPageSize])[newId % kPageSize];
+}
+
+DnsTlsQueryMap::QueryPromise& DnsTlsQueryMap::insert(const Query& query) {
+    const uint16_t newId = query.newId;
+    std::unique_ptr<Page>& page = mPages[newId / kPageSize];
+    if (!page) page = std::make_unique<Page>();
+    mUsed[newId / 64] |= 1ULL << (newId % 64);
+    if (mUsed[newId / 64] == UINT64_MAX) {
+        mFullWords[newId / 64 / 64] |= 1ULL << (newId / 64 % 64);
     }
-    // Linear scan.
-    uint16_t nextId = 0;
-    for (auto& pair : mQueries) {
-        uint16_t id = pair.first;
-        if (id != nextId) {
-            // Found a gap.
-            return nextId;
+    mSize++;
+    return (*page)[newId % kPageSize].emplace(query);
+}
+
+void DnsTlsQueryMap::erase(uint16_t newId) {
+    std::optional<QueryPromise>& slot = (*mPages[newId / kPageSize])[newId % kPageSize];
+    if (!slot->key.empty()) mInflight.erase(slot->key);
+    slot.reset();
+    mUsed[newId / 64] &= ~(1ULL << (newId % 64));
+    mFullWords[newId / 64 / 64] &= ~(1ULL << (newId / 64 % 64));
+    mSize--;
+}
+
+template <typename F>
+void DnsTlsQueryMap::forEach(F f) {
+    for (size_t word = 0; word < mUsed.size(); ++word) {
+        for (uint64_t bits = mUsed[word]; bits != 0; bits &= bits - 1) {
+            const uint16_t newId = word * 64 + __builtin_ctzll(bits);
+            f(*(*mPages[newId / kPageSize])[newId % kPageSize]);
         }
-        nextId = id + 1;
     }
-    // Unreachable (but the compiler isn't smart enough to prove it).
-    return -1;
 }
 
 std::vector<DnsTlsQueryMap::Query> DnsTlsQueryMap::getAll() {
     std::lock_guard guard(mLock);
     std::vector<DnsTlsQueryMap::Query> queries;
-    for (auto& q : mQueries) {
-        queries.push_back(q.second.query);
-    }
+    queries.reserve(mSize);
+    forEach([&queries](QueryPromise& p) { queries.push_back(p.query); });
     return queries;
 }
 
 bool DnsTlsQueryMap::empty() {
     std::lock_guard guard(mLock);
-    return mQueries.empty();
+    return mSize == 0;
 }
 
 void DnsTlsQueryMap::clear() {
     std::lock_guard guard(mLock);
-    for (auto& q : mQueries) {
-        expire(&q.second);
-    }
-    mQueries.clear();
+    forEach([this](QueryPromise& p) REQUIRES(mLock) {
+        expire(&p);
+        erase(p.query.newId);
+    });
 }
 
 void DnsTlsQueryMap::onResponse(std::vector<uint8_t> response) {
@@ -139,19 +184,19 @@ void DnsTlsQueryMap::onResponse(std::vector<uint8_t> response) {
     }
     uint16_t id = response[0] << 8 | response[1];
     std::lock_guard guard(mLock);
-    auto it = mQueries.find(id);
-    if (it == mQueries.end()) {
+    QueryPromise* p = find(id);
+    if (p == nullptr) {
         LOG(WARNING) << "Discarding response: unknown ID " << id;
         return;
     }
     Result r = { .code = Response::success, .response = std::move(response) };
     // Rewrite ID to match the query
-    const uint8_t* data = it->second.query.query.data();
+    const uint8_t* data = p->query.query.data();
     r.response[0] = data[0];
     r.response[1] = data[1];
     LOG(DEBUG) << "Sending result to dispatcher";
-    it->second.result.set_value(std::move(r));
-    mQueries.erase(it);
+    complete(p, std::move(r));
+    erase(id);
 }
 
 }  // end of namespace net
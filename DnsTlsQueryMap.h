@@ -17,9 +17,14 @@
 #ifndef _DNS_DNSTLSQUERYMAP_H
 #define _DNS_DNSTLSQUERYMAP_H
 
+#include <array>
 #include <future>
-#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/thread_annotations.h>
@@ -51,15 +56,20 @@ class DnsTlsQueryMap {
     };
 
     struct QueryFuture {
-        QueryFuture(Query query, std::future<Result> result)
-            : query(query), result(std::move(result)) {}
+        QueryFuture(Query query, std::future<Result> result, bool joined = false)
+            : query(query), result(std::move(result)), joined(joined) {}
         Query query;
         // A future which will resolve to the result of this query.
         std::future<Result> result;
+        // If true, the query shares the result of |query|, an identical one that was in flight
+        // already, and isn't to be sent.
+        bool joined;
     };
 
     // Returns an object containing everything needed to complete processing of
     // this query, or null if the query could not be recorded.
+    // With the "dot_coalesce_queries" flag, a query identical to one in flight but for its ID and
+    // the case of its name joins it, and gets its result rewritten with its own ID.
     std::unique_ptr<QueryFuture> recordQuery(const netdutils::Slice query);
 
     // Process a response, including a new ID.  If the response
@@ -83,6 +93,7 @@ class DnsTlsQueryMap {
     // The maximum number of times we will send a query before abandoning it.
     static constexpr int kMaxTries = 3;
     int mMaxTries;
+    bool mCoalesce;
 
   private:
     std::mutex mLock;
@@ -95,16 +106,43 @@ class DnsTlsQueryMap {
         // A promise whose future is returned by recordQuery()
         // It is fulfilled by onResponse().
         std::promise<Result> result;
+        // The key of the query in mInflight, if any, and the queries that joined it, with their
+        // original ID number.
+        std::string key;
+        std::vector<std::pair<uint16_t, std::promise<Result>>> joined;
     };
 
-    // Outstanding queries by newId.
-    std::map<uint16_t, QueryPromise> mQueries GUARDED_BY(mLock);
-
-    // Get a "newId" number that is not currently in use.  Returns -1 if there are none.
+    // Outstanding queries are kept in slots indexed by newId, so that recording and completing
+    // one takes constant time.  The slots are allocated a page at a time, on first use, and kept
+    // for reuse; since the lowest free ID is always taken, only as many pages are allocated as
+    // there have been queries in flight at once.
+    static constexpr size_t kNumIds = UINT16_MAX + 1;
+    static constexpr size_t kPageSize = 256;
+    using Page = std::array<std::optional<QueryPromise>, kPageSize>;
+    std::array<std::unique_ptr<Page>, kNumIds / kPageSize> mPages GUARDED_BY(mLock);
+    // Bit i % 64 of mUsed[i / 64] is set if newId i is in use, and bit j % 64 of
+    // mFullWords[j / 64] is set if all the IDs of mUsed[j] are.
+    std::array<uint64_t, kNumIds / 64> mUsed GUARDED_BY(mLock) = {};
+    std::array<uint64_t, kNumIds / 64 / 64> mFullWords GUARDED_BY(mLock) = {};
+    size_t mSize GUARDED_BY(mLock) = 0;
+    // The newId of the query in flight for each coalescing key, if mCoalesce.
+    std::unordered_map<std::string, uint16_t> mInflight GUARDED_BY(mLock);
+
+    // Get the lowest "newId" number that is not currently in use.  Returns -1 if there are none.
     int32_t getFreeId() REQUIRES(mLock);
 
+    // Returns the query with |newId|, or null if there is none.
+    QueryPromise* _Nullable find(uint16_t newId) REQUIRES(mLock);
+    QueryPromise& insert(const Query& query) REQUIRES(mLock);
+    void erase(uint16_t newId) REQUIRES(mLock);
+    // Calls |f| on every query, by increasing newId.  |f| may erase the query it is called on.
+    template <typename F>
+    void forEach(F f) REQUIRES(mLock);
+
     // Fulfill the result with an error code.
     static void expire(QueryPromise* _Nonnull p);
+    // Fulfills the result of |p|, and of each query that joined it.
+    static void complete(QueryPromise* _Nonnull p, Result r);
 };
 
 }  // end of namespace net
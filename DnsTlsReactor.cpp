@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "DnsTlsReactor.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <vector>
+
+#include <android-base/logging.h>
+#include <netdutils/ThreadUtil.h>
+
+#include "Experiments.h"
+
+namespace android::net {
+
+using std::chrono::ceil;
+using std::chrono::milliseconds;
+
+namespace {
+
+constexpr int kMaxEvents = 64;
+
+}  // namespace
+
+DnsTlsReactor::DnsTlsReactor(clock::duration idleTimeout)
+    : mEpollFd(epoll_create1(EPOLL_CLOEXEC)),
+      mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      mIdleTimeout(idleTimeout) {
+    epoll_event event = {.events = EPOLLIN, .data = {.ptr = nullptr}};
+    if (!mEpollFd.ok() || !mEventFd.ok() ||
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mEventFd, &event) != 0) {
+        PLOG(ERROR) << __func__ << ": failed to set up epoll";
+        return;
+    }
+    mUsable = true;
+}
+
+DnsTlsReactor::~DnsTlsReactor() {
+    std::thread thread;
+    {
+        std::lock_guard guard(mMutex);
+        mStopping = true;
+        thread = std::move(mThread);
+    }
+    signal();
+    if (thread.joinable()) thread.join();
+}
+
+bool DnsTlsReactor::isRunning() {
+    std::lock_guard guard(mMutex);
+    return mLooping;
+}
+
+void DnsTlsReactor::startLocked() {
+    // A thread that has left the loop has also released the lock, so it's about to return.
+    if (mThread.joinable()) mThread.join();
+    LOG(DEBUG) << __func__ << ": starting the reactor thread";
+    mLooping = true;
+    mThread = std::thread(&DnsTlsReactor::loop, this);
+    mThreadId = mThread.get_id();
+}
+
+bool DnsTlsReactor::isEnabled() {
+    return Experiments::getInstance()->getFlag("dot_reactor", 0) == 1;
+}
+
+int DnsTlsReactor::add(Client* client, int fd, uint32_t events, clock::time_point deadline) {
+    if (!mUsable) return -ENOSYS;
+    std::lock_guard guard(mMutex);
+    if (mStopping) return -ENOSYS;
+    if (mClients.count(client) != 0) return -EEXIST;
+    epoll_event event = {.events = events, .data = {.ptr = client}};
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) != 0) return -errno;
+    mClients[client] = {.fd = fd, .events = events, .deadline = deadline};
+    if (!mLooping) {
+        startLocked();
+    } else {
+        // The loop may be sleeping until a later deadline.
+        signal();
+    }
+    return 0;
+}
+
+void DnsTlsReactor::update(Client* client, uint32_t events, clock::time_point deadline) {
+    std::lock_guard guard(mMutex);
+    const auto it = mClients.find(client);
+    if (it == mClients.end()) return;
+    Registration& registration = it->second;
+    if (registration.events != events) {
+        epoll_event event = {.events = events, .data = {.ptr = client}};
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, registration.fd, &event) != 0) {
+            PLOG(ERROR) << __func__ << ": epoll_ctl";
+        }
+        registration.events = events;
+    }
+    registration.deadline = deadline;
+    // The loop works out its timeout again after every round of callbacks.
+    if (!onReactorThread()) signal();
+}
+
+void DnsTlsReactor::wakeUp(Client* client) {
+    std::lock_guard guard(mMutex);
+    const auto it = mClients.find(client);
+    if (it == mClients.end() || it->second.woken) return;
+    it->second.woken = true;
+    signal();
+}
+
+void DnsTlsReactor::remove(Client* client) {
+    std::unique_lock lock(mMutex);
+    if (const auto it = mClients.find(client); it != mClients.end()) {
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        mClients.erase(it);
+        if (mClients.empty()) {
+            mIdleSince = clock::now();
+            // For the loop to start counting, rather than sleep until that client's deadline.
+            if (!onReactorThread()) signal();
+        }
+    }
+    // On the reactor thread, no callback can be running but the caller's.
+    if (onReactorThread()) return;
+    mCv.wait(lock, [&]() REQUIRES(mMutex) { return mRunning != client; });
+}
+
+void DnsTlsReactor::loop() {
+    netdutils::setThreadName("DnsTlsReactor");
+    epoll_event events[kMaxEvents];
+    std::unique_lock lock(mMutex);
+    while (!mStopping) {
+        int timeoutMs = -1;
+        const auto now = clock::now();
+        if (mClients.empty()) {
+            const auto idleLeft = ceil<milliseconds>(mIdleSince + mIdleTimeout - now).count();
+            if (idleLeft <= 0) {
+                LOG(DEBUG) << __func__ << ": idle, stopping the reactor thread";
+                mLooping = false;
+                return;
+            }
+            timeoutMs = std::min<int64_t>(idleLeft, INT32_MAX);
+        }
+        for (const auto& [client, registration] : mClients) {
+            if (registration.woken) {
+                timeoutMs = 0;
+                break;
+            }
+            const auto remaining = ceil<milliseconds>(registration.deadline - now).count();
+            if (remaining <= 0) {
+                timeoutMs = 0;
+                break;
+            }
+            if (remaining < timeoutMs || timeoutMs == -1) {
+                timeoutMs = std::min<int64_t>(remaining, INT32_MAX);
+            }
+        }
+        lock.unlock();
+        const int n = epoll_wait(mEpollFd, events, kMaxEvents, timeoutMs);
+        lock.lock();
+        if (n < 0 && errno != EINTR) {
+            PLOG(ERROR) << __func__ << ": epoll_wait";
+        }
+
+        std::map<Client*, uint32_t> ready;
+        for (int i = 0; i < n; i++) {
+            Client* const client = static_cast<Client*>(events[i].data.ptr);
+            if (client == nullptr) {
+                eventfd_t value;
+                eventfd_read(mEventFd, &value);
+                continue;
+            }
+            // Removed while the lock was released.
+            if (mClients.count(client) == 0) continue;
+            ready[client] |= events[i].events;
+        }
+        const auto later = clock::now();
+        for (auto& [client, registration] : mClients) {
+            if (registration.woken) {
+                ready[client] |= kWokenUp;
+                registration.woken = false;
+            }
+            if (registration.deadline <= later) {
+                ready[client] |= kTimedOut;
+                // Until the client sets another one.
+                registration.deadline = clock::time_point::max();
+            }
+        }
+
+        for (const auto& [client, happened] : ready) {
+            // Removed by an earlier callback.
+            if (mClients.count(client) == 0) continue;
+            mRunning = client;
+            lock.unlock();
+            client->onReady(happened);
+            lock.lock();
+            mRunning = nullptr;
+            mCv.notify_all();
+        }
+    }
+}
+
+void DnsTlsReactor::signal() {
+    if (eventfd_write(mEventFd, 1) != 0) PLOG(WARNING) << __func__ << ": eventfd_write";
+}
+
+}  // namespace android::net
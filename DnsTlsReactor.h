@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+
+namespace android::net {
+
+// Drives the connections of all DnsTlsSockets from a single epoll thread, instead of each
+// socket running its own loop thread that sits idle between queries. A client registers its
+// socket with the events it waits for and a deadline, and is called back on the reactor thread
+// whenever any of them happens or it is woken up. All methods are thread-safe.
+//
+// The thread is only started for the first client, and exits once there has been none for the
+// idle timeout, to be started again by the next one.
+class DnsTlsReactor {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // Besides EPOLLIN, EPOLLOUT, EPOLLERR and EPOLLHUP, what onReady() may be called with.
+    static constexpr uint32_t kWokenUp = 1U << 30;
+    static constexpr uint32_t kTimedOut = 1U << 31;
+
+    static constexpr clock::duration kIdleTimeout = std::chrono::minutes(10);
+
+    class Client {
+      public:
+        virtual ~Client() = default;
+        // Runs on the reactor thread with what happened, and never for two clients at once, so
+        // it must not block. It may call update() and remove() for itself.
+        virtual void onReady(uint32_t events) = 0;
+    };
+
+    explicit DnsTlsReactor(clock::duration idleTimeout = kIdleTimeout);
+    ~DnsTlsReactor();
+
+    static DnsTlsReactor& getInstance() {
+        static DnsTlsReactor instance;
+        return instance;
+    }
+
+    static bool isEnabled();
+
+    // Registers |client|, which then waits for |events| on |fd| until |deadline|. Returns 0 or a
+    // negative errno.
+    int add(Client* client, int fd, uint32_t events, clock::time_point deadline) EXCLUDES(mMutex);
+    // Changes what |client| waits for.
+    void update(Client* client, uint32_t events, clock::time_point deadline) EXCLUDES(mMutex);
+    // Has onReady() called with kWokenUp soon.
+    void wakeUp(Client* client) EXCLUDES(mMutex);
+    // Unregisters |client|. Once this returns, onReady() isn't running for it and won't be
+    // called again.
+    void remove(Client* client) EXCLUDES(mMutex);
+
+    bool onReactorThread() const { return std::this_thread::get_id() == mThreadId; }
+
+    // Whether the thread is running.
+    bool isRunning() EXCLUDES(mMutex);
+
+  private:
+    struct Registration {
+        int fd;
+        uint32_t events;
+        clock::time_point deadline;
+        bool woken = false;
+    };
+
+    void startLocked() REQUIRES(mMutex);
+    void loop() EXCLUDES(mMutex);
+    void signal();
+
+    base::unique_fd mEpollFd;
+    base::unique_fd mEventFd;
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::map<Client*, Registration> mClients GUARDED_BY(mMutex);
+    // The client whose onReady() is running, if any.
+    Client* mRunning GUARDED_BY(mMutex) = nullptr;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    const clock::duration mIdleTimeout;
+    // Since when there has been no client.
+    clock::time_point mIdleSince GUARDED_BY(mMutex);
+    // Whether epoll could be set up at all.
+    bool mUsable = false;
+    // Whether |mThread| is running the loop. Once it isn't, it's joined by the next start.
+    bool mLooping GUARDED_BY(mMutex) = false;
+    std::thread mThread GUARDED_BY(mMutex);
+    std::atomic<std::thread::id> mThreadId;
+};
+
+}  // namespace android::net
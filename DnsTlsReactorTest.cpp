@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "DnsTlsReactor.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using android::base::unique_fd;
+
+namespace {
+
+// Records what it is called with, and drains its socket so that it is only called again when
+// something new happens.
+class FakeClient : public DnsTlsReactor::Client {
+  public:
+    void onReady(uint32_t events) override {
+        char buf[16];
+        while (recv(fd, buf, sizeof(buf), 0) > 0) {
+        }
+        std::lock_guard guard(mMutex);
+        mEvents.push_back(events);
+        mCv.notify_all();
+    }
+
+    // Waits for the |n|th call, and returns what it was called with, or 0 on timeout.
+    uint32_t waitFor(size_t n) {
+        std::unique_lock lock(mMutex);
+        if (!mCv.wait_for(lock, 2s, [&] { return mEvents.size() >= n; })) return 0;
+        return mEvents[n - 1];
+    }
+
+    size_t calls() {
+        std::lock_guard guard(mMutex);
+        return mEvents.size();
+    }
+
+    int fd = -1;
+
+  private:
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::vector<uint32_t> mEvents;
+};
+
+}  // namespace
+
+class DnsTlsReactorTest : public ResolvTestBase {
+  protected:
+    static std::pair<unique_fd, unique_fd> socketPair() {
+        int fds[2];
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds));
+        return {unique_fd(fds[0]), unique_fd(fds[1])};
+    }
+
+    static DnsTlsReactor::clock::time_point later() { return DnsTlsReactor::clock::now() + 10s; }
+
+    DnsTlsReactor mReactor;
+};
+
+TEST_F(DnsTlsReactorTest, Events) {
+    auto [a, b] = socketPair();
+    FakeClient client;
+    client.fd = a.get();
+    ASSERT_EQ(0, mReactor.add(&client, a.get(), EPOLLIN, later()));
+    EXPECT_EQ(-EEXIST, mReactor.add(&client, a.get(), EPOLLIN, later()));
+
+    ASSERT_EQ(1, send(b, "x", 1, 0));
+    EXPECT_EQ(uint32_t{EPOLLIN}, client.waitFor(1));
+
+    mReactor.update(&client, EPOLLIN | EPOLLOUT, later());
+    EXPECT_EQ(uint32_t{EPOLLOUT}, client.waitFor(2));
+    mReactor.remove(&client);
+}
+
+TEST_F(DnsTlsReactorTest, WakeUp) {
+    auto [a, b] = socketPair();
+    FakeClient client;
+    ASSERT_EQ(0, mReactor.add(&client, a.get(), EPOLLIN, later()));
+    mReactor.wakeUp(&client);
+    EXPECT_EQ(DnsTlsReactor::kWokenUp, client.waitFor(1));
+    mReactor.remove(&client);
+
+    // Clients that aren't registered are ignored.
+    mReactor.wakeUp(&client);
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(1U, client.calls());
+}
+
+TEST_F(DnsTlsReactorTest, Timeout) {
+    auto [a, b] = socketPair();
+    auto [c, d] = socketPair();
+    FakeClient slow;
+    FakeClient fast;
+    const auto start = DnsTlsReactor::clock::now();
+    ASSERT_EQ(0, mReactor.add(&slow, a.get(), EPOLLIN, start + 500ms));
+    // The earlier deadline must be honoured even though it was registered last.
+    ASSERT_EQ(0, mReactor.add(&fast, c.get(), EPOLLIN, start + 50ms));
+
+    EXPECT_EQ(DnsTlsReactor::kTimedOut, fast.waitFor(1));
+    EXPECT_LT(DnsTlsReactor::clock::now() - start, 400ms);
+    EXPECT_EQ(0U, slow.calls());
+    EXPECT_EQ(DnsTlsReactor::kTimedOut, slow.waitFor(1));
+
+    // A deadline only fires once.
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(1U, fast.calls());
+    mReactor.remove(&slow);
+    mReactor.remove(&fast);
+}
+
+TEST_F(DnsTlsReactorTest, Remove) {
+    auto [a, b] = socketPair();
+    FakeClient client;
+    client.fd = a.get();
+    ASSERT_EQ(0, mReactor.add(&client, a.get(), EPOLLIN, later()));
+    mReactor.remove(&client);
+    ASSERT_EQ(1, send(b, "x", 1, 0));
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(0U, client.calls());
+
+    // The file descriptor can be registered again.
+    ASSERT_EQ(0, mReactor.add(&client, a.get(), EPOLLIN, later()));
+    EXPECT_EQ(uint32_t{EPOLLIN}, client.waitFor(1));
+    mReactor.remove(&client);
+}
+
+TEST_F(DnsTlsReactorTest, IdleThread) {
+    DnsTlsReactor reactor(50ms);
+    EXPECT_FALSE(reactor.isRunning());
+
+    auto [a, b] = socketPair();
+    FakeClient client;
+    client.fd = a.get();
+    ASSERT_EQ(0, reactor.add(&client, a.get(), EPOLLIN, later()));
+    EXPECT_TRUE(reactor.isRunning());
+    reactor.remove(&client);
+    std::this_thread::sleep_for(200ms);
+    EXPECT_FALSE(reactor.isRunning());
+
+    // The next client starts it again.
+    ASSERT_EQ(0, reactor.add(&client, a.get(), EPOLLIN, later()));
+    EXPECT_TRUE(reactor.isRunning());
+    ASSERT_EQ(1, send(b, "x", 1, 0));
+    EXPECT_EQ(uint32_t{EPOLLIN}, client.waitFor(1));
+    reactor.remove(&client);
+}
+
+}  // namespace android::net
@@ -48,20 +48,46 @@ int DnsTlsSessionCache::newSessionCallback(SSL* ssl, SSL_SESSION* session) {
         return 0;
     }
     LOG(DEBUG) << "Recording session";
-    cache->recordSession(session);
-    return 1;  // Increment the refcount of session.
+    // 1 increments the refcount of session.
+    return cache->recordSession(session) ? 1 : 0;
 }
 
-void DnsTlsSessionCache::recordSession(SSL_SESSION* session) {
+bool DnsTlsSessionCache::recordSession(SSL_SESSION* session) {
+    if (mStore != nullptr) {
+        uint8_t* bytes;
+        size_t len;
+        if (!SSL_SESSION_to_bytes(session, &bytes, &len)) {
+            LOG(WARNING) << "Failed to serialize session";
+            return false;
+        }
+        bssl::UniquePtr<uint8_t> owner(bytes);
+        const time_t expiry = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+        mStore->put(mKey, std::vector<uint8_t>(bytes, bytes + len), expiry);
+        return false;
+    }
+
     std::lock_guard guard(mLock);
     mSessions.emplace_front(session);
     if (mSessions.size() > kMaxSize) {
         LOG(DEBUG) << "Too many sessions; trimming";
         mSessions.pop_back();
     }
+    return true;
 }
 
 bssl::UniquePtr<SSL_SESSION> DnsTlsSessionCache::getSession() {
+    if (mStore != nullptr) {
+        const std::vector<uint8_t> bytes = mStore->take(mKey);
+        if (bytes.empty()) {
+            LOG(DEBUG) << "No stored sessions";
+            return nullptr;
+        }
+        // Parsing only needs a context for its certificate methods, so any one will do.
+        static SSL_CTX* const ctx = SSL_CTX_new(TLS_method());
+        return bssl::UniquePtr<SSL_SESSION>(
+                SSL_SESSION_from_bytes(bytes.data(), bytes.size(), ctx));
+    }
+
     std::lock_guard guard(mLock);
     if (mSessions.size() == 0) {
         LOG(DEBUG) << "No known sessions";
@@ -72,5 +98,9 @@ bssl::UniquePtr<SSL_SESSION> DnsTlsSessionCache::getSession() {
     return ret;
 }
 
+void DnsTlsSessionCache::recordHandshake(SSL* ssl) {
+    if (mStore != nullptr) mStore->recordHandshake(SSL_session_reused(ssl));
+}
+
 }  // end of namespace net
 }  // end of namespace android
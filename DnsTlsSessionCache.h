@@ -24,6 +24,8 @@
 
 #include <android-base/thread_annotations.h>
 
+#include "DnsTlsSessionStore.h"
+
 namespace android {
 namespace net {
 
@@ -31,6 +33,13 @@ namespace net {
 // This class is thread-safe.
 class DnsTlsSessionCache {
   public:
+    DnsTlsSessionCache() = default;
+    // Keeps the sessions in |store|, if not null, where they outlive this cache and can be
+    // resumed by any other cache for the same |server| and |mark|.
+    DnsTlsSessionCache(DnsTlsSessionStore* _Nullable store, const DnsTlsServer& server,
+                       unsigned mark)
+        : mStore(store), mKey(DnsTlsSessionStore::keyOf(server, mark)) {}
+
     // Prepare SSL objects to use this session cache.  These methods must be called
     // before making use of either object.
     void prepareSslContext(SSL_CTX* _Nonnull ssl_ctx);
@@ -43,12 +52,19 @@ class DnsTlsSessionCache {
     // pointer.)
     bssl::UniquePtr<SSL_SESSION> getSession() EXCLUDES(mLock);
 
+    // Counts the completed handshake of |ssl| in the store, as resumed or not.
+    void recordHandshake(SSL* _Nonnull ssl);
+
   private:
     static constexpr size_t kMaxSize = 5;
     static int newSessionCallback(SSL* _Nullable ssl, SSL_SESSION* _Nullable session);
 
     std::mutex mLock;
-    void recordSession(SSL_SESSION* _Nullable session) EXCLUDES(mLock);
+    // Returns whether |session| was kept, which then holds a reference to it.
+    bool recordSession(SSL_SESSION* _Nullable session) EXCLUDES(mLock);
+
+    DnsTlsSessionStore* _Nullable const mStore = nullptr;
+    const DnsTlsSessionStore::Key mKey{};
 
     // Queue of sessions, from least recently added to most recently.
     std::deque<bssl::UniquePtr<SSL_SESSION>> mSessions GUARDED_BY(mLock);
@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "DnsTlsSessionStore.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <tuple>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+
+#include "Experiments.h"
+#include "QueryThreadPool.h"
+
+namespace android::net {
+
+namespace {
+
+// A session file holds the header, followed by |count| records, each of them followed by the
+// address, the name and the session of its entry. Fields are in host byte order.
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    // Marks hold netids, which are only meaningful within a boot.
+    char bootId[40];
+    uint32_t count;
+};
+
+struct FileRecord {
+    int64_t expiry;
+    uint32_t mark;
+    uint32_t addrLen;
+    uint32_t nameLen;
+    uint32_t sessionLen;
+};
+
+constexpr uint32_t kFileMagic = 0x444f5453;  // "DOTS"
+constexpr uint32_t kFileVersion = 1;
+
+const std::string& bootId() {
+    static const std::string id = []() {
+        std::string id;
+        android::base::ReadFileToString("/proc/sys/kernel/random/boot_id", &id);
+        return android::base::Trim(id);
+    }();
+    return id;
+}
+
+size_t sizeOf(const DnsTlsSessionStore::Key& key, const std::vector<uint8_t>& session) {
+    return key.addr.size() + key.name.size() + session.size();
+}
+
+}  // namespace
+
+bool DnsTlsSessionStore::Key::operator<(const Key& other) const {
+    return std::tie(addr, name, mark) < std::tie(other.addr, other.name, other.mark);
+}
+
+DnsTlsSessionStore::DnsTlsSessionStore(std::string path, size_t maxBytes)
+    : mPath(std::move(path)), mMaxBytes(maxBytes), mLastSave(std::chrono::steady_clock::now()) {
+    if (!mPath.empty()) load();
+}
+
+DnsTlsSessionStore::~DnsTlsSessionStore() {
+    std::unique_lock lock(mMutex);
+    if (mSavePending && TimerService::getInstance().cancel(mSaveTimer)) mSavePending = false;
+    mSaveDone.wait(lock, [this]() REQUIRES(mMutex) { return !mSavePending && !mSaveRunning; });
+}
+
+DnsTlsSessionStore* DnsTlsSessionStore::getInstance() {
+    // Never deleted, as DoT sockets may still record sessions at exit.
+    static DnsTlsSessionStore* instance = []() -> DnsTlsSessionStore* {
+        if (Experiments::getInstance()->getFlag("dot_session_store", 0) != 1) return nullptr;
+        return new DnsTlsSessionStore(kDefaultPath, kDefaultMaxBytes);
+    }();
+    return instance;
+}
+
+DnsTlsSessionStore::Key DnsTlsSessionStore::keyOf(const DnsTlsServer& server, unsigned mark) {
+    return {.addr = server.addr().toString(), .name = server.name, .mark = mark};
+}
+
+void DnsTlsSessionStore::put(const Key& key, std::vector<uint8_t> session, time_t expiry) {
+    if (session.empty() || sizeOf(key, session) > mMaxBytes) return;
+    std::lock_guard guard(mMutex);
+    addLocked(key, std::move(session), expiry);
+    if (!mPath.empty()) scheduleSaveLocked();
+}
+
+void DnsTlsSessionStore::addLocked(const Key& key, std::vector<uint8_t> session, time_t expiry) {
+    const size_t size = sizeOf(key, session);
+    auto oldest = mSessions.end();
+    size_t sameKey = 0;
+    for (auto it = mSessions.begin(); it != mSessions.end(); ++it) {
+        if (!(it->key == key)) continue;
+        if (sameKey++ == 0) oldest = it;
+    }
+    if (sameKey >= kMaxSessionsPerKey) {
+        eraseLocked(oldest);
+        mStats.evicted++;
+    }
+    mSessions.push_back({.key = key, .bytes = std::move(session), .expiry = expiry});
+    mStats.sessions++;
+    mStats.bytes += size;
+    while (mStats.bytes > mMaxBytes) {
+        eraseLocked(mSessions.begin());
+        mStats.evicted++;
+    }
+}
+
+void DnsTlsSessionStore::scheduleSaveLocked() {
+    if (mSavePending) return;
+    mSavePending = true;
+    const auto delay = std::max<std::chrono::steady_clock::duration>(
+            mLastSave + kSaveInterval - std::chrono::steady_clock::now(),
+            std::chrono::steady_clock::duration::zero());
+    // The timer thread doesn't wait for the file.
+    mSaveTimer = TimerService::getInstance().schedule(delay, [this] {
+        {
+            std::lock_guard guard(mMutex);
+            mSavePending = false;
+            mSaveRunning = true;
+            mLastSave = std::chrono::steady_clock::now();
+        }
+        if (QueryThreadPool::executeBackground([this] { runScheduledSave(); },
+                                               "DotSessionSave") != 0) {
+            // The next session schedules it again.
+            std::lock_guard guard(mMutex);
+            mSaveRunning = false;
+            mSaveDone.notify_all();
+        }
+    });
+}
+
+void DnsTlsSessionStore::runScheduledSave() {
+    save();
+    std::lock_guard guard(mMutex);
+    mSaveRunning = false;
+    mSaveDone.notify_all();
+}
+
+std::vector<uint8_t> DnsTlsSessionStore::take(const Key& key) {
+    const time_t now = time(nullptr);
+    std::lock_guard guard(mMutex);
+    for (auto it = mSessions.end(); it != mSessions.begin();) {
+        --it;
+        if (!(it->key == key)) continue;
+        if (it->expiry <= now) {
+            it = eraseLocked(it);
+            mStats.expired++;
+            continue;
+        }
+        std::vector<uint8_t> session = it->bytes;
+        eraseLocked(it);
+        mStats.taken++;
+        return session;
+    }
+    return {};
+}
+
+std::list<DnsTlsSessionStore::Session>::iterator DnsTlsSessionStore::eraseLocked(
+        std::list<Session>::iterator it) {
+    mStats.bytes -= sizeOf(it->key, it->bytes);
+    mStats.sessions--;
+    return mSessions.erase(it);
+}
+
+void DnsTlsSessionStore::recordHandshake(bool resumed) {
+    std::lock_guard guard(mMutex);
+    mStats.handshakes++;
+    if (resumed) mStats.resumed++;
+}
+
+int DnsTlsSessionStore::save() {
+    if (mPath.empty()) return -EINVAL;
+
+    std::string content;
+    {
+        FileHeader header = {.magic = kFileMagic, .version = kFileVersion};
+        strlcpy(header.bootId, bootId().c_str(), sizeof(header.bootId));
+        std::lock_guard guard(mMutex);
+        header.count = mSessions.size();
+        content.reserve(sizeof(header) + mSessions.size() * sizeof(FileRecord) + mStats.bytes);
+        content.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const Session& session : mSessions) {
+            const FileRecord record = {
+                    .expiry = session.expiry,
+                    .mark = session.key.mark,
+                    .addrLen = static_cast<uint32_t>(session.key.addr.size()),
+                    .nameLen = static_cast<uint32_t>(session.key.name.size()),
+                    .sessionLen = static_cast<uint32_t>(session.bytes.size()),
+            };
+            content.append(reinterpret_cast<const char*>(&record), sizeof(record));
+            content.append(session.key.addr);
+            content.append(session.key.name);
+            content.append(session.bytes.begin(), session.bytes.end());
+        }
+    }
+
+    std::lock_guard guard(mFileMutex);
+    const std::string tmpPath = mPath + ".tmp";
+    android::base::unique_fd fd(
+            open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd == -1 || !android::base::WriteFully(fd, content.data(), content.size())) {
+        const int err = errno;
+        PLOG(WARNING) << __func__ << ": failed to write " << tmpPath;
+        unlink(tmpPath.c_str());
+        return -err;
+    }
+    fd.reset();
+    if (rename(tmpPath.c_str(), mPath.c_str()) == -1) {
+        const int err = errno;
+        PLOG(WARNING) << __func__ << ": failed to rename " << tmpPath;
+        unlink(tmpPath.c_str());
+        return -err;
+    }
+    return 0;
+}
+
+void DnsTlsSessionStore::load() {
+    std::string content;
+    if (!android::base::ReadFileToString(mPath, &content)) return;
+    FileHeader header;
+    if (content.size() < sizeof(header)) return;
+    memcpy(&header, content.data(), sizeof(header));
+    header.bootId[sizeof(header.bootId) - 1] = '\0';
+    if (header.magic != kFileMagic || header.version != kFileVersion || bootId() != header.bootId) {
+        LOG(INFO) << __func__ << ": ignoring stale or invalid " << mPath;
+        return;
+    }
+
+    const time_t now = time(nullptr);
+    size_t offset = sizeof(header);
+    int loaded = 0;
+    for (uint32_t i = 0; i < header.count; i++) {
+        FileRecord record;
+        if (content.size() - offset < sizeof(record)) break;
+        memcpy(&record, content.data() + offset, sizeof(record));
+        offset += sizeof(record);
+        const size_t size =
+                static_cast<size_t>(record.addrLen) + record.nameLen + record.sessionLen;
+        if (content.size() - offset < size) break;
+        Key key = {
+                .addr = content.substr(offset, record.addrLen),
+                .name = content.substr(offset + record.addrLen, record.nameLen),
+                .mark = record.mark,
+        };
+        const auto* session =
+                reinterpret_cast<const uint8_t*>(content.data()) + offset + record.addrLen +
+                record.nameLen;
+        offset += size;
+        if (record.expiry <= now) continue;
+        if (record.sessionLen == 0 || size > mMaxBytes) continue;
+        // Oldest first, so adding them in order restores the order of the store. What was just
+        // loaded doesn't need saving.
+        std::lock_guard guard(mMutex);
+        addLocked(key, std::vector<uint8_t>(session, session + record.sessionLen), record.expiry);
+        loaded++;
+    }
+    LOG(INFO) << __func__ << ": " << loaded << " sessions";
+}
+
+DnsTlsSessionStore::Stats DnsTlsSessionStore::getStats() const {
+    std::lock_guard guard(mMutex);
+    return mStats;
+}
+
+void DnsTlsSessionStore::dump(netdutils::DumpWriter& dw) const {
+    const Stats stats = getStats();
+    dw.println("DoT session store: %zu sessions, %zu bytes, max %zu", stats.sessions, stats.bytes,
+               mMaxBytes);
+    netdutils::ScopedIndent indent(dw);
+    dw.println("handshakes: %" PRIu64 ", resumed: %" PRIu64 " (%" PRIu64 "%%)", stats.handshakes,
+               stats.resumed, stats.handshakes > 0 ? stats.resumed * 100 / stats.handshakes : 0);
+    dw.println("sessions taken: %" PRIu64 ", evicted: %" PRIu64 ", expired: %" PRIu64,
+               stats.taken, stats.evicted, stats.expired);
+}
+
+}  // namespace android::net
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/DumpWriter.h>
+
+#include "DnsTlsServer.h"
+#include "TimerService.h"
+
+namespace android::net {
+
+// Serialized TLS sessions for resuming DoT connections, kept per server for as long as they are
+// valid. A DnsTlsSessionCache only lives as long as its DnsTlsTransport, which is dropped when
+// idle or when its network changes, so without the store the next connection to the same server
+// pays a full handshake. The store is bounded by the total size of its sessions, and drops the
+// oldest first. Given a path, it reloads the sessions saved there by an earlier instance, and saves
+// its own at most once every kSaveInterval, on a background thread, since sessions are added from
+// the TLS handshake. This class is thread-safe.
+class DnsTlsSessionStore {
+  public:
+    // Sessions are only resumed with the server that issued them, and on the same network.
+    struct Key {
+        std::string addr;  // IP address and port.
+        std::string name;  // Private DNS hostname, if any.
+        unsigned mark;
+        bool operator<(const Key& other) const;
+        bool operator==(const Key& other) const = default;
+    };
+
+    struct Stats {
+        uint64_t handshakes = 0;
+        // Handshakes that resumed a session.
+        uint64_t resumed = 0;
+        // Sessions taken to be offered in a handshake.
+        uint64_t taken = 0;
+        // Sessions dropped to make room, and because they expired.
+        uint64_t evicted = 0;
+        uint64_t expired = 0;
+        size_t sessions = 0;
+        size_t bytes = 0;
+    };
+
+    static constexpr size_t kDefaultMaxBytes = 64 * 1024;
+    // As many as a DnsTlsSessionCache keeps on its own.
+    static constexpr size_t kMaxSessionsPerKey = 5;
+    static constexpr std::chrono::seconds kSaveInterval{60};
+    static constexpr char kDefaultPath[] = "/data/misc/net/dot_sessions";
+
+    // Loads the sessions saved in |path|, and saves them there as they change, unless |path| is
+    // empty.
+    DnsTlsSessionStore(std::string path, size_t maxBytes);
+    // Drops the save that is scheduled, and waits for the one that is running, if any.
+    ~DnsTlsSessionStore();
+
+    // Returns the store, or nullptr if each DnsTlsSessionCache keeps its own sessions. Whether the
+    // store is used is decided by the "dot_session_store" flag on first call.
+    static DnsTlsSessionStore* getInstance();
+
+    static Key keyOf(const DnsTlsServer& server, unsigned mark);
+
+    // Adds |session|, an SSL_SESSION serialized for |key|, which can't be resumed after |expiry|.
+    void put(const Key& key, std::vector<uint8_t> session, time_t expiry) EXCLUDES(mMutex);
+    // Removes and returns the most recent session of |key| that hasn't expired, or an empty
+    // vector if there's none. Sessions are single-use, as TLS 1.3 tickets should be.
+    std::vector<uint8_t> take(const Key& key) EXCLUDES(mMutex);
+    void recordHandshake(bool resumed) EXCLUDES(mMutex);
+
+    // Saves the sessions to the file now. Returns 0 or a negative errno.
+    int save() EXCLUDES(mMutex);
+
+    Stats getStats() const EXCLUDES(mMutex);
+    void dump(netdutils::DumpWriter& dw) const EXCLUDES(mMutex);
+
+  private:
+    struct Session {
+        Key key;
+        std::vector<uint8_t> bytes;
+        time_t expiry;
+    };
+
+    void load() EXCLUDES(mMutex);
+    void addLocked(const Key& key, std::vector<uint8_t> session, time_t expiry) REQUIRES(mMutex);
+    // Saves the sessions once kSaveInterval has passed since the last save, unless that's already
+    // scheduled.
+    void scheduleSaveLocked() REQUIRES(mMutex);
+    void runScheduledSave() EXCLUDES(mMutex);
+    // Removes |it|, and returns what followed it.
+    std::list<Session>::iterator eraseLocked(std::list<Session>::iterator it) REQUIRES(mMutex);
+
+    const std::string mPath;
+    const size_t mMaxBytes;
+    mutable std::mutex mMutex;
+    // From least recently added to most recently.
+    std::list<Session> mSessions GUARDED_BY(mMutex);
+    std::chrono::steady_clock::time_point mLastSave GUARDED_BY(mMutex);
+    TimerService::Id mSaveTimer GUARDED_BY(mMutex) = 0;
+    // A save is waiting for its timer, or running.
+    bool mSavePending GUARDED_BY(mMutex) = false;
+    bool mSaveRunning GUARDED_BY(mMutex) = false;
+    std::condition_variable mSaveDone;
+    Stats mStats GUARDED_BY(mMutex);
+    // Serializes writers of the file, which run without mMutex.
+    std::mutex mFileMutex;
+};
+
+}  // namespace android::net
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "DnsTlsSessionStore.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using android::base::TemporaryDir;
+
+class DnsTlsSessionStoreTest : public ResolvTestBase {
+  protected:
+    using Key = DnsTlsSessionStore::Key;
+
+    static std::vector<uint8_t> session(uint8_t id, size_t size = 100) {
+        return std::vector<uint8_t>(size, id);
+    }
+    static time_t later() { return time(nullptr) + 3600; }
+
+    const Key kServer1 = {.addr = "192.0.2.1:853", .name = "dns.example.com", .mark = 0x10064};
+    const Key kServer2 = {.addr = "192.0.2.2:853", .name = "", .mark = 0x10064};
+    // The first server on another network.
+    const Key kServer1Other = {.addr = "192.0.2.1:853", .name = "dns.example.com", .mark = 0x10065};
+};
+
+TEST_F(DnsTlsSessionStoreTest, TakesEachSessionOnce) {
+    DnsTlsSessionStore store("", DnsTlsSessionStore::kDefaultMaxBytes);
+    EXPECT_TRUE(store.take(kServer1).empty());
+
+    store.put(kServer1, session(1), later());
+    store.put(kServer1, session(2), later());
+    store.put(kServer2, session(3), later());
+    EXPECT_TRUE(store.take(kServer1Other).empty());
+
+    // Most recent first.
+    EXPECT_EQ(session(2), store.take(kServer1));
+    EXPECT_EQ(session(1), store.take(kServer1));
+    EXPECT_TRUE(store.take(kServer1).empty());
+    EXPECT_EQ(session(3), store.take(kServer2));
+
+    const DnsTlsSessionStore::Stats stats = store.getStats();
+    EXPECT_EQ(3U, stats.taken);
+    EXPECT_EQ(0U, stats.sessions);
+    EXPECT_EQ(0U, stats.bytes);
+}
+
+TEST_F(DnsTlsSessionStoreTest, Bounds) {
+    // At most kMaxSessionsPerKey sessions per server, whatever room is left.
+    DnsTlsSessionStore big("", DnsTlsSessionStore::kDefaultMaxBytes);
+    for (size_t i = 0; i <= DnsTlsSessionStore::kMaxSessionsPerKey; i++) {
+        big.put(kServer1, session(i), later());
+    }
+    EXPECT_EQ(DnsTlsSessionStore::kMaxSessionsPerKey, big.getStats().sessions);
+    EXPECT_EQ(1U, big.getStats().evicted);
+
+    // The oldest sessions make room, whichever server they are for.
+    const size_t kSessionBytes = 100 + kServer2.addr.size();
+    DnsTlsSessionStore store("", 3 * kSessionBytes);
+    store.put(kServer1, session(0), later());
+    for (uint8_t i = 1; i <= 4; i++) store.put(kServer2, session(i), later());
+    EXPECT_EQ(3U, store.getStats().sessions);
+    EXPECT_EQ(3 * kSessionBytes, store.getStats().bytes);
+    EXPECT_TRUE(store.take(kServer1).empty());
+    EXPECT_EQ(session(4), store.take(kServer2));
+    EXPECT_EQ(session(3), store.take(kServer2));
+    EXPECT_EQ(session(2), store.take(kServer2));
+    EXPECT_TRUE(store.take(kServer2).empty());
+
+    // A session that can never fit isn't stored.
+    store.put(kServer2, session(5, 4 * kSessionBytes), later());
+    EXPECT_EQ(0U, store.getStats().sessions);
+}
+
+TEST_F(DnsTlsSessionStoreTest, Expiry) {
+    DnsTlsSessionStore store("", DnsTlsSessionStore::kDefaultMaxBytes);
+    store.put(kServer1, session(1), later());
+    store.put(kServer1, session(2), time(nullptr) - 1);
+    EXPECT_EQ(session(1), store.take(kServer1));
+    EXPECT_EQ(1U, store.getStats().expired);
+    EXPECT_EQ(0U, store.getStats().sessions);
+}
+
+TEST_F(DnsTlsSessionStoreTest, SaveAndLoad) {
+    TemporaryDir dir;
+    const std::string path = std::string(dir.path) + "/dot_sessions";
+    {
+        DnsTlsSessionStore store(path, DnsTlsSessionStore::kDefaultMaxBytes);
+        store.put(kServer1, session(1), later());
+        store.put(kServer1, session(2), later());
+        store.put(kServer2, session(3), time(nullptr) - 1);
+        store.put(kServer1Other, session(4), later());
+        EXPECT_EQ(0, store.save());
+    }
+
+    DnsTlsSessionStore store(path, DnsTlsSessionStore::kDefaultMaxBytes);
+    // Expired sessions aren't loaded.
+    EXPECT_EQ(3U, store.getStats().sessions);
+    EXPECT_EQ(session(2), store.take(kServer1));
+    EXPECT_EQ(session(1), store.take(kServer1));
+    EXPECT_EQ(session(4), store.take(kServer1Other));
+    EXPECT_TRUE(store.take(kServer2).empty());
+
+    // Nor is anything from a file that isn't a session file.
+    ASSERT_TRUE(android::base::WriteStringToFile(std::string(100, 'x'), path));
+    DnsTlsSessionStore garbage(path, DnsTlsSessionStore::kDefaultMaxBytes);
+    EXPECT_EQ(0U, garbage.getStats().sessions);
+}
+
+TEST_F(DnsTlsSessionStoreTest, PutDoesNotSave) {
+    TemporaryDir dir;
+    const std::string path = std::string(dir.path) + "/dot_sessions";
+    {
+        DnsTlsSessionStore store(path, DnsTlsSessionStore::kDefaultMaxBytes);
+        store.put(kServer1, session(1), later());
+    }
+    // The save was scheduled for kSaveInterval later, and dropped with the store.
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+}
+
+}  // namespace android::net
@@ -24,11 +24,15 @@
 #include <linux/tcp.h>
 #include <openssl/err.h>
 #include <openssl/sha.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/poll.h>
 #include <unistd.h>
 #include <algorithm>
+#include <iterator>
 
+#include "DnsTlsBufferPool.h"
+#include "DnsTlsKeepalive.h"
 #include "DnsTlsSessionCache.h"
 #include "IDnsTlsSocketObserver.h"
 
@@ -49,12 +53,37 @@ using netdutils::isOk;
 using netdutils::setThreadName;
 using netdutils::Slice;
 using netdutils::Status;
+using std::chrono::milliseconds;
 
 namespace net {
 namespace {
 
 constexpr const char kCaCertDir[] = "/system/etc/security/cacerts";
 
+// Truncate responses larger than this.  This is safe because a DNS packet is always invalid
+// when truncated, so the response will be treated as an error.
+constexpr uint16_t kMaxResponseSize = 8192;
+
+// The most plaintext a TLS record can carry.
+constexpr size_t kMaxRecordSize = 16384;
+
+// Appends the queries queued behind the first one of |q| to it, as long as they fit in one TLS
+// record, so that a burst (such as the A and AAAA queries of a getaddrinfo) is sent in a single
+// write, rather than a record and usually a TCP segment each.
+void coalesceFront(std::deque<std::vector<uint8_t>>& q) {
+    std::vector<uint8_t>& front = q.front();
+    size_t size = front.size();
+    auto end = q.begin() + 1;
+    for (; end != q.end() && size + end->size() <= kMaxRecordSize; ++end) size += end->size();
+    if (end == q.begin() + 1) return;
+    front.reserve(size);
+    for (auto it = q.begin() + 1; it != end; ++it) {
+        front.insert(front.end(), it->begin(), it->end());
+    }
+    LOG(DEBUG) << "Coalesced " << (end - q.begin()) << " queries into " << size << " bytes";
+    q.erase(q.begin() + 1, end);
+}
+
 int waitForReading(int fd, int timeoutMs = -1) {
     pollfd fds = {.fd = fd, .events = POLLIN};
     return TEMP_FAILURE_RETRY(poll(&fds, 1, timeoutMs));
@@ -178,8 +207,13 @@ bool DnsTlsSocket::initialize() {
     if (mConnectTimeoutMs < 1000) mConnectTimeoutMs = 1000;
 
     mAsyncHandshake = instance->getFlag("dot_async_handshake", 0);
+    if (DnsTlsReactor::isEnabled()) mReactor = &DnsTlsReactor::getInstance();
+    mEarlyData = instance->getFlag("dot_early_data", 0) == 1;
+    mTcpKeepalive = instance->getFlag("dot_tcp_keepalive", 0) == 1;
     LOG(DEBUG) << "DnsTlsSocket is initialized with { mConnectTimeoutMs: " << mConnectTimeoutMs
-               << ", mAsyncHandshake: " << mAsyncHandshake << " }";
+               << ", mAsyncHandshake: " << mAsyncHandshake
+               << ", reactor: " << (mReactor != nullptr) << ", mEarlyData: " << mEarlyData
+               << ", mTcpKeepalive: " << mTcpKeepalive << " }";
 
     transitionState(State::UNINITIALIZED, State::INITIALIZED);
 
@@ -194,6 +228,33 @@ bool DnsTlsSocket::startHandshake() {
     }
     transitionState(State::INITIALIZED, State::CONNECTING);
 
+    if (mReactor != nullptr) {
+        // As with mAsyncHandshake, the handshake happens later, only on the reactor thread, and
+        // its failure is reported by onClosed().
+        if (Status status = tcpConnect(); !status.ok()) {
+            transitionState(State::CONNECTING, State::WAIT_FOR_DELETE);
+            LOG(WARNING) << "TCP Handshake failed: " << status.code();
+            return false;
+        }
+        if (mSsl = prepareForSslConnect(mSslFd.get()); !mSsl) {
+            sslDisconnect();
+            transitionState(State::CONNECTING, State::WAIT_FOR_DELETE);
+            return false;
+        }
+        SSL_set_early_data_enabled(mSsl.get(), mEarlyData);
+        // The socket is writable once the TCP connection is established, or right away with TFO.
+        const auto deadline =
+                DnsTlsReactor::clock::now() + std::chrono::milliseconds(mConnectTimeoutMs);
+        if (int err = mReactor->add(this, mSslFd.get(), EPOLLOUT, deadline); err != 0) {
+            LOG(WARNING) << "Failed to register with the reactor: " << strerror(-err);
+            sslDisconnect();
+            transitionState(State::CONNECTING, State::WAIT_FOR_DELETE);
+            return false;
+        }
+        mRegistered = true;
+        return true;
+    }
+
     if (!mAsyncHandshake) {
         if (Status status = tcpConnect(); !status.ok()) {
             transitionState(State::CONNECTING, State::WAIT_FOR_DELETE);
@@ -300,6 +361,7 @@ bssl::UniquePtr<SSL> DnsTlsSocket::sslConnect(int fd) {
     }
 
     LOG(DEBUG) << mMark << " handshake complete";
+    mCache->recordHandshake(ssl.get());
 
     return ssl;
 }
@@ -309,10 +371,12 @@ bssl::UniquePtr<SSL> DnsTlsSocket::sslConnectV2(int fd) {
     if (ssl = prepareForSslConnect(fd); !ssl) {
         return nullptr;
     }
+    // Queries come in while this runs, so there may be one to send as early data.
+    SSL_set_early_data_enabled(ssl.get(), mEarlyData);
 
     for (;;) {
         LOG(DEBUG) << " Calling SSL_connect with mark 0x" << std::hex << mMark;
-        int ret = SSL_connect(ssl.get());
+        int ret = sslConnectStep(ssl.get());
         LOG(DEBUG) << " SSL_connect returned " << ret << " with mark 0x" << std::hex << mMark;
         if (ret == 1) break;  // SSL handshake complete;
 
@@ -353,10 +417,61 @@ bssl::UniquePtr<SSL> DnsTlsSocket::sslConnectV2(int fd) {
     }
 
     LOG(DEBUG) << mMark << " handshake complete";
+    mCache->recordHandshake(ssl.get());
 
     return ssl;
 }
 
+int DnsTlsSocket::sslConnectStep(SSL* ssl) {
+    for (;;) {
+        const int ret = SSL_connect(ssl);
+        if (ret == 1 && SSL_in_early_data(ssl) && !mEarlyDataTried) {
+            // Resuming a session that allows early data: the handshake returns early so that the
+            // first query can go in the same flight as the ClientHello.  Finishing the handshake
+            // is up to the next call.
+            mEarlyDataTried = true;
+            if (!sendEarlyQuery(ssl)) return -1;
+            continue;
+        }
+        if (ret != 1 && SSL_get_error(ssl, ret) == SSL_ERROR_EARLY_DATA_REJECTED) {
+            // The handshake goes on as a full one, and the query is sent after it.
+            LOG(DEBUG) << mMark << " early data rejected";
+            SSL_reset_early_data_reject(ssl);
+            if (mEarlyQuery) {
+                mPending.push_front(std::move(*mEarlyQuery));
+                mEarlyQuery.reset();
+            }
+            continue;
+        }
+        if (ret == 1) mEarlyQuery.reset();
+        return ret;
+    }
+}
+
+bool DnsTlsSocket::sendEarlyQuery(SSL* ssl) {
+    std::deque<std::vector<uint8_t>> q;
+    mQueue.swap(q);
+    std::move(q.begin(), q.end(), std::back_inserter(mPending));
+
+    // Early data can be replayed by an attacker, so only standard queries, which are idempotent,
+    // are sent in it.  mQueue is newest first, so look for the oldest one.
+    const auto it = std::find_if(mPending.rbegin(), mPending.rend(), [](const auto& buf) {
+        // The 2-byte length comes before the DNS header.
+        return buf.size() >= 2 + HFIXEDSZ && ((buf[2 + 2] >> 3) & 0xf) == ns_o_query;
+    });
+    if (it == mPending.rend()) return true;
+
+    const int ret = SSL_write(ssl, it->data(), it->size());
+    if (ret != int(it->size())) {
+        LOG(WARNING) << "SSL_write of early data failed: " << SSL_get_error(ssl, ret);
+        return false;
+    }
+    LOG(DEBUG) << mMark << " Wrote " << it->size() << " bytes of early data";
+    mEarlyQuery = std::move(*it);
+    mPending.erase(std::next(it).base());
+    return true;
+}
+
 void DnsTlsSocket::sslDisconnect() {
     if (mSsl) {
         SSL_shutdown(mSsl.get());
@@ -395,7 +510,6 @@ bool DnsTlsSocket::sslWrite(const Slice buffer) {
 void DnsTlsSocket::loop() {
     std::lock_guard guard(mLock);
     std::deque<std::vector<uint8_t>> q;
-    const int timeout_msecs = DnsTlsSocket::kIdleTimeout.count() * 1000;
 
     setThreadName(fmt::format("TlsListen_{}", mMark & 0xffff));
 
@@ -413,6 +527,8 @@ void DnsTlsSocket::loop() {
             return;
         }
         LOG(DEBUG) << "Handshaking succeeded";
+        // The queries taken off mQueue to look for one to send as early data.
+        q.swap(mPending);
     }
 
     transitionState(State::CONNECTING, State::CONNECTED);
@@ -437,7 +553,7 @@ void DnsTlsSocket::loop() {
             fds[EVENTFD].events = POLLIN;
         }
 
-        const int s = TEMP_FAILURE_RETRY(poll(fds, std::size(fds), timeout_msecs));
+        const int s = TEMP_FAILURE_RETRY(poll(fds, std::size(fds), mIdleTimeout.count()));
         if (s == 0) {
             LOG(DEBUG) << "Idle timeout";
             break;
@@ -485,9 +601,13 @@ void DnsTlsSocket::loop() {
         } else if (fds[SSLFD].revents & POLLOUT) {
             // q cannot be empty here.
             // Sending the entire queue here would risk a TCP flow control deadlock, so
-            // we only send a single query on each cycle of this loop.
-            // TODO: Coalesce multiple pending queries if there is enough space in the
-            // write buffer.
+            // we only send a single record on each cycle of this loop, with as many of the
+            // pending queries as fit in it.  Queries queued since mEventFd was last read go
+            // along too; mEventFd then wakes the loop up to find nothing new, which is harmless.
+            std::deque<std::vector<uint8_t>> more;
+            mQueue.swap(more);
+            std::move(more.begin(), more.end(), std::back_inserter(q));
+            coalesceFront(q);
             if (!sendQuery(q.front())) {
                 break;
             }
@@ -502,8 +622,170 @@ void DnsTlsSocket::loop() {
     LOG(DEBUG) << "Ending loop";
 }
 
+void DnsTlsSocket::onReady(uint32_t events) {
+    std::lock_guard guard(mLock);
+    if (!mRegistered) return;
+    const bool open = (mState == State::CONNECTING) ? continueHandshake(events)
+                                                     : serviceConnection(events);
+    if (!open) closeOnReactor();
+}
+
+bool DnsTlsSocket::continueHandshake(uint32_t events) {
+    if (events & DnsTlsReactor::kTimedOut) {
+        LOG(WARNING) << "handshake timeout";
+        return false;
+    }
+    if (mShutdownRequested) {
+        LOG(WARNING) << "Got shutdown request during handshake";
+        return false;
+    }
+
+    // Only called once the socket is ready for what the last call was waiting for, so this
+    // doesn't block.
+    const int ret = sslConnectStep(mSsl.get());
+    LOG(DEBUG) << " SSL_connect returned " << ret << " with mark 0x" << std::hex << mMark;
+    if (ret != 1) {
+        const int ssl_err = SSL_get_error(mSsl.get(), ret);
+        uint32_t interest;
+        switch (ssl_err) {
+            case SSL_ERROR_WANT_READ:
+                interest = EPOLLIN;
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                interest = EPOLLOUT;
+                break;
+            default:
+                PLOG(WARNING) << "SSL_connect ssl error =" << ssl_err << ", mark 0x" << std::hex
+                              << mMark;
+                return false;
+        }
+        // As in sslConnectV2(), each step of the handshake may take up to mConnectTimeoutMs.
+        const auto deadline =
+                DnsTlsReactor::clock::now() + std::chrono::milliseconds(mConnectTimeoutMs);
+        mReactor->update(this, interest, deadline);
+        return true;
+    }
+
+    LOG(DEBUG) << mMark << " handshake complete";
+    mCache->recordHandshake(mSsl.get());
+    transitionState(State::CONNECTING, State::CONNECTED);
+    // Send whatever was queried during the handshake.
+    return serviceConnection(DnsTlsReactor::kWokenUp);
+}
+
+bool DnsTlsSocket::serviceConnection(uint32_t events) {
+    // With nothing else happening, the timer is the idle timeout.
+    if (events == DnsTlsReactor::kTimedOut) {
+        LOG(DEBUG) << "Idle timeout";
+        return false;
+    }
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !readAvailableResponses()) {
+        LOG(DEBUG) << "SSL remote close or read error.";
+        return false;
+    }
+    if (events & DnsTlsReactor::kWokenUp) {
+        std::deque<std::vector<uint8_t>> q;
+        mQueue.swap(q);
+        std::move(q.begin(), q.end(), std::back_inserter(mPending));
+    }
+    if (!writePendingQueries()) return false;
+    // The pending queries are sent before an orderly shutdown, as the loop thread does.
+    if (mShutdownRequested && mPending.empty()) {
+        LOG(DEBUG) << "Destructor-initiated shutdown";
+        return false;
+    }
+
+    const uint32_t interest = EPOLLIN | (mPending.empty() ? 0 : EPOLLOUT);
+    mReactor->update(this, interest, DnsTlsReactor::clock::now() + mIdleTimeout);
+    return true;
+}
+
+bool DnsTlsSocket::readAvailableResponses() {
+    // Large enough for a whole TLS record.
+    constexpr size_t kChunkSize = 16384;
+    for (;;) {
+        const size_t size = mReadBuffer.size();
+        mReadBuffer.resize(size + kChunkSize);
+        const int ret = SSL_read(mSsl.get(), mReadBuffer.data() + size, kChunkSize);
+        mReadBuffer.resize(size + std::max(ret, 0));
+        if (ret > 0) continue;
+
+        const int ssl_err = SSL_get_error(mSsl.get(), ret);
+        if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) break;
+        LOG(DEBUG) << "SSL_read error " << ssl_err;
+        return false;
+    }
+
+    size_t offset = 0;
+    while (mReadBuffer.size() - offset >= 2) {
+        const uint16_t responseSize = (mReadBuffer[offset] << 8) | mReadBuffer[offset + 1];
+        if (mReadBuffer.size() - offset - 2 < responseSize) break;
+        const auto begin = mReadBuffer.begin() + offset + 2;
+        LOG(DEBUG) << mMark << " SSL_read complete, size " << responseSize;
+        std::vector<uint8_t> response =
+                DnsTlsBufferPool::getInstance().acquire(std::min(responseSize, kMaxResponseSize));
+        std::copy(begin, begin + response.size(), response.begin());
+        deliverResponse(std::move(response));
+        offset += 2 + responseSize;
+    }
+    mReadBuffer.erase(mReadBuffer.begin(), mReadBuffer.begin() + offset);
+    return true;
+}
+
+bool DnsTlsSocket::writePendingQueries() {
+    while (!mPending.empty()) {
+        // After SSL_ERROR_WANT_WRITE, SSL_write must be retried with the same buffer, which stays
+        // at the front until written.
+        if (!mWriteBlocked) coalesceFront(mPending);
+        const std::vector<uint8_t>& buf = mPending.front();
+        const int ret = SSL_write(mSsl.get(), buf.data(), buf.size());
+        mWriteBlocked = false;
+        if (ret == int(buf.size())) {
+            LOG(DEBUG) << mMark << " SSL_write complete";
+            mPending.pop_front();
+            continue;
+        }
+        const int ssl_err = SSL_get_error(mSsl.get(), ret);
+        if (ssl_err == SSL_ERROR_WANT_WRITE || ssl_err == SSL_ERROR_WANT_READ) {
+            mWriteBlocked = true;
+            break;
+        }
+        LOG(DEBUG) << "SSL_write error " << ssl_err;
+        return false;
+    }
+    return true;
+}
+
+void DnsTlsSocket::closeOnReactor() {
+    LOG(DEBUG) << "Disconnecting";
+    mReactor->remove(this);
+    mRegistered = false;
+    const State from = mState;
+    sslDisconnect();
+    LOG(DEBUG) << "Calling onClosed";
+    mObserver->onClosed();
+    transitionState(from, State::WAIT_FOR_DELETE);
+    mClosedCv.notify_all();
+}
+
 DnsTlsSocket::~DnsTlsSocket() {
     LOG(DEBUG) << "Destructor";
+    if (mReactor != nullptr) {
+        std::unique_lock lock(mLock);
+        if (!mRegistered) return;
+        if (mReactor->onReactorThread()) {
+            LOG(ERROR) << "Violation of re-entrance precondition";
+            mReactor->remove(this);
+            return;
+        }
+        // This will trigger an orderly shutdown in onReady().
+        mShutdownRequested = true;
+        mReactor->wakeUp(this);
+        LOG(DEBUG) << "Waiting for the connection to close";
+        mClosedCv.wait(lock, [&]() REQUIRES(mLock) { return !mRegistered; });
+        LOG(DEBUG) << "Destructor completed";
+        return;
+    }
     // This will trigger an orderly shutdown in loop().
     requestLoopShutdown();
     {
@@ -536,7 +818,13 @@ bool DnsTlsSocket::query(uint16_t id, const Slice query) {
     // Copy body
     std::memcpy(buf.data() + 4, query.base(), query.size());
 
-    mQueue.push(std::move(buf));
+    // A non-empty queue means the consumer has been signalled and hasn't taken the queries yet;
+    // it takes this one along with them.
+    if (!mQueue.push(std::move(buf))) return true;
+    if (mReactor != nullptr) {
+        mReactor->wakeUp(this);
+        return true;
+    }
     // Increment the mEventFd counter by 1.
     return incrementEventFd(1);
 }
@@ -626,12 +914,12 @@ bool DnsTlsSocket::readResponse() {
     if (err != SSL_ERROR_NONE) {
         return false;
     }
-    // Truncate responses larger than MAX_SIZE.  This is safe because a DNS packet is
-    // always invalid when truncated, so the response will be treated as an error.
-    constexpr uint16_t MAX_SIZE = 8192;
     const uint16_t responseSize = (responseHeader[0] << 8) | responseHeader[1];
     LOG(DEBUG) << mMark << " Expecting response of size " << responseSize;
-    std::vector<uint8_t> response(std::min(responseSize, MAX_SIZE));
+    // Read straight into a recycled buffer, which the dispatcher gives back once it has copied
+    // the answer out.
+    std::vector<uint8_t> response =
+            DnsTlsBufferPool::getInstance().acquire(std::min(responseSize, kMaxResponseSize));
     if (sslRead(netdutils::makeSlice(response), true) != SSL_ERROR_NONE) {
         LOG(DEBUG) << mMark << " Failed to read " << response.size() << " bytes";
         return false;
@@ -648,9 +936,21 @@ bool DnsTlsSocket::readResponse() {
     }
     LOG(DEBUG) << mMark << " SSL_read complete";
 
-    mObserver->onResponse(std::move(response));
+    deliverResponse(std::move(response));
     return true;
 }
 
+void DnsTlsSocket::deliverResponse(std::vector<uint8_t> response) {
+    if (mTcpKeepalive) {
+        if (const auto timeout = getTcpKeepaliveTimeout(response); timeout.has_value()) {
+            // A timeout of 0 asks for the connection to be closed once idle; it is kept open a
+            // little so that the responses to queries already sent aren't lost.
+            mIdleTimeout = std::clamp<milliseconds>(*timeout, kMinIdleTimeout, kMaxIdleTimeout);
+            LOG(DEBUG) << mMark << " Server idle timeout " << timeout->count() << "ms";
+        }
+    }
+    mObserver->onResponse(std::move(response));
+}
+
 }  // end of namespace net
 }  // end of namespace android
@@ -18,14 +18,18 @@
 #define _DNS_DNSTLSSOCKET_H
 
 #include <openssl/ssl.h>
+#include <condition_variable>
+#include <deque>
 #include <future>
 #include <mutex>
+#include <optional>
 
 #include <android-base/thread_annotations.h>
 #include <android-base/unique_fd.h>
 #include <netdutils/Slice.h>
 #include <netdutils/Status.h>
 
+#include "DnsTlsReactor.h"
 #include "DnsTlsServer.h"
 #include "IDnsTlsSocket.h"
 #include "LockedQueue.h"
@@ -67,8 +71,11 @@ class DnsTlsSessionCache;
 //                            +--> WAIT_FOR_DELETE <-----+
 //
 //
+// With the "dot_reactor" flag, there's no loop thread: the connection, handshake included, is
+// driven by the shared DnsTlsReactor, and goes through the same states.
+//
 // TODO: Add onHandshakeFinished() for handshake results.
-class DnsTlsSocket : public IDnsTlsSocket {
+class DnsTlsSocket : public IDnsTlsSocket, private DnsTlsReactor::Client {
   public:
     enum class State {
         UNINITIALIZED,
@@ -124,6 +131,15 @@ class DnsTlsSocket : public IDnsTlsSocket {
     // which allows to terminate connection handshake any time.
     bssl::UniquePtr<SSL> sslConnectV2(int fd) REQUIRES(mLock);
 
+    // Calls SSL_connect on |ssl|, and handles early data along the way: sends a query as early
+    // data if the handshake allows it, and queues it again if the server rejects it.  Returns
+    // what SSL_connect does otherwise.
+    int sslConnectStep(SSL* _Nonnull ssl) REQUIRES(mLock);
+
+    // Moves mQueue to mPending, and writes the oldest of those queries that can safely be
+    // replayed as early data.  Returns false on error.
+    bool sendEarlyQuery(SSL* _Nonnull ssl) REQUIRES(mLock);
+
     // Disconnect the SSL session and close the socket.
     void sslDisconnect() REQUIRES(mLock);
 
@@ -142,6 +158,20 @@ class DnsTlsSocket : public IDnsTlsSocket {
     // the response.
     bool readResponse() REQUIRES(mLock);
 
+    // Called by mReactor with what happened on mSslFd.
+    void onReady(uint32_t events) override EXCLUDES(mLock);
+
+    // Steps of a connection driven by mReactor. They return false once it is to be closed.
+    bool continueHandshake(uint32_t events) REQUIRES(mLock);
+    bool serviceConnection(uint32_t events) REQUIRES(mLock);
+    // Reads whatever the server has sent, and hands out every complete response.
+    bool readAvailableResponses() REQUIRES(mLock);
+    // Passes |response| to mObserver, after taking the idle timeout from it.
+    void deliverResponse(std::vector<uint8_t> response) REQUIRES(mLock);
+    // Writes pending queries until the socket is full.
+    bool writePendingQueries() REQUIRES(mLock);
+    void closeOnReactor() REQUIRES(mLock);
+
     // It is only used for DNS-OVER-TLS internal test.
     bool setTestCaCertificate() REQUIRES(mLock);
 
@@ -157,9 +187,9 @@ class DnsTlsSocket : public IDnsTlsSocket {
     // Transition the state from expected state |from| to new state |to|.
     void transitionState(State from, State to) REQUIRES(mLock);
 
-    // Queue of pending queries.  query() pushes items onto the queue and notifies
-    // the loop thread by incrementing mEventFd.  loop() reads items off the queue.
-    LockedQueue<std::vector<uint8_t>> mQueue;
+    // Queue of pending queries.  query() pushes items onto the queue and, if it was empty,
+    // notifies the loop thread by incrementing mEventFd.  loop() reads items off the queue.
+    MpscQueue<std::vector<uint8_t>> mQueue;
 
     // eventfd socket used for notifying the SSL thread when queries are ready to send.
     // This socket acts similarly to an atomic counter, incremented by query() and cleared
@@ -181,6 +211,9 @@ class DnsTlsSocket : public IDnsTlsSocket {
     base::unique_fd mSslFd GUARDED_BY(mLock);
     bssl::UniquePtr<SSL> mSsl GUARDED_BY(mLock);
     static constexpr std::chrono::seconds kIdleTimeout = std::chrono::seconds(20);
+    // The bounds on an idle timeout advertised by the server.
+    static constexpr std::chrono::seconds kMinIdleTimeout = std::chrono::seconds(1);
+    static constexpr std::chrono::seconds kMaxIdleTimeout = std::chrono::seconds(120);
 
     const unsigned mMark;  // Socket mark
     const DnsTlsServer mServer;
@@ -198,6 +231,31 @@ class DnsTlsSocket : public IDnsTlsSocket {
     static constexpr int kDotConnectTimeoutMs = 127 * 1000;
     int mConnectTimeoutMs;
 
+    // Set by initialize() if the connection is driven by the reactor, and constant thereafter.
+    DnsTlsReactor* mReactor = nullptr;
+    // Whether mSslFd is registered with mReactor, which is until the connection is closed.
+    bool mRegistered GUARDED_BY(mLock) = false;
+    bool mShutdownRequested GUARDED_BY(mLock) = false;
+    std::condition_variable mClosedCv;
+    // Queries taken off mQueue that aren't written yet, front first.  The loop thread only uses
+    // it during the handshake.
+    std::deque<std::vector<uint8_t>> mPending GUARDED_BY(mLock);
+    // Whether the front of mPending is to be retried as is.
+    bool mWriteBlocked GUARDED_BY(mLock) = false;
+
+    // If true, the asynchronous handshakes (with mAsyncHandshake or mReactor) send a query as TLS
+    // 1.3 early data when resuming a session that allows it.  Set by the "dot_early_data" flag.
+    bool mEarlyData GUARDED_BY(mLock) = false;
+    bool mEarlyDataTried GUARDED_BY(mLock) = false;
+    // The query sent as early data, until the handshake says whether the server accepted it.
+    std::optional<std::vector<uint8_t>> mEarlyQuery GUARDED_BY(mLock);
+    // If true, the idle timeout is the one the server advertises with edns-tcp-keepalive, if any.
+    // Set by the "dot_tcp_keepalive" flag.
+    bool mTcpKeepalive GUARDED_BY(mLock) = false;
+    std::chrono::milliseconds mIdleTimeout GUARDED_BY(mLock) = kIdleTimeout;
+    // What has been read of responses that aren't complete yet.
+    std::vector<uint8_t> mReadBuffer GUARDED_BY(mLock);
+
     // For testing.
     friend class DnsTlsSocketTest;
 };
@@ -30,6 +30,7 @@
 #include <private/android_filesystem_config.h>  // AID_DNS
 #include <sys/poll.h>
 
+#include "DnsTlsKeepalive.h"
 #include "DnsTlsSocketFactory.h"
 #include "Experiments.h"
 #include "IDnsTlsSocketFactory.h"
@@ -148,9 +149,16 @@ base::Result<void> sendUdpQuery(netdutils::IPAddress ip, uint32_t mark,
 
 }  // namespace
 
-std::future<DnsTlsTransport::Result> DnsTlsTransport::query(const netdutils::Slice query) {
+std::future<DnsTlsTransport::Result> DnsTlsTransport::query(netdutils::Slice query) {
     std::lock_guard guard(mLock);
 
+    // The server only says how long it keeps idle connections open if asked to.
+    std::vector<uint8_t> withKeepalive;
+    if (Experiments::getInstance()->getFlag("dot_tcp_keepalive", 0) == 1) {
+        withKeepalive.assign(query.base(), query.limit());
+        if (addTcpKeepalive(&withKeepalive)) query = netdutils::makeSlice(withKeepalive);
+    }
+
     auto record = mQueries.recordQuery(query);
     if (!record) {
         return std::async(std::launch::deferred, []{
@@ -158,6 +166,9 @@ std::future<DnsTlsTransport::Result> DnsTlsTransport::query(const netdutils::Sli
         });
     }
 
+    // The query it joined is in flight already.
+    if (record->joined) return std::move(record->result);
+
     if (!mSocket) {
         LOG(DEBUG) << "No socket for query.  Opening socket and sending.";
         doConnect();
@@ -168,6 +179,15 @@ std::future<DnsTlsTransport::Result> DnsTlsTransport::query(const netdutils::Sli
     return std::move(record->result);
 }
 
+bool DnsTlsTransport::warmUp() {
+    std::lock_guard guard(mLock);
+    if (!mSocket) {
+        LOG(DEBUG) << "Opening socket ahead of the first query.";
+        doConnect();
+    }
+    return mSocket != nullptr;
+}
+
 int DnsTlsTransport::getConnectCounter() const {
     std::lock_guard guard(mLock);
     return mConnectCounter;
@@ -271,14 +291,18 @@ DnsTlsTransport::~DnsTlsTransport() {
 }
 
 // static
-// TODO: Use this function to preheat the session cache.
-// That may require moving it to DnsTlsDispatcher.
 bool DnsTlsTransport::validate(const DnsTlsServer& server, uint32_t mark) {
+    DnsTlsSocketFactory factory;
+    DnsTlsTransport transport(server, mark, &factory);
+    return validate(server, mark, transport);
+}
+
+// static
+bool DnsTlsTransport::validate(const DnsTlsServer& server, uint32_t mark,
+                               DnsTlsTransport& transport) {
     LOG(DEBUG) << "Beginning validation with mark " << std::hex << mark;
 
     const std::vector<uint8_t> query = makeDnsQuery();
-    DnsTlsSocketFactory factory;
-    DnsTlsTransport transport(server, mark, &factory);
 
     // Send the initial query to warm up the connection.
     auto r = transport.query(netdutils::makeSlice(query)).get();
@@ -43,7 +43,10 @@ class DnsTlsTransport : public IDnsTlsSocketObserver {
   public:
     DnsTlsTransport(const DnsTlsServer& server, unsigned mark,
                     IDnsTlsSocketFactory* _Nonnull factory)
-        : mMark(mark), mServer(server), mFactory(factory) {}
+        : mCache(DnsTlsSessionStore::getInstance(), server, mark),
+          mMark(mark),
+          mServer(server),
+          mFactory(factory) {}
     ~DnsTlsTransport();
 
     using Response = DnsTlsQueryMap::Response;
@@ -52,10 +55,16 @@ class DnsTlsTransport : public IDnsTlsSocketObserver {
     // Given a |query|, this method sends it to the server and returns the result asynchronously.
     std::future<Result> query(const netdutils::Slice query) EXCLUDES(mLock);
 
+    // Opens the connection to the server ahead of the first query, if it isn't open. This blocks
+    // for the handshake. Returns whether the connection is open.
+    bool warmUp() EXCLUDES(mLock);
+
     // Check that a given TLS server is fully working with a specified mark.
     // This function is used in ResolverController to ensure that we don't enable DNS over TLS
     // on networks where it doesn't actually work.
     static bool validate(const DnsTlsServer& server, uint32_t mark);
+    // As above, but probes through |transport|, whose connection stays open afterwards.
+    static bool validate(const DnsTlsServer& server, uint32_t mark, DnsTlsTransport& transport);
 
     int getConnectCounter() const EXCLUDES(mLock);
 
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "DnsUdpReactor.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <optional>
+
+#include <android-base/logging.h>
+
+#include "Experiments.h"
+
+namespace android::net {
+
+using base::Error;
+using std::chrono::ceil;
+using std::chrono::milliseconds;
+
+namespace {
+
+constexpr int kMaxEvents = 64;
+
+}  // namespace
+
+DnsUdpReactor::DnsUdpReactor()
+    : mEpollFd(epoll_create1(EPOLL_CLOEXEC)), mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = mEventFd.get()}};
+    if (!mEpollFd.ok() || !mEventFd.ok() ||
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mEventFd, &event) != 0) {
+        PLOG(ERROR) << __func__ << ": failed to set up epoll";
+        return;
+    }
+    mThread = std::thread(&DnsUdpReactor::loop, this);
+}
+
+DnsUdpReactor::~DnsUdpReactor() {
+    {
+        std::lock_guard guard(mMutex);
+        mStopping = true;
+    }
+    wakeUp();
+    if (mThread.joinable()) mThread.join();
+}
+
+bool DnsUdpReactor::isEnabled() {
+    return Experiments::getInstance()->getFlag("udp_reactor", 0) == 1;
+}
+
+void DnsUdpReactor::watch(std::span<const int> fds, clock::time_point deadline,
+                          Callback callback) {
+    auto waiter = std::make_shared<Waiter>();
+    waiter->callback = std::move(callback);
+    if (!mThread.joinable()) {
+        waiter->callback(Error(ENOSYS));
+        return;
+    }
+
+    std::optional<Completion> failed;
+    {
+        std::lock_guard guard(mMutex);
+        for (int fd : fds) {
+            if (mWaiters.count(fd) != 0) {
+                failed = completeLocked(waiter, Error(EEXIST));
+                break;
+            }
+            // Registered before the socket is added, so that the loop finds it when it's readable.
+            mWaiters[fd] = waiter;
+            waiter->fds.push_back(fd);
+            epoll_event event = {.events = EPOLLIN, .data = {.fd = fd}};
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                const int error = errno;
+                mWaiters.erase(fd);
+                waiter->fds.pop_back();
+                failed = completeLocked(waiter, Error(error));
+                break;
+            }
+        }
+        if (!failed) {
+            waiter->timer = mTimers.emplace(deadline, waiter);
+            waiter->scheduled = true;
+            // The loop may be sleeping until a later deadline.
+            if (waiter->timer == mTimers.begin()) wakeUp();
+        }
+    }
+    if (failed) failed->first(std::move(failed->second));
+}
+
+std::future<DnsUdpReactor::Result> DnsUdpReactor::wait(std::span<const int> fds,
+                                                       clock::time_point deadline) {
+    auto promise = std::make_shared<std::promise<Result>>();
+    auto future = promise->get_future();
+    watch(fds, deadline, [promise](Result result) { promise->set_value(std::move(result)); });
+    return future;
+}
+
+void DnsUdpReactor::loop() {
+    epoll_event events[kMaxEvents];
+    std::unique_lock lock(mMutex);
+    while (!mStopping) {
+        int timeoutMs = -1;
+        if (!mTimers.empty()) {
+            const auto remaining = ceil<milliseconds>(mTimers.begin()->first - clock::now());
+            timeoutMs = std::max<int64_t>(0, std::min<int64_t>(remaining.count(), INT32_MAX));
+        }
+        lock.unlock();
+        const int n = epoll_wait(mEpollFd, events, kMaxEvents, timeoutMs);
+        lock.lock();
+        if (n < 0 && errno != EINTR) {
+            PLOG(ERROR) << __func__ << ": epoll_wait";
+        }
+
+        std::vector<std::shared_ptr<Waiter>> readyWaiters;
+        for (int i = 0; i < n; i++) {
+            const int fd = events[i].data.fd;
+            if (fd == mEventFd.get()) {
+                eventfd_t value;
+                eventfd_read(mEventFd, &value);
+                continue;
+            }
+            const auto it = mWaiters.find(fd);
+            // Its query gave up on it while the lock was released.
+            if (it == mWaiters.end()) continue;
+            if (it->second->ready.empty()) readyWaiters.push_back(it->second);
+            it->second->ready.push_back(fd);
+        }
+        std::vector<Completion> completions;
+        for (const auto& waiter : readyWaiters) {
+            completions.push_back(completeLocked(waiter, std::move(waiter->ready)));
+        }
+        const auto now = clock::now();
+        while (!mTimers.empty() && mTimers.begin()->first <= now) {
+            completions.push_back(completeLocked(mTimers.begin()->second, Error(ETIMEDOUT)));
+        }
+
+        lock.unlock();
+        for (auto& [callback, result] : completions) callback(std::move(result));
+        lock.lock();
+    }
+
+    // Nobody is left to wait for the remaining queries.
+    std::vector<Completion> completions;
+    while (!mTimers.empty()) {
+        completions.push_back(completeLocked(mTimers.begin()->second, Error(ECANCELED)));
+    }
+    lock.unlock();
+    for (auto& [callback, result] : completions) callback(std::move(result));
+}
+
+DnsUdpReactor::Completion DnsUdpReactor::completeLocked(std::shared_ptr<Waiter> waiter,
+                                                        Result result) {
+    for (int fd : waiter->fds) {
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+        mWaiters.erase(fd);
+    }
+    waiter->fds.clear();
+    if (waiter->scheduled) {
+        mTimers.erase(waiter->timer);
+        waiter->scheduled = false;
+    }
+    return {std::move(waiter->callback), std::move(result)};
+}
+
+void DnsUdpReactor::wakeUp() {
+    if (eventfd_write(mEventFd, 1) != 0) PLOG(WARNING) << __func__ << ": eventfd_write";
+}
+
+}  // namespace android::net
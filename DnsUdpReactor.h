@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+
+namespace android::net {
+
+// Waits for answers on the UDP sockets of all in-flight cleartext queries from a single epoll
+// thread, instead of each query thread sitting in its own poll() loop. A query registers the
+// sockets it expects an answer on together with its retransmit deadline, and is told as soon as
+// one of them becomes readable, or with ETIMEDOUT once the deadline has passed. All methods are
+// thread-safe.
+class DnsUdpReactor {
+  public:
+    using clock = std::chrono::steady_clock;
+    using Result = base::Result<std::vector<int>>;
+    using Callback = std::function<void(Result)>;
+
+    DnsUdpReactor();
+    ~DnsUdpReactor();
+
+    static DnsUdpReactor& getInstance() {
+        static DnsUdpReactor instance;
+        return instance;
+    }
+
+    static bool isEnabled();
+
+    // Calls |callback| with the subset of |fds| that are readable or have a pending error. The
+    // callback runs on the reactor thread, without any lock held, so it may watch again; it must
+    // not block. The sockets must stay open until it has been called.
+    void watch(std::span<const int> fds, clock::time_point deadline, Callback callback)
+            EXCLUDES(mMutex);
+
+    // Same as watch(), for callers that block until the sockets are ready.
+    std::future<Result> wait(std::span<const int> fds, clock::time_point deadline)
+            EXCLUDES(mMutex);
+
+  private:
+    struct Waiter {
+        Callback callback;
+        std::vector<int> fds;
+        std::vector<int> ready;
+        // Where the waiter is in |mTimers|, if |scheduled|.
+        std::multimap<clock::time_point, std::shared_ptr<Waiter>>::iterator timer;
+        bool scheduled = false;
+    };
+    using Completion = std::pair<Callback, Result>;
+
+    void loop() EXCLUDES(mMutex);
+    // Unregisters |waiter|, and returns what its callback is to be called with once the lock is
+    // released. Takes |waiter| by value, as the caller may pass a reference to what this erases.
+    Completion completeLocked(std::shared_ptr<Waiter> waiter, Result result) REQUIRES(mMutex);
+    void wakeUp();
+
+    base::unique_fd mEpollFd;
+    base::unique_fd mEventFd;
+    std::mutex mMutex;
+    // Registered sockets, and the waiter each one belongs to.
+    std::map<int, std::shared_ptr<Waiter>> mWaiters GUARDED_BY(mMutex);
+    // All waiters, by deadline.
+    std::multimap<clock::time_point, std::shared_ptr<Waiter>> mTimers GUARDED_BY(mMutex);
+    bool mStopping GUARDED_BY(mMutex) = false;
+    std::thread mThread;
+};
+
+}  // namespace android::net
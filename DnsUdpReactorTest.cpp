@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/socket.h>
+
+#include <functional>
+#include <thread>
+
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "DnsUdpReactor.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using android::base::unique_fd;
+
+class DnsUdpReactorTest : public ResolvTestBase {
+  protected:
+    // Returns a connected pair of datagram sockets.
+    static std::pair<unique_fd, unique_fd> socketPair() {
+        int fds[2];
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds));
+        return {unique_fd(fds[0]), unique_fd(fds[1])};
+    }
+
+    DnsUdpReactor mReactor;
+};
+
+TEST_F(DnsUdpReactorTest, Readable) {
+    auto [a, b] = socketPair();
+    auto [c, d] = socketPair();
+    const int fds[] = {a.get(), c.get()};
+    auto future = mReactor.wait(fds, DnsUdpReactor::clock::now() + 2s);
+    EXPECT_EQ(std::future_status::timeout, future.wait_for(20ms));
+
+    ASSERT_EQ(1, send(d, "x", 1, 0));
+    const auto result = future.get();
+    ASSERT_TRUE(result.ok()) << result.error();
+    EXPECT_EQ(std::vector<int>{c.get()}, *result);
+
+    // Once completed, the sockets can be waited on again.
+    auto again = mReactor.wait(fds, DnsUdpReactor::clock::now() + 2s);
+    const auto result2 = again.get();
+    ASSERT_TRUE(result2.ok());
+    EXPECT_EQ(std::vector<int>{c.get()}, *result2);
+}
+
+TEST_F(DnsUdpReactorTest, Timeout) {
+    auto [a, b] = socketPair();
+    auto [c, d] = socketPair();
+    const int slow[] = {a.get()};
+    const int fast[] = {c.get()};
+    const auto start = DnsUdpReactor::clock::now();
+    // The earlier deadline must be honoured even though it was registered last.
+    auto slowFuture = mReactor.wait(slow, start + 500ms);
+    auto fastFuture = mReactor.wait(fast, start + 50ms);
+
+    const auto fastResult = fastFuture.get();
+    ASSERT_FALSE(fastResult.ok());
+    EXPECT_EQ(ETIMEDOUT, fastResult.error().code());
+    EXPECT_LT(DnsUdpReactor::clock::now() - start, 400ms);
+
+    const auto slowResult = slowFuture.get();
+    ASSERT_FALSE(slowResult.ok());
+    EXPECT_EQ(ETIMEDOUT, slowResult.error().code());
+    EXPECT_GE(DnsUdpReactor::clock::now() - start, 500ms);
+}
+
+TEST_F(DnsUdpReactorTest, ManyConcurrentWaiters) {
+    constexpr int kWaiters = 200;
+    std::vector<std::pair<unique_fd, unique_fd>> pairs;
+    std::vector<std::future<DnsUdpReactor::Result>> futures;
+    for (int i = 0; i < kWaiters; i++) {
+        pairs.push_back(socketPair());
+        const int fds[] = {pairs.back().first.get()};
+        futures.push_back(mReactor.wait(fds, DnsUdpReactor::clock::now() + 5s));
+    }
+    for (auto& [mine, peer] : pairs) ASSERT_EQ(1, send(peer, "x", 1, 0));
+    for (int i = 0; i < kWaiters; i++) {
+        const auto result = futures[i].get();
+        ASSERT_TRUE(result.ok()) << result.error();
+        EXPECT_EQ(std::vector<int>{pairs[i].first.get()}, *result);
+    }
+}
+
+TEST_F(DnsUdpReactorTest, WatchAgainFromCallback) {
+    auto [a, b] = socketPair();
+    const int fds[] = {a.get()};
+    std::promise<int> done;
+    int timeouts = 0;
+    // Times out twice on the reactor thread, then sees the socket readable.
+    std::function<void(DnsUdpReactor::Result)> callback = [&](DnsUdpReactor::Result result) {
+        if (result.ok()) {
+            done.set_value(timeouts);
+            return;
+        }
+        EXPECT_EQ(ETIMEDOUT, result.error().code());
+        if (++timeouts == 2) ASSERT_EQ(1, send(b, "x", 1, 0));
+        mReactor.watch(fds, DnsUdpReactor::clock::now() + 10ms, callback);
+    };
+    mReactor.watch(fds, DnsUdpReactor::clock::now() + 10ms, callback);
+    EXPECT_EQ(2, done.get_future().get());
+}
+
+TEST_F(DnsUdpReactorTest, InvalidSocket) {
+    auto [a, b] = socketPair();
+    const int fds[] = {a.get()};
+    auto first = mReactor.wait(fds, DnsUdpReactor::clock::now() + 2s);
+    // A socket can't be waited on twice at the same time.
+    const auto twice = mReactor.wait(fds, DnsUdpReactor::clock::now() + 2s).get();
+    ASSERT_FALSE(twice.ok());
+    EXPECT_EQ(EEXIST, twice.error().code());
+
+    const int bad[] = {-1};
+    const auto result = mReactor.wait(bad, DnsUdpReactor::clock::now() + 2s).get();
+    ASSERT_FALSE(result.ok());
+    EXPECT_EQ(EBADF, result.error().code());
+
+    ASSERT_EQ(1, send(b, "x", 1, 0));
+    EXPECT_TRUE(first.get().ok());
+}
+
+}  // namespace android::net
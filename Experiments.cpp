@@ -18,6 +18,7 @@
 
 #include <android-base/format.h>
 #include <netdutils/DumpWriter.h>
+#include <map>
 #include <string>
 
 #include "util.h"
@@ -43,9 +44,13 @@ void Experiments::update() {
 }
 
 void Experiments::dump(DumpWriter& dw) const {
-    std::lock_guard guard(mMutex);
+    // Sorted by name.
+    std::map<std::string_view, int> flags;
+    for (size_t i = 0; i < kNumFlags; i++) {
+        flags[kExperimentFlagKeyList[i]] = mFlagValues[i].load(std::memory_order_relaxed);
+    }
     dw.println("Experiments list: ");
-    for (const auto& [key, value] : mFlagsMapInt) {
+    for (const auto& [key, value] : flags) {
         ScopedIndent indentStats(dw);
         if (value == Experiments::kFlagIntDefault) {
             dw.println(fmt::format("{}: UNSET", key));
@@ -57,16 +62,23 @@ void Experiments::dump(DumpWriter& dw) const {
 
 void Experiments::updateInternal() {
     std::lock_guard guard(mMutex);
-    for (const auto& key : kExperimentFlagKeyList) {
-        mFlagsMapInt[key] = mGetExperimentFlagIntFunction(key, Experiments::kFlagIntDefault);
+    for (size_t i = 0; i < kNumFlags; i++) {
+        mFlagValues[i].store(
+                mGetExperimentFlagIntFunction(kExperimentFlagKeyList[i], kFlagIntDefault),
+                std::memory_order_relaxed);
     }
 }
 
-int Experiments::getFlag(std::string_view key, int defaultValue) const {
-    std::lock_guard guard(mMutex);
-    auto it = mFlagsMapInt.find(key);
-    if (it != mFlagsMapInt.end() && it->second != Experiments::kFlagIntDefault) {
-        return it->second;
+int Experiments::getFlag(Flag flag, int defaultValue) const {
+    const int value = mFlagValues[flag.index()].load(std::memory_order_relaxed);
+    return value != kFlagIntDefault ? value : defaultValue;
+}
+
+int Experiments::getFlagByName(std::string_view key, int defaultValue) const {
+    for (size_t i = 0; i < kNumFlags; i++) {
+        if (kExperimentFlagKeyList[i] != key) continue;
+        const int value = mFlagValues[i].load(std::memory_order_relaxed);
+        return value != kFlagIntDefault ? value : defaultValue;
     }
     return defaultValue;
 }
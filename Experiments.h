@@ -16,8 +16,11 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <climits>
-#include <map>
+#include <functional>
+#include <iterator>
 #include <mutex>
 #include <string>
 #include <string_view>
@@ -28,14 +31,30 @@
 namespace android::net {
 
 // TODO: Add some way to update the stored experiment flags periodically.
-// TODO: Refactor this class and make things easier. (e.g. remove string map.)
 class Experiments {
   public:
     using GetExperimentFlagIntFunction = std::function<int(const std::string&, int)>;
+
+    // A flag, by its position in kExperimentFlagKeyList. It's made from the flag's name at
+    // compile time, so that getFlag("name", ...) doesn't search for the name, and a name that
+    // isn't in the list doesn't compile.
+    class Flag {
+      public:
+        consteval Flag(const char* name) : mIndex(indexOf(name)) {}
+        size_t index() const { return mIndex; }
+
+      private:
+        static consteval size_t indexOf(std::string_view name);
+        size_t mIndex;
+    };
+
     static Experiments* getInstance();
-    int getFlag(std::string_view key, int defaultValue) const EXCLUDES(mMutex);
-    void update();
-    void dump(netdutils::DumpWriter& dw) const EXCLUDES(mMutex);
+    // Lock-free, for the query path.
+    int getFlag(Flag flag, int defaultValue) const;
+    // For callers that only know the name at run time. Unknown names return |defaultValue|.
+    int getFlagByName(std::string_view key, int defaultValue) const;
+    void update() EXCLUDES(mMutex);
+    void dump(netdutils::DumpWriter& dw) const;
 
     Experiments(Experiments const&) = delete;
     void operator=(Experiments const&) = delete;
@@ -44,8 +63,8 @@ class Experiments {
     explicit Experiments(GetExperimentFlagIntFunction getExperimentFlagIntFunction);
     Experiments() = delete;
     void updateInternal() EXCLUDES(mMutex);
-    mutable std::mutex mMutex;
-    std::map<std::string_view, int> mFlagsMapInt GUARDED_BY(mMutex);
+    // Serializes updates. Readers don't take it.
+    std::mutex mMutex;
     // TODO: Migrate other experiment flags to here.
     // (retry_count, retransmission_time_interval)
     static constexpr const char* const kExperimentFlagKeyList[] = {
@@ -69,12 +88,87 @@ class Experiments {
             "doh_session_resumption",
             "mdns_resolution",
             "max_queries_global",
+            "cache_flat_table",
+            "cache_prefetch",
+            "cache_snapshot",
+            "cache_rrset",
+            "cache_aggressive_nsec",
+            "cache_minimize_answers",
+            "cache_intern_answers",
+            "cache_shared_domains",
+            "udp_socket_pool",
+            "hedged_queries",
+            "adaptive_timeout",
+            "adaptive_timeout_min_msec",
+            "adaptive_timeout_max_msec",
+            "tcp_connection_idle_timeout_ms",
+            "udp_reactor",
+            "batched_lookup",
+            "query_thread_pool",
+            "async_resnsend",
+            "addrinfo_cache",
+            "src_addr_cache",
+            "parallel_search",
+            "dot_session_store",
+            "dot_reactor",
+            "dot_max_connections",
+            "dot_pool_depth_threshold",
+            "dot_pool_latency_threshold_ms",
+            "dot_early_data",
+            "dot_tcp_keepalive",
+            "dot_coalesce_queries",
+            "doh_coalesce_queries",
+            "doh_max_connections",
+            "doh_max_streams_per_connection",
+            "doh_early_data",
+            "dot_prewarm_connections",
+            "dot_sort_servers",
+            "dot_validation_parallelism",
+            "stats_lazy_merge",
+            "async_dns_event_reporting",
+            "query_stage_tracing",
+            "max_queries_per_uid_per_sec",
+            "max_queries_per_uid_burst",
+            "query_priority_scheduling",
+            "cancel_on_client_hangup",
+            "dns64_parallel_discovery",
+            "dns64_ra_prefix_preferred",
+            "keep_nameserver_stats",
+            "cache_generations",
+            "mdns_cache",
+            "mdns_parallel_groups",
+            "mdns_aggregation_ms",
+            "dot_cleartext_race",
+            "server_selection_mode",
+            "cache_admission",
+            "https_prefetch",
+            "doh_dispatcher_idle_ms",
+            "cache_uid_partitions",
+            "listener_cache_fast_path",
+            "adaptive_edns",
+            "circuit_breaker_timeouts",
+            "doh_batch_queries",
+            "udp_rx_timestamps",
+            "dot_validation_reuse_connection",
+            "adaptive_pending_waits",
+            "listener_shards",
     };
+    static constexpr size_t kNumFlags = std::size(kExperimentFlagKeyList);
     // This value is used in updateInternal as the default value if any flags can't be found.
     static constexpr int kFlagIntDefault = INT_MIN;
+    // Indexed by Flag. Each value is published on its own, so a reader racing with update() may
+    // see some flags updated and others not, as it could when each flag was read under the lock.
+    std::array<std::atomic<int>, kNumFlags> mFlagValues;
     // For testing.
     friend class ExperimentsTest;
     const GetExperimentFlagIntFunction mGetExperimentFlagIntFunction;
 };
 
+consteval size_t Experiments::Flag::indexOf(std::string_view name) {
+    for (size_t i = 0; i < kNumFlags; i++) {
+        if (kExperimentFlagKeyList[i] == name) return i;
+    }
+    throw "Not in kExperimentFlagKeyList";
+}
+
 }  // namespace android::net
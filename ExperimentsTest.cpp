@@ -50,34 +50,44 @@ class ExperimentsTest : public ResolvTestBase {
 
     void setupExperimentsMap(int value) {
         setupFakeMap(value);
-        std::lock_guard guard(mExperiments.mMutex);
-        mExperiments.mFlagsMapInt = sFakeFlagsMapInt;
+        for (size_t i = 0; i < Experiments::kNumFlags; i++) {
+            mExperiments.mFlagValues[i] = sFakeFlagsMapInt[Experiments::kExperimentFlagKeyList[i]];
+        }
+    }
+
+    std::map<std::string_view, int> getFlagsMapInt() const {
+        std::map<std::string_view, int> flags;
+        for (size_t i = 0; i < Experiments::kNumFlags; i++) {
+            flags[Experiments::kExperimentFlagKeyList[i]] = mExperiments.mFlagValues[i];
+        }
+        return flags;
     }
 
     void expectFlagsMapInt() {
-        std::lock_guard guard(mExperiments.mMutex);
-        EXPECT_THAT(mExperiments.mFlagsMapInt, ::testing::ContainerEq(sFakeFlagsMapInt));
+        EXPECT_THAT(getFlagsMapInt(), ::testing::ContainerEq(sFakeFlagsMapInt));
     }
 
     void expectFlagsMapIntDefault() {
-        std::lock_guard guard(mExperiments.mMutex);
-        for (const auto& [key, value] : mExperiments.mFlagsMapInt) {
+        for (const auto& [key, value] : getFlagsMapInt()) {
             EXPECT_EQ(value, Experiments::kFlagIntDefault);
         }
     }
 
     void expectGetDnsExperimentFlagIntDefault(int value) {
         for (const auto& key : Experiments::kExperimentFlagKeyList) {
-            EXPECT_EQ(mExperiments.getFlag(key, value), value);
+            EXPECT_EQ(mExperiments.getFlagByName(key, value), value);
         }
+        EXPECT_EQ(mExperiments.getFlag("keep_listening_udp", value), value);
     }
 
     void expectGetDnsExperimentFlagInt() {
         std::map<std::string_view, int> tempMap;
         for (const auto& key : Experiments::kExperimentFlagKeyList) {
-            tempMap[key] = mExperiments.getFlag(key, 0);
+            tempMap[key] = mExperiments.getFlagByName(key, 0);
         }
         EXPECT_THAT(tempMap, ::testing::ContainerEq(sFakeFlagsMapInt));
+        EXPECT_EQ(mExperiments.getFlag("query_stage_tracing", -1),
+                  sFakeFlagsMapInt["query_stage_tracing"]);
     }
 
     void expectDumpOutput() {
@@ -88,8 +98,7 @@ class ExperimentsTest : public ResolvTestBase {
         const std::string title = "Experiments list:";
         EXPECT_EQ(dumpString.find(title), 0U);
         size_t startPos = title.size();
-        std::lock_guard guard(mExperiments.mMutex);
-        for (const auto& [key, value] : mExperiments.mFlagsMapInt) {
+        for (const auto& [key, value] : getFlagsMapInt()) {
             std::string flagDump = fmt::format("{}: {}", key, value);
             if (value == Experiments::kFlagIntDefault) {
                 flagDump = fmt::format("{}: UNSET", key);
@@ -103,6 +112,19 @@ class ExperimentsTest : public ResolvTestBase {
         EXPECT_EQ(dumpString.substr(startPos), "\n");
     }
 
+    static void expectFlagNamesUnique() {
+        for (size_t i = 0; i < Experiments::kNumFlags; i++) {
+            for (size_t j = 0; j < i; j++) {
+                EXPECT_STRNE(Experiments::kExperimentFlagKeyList[i],
+                             Experiments::kExperimentFlagKeyList[j]);
+            }
+        }
+    }
+
+    static const char* flagName(Experiments::Flag flag) {
+        return Experiments::kExperimentFlagKeyList[flag.index()];
+    }
+
     static std::map<std::string_view, int> sFakeFlagsMapInt;
     Experiments mExperiments;
 };
@@ -149,4 +171,14 @@ TEST_F(ExperimentsTest, dump) {
     expectDumpOutput();
 }
 
+TEST_F(ExperimentsTest, flagIndex) {
+    expectFlagNamesUnique();
+    EXPECT_EQ(0U, Experiments::Flag("keep_listening_udp").index());
+    EXPECT_STREQ("dot_maxtries", flagName("dot_maxtries"));
+
+    setupFakeMap(7);
+    mExperiments.update();
+    EXPECT_EQ(42, mExperiments.getFlagByName("no_such_flag", 42));
+}
+
 }  // namespace android::net
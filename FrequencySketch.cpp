@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FrequencySketch.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace android::net {
+
+namespace {
+
+// Odd multipliers that spread the hash differently for each row.
+constexpr uint32_t kSeeds[] = {0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f};
+
+// Per row. With fewer, a key seen once would too often share all its counters with keys seen
+// more, and be taken for one of them.
+constexpr size_t kCountersPerKey = 4;
+// Rows narrower than that would make every key collide.
+constexpr size_t kMinWidth = 16;
+
+}  // namespace
+
+void FrequencySketch::resize(size_t capacity) {
+    mWidth = std::bit_ceil(std::max(capacity * kCountersPerKey, kMinWidth));
+    mCounters = std::make_unique<std::atomic<uint8_t>[]>(mWidth * kDepth / 2);
+    mSampleSize = std::max<size_t>(capacity, 1) * kSamplesPerKey;
+    mSamples = 0;
+}
+
+size_t FrequencySketch::index(uint32_t hash, int row) const {
+    uint32_t h = hash * kSeeds[row];
+    h ^= h >> 16;
+    return row * mWidth + (h & (mWidth - 1));
+}
+
+uint8_t FrequencySketch::counter(size_t index) const {
+    const uint8_t pair = mCounters[index / 2].load(std::memory_order_relaxed);
+    return (index % 2 ? pair >> 4 : pair) & 0xf;
+}
+
+void FrequencySketch::record(uint32_t hash) {
+    // Only the smallest counters are incremented ("conservative update"), which keeps those
+    // shared with more popular keys from growing further.
+    const uint8_t count = estimate(hash);
+    if (count < kMaxCount) {
+        for (int row = 0; row < kDepth; row++) {
+            const size_t i = index(hash, row);
+            const int shift = i % 2 ? 4 : 0;
+            std::atomic<uint8_t>& pair = mCounters[i / 2];
+            uint8_t old = pair.load(std::memory_order_relaxed);
+            while (((old >> shift) & 0xf) == count) {
+                const uint8_t incremented = old + (1 << shift);
+                if (pair.compare_exchange_weak(old, incremented, std::memory_order_relaxed)) break;
+            }
+        }
+    }
+    if (mSamples.fetch_add(1, std::memory_order_relaxed) + 1 == mSampleSize) age();
+}
+
+uint8_t FrequencySketch::estimate(uint32_t hash) const {
+    uint8_t count = kMaxCount;
+    for (int row = 0; row < kDepth; row++) {
+        count = std::min(count, counter(index(hash, row)));
+    }
+    return count;
+}
+
+void FrequencySketch::age() {
+    for (size_t i = 0; i < mWidth * kDepth / 2; i++) {
+        // Both halves at once.
+        const uint8_t pair = mCounters[i].load(std::memory_order_relaxed);
+        mCounters[i].store((pair >> 1) & 0x77, std::memory_order_relaxed);
+    }
+    // Halving the counts halves the samples they're made of.
+    mSamples.fetch_sub(mSampleSize / 2, std::memory_order_relaxed);
+}
+
+}  // namespace android::net
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+namespace android::net {
+
+// Estimates how often each key was seen recently, in a few counters per expected key: a
+// count-min sketch whose 4-bit counters saturate at kMaxCount, and are all halved once
+// kSamplesPerKey times as many keys as it was sized for have been recorded, so that keys popular
+// a while ago fade out. This is the frequency filter of TinyLFU (Einziger et al., 2017), which the
+// DNS cache uses to choose between an incoming answer and the entry it would evict.
+//
+// Keys are hashes. Counts may be overestimated when keys collide, never underestimated except by
+// aging.
+//
+// record() and estimate() may be called concurrently. Updates racing with each other or with
+// aging may be lost, which only makes the estimates a little less accurate.
+class FrequencySketch {
+  public:
+    static constexpr uint8_t kMaxCount = 15;
+    static constexpr size_t kSamplesPerKey = 10;
+
+    // Sized for |capacity| keys.
+    explicit FrequencySketch(size_t capacity) { resize(capacity); }
+
+    // Forgets all the counts, and sizes the sketch for |capacity| keys. Not thread-safe.
+    void resize(size_t capacity);
+
+    void record(uint32_t hash);
+    // Returns how many times |hash| was recorded, up to kMaxCount, since counts were last halved.
+    uint8_t estimate(uint32_t hash) const;
+
+  private:
+    static constexpr int kDepth = 4;
+
+    // The index of the counter for |hash| in row |row|.
+    size_t index(uint32_t hash, int row) const;
+    uint8_t counter(size_t index) const;
+    void age();
+
+    // Two counters per byte, the even one in the low bits.
+    std::unique_ptr<std::atomic<uint8_t>[]> mCounters;
+    // Counters per row, a power of two.
+    size_t mWidth = 0;
+    size_t mSampleSize = 0;
+    std::atomic<size_t> mSamples = 0;
+};
+
+}  // namespace android::net
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "FrequencySketch.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class FrequencySketchTest : public ResolvTestBase {
+  protected:
+    static constexpr size_t kCapacity = 64;
+
+    FrequencySketch mSketch{kCapacity};
+};
+
+TEST_F(FrequencySketchTest, CountsEachKey) {
+    EXPECT_EQ(0, mSketch.estimate(1));
+    for (int i = 0; i < 3; i++) mSketch.record(1);
+    mSketch.record(2);
+    EXPECT_EQ(3, mSketch.estimate(1));
+    EXPECT_EQ(1, mSketch.estimate(2));
+    EXPECT_EQ(0, mSketch.estimate(3));
+}
+
+TEST_F(FrequencySketchTest, Saturates) {
+    for (int i = 0; i < 100; i++) mSketch.record(1);
+    EXPECT_EQ(FrequencySketch::kMaxCount, mSketch.estimate(1));
+}
+
+TEST_F(FrequencySketchTest, MostKeysDontCollide) {
+    // As many keys as the sketch is sized for, recorded once each, and one recorded many times.
+    for (uint32_t key = 0; key < kCapacity; key++) mSketch.record(key * 2654435761U);
+    for (int i = 0; i < 8; i++) mSketch.record(42);
+    int overestimated = 0;
+    for (uint32_t key = 0; key < kCapacity; key++) {
+        if (mSketch.estimate(key * 2654435761U) > 1) overestimated++;
+    }
+    EXPECT_LT(overestimated, static_cast<int>(kCapacity / 10));
+    EXPECT_EQ(8, mSketch.estimate(42));
+}
+
+TEST_F(FrequencySketchTest, AgesCounts) {
+    for (int i = 0; i < 10; i++) mSketch.record(1);
+    // Another key, until the counts are halved.
+    const size_t sampleSize = kCapacity * FrequencySketch::kSamplesPerKey;
+    for (size_t i = 0; i < sampleSize - 11; i++) mSketch.record(3);
+    EXPECT_EQ(10, mSketch.estimate(1));
+    EXPECT_EQ(FrequencySketch::kMaxCount, mSketch.estimate(3));
+    mSketch.record(2);
+    EXPECT_EQ(5, mSketch.estimate(1));
+    EXPECT_EQ(0, mSketch.estimate(2));
+    EXPECT_EQ(FrequencySketch::kMaxCount / 2, mSketch.estimate(3));
+
+    // And again once as many more have been recorded.
+    for (size_t i = 0; i < sampleSize / 2; i++) mSketch.record(3);
+    EXPECT_EQ(2, mSketch.estimate(1));
+}
+
+TEST_F(FrequencySketchTest, ResizeForgetsCounts) {
+    mSketch.record(1);
+    mSketch.resize(kCapacity * 4);
+    EXPECT_EQ(0, mSketch.estimate(1));
+    mSketch.record(1);
+    EXPECT_EQ(1, mSketch.estimate(1));
+}
+
+}  // namespace android::net
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "HeavyHitters.h"
+
+#include <algorithm>
+
+namespace android::net {
+
+void HeavyHitters::record(uint32_t hash, std::string_view key) {
+    if (mSampleEvery > 1) {
+        thread_local uint32_t tRecorded = 0;
+        if (++tRecorded % mSampleEvery != 0) return;
+    }
+    std::lock_guard guard(mMutex);
+    if (mCapacity == 0) return;
+    Counter* least = nullptr;
+    for (Counter& counter : mCounters) {
+        if (counter.hash == hash && counter.item.key == key) {
+            counter.item.count++;
+            return;
+        }
+        if (least == nullptr || counter.item.count < least->item.count) least = &counter;
+    }
+    if (mCounters.size() < mCapacity) {
+        mCounters.push_back({hash, {std::string(key), 1, 0}});
+        return;
+    }
+    // The new key may have been seen as often as the one it replaces.
+    least->hash = hash;
+    least->item.key.assign(key);
+    least->item.error = least->item.count;
+    least->item.count++;
+}
+
+std::vector<HeavyHitters::Item> HeavyHitters::top() const {
+    std::vector<Item> items;
+    {
+        std::lock_guard guard(mMutex);
+        items.reserve(mCounters.size());
+        for (const Counter& counter : mCounters) items.push_back(counter.item);
+    }
+    for (Item& item : items) {
+        item.count *= mSampleEvery;
+        item.error *= mSampleEvery;
+    }
+    std::stable_sort(items.begin(), items.end(),
+                     [](const Item& a, const Item& b) { return a.count > b.count; });
+    return items;
+}
+
+}  // namespace android::net
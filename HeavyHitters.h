@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Finds the keys seen most often, in as many counters as keys it's asked to find, with the
+// Space-Saving algorithm (Metwally et al., 2005): a key not counted yet takes over the counter of
+// the least seen one, and starts from its count. Any key seen more than 1/capacity of the times
+// is sure to be counted, and a count is too high by at most its error.
+//
+// Keys are compared by hash first, and their bytes only if the hashes match. Thread-safe.
+//
+// With a |sampleEvery| above 1, each thread only counts one in that many of the keys it records,
+// without taking the lock for the others, and counts are scaled back up by top().
+class HeavyHitters {
+  public:
+    struct Item {
+        std::string key;
+        uint64_t count;
+        // How much of |count| may have been seen for other keys.
+        uint64_t error;
+    };
+
+    explicit HeavyHitters(size_t capacity, uint32_t sampleEvery = 1)
+        : mCapacity(capacity), mSampleEvery(sampleEvery > 0 ? sampleEvery : 1) {}
+
+    void record(uint32_t hash, std::string_view key) EXCLUDES(mMutex);
+    // Returns the keys counted, most seen first.
+    std::vector<Item> top() const EXCLUDES(mMutex);
+
+  private:
+    struct Counter {
+        uint32_t hash;
+        Item item;
+    };
+
+    const size_t mCapacity;
+    const uint32_t mSampleEvery;
+    mutable std::mutex mMutex;
+    std::vector<Counter> mCounters GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "HeavyHitters.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class HeavyHittersTest : public ResolvTestBase {
+  protected:
+    static constexpr size_t kCapacity = 4;
+
+    void record(const std::string& key, int times = 1) {
+        for (int i = 0; i < times; i++) mHitters.record(std::hash<std::string>{}(key), key);
+    }
+
+    HeavyHitters mHitters{kCapacity};
+};
+
+TEST_F(HeavyHittersTest, CountsEachKey) {
+    EXPECT_TRUE(mHitters.top().empty());
+    record("b", 2);
+    record("a", 3);
+    record("c");
+    const auto top = mHitters.top();
+    ASSERT_EQ(3U, top.size());
+    EXPECT_EQ("a", top[0].key);
+    EXPECT_EQ(3U, top[0].count);
+    EXPECT_EQ("b", top[1].key);
+    EXPECT_EQ(2U, top[1].count);
+    EXPECT_EQ("c", top[2].key);
+    EXPECT_EQ(0U, top[2].error);
+}
+
+TEST_F(HeavyHittersTest, KeepsFrequentKeys) {
+    // Keys seen once each, interleaved with two seen far more often.
+    for (int i = 0; i < 100; i++) {
+        record("popular");
+        if (i % 2 == 0) record("common");
+        record("rare" + std::to_string(i));
+    }
+    const auto top = mHitters.top();
+    ASSERT_EQ(kCapacity, top.size());
+    EXPECT_EQ("popular", top[0].key);
+    EXPECT_EQ("common", top[1].key);
+    // Overestimated by less than its error.
+    EXPECT_GE(top[1].count, 50U);
+    EXPECT_LE(top[1].count - top[1].error, 50U);
+}
+
+TEST_F(HeavyHittersTest, TakesOverTheLeastSeen) {
+    record("a", 3);
+    record("b", 2);
+    record("c", 2);
+    record("d", 1);
+    // Full: "e" replaces "d", and is counted as if seen once more than it.
+    record("e");
+    const auto top = mHitters.top();
+    ASSERT_EQ(kCapacity, top.size());
+    EXPECT_EQ("e", top.back().key);
+    EXPECT_EQ(2U, top.back().count);
+    EXPECT_EQ(1U, top.back().error);
+}
+
+TEST_F(HeavyHittersTest, SampledCountsAreScaledUp) {
+    HeavyHitters sampled(kCapacity, 4);
+    for (int i = 0; i < 400; i++) sampled.record(std::hash<std::string>{}("a"), "a");
+    const auto top = sampled.top();
+    ASSERT_EQ(1U, top.size());
+    EXPECT_EQ("a", top[0].key);
+    EXPECT_EQ(400U, top[0].count);
+    EXPECT_EQ(0U, top[0].error);
+}
+
+}  // namespace android::net
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "HostsFile.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+namespace android::net {
+
+using android::base::unique_fd;
+
+namespace {
+
+constexpr std::string_view kBlanks = " \t";
+
+char lowercase(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+std::string addrKey(int family, const void* addr, size_t len) {
+    std::string key(1, static_cast<char>(family));
+    key.append(static_cast<const char*>(addr), len);
+    return key;
+}
+
+size_t addrLen(int family) {
+    return family == AF_INET6 ? sizeof(in6_addr) : sizeof(in_addr);
+}
+
+}  // namespace
+
+HostsFile::Table::Table(std::string_view contents) {
+    while (!contents.empty()) {
+        const size_t eol = contents.find('\n');
+        std::string_view line = contents.substr(0, eol);
+        // As fgets() leaves it: a last line without a newline can still end at a comment.
+        const bool terminated = eol != std::string_view::npos;
+        contents.remove_prefix(terminated ? eol + 1 : contents.size());
+
+        if (line.empty() || line[0] == '#') continue;
+        if (const size_t comment = line.find('#'); comment != std::string_view::npos) {
+            line = line.substr(0, comment);
+        } else if (!terminated) {
+            continue;
+        }
+        const size_t blank = line.find_first_of(kBlanks);
+        if (blank == std::string_view::npos) continue;
+
+        std::string address(line.substr(0, blank));
+        std::vector<std::string> names;
+        line.remove_prefix(blank);
+        while (!line.empty()) {
+            const size_t start = line.find_first_not_of(kBlanks);
+            if (start == std::string_view::npos) break;
+            line.remove_prefix(start);
+            const size_t end = std::min(line.find_first_of(kBlanks), line.size());
+            names.emplace_back(line.substr(0, end));
+            line.remove_prefix(end);
+        }
+        add(std::move(address), std::move(names));
+    }
+}
+
+void HostsFile::Table::add(std::string address, std::vector<std::string> names) {
+    Entry entry = {.address = std::move(address), .family = AF_UNSPEC, .names = std::move(names)};
+    if (inet_pton(AF_INET6, entry.address.c_str(), &entry.addr) > 0) {
+        entry.family = AF_INET6;
+    } else if (inet_pton(AF_INET, entry.address.c_str(), &entry.addr) > 0) {
+        entry.family = AF_INET;
+    }
+
+    const uint32_t index = mEntries.size();
+    for (const std::string& name : entry.names) {
+        std::vector<uint32_t>& lines = mByName[name];
+        // A name written twice on a line doesn't make it match twice.
+        if (lines.empty() || lines.back() != index) lines.push_back(index);
+    }
+    if (entry.family != AF_UNSPEC) {
+        mByAddr.try_emplace(addrKey(entry.family, &entry.addr, addrLen(entry.family)), index);
+    }
+    mEntries.push_back(std::move(entry));
+}
+
+size_t HostsFile::Table::memoryUsage() const {
+    // The names are counted once per line and once in the index, and each hash table node as
+    // its value and two pointers.
+    constexpr size_t kNodeOverhead = 2 * sizeof(void*);
+    size_t bytes = sizeof(*this) + mEntries.capacity() * sizeof(Entry);
+    for (const Entry& entry : mEntries) {
+        bytes += entry.address.capacity() + entry.names.capacity() * sizeof(std::string);
+        for (const std::string& name : entry.names) bytes += name.capacity();
+    }
+    for (const auto& [name, lines] : mByName) {
+        bytes += sizeof(std::pair<std::string, std::vector<uint32_t>>) + kNodeOverhead +
+                 name.capacity() + lines.capacity() * sizeof(uint32_t);
+    }
+    bytes += mByName.bucket_count() * sizeof(void*);
+    for (const auto& [key, _] : mByAddr) {
+        bytes += sizeof(std::pair<std::string, uint32_t>) + kNodeOverhead + key.capacity();
+    }
+    bytes += mByAddr.bucket_count() * sizeof(void*);
+    return bytes;
+}
+
+std::span<const uint32_t> HostsFile::Table::findByName(std::string_view name) const {
+    const auto it = mByName.find(name);
+    if (it == mByName.end()) return {};
+    return it->second;
+}
+
+const HostsFile::Entry* HostsFile::Table::findByAddr(int family, const void* addr,
+                                                     size_t len) const {
+    if ((family != AF_INET && family != AF_INET6) || len != addrLen(family)) return nullptr;
+    // Short enough for the small string optimization.
+    const auto it = mByAddr.find(addrKey(family, addr, len));
+    return it == mByAddr.end() ? nullptr : &mEntries[it->second];
+}
+
+size_t HostsFile::Table::CaseInsensitiveHash::operator()(std::string_view name) const {
+    // FNV-1a.
+    size_t hash = 2166136261U;
+    for (char c : name) hash = (hash ^ static_cast<uint8_t>(lowercase(c))) * 16777619U;
+    return hash;
+}
+
+bool HostsFile::Table::CaseInsensitiveEqual::operator()(std::string_view a,
+                                                         std::string_view b) const {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (lowercase(a[i]) != lowercase(b[i])) return false;
+    }
+    return true;
+}
+
+HostsFile& HostsFile::getInstance() {
+    static HostsFile instance(_PATH_HOSTS);
+    return instance;
+}
+
+std::shared_ptr<const HostsFile::Table> HostsFile::get() {
+    struct stat st;
+    const bool exists = stat(mPath.c_str(), &st) == 0;
+
+    std::lock_guard guard(mMutex);
+    if (!exists) {
+        mTable.reset();
+        return nullptr;
+    }
+    if (mTable && mVersion.dev == st.st_dev && mVersion.ino == st.st_ino &&
+        mVersion.size == st.st_size && mVersion.mtime.tv_sec == st.st_mtim.tv_sec &&
+        mVersion.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return mTable;
+    }
+    mTable = load(&mVersion);
+    return mTable;
+}
+
+std::shared_ptr<const HostsFile::Table> HostsFile::load(Version* version) const {
+    unique_fd fd(open(mPath.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (!fd.ok() || fstat(fd, &st) != 0) {
+        PLOG(WARNING) << __func__ << ": can't read " << mPath;
+        return nullptr;
+    }
+    // The version of what is parsed, not of what was found changed: it may have changed again.
+    *version = {.dev = st.st_dev, .ino = st.st_ino, .size = st.st_size, .mtime = st.st_mtim};
+    if (st.st_size == 0) return std::make_shared<Table>(std::string_view());
+
+    void* contents = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (contents == MAP_FAILED) {
+        PLOG(WARNING) << __func__ << ": can't map " << mPath;
+        return nullptr;
+    }
+    auto table = std::make_shared<Table>(
+            std::string_view(static_cast<const char*>(contents), st.st_size));
+    munmap(contents, st.st_size);
+    return table;
+}
+
+}  // namespace android::net
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// The hosts file, parsed once and indexed by name and by address. It's parsed again only when
+// the file is replaced or modified, which stat() tells without reading it. This class is
+// thread-safe.
+//
+// Its Table also holds the customized hosts of a network, see ResolverOptionsParcel.hosts.
+class HostsFile {
+  public:
+    // A line of the file.
+    struct Entry {
+        // The address as written, which getaddrinfo_numeric() parses with the hints it's given.
+        std::string address;
+        // AF_INET or AF_INET6 if |address| is a plain address in |addr|, else AF_UNSPEC.
+        int family;
+        in6_addr addr;
+        // The official name, then the aliases.
+        std::vector<std::string> names;
+    };
+
+    // An index of lines, immutable once shared. Lookups don't allocate.
+    class Table {
+      public:
+        Table() = default;
+        // Parses the contents of a hosts file.
+        explicit Table(std::string_view contents);
+
+        // Adds a line, parsing |address|.
+        void add(std::string address, std::vector<std::string> names);
+
+        // Returns the indices of the lines naming |name|, ignoring case, in order.
+        std::span<const uint32_t> findByName(std::string_view name) const;
+        // Returns the first line for address |addr| of |family|, or nullptr if there's none.
+        const Entry* findByAddr(int family, const void* addr, size_t len) const;
+
+        const Entry& entry(uint32_t index) const { return mEntries[index]; }
+        size_t size() const { return mEntries.size(); }
+        // Approximate bytes of memory the table holds.
+        size_t memoryUsage() const;
+
+      private:
+        struct CaseInsensitiveHash {
+            using is_transparent = void;
+            size_t operator()(std::string_view name) const;
+        };
+        struct CaseInsensitiveEqual {
+            using is_transparent = void;
+            bool operator()(std::string_view a, std::string_view b) const;
+        };
+
+        std::vector<Entry> mEntries;
+        // By name and by family and address bytes, the indices of the lines.
+        std::unordered_map<std::string, std::vector<uint32_t>, CaseInsensitiveHash,
+                           CaseInsensitiveEqual>
+                mByName;
+        std::unordered_map<std::string, uint32_t> mByAddr;
+    };
+
+    explicit HostsFile(std::string path) : mPath(std::move(path)) {}
+
+    // Returns the system hosts file, _PATH_HOSTS.
+    static HostsFile& getInstance();
+
+    // Returns the index of the file as it is now, or nullptr if it can't be read.
+    std::shared_ptr<const Table> get() EXCLUDES(mMutex);
+
+  private:
+    // What tells whether the file changed since it was last parsed.
+    struct Version {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        timespec mtime;
+    };
+
+    std::shared_ptr<const Table> load(Version* version) const;
+
+    const std::string mPath;
+    std::mutex mMutex;
+    Version mVersion GUARDED_BY(mMutex) = {};
+    std::shared_ptr<const Table> mTable GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
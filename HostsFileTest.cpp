@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "HostsFile.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using android::base::TemporaryDir;
+using android::base::WriteStringToFile;
+
+class HostsFileTest : public ResolvTestBase {
+  protected:
+    static std::vector<std::string> addresses(const HostsFile::Table& table,
+                                              std::span<const uint32_t> indices) {
+        std::vector<std::string> result;
+        for (uint32_t index : indices) result.push_back(table.entry(index).address);
+        return result;
+    }
+};
+
+TEST_F(HostsFileTest, Parse) {
+    const HostsFile::Table table(
+            "# comment\n"
+            "127.0.0.1 localhost\n"
+            "::1\tlocalhost ip6-localhost  # loopback\n"
+            "\n"
+            "1.2.3.4\n"
+            "fe80::1%wlan0 LinkLocal\n"
+            "not-an-address bogus\n"
+            "5.6.7.8 Hello hello.example.com hello\n"
+            "9.9.9.9 unterminated");
+
+    EXPECT_EQ((std::vector<std::string>{"127.0.0.1", "::1"}),
+              addresses(table, table.findByName("localhost")));
+    EXPECT_EQ(std::vector<std::string>{"::1"},
+              addresses(table, table.findByName("IP6-LOCALHOST")));
+    // Lines whose address only getaddrinfo_numeric() parses still name their hosts.
+    const auto linkLocal = table.findByName("linklocal");
+    ASSERT_EQ(1U, linkLocal.size());
+    EXPECT_EQ(AF_UNSPEC, table.entry(linkLocal[0]).family);
+    EXPECT_EQ(1U, table.findByName("bogus").size());
+    // A name written twice on a line matches it once.
+    const auto hello = table.findByName("hello");
+    ASSERT_EQ(1U, hello.size());
+    EXPECT_EQ((std::vector<std::string>{"Hello", "hello.example.com", "hello"}),
+              table.entry(hello[0]).names);
+    EXPECT_TRUE(table.findByName("unterminated").empty());
+    EXPECT_TRUE(table.findByName("#").empty());
+    EXPECT_TRUE(table.findByName("loopback").empty());
+}
+
+TEST_F(HostsFileTest, Add) {
+    HostsFile::Table table;
+    table.add("1.2.3.4", {"v4v6.example.com."});
+    table.add("::1.2.3.4", {"v4v6.example.com."});
+    table.add("wrong IP", {"invalid.example.com."});
+
+    EXPECT_EQ((std::vector<std::string>{"1.2.3.4", "::1.2.3.4"}),
+              addresses(table, table.findByName("V4V6.example.com.")));
+    EXPECT_TRUE(table.findByName("v4v6.example.com").empty());
+    const auto invalid = table.findByName("invalid.example.com.");
+    ASSERT_EQ(1U, invalid.size());
+    EXPECT_EQ(AF_UNSPEC, table.entry(invalid[0]).family);
+}
+
+TEST_F(HostsFileTest, FindByAddr) {
+    const HostsFile::Table table(
+            "1.2.3.4 first\n"
+            "1.2.3.4 second\n"
+            "::1.2.3.4 mapped\n");
+
+    in_addr v4;
+    ASSERT_EQ(1, inet_pton(AF_INET, "1.2.3.4", &v4));
+    const HostsFile::Entry* entry = table.findByAddr(AF_INET, &v4, sizeof(v4));
+    ASSERT_NE(nullptr, entry);
+    EXPECT_EQ(std::vector<std::string>{"first"}, entry->names);
+    EXPECT_EQ(nullptr, table.findByAddr(AF_INET, &v4, sizeof(in6_addr)));
+
+    in6_addr v6;
+    ASSERT_EQ(1, inet_pton(AF_INET6, "::1.2.3.4", &v6));
+    entry = table.findByAddr(AF_INET6, &v6, sizeof(v6));
+    ASSERT_NE(nullptr, entry);
+    EXPECT_EQ(std::vector<std::string>{"mapped"}, entry->names);
+    ASSERT_EQ(1, inet_pton(AF_INET6, "::1", &v6));
+    EXPECT_EQ(nullptr, table.findByAddr(AF_INET6, &v6, sizeof(v6)));
+}
+
+TEST_F(HostsFileTest, ReloadsOnChange) {
+    TemporaryDir dir;
+    const std::string path = std::string(dir.path) + "/hosts";
+    HostsFile hostsFile(path);
+    EXPECT_EQ(nullptr, hostsFile.get());
+
+    ASSERT_TRUE(WriteStringToFile("1.2.3.4 a\n", path));
+    const auto table = hostsFile.get();
+    ASSERT_NE(nullptr, table);
+    EXPECT_EQ(1U, table->findByName("a").size());
+    // Unchanged, the file isn't parsed again.
+    EXPECT_EQ(table, hostsFile.get());
+
+    // Replaced by a file of the same size, which may well have the same mtime.
+    const std::string newPath = path + ".new";
+    ASSERT_TRUE(WriteStringToFile("1.2.3.4 b\n", newPath));
+    ASSERT_EQ(0, rename(newPath.c_str(), path.c_str()));
+    const auto replaced = hostsFile.get();
+    ASSERT_NE(nullptr, replaced);
+    EXPECT_TRUE(replaced->findByName("a").empty());
+    EXPECT_EQ(1U, replaced->findByName("b").size());
+
+    // Rewritten in place.
+    ASSERT_TRUE(WriteStringToFile("1.2.3.4 b\n5.6.7.8 c\n", path));
+    const auto rewritten = hostsFile.get();
+    ASSERT_NE(nullptr, rewritten);
+    EXPECT_EQ(1U, rewritten->findByName("c").size());
+
+    ASSERT_EQ(0, unlink(path.c_str()));
+    EXPECT_EQ(nullptr, hostsFile.get());
+}
+
+}  // namespace android::net
@@ -18,8 +18,10 @@
 #define _DNS_LOCKED_QUEUE_H
 
 #include <algorithm>
+#include <atomic>
 #include <deque>
 #include <mutex>
+#include <utility>
 
 #include <android-base/thread_annotations.h>
 
@@ -46,6 +48,55 @@ class LockedQueue {
     std::deque<T> mQueue GUARDED_BY(mLock);
 };
 
+// A lock-free alternative to LockedQueue for many producers and a single consumer. Items are
+// linked into a stack, which swap() takes whole, so it sees them newest first as LockedQueue does.
+template <typename T>
+class MpscQueue {
+  public:
+    MpscQueue() = default;
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    ~MpscQueue() { deleteList(mHead.load(std::memory_order_acquire)); }
+
+    // Push an item onto the queue. Returns true if the queue was empty, i.e. the consumer has
+    // taken every earlier item and must be told about this one; when it returns false, whoever
+    // pushed onto the empty queue has already told it.
+    bool push(T item) {
+        Node* const node = new Node{std::move(item), nullptr};
+        Node* head = mHead.load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while (!mHead.compare_exchange_weak(head, node, std::memory_order_release,
+                                              std::memory_order_relaxed));
+        // Not node->next: the consumer may already have taken and freed the node.
+        return head == nullptr;
+    }
+
+    // Replace the contents of |other| with the contents of the queue, leaving it empty.
+    void swap(std::deque<T>& other) {
+        other.clear();
+        Node* node = mHead.exchange(nullptr, std::memory_order_acquire);
+        while (node != nullptr) {
+            other.push_back(std::move(node->item));
+            delete std::exchange(node, node->next);
+        }
+    }
+
+  private:
+    struct Node {
+        T item;
+        Node* next;
+    };
+
+    static void deleteList(Node* node) {
+        while (node != nullptr) delete std::exchange(node, node->next);
+    }
+
+    // Newest first. Only push() adds nodes and only swap() removes them, all at once, so the
+    // compare-and-swap in push() can't be fooled by a node being freed and reused (ABA).
+    std::atomic<Node*> mHead = nullptr;
+};
+
 template <typename T>
 class LockedRingBuffer {
   public:
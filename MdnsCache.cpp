@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "MdnsCache.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include <android-base/logging.h>
+
+#include "DnsMessageIndex.h"
+#include "Experiments.h"
+
+namespace android::net {
+
+using base::unique_fd;
+using std::chrono::ceil;
+using std::chrono::seconds;
+
+namespace {
+
+constexpr int kMaxEvents = 16;
+constexpr uint16_t kMdnsPort = 5353;
+// RFC 6762 section 17: mDNS messages may be as large as a jumbo frame allows.
+constexpr size_t kMaxPacketSize = 9000;
+// The top bit of the class of a record, which mDNS uses as its cache-flush bit (RFC 6762 section
+// 10.2). In questions it's the unicast-response bit instead.
+constexpr uint16_t kCacheFlushBit = 0x8000;
+// How long records superseded by a cache-flush record or a goodbye are still answered with.
+constexpr auto kFlushDelay = seconds(1);
+
+// The mDNS group of |family|, on interface |ifindex| for IPv6.
+sockaddr_storage groupAddress(int family, int ifindex) {
+    sockaddr_storage ss = {};
+    if (family == AF_INET) {
+        auto& sin = reinterpret_cast<sockaddr_in&>(ss);
+        sin = {.sin_family = AF_INET, .sin_port = htons(kMdnsPort)};
+        inet_pton(AF_INET, "224.0.0.251", &sin.sin_addr);
+    } else {
+        auto& sin6 = reinterpret_cast<sockaddr_in6&>(ss);
+        sin6 = {.sin6_family = AF_INET6,
+                .sin6_port = htons(kMdnsPort),
+                .sin6_scope_id = static_cast<uint32_t>(ifindex)};
+        inet_pton(AF_INET6, "ff02::fb", &sin6.sin6_addr);
+    }
+    return ss;
+}
+
+socklen_t addressSize(int family) {
+    return family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+}
+
+std::span<const uint8_t> addressBytes(const sockaddr* sa) {
+    if (sa->sa_family == AF_INET) {
+        const auto& addr = reinterpret_cast<const sockaddr_in*>(sa)->sin_addr;
+        return {reinterpret_cast<const uint8_t*>(&addr), sizeof(addr)};
+    }
+    const auto& addr = reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr;
+    return {reinterpret_cast<const uint8_t*>(&addr), sizeof(addr)};
+}
+
+// Finds the interface that the sockets marked with |mark| send to the mDNS group of |family|
+// through, which is the interface of the network they belong to. Returns its name, or "".
+std::string findInterface(int family, uint32_t mark, MdnsCache::Interface* iface) {
+    unique_fd fd(socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+    const sockaddr_storage group = groupAddress(family, 0);
+    sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    if (!fd.ok() || setsockopt(fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) != 0 ||
+        connect(fd, reinterpret_cast<const sockaddr*>(&group), addressSize(family)) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&local), &len) != 0) {
+        return "";
+    }
+
+    // The interface that has the source address of the route.
+    ifaddrs* addrs;
+    if (getifaddrs(&addrs) != 0) return "";
+    std::string name;
+    for (const ifaddrs* ifa = addrs; ifa != nullptr; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == nullptr || ifa->ifa_netmask == nullptr ||
+            ifa->ifa_addr->sa_family != family ||
+            !std::ranges::equal(addressBytes(ifa->ifa_addr),
+                                addressBytes(reinterpret_cast<const sockaddr*>(&local)))) {
+            continue;
+        }
+        iface->ifindex = if_nametoindex(ifa->ifa_name);
+        std::memcpy(&iface->addr, ifa->ifa_addr, addressSize(family));
+        std::memcpy(&iface->netmask, ifa->ifa_netmask, addressSize(family));
+        if (iface->ifindex != 0) name = ifa->ifa_name;
+        break;
+    }
+    freeifaddrs(addrs);
+    return name;
+}
+
+// Binds a socket of |family| to the mDNS group of that family on interface |name| alone, and joins
+// the group on it. The group address is bound rather than the wildcard one, so that unicast
+// datagrams sent to the mDNS port of the device still all go to the mDNS stack that owns it.
+unique_fd openListeningSocket(int family, const std::string& name, int ifindex, uint32_t mark) {
+    unique_fd fd(socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    if (!fd.ok()) return {};
+
+    const int on = 1;
+    const int off = 0;
+    // Other mDNS stacks on the device have the port bound too, and all get the multicast
+    // datagrams.
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, name.c_str(), name.size() + 1) != 0) {
+        return {};
+    }
+
+    const sockaddr_storage group = groupAddress(family, ifindex);
+    const auto* addr = reinterpret_cast<const sockaddr*>(&group);
+    if (family == AF_INET) {
+        ip_mreqn mreq = {.imr_multiaddr = reinterpret_cast<const sockaddr_in&>(group).sin_addr,
+                         .imr_ifindex = ifindex};
+        // Only datagrams sent to the groups joined on this socket, not those joined by others.
+        if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off)) != 0 ||
+            setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) != 0 ||
+            setsockopt(fd, IPPROTO_IP, IP_RECVTTL, &on, sizeof(on)) != 0 ||
+            bind(fd, addr, sizeof(sockaddr_in)) != 0 ||
+            setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+            return {};
+        }
+    } else {
+        const auto& sin6 = reinterpret_cast<const sockaddr_in6&>(group);
+        ipv6_mreq mreq = {.ipv6mr_multiaddr = sin6.sin6_addr,
+                          .ipv6mr_interface = static_cast<unsigned>(ifindex)};
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) != 0 ||
+            setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_ALL, &off, sizeof(off)) != 0 ||
+            setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)) != 0 ||
+            setsockopt(fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on)) != 0 ||
+            bind(fd, addr, sizeof(sockaddr_in6)) != 0 ||
+            setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) != 0) {
+            return {};
+        }
+    }
+    return fd;
+}
+
+// The interface |msg| was received on, or kUnknownInterface, and its IP TTL or hop limit, or -1.
+struct ReceiveInfo {
+    int ifindex = MdnsCache::kUnknownInterface;
+    int hopLimit = -1;
+};
+
+ReceiveInfo receiveInfo(msghdr* msg) {
+    ReceiveInfo info;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            info.ifindex = reinterpret_cast<const in_pktinfo*>(CMSG_DATA(cmsg))->ipi_ifindex;
+        } else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+            info.ifindex = reinterpret_cast<const in6_pktinfo*>(CMSG_DATA(cmsg))->ipi6_ifindex;
+        } else if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TTL) ||
+                   (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT)) {
+            std::memcpy(&info.hopLimit, CMSG_DATA(cmsg), sizeof(info.hopLimit));
+        }
+    }
+    return info;
+}
+
+// Whether |from| is on the link of |iface|: an IPv6 link-local address, or an address in the
+// subnet of the interface.
+bool isOnLink(const sockaddr_storage& from, const MdnsCache::Interface& iface) {
+    const auto* sa = reinterpret_cast<const sockaddr*>(&from);
+    if (sa->sa_family != iface.addr.ss_family) return false;
+    if (sa->sa_family == AF_INET6 &&
+        IN6_IS_ADDR_LINKLOCAL(&reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr)) {
+        return true;
+    }
+    const std::span<const uint8_t> src = addressBytes(sa);
+    const std::span<const uint8_t> addr =
+            addressBytes(reinterpret_cast<const sockaddr*>(&iface.addr));
+    const std::span<const uint8_t> mask =
+            addressBytes(reinterpret_cast<const sockaddr*>(&iface.netmask));
+    for (size_t i = 0; i < src.size(); i++) {
+        if ((src[i] & mask[i]) != (addr[i] & mask[i])) return false;
+    }
+    return true;
+}
+
+uint16_t sourcePort(const sockaddr_storage& from) {
+    if (from.ss_family == AF_INET) {
+        return ntohs(reinterpret_cast<const sockaddr_in&>(from).sin_port);
+    }
+    return ntohs(reinterpret_cast<const sockaddr_in6&>(from).sin6_port);
+}
+
+// Names are compared ignoring ASCII case (RFC 6762 section 16).
+std::string toLower(std::string name) {
+    std::ranges::transform(name, name.begin(), [](unsigned char c) { return std::tolower(c); });
+    return name;
+}
+
+void put16(std::span<uint8_t> buf, size_t offset, uint16_t value) {
+    buf[offset] = value >> 8;
+    buf[offset + 1] = value & 0xff;
+}
+
+}  // namespace
+
+MdnsCache::MdnsCache()
+    : mEpollFd(epoll_create1(EPOLL_CLOEXEC)), mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = mEventFd.get()}};
+    if (!mEpollFd.ok() || !mEventFd.ok() ||
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mEventFd, &event) != 0) {
+        PLOG(ERROR) << __func__ << ": failed to set up epoll";
+        mEpollFd.reset();
+    }
+}
+
+MdnsCache::~MdnsCache() {
+    std::thread thread;
+    {
+        std::lock_guard guard(mMutex);
+        mStopping = true;
+        thread.swap(mThread);
+    }
+    if (thread.joinable()) {
+        eventfd_write(mEventFd, 1);
+        thread.join();
+    }
+}
+
+bool MdnsCache::isEnabled() {
+    return Experiments::getInstance()->getFlag("mdns_cache", 0) == 1;
+}
+
+bool MdnsCache::listen(unsigned netid, uint32_t mark) {
+    std::lock_guard guard(mMutex);
+    Network& network = mNetworks[netid];
+    if (network.listenTried) return !network.interfaces.empty();
+    network.listenTried = true;
+    if (!mEpollFd.ok()) return false;
+
+    for (int family : {AF_INET, AF_INET6}) {
+        Interface iface;
+        const std::string name = findInterface(family, mark, &iface);
+        if (name.empty()) continue;
+        iface.socket = openListeningSocket(family, name, iface.ifindex, mark);
+        epoll_event event = {.events = EPOLLIN, .data = {.fd = iface.socket.get()}};
+        if (!iface.socket.ok() || epoll_ctl(mEpollFd, EPOLL_CTL_ADD, iface.socket, &event) != 0) {
+            PLOG(WARNING) << __func__ << ": netid " << netid << ": can't listen for mDNS over "
+                          << (family == AF_INET ? "IPv4" : "IPv6") << " on " << name;
+            continue;
+        }
+        mSocketNetworks[iface.socket.get()] = netid;
+        network.interfaces.push_back(std::move(iface));
+    }
+    if (network.interfaces.empty()) return false;
+    if (!mThread.joinable()) mThread = std::thread(&MdnsCache::loop, this);
+    LOG(INFO) << __func__ << ": netid " << netid << ": listening for mDNS on "
+              << network.interfaces.size() << " sockets";
+    return true;
+}
+
+void MdnsCache::clear(unsigned netid) {
+    std::lock_guard guard(mMutex);
+    const auto it = mNetworks.find(netid);
+    if (it == mNetworks.end()) return;
+    // The loop only reads sockets with the lock held, so none of these is being read.
+    for (const Interface& iface : it->second.interfaces) {
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, iface.socket, nullptr);
+        mSocketNetworks.erase(iface.socket.get());
+    }
+    mNetworks.erase(it);
+}
+
+void MdnsCache::absorb(unsigned netid, int ifindex, std::span<const uint8_t> packet,
+                       clock::time_point now) {
+    std::lock_guard guard(mMutex);
+    absorbLocked(mNetworks[netid], ifindex, packet, now);
+}
+
+void MdnsCache::absorbLocked(Network& network, int ifindex, std::span<const uint8_t> packet,
+                             clock::time_point now) {
+    DnsMessageIndex index;
+    if (!index.parse(packet) || !index.getFlag(ns_f_qr) || index.getFlag(ns_f_opcode) != 0 ||
+        index.getFlag(ns_f_rcode) != ns_r_noerror) {
+        return;
+    }
+    expire(network, now);
+
+    // RFC 6762 section 6: responders put the records they announce in any of the sections.
+    for (ns_sect sect : {ns_s_an, ns_s_ns, ns_s_ar}) {
+        for (const DnsMessageIndex::Record& rr : index.section(sect)) {
+            if ((rr.rclass & ~kCacheFlushBit) != ns_c_in) continue;
+            if (!(rr.type == ns_t_a && rr.rdlen == NS_INADDRSZ) &&
+                !(rr.type == ns_t_aaaa && rr.rdlen == NS_IN6ADDRSZ)) {
+                continue;
+            }
+            char name[NS_MAXDNAME];
+            if (!index.expandName(rr.nameOffset, name, sizeof(name))) continue;
+            const std::span<const uint8_t> rdata = index.rdata(rr);
+            const auto same = [&](const Record& r) {
+                return r.ifindex == ifindex && std::ranges::equal(r.rdata, rdata);
+            };
+
+            auto& records = network.records[{toLower(name), rr.type}];
+            if (rr.ttl == 0) {
+                // A goodbye: the record stays for a second, in case another host still has it.
+                for (Record& r : records) {
+                    if (same(r)) r.expiry = std::min(r.expiry, now + kFlushDelay);
+                }
+                continue;
+            }
+            if (rr.rclass & kCacheFlushBit) {
+                // Records heard in the last second are part of the same announcement.
+                for (Record& r : records) {
+                    if (r.ifindex == ifindex && r.received < now - kFlushDelay && !same(r)) {
+                        r.expiry = std::min(r.expiry, now + kFlushDelay);
+                    }
+                }
+            }
+            const auto existing = std::ranges::find_if(records, same);
+            if (existing != records.end()) {
+                existing->received = now;
+                existing->expiry = now + seconds(rr.ttl);
+            } else if (network.count < kMaxRecordsPerNetwork) {
+                records.push_back({.ifindex = ifindex,
+                                   .rdata = {rdata.begin(), rdata.end()},
+                                   .received = now,
+                                   .expiry = now + seconds(rr.ttl)});
+                network.count++;
+            }
+        }
+    }
+}
+
+void MdnsCache::expire(Network& network, clock::time_point now) {
+    for (auto it = network.records.begin(); it != network.records.end();) {
+        network.count -=
+                std::erase_if(it->second, [now](const Record& r) { return r.expiry <= now; });
+        it = it->second.empty() ? network.records.erase(it) : std::next(it);
+    }
+}
+
+int MdnsCache::lookup(unsigned netid, std::span<const uint8_t> query, std::span<uint8_t> ans,
+                      clock::time_point now) {
+    DnsMessageIndex index;
+    if (!index.parse(query) || index.section(ns_s_qd).size() != 1) return 0;
+    const DnsMessageIndex::Record& question = index.section(ns_s_qd).front();
+    if ((question.rclass & ~kCacheFlushBit) != ns_c_in) return 0;
+    char name[NS_MAXDNAME];
+    if (!index.expandName(question.nameOffset, name, sizeof(name))) return 0;
+
+    std::lock_guard guard(mMutex);
+    const auto network = mNetworks.find(netid);
+    if (network == mNetworks.end()) return 0;
+    expire(network->second, now);
+    const auto it = network->second.records.find({toLower(name), question.type});
+    if (it == network->second.records.end()) return 0;
+
+    // The header and question of the query, then a record for each address, named with a pointer
+    // to the question.
+    const size_t questionEnd = question.rdataOffset;
+    if (ans.size() < questionEnd) return 0;
+    std::copy(query.begin(), query.begin() + questionEnd, ans.begin());
+    size_t len = questionEnd;
+    std::vector<const Record*> answered;
+    for (const Record& r : it->second) {
+        // The same address may have been heard on several interfaces.
+        if (std::ranges::any_of(answered, [&](const Record* a) { return a->rdata == r.rdata; })) {
+            continue;
+        }
+        const size_t rrlen = NS_INT16SZ * 4 + NS_INT32SZ + r.rdata.size();
+        if (len + rrlen > ans.size()) break;
+        const auto ttl = static_cast<uint32_t>(ceil<seconds>(r.expiry - now).count());
+        put16(ans, len, NS_CMPRSFLGS << 8 | NS_HFIXEDSZ);
+        put16(ans, len + 2, question.type);
+        put16(ans, len + 4, ns_c_in);
+        put16(ans, len + 6, ttl >> 16);
+        put16(ans, len + 8, ttl & 0xffff);
+        put16(ans, len + 10, r.rdata.size());
+        std::copy(r.rdata.begin(), r.rdata.end(), ans.begin() + len + 12);
+        len += rrlen;
+        answered.push_back(&r);
+    }
+    if (answered.empty()) return 0;
+
+    HEADER* hp = reinterpret_cast<HEADER*>(ans.data());
+    hp->qr = 1;
+    hp->aa = 1;
+    hp->tc = 0;
+    hp->ra = 0;
+    hp->rcode = ns_r_noerror;
+    hp->ancount = htons(answered.size());
+    hp->nscount = 0;
+    hp->arcount = 0;
+    return len;
+}
+
+size_t MdnsCache::size(unsigned netid) const {
+    std::lock_guard guard(mMutex);
+    const auto it = mNetworks.find(netid);
+    return it == mNetworks.end() ? 0 : it->second.count;
+}
+
+void MdnsCache::loop() {
+    epoll_event events[kMaxEvents];
+    std::vector<uint8_t> buf(kMaxPacketSize);
+    while (true) {
+        const int n = epoll_wait(mEpollFd, events, kMaxEvents, -1);
+        if (n < 0 && errno != EINTR) {
+            PLOG(ERROR) << __func__ << ": epoll_wait";
+            return;
+        }
+        std::lock_guard guard(mMutex);
+        if (mStopping) return;
+        for (int i = 0; i < n; i++) {
+            const int fd = events[i].data.fd;
+            const auto it = mSocketNetworks.find(fd);
+            // The eventfd, or a network that was cleared since.
+            if (it == mSocketNetworks.end()) continue;
+            drainLocked(fd, it->second, buf);
+        }
+    }
+}
+
+void MdnsCache::drainLocked(int fd, unsigned netid, std::vector<uint8_t>& buf) {
+    Network& network = mNetworks[netid];
+    const auto iface = std::ranges::find(network.interfaces, fd,
+                                         [](const Interface& i) { return i.socket.get(); });
+    if (iface == network.interfaces.end()) return;
+    while (true) {
+        sockaddr_storage from;
+        iovec iov = {.iov_base = buf.data(), .iov_len = buf.size()};
+        alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(in6_pktinfo)) + CMSG_SPACE(sizeof(int))];
+        msghdr msg = {.msg_name = &from,
+                      .msg_namelen = sizeof(from),
+                      .msg_iov = &iov,
+                      .msg_iovlen = 1,
+                      .msg_control = control,
+                      .msg_controllen = sizeof(control)};
+        const ssize_t len = recvmsg(fd, &msg, MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                PLOG(WARNING) << __func__ << ": netid " << netid << ": recvmsg";
+            }
+            if (errno != EINTR) return;
+            continue;
+        }
+        // RFC 6762 section 6: multicast responses not sent from the mDNS port are ignored.
+        if (msg.msg_flags & MSG_TRUNC || sourcePort(from) != kMdnsPort) continue;
+        // Only responses heard on the interface of the network, from a responder on its link
+        // (RFC 6762 section 11): sent with a TTL of 255, or from an on-link address.
+        const ReceiveInfo info = receiveInfo(&msg);
+        if (info.ifindex != iface->ifindex) continue;
+        if (info.hopLimit != 255 && !isOnLink(from, *iface)) continue;
+        absorbLocked(network, info.ifindex, {buf.data(), static_cast<size_t>(len)}, clock::now());
+    }
+}
+
+}  // namespace android::net
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+
+namespace android::net {
+
+// The A and AAAA records that mDNS responders on a network announce, kept for as long as their
+// TTLs say. Once a network has been listened on, a thread of its own reads every response sent to
+// the mDNS groups on the interface of the network, solicited or not, so that repeat lookups of
+// .local names are answered without another multicast round trip. Responses from off the link are
+// ignored (RFC 6762 section 11). Records are kept per interface they were heard on: a record with
+// the cache-flush bit set replaces those of its name and type heard on the same interface more
+// than a second before (RFC 6762 section 10.2), and a record with TTL 0 is a goodbye that expires
+// its match a second later (section 10.1). This class is thread-safe.
+class MdnsCache {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // The interface of records that weren't heard on the listening sockets, such as the answers to
+    // queries sent by send_mdns().
+    static constexpr int kUnknownInterface = 0;
+    // Records kept per network. Records of new names are ignored beyond that.
+    static constexpr size_t kMaxRecordsPerNetwork = 256;
+
+    MdnsCache();
+    ~MdnsCache();
+
+    static MdnsCache& getInstance() {
+        static MdnsCache instance;
+        return instance;
+    }
+
+    static bool isEnabled();
+
+    // Joins the mDNS groups on network |netid|, with sockets marked with |mark|, unless that was
+    // already tried since the network was last cleared. Returns whether the network is listened
+    // on.
+    bool listen(unsigned netid, uint32_t mark) EXCLUDES(mMutex);
+    // Stops listening on network |netid|, and forgets its records.
+    void clear(unsigned netid) EXCLUDES(mMutex);
+
+    // Keeps the A and AAAA records of mDNS response |packet|, heard on interface |ifindex| of
+    // network |netid|. Anything that isn't a successful response is ignored.
+    void absorb(unsigned netid, int ifindex, std::span<const uint8_t> packet,
+                clock::time_point now = clock::now()) EXCLUDES(mMutex);
+
+    // Answers |query| from the records of network |netid| heard on any of its interfaces, with
+    // the TTLs they have left. Returns the length of the answer written to |ans|, or 0 if there's
+    // no record for it. Records that don't fit in |ans| are left out.
+    int lookup(unsigned netid, std::span<const uint8_t> query, std::span<uint8_t> ans,
+               clock::time_point now = clock::now()) EXCLUDES(mMutex);
+
+    // The number of records kept for network |netid|, expired or not.
+    size_t size(unsigned netid) const EXCLUDES(mMutex);
+
+    // An interface that a network's mDNS group of a family is listened to on.
+    struct Interface {
+        base::unique_fd socket;
+        int ifindex = kUnknownInterface;
+        // The address the network has on the interface, and its netmask, to tell on-link sources.
+        sockaddr_storage addr = {};
+        sockaddr_storage netmask = {};
+    };
+
+  private:
+    struct Record {
+        int ifindex;
+        std::vector<uint8_t> rdata;
+        clock::time_point received;
+        clock::time_point expiry;
+    };
+    // Owner name, lower case and without the trailing dot, and type.
+    using Key = std::pair<std::string, uint16_t>;
+
+    struct Network {
+        // For IPv4 and IPv6. Either may be missing if the network has no route for its family.
+        std::vector<Interface> interfaces;
+        bool listenTried = false;
+        std::map<Key, std::vector<Record>> records;
+        size_t count = 0;
+    };
+
+    void loop() EXCLUDES(mMutex);
+    // Reads the datagrams waiting on |fd| until there's none left.
+    void drainLocked(int fd, unsigned netid, std::vector<uint8_t>& buf) REQUIRES(mMutex);
+    void absorbLocked(Network& network, int ifindex, std::span<const uint8_t> packet,
+                      clock::time_point now) REQUIRES(mMutex);
+    // Drops the records of |network| that have expired.
+    static void expire(Network& network, clock::time_point now);
+
+    base::unique_fd mEpollFd;
+    base::unique_fd mEventFd;
+    mutable std::mutex mMutex;
+    std::map<unsigned, Network> mNetworks GUARDED_BY(mMutex);
+    // The network of each listening socket.
+    std::map<int, unsigned> mSocketNetworks GUARDED_BY(mMutex);
+    bool mStopping GUARDED_BY(mMutex) = false;
+    // Started by the first listen().
+    std::thread mThread GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/nameser.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsMessageIndex.h"
+#include "MdnsCache.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+class MdnsCacheTest : public ResolvTestBase {
+  protected:
+    using Addrs = std::vector<std::vector<uint8_t>>;
+
+    static constexpr unsigned kNetId = 30;
+    static constexpr int kWlan = 10;
+    static constexpr int kEth = 11;
+    static constexpr uint16_t kCacheFlush = 0x8000;
+
+    // "printer.local" in wire format.
+    static inline const std::string kPrinter = std::string("\7printer\5local\0", 15);
+    static inline const std::vector<uint8_t> kAddr1 = {192, 168, 1, 10};
+    static inline const std::vector<uint8_t> kAddr2 = {192, 168, 1, 11};
+
+    struct Message {
+        std::vector<uint8_t> bytes = std::vector<uint8_t>(NS_HFIXEDSZ);
+
+        Message& header(uint16_t flags, uint16_t qd, uint16_t an) {
+            put(2, flags);
+            put(4, qd);
+            put(6, an);
+            return *this;
+        }
+        void put(size_t offset, uint16_t value) {
+            bytes[offset] = value >> 8;
+            bytes[offset + 1] = value & 0xff;
+        }
+        Message& put16(uint16_t value) {
+            bytes.push_back(value >> 8);
+            bytes.push_back(value & 0xff);
+            return *this;
+        }
+        Message& name(const std::string& wire) {
+            bytes.insert(bytes.end(), wire.begin(), wire.end());
+            return *this;
+        }
+        Message& record(uint16_t type, uint16_t rclass, uint32_t ttl,
+                        const std::vector<uint8_t>& rdata) {
+            name(kPrinter).put16(type).put16(rclass).put16(ttl >> 16).put16(ttl & 0xffff);
+            put16(rdata.size());
+            bytes.insert(bytes.end(), rdata.begin(), rdata.end());
+            return *this;
+        }
+    };
+
+    // An unsolicited response announcing |addr| for printer.local.
+    static std::vector<uint8_t> announcement(const std::vector<uint8_t>& addr, uint32_t ttl,
+                                             bool cacheFlush = true) {
+        return Message()
+                .header(0x8400, 0, 1)
+                .record(ns_t_a, ns_c_in | (cacheFlush ? kCacheFlush : 0), ttl, addr)
+                .bytes;
+    }
+
+    static std::vector<uint8_t> query(uint16_t type) {
+        Message msg;
+        msg.put(0, 0x1234);
+        return msg.header(0, 1, 0).name(kPrinter).put16(type).put16(ns_c_in).bytes;
+    }
+
+    // Looks up the A records of printer.local at |when|, and returns their addresses, or an empty
+    // list if there's no answer.
+    Addrs lookup(MdnsCache::clock::time_point when, std::vector<uint32_t>* ttls = nullptr) {
+        std::vector<uint8_t> ans(512);
+        const int len = mCache.lookup(kNetId, query(ns_t_a), ans, when);
+        Addrs addrs;
+        if (len <= 0) return addrs;
+
+        DnsMessageIndex index;
+        EXPECT_TRUE(index.parse({ans.data(), static_cast<size_t>(len)}));
+        EXPECT_EQ(1, index.getFlag(ns_f_qr));
+        EXPECT_EQ(1, index.getFlag(ns_f_aa));
+        EXPECT_EQ(0x1234, (ans[0] << 8) | ans[1]);
+        for (const auto& rr : index.section(ns_s_an)) {
+            EXPECT_EQ(ns_t_a, rr.type);
+            EXPECT_EQ(ns_c_in, rr.rclass);
+            const auto rdata = index.rdata(rr);
+            addrs.emplace_back(rdata.begin(), rdata.end());
+            if (ttls != nullptr) ttls->push_back(rr.ttl);
+        }
+        return addrs;
+    }
+
+    MdnsCache mCache;
+    const MdnsCache::clock::time_point mStart = MdnsCache::clock::now();
+};
+
+TEST_F(MdnsCacheTest, AnswersAnnouncedRecordsUntilTheyExpire) {
+    EXPECT_TRUE(lookup(mStart).empty());
+
+    mCache.absorb(kNetId, kWlan, announcement(kAddr1, 120), mStart);
+    std::vector<uint32_t> ttls;
+    EXPECT_EQ(Addrs{kAddr1}, lookup(mStart + seconds(20), &ttls));
+    EXPECT_EQ(std::vector<uint32_t>{100}, ttls);
+    // Other networks don't see it.
+    std::vector<uint8_t> ans(512);
+    EXPECT_EQ(0, mCache.lookup(kNetId + 1, query(ns_t_a), ans, mStart));
+    // Nor does another type.
+    EXPECT_EQ(0, mCache.lookup(kNetId, query(ns_t_aaaa), ans, mStart));
+
+    EXPECT_TRUE(lookup(mStart + seconds(120)).empty());
+    EXPECT_EQ(0U, mCache.size(kNetId));
+}
+
+TEST_F(MdnsCacheTest, NamesAreCaseInsensitive) {
+    std::vector<uint8_t> packet = announcement(kAddr1, 120);
+    packet[NS_HFIXEDSZ + 1] = 'P';
+    mCache.absorb(kNetId, kWlan, packet, mStart);
+    EXPECT_EQ(Addrs{kAddr1}, lookup(mStart));
+}
+
+TEST_F(MdnsCacheTest, IgnoresQueriesAndErrors) {
+    // A query with a known answer, and a response with REFUSED.
+    for (uint16_t flags : {0x0000, 0x8405}) {
+        const auto packet = Message().header(flags, 0, 1).record(ns_t_a, ns_c_in, 120, kAddr1);
+        mCache.absorb(kNetId, kWlan, packet.bytes, mStart);
+    }
+    // An A record of the wrong size.
+    mCache.absorb(kNetId, kWlan, announcement({1, 2, 3}, 120), mStart);
+    EXPECT_EQ(0U, mCache.size(kNetId));
+}
+
+TEST_F(MdnsCacheTest, CacheFlushReplacesOlderRecordsOfTheSameInterface) {
+    mCache.absorb(kNetId, kWlan, announcement(kAddr1, 120), mStart);
+    mCache.absorb(kNetId, kEth, announcement(kAddr1, 120), mStart);
+    // Records of the same announcement, within a second of each other, are all kept.
+    mCache.absorb(kNetId, kWlan, announcement(kAddr2, 120), mStart + milliseconds(500));
+    EXPECT_EQ(3U, mCache.size(kNetId));
+    EXPECT_EQ((Addrs{kAddr1, kAddr2}), lookup(mStart + seconds(1)));
+
+    // The printer moved to kAddr2 on wlan: kAddr1 is still answered for a second.
+    mCache.absorb(kNetId, kWlan, announcement(kAddr2, 120), mStart + seconds(10));
+    EXPECT_EQ((Addrs{kAddr1, kAddr2}), lookup(mStart + seconds(10)));
+    // Then only from eth, where nothing flushed it.
+    EXPECT_EQ((Addrs{kAddr1, kAddr2}), lookup(mStart + seconds(11)));
+    EXPECT_EQ(2U, mCache.size(kNetId));
+}
+
+TEST_F(MdnsCacheTest, SharedRecordsDontFlush) {
+    mCache.absorb(kNetId, kWlan, announcement(kAddr1, 120, false), mStart);
+    mCache.absorb(kNetId, kWlan, announcement(kAddr2, 120, false), mStart + seconds(10));
+    EXPECT_EQ((Addrs{kAddr1, kAddr2}), lookup(mStart + seconds(20)));
+}
+
+TEST_F(MdnsCacheTest, GoodbyeExpiresTheRecordASecondLater) {
+    mCache.absorb(kNetId, kWlan, announcement(kAddr1, 120), mStart);
+    mCache.absorb(kNetId, kWlan, announcement(kAddr2, 120, false), mStart);
+    mCache.absorb(kNetId, kWlan, announcement(kAddr1, 0), mStart + seconds(10));
+    EXPECT_EQ((Addrs{kAddr1, kAddr2}), lookup(mStart + seconds(10)));
+    EXPECT_EQ(Addrs{kAddr2}, lookup(mStart + seconds(11)));
+}
+
+TEST_F(MdnsCacheTest, LimitsRecordsPerNetwork) {
+    for (size_t i = 0; i < MdnsCache::kMaxRecordsPerNetwork + 10; i++) {
+        const std::vector<uint8_t> addr = {10, 0, static_cast<uint8_t>(i >> 8),
+                                           static_cast<uint8_t>(i)};
+        mCache.absorb(kNetId, kWlan, announcement(addr, 120, false), mStart);
+    }
+    EXPECT_EQ(MdnsCache::kMaxRecordsPerNetwork, mCache.size(kNetId));
+    // Records that don't fit in the answer are left out.
+    constexpr size_t kRecordSize = 16;
+    EXPECT_EQ((512 - NS_HFIXEDSZ - kPrinter.size() - 4) / kRecordSize, lookup(mStart).size());
+}
+
+}  // namespace android::net
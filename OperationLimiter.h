@@ -17,6 +17,12 @@
 #ifndef NETUTILS_OPERATIONLIMITER_H
 #define NETUTILS_OPERATIONLIMITER_H
 
+#include <sched.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <unordered_map>
 
@@ -24,6 +30,7 @@
 #include <android-base/thread_annotations.h>
 
 #include "Experiments.h"
+#include "ResolvTrace.h"
 
 namespace android {
 namespace netdutils {
@@ -32,6 +39,10 @@ namespace netdutils {
 // ID, rejecting further attempts to start new operations after a configurable
 // limit has been reached.
 //
+// If the max_queries_per_uid_per_sec flag is set, each key also has a token bucket that refills at
+// that rate, up to max_queries_per_uid_burst tokens (by default, one second's worth). Each start
+// takes a token, and is rejected if there are none left, however few operations are in progress.
+//
 // The intended usage pattern is:
 //     OperationLimiter<UserId> connections_per_user;
 //     ...
@@ -41,79 +52,220 @@ namespace netdutils {
 //         connections_per_user.finish(user);
 //     }
 //
+// Keys are spread over shards that are locked separately, and the global count over per-core
+// stripes, so callers with different keys rarely wait for each other or contend for a cache line.
+//
 // This class is thread-safe.
 template <typename KeyType>
 class OperationLimiter {
   public:
+    using Clock = std::chrono::steady_clock;
+
     OperationLimiter(int limitPerKey) : mLimitPerKey(limitPerKey) {}
 
     ~OperationLimiter() {
-        DCHECK(mCounters.empty()) << "Destroying OperationLimiter with active operations";
+        DCHECK(!hasActiveOperations()) << "Destroying OperationLimiter with active operations";
     }
 
-    // Returns false if |key| has reached the maximum number of concurrent operations,
-    // or if the global limit has been reached. Otherwise, increments the counter and returns true.
+    // Returns false if |key| has reached the maximum number of concurrent operations, if it has no
+    // tokens left, or if the global limit has been reached. Otherwise, increments the counter and
+    // returns true. |background| operations may only take up to kBackgroundSharePercent of the
+    // global limit, so that the rest is left for the others.
     //
     // Note: each successful start(key) must be matched by exactly one call to
     // finish(key).
-    bool start(KeyType key) EXCLUDES(mMutex) {
-        std::lock_guard lock(mMutex);
-        int globalLimit =
-                android::net::Experiments::getInstance()->getFlag("max_queries_global", INT_MAX);
+    bool start(KeyType key, bool background = false) {
+        return start(key, background, Clock::now());
+    }
+
+    // As above, at time |now|. For testing.
+    bool start(KeyType key, bool background, Clock::time_point now) {
+        const auto experiments = android::net::Experiments::getInstance();
+        int globalLimit = experiments->getFlag("max_queries_global", INT_MAX);
         if (globalLimit < mLimitPerKey) {
             LOG(ERROR) << "Misconfiguration on max_queries_global " << globalLimit;
             globalLimit = INT_MAX;
         }
-        if (mGlobalCounter >= globalLimit) {
+        if (background && globalLimit != INT_MAX) {
+            globalLimit = std::max<int>(mLimitPerKey,
+                                        int64_t{globalLimit} * kBackgroundSharePercent / 100);
+        }
+        // Counted before the key's limits are checked, and given back if they reject it. The
+        // stripes are only summed when there's a global limit. Sequentially consistent, so that
+        // of two callers racing for the last slot, at least one sees the other.
+        std::atomic<int>& stripe = localStripe();
+        stripe.fetch_add(1, std::memory_order_seq_cst);
+        if (globalLimit != INT_MAX && globalCount() > globalLimit) {
             // Oh, no!
+            stripe.fetch_sub(1, std::memory_order_relaxed);
             LOG(ERROR) << "Query from " << key << " denied due to global limit: " << globalLimit;
+            traceRejection();
             return false;
         }
 
-        auto& cnt = mCounters[key];  // operator[] creates new entries as needed.
-        if (cnt >= mLimitPerKey) {
+        const int rate = experiments->getFlag("max_queries_per_uid_per_sec", 0);
+        const int burst = std::max(experiments->getFlag("max_queries_per_uid_burst", rate), 1);
+
+        Shard& shard = getShard(key);
+        std::lock_guard lock(shard.mutex);
+        auto [it, inserted] = shard.counters.try_emplace(key);
+        Counter& cnt = it->second;
+        if (inserted) {
+            cnt.tokens = burst;
+            cnt.lastRefill = now;
+            sweepLocked(shard, it, now, rate, burst);
+        }
+        if (cnt.inProgress >= mLimitPerKey) {
             // Oh, no!
             LOG(ERROR) << "Query from " << key << " denied due to limit: " << mLimitPerKey;
+            rejectLocked(shard, it, rate);
+            return false;
+        }
+        if (rate > 0 && !takeToken(cnt, now, rate, burst)) {
+            LOG(ERROR) << "Query from " << key << " denied due to rate limit: " << rate << "/s";
+            rejectLocked(shard, it, rate);
             return false;
         }
 
-        ++cnt;
-        ++mGlobalCounter;
+        ++cnt.inProgress;
         return true;
     }
 
     // Decrements the number of operations in progress accounted to |key|.
     // See usage notes on start().
-    void finish(KeyType key) EXCLUDES(mMutex) {
-        std::lock_guard lock(mMutex);
+    void finish(KeyType key) { release(key, false); }
 
-        --mGlobalCounter;
-        if (mGlobalCounter < 0) {
-            LOG(FATAL_WITHOUT_ABORT) << "Global operations counter going negative, this is a bug.";
-            return;
-        }
+    // Like finish(), for an operation that gave up before doing its work, to be started again:
+    // the token that start() took is given back, so that the operation isn't charged twice.
+    void cancel(KeyType key) { release(key, true); }
 
-        auto it = mCounters.find(key);
-        if (it == mCounters.end()) {
+  private:
+    struct Counter {
+        int inProgress = 0;
+        double tokens = 0;
+        Clock::time_point lastRefill;
+    };
+
+    void release(KeyType key, bool refund) {
+        Shard& shard = getShard(key);
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.counters.find(key);
+        if (it == shard.counters.end() || it->second.inProgress <= 0) {
+            // Then the global count wasn't counted for it either.
             LOG(FATAL_WITHOUT_ABORT) << "Decremented non-existent counter for key=" << key;
             return;
         }
-        auto& cnt = it->second;
-        --cnt;
-        if (cnt <= 0) {
-            // Cleanup counters once they drop down to zero.
-            mCounters.erase(it);
+        // Any stripe will do: only their sum means anything.
+        localStripe().fetch_sub(1, std::memory_order_relaxed);
+        const auto experiments = android::net::Experiments::getInstance();
+        const int rate = experiments->getFlag("max_queries_per_uid_per_sec", 0);
+        if (refund && rate > 0) {
+            const int burst = std::max(experiments->getFlag("max_queries_per_uid_burst", rate), 1);
+            it->second.tokens = std::min<double>(burst, it->second.tokens + 1);
+        }
+        // Cleanup counters once they drop down to zero, unless their tokens are still needed.
+        if (--it->second.inProgress <= 0 && rate <= 0) {
+            shard.counters.erase(it);
         }
     }
 
-  private:
-    // Protects access to the map below.
-    std::mutex mMutex;
+    using CounterMap = std::unordered_map<KeyType, Counter>;
+
+    static constexpr size_t kNumShards = 16;
+    static constexpr int kBackgroundSharePercent = 75;
+    // Keys with no operations in progress are kept for their token buckets. Once a shard has this
+    // many keys, the idle ones whose buckets have refilled are dropped as new keys arrive.
+    static constexpr size_t kSweepThreshold = 64;
+
+    // Aligned so that shards don't share cache lines.
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        CounterMap counters GUARDED_BY(mutex);
+        // Sweeps again only once the keys that survived the last sweep have doubled.
+        size_t sweepAt GUARDED_BY(mutex) = kSweepThreshold;
+    };
+
+    Shard& getShard(const KeyType& key) { return mShards[std::hash<KeyType>{}(key) % kNumShards]; }
+
+    // Aligned so that the stripes of different cores don't share cache lines.
+    struct alignas(64) Stripe {
+        std::atomic<int> count = 0;
+    };
+
+    // The stripe of the calling core, whose line it mostly keeps to itself.
+    std::atomic<int>& localStripe() {
+        const int cpu = sched_getcpu();
+        return mGlobalStripes[cpu < 0 ? 0 : cpu % kNumShards].count;
+    }
+
+    int globalCount() const {
+        int count = 0;
+        for (const Stripe& stripe : mGlobalStripes) {
+            count += stripe.count.load(std::memory_order_seq_cst);
+        }
+        return count;
+    }
+
+    static void refill(Counter& cnt, Clock::time_point now, int rate, int burst) {
+        const std::chrono::duration<double> elapsed = now - cnt.lastRefill;
+        if (elapsed.count() <= 0) return;
+        cnt.tokens = std::min<double>(burst, cnt.tokens + elapsed.count() * rate);
+        cnt.lastRefill = now;
+    }
+
+    static bool takeToken(Counter& cnt, Clock::time_point now, int rate, int burst) {
+        refill(cnt, now, rate, burst);
+        if (cnt.tokens < 1) return false;
+        cnt.tokens -= 1;
+        return true;
+    }
+
+    void rejectLocked(Shard& shard, typename CounterMap::iterator it, int rate)
+            REQUIRES(shard.mutex) {
+        localStripe().fetch_sub(1, std::memory_order_relaxed);
+        if (it->second.inProgress <= 0 && rate <= 0) shard.counters.erase(it);
+        traceRejection();
+    }
+
+    // Drops the idle keys other than |keep| that have all their tokens back, or all of them if
+    // the rate limit has been turned off.
+    void sweepLocked(Shard& shard, typename CounterMap::iterator keep, Clock::time_point now,
+                     int rate, int burst) REQUIRES(shard.mutex) {
+        if (shard.counters.size() < shard.sweepAt) return;
+        for (auto it = shard.counters.begin(); it != shard.counters.end();) {
+            Counter& cnt = it->second;
+            bool idle = it != keep && cnt.inProgress <= 0;
+            if (idle && rate > 0) {
+                refill(cnt, now, rate, burst);
+                idle = cnt.tokens >= burst;
+            }
+            it = idle ? shard.counters.erase(it) : std::next(it);
+        }
+        shard.sweepAt = std::max(kSweepThreshold, 2 * shard.counters.size());
+    }
+
+    void traceRejection() {
+        net::traceCounter("OperationLimiter rejections",
+                          mRejections.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+
+    bool hasActiveOperations() {
+        for (Shard& shard : mShards) {
+            std::lock_guard lock(shard.mutex);
+            for (const auto& [key, cnt] : shard.counters) {
+                if (cnt.inProgress > 0) return true;
+            }
+        }
+        return false;
+    }
+
+    std::array<Shard, kNumShards> mShards;
 
-    // Tracks the number of outstanding queries by key.
-    std::unordered_map<KeyType, int> mCounters GUARDED_BY(mMutex);
+    // The operations in progress, spread over the cores that started or finished them.
+    std::array<Stripe, kNumShards> mGlobalStripes;
 
-    int mGlobalCounter GUARDED_BY(mMutex) = 0;
+    // Traced as a counter, so that rejections show up next to what caused them.
+    std::atomic<int> mRejections = 0;
 
     // Maximum number of outstanding queries from a single key.
     const int mLimitPerKey;
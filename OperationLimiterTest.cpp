@@ -16,8 +16,13 @@
 
 #include "OperationLimiter.h"
 
+#include <thread>
+#include <vector>
+
 #include <gtest/gtest-spi.h>
 
+#include "tests/resolv_test_utils.h"
+
 namespace android {
 namespace netdutils {
 
@@ -71,5 +76,135 @@ TEST(OperationLimiter, destroyWithActiveOperations) {
             "" /* "active operations */);
 }
 
+TEST(OperationLimiter, concurrentKeys) {
+    constexpr int kThreads = 8;
+    constexpr int kIterations = 1000;
+    OperationLimiter<int> limiter(2);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; i++) {
+        threads.emplace_back([&limiter, key = i % 4]() {
+            for (int j = 0; j < kIterations; j++) {
+                // Two threads share each key, so both of them always get in.
+                ASSERT_TRUE(limiter.start(key));
+                limiter.finish(key);
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    EXPECT_TRUE(limiter.start(0));
+    EXPECT_TRUE(limiter.start(0));
+    EXPECT_FALSE(limiter.start(0));
+    limiter.finish(0);
+    limiter.finish(0);
+}
+
+TEST(OperationLimiter, rateLimit) {
+    using namespace std::chrono_literals;
+    ScopedSystemProperties rate("persist.device_config.netd_native.max_queries_per_uid_per_sec",
+                                "10");
+    ScopedSystemProperties burst("persist.device_config.netd_native.max_queries_per_uid_burst",
+                                 "3");
+    android::net::Experiments::getInstance()->update();
+    {
+        OperationLimiter<int> limiter(100);
+        const auto t0 = OperationLimiter<int>::Clock::now();
+
+        // The burst goes through, even if each query is done before the next one starts...
+        for (int i = 0; i < 3; i++) {
+            EXPECT_TRUE(limiter.start(42, false, t0));
+            limiter.finish(42);
+        }
+        // ...and then the key has to wait for tokens.
+        EXPECT_FALSE(limiter.start(42, false, t0));
+        EXPECT_FALSE(limiter.start(42, false, t0 + 50ms));
+        EXPECT_TRUE(limiter.start(42, false, t0 + 100ms));
+        EXPECT_FALSE(limiter.start(42, false, t0 + 100ms));
+        limiter.finish(42);
+
+        // Other keys have tokens of their own.
+        EXPECT_TRUE(limiter.start(666, false, t0));
+        limiter.finish(666);
+
+        // Idle for long, the bucket is full again, but no fuller.
+        for (int i = 0; i < 3; i++) {
+            EXPECT_TRUE(limiter.start(42, false, t0 + 10s));
+            limiter.finish(42);
+        }
+        EXPECT_FALSE(limiter.start(42, false, t0 + 10s));
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST(OperationLimiter, cancelRefundsToken) {
+    ScopedSystemProperties rate("persist.device_config.netd_native.max_queries_per_uid_per_sec",
+                                "10");
+    ScopedSystemProperties burst("persist.device_config.netd_native.max_queries_per_uid_burst",
+                                 "2");
+    android::net::Experiments::getInstance()->update();
+    {
+        OperationLimiter<int> limiter(100);
+        const auto t0 = OperationLimiter<int>::Clock::now();
+
+        // Cancelled operations don't use up the burst...
+        for (int i = 0; i < 5; i++) {
+            EXPECT_TRUE(limiter.start(42, false, t0));
+            limiter.cancel(42);
+        }
+        EXPECT_TRUE(limiter.start(42, false, t0));
+        EXPECT_TRUE(limiter.start(42, false, t0));
+        // ...but don't fill the bucket beyond it either.
+        limiter.cancel(42);
+        limiter.cancel(42);
+        EXPECT_TRUE(limiter.start(42, false, t0));
+        EXPECT_TRUE(limiter.start(42, false, t0));
+        EXPECT_FALSE(limiter.start(42, false, t0));
+        limiter.finish(42);
+        limiter.finish(42);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST(OperationLimiter, backgroundShare) {
+    ScopedSystemProperties global("persist.device_config.netd_native.max_queries_global", "8");
+    android::net::Experiments::getInstance()->update();
+    {
+        OperationLimiter<int> limiter(2);
+        for (int i = 0; i < 6; i++) EXPECT_TRUE(limiter.start(i, true));
+        // Background operations have taken their share...
+        EXPECT_FALSE(limiter.start(6, true));
+        // ...but the rest is still there for the others.
+        EXPECT_TRUE(limiter.start(6));
+        EXPECT_TRUE(limiter.start(7));
+        EXPECT_FALSE(limiter.start(8));
+        for (int i = 0; i < 8; i++) limiter.finish(i);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST(OperationLimiter, globalLimitAcrossCores) {
+    ScopedSystemProperties global("persist.device_config.netd_native.max_queries_global", "8");
+    android::net::Experiments::getInstance()->update();
+    {
+        OperationLimiter<int> limiter(2);
+        // Started on threads that may run on any core, the operations still count together...
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 8; i++) {
+            threads.emplace_back([&limiter, i]() { EXPECT_TRUE(limiter.start(i)); });
+        }
+        for (auto& thread : threads) thread.join();
+        EXPECT_FALSE(limiter.start(8));
+
+        // ...and finishing them on other cores makes room again.
+        threads.clear();
+        for (int i = 0; i < 4; i++) threads.emplace_back([&limiter, i]() { limiter.finish(i); });
+        for (auto& thread : threads) thread.join();
+        for (int i = 8; i < 12; i++) EXPECT_TRUE(limiter.start(i));
+        EXPECT_FALSE(limiter.start(12));
+        for (int i = 4; i < 12; i++) limiter.finish(i);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
 }  // namespace netdutils
 }  // namespace android
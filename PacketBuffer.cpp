@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PacketBuffer.h"
+
+#include <arpa/nameser.h>
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+#include <android-base/thread_annotations.h>
+
+#include "resolv_private.h"
+
+namespace android::net {
+
+static_assert(PacketBuffer::kMaxSize == MAXPACKET);
+
+namespace {
+
+// Enough for the answers of as many lookups at once, and bounded so that a burst of them doesn't
+// leave the memory held for good.
+constexpr size_t kMaxPooled = 64;
+
+struct Pool {
+    std::mutex lock;
+    std::vector<std::vector<uint8_t>> free GUARDED_BY(lock);
+};
+
+// Never destroyed: detached query threads may still give their buffers back at exit.
+Pool& pool() {
+    static Pool* const instance = new Pool;
+    return *instance;
+}
+
+}  // namespace
+
+PacketBuffer::PacketBuffer(size_t size) : mSize(size) {
+    if (size <= kMaxSize) {
+        Pool& p = pool();
+        std::lock_guard guard(p.lock);
+        if (!p.free.empty()) {
+            mBuffer = std::move(p.free.back());
+            p.free.pop_back();
+        }
+    }
+    if (!mBuffer.empty()) {
+        // Callers read the counts in the header even when no answer was written.
+        std::fill_n(mBuffer.begin(), HFIXEDSZ, 0);
+        return;
+    }
+    // Only a new buffer is zero-filled, once.
+    mBuffer.resize(std::max(size, kMaxSize));
+}
+
+PacketBuffer::~PacketBuffer() {
+    // Neither moved from nor larger than the others.
+    if (mBuffer.size() != kMaxSize) return;
+    Pool& p = pool();
+    std::lock_guard guard(p.lock);
+    if (p.free.size() < kMaxPooled) p.free.push_back(std::move(mBuffer));
+}
+
+PacketBuffer::PacketBuffer(PacketBuffer&& other) noexcept
+    : mBuffer(std::move(other.mBuffer)), mSize(std::exchange(other.mSize, 0)) {
+    other.mBuffer.clear();
+}
+
+PacketBuffer& PacketBuffer::operator=(PacketBuffer&& other) noexcept {
+    // |other| gives back the buffer this one had.
+    std::swap(mBuffer, other.mBuffer);
+    std::swap(mSize, other.mSize);
+    return *this;
+}
+
+size_t PacketBuffer::pooled() {
+    Pool& p = pool();
+    std::lock_guard guard(p.lock);
+    return p.free.size();
+}
+
+}  // namespace android::net
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <span>
+#include <vector>
+
+namespace android::net {
+
+// A buffer for one DNS message, taken from a process-wide pool of MAXPACKET-sized buffers and
+// given back to it when destroyed, so that every lookup doesn't allocate and zero-fill its answer
+// buffers anew. But for its zeroed header, a recycled buffer still holds what its last user wrote
+// there: nothing past the header may be read that wasn't first written. This class is thread-safe,
+// but its instances aren't.
+class PacketBuffer {
+  public:
+    // MAXPACKET.
+    static constexpr size_t kMaxSize = 8 * 1024;
+
+    PacketBuffer() : PacketBuffer(kMaxSize) {}
+    // Buffers larger than kMaxSize are allocated, and freed, as usual.
+    explicit PacketBuffer(size_t size);
+    ~PacketBuffer();
+
+    PacketBuffer(PacketBuffer&& other) noexcept;
+    PacketBuffer& operator=(PacketBuffer&& other) noexcept;
+
+    uint8_t* data() { return mBuffer.data(); }
+    const uint8_t* data() const { return mBuffer.data(); }
+    size_t size() const { return mSize; }
+
+    operator std::span<uint8_t>() { return {mBuffer.data(), mSize}; }
+    operator std::span<const uint8_t>() const { return {mBuffer.data(), mSize}; }
+
+    // The number of buffers waiting in the pool to be reused.
+    static size_t pooled();
+
+  private:
+    std::vector<uint8_t> mBuffer;
+    size_t mSize;
+};
+
+}  // namespace android::net
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/nameser.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "PacketBuffer.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class PacketBufferTest : public ResolvTestBase {};
+
+TEST_F(PacketBufferTest, Recycle) {
+    const uint8_t* data;
+    {
+        PacketBuffer buffer;
+        EXPECT_EQ(PacketBuffer::kMaxSize, buffer.size());
+        data = buffer.data();
+        std::fill_n(buffer.data(), buffer.size(), 0xff);
+    }
+    EXPECT_LE(1U, PacketBuffer::pooled());
+
+    // The same buffer, of the size asked for this time, with only its header cleared.
+    PacketBuffer again(100);
+    EXPECT_EQ(data, again.data());
+    EXPECT_EQ(100U, again.size());
+    EXPECT_EQ(std::vector<uint8_t>(HFIXEDSZ, 0),
+              std::vector(again.data(), again.data() + HFIXEDSZ));
+    EXPECT_EQ(0xff, again.data()[HFIXEDSZ]);
+}
+
+TEST_F(PacketBufferTest, Move) {
+    PacketBuffer buffer;
+    const uint8_t* const data = buffer.data();
+    PacketBuffer moved(std::move(buffer));
+    EXPECT_EQ(data, moved.data());
+    EXPECT_EQ(0U, buffer.size());
+    const std::span<uint8_t> span = moved;
+    EXPECT_EQ(data, span.data());
+    EXPECT_EQ(PacketBuffer::kMaxSize, span.size());
+
+    // The buffers trade places, and each goes back to the pool in the end.
+    auto other = std::make_unique<PacketBuffer>();
+    const uint8_t* const otherData = other->data();
+    *other = std::move(moved);
+    EXPECT_EQ(data, other->data());
+    EXPECT_EQ(otherData, moved.data());
+    const size_t pooled = PacketBuffer::pooled();
+    other.reset();
+    EXPECT_EQ(pooled + 1, PacketBuffer::pooled());
+}
+
+TEST_F(PacketBufferTest, Large) {
+    const size_t pooled = PacketBuffer::pooled();
+    {
+        PacketBuffer buffer(PacketBuffer::kMaxSize + 1);
+        EXPECT_EQ(PacketBuffer::kMaxSize + 1, buffer.size());
+        EXPECT_EQ(pooled, PacketBuffer::pooled());
+    }
+    // Not kept for later.
+    EXPECT_EQ(pooled, PacketBuffer::pooled());
+}
+
+}  // namespace android::net
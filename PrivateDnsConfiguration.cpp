@@ -27,8 +27,10 @@
 #include <netdutils/ThreadUtil.h>
 #include <sys/socket.h>
 
+#include "DnsTlsDispatcher.h"
 #include "DnsTlsTransport.h"
 #include "ResolverEventReporter.h"
+#include "TimerService.h"
 #include "doh.h"
 #include "netd_resolv/resolv.h"
 #include "resolv_cache.h"
@@ -46,6 +48,24 @@ using std::chrono::milliseconds;
 namespace android {
 namespace net {
 
+namespace {
+
+// Where a validation of |server| on |netId| waits in line for the ValidationScheduler. The server
+// that DnsStats ranks best, which queries would try first, comes first, and retries after a
+// failure come after all first attempts. Revalidations of a server that was working go before
+// anything else.
+int validationPriority(const DnsTlsServer& server, unsigned netId, bool isRevalidation,
+                       bool isRetry) {
+    if (isRevalidation && !isRetry) return -1;
+    const auto ranked = resolv_stats_get_sorted_servers(netId, PROTO_DOT);
+    const int size = static_cast<int>(ranked.size());
+    const int rank = static_cast<int>(std::find(ranked.begin(), ranked.end(), server.addr()) -
+                                      ranked.begin());
+    return isRetry ? size + 1 + rank : rank;
+}
+
+}  // namespace
+
 int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
                                  const std::vector<std::string>& servers, const std::string& name,
                                  const std::string& caCert) {
@@ -76,6 +96,7 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
     } else {
         mPrivateDnsModes[netId] = PrivateDnsMode::OFF;
         mPrivateDnsTransports.erase(netId);
+        publishStatusLocked(netId);
         // TODO: signal validation threads to stop.
         return 0;
     }
@@ -104,17 +125,33 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
             startValidation(identity, netId, false);
         }
     }
+    publishStatusLocked(netId);
 
     return 0;
 }
 
+std::shared_ptr<const PrivateDnsStatus> PrivateDnsConfiguration::getStatusSnapshot(
+        unsigned netId) const {
+    static const auto kOff = std::make_shared<const PrivateDnsStatus>(PrivateDnsStatus{
+            .mode = PrivateDnsMode::OFF,
+            .dotServersMap = {},
+            .dohServersMap = {},
+    });
+    const auto snapshots = std::atomic_load(&mStatusSnapshots);
+    const auto it = snapshots->find(netId);
+    return it != snapshots->end() ? it->second : kOff;
+}
+
 PrivateDnsStatus PrivateDnsConfiguration::getStatus(unsigned netId) const {
+    return *getStatusSnapshot(netId);
+}
+
+PrivateDnsStatus PrivateDnsConfiguration::getStatusLocked(unsigned netId) const {
     PrivateDnsStatus status{
             .mode = PrivateDnsMode::OFF,
             .dotServersMap = {},
             .dohServersMap = {},
     };
-    std::lock_guard guard(mPrivateDnsLock);
 
     const auto mode = mPrivateDnsModes.find(netId);
     if (mode == mPrivateDnsModes.end()) return status;
@@ -140,11 +177,23 @@ PrivateDnsStatus PrivateDnsConfiguration::getStatus(unsigned netId) const {
     return status;
 }
 
+void PrivateDnsConfiguration::publishStatusLocked(unsigned netId) {
+    auto snapshots = std::make_shared<StatusSnapshots>(*mStatusSnapshots);
+    if (mPrivateDnsModes.contains(netId)) {
+        (*snapshots)[netId] = std::make_shared<const PrivateDnsStatus>(getStatusLocked(netId));
+    } else {
+        snapshots->erase(netId);
+    }
+    std::atomic_store(&mStatusSnapshots, std::shared_ptr<const StatusSnapshots>(snapshots));
+}
+
 void PrivateDnsConfiguration::clear(unsigned netId) {
     LOG(DEBUG) << "PrivateDnsConfiguration::clear(" << netId << ")";
     std::lock_guard guard(mPrivateDnsLock);
     mPrivateDnsModes.erase(netId);
     mPrivateDnsTransports.erase(netId);
+    mPrewarms.erase(netId);
+    publishStatusLocked(netId);
 }
 
 base::Result<void> PrivateDnsConfiguration::requestValidation(unsigned netId,
@@ -194,69 +243,123 @@ void PrivateDnsConfiguration::startValidation(const ServerIdentity& identity, un
     if (!result.ok()) return;
     DnsTlsServer server = *static_cast<const DnsTlsServer*>(result.value());
 
-    std::thread validate_thread([this, identity, server, netId, isRevalidation] {
+    // cat /proc/sys/net/ipv4/tcp_syn_retries yields "6".
+    //
+    // Start with a 1 minute delay and backoff to once per hour.
+    //
+    // Assumptions:
+    //     [1] Each TLS validation is ~10KB of certs+handshake+payload.
+    //     [2] Network typically provision clients with <=4 nameservers.
+    //     [3] Average month has 30 days.
+    //
+    // Each validation pass in a given hour is ~1.2MB of data. And 24
+    // such validation passes per day is about ~30MB per month, in the
+    // worst case. Otherwise, this will cost ~600 SYNs per month
+    // (6 SYNs per ip, 4 ips per validation pass, 24 passes per day).
+    auto backoff = std::make_shared<netdutils::BackoffSequence<>>(mBackoffBuilder.build());
+    runValidation(identity, server, netId, isRevalidation, std::move(backoff), false);
+}
+
+void PrivateDnsConfiguration::runValidation(const ServerIdentity& identity,
+                                            const DnsTlsServer& server, unsigned netId,
+                                            bool isRevalidation,
+                                            std::shared_ptr<netdutils::BackoffSequence<>> backoff,
+                                            bool isRetry) {
+    std::thread validate_thread([this, identity, server, netId, isRevalidation,
+                                 backoff = std::move(backoff), isRetry] {
         setThreadName(fmt::format("TlsVerify_{}", netId));
 
-        // cat /proc/sys/net/ipv4/tcp_syn_retries yields "6".
-        //
-        // Start with a 1 minute delay and backoff to once per hour.
-        //
-        // Assumptions:
-        //     [1] Each TLS validation is ~10KB of certs+handshake+payload.
-        //     [2] Network typically provision clients with <=4 nameservers.
-        //     [3] Average month has 30 days.
-        //
-        // Each validation pass in a given hour is ~1.2MB of data. And 24
-        // such validation passes per day is about ~30MB per month, in the
-        // worst case. Otherwise, this will cost ~600 SYNs per month
-        // (6 SYNs per ip, 4 ips per validation pass, 24 passes per day).
-        auto backoff = mBackoffBuilder.build();
-
-        while (true) {
-            // ::validate() is a blocking call that performs network operations.
-            // It can take milliseconds to minutes, up to the SYN retry limit.
-            LOG(WARNING) << "Validating DnsTlsServer " << server.toIpString() << " with mark 0x"
-                         << std::hex << server.validationMark();
-            const bool success = DnsTlsTransport::validate(server, server.validationMark());
-            LOG(WARNING) << "validateDnsTlsServer returned " << success << " for "
-                         << server.toIpString();
-
-            const bool needs_reeval =
-                    this->recordPrivateDnsValidation(identity, netId, success, isRevalidation);
-
-            if (!needs_reeval) {
-                break;
+        // ::validate() is a blocking call that performs network operations.
+        // It can take milliseconds to minutes, up to the SYN retry limit.
+        LOG(WARNING) << "Validating DnsTlsServer " << server.toIpString() << " with mark 0x"
+                     << std::hex << server.validationMark();
+        const int parallelism =
+                Experiments::getInstance()->getFlag("dot_validation_parallelism", 0);
+        const bool viaDispatcher =
+                parallelism > 0 ||
+                Experiments::getInstance()->getFlag("dot_validation_reuse_connection", 0) == 1;
+        bool success;
+        if (viaDispatcher) {
+            // Probing through the dispatcher leaves the connection, and its TLS session, open
+            // for the first queries, instead of closing it and having them open another.
+            if (parallelism > 0) {
+                mValidationScheduler.setMaxConcurrent(parallelism);
+                mValidationScheduler.start(
+                        validationPriority(server, netId, isRevalidation, isRetry));
             }
-
-            if (backoff.hasNextTimeout()) {
-                // TODO: make the thread able to receive signals to shutdown early.
-                std::this_thread::sleep_for(backoff.getNextTimeout());
-            } else {
-                break;
+            success = DnsTlsDispatcher::getInstance().validate(server, netId,
+                                                               server.validationMark());
+            if (parallelism > 0) mValidationScheduler.finish();
+        } else {
+            success = DnsTlsTransport::validate(server, server.validationMark());
+        }
+        LOG(WARNING) << "validateDnsTlsServer returned " << success << " for "
+                     << server.toIpString();
+
+        const bool needs_reeval =
+                this->recordPrivateDnsValidation(identity, netId, success, isRevalidation);
+
+        if (!needs_reeval) {
+            // Unless it went through the dispatcher, the connection used for validation is
+            // closed, and queries would otherwise open their own only when the first one is sent.
+            if (success && !isRevalidation && !viaDispatcher &&
+                this->claimPrewarm(identity, netId)) {
+                const bool warm =
+                        DnsTlsDispatcher::getInstance().warmUp(server, netId, server.mark);
+                LOG(INFO) << "Warmed up connection to " << server.toIpString() << ": " << warm;
             }
+            return;
         }
+
+        if (!backoff->hasNextTimeout()) return;
+        TimerService::getInstance().schedule(
+                backoff->getNextTimeout(),
+                [this, identity, server, netId, isRevalidation, backoff] {
+                    runValidation(identity, server, netId, isRevalidation, backoff, true);
+                });
     });
     validate_thread.detach();
 }
 
+bool PrivateDnsConfiguration::claimPrewarm(const ServerIdentity& identity, unsigned netId) {
+    const int maxServers = Experiments::getInstance()->getFlag("dot_prewarm_connections", 0);
+    if (maxServers <= 0) return false;
+
+    std::lock_guard guard(mPrivateDnsLock);
+    // The server may have been removed while it was being validated.
+    const auto server = getPrivateDnsLocked(identity, netId);
+    if (!server.ok() || !server.value()->active() ||
+        server.value()->validationState() != Validation::success) {
+        return false;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    auto& prewarms = mPrewarms[netId];
+    std::erase_if(prewarms, [&](const auto& it) { return now - it.second >= kPrewarmInterval; });
+    if (prewarms.contains(identity) || prewarms.size() >= static_cast<size_t>(maxServers)) {
+        return false;
+    }
+    prewarms[identity] = now;
+    return true;
+}
+
 void PrivateDnsConfiguration::sendPrivateDnsValidationEvent(const ServerIdentity& identity,
                                                             unsigned netId, bool success) const {
     LOG(DEBUG) << "Sending validation " << (success ? "success" : "failure") << " event on netId "
                << netId << " for " << identity.sockaddr.toString() << " with hostname {"
                << identity.provider << "}";
     // Send a validation event to NetdEventListenerService.
-    const auto& listeners = ResolverEventReporter::getInstance().getListeners();
-    if (listeners.empty()) {
+    const auto listeners = ResolverEventReporter::getInstance().getListeners();
+    if (listeners->empty()) {
         LOG(ERROR)
                 << "Validation event not sent since no INetdEventListener receiver is available.";
     }
-    for (const auto& it : listeners) {
+    for (const auto& it : *listeners) {
         it->onPrivateDnsValidationEvent(netId, identity.sockaddr.ip().toString(), identity.provider,
                                         success);
     }
 
     // Send a validation event to unsolicited event listeners.
-    const auto& unsolEventListeners = ResolverEventReporter::getInstance().getUnsolEventListeners();
+    const auto unsolEventListeners = ResolverEventReporter::getInstance().getUnsolEventListeners();
     const PrivateDnsValidationEventParcel validationEvent = {
             .netId = static_cast<int32_t>(netId),
             .ipAddress = identity.sockaddr.ip().toString(),
@@ -267,7 +370,7 @@ void PrivateDnsConfiguration::sendPrivateDnsValidationEvent(const ServerIdentity
                                 ? IDnsResolverUnsolicitedEventListener::PROTOCOL_DOT
                                 : IDnsResolverUnsolicitedEventListener::PROTOCOL_DOH,
     };
-    for (const auto& it : unsolEventListeners) {
+    for (const auto& it : *unsolEventListeners) {
         it->onPrivateDnsValidationEvent(validationEvent);
     }
 }
@@ -347,7 +450,11 @@ void PrivateDnsConfiguration::updateServerState(const ServerIdentity& identity,
 
     auto* server = result.value();
 
+    // Failures remembered before may have been those of servers that queries no longer go to,
+    // or that they go to instead now.
+    if (server->validationState() != state) resolv_cache_clear_failures(netId);
     server->setValidationState(state);
+    publishStatusLocked(netId);
     notifyValidationStateUpdate(identity.sockaddr, state, netId);
 
     RecordEntry record(netId, identity, state);
@@ -426,21 +533,59 @@ void PrivateDnsConfiguration::dump(netdutils::DumpWriter& dw) const {
                 record.serverIdentity.provider, validationStatusToString(record.state)));
     }
     dw.blankline();
-}
 
-void PrivateDnsConfiguration::initDoh() {
-    std::lock_guard guard(mPrivateDnsLock);
-    initDohLocked();
+    SessionStats stats;
+    doh_get_session_stats(&stats);
+    dw.println(fmt::format(
+            "DoH session resumption: resumed={} early_data_accepted={} early_data_rejected={}",
+            stats.resumed, stats.early_data_accepted, stats.early_data_rejected));
+    dw.blankline();
+
+    dw.println(fmt::format("DoT validations: running={} waiting={}",
+                           mValidationScheduler.running(), mValidationScheduler.waiting()));
+    dw.blankline();
 }
 
 void PrivateDnsConfiguration::initDohLocked() {
+    // Whether it's still there or not, it's in use again.
+    mDohTeardownGeneration++;
     if (mDohDispatcher != nullptr) return;
-    mDohDispatcher = doh_dispatcher_new(
-            [](uint32_t net_id, bool success, const char* ip_addr, const char* host) {
-                android::net::PrivateDnsConfiguration::getInstance().onDohStatusUpdate(
-                        net_id, success, ip_addr, host);
-            },
-            [](int32_t sock) { resolv_tag_socket(sock, AID_DNS, NET_CONTEXT_INVALID_PID); });
+    LOG(INFO) << __func__ << ": Starting the DoH dispatcher";
+    mDohDispatcher = std::shared_ptr<DohDispatcher>(
+            doh_dispatcher_new(
+                    [](uint32_t net_id, bool success, const char* ip_addr, const char* host) {
+                        android::net::PrivateDnsConfiguration::getInstance().onDohStatusUpdate(
+                                net_id, success, ip_addr, host);
+                    },
+                    [](int32_t sock) {
+                        resolv_tag_socket(sock, AID_DNS, NET_CONTEXT_INVALID_PID);
+                    }),
+            [](DohDispatcher* doh) {
+                if (doh != nullptr) doh_dispatcher_delete(doh);
+            });
+}
+
+void PrivateDnsConfiguration::scheduleDohTeardownLocked() {
+    const uint64_t generation = ++mDohTeardownGeneration;
+    const std::chrono::milliseconds delay(std::max(
+            Experiments::getInstance()->getFlag("doh_dispatcher_idle_ms",
+                                                kDohDispatcherIdleDefaultMs),
+            0));
+    // Neither mPrivateDnsLock, which a binder call may hold for a while, nor stopping the
+    // runtime, which waits for threads that may be waiting for that lock to report a validation,
+    // is waited for on the timer thread, which the other timers share.
+    TimerService::getInstance().schedule(delay, [this, generation] {
+        std::thread teardown_thread([this, generation] {
+            setThreadName("DohTeardown");
+            std::unique_lock lock(mPrivateDnsLock);
+            if (mDohTeardownGeneration != generation || !mDohTracker.empty()) return;
+            std::shared_ptr<DohDispatcher> dispatcher = std::move(mDohDispatcher);
+            lock.unlock();
+            LOG(INFO) << "Deleting the idle DoH dispatcher";
+            dispatcher.reset();
+        });
+        teardown_thread.detach();
+    });
 }
 
 int PrivateDnsConfiguration::setDoh(int32_t netId, uint32_t mark,
@@ -454,9 +599,9 @@ int PrivateDnsConfiguration::setDoh(int32_t netId, uint32_t mark,
         return 0;
     }
 
-    const auto getTimeoutFromFlag = [&](const std::string_view key, int defaultValue) -> uint64_t {
+    const auto getTimeoutFromFlag = [&](Experiments::Flag flag, int defaultValue) -> uint64_t {
         static constexpr int kMinTimeoutMs = 1000;
-        uint64_t timeout = Experiments::getInstance()->getFlag(key, defaultValue);
+        uint64_t timeout = Experiments::getInstance()->getFlag(flag, defaultValue);
         if (timeout < kMinTimeoutMs) {
             timeout = kMinTimeoutMs;
         }
@@ -472,8 +617,6 @@ int PrivateDnsConfiguration::setDoh(int32_t netId, uint32_t mark,
         return ipa > ipb;
     });
 
-    initDohLocked();
-
     // TODO: 1. Improve how to choose the server
     // TODO: 2. Support multiple servers
     for (const auto& entry : mAvailableDoHProviders) {
@@ -492,6 +635,7 @@ int PrivateDnsConfiguration::setDoh(int32_t netId, uint32_t mark,
         }
         const auto& [dohIt, _] = mDohTracker.insert_or_assign(netId, doh.value());
         const auto& dohId = dohIt->second;
+        publishStatusLocked(netId);
 
         RecordEntry record(netId,
                            {netdutils::IPSockAddr::toIPSockAddr(dohId.ipAddr, kDohPort), name},
@@ -499,6 +643,7 @@ int PrivateDnsConfiguration::setDoh(int32_t netId, uint32_t mark,
         mPrivateDnsLog.push(std::move(record));
         LOG(INFO) << __func__ << ": Upgrading server to DoH: " << name;
         resolv_stats_set_addrs(netId, PROTO_DOH, {dohId.ipAddr}, kDohPort);
+        initDohLocked();
 
         const FeatureFlags flags = {
                 .probe_timeout_ms =
@@ -507,13 +652,25 @@ int PrivateDnsConfiguration::setDoh(int32_t netId, uint32_t mark,
                         getTimeoutFromFlag("doh_idle_timeout_ms", kDohIdleDefaultTimeoutMs),
                 .use_session_resumption =
                         Experiments::getInstance()->getFlag("doh_session_resumption", 0) == 1,
+                .max_connections = static_cast<uint32_t>(std::clamp(
+                        Experiments::getInstance()->getFlag("doh_max_connections",
+                                                            kDohDefaultMaxConnections),
+                        1, kDohMaxConnections)),
+                .max_streams_per_connection = static_cast<uint32_t>(std::max(
+                        Experiments::getInstance()->getFlag("doh_max_streams_per_connection",
+                                                            kDohDefaultMaxStreamsPerConnection),
+                        1)),
+                .use_early_data = Experiments::getInstance()->getFlag("doh_early_data", 0) == 1,
         };
         LOG(DEBUG) << __func__ << ": probe_timeout_ms=" << flags.probe_timeout_ms
                    << ", idle_timeout_ms=" << flags.idle_timeout_ms
-                   << ", use_session_resumption=" << flags.use_session_resumption;
+                   << ", use_session_resumption=" << flags.use_session_resumption
+                   << ", max_connections=" << flags.max_connections
+                   << ", max_streams_per_connection=" << flags.max_streams_per_connection
+                   << ", use_early_data=" << flags.use_early_data;
 
-        return doh_net_new(mDohDispatcher, netId, dohId.httpsTemplate.c_str(), dohId.host.c_str(),
-                           dohId.ipAddr.c_str(), mark, caCert.c_str(), &flags);
+        return doh_net_new(mDohDispatcher.get(), netId, dohId.httpsTemplate.c_str(),
+                           dohId.host.c_str(), dohId.ipAddr.c_str(), mark, caCert.c_str(), &flags);
     }
 
     LOG(INFO) << __func__ << ": No suitable DoH server found";
@@ -523,9 +680,11 @@ int PrivateDnsConfiguration::setDoh(int32_t netId, uint32_t mark,
 
 void PrivateDnsConfiguration::clearDohLocked(unsigned netId) {
     LOG(DEBUG) << "PrivateDnsConfiguration::clearDohLocked (" << netId << ")";
-    if (mDohDispatcher != nullptr) doh_net_delete(mDohDispatcher, netId);
+    if (mDohDispatcher != nullptr) doh_net_delete(mDohDispatcher.get(), netId);
     mDohTracker.erase(netId);
+    publishStatusLocked(netId);
     resolv_stats_set_addrs(netId, PROTO_DOH, {}, kDohPort);
+    if (mDohTracker.empty() && mDohDispatcher != nullptr) scheduleDohTeardownLocked();
 }
 
 void PrivateDnsConfiguration::clearDoh(unsigned netId) {
@@ -533,15 +692,62 @@ void PrivateDnsConfiguration::clearDoh(unsigned netId) {
     clearDohLocked(netId);
 }
 
+ssize_t PrivateDnsConfiguration::dohQueryBatch(unsigned netId, std::span<DohBatchQuery> queries,
+                                               uint64_t timeoutMs) {
+    std::shared_ptr<DohDispatcher> dispatcher;
+    {
+        std::lock_guard guard(mPrivateDnsLock);
+        dispatcher = mDohDispatcher;
+        if (dispatcher == nullptr) return DOH_RESULT_CAN_NOT_SEND;
+    }
+    return doh_query_batch(dispatcher.get(), netId, queries.data(), queries.size(), timeoutMs);
+}
+
 ssize_t PrivateDnsConfiguration::dohQuery(unsigned netId, const Slice query, const Slice answer,
                                           uint64_t timeoutMs) {
+    std::shared_ptr<DohDispatcher> dispatcher;
     {
         std::lock_guard guard(mPrivateDnsLock);
-        // It's safe because mDohDispatcher won't be deleted after initializing.
-        if (mDohDispatcher == nullptr) return DOH_RESULT_CAN_NOT_SEND;
+        dispatcher = mDohDispatcher;
+        if (dispatcher == nullptr) return DOH_RESULT_CAN_NOT_SEND;
     }
-    return doh_query(mDohDispatcher, netId, query.base(), query.size(), answer.base(),
-                     answer.size(), timeoutMs);
+    const auto send = [&]() {
+        return doh_query(dispatcher.get(), netId, query.base(), query.size(), answer.base(),
+                         answer.size(), timeoutMs);
+    };
+    if (Experiments::getInstance()->getFlag("doh_coalesce_queries", 0) != 1) return send();
+    std::string key = getQueryCoalescingKey(std::span<const uint8_t>(query.base(), query.size()));
+    if (key.empty()) return send();
+
+    std::unique_lock lock(mDohFlightsLock);
+    const auto [it, inserted] = mDohFlights.try_emplace({netId, std::move(key)});
+    if (!inserted) {
+        const std::shared_ptr<DohFlight> flight = it->second;
+        if (!mDohFlightsCv.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                                    [&]() REQUIRES(mDohFlightsLock) { return flight->done; })) {
+            return DOH_RESULT_TIMEOUT;
+        }
+        if (flight->result <= 0) return flight->result;
+        if (flight->answer.size() > answer.size()) return DOH_RESULT_INTERNAL_ERROR;
+        std::copy(flight->answer.begin(), flight->answer.end(), answer.base());
+        // The ID of this query.
+        answer.base()[0] = query.base()[0];
+        answer.base()[1] = query.base()[1];
+        return flight->result;
+    }
+
+    const auto flight = std::make_shared<DohFlight>();
+    it->second = flight;
+    lock.unlock();
+    const ssize_t result = send();
+    lock.lock();
+    flight->done = true;
+    flight->result = result;
+    if (result > 0) flight->answer.assign(answer.base(), answer.base() + result);
+    // Only this thread erases its entry.
+    mDohFlights.erase(it);
+    mDohFlightsCv.notify_all();
+    return result;
 }
 
 void PrivateDnsConfiguration::onDohStatusUpdate(uint32_t netId, bool success, const char* ipAddr,
@@ -556,6 +762,7 @@ void PrivateDnsConfiguration::onDohStatusUpdate(uint32_t netId, bool success, co
     }
     Validation status = success ? Validation::success : Validation::fail;
     it->second.status = status;
+    publishStatusLocked(netId);
     // Send the events to registered listeners.
     ServerIdentity identity = {netdutils::IPSockAddr::toIPSockAddr(ipAddr, kDohPort), host};
     if (needReportEvent(netId, identity, success)) {
@@ -17,9 +17,14 @@
 #pragma once
 
 #include <array>
+#include <chrono>
+#include <condition_variable>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <span>
+#include <string>
 #include <vector>
 
 #include <android-base/format.h>
@@ -34,6 +39,7 @@
 #include "DnsTlsServer.h"
 #include "LockedQueue.h"
 #include "PrivateDnsValidationObserver.h"
+#include "ValidationScheduler.h"
 #include "doh.h"
 
 namespace android {
@@ -76,6 +82,12 @@ class PrivateDnsConfiguration {
 
     // The default value for QUIC max_idle_timeout.
     static constexpr int kDohIdleDefaultTimeoutMs = 55000;
+    // By default, all the queries to a DoH server share one connection.
+    static constexpr int kDohDefaultMaxConnections = 1;
+    static constexpr int kDohMaxConnections = 8;
+    static constexpr int kDohDefaultMaxStreamsPerConnection = 16;
+    // How long the DoH dispatcher, and its runtime threads, are kept once no network uses DoH.
+    static constexpr int kDohDispatcherIdleDefaultMs = 10 * 60 * 1000;
 
     struct ServerIdentity {
         const netdutils::IPSockAddr sockaddr;
@@ -103,19 +115,30 @@ class PrivateDnsConfiguration {
     int set(int32_t netId, uint32_t mark, const std::vector<std::string>& servers,
             const std::string& name, const std::string& caCert) EXCLUDES(mPrivateDnsLock);
 
-    void initDoh() EXCLUDES(mPrivateDnsLock);
-
     int setDoh(int32_t netId, uint32_t mark, const std::vector<std::string>& servers,
                const std::string& name, const std::string& caCert) EXCLUDES(mPrivateDnsLock);
 
-    PrivateDnsStatus getStatus(unsigned netId) const EXCLUDES(mPrivateDnsLock);
+    // Returns the private DNS state of |netId| without taking mPrivateDnsLock or copying it. The
+    // state is an immutable snapshot, replaced whenever the configuration of the network or the
+    // validation state of one of its servers changes.
+    std::shared_ptr<const PrivateDnsStatus> getStatusSnapshot(unsigned netId) const;
+
+    // A copy of getStatusSnapshot().
+    PrivateDnsStatus getStatus(unsigned netId) const;
 
     void clear(unsigned netId) EXCLUDES(mPrivateDnsLock);
 
     void clearDoh(unsigned netId) EXCLUDES(mPrivateDnsLock);
 
+    // With the "doh_coalesce_queries" flag, a query identical to one in flight on |netId|, but
+    // for its ID and the case of its name, waits for the answer to that one instead of being
+    // sent.
     ssize_t dohQuery(unsigned netId, const netdutils::Slice query, const netdutils::Slice answer,
-                     uint64_t timeoutMs) EXCLUDES(mPrivateDnsLock);
+                     uint64_t timeoutMs) EXCLUDES(mPrivateDnsLock, mDohFlightsLock);
+    // Sends |queries| on |netId| together, and waits for all of them; see doh_query_batch().
+    // They aren't coalesced with the queries in flight.
+    ssize_t dohQueryBatch(unsigned netId, std::span<DohBatchQuery> queries, uint64_t timeoutMs)
+            EXCLUDES(mPrivateDnsLock);
 
     // Request the server to be revalidated on a connection tagged with |mark|.
     // Returns a Result to indicate if the request is accepted.
@@ -141,6 +164,11 @@ class PrivateDnsConfiguration {
     // |isRevalidation| is true if this call is due to a revalidation request.
     void startValidation(const ServerIdentity& identity, unsigned netId, bool isRevalidation)
             REQUIRES(mPrivateDnsLock);
+    // Runs a validation pass for |server| on a thread of its own. If another pass is needed, it's
+    // scheduled on the TimerService after the next timeout of |backoff|, with no thread waiting.
+    void runValidation(const ServerIdentity& identity, const DnsTlsServer& server, unsigned netId,
+                       bool isRevalidation, std::shared_ptr<netdutils::BackoffSequence<>> backoff,
+                       bool isRetry);
 
     bool recordPrivateDnsValidation(const ServerIdentity& identity, unsigned netId, bool success,
                                     bool isRevalidation) EXCLUDES(mPrivateDnsLock);
@@ -148,6 +176,13 @@ class PrivateDnsConfiguration {
     void sendPrivateDnsValidationEvent(const ServerIdentity& identity, unsigned netId,
                                        bool success) const REQUIRES(mPrivateDnsLock);
 
+    // Whether to open a connection to |identity|, which has just been validated, ahead of the
+    // first query on |netId|. Only the first "dot_prewarm_connections" servers of a network are
+    // warmed up, and each at most once per kPrewarmInterval, so that a network whose
+    // configuration keeps being applied doesn't keep waking the radio.
+    bool claimPrewarm(const ServerIdentity& identity, unsigned netId) EXCLUDES(mPrivateDnsLock);
+    static constexpr std::chrono::minutes kPrewarmInterval{5};
+
     // Decide if a validation for |server| is needed. Note that servers that have failed
     // multiple validation attempts but for which there is still a validating
     // thread running are marked as being Validation::in_process.
@@ -163,8 +198,15 @@ class PrivateDnsConfiguration {
     base::Result<IPrivateDnsServer*> getPrivateDnsLocked(const ServerIdentity& identity,
                                                          unsigned netId) REQUIRES(mPrivateDnsLock);
 
+    PrivateDnsStatus getStatusLocked(unsigned netId) const REQUIRES(mPrivateDnsLock);
+    // Replaces the snapshot of |netId| with its current state, after any change to it.
+    void publishStatusLocked(unsigned netId) REQUIRES(mPrivateDnsLock);
+
+    // The DoH dispatcher is only created for the first network to use DoH, and deleted after
+    // "doh_dispatcher_idle_ms" without any.
     void initDohLocked() REQUIRES(mPrivateDnsLock);
     void clearDohLocked(unsigned netId) REQUIRES(mPrivateDnsLock);
+    void scheduleDohTeardownLocked() REQUIRES(mPrivateDnsLock);
 
     mutable std::mutex mPrivateDnsLock;
     std::map<unsigned, PrivateDnsMode> mPrivateDnsModes GUARDED_BY(mPrivateDnsLock);
@@ -175,6 +217,20 @@ class PrivateDnsConfiguration {
     // Any pending validation threads will continue running because we have no way to cancel them.
     std::map<unsigned, PrivateDnsTracker> mPrivateDnsTransports GUARDED_BY(mPrivateDnsLock);
 
+    using StatusSnapshots = std::map<unsigned, std::shared_ptr<const PrivateDnsStatus>>;
+    // Copied on write, with mPrivateDnsLock held, and swapped in with std::atomic_store(), so that
+    // readers only need std::atomic_load().
+    std::shared_ptr<const StatusSnapshots> mStatusSnapshots =
+            std::make_shared<const StatusSnapshots>();
+
+    // With the "dot_validation_parallelism" flag, at most that many DoT validations run at a
+    // time, across all networks.
+    ValidationScheduler mValidationScheduler{0};
+
+    // When each server was last warmed up, by network.
+    std::map<unsigned, std::map<ServerIdentity, std::chrono::steady_clock::time_point>> mPrewarms
+            GUARDED_BY(mPrivateDnsLock);
+
     void notifyValidationStateUpdate(const netdutils::IPSockAddr& sockaddr, Validation validation,
                                      uint32_t netId) const REQUIRES(mPrivateDnsLock);
 
@@ -184,7 +240,12 @@ class PrivateDnsConfiguration {
     // TODO: fix the reentrancy problem.
     PrivateDnsValidationObserver* mObserver GUARDED_BY(mPrivateDnsLock);
 
-    DohDispatcher* mDohDispatcher;
+    // Queries hold a reference while they run, so the dispatcher outlives its teardown until
+    // they're done.
+    std::shared_ptr<DohDispatcher> mDohDispatcher GUARDED_BY(mPrivateDnsLock);
+    // Bumped whenever a teardown is scheduled or DoH is set up again, which cancels the teardown
+    // scheduled before.
+    uint64_t mDohTeardownGeneration GUARDED_BY(mPrivateDnsLock) = 0;
 
     friend class PrivateDnsConfigurationTest;
 
@@ -275,6 +336,18 @@ class PrivateDnsConfiguration {
     };
 
     LockedRingBuffer<RecordEntry> mPrivateDnsLog{100};
+
+    // The outcome of a coalesced DoH query, guarded by mDohFlightsLock.
+    struct DohFlight {
+        bool done = false;
+        ssize_t result = DOH_RESULT_INTERNAL_ERROR;
+        std::vector<uint8_t> answer;
+    };
+    std::mutex mDohFlightsLock;
+    std::condition_variable mDohFlightsCv;
+    // Keyed by netId and coalescing key.
+    std::map<std::pair<unsigned, std::string>, std::shared_ptr<DohFlight>> mDohFlights
+            GUARDED_BY(mDohFlightsLock);
 };
 
 }  // namespace net
@@ -150,6 +150,28 @@ TEST_F(PrivateDnsConfigurationTest, ValidationSuccess) {
     ASSERT_TRUE(PollForCondition([&]() { return mObserver.runningThreads == 0; }));
 }
 
+TEST_F(PrivateDnsConfigurationTest, StatusSnapshot) {
+    testing::InSequence seq;
+    EXPECT_CALL(mObserver, onValidationStateUpdate(kServer1, Validation::in_process, kNetId));
+    EXPECT_CALL(mObserver, onValidationStateUpdate(kServer1, Validation::success, kNetId));
+
+    const auto off = mPdc.getStatusSnapshot(kNetId);
+    EXPECT_EQ(PrivateDnsMode::OFF, off->mode);
+    EXPECT_EQ(mPdc.set(kNetId, kMark, {kServer1}, {}, {}), 0);
+    expectPrivateDnsStatus(PrivateDnsMode::OPPORTUNISTIC);
+    ASSERT_TRUE(PollForCondition([&]() { return mObserver.runningThreads == 0; }));
+
+    // Snapshots are replaced rather than modified, and only when something changes.
+    const auto validated = mPdc.getStatusSnapshot(kNetId);
+    EXPECT_EQ(PrivateDnsMode::OFF, off->mode);
+    EXPECT_EQ(validated, mPdc.getStatusSnapshot(kNetId));
+    EXPECT_EQ(1U, validated->validatedServers().size());
+
+    mPdc.clear(kNetId);
+    EXPECT_EQ(PrivateDnsMode::OFF, mPdc.getStatusSnapshot(kNetId)->mode);
+    EXPECT_EQ(PrivateDnsMode::OPPORTUNISTIC, validated->mode);
+}
+
 TEST_F(PrivateDnsConfigurationTest, ValidationFail_Opportunistic) {
     ASSERT_TRUE(backend.stopServer());
 
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "QueryPriority.h"
+
+#include <atomic>
+
+#include <cutils/misc.h>  // FIRST_APPLICATION_UID
+#include <cutils/multiuser.h>
+
+#include "Experiments.h"
+
+namespace android::net {
+
+const char* queryPriorityName(QueryPriority priority) {
+    switch (priority) {
+        case QueryPriority::FOREGROUND:
+            return "foreground";
+        case QueryPriority::SYSTEM:
+            return "system";
+        case QueryPriority::BACKGROUND:
+            return "background";
+    }
+    return "unknown";
+}
+
+QueryPriorities& QueryPriorities::getInstance() {
+    static QueryPriorities instance;
+    return instance;
+}
+
+void QueryPriorities::setForegroundUids(const std::vector<int32_t>& uids) {
+    auto foreground = std::make_shared<const std::unordered_set<uid_t>>(uids.begin(), uids.end());
+    std::atomic_store(&mForegroundUids, std::move(foreground));
+}
+
+QueryPriority QueryPriorities::classify(uid_t uid) const {
+    if (std::atomic_load(&mForegroundUids)->contains(uid)) return QueryPriority::FOREGROUND;
+    // System uids of every user.
+    if (multiuser_get_app_id(uid) < FIRST_APPLICATION_UID) return QueryPriority::SYSTEM;
+    return QueryPriority::BACKGROUND;
+}
+
+QueryPriority QueryPriorities::forUid(uid_t uid) {
+    if (Experiments::getInstance()->getFlag("query_priority_scheduling", 0) != 1) {
+        return QueryPriority::FOREGROUND;
+    }
+    return getInstance().classify(uid);
+}
+
+}  // namespace android::net
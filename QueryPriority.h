@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+namespace android::net {
+
+// The classes of DnsProxyListener requests, highest priority first.
+enum class QueryPriority {
+    FOREGROUND,
+    SYSTEM,
+    BACKGROUND,
+};
+inline constexpr size_t kQueryPriorityCount = static_cast<size_t>(QueryPriority::BACKGROUND) + 1;
+
+const char* queryPriorityName(QueryPriority priority);
+
+// Classifies requests by the uid they're made for: the foreground apps set by the network stack,
+// then system uids, then all other apps. This class is thread-safe.
+class QueryPriorities {
+  public:
+    static QueryPriorities& getInstance();
+
+    void setForegroundUids(const std::vector<int32_t>& uids);
+    QueryPriority classify(uid_t uid) const;
+
+    // The class of requests for |uid|, or FOREGROUND for all of them if the
+    // "query_priority_scheduling" flag isn't set, as if they all had the same priority.
+    static QueryPriority forUid(uid_t uid);
+
+  private:
+    // Replaced as a whole, so that classify() doesn't lock.
+    std::shared_ptr<const std::unordered_set<uid_t>> mForegroundUids =
+            std::make_shared<const std::unordered_set<uid_t>>();
+};
+
+}  // namespace android::net
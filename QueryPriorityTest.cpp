@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "QueryPriority.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class QueryPriorityTest : public ResolvTestBase {};
+
+TEST_F(QueryPriorityTest, Classify) {
+    QueryPriorities priorities;
+    EXPECT_EQ(QueryPriority::SYSTEM, priorities.classify(0));
+    EXPECT_EQ(QueryPriority::SYSTEM, priorities.classify(1000));
+    // AID_SYSTEM of user 10.
+    EXPECT_EQ(QueryPriority::SYSTEM, priorities.classify(1001000));
+    EXPECT_EQ(QueryPriority::BACKGROUND, priorities.classify(10050));
+
+    priorities.setForegroundUids({10050, 1000});
+    EXPECT_EQ(QueryPriority::FOREGROUND, priorities.classify(10050));
+    EXPECT_EQ(QueryPriority::FOREGROUND, priorities.classify(1000));
+    // Only the uid itself, not the same app of another user.
+    EXPECT_EQ(QueryPriority::BACKGROUND, priorities.classify(1010050));
+
+    priorities.setForegroundUids({});
+    EXPECT_EQ(QueryPriority::BACKGROUND, priorities.classify(10050));
+}
+
+TEST_F(QueryPriorityTest, DisabledByDefault) {
+    QueryPriorities::getInstance().setForegroundUids({10050});
+    EXPECT_EQ(QueryPriority::FOREGROUND, QueryPriorities::forUid(10051));
+    EXPECT_EQ(QueryPriority::FOREGROUND, QueryPriorities::forUid(1000));
+    QueryPriorities::getInstance().setForegroundUids({});
+}
+
+}  // namespace android::net
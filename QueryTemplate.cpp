@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "QueryTemplate.h"
+
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include "QueryTrace.h"
+#include "resolv_private.h"
+
+namespace android::net {
+
+namespace {
+
+void putBE16(uint8_t* p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+}  // namespace
+
+QueryTemplate::QueryTemplate(const char* name, uint32_t netcontextFlags)
+    : mName(name), mNetcontextFlags(netcontextFlags) {
+    mQuestionEnd = res_nmkquery(QUERY, name, ns_c_in, ns_t_a, {}, mPacket, netcontextFlags);
+    if (mQuestionEnd <= 0) {
+        mQuestionEnd = 0;
+        return;
+    }
+    mSize = res_nopt(netcontextFlags, mQuestionEnd, mPacket, 0);
+    if (mSize <= 0) mQuestionEnd = 0;
+}
+
+int QueryTemplate::make(int cl, int type, bool edns, int anslen, std::span<uint8_t> buf) const {
+    if (mQuestionEnd == 0) return -1;
+    const size_t size = edns ? mSize : mQuestionEnd;
+    if (buf.size() < size) {
+        // res_nopt() pads less to fit the buffer: let it.
+        const int n = res_nmkquery(QUERY, mName.c_str(), cl, type, {}, buf, mNetcontextFlags);
+        if (n <= 0 || !edns) return n;
+        return res_nopt(mNetcontextFlags, n, buf, anslen);
+    }
+
+    ScopedStageTimer timer(QueryStage::QUERY_BUILD);
+    memcpy(buf.data(), mPacket.data(), size);
+    putBE16(&buf[0], arc4random_uniform(65536));
+    putBE16(&buf[mQuestionEnd - 2 * INT16SZ], type);
+    putBE16(&buf[mQuestionEnd - INT16SZ], cl);
+    if (edns) {
+        // The CLASS of the OPT record, after its root name and TYPE.
+        putBE16(&buf[mQuestionEnd + 1 + INT16SZ], std::min(anslen, 0xffff));
+    } else {
+        // ARCOUNT
+        putBE16(&buf[10], 0);
+    }
+    return size;
+}
+
+}  // namespace android::net
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <span>
+#include <string>
+
+namespace android::net {
+
+// The queries of a lookup for one name, e.g. A and AAAA, and again without EDNS0 if the server
+// rejects it. The name and EDNS0 OPT record, with its padding, are encoded once; each query is
+// then a copy of them with the ID, type, class and UDP payload size patched in.
+class QueryTemplate {
+  public:
+    // For queries made with these NET_CONTEXT_FLAG_* flags. The query can't be made, as with
+    // res_nmkquery(), if |name| isn't a valid domain name.
+    QueryTemplate(const char* name, uint32_t netcontextFlags);
+
+    // Writes the query that res_nmkquery(QUERY, name, cl, type, {}, buf, netcontextFlags) makes,
+    // followed by res_nopt(netcontextFlags, ..., anslen) if |edns|, into |buf|. Returns its length,
+    // or -1 if it can't be made.
+    int make(int cl, int type, bool edns, int anslen, std::span<uint8_t> buf) const;
+
+    // HFIXEDSZ + MAXCDNAME + QFIXEDSZ, and the OPT record padded to a multiple of 128 bytes: large
+    // enough for any query that make() writes.
+    static constexpr size_t kMaxSize = 512;
+
+  private:
+    const std::string mName;
+    const uint32_t mNetcontextFlags;
+    std::array<uint8_t, kMaxSize> mPacket;
+    // The query without the OPT record, and with it. 0 if the query can't be made.
+    int mQuestionEnd = 0;
+    int mSize = 0;
+};
+
+}  // namespace android::net
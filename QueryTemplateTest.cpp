@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "QueryTemplate.h"
+
+#include <arpa/nameser.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "resolv_private.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class QueryTemplateTest : public ResolvTestBase {
+  protected:
+    // What the resolver built before templates, with the ID cleared.
+    static std::vector<uint8_t> expected(const char* name, int cl, int type, uint32_t flags,
+                                         bool edns, int anslen, size_t bufsize = MAXPACKET) {
+        std::vector<uint8_t> buf(bufsize);
+        int n = res_nmkquery(QUERY, name, cl, type, {}, buf, flags);
+        if (n > 0 && edns) n = res_nopt(flags, n, buf, anslen);
+        if (n <= 0) return {};
+        buf.resize(n);
+        buf[0] = buf[1] = 0;
+        return buf;
+    }
+
+    static std::vector<uint8_t> made(const QueryTemplate& query, int cl, int type, bool edns,
+                                     int anslen, size_t bufsize = MAXPACKET) {
+        std::vector<uint8_t> buf(bufsize);
+        const int n = query.make(cl, type, edns, anslen, buf);
+        if (n <= 0) return {};
+        buf.resize(n);
+        buf[0] = buf[1] = 0;
+        return buf;
+    }
+};
+
+TEST_F(QueryTemplateTest, MatchesMkquery) {
+    const char* const names[] = {"a.com", "www.example.com", "", ".",
+                                 "a-very-long-label-to-cross-one-padding-block.example.co.uk"};
+    const uint32_t flags[] = {0, NET_CONTEXT_FLAG_USE_EDNS, NET_CONTEXT_FLAG_USE_DNS_OVER_TLS};
+    const int types[] = {ns_t_a, ns_t_aaaa, ns_t_ptr};
+    for (const char* name : names) {
+        for (uint32_t flag : flags) {
+            SCOPED_TRACE(std::string(name) + " flags=" + std::to_string(flag));
+            const QueryTemplate query(name, flag);
+            for (int type : types) {
+                for (bool edns : {true, false}) {
+                    for (int anslen : {512, 4096, 70000}) {
+                        EXPECT_EQ(expected(name, ns_c_in, type, flag, edns, anslen),
+                                  made(query, ns_c_in, type, edns, anslen));
+                    }
+                }
+            }
+            EXPECT_EQ(expected(name, ns_c_chaos, ns_t_txt, flag, true, 1232),
+                      made(query, ns_c_chaos, ns_t_txt, true, 1232));
+        }
+    }
+}
+
+TEST_F(QueryTemplateTest, SmallBuffer) {
+    const QueryTemplate query("www.example.com", NET_CONTEXT_FLAG_USE_EDNS);
+    // Too small for the padding of the template, so the padding is cut short.
+    EXPECT_EQ(expected("www.example.com", ns_c_in, ns_t_a, NET_CONTEXT_FLAG_USE_EDNS, true, 512,
+                       100),
+              made(query, ns_c_in, ns_t_a, true, 512, 100));
+    std::vector<uint8_t> tiny(20);
+    EXPECT_EQ(-1, query.make(ns_c_in, ns_t_a, true, 512, tiny));
+}
+
+TEST_F(QueryTemplateTest, InvalidName) {
+    // A label longer than 63 characters.
+    const std::string name(64, 'a');
+    const QueryTemplate query(name.c_str(), 0);
+    std::vector<uint8_t> buf(MAXPACKET);
+    EXPECT_EQ(-1, query.make(ns_c_in, ns_t_a, false, 512, buf));
+}
+
+}  // namespace android::net
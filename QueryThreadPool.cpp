@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "QueryThreadPool.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include "Experiments.h"
+#include "util.h"
+
+namespace android::net {
+
+using android::base::StringPrintf;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+
+namespace {
+
+void* runOwnThread(void* arg) {
+    std::unique_ptr<QueryThreadPool::Task> task(static_cast<QueryThreadPool::Task*>(arg));
+    (*task)();
+    return nullptr;
+}
+
+// Runs |task| on a new detached thread named |threadName|. Returns 0, or a negative errno.
+int startOwnThread(QueryThreadPool::Task task, const std::string& threadName) {
+    auto ownTask = std::make_unique<QueryThreadPool::Task>(std::move(task));
+    pthread_t thread;
+    if (const int rval = pthread_create(&thread, nullptr, runOwnThread, ownTask.get()); rval != 0) {
+        return -rval;
+    }
+    ownTask.release();
+    pthread_setname_np(thread, threadName.substr(0, 15).c_str());
+    pthread_detach(thread);
+    return 0;
+}
+
+// Background tasks running on threads of their own because there's no pool.
+std::atomic<size_t> sUnpooledBackgroundThreads = 0;
+
+}  // namespace
+
+QueryThreadPool::QueryThreadPool(size_t numWorkers, bool pinned)
+    : mPinned(pinned), mIdle(numWorkers) {
+    for (size_t i = 0; i < numWorkers; i++) mWorkers.push_back(std::make_unique<Worker>());
+    for (size_t i = 0; i < numWorkers; i++) {
+        mWorkers[i]->thread = std::thread(&QueryThreadPool::loop, this, i);
+    }
+}
+
+QueryThreadPool::~QueryThreadPool() {
+    {
+        std::lock_guard guard(mMutex);
+        mStopping = true;
+        for (const auto& worker : mWorkers) worker->waiting = false;
+    }
+    for (const auto& worker : mWorkers) worker->cv.notify_one();
+    for (const auto& worker : mWorkers) worker->thread.join();
+}
+
+QueryThreadPool* QueryThreadPool::getInstance() {
+    // Never deleted, as workers may still be blocked in a query at exit.
+    static QueryThreadPool* instance = []() -> QueryThreadPool* {
+        const auto experiments = Experiments::getInstance();
+        if (experiments->getFlag("query_thread_pool", 0) != 1) return nullptr;
+        return new QueryThreadPool(std::max(1U, std::thread::hardware_concurrency()),
+                                   experiments->getFlag("listener_shards", 0) > 0);
+    }();
+    return instance;
+}
+
+int QueryThreadPool::execute(Task task, const std::string& threadName, QueryPriority priority) {
+    const bool background = priority == QueryPriority::BACKGROUND;
+    bool queued = false;
+    Worker* wake = nullptr;
+    {
+        std::lock_guard guard(mMutex);
+        PriorityStats& byPriority = mStats.byPriority[static_cast<size_t>(priority)];
+        const size_t queuedBackground =
+                mStats.byPriority[static_cast<size_t>(QueryPriority::BACKGROUND)].queueDepth;
+        const size_t ahead = background ? mStats.queueDepth : mStats.queueDepth - queuedBackground;
+        if (ahead < mIdle || (background && *mBackgroundOwnThreads >= mWorkers.size())) {
+            mStats.queueDepth++;
+            byPriority.queueDepth++;
+            mStats.maxQueueDepth = std::max(mStats.maxQueueDepth, mStats.queueDepth);
+            const int cpu = mPinned ? sched_getcpu() : -1;
+            const size_t index = cpu >= 0 ? size_t(cpu) : mNextWorker++;
+            Worker& worker = *mWorkers[index % mWorkers.size()];
+            {
+                std::lock_guard workerGuard(worker.mutex);
+                worker.queues[static_cast<size_t>(priority)].push_back(
+                        {std::move(task), clock::now(), priority});
+            }
+            queued = true;
+            // The worker the task was queued on if it's idle, as it looks at its own queue
+            // first, or any other idle one, which takes it from there.
+            if (worker.waiting) {
+                wake = &worker;
+            } else {
+                for (const auto& other : mWorkers) {
+                    if (other->waiting) {
+                        wake = other.get();
+                        break;
+                    }
+                }
+            }
+            if (wake != nullptr) wake->waiting = false;
+        } else {
+            mStats.overflowed++;
+            if (background) ++*mBackgroundOwnThreads;
+        }
+    }
+    if (queued) {
+        if (wake != nullptr) wake->cv.notify_one();
+        return 0;
+    }
+
+    if (background) {
+        task = [task = std::move(task), ownThreads = mBackgroundOwnThreads] {
+            task();
+            --*ownThreads;
+        };
+    }
+    // All workers are busy, and may well stay so for seconds.
+    const int rval = startOwnThread(std::move(task), threadName);
+    if (rval != 0 && background) --*mBackgroundOwnThreads;
+    return rval;
+}
+
+int QueryThreadPool::executeBackground(Task task, const std::string& threadName) {
+    if (QueryThreadPool* pool = getInstance(); pool != nullptr) {
+        return pool->execute(std::move(task), threadName, QueryPriority::BACKGROUND);
+    }
+    const size_t maxThreads = std::max(1U, std::thread::hardware_concurrency());
+    if (sUnpooledBackgroundThreads.fetch_add(1) >= maxThreads) {
+        sUnpooledBackgroundThreads--;
+        return -EBUSY;
+    }
+    const int rval = startOwnThread(
+            [task = std::move(task)] {
+                task();
+                sUnpooledBackgroundThreads--;
+            },
+            threadName);
+    if (rval != 0) sUnpooledBackgroundThreads--;
+    return rval;
+}
+
+void QueryThreadPool::loop(size_t index) {
+    pthread_setname_np(pthread_self(), StringPrintf("DnsWorker%zu", index).c_str());
+    if (mPinned && pinToAllowedCore(index) < 0) {
+        LOG(INFO) << "Worker " << index << " isn't pinned";
+    }
+    Worker& worker = *mWorkers[index];
+    for (;;) {
+        Queued queued;
+        if (!take(index, &queued)) {
+            std::unique_lock lock(mMutex);
+            if (mStats.queueDepth > 0) continue;
+            if (mStopping) return;
+            worker.waiting = true;
+            worker.cv.wait(lock, [&worker] { return !worker.waiting; });
+            continue;
+        }
+
+        const auto wait = clock::now() - queued.enqueued;
+        PriorityStats* byPriority;
+        {
+            std::lock_guard guard(mMutex);
+            byPriority = &mStats.byPriority[static_cast<size_t>(queued.priority)];
+            mStats.queueDepth--;
+            byPriority->queueDepth--;
+            mIdle--;
+            mStats.totalWait += wait;
+            mStats.maxWait = std::max(mStats.maxWait, wait);
+            byPriority->totalWait += wait;
+            byPriority->maxWait = std::max(byPriority->maxWait, wait);
+        }
+        queued.task();
+        {
+            std::lock_guard guard(mMutex);
+            mIdle++;
+            mStats.executed++;
+            byPriority->executed++;
+        }
+    }
+}
+
+bool QueryThreadPool::take(size_t index, Queued* queued) {
+    for (size_t priority = 0; priority < kQueryPriorityCount; priority++) {
+        for (size_t i = 0; i < mWorkers.size(); i++) {
+            Worker& worker = *mWorkers[(index + i) % mWorkers.size()];
+            std::lock_guard guard(worker.mutex);
+            std::deque<Queued>& queue = worker.queues[priority];
+            if (queue.empty()) continue;
+            // Oldest first, stolen or not, as every task is a client waiting for its answer.
+            *queued = std::move(queue.front());
+            queue.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+QueryThreadPool::Stats QueryThreadPool::getStats() const {
+    std::lock_guard guard(mMutex);
+    return mStats;
+}
+
+void QueryThreadPool::dump(netdutils::DumpWriter& dw) const {
+    const Stats stats = getStats();
+    const clock::duration avgWait =
+            stats.executed > 0 ? stats.totalWait / static_cast<int64_t>(stats.executed)
+                               : clock::duration{};
+    dw.println("Query thread pool: %zu workers", mWorkers.size());
+    netdutils::ScopedIndent indent(dw);
+    dw.println("executed: %" PRIu64 ", on own thread: %" PRIu64, stats.executed, stats.overflowed);
+    dw.println("queue depth: %zu, max %zu", stats.queueDepth, stats.maxQueueDepth);
+    dw.println("wait: avg %lldus, max %lldus",
+               static_cast<long long>(duration_cast<microseconds>(avgWait).count()),
+               static_cast<long long>(duration_cast<microseconds>(stats.maxWait).count()));
+    for (size_t i = 0; i < kQueryPriorityCount; i++) {
+        const PriorityStats& byPriority = stats.byPriority[i];
+        if (byPriority.executed == 0 && byPriority.queueDepth == 0) continue;
+        const clock::duration avg = byPriority.executed > 0
+                                            ? byPriority.totalWait /
+                                                      static_cast<int64_t>(byPriority.executed)
+                                            : clock::duration{};
+        dw.println("%s: executed %" PRIu64 ", queued %zu, wait avg %lldus, max %lldus",
+                   queryPriorityName(static_cast<QueryPriority>(i)), byPriority.executed,
+                   byPriority.queueDepth,
+                   static_cast<long long>(duration_cast<microseconds>(avg).count()),
+                   static_cast<long long>(
+                           duration_cast<microseconds>(byPriority.maxWait).count()));
+    }
+}
+
+}  // namespace android::net
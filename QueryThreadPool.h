@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/DumpWriter.h>
+
+#include "QueryPriority.h"
+
+namespace android::net {
+
+// Runs the DnsProxyListener handlers on a fixed set of worker threads, one per core, instead of
+// starting a thread for each of them. Each worker has its own queue, and takes work from the
+// other queues when its own is empty.
+//
+// A handler may block for as long as its DNS queries take, so tasks are never left waiting
+// behind it: when there aren't more idle workers than queued tasks, a task gets a thread of its
+// own as before. This class is thread-safe.
+//
+// Workers take queued tasks by QueryPriority, highest first. Tasks of a higher priority don't
+// count the BACKGROUND ones queued ahead of them, so they are never left waiting behind them.
+// BACKGROUND tasks get threads of their own only up to one per worker, and then wait for a
+// worker, so that background storms don't start threads without bound.
+//
+// Pinned, worker i runs on the i-th core netd may run on, and a task is queued on the worker of
+// the core it's executed from, and wakes that worker if it's idle: a handler started by a
+// ClientShards shard runs on the core its client is served on, unless that worker is busy and
+// another one takes it. When netd may only run on some of the cores, the workers are left to the
+// scheduler, like the shards.
+class QueryThreadPool {
+  public:
+    using clock = std::chrono::steady_clock;
+    using Task = std::function<void()>;
+
+    struct PriorityStats {
+        // Those executed by workers.
+        uint64_t executed = 0;
+        size_t queueDepth = 0;
+        clock::duration totalWait{};
+        clock::duration maxWait{};
+    };
+
+    struct Stats {
+        uint64_t executed = 0;
+        // Tasks that got a thread of their own because all workers were busy.
+        uint64_t overflowed = 0;
+        size_t queueDepth = 0;
+        size_t maxQueueDepth = 0;
+        clock::duration totalWait{};
+        clock::duration maxWait{};
+        // Indexed by QueryPriority.
+        std::array<PriorityStats, kQueryPriorityCount> byPriority{};
+    };
+
+    explicit QueryThreadPool(size_t numWorkers, bool pinned = false);
+    // Runs the tasks still queued, then stops the workers.
+    ~QueryThreadPool();
+
+    // Returns the pool, or nullptr if handlers get a thread each. Whether the pool is used, and
+    // pinned, is decided by the "query_thread_pool" and "listener_shards" flags on first call.
+    static QueryThreadPool* getInstance();
+
+    // Runs |task| on a worker, or on a new thread named |threadName| if none is free. Returns 0,
+    // or a negative errno if that thread couldn't be started, in which case |task| is dropped.
+    int execute(Task task, const std::string& threadName,
+                QueryPriority priority = QueryPriority::FOREGROUND) EXCLUDES(mMutex);
+
+    // Runs |task| at BACKGROUND priority on the pool if there is one, or else on a new thread
+    // named |threadName| unless there are already one per core of those. Returns 0, or a negative
+    // errno if |task| was dropped. For work nobody waits for, like cache refreshes.
+    static int executeBackground(Task task, const std::string& threadName);
+
+    Stats getStats() const EXCLUDES(mMutex);
+    void dump(netdutils::DumpWriter& dw) const EXCLUDES(mMutex);
+
+  private:
+    struct Queued {
+        Task task;
+        clock::time_point enqueued;
+        QueryPriority priority;
+    };
+    struct Worker {
+        std::mutex mutex;
+        // Indexed by QueryPriority.
+        std::array<std::deque<Queued>, kQueryPriorityCount> queues GUARDED_BY(mutex);
+        std::thread thread;
+        // Notified with |waiting| cleared, to wake the idle worker up. |waiting| is guarded by
+        // QueryThreadPool::mMutex.
+        std::condition_variable cv;
+        bool waiting = false;
+    };
+
+    void loop(size_t index) EXCLUDES(mMutex);
+    // Takes the oldest task of the highest priority, from worker |index| first.
+    bool take(size_t index, Queued* queued);
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    const bool mPinned;
+    std::atomic<size_t> mNextWorker = 0;
+    mutable std::mutex mMutex;
+    size_t mIdle GUARDED_BY(mMutex);
+    bool mStopping GUARDED_BY(mMutex) = false;
+    Stats mStats GUARDED_BY(mMutex);
+    // BACKGROUND tasks running on threads of their own. Shared with those threads, which don't
+    // know whether the pool is still there when they finish.
+    const std::shared_ptr<std::atomic<size_t>> mBackgroundOwnThreads =
+            std::make_shared<std::atomic<size_t>>(0);
+};
+
+}  // namespace android::net
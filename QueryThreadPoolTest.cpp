@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <future>
+#include <set>
+
+#include <gtest/gtest.h>
+
+#include "QueryThreadPool.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+
+class QueryThreadPoolTest : public ResolvTestBase {};
+
+TEST_F(QueryThreadPoolTest, ReusesWorkers) {
+    constexpr int kTasks = 100;
+    std::set<std::thread::id> threads;
+    {
+        QueryThreadPool pool(2);
+        std::mutex mutex;
+        for (int i = 0; i < kTasks; i++) {
+            std::promise<void> done;
+            EXPECT_EQ(0, pool.execute(
+                                 [&]() {
+                                     std::lock_guard guard(mutex);
+                                     threads.insert(std::this_thread::get_id());
+                                     done.set_value();
+                                 },
+                                 "test"));
+            done.get_future().wait();
+            // Until the worker is done with it, it's not idle.
+            while (pool.getStats().executed < static_cast<uint64_t>(i + 1)) {
+                std::this_thread::yield();
+            }
+        }
+        const QueryThreadPool::Stats stats = pool.getStats();
+        EXPECT_EQ(0U, stats.overflowed);
+        EXPECT_EQ(1U, stats.maxQueueDepth);
+    }
+    EXPECT_LE(threads.size(), 2U);
+}
+
+TEST_F(QueryThreadPoolTest, BlockingTasksGetTheirOwnThread) {
+    QueryThreadPool pool(2);
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::atomic<int> started = 0;
+    // More blocked tasks than workers: none of them waits for another to finish.
+    constexpr int kTasks = 5;
+    for (int i = 0; i < kTasks; i++) {
+        ASSERT_EQ(0, pool.execute(
+                             [&, released]() {
+                                 started++;
+                                 released.wait();
+                             },
+                             "blocking"));
+    }
+    for (int i = 0; i < 200 && started < kTasks; i++) std::this_thread::sleep_for(10ms);
+    EXPECT_EQ(kTasks, started);
+    EXPECT_LE(static_cast<uint64_t>(kTasks - 2), pool.getStats().overflowed);
+    release.set_value();
+}
+
+TEST_F(QueryThreadPoolTest, DrainsQueueOnDestruction) {
+    std::atomic<int> ran = 0;
+    {
+        QueryThreadPool pool(4);
+        for (int i = 0; i < 4; i++) {
+            pool.execute([&]() { ran++; }, "test");
+        }
+    }
+    EXPECT_EQ(4, ran);
+}
+
+TEST_F(QueryThreadPoolTest, BackgroundTasksWaitForWorkers) {
+    QueryThreadPool pool(1);
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::atomic<int> started = 0;
+    const auto blocking = [&, released]() {
+        started++;
+        released.wait();
+    };
+    // One on the worker, and one on a thread of its own: as many as there are workers.
+    ASSERT_EQ(0, pool.execute(blocking, "blocking", QueryPriority::BACKGROUND));
+    for (int i = 0; i < 200 && started < 1; i++) std::this_thread::sleep_for(10ms);
+    ASSERT_EQ(0, pool.execute(blocking, "blocking", QueryPriority::BACKGROUND));
+
+    // Further background tasks wait...
+    std::atomic<int> background = 0;
+    ASSERT_EQ(0, pool.execute([&]() { background++; }, "bg", QueryPriority::BACKGROUND));
+    // ...but the others don't.
+    std::promise<void> foreground;
+    ASSERT_EQ(0, pool.execute([&]() { foreground.set_value(); }, "fg", QueryPriority::FOREGROUND));
+    EXPECT_EQ(std::future_status::ready, foreground.get_future().wait_for(2s));
+    EXPECT_EQ(0, background);
+    const QueryThreadPool::Stats stats = pool.getStats();
+    EXPECT_EQ(1U, stats.byPriority[static_cast<size_t>(QueryPriority::BACKGROUND)].queueDepth);
+    EXPECT_EQ(2U, stats.overflowed);
+
+    release.set_value();
+    for (int i = 0; i < 200 && background < 1; i++) std::this_thread::sleep_for(10ms);
+    EXPECT_EQ(1, background);
+}
+
+TEST_F(QueryThreadPoolTest, PinnedRunsOnCallingCore) {
+    const size_t cores = std::thread::hardware_concurrency();
+    if (cores < 2) GTEST_SKIP() << "Needs several cores";
+    cpu_set_t allowed;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+    if (CPU_COUNT(&allowed) < sysconf(_SC_NPROCESSORS_ONLN)) {
+        GTEST_SKIP() << "Workers aren't pinned when only some cores are allowed";
+    }
+    QueryThreadPool pool(cores, true);
+    for (const int core : {0, static_cast<int>(cores) - 1}) {
+        // Until all the workers wait for tasks, or one that doesn't yet may take it first.
+        std::this_thread::sleep_for(100ms);
+        int ranOn = -1;
+        std::thread caller([&]() {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(core, &cpus);
+            ASSERT_EQ(0, sched_setaffinity(0, sizeof(cpus), &cpus));
+            std::promise<void> done;
+            ASSERT_EQ(0, pool.execute(
+                                 [&]() {
+                                     ranOn = sched_getcpu();
+                                     done.set_value();
+                                 },
+                                 "test"));
+            done.get_future().wait();
+        });
+        caller.join();
+        // All workers are idle, so the one of the caller's core wakes up for the task.
+        EXPECT_EQ(core, ranOn);
+    }
+}
+
+TEST_F(QueryThreadPoolTest, DisabledByDefault) {
+    EXPECT_EQ(nullptr, QueryThreadPool::getInstance());
+}
+
+TEST_F(QueryThreadPoolTest, BackgroundWithoutPoolIsBounded) {
+    ASSERT_EQ(nullptr, QueryThreadPool::getInstance());
+    const size_t maxThreads = std::max(1U, std::thread::hardware_concurrency());
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::atomic<size_t> finished = 0;
+    for (size_t i = 0; i < maxThreads; i++) {
+        ASSERT_EQ(0, QueryThreadPool::executeBackground(
+                             [&, released]() {
+                                 released.wait();
+                                 finished++;
+                             },
+                             "blocking"));
+    }
+    // One per core at most: the next one is dropped.
+    EXPECT_EQ(-EBUSY, QueryThreadPool::executeBackground([] {}, "dropped"));
+
+    release.set_value();
+    for (int i = 0; i < 200 && finished < maxThreads; i++) std::this_thread::sleep_for(10ms);
+    EXPECT_EQ(maxThreads, finished);
+    // The threads are given back once their tasks are done.
+    std::promise<void> ran;
+    for (int i = 0; i < 200; i++) {
+        if (QueryThreadPool::executeBackground([&] { ran.set_value(); }, "again") == 0) break;
+        std::this_thread::sleep_for(10ms);
+    }
+    EXPECT_EQ(std::future_status::ready, ran.get_future().wait_for(2s));
+}
+
+}  // namespace android::net
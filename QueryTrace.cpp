@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "QueryTrace.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+#include "Experiments.h"
+
+namespace android::net {
+
+namespace {
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+
+thread_local QueryTrace* sCurrentTrace = nullptr;
+
+constexpr const char* kStageNames[kQueryStageCount] = {
+        "cache_lookup", "pending_wait", "query_build", "socket_setup",   "upstream_wait",
+        "parse",        "sort",         "dns64",       "response_write",
+};
+
+struct StageTotals {
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> totalUs = 0;
+    std::atomic<uint64_t> maxUs = 0;
+};
+
+std::atomic<uint64_t> sTracedLookups = 0;
+std::array<StageTotals, kQueryStageCount> sTotals;
+
+int32_t toMicros(QueryTrace::clock::duration elapsed) {
+    const int64_t us = duration_cast<microseconds>(elapsed).count();
+    return static_cast<int32_t>(std::min<int64_t>(us, std::numeric_limits<int32_t>::max()));
+}
+
+}  // namespace
+
+QueryTrace* QueryTrace::current() {
+    return sCurrentTrace;
+}
+
+void QueryTrace::report(DnsQueryStages* stages) const {
+    using Setter = void (DnsQueryStages::*)(int32_t);
+    static constexpr Setter kSetters[kQueryStageCount] = {
+            &DnsQueryStages::set_cache_lookup_micros,  &DnsQueryStages::set_pending_wait_micros,
+            &DnsQueryStages::set_query_build_micros,   &DnsQueryStages::set_socket_setup_micros,
+            &DnsQueryStages::set_upstream_wait_micros, &DnsQueryStages::set_parse_micros,
+            &DnsQueryStages::set_sort_micros,          &DnsQueryStages::set_dns64_micros,
+            &DnsQueryStages::set_response_write_micros,
+    };
+    sTracedLookups.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < kQueryStageCount; i++) {
+        if (mElapsed[i] <= clock::duration::zero()) continue;
+        const int32_t us = toMicros(mElapsed[i]);
+        (stages->*kSetters[i])(us);
+
+        StageTotals& totals = sTotals[i];
+        totals.count.fetch_add(1, std::memory_order_relaxed);
+        totals.totalUs.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = totals.maxUs.load(std::memory_order_relaxed);
+        while (static_cast<uint64_t>(us) > max &&
+               !totals.maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+        }
+    }
+}
+
+void QueryTrace::dump(netdutils::DumpWriter& dw) {
+    const uint64_t lookups = sTracedLookups.load(std::memory_order_relaxed);
+    dw.println("Query stages (%" PRIu64 " lookups traced):", lookups);
+    netdutils::ScopedIndent indentStages(dw);
+    for (size_t i = 0; i < kQueryStageCount; i++) {
+        const uint64_t count = sTotals[i].count.load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        dw.println("%s: count=%" PRIu64 " avg=%" PRIu64 "us max=%" PRIu64 "us", kStageNames[i],
+                   count, sTotals[i].totalUs.load(std::memory_order_relaxed) / count,
+                   sTotals[i].maxUs.load(std::memory_order_relaxed));
+    }
+}
+
+ScopedQueryTrace::ScopedQueryTrace()
+    : mEnabled(Experiments::getInstance()->getFlag("query_stage_tracing", 0)) {
+    if (!mEnabled) return;
+    mPrevious = sCurrentTrace;
+    sCurrentTrace = &mTrace;
+}
+
+ScopedQueryTrace::~ScopedQueryTrace() {
+    if (mEnabled) sCurrentTrace = mPrevious;
+}
+
+}  // namespace android::net
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <array>
+#include <chrono>
+
+#include <netdutils/DumpWriter.h>
+
+#include "stats.pb.h"
+
+namespace android::net {
+
+// The stages of a lookup, as in DnsQueryStages.
+enum class QueryStage {
+    CACHE_LOOKUP,
+    PENDING_WAIT,
+    QUERY_BUILD,
+    SOCKET_SETUP,
+    UPSTREAM_WAIT,
+    PARSE,
+    SORT,
+    DNS64,
+    RESPONSE_WRITE,
+};
+inline constexpr size_t kQueryStageCount = static_cast<size_t>(QueryStage::RESPONSE_WRITE) + 1;
+
+// The time a lookup spent in each stage. The trace of the lookup a thread is handling is found
+// with current(), so that the stages are timed as the lookup goes through them without passing it
+// down to every function involved. Stages run on other threads, e.g. the queries res_queryN sends
+// in parallel, aren't traced.
+class QueryTrace {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // The trace of the lookup this thread handles, or nullptr if it isn't traced.
+    static QueryTrace* current();
+
+    void add(QueryStage stage, clock::duration elapsed) {
+        mElapsed[static_cast<size_t>(stage)] += elapsed;
+    }
+    clock::duration get(QueryStage stage) const { return mElapsed[static_cast<size_t>(stage)]; }
+
+    // Sets the stages that took any time in |stages|, and adds them to the totals in the dump.
+    void report(DnsQueryStages* stages) const;
+
+    // Dumps the number of lookups traced, and the average and largest time per stage.
+    static void dump(netdutils::DumpWriter& dw);
+
+  private:
+    std::array<clock::duration, kQueryStageCount> mElapsed{};
+};
+
+// Traces the lookup handled by this thread during its lifetime, if the "query_stage_tracing" flag
+// is set.
+class ScopedQueryTrace {
+  public:
+    ScopedQueryTrace();
+    ~ScopedQueryTrace();
+    ScopedQueryTrace(const ScopedQueryTrace&) = delete;
+    ScopedQueryTrace& operator=(const ScopedQueryTrace&) = delete;
+
+  private:
+    QueryTrace mTrace;
+    QueryTrace* mPrevious = nullptr;
+    bool mEnabled = false;
+};
+
+// Adds the time from its construction to its destruction to |stage| of the current trace.
+class ScopedStageTimer {
+  public:
+    explicit ScopedStageTimer(QueryStage stage) : mTrace(QueryTrace::current()), mStage(stage) {
+        if (mTrace != nullptr) mStart = QueryTrace::clock::now();
+    }
+    ~ScopedStageTimer() {
+        if (mTrace != nullptr) mTrace->add(mStage, QueryTrace::clock::now() - mStart);
+    }
+    ScopedStageTimer(const ScopedStageTimer&) = delete;
+    ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+
+  private:
+    QueryTrace* const mTrace;
+    const QueryStage mStage;
+    QueryTrace::clock::time_point mStart;
+};
+
+}  // namespace android::net
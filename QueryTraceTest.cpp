@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "Experiments.h"
+#include "QueryTrace.h"
+#include "tests/resolv_test_base.h"
+#include "tests/resolv_test_utils.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+
+class QueryTraceTest : public ResolvTestBase {
+  protected:
+    void SetUp() override { Experiments::getInstance()->update(); }
+    void TearDown() override {
+        mFlag.reset();
+        Experiments::getInstance()->update();
+    }
+
+    void enableTracing() {
+        mFlag = std::make_unique<ScopedSystemProperties>(
+                "persist.device_config.netd_native.query_stage_tracing", "1");
+        Experiments::getInstance()->update();
+    }
+
+    std::unique_ptr<ScopedSystemProperties> mFlag;
+};
+
+TEST_F(QueryTraceTest, Disabled) {
+    ScopedQueryTrace trace;
+    EXPECT_EQ(nullptr, QueryTrace::current());
+    // Timing a stage without a trace does nothing.
+    ScopedStageTimer timer(QueryStage::PARSE);
+}
+
+TEST_F(QueryTraceTest, Stages) {
+    enableTracing();
+    EXPECT_EQ(nullptr, QueryTrace::current());
+    {
+        ScopedQueryTrace trace;
+        QueryTrace* current = QueryTrace::current();
+        ASSERT_NE(nullptr, current);
+        for (int i = 0; i < 2; i++) {
+            ScopedStageTimer timer(QueryStage::UPSTREAM_WAIT);
+            std::this_thread::sleep_for(10ms);
+        }
+        EXPECT_GE(current->get(QueryStage::UPSTREAM_WAIT), 20ms);
+        EXPECT_EQ(QueryTrace::clock::duration::zero(), current->get(QueryStage::SORT));
+
+        // Other threads aren't traced.
+        std::thread([] { EXPECT_EQ(nullptr, QueryTrace::current()); }).join();
+
+        DnsQueryStages stages;
+        current->report(&stages);
+        EXPECT_GE(stages.upstream_wait_micros(), 20000);
+        EXPECT_FALSE(stages.has_sort_micros());
+    }
+    EXPECT_EQ(nullptr, QueryTrace::current());
+}
+
+TEST_F(QueryTraceTest, Nested) {
+    enableTracing();
+    ScopedQueryTrace outer;
+    QueryTrace* outerTrace = QueryTrace::current();
+    {
+        ScopedQueryTrace inner;
+        EXPECT_NE(outerTrace, QueryTrace::current());
+        ScopedStageTimer timer(QueryStage::DNS64);
+    }
+    EXPECT_EQ(outerTrace, QueryTrace::current());
+    EXPECT_EQ(QueryTrace::clock::duration::zero(), outerTrace->get(QueryStage::DNS64));
+}
+
+}  // namespace android::net
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "res_comp.h"
+
+#include <arpa/nameser.h>
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+namespace {
+
+// dn_expand() as it was, on top of ns_name_uncompress().
+int referenceExpand(const std::vector<uint8_t>& msg, size_t offset, char* dst, size_t len) {
+    const int n = ns_name_uncompress(msg.data(), msg.data() + msg.size(), msg.data() + offset,
+                                     dst, len);
+    if (n > 0 && dst[0] == '.') dst[0] = '\0';
+    return n;
+}
+
+// A header, then "www.Example.com", "mail" pointing to "example.com", and a pointer to itself.
+std::vector<uint8_t> makeMessage() {
+    std::vector<uint8_t> msg(NS_HFIXEDSZ);
+    const uint8_t names[] = {3, 'w', 'w', 'w', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e',
+                             3, 'c', 'o', 'm', 0, 4, 'm', 'a', 'i', 'l', 0xc0, 16,
+                             0xc0, 36};
+    msg.insert(msg.end(), std::begin(names), std::end(names));
+    return msg;
+}
+
+}  // namespace
+
+class DnExpandTest : public ResolvTestBase {
+  protected:
+    // Expands the name at every offset of |msg| into buffers of several sizes, expecting the
+    // results of ns_name_uncompress().
+    static void expectSameAsReference(const std::vector<uint8_t>& msg) {
+        for (size_t offset = 0; offset < msg.size(); offset++) {
+            for (size_t len : {0, 1, 2, 5, 16, NS_MAXDNAME}) {
+                SCOPED_TRACE("offset=" + std::to_string(offset) + " len=" + std::to_string(len));
+                std::vector<char> expected(len + 1, 'x');
+                std::vector<char> actual(len + 1, 'x');
+                const int n = referenceExpand(msg, offset, expected.data(), len);
+                std::string_view name;
+                ASSERT_EQ(n, dn_expand(msg, msg.data() + offset, {actual.data(), len}, &name));
+                if (n < 0) continue;
+                EXPECT_STREQ(expected.data(), actual.data());
+                EXPECT_EQ(std::string_view(expected.data()), name);
+            }
+        }
+    }
+};
+
+TEST_F(DnExpandTest, Names) {
+    const std::vector<uint8_t> msg = makeMessage();
+    char buf[NS_MAXDNAME];
+    std::string_view name;
+    EXPECT_EQ(17, dn_expand(msg, msg.data() + 12, buf, &name));
+    EXPECT_EQ("www.Example.com", name);
+    EXPECT_EQ(7, dn_expand(msg, msg.data() + 29, buf, &name));
+    EXPECT_EQ("mail.Example.com", name);
+    // The root.
+    EXPECT_EQ(1, dn_expand(msg, msg.data() + 28, buf, &name));
+    EXPECT_EQ("", name);
+    EXPECT_STREQ("", buf);
+    // A loop.
+    EXPECT_EQ(-1, dn_expand(msg, msg.data() + 36, buf, &name));
+    // Past the message.
+    EXPECT_EQ(-1, dn_expand(msg, msg.data() + msg.size(), buf, &name));
+    // The old signature.
+    EXPECT_EQ(7, dn_expand(msg.data(), msg.data() + msg.size(), msg.data() + 29, buf, sizeof(buf)));
+    EXPECT_STREQ("mail.Example.com", buf);
+    expectSameAsReference(msg);
+}
+
+TEST_F(DnExpandTest, Escapes) {
+    std::vector<uint8_t> msg(NS_HFIXEDSZ);
+    const uint8_t names[] = {7, 'a', '.', '\\', '"', ' ', 0x7f, 0xff, 3, 'c', 'o', 'm', 0,
+                             1, 0, 0xc0, 12};
+    msg.insert(msg.end(), std::begin(names), std::end(names));
+    char buf[NS_MAXDNAME];
+    std::string_view name;
+    EXPECT_EQ(13, dn_expand(msg, msg.data() + 12, buf, &name));
+    EXPECT_EQ("a\\.\\\\\\\"\\032\\127\\255.com", name);
+    EXPECT_EQ(4, dn_expand(msg, msg.data() + 25, buf, &name));
+    EXPECT_EQ("\\000.a\\.\\\\\\\"\\032\\127\\255.com", name);
+    expectSameAsReference(msg);
+}
+
+TEST_F(DnExpandTest, LongNames) {
+    std::vector<uint8_t> msg(NS_HFIXEDSZ);
+    // 4 labels of 63 make a name of 257 bytes, which is too long; 3 of them and one of 61 fit.
+    for (int label = 0; label < 4; label++) {
+        msg.push_back(63);
+        msg.insert(msg.end(), 63, 'a' + label);
+    }
+    msg.push_back(0);
+    msg.push_back(61);
+    msg.insert(msg.end(), 61, 'z');
+    msg.push_back(0xc0);
+    msg.push_back(12 + 64);
+    expectSameAsReference(msg);
+    char buf[NS_MAXDNAME];
+    EXPECT_EQ(-1, dn_expand(msg, msg.data() + 12, buf, nullptr));
+    EXPECT_EQ(64, dn_expand(msg, msg.data() + 12 + 4 * 64 + 1, buf, nullptr));
+}
+
+TEST_F(DnExpandTest, RandomMessages) {
+    std::mt19937 rng(42);
+    for (int i = 0; i < 500; i++) {
+        std::vector<uint8_t> msg = makeMessage();
+        // Small bytes make for labels that fit, and 0xc0 for pointers into the message.
+        for (int j = 0; j < 64; j++) {
+            const uint32_t r = rng();
+            msg.push_back((r & 3) == 0   ? 0xc0
+                          : (r & 3) == 1 ? (r >> 8) % msg.size()
+                                         : (r >> 8) % 8);
+        }
+        expectSameAsReference(msg);
+    }
+}
+
+class DnsNameCompressorTest : public ResolvTestBase {
+  protected:
+    static constexpr const char* kNames[] = {
+            "www.example.com", "WWW.EXAMPLE.COM", "mail.example.com", "example.com",
+            "example.org",     "a.b.mail.example.com", "com", "", "x\\.y.example.com",
+            "b.mail.Example.com",
+    };
+
+    // The names written one after the other with dn_comp().
+    static std::vector<uint8_t> withDnComp(size_t size) {
+        std::vector<uint8_t> msg(size);
+        uint8_t* dnptrs[32] = {msg.data()};
+        uint8_t* p = msg.data() + NS_HFIXEDSZ;
+        for (const char* name : kNames) {
+            const int n = dn_comp(name, p, msg.data() + msg.size() - p, dnptrs, std::end(dnptrs));
+            if (n < 0) return {};
+            p += n;
+        }
+        msg.resize(p - msg.data());
+        return msg;
+    }
+};
+
+TEST_F(DnsNameCompressorTest, SameAsDnComp) {
+    std::vector<uint8_t> msg(NS_PACKETSZ);
+    DnsNameCompressor compressor(msg);
+    size_t offset = NS_HFIXEDSZ;
+    for (const char* name : kNames) {
+        const int n = compressor.compress(name, offset);
+        ASSERT_GT(n, 0) << name;
+        offset += n;
+    }
+    msg.resize(offset);
+    EXPECT_EQ(withDnComp(NS_PACKETSZ), msg);
+
+    // And the names read back, in the case of the suffixes pointed to.
+    char buf[NS_MAXDNAME];
+    std::string_view name;
+    offset = NS_HFIXEDSZ;
+    for (const char* expected : kNames) {
+        const int n = dn_expand(msg, msg.data() + offset, buf, &name);
+        ASSERT_GT(n, 0);
+        EXPECT_EQ(0, strcasecmp(expected, std::string(name).c_str())) << name;
+        offset += n;
+    }
+}
+
+TEST_F(DnsNameCompressorTest, AddName) {
+    std::vector<uint8_t> msg = makeMessage();
+    const size_t end = msg.size();
+    msg.resize(NS_PACKETSZ);
+    DnsNameCompressor compressor(msg);
+    ASSERT_TRUE(compressor.addName(12));
+    ASSERT_TRUE(compressor.addName(29));
+    // A loop.
+    EXPECT_FALSE(compressor.addName(36));
+
+    // To "mail", which has its own pointer to "example.com".
+    EXPECT_EQ(2, compressor.compress("Mail.example.COM", end));
+    EXPECT_EQ(0xc0, msg[end]);
+    EXPECT_EQ(29, msg[end + 1]);
+    EXPECT_EQ(6, compressor.compress("ftp.example.com", end + 2));
+    EXPECT_EQ(16, msg[end + 2 + 5]);
+    // Now that one too.
+    EXPECT_EQ(2, compressor.compress("ftp.example.com", end + 8));
+    EXPECT_EQ(end + 2, msg[end + 9]);
+}
+
+TEST_F(DnsNameCompressorTest, Errors) {
+    std::vector<uint8_t> msg(NS_HFIXEDSZ + 8);
+    DnsNameCompressor compressor(msg);
+    EXPECT_EQ(-1, compressor.compress("toolongforthis.com", NS_HFIXEDSZ));
+    EXPECT_EQ(-1, compressor.compress("a..b", NS_HFIXEDSZ));
+    const std::string label(64, 'a');
+    EXPECT_EQ(-1, compressor.compress(label.c_str(), NS_HFIXEDSZ));
+    EXPECT_EQ(-1, compressor.compress("a", msg.size() + 1));
+    EXPECT_EQ(3, compressor.compress("a", NS_HFIXEDSZ));
+    EXPECT_EQ(2, compressor.compress("A.", NS_HFIXEDSZ + 3));
+    // No room for the pointer.
+    EXPECT_EQ(-1, compressor.compress("a", msg.size() - 1));
+}
+
+}  // namespace android::net
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// atrace helpers, under the "network" category. When that category isn't being traced, each costs
+// one check of a global flag. Files that use the ATRACE_* macros define ATRACE_TAG themselves.
+
+#include <cutils/trace.h>
+
+namespace android::net {
+
+// Marks |name| in the enclosing slice with a slice of its own that takes no time, e.g. to tell
+// how an operation ended.
+inline void traceMark(const char* name) {
+    if (!atrace_is_tag_enabled(ATRACE_TAG_NETWORK)) return;
+    atrace_begin(ATRACE_TAG_NETWORK, name);
+    atrace_end(ATRACE_TAG_NETWORK);
+}
+
+// Sets counter |name| to |value|.
+inline void traceCounter(const char* name, int32_t value) {
+    atrace_int(ATRACE_TAG_NETWORK, name, value);
+}
+
+}  // namespace android::net
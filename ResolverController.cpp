@@ -18,25 +18,44 @@
 
 #include "ResolverController.h"
 
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <aidl/android/net/IDnsResolver.h>
+#include <android-base/format.h>
 #include <android-base/logging.h>
 #include <android-base/strings.h>
+#include <netdutils/ThreadUtil.h>
 
+#include "CircuitBreaker.h"
 #include "Dns64Configuration.h"
 #include "DnsResolver.h"
 #include "DnsTlsDispatcher.h"
+#include "MdnsCache.h"
 #include "PrivateDnsConfiguration.h"
 #include "ResolverEventReporter.h"
 #include "ResolverStats.h"
+#include "UdpPayloadTracker.h"
 #include "resolv_cache.h"
+#include "resolv_private.h"
 #include "stats.h"
+#include "stats.pb.h"
 #include "util.h"
 
 using aidl::android::net::ResolverParamsParcel;
+using aidl::android::net::resolv::aidl::CacheWarmupQueryParcel;
 using aidl::android::net::resolv::aidl::IDnsResolverUnsolicitedEventListener;
 using aidl::android::net::resolv::aidl::Nat64PrefixEventParcel;
 
@@ -53,15 +72,15 @@ void sendNat64PrefixEvent(const Dns64Configuration::Nat64PrefixInfo& args) {
                << args.netId << " with prefix " << args.prefixString << "/"
                << (int)(args.prefixLength);
     // Send a nat64 prefix event to NetdEventListenerService.
-    const auto& listeners = ResolverEventReporter::getInstance().getListeners();
-    if (listeners.empty()) {
+    const auto listeners = ResolverEventReporter::getInstance().getListeners();
+    if (listeners->empty()) {
         LOG(ERROR) << __func__ << ": No available listener. Skipping NAT64 prefix event";
     }
-    for (const auto& it : listeners) {
+    for (const auto& it : *listeners) {
         it->onNat64PrefixEvent(args.netId, args.added, args.prefixString, args.prefixLength);
     }
 
-    const auto& unsolEventListeners = ResolverEventReporter::getInstance().getUnsolEventListeners();
+    const auto unsolEventListeners = ResolverEventReporter::getInstance().getUnsolEventListeners();
     const Nat64PrefixEventParcel nat64PrefixEvent = {
             .netId = static_cast<int32_t>(args.netId),
             .prefixOperation =
@@ -70,7 +89,7 @@ void sendNat64PrefixEvent(const Dns64Configuration::Nat64PrefixInfo& args) {
             .prefixAddress = args.prefixString,
             .prefixLength = args.prefixLength,
     };
-    for (const auto& it : unsolEventListeners) {
+    for (const auto& it : *unsolEventListeners) {
         it->onNat64PrefixEvent(nat64PrefixEvent);
     }
 }
@@ -149,10 +168,96 @@ int getDnsInfo(unsigned netId, std::vector<std::string>* servers, std::vector<st
         domains->push_back(res_domains[i]);
     }
 
-    (*wait_for_pending_req_timeout_count)[0] = res_wait_for_pending_req_timeout_count;
+    auto& cacheCounters = *wait_for_pending_req_timeout_count;
+    cacheCounters[IDnsResolver::RESOLVER_CACHE_PENDING_REQ_TIMEOUTS] =
+            res_wait_for_pending_req_timeout_count;
+    if (cacheCounters.size() > IDnsResolver::RESOLVER_CACHE_PREFETCHES) {
+        cacheCounters[IDnsResolver::RESOLVER_CACHE_PREFETCHES] =
+                resolv_cache_get_prefetch_count(netId);
+    }
     return 0;
 }
 
+// Bounds on cache warming: each request is handled by at most kCacheWarmupThreads threads,
+// and at most kMaxCacheWarmups requests are handled at a time.
+constexpr size_t kMaxCacheWarmupQueries = 256;
+constexpr size_t kCacheWarmupThreads = 4;
+constexpr int kMaxCacheWarmups = 4;
+std::atomic<int> sCacheWarmups = 0;
+
+// The queries of a warmup request, shared by the threads handling it.
+struct CacheWarmup {
+    ~CacheWarmup() { sCacheWarmups--; }
+
+    android_net_context netcontext;
+    std::vector<CacheWarmupQueryParcel> queries;
+    std::atomic<size_t> next = 0;
+};
+
+void runCacheWarmup(const std::shared_ptr<CacheWarmup>& warmup) {
+    for (size_t i; (i = warmup->next++) < warmup->queries.size();) {
+        const CacheWarmupQueryParcel& query = warmup->queries[i];
+        // res_nquery() goes through the cache like any other query, so names that are cached
+        // or already being resolved are not sent again.
+        NetworkDnsEventReported event;
+        ResState res(&warmup->netcontext, &event);
+        resolv_populate_res_for_net(&res);
+        std::vector<uint8_t> answer(MAXPACKET);
+        int herrno = NETDB_INTERNAL;
+        if (res_nquery(&res, query.hostName.c_str(), ns_c_in, query.type, answer, &herrno) < 0) {
+            LOG(DEBUG) << __func__ << ": " << query.hostName << " type " << query.type
+                       << " failed, h_errno = " << herrno;
+        }
+    }
+}
+
+// Whether |server| is a globally routable address, which names the same server on any network.
+// Private, shared, loopback and link-local addresses name a different server on each network.
+bool isPublicServer(const std::string& server) {
+    in_addr v4;
+    if (inet_pton(AF_INET, server.c_str(), &v4) == 1) {
+        const uint32_t a = ntohl(v4.s_addr);
+        return (a >> 24) != 10 && (a >> 24) != 127 && (a >> 24) != 0 &&
+               (a >> 20) != (172 << 4 | 1) && (a >> 16) != (192 << 8 | 168) &&
+               (a >> 16) != (169 << 8 | 254) && (a >> 22) != (100 << 2 | 1);
+    }
+    in6_addr v6;
+    if (inet_pton(AF_INET6, server.c_str(), &v6) != 1) return false;
+    if (IN6_IS_ADDR_V4MAPPED(&v6)) {
+        char v4str[INET_ADDRSTRLEN];
+        return inet_ntop(AF_INET, &v6.s6_addr[12], v4str, sizeof(v4str)) != nullptr &&
+               isPublicServer(v4str);
+    }
+    // Unique local addresses are fc00::/7.
+    return !IN6_IS_ADDR_LOOPBACK(&v6) && !IN6_IS_ADDR_UNSPECIFIED(&v6) &&
+           !IN6_IS_ADDR_LINKLOCAL(&v6) && !IN6_IS_ADDR_SITELOCAL(&v6) &&
+           (v6.s6_addr[0] & 0xfe) != 0xfc;
+}
+
+// Networks using the same upstream servers with the same private DNS setup get the same answers,
+// so they may share cached answers. The same private address is a different server on each
+// network though, so only networks whose servers are all public addresses share, or those in
+// strict private DNS mode, whose servers are authenticated by their name. Networks that restrict
+// DNS traffic to some UIDs keep their cache to themselves.
+std::string cacheDomainOf(const ResolverParamsParcel& params,
+                          const std::vector<std::string>& tlsServers) {
+    if (Experiments::getInstance()->getFlag("cache_shared_domains", 0) != 1) return "";
+    if (params.resolverOptions && params.resolverOptions->enforceDnsUid) return "";
+    if (params.servers.empty() && tlsServers.empty()) return "";
+    if (params.tlsName.empty() &&
+        !(std::all_of(params.servers.begin(), params.servers.end(), isPublicServer) &&
+          std::all_of(tlsServers.begin(), tlsServers.end(), isPublicServer))) {
+        return "";
+    }
+
+    std::vector<std::string> servers = params.servers;
+    std::vector<std::string> privateServers = tlsServers;
+    std::sort(servers.begin(), servers.end());
+    std::sort(privateServers.begin(), privateServers.end());
+    return fmt::format("{}|{}|{}|{}", base::Join(servers, ","), base::Join(privateServers, ","),
+                       params.tlsName, std::hash<std::string>{}(params.caCertificate));
+}
+
 }  // namespace
 
 ResolverController::ResolverController()
@@ -167,11 +272,18 @@ void ResolverController::destroyNetworkCache(unsigned netId) {
 
     resolv_delete_cache_for_net(netId);
     mDns64Configuration->stopPrefixDiscovery(netId);
+    MdnsCache::getInstance().clear(netId);
+    UdpPayloadTracker::getInstance().clear(netId);
+    CircuitBreaker::getInstance().clear(netId);
     PrivateDnsConfiguration::getInstance().clear(netId);
     if (isDoHEnabled()) PrivateDnsConfiguration::getInstance().clearDoh(netId);
 
     // Don't get this instance in PrivateDnsConfiguration. It's probe to deadlock.
     DnsTlsDispatcher::getInstance().forceCleanup(netId);
+
+    forgetResolverInfoSnapshot(netId);
+    std::lock_guard guard(mPeakMutex);
+    mPeakMemoryUsage.erase(netId);
 }
 
 int ResolverController::createNetworkCache(unsigned netId) {
@@ -185,12 +297,66 @@ int ResolverController::flushNetworkCache(unsigned netId) {
     return resolv_flush_cache_for_net(netId);
 }
 
+int ResolverController::warmNetworkCache(unsigned netId,
+                                         const std::vector<CacheWarmupQueryParcel>& queries) {
+    LOG(VERBOSE) << __func__ << ": netId = " << netId << ", " << queries.size() << " queries";
+
+    if (!has_named_cache(netId)) return -ENONET;
+    if (queries.size() > kMaxCacheWarmupQueries) return -EINVAL;
+    for (const auto& query : queries) {
+        if (query.hostName.empty() || query.hostName.size() >= NS_MAXDNAME || query.type <= 0 ||
+            query.type > UINT16_MAX) {
+            return -EINVAL;
+        }
+    }
+    if (queries.empty()) return 0;
+
+    if (sCacheWarmups++ >= kMaxCacheWarmups) {
+        sCacheWarmups--;
+        return -EBUSY;
+    }
+    auto warmup = std::make_shared<CacheWarmup>();
+    gResNetdCallbacks.get_network_context(netId, 0 /* uid */, &warmup->netcontext);
+    warmup->queries = queries;
+
+    for (size_t i = 0; i < std::min(kCacheWarmupThreads, queries.size()); i++) {
+        std::thread([warmup, netId]() {
+            netdutils::setThreadName(fmt::format("CacheWarm_{}", netId));
+            runCacheWarmup(warmup);
+        }).detach();
+    }
+    return 0;
+}
+
+int ResolverController::handOverNetworkCache(unsigned fromNetId, unsigned toNetId,
+                                             int32_t maxQueries) {
+    LOG(VERBOSE) << __func__ << ": fromNetId = " << fromNetId << ", toNetId = " << toNetId
+                 << ", maxQueries = " << maxQueries;
+
+    if (!has_named_cache(fromNetId) || !has_named_cache(toNetId)) return -ENONET;
+    if (maxQueries < 0 || static_cast<size_t>(maxQueries) > kMaxCacheWarmupQueries) {
+        return -EINVAL;
+    }
+
+    std::vector<CacheWarmupQueryParcel> queries;
+    for (auto& question : resolv_cache_get_hot_questions(fromNetId, maxQueries)) {
+        CacheWarmupQueryParcel query;
+        query.hostName = std::move(question.name);
+        query.type = question.type;
+        queries.push_back(std::move(query));
+    }
+    LOG(INFO) << __func__ << ": warming " << queries.size() << " queries from netId "
+              << fromNetId << " on netId " << toNetId;
+    return warmNetworkCache(toNetId, queries);
+}
+
 int ResolverController::setResolverConfiguration(const ResolverParamsParcel& resolverParams) {
     using aidl::android::net::IDnsResolver;
 
     if (!has_named_cache(resolverParams.netId)) {
         return -ENOENT;
     }
+    forgetResolverInfoSnapshot(resolverParams.netId);
 
     // Expect to get the mark with system permission.
     android_net_context netcontext;
@@ -244,9 +410,14 @@ int ResolverController::setResolverConfiguration(const ResolverParamsParcel& res
     res_params.base_timeout_msec = resolverParams.baseTimeoutMsec;
     res_params.retry_count = resolverParams.retryCount;
 
-    return resolv_set_nameservers(resolverParams.netId, resolverParams.servers,
-                                  resolverParams.domains, res_params,
-                                  resolverParams.resolverOptions, resolverParams.transportTypes);
+    if (err = resolv_set_nameservers(resolverParams.netId, resolverParams.servers,
+                                     resolverParams.domains, res_params,
+                                     resolverParams.resolverOptions, resolverParams.transportTypes);
+        err != 0) {
+        return err;
+    }
+
+    return resolv_set_cache_domain(resolverParams.netId, cacheDomainOf(resolverParams, tlsServers));
 }
 
 int ResolverController::getResolverInfo(int32_t netId, std::vector<std::string>* servers,
@@ -265,8 +436,26 @@ int ResolverController::getResolverInfo(int32_t netId, std::vector<std::string>*
     }
 
     // Serialize the information for binder.
+    const size_t capacity = stats->size();
     ResolverStats::encodeAll(res_stats, stats);
 
+    // Older callers size the array for the stats alone, and would misread anything after them.
+    if (capacity >= stats->size() + servers->size() * IDnsResolver::RESOLVER_LATENCY_COUNT) {
+        for (const auto& server : *servers) {
+            const auto addr = netdutils::IPSockAddr::toIPSockAddr(server, 53);
+            const auto ms = [&](int percentile) -> int32_t {
+                const auto latency =
+                        resolv_stats_get_latency_percentile(netId, addr, PROTO_UDP, percentile);
+                return latency ? latency->count() / 1000 : -1;
+            };
+            std::array<int32_t, IDnsResolver::RESOLVER_LATENCY_COUNT> latencies;
+            latencies[IDnsResolver::RESOLVER_LATENCY_P50] = ms(50);
+            latencies[IDnsResolver::RESOLVER_LATENCY_P90] = ms(90);
+            latencies[IDnsResolver::RESOLVER_LATENCY_P99] = ms(99);
+            stats->insert(stats->end(), latencies.begin(), latencies.end());
+        }
+    }
+
     const auto privateDnsStatus = PrivateDnsConfiguration::getInstance().getStatus(netId);
     for (const auto& [server, _] : privateDnsStatus.dotServersMap) {
         tlsServers->push_back(server.toIpString());
@@ -282,6 +471,92 @@ int ResolverController::getResolverInfo(int32_t netId, std::vector<std::string>*
     return 0;
 }
 
+int ResolverController::getResolverInfoSnapshot(int32_t netId, std::vector<uint8_t>* snapshot) {
+    const auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard guard(mSnapshotMutex);
+        const auto it = mSnapshots.find(netId);
+        if (it != mSnapshots.end() && now - it->second.takenAt < kSnapshotMaxAge) {
+            *snapshot = it->second.bytes;
+            return 0;
+        }
+    }
+
+    // Callers racing for an expired snapshot each take one, and the last one is kept.
+    if (int ret = takeResolverInfoSnapshot(netId, snapshot); ret != 0) return ret;
+    std::lock_guard guard(mSnapshotMutex);
+    mSnapshots[netId] = {.takenAt = now, .bytes = *snapshot};
+    return 0;
+}
+
+int ResolverController::takeResolverInfoSnapshot(int32_t netId, std::vector<uint8_t>* snapshot) {
+    using aidl::android::net::IDnsResolver;
+    std::vector<std::string> servers;
+    std::vector<std::string> domains;
+    res_params params;
+    std::vector<ResolverStats> stats;
+    std::vector<int32_t> cacheCounters(IDnsResolver::RESOLVER_CACHE_COUNTERS_COUNT, 0);
+    if (int ret = getDnsInfo(netId, &servers, &domains, &params, &stats, &cacheCounters);
+        ret != 0) {
+        return ret;
+    }
+    snapshot->clear();
+    // No DNS configuration.
+    if (servers.empty() && domains.empty()) return 0;
+
+    ResolverInfoSnapshot proto;
+    proto.set_version(1);
+    proto.set_net_id(netId);
+    proto.set_time_ms(std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::system_clock::now().time_since_epoch())
+                              .count());
+    for (size_t i = 0; i < servers.size(); i++) {
+        ResolverInfoSnapshot::Server* server = proto.add_servers();
+        server->set_address(servers[i]);
+        if (i < stats.size()) {
+            server->set_successes(stats[i].successes);
+            server->set_errors(stats[i].errors);
+            server->set_timeouts(stats[i].timeouts);
+            server->set_internal_errors(stats[i].internal_errors);
+            server->set_rtt_avg_ms(stats[i].rtt_avg);
+            server->set_last_sample_time(stats[i].last_sample_time);
+            server->set_usable(stats[i].usable);
+        }
+        const auto addr = netdutils::IPSockAddr::toIPSockAddr(servers[i], 53);
+        const auto ms = [&](int percentile) -> int32_t {
+            const auto latency =
+                    resolv_stats_get_latency_percentile(netId, addr, PROTO_UDP, percentile);
+            return latency ? latency->count() / 1000 : -1;
+        };
+        server->set_latency_p50_ms(ms(50));
+        server->set_latency_p90_ms(ms(90));
+        server->set_latency_p99_ms(ms(99));
+    }
+    for (const auto& domain : domains) proto.add_domains(domain);
+    const auto privateDnsStatus = PrivateDnsConfiguration::getInstance().getStatus(netId);
+    for (const auto& [server, _] : privateDnsStatus.dotServersMap) {
+        proto.add_tls_servers(server.toIpString());
+    }
+    proto.set_sample_validity_sec(params.sample_validity);
+    proto.set_success_threshold(params.success_threshold);
+    proto.set_min_samples(params.min_samples);
+    proto.set_max_samples(params.max_samples);
+    proto.set_base_timeout_msec(params.base_timeout_msec);
+    proto.set_retry_count(params.retry_count);
+    proto.set_pending_request_timeouts(
+            cacheCounters[IDnsResolver::RESOLVER_CACHE_PENDING_REQ_TIMEOUTS]);
+    proto.set_prefetches(cacheCounters[IDnsResolver::RESOLVER_CACHE_PREFETCHES]);
+
+    snapshot->resize(proto.ByteSizeLong());
+    if (!proto.SerializeToArray(snapshot->data(), snapshot->size())) return -ENOTRECOVERABLE;
+    return 0;
+}
+
+void ResolverController::forgetResolverInfoSnapshot(unsigned netId) {
+    std::lock_guard guard(mSnapshotMutex);
+    mSnapshots.erase(netId);
+}
+
 void ResolverController::startPrefix64Discovery(int32_t netId) {
     mDns64Configuration->startPrefixDiscovery(netId);
 }
@@ -300,17 +575,40 @@ int ResolverController::getPrefix64(unsigned netId, netdutils::IPPrefix* prefix)
     return 0;
 }
 
+std::optional<ResolverController::MemoryUsage> ResolverController::getMemoryUsage(
+        unsigned netId, MemoryUsage* peak) {
+    ResolvCacheMemoryUsage cacheUsage;
+    if (!resolv_cache_get_memory_usage(netId, &cacheUsage)) return std::nullopt;
+    const MemoryUsage usage = {
+            .cache = cacheUsage.cache,
+            .hosts = cacheUsage.hosts,
+            .stats = cacheUsage.stats,
+            .dot = DnsTlsDispatcher::getInstance().getMemoryUsage(netId),
+            .queryLog = gDnsResolv->dnsQueryLog().memoryUsage(netId),
+    };
+
+    std::lock_guard guard(mPeakMutex);
+    MemoryUsage& highWater = mPeakMemoryUsage[netId];
+    highWater.cache = std::max({highWater.cache, usage.cache, cacheUsage.cache_peak});
+    highWater.hosts = std::max(highWater.hosts, usage.hosts);
+    highWater.stats = std::max(highWater.stats, usage.stats);
+    highWater.dot = std::max(highWater.dot, usage.dot);
+    highWater.queryLog = std::max(highWater.queryLog, usage.queryLog);
+    *peak = highWater;
+    return usage;
+}
+
 void ResolverController::dump(DumpWriter& dw, unsigned netId) {
     // No lock needed since Bionic's resolver locks all accessed data structures internally.
+    using aidl::android::net::IDnsResolver;
     using android::net::ResolverStats;
     std::vector<std::string> servers;
     std::vector<std::string> domains;
     res_params params = {};
     std::vector<ResolverStats> stats;
-    std::vector<int32_t> wait_for_pending_req_timeout_count(1, 0);
+    std::vector<int32_t> cacheCounters(IDnsResolver::RESOLVER_CACHE_COUNTERS_COUNT, 0);
     time_t now = time(nullptr);
-    int rv = getDnsInfo(netId, &servers, &domains, &params, &stats,
-                        &wait_for_pending_req_timeout_count);
+    int rv = getDnsInfo(netId, &servers, &domains, &params, &stats, &cacheCounters);
     dw.incIndent();
     if (rv != 0) {
         dw.println("getDnsInfo() failed for netid %u", netId);
@@ -354,11 +652,13 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
             dw.println(
                     "DNS parameters: sample validity = %us, success threshold = %u%%, "
                     "samples (min, max) = (%u, %u), base_timeout = %dmsec, retry count = "
-                    "%dtimes",
+                    "%dtimes, adaptive timeout (min, max) = (%d, %d)msec",
                     params.sample_validity, params.success_threshold, params.min_samples,
-                    params.max_samples, params.base_timeout_msec, params.retry_count);
+                    params.max_samples, params.base_timeout_msec, params.retry_count,
+                    params.min_timeout_msec, params.max_timeout_msec);
         }
         mDns64Configuration->dump(dw, netId);
+        CircuitBreaker::getInstance().dump(dw, netId);
         const auto privateDnsStatus = PrivateDnsConfiguration::getInstance().getStatus(netId);
         dw.println("Private DNS mode: %s", getPrivateDnsModeString(privateDnsStatus.mode));
         if (privateDnsStatus.dotServersMap.size() == 0) {
@@ -373,7 +673,9 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
             }
             dw.decIndent();
         }
-        dw.println("Concurrent DNS query timeout: %d", wait_for_pending_req_timeout_count[0]);
+        dw.println("Concurrent DNS query timeout: %d",
+                   cacheCounters[IDnsResolver::RESOLVER_CACHE_PENDING_REQ_TIMEOUTS]);
+        dw.println("Cache prefetches: %d", cacheCounters[IDnsResolver::RESOLVER_CACHE_PREFETCHES]);
         resolv_netconfig_dump(dw, netId);
     }
     dw.decIndent();
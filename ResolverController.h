@@ -17,11 +17,17 @@
 #ifndef _RESOLVER_CONTROLLER_H_
 #define _RESOLVER_CONTROLLER_H_
 
+#include <chrono>
 #include <list>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <vector>
 
 #include <aidl/android/net/ResolverParamsParcel.h>
+#include <aidl/android/net/resolv/aidl/CacheWarmupQueryParcel.h>
+#include <android-base/thread_annotations.h>
 #include "Dns64Configuration.h"
 #include "netd_resolv/resolv.h"
 #include "netdutils/DumpWriter.h"
@@ -39,6 +45,13 @@ class ResolverController {
     void destroyNetworkCache(unsigned netid);
     int createNetworkCache(unsigned netid);
     int flushNetworkCache(unsigned netid);
+    // Resolves |queries| on |netid| in the background, so that their answers get cached.
+    int warmNetworkCache(
+            unsigned netid,
+            const std::vector<aidl::android::net::resolv::aidl::CacheWarmupQueryParcel>& queries);
+    // Warms the cache of |toNetId| with up to |maxQueries| of the questions looked up most
+    // often in the cache of |fromNetId|, as warmNetworkCache() does.
+    int handOverNetworkCache(unsigned fromNetId, unsigned toNetId, int32_t maxQueries);
 
     // Binder specific functions, which convert between the ResolverParamsParcel and the
     // actual data structures.
@@ -49,6 +62,13 @@ class ResolverController {
                         std::vector<int32_t>* params, std::vector<int32_t>* stats,
                         std::vector<int32_t>* wait_for_pending_req_timeout_count);
 
+    // Serializes into |snapshot| what getResolverInfo() returns, as a ResolverInfoSnapshot. The
+    // snapshot of a network is reused for kSnapshotMaxAge, until its configuration changes, so
+    // that frequent callers don't take the locks of the cache and the stats every time.
+    int getResolverInfoSnapshot(int32_t netId, std::vector<uint8_t>* snapshot)
+            EXCLUDES(mSnapshotMutex);
+    static constexpr std::chrono::seconds kSnapshotMaxAge{1};
+
     // Start or stop NAT64 prefix discovery.
     void startPrefix64Discovery(int32_t netId);
     void stopPrefix64Discovery(int32_t netId);
@@ -62,11 +82,46 @@ class ResolverController {
 
     // Return the current NAT64 prefix network, regardless of how it was discovered.
     int getPrefix64(unsigned netId, netdutils::IPPrefix* prefix);
+    // As above, without taking a lock, for the queries that synthesize from it.
+    bool getPrefix64(unsigned netId, in6_addr* prefix) const {
+        return mDns64Configuration->getPrefix64(netId, prefix);
+    }
 
     void dump(netdutils::DumpWriter& dw, unsigned netId);
 
+    // Approximate bytes of memory held for a network, per component. DoH isn't counted: its
+    // connections live on the Rust side.
+    struct MemoryUsage {
+        size_t cache = 0;
+        size_t hosts = 0;
+        size_t stats = 0;
+        size_t dot = 0;
+        size_t queryLog = 0;
+
+        size_t total() const { return cache + hosts + stats + dot + queryLog; }
+    };
+    // Returns the memory usage of network |netId|, or std::nullopt if it has no cache, and
+    // stores in |peak| the most of each component seen so far. The peaks are sampled at each
+    // call, except that of the cache, which its arena keeps.
+    std::optional<MemoryUsage> getMemoryUsage(unsigned netId, MemoryUsage* peak)
+            EXCLUDES(mPeakMutex);
+
   private:
     android::sp<Dns64Configuration> mDns64Configuration;
+
+    std::mutex mPeakMutex;
+    std::map<unsigned, MemoryUsage> mPeakMemoryUsage GUARDED_BY(mPeakMutex);
+
+    struct Snapshot {
+        std::chrono::steady_clock::time_point takenAt;
+        std::vector<uint8_t> bytes;
+    };
+    // Takes the snapshot of network |netId| anew.
+    int takeResolverInfoSnapshot(int32_t netId, std::vector<uint8_t>* snapshot);
+    void forgetResolverInfoSnapshot(unsigned netId) EXCLUDES(mSnapshotMutex);
+
+    std::mutex mSnapshotMutex;
+    std::map<unsigned, Snapshot> mSnapshots GUARDED_BY(mSnapshotMutex);
 };
 }  // namespace net
 }  // namespace android
@@ -35,12 +35,52 @@ ResolverEventReporter& ResolverEventReporter::getInstance() {
     return instance;
 }
 
-ResolverEventReporter::ListenerSet ResolverEventReporter::getListeners() const {
-    return getListenersImpl();
+std::shared_ptr<const ResolverEventReporter::ListenerSet> ResolverEventReporter::getListeners()
+        const {
+    return std::atomic_load(&mListenersSnapshot);
+}
+
+std::shared_ptr<const ResolverEventReporter::UnsolEventListenerSet>
+ResolverEventReporter::getUnsolEventListeners() const {
+    return std::atomic_load(&mUnsolEventListenersSnapshot);
+}
+
+void ResolverEventReporter::sendDnsEvents(const std::vector<DnsEvent>& batch) const {
+    const auto listeners = getListeners();
+    if (listeners->empty()) {
+        LOG(ERROR) << __func__ << ": " << batch.size()
+                   << " DNS event(s) not sent since no INetdEventListener receiver is available.";
+    }
+    for (const auto& it : *listeners) {
+        for (const DnsEvent& event : batch) {
+            it->onDnsEvent(event.netId, event.eventType, event.returnCode, event.latencyMs,
+                           event.hostname, event.ipAddresses, event.ipAddressesCount, event.uid);
+        }
+    }
+
+    const auto unsolEventListeners = getUnsolEventListeners();
+    for (const auto& it : *unsolEventListeners) {
+        for (const DnsEvent& event : batch) {
+            if (event.healthEvent) it->onDnsHealthEvent(*event.healthEvent);
+        }
+    }
 }
 
-ResolverEventReporter::UnsolEventListenerSet ResolverEventReporter::getUnsolEventListeners() const {
-    return getUnsolEventListenersImpl();
+bool ResolverEventReporter::queueDnsEvent(DnsEvent&& event) {
+    return dnsEventQueue().push(std::move(event));
+}
+
+ResolverEventReporter::DnsEventQueue::Stats ResolverEventReporter::getDnsEventQueueStats() {
+    return dnsEventQueue().getStats();
+}
+
+ResolverEventReporter::DnsEventQueue& ResolverEventReporter::dnsEventQueue() {
+    // Never destroyed, so that exiting doesn't wait for a listener that has stopped responding.
+    static DnsEventQueue* queue =
+            new DnsEventQueue(kMaxQueuedDnsEvents, [this](std::vector<DnsEvent>& batch) {
+                sendDnsEvents(batch);
+            });
+    return *queue;
 }
 
 int ResolverEventReporter::addListener(const std::shared_ptr<INetdEventListener>& listener) {
@@ -57,10 +97,11 @@ int ResolverEventReporter::addUnsolEventListener(
 // Consider breaking it into two listeners. Once it has done, may let framework register
 // the listener proactively.
 void ResolverEventReporter::addDefaultListener() {
+    // Checked without the lock first, as this is called for every event once the listener is
+    // there.
+    if (mDefaultListenerAdded) return;
     std::lock_guard lock(mMutex);
-
-    static bool added = false;
-    if (added) return;
+    if (mDefaultListenerAdded) return;
 
     // Use the non-blocking call AServiceManager_checkService in order not to delay DNS
     // lookup threads when the netd_listener service is not ready.
@@ -69,7 +110,7 @@ void ResolverEventReporter::addDefaultListener() {
 
     if (listener == nullptr) return;
 
-    if (!addListenerImplLocked(listener)) added = true;
+    if (!addListenerImplLocked(listener)) mDefaultListenerAdded = true;
 }
 
 void ResolverEventReporter::handleBinderDied(const void* who) {
@@ -80,7 +121,10 @@ void ResolverEventReporter::handleBinderDied(const void* who) {
     auto found = std::find_if(mListeners.begin(), mListeners.end(),
                               [=](const auto& it) { return static_cast<void*>(it.get()) == who; });
 
-    if (found != mListeners.end()) mListeners.erase(found);
+    if (found != mListeners.end()) {
+        mListeners.erase(found);
+        publishListenersLocked();
+    }
 }
 
 void ResolverEventReporter::handleUnsolEventBinderDied(const void* who) {
@@ -91,18 +135,16 @@ void ResolverEventReporter::handleUnsolEventBinderDied(const void* who) {
     auto found = std::find_if(mUnsolEventListeners.begin(), mUnsolEventListeners.end(),
                               [=](const auto& it) { return static_cast<void*>(it.get()) == who; });
 
-    if (found != mUnsolEventListeners.end()) mUnsolEventListeners.erase(found);
-}
-
-ResolverEventReporter::ListenerSet ResolverEventReporter::getListenersImpl() const {
-    std::lock_guard lock(mMutex);
-    return mListeners;
+    if (found != mUnsolEventListeners.end()) {
+        mUnsolEventListeners.erase(found);
+        publishListenersLocked();
+    }
 }
 
-ResolverEventReporter::UnsolEventListenerSet ResolverEventReporter::getUnsolEventListenersImpl()
-        const {
-    std::lock_guard lock(mMutex);
-    return mUnsolEventListeners;
+void ResolverEventReporter::publishListenersLocked() {
+    std::atomic_store(&mListenersSnapshot, std::make_shared<const ListenerSet>(mListeners));
+    std::atomic_store(&mUnsolEventListenersSnapshot,
+                      std::make_shared<const UnsolEventListenerSet>(mUnsolEventListeners));
 }
 
 int ResolverEventReporter::addListenerImpl(const std::shared_ptr<INetdEventListener>& listener) {
@@ -152,6 +194,7 @@ int ResolverEventReporter::addListenerImplLocked(
     }
 
     mListeners.insert(listener);
+    publishListenersLocked();
     return 0;
 }
 
@@ -204,5 +247,6 @@ int ResolverEventReporter::addUnsolEventListenerImplLocked(
     }
 
     mUnsolEventListeners.insert(listener);
+    publishListenersLocked();
     return 0;
 }
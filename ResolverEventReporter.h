@@ -17,10 +17,16 @@
 #ifndef NETD_RESOLV_EVENT_REPORTER_H
 #define NETD_RESOLV_EVENT_REPORTER_H
 
+#include <atomic>
+#include <memory>
+#include <optional>
 #include <set>
+#include <string>
+#include <vector>
 
 #include <android-base/thread_annotations.h>
 
+#include "BatchedEventQueue.h"
 #include "aidl/android/net/metrics/INetdEventListener.h"
 #include "aidl/android/net/resolv/aidl/IDnsResolverUnsolicitedEventListener.h"
 
@@ -40,15 +46,31 @@ class ResolverEventReporter {
     using UnsolEventListenerSet = std::set<std::shared_ptr<
             aidl::android::net::resolv::aidl::IDnsResolverUnsolicitedEventListener>>;
 
+    // The arguments of INetdEventListener::onDnsEvent, and the DNS health event the query gives
+    // the unsolicited event listeners, if any.
+    struct DnsEvent {
+        int32_t netId = 0;
+        int32_t eventType = 0;
+        int32_t returnCode = 0;
+        int32_t latencyMs = 0;
+        std::string hostname;
+        std::vector<std::string> ipAddresses;
+        int32_t ipAddressesCount = 0;
+        int32_t uid = 0;
+        std::optional<aidl::android::net::resolv::aidl::DnsHealthEventParcel> healthEvent;
+    };
+    using DnsEventQueue = android::net::BatchedEventQueue<DnsEvent>;
+
     // Get the instance of the singleton ResolverEventReporter.
     static ResolverEventReporter& getInstance();
 
-    // Return the binder from the singleton ResolverEventReporter. This method is threadsafe.
-    ListenerSet getListeners() const;
+    // Return the binder from the singleton ResolverEventReporter. This method is threadsafe, and
+    // doesn't lock: the set is an immutable snapshot that's replaced when the listeners change.
+    std::shared_ptr<const ListenerSet> getListeners() const;
 
-    // Return registered binder services from the singleton ResolverEventReporter. This method is
-    // threadsafe.
-    UnsolEventListenerSet getUnsolEventListeners() const;
+    // Return registered binder services from the singleton ResolverEventReporter. Like
+    // getListeners(), this is threadsafe and doesn't lock.
+    std::shared_ptr<const UnsolEventListenerSet> getUnsolEventListeners() const;
 
     // Add the binder to the singleton ResolverEventReporter. This method is threadsafe.
     int addListener(
@@ -60,7 +82,18 @@ class ResolverEventReporter {
                     aidl::android::net::resolv::aidl::IDnsResolverUnsolicitedEventListener>&
                     listener);
 
+    // Sends |batch| to the listeners, one listener at a time, on the calling thread.
+    void sendDnsEvents(const std::vector<DnsEvent>& batch) const;
+
+    // Sends |event| to the listeners on a background thread, batched with the events queued
+    // while the listeners are busy. Returns false if it's dropped because the queue is full.
+    bool queueDnsEvent(DnsEvent&& event);
+
+    DnsEventQueue::Stats getDnsEventQueueStats();
+
   private:
+    static constexpr size_t kMaxQueuedDnsEvents = 1024;
+
     ResolverEventReporter() = default;
     ~ResolverEventReporter() = default;
 
@@ -79,14 +112,21 @@ class ResolverEventReporter {
             const std::shared_ptr<
                     aidl::android::net::resolv::aidl::IDnsResolverUnsolicitedEventListener>&
                     listener) REQUIRES(mMutex);
-    ListenerSet getListenersImpl() const EXCLUDES(mMutex);
-    UnsolEventListenerSet getUnsolEventListenersImpl() const EXCLUDES(mMutex);
+    DnsEventQueue& dnsEventQueue();
     void handleBinderDied(const void* who) EXCLUDES(mMutex);
     void handleUnsolEventBinderDied(const void* who) EXCLUDES(mMutex);
 
+    void publishListenersLocked() REQUIRES(mMutex);
+
     mutable std::mutex mMutex;
     ListenerSet mListeners GUARDED_BY(mMutex);
     UnsolEventListenerSet mUnsolEventListeners GUARDED_BY(mMutex);
+    // Copies of the sets above, swapped in with std::atomic_store() whenever they change, with
+    // mMutex held, so that readers only need std::atomic_load().
+    std::shared_ptr<const ListenerSet> mListenersSnapshot = std::make_shared<const ListenerSet>();
+    std::shared_ptr<const UnsolEventListenerSet> mUnsolEventListenersSnapshot =
+            std::make_shared<const UnsolEventListenerSet>();
+    std::atomic<bool> mDefaultListenerAdded = false;
 };
 
 #endif  // NETD_RESOLV_EVENT_REPORTER_H
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "ServerLoad.h"
+
+#include <algorithm>
+#include <numeric>
+
+#include "Experiments.h"
+
+namespace android::net {
+
+using netdutils::IPSockAddr;
+using std::chrono::microseconds;
+
+namespace {
+
+// The latency taken for all servers when none has answered recently, which only matters relative
+// to the others.
+constexpr microseconds kUnknownLatency = std::chrono::milliseconds(1);
+
+}  // namespace
+
+ServerLoad::ScopedQuery::ScopedQuery(unsigned netid, const IPSockAddr& server, Protocol protocol)
+    : mKey(mode() == Mode::OFF ? std::nullopt : std::optional(Key(netid, server, protocol))) {
+    if (mKey) getInstance().add(*mKey, 1);
+}
+
+ServerLoad::ScopedQuery::~ScopedQuery() {
+    if (mKey) getInstance().add(*mKey, -1);
+}
+
+ServerLoad::Mode ServerLoad::mode() {
+    const int mode = Experiments::getInstance()->getFlag("server_selection_mode", 0);
+    switch (mode) {
+        case static_cast<int>(Mode::LEAST_OUTSTANDING):
+        case static_cast<int>(Mode::TWO_CHOICES):
+            return static_cast<Mode>(mode);
+        default:
+            return Mode::OFF;
+    }
+}
+
+void ServerLoad::add(const Key& key, int delta) {
+    std::lock_guard guard(mMutex);
+    if ((mInFlight[key] += delta) <= 0) mInFlight.erase(key);
+}
+
+int ServerLoad::inFlight(unsigned netid, const IPSockAddr& server, Protocol protocol) const {
+    std::lock_guard guard(mMutex);
+    const auto it = mInFlight.find({netid, server, protocol});
+    return it == mInFlight.end() ? 0 : it->second;
+}
+
+std::vector<size_t> ServerLoad::order(Mode mode, std::span<const Candidate> candidates,
+                                      uint32_t (*random)(uint32_t)) {
+    std::vector<size_t> order(candidates.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (mode == Mode::OFF || candidates.size() < 2) return order;
+
+    microseconds fastest = microseconds::max();
+    for (const Candidate& c : candidates) {
+        if (c.latency) fastest = std::min(fastest, *c.latency);
+    }
+    if (fastest == microseconds::max()) fastest = kUnknownLatency;
+    const auto wait = [&](size_t i) {
+        const Candidate& c = candidates[i];
+        return c.latency.value_or(fastest) * (c.inFlight + 1);
+    };
+
+    if (mode == Mode::LEAST_OUTSTANDING) {
+        // Stable, so that servers which would wait as long keep their order.
+        std::stable_sort(order.begin(), order.end(),
+                         [&](size_t a, size_t b) { return wait(a) < wait(b); });
+        return order;
+    }
+
+    const size_t a = random(candidates.size());
+    size_t b = random(candidates.size() - 1);
+    if (b >= a) b++;
+    const size_t chosen = (wait(b) < wait(a) || (wait(b) == wait(a) && b < a)) ? b : a;
+    // The others are tried after it, in their usual order.
+    std::rotate(order.begin(), order.begin() + chosen, order.begin() + chosen + 1);
+    return order;
+}
+
+}  // namespace android::net
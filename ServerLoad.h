@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <tuple>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/InternetAddresses.h>
+
+#include "stats.pb.h"
+
+namespace android::net {
+
+// Counts the queries in flight to each server, per network and protocol, so that the server a
+// query goes to first can be chosen by how busy the servers are now, and not only by how they did
+// in the past: otherwise, every query of a burst goes to the best-scored server, and its latency
+// goes up for all of them. This class is thread-safe.
+class ServerLoad {
+  public:
+    // The "server_selection_mode" flag.
+    enum class Mode {
+        // Servers are tried in the order of their scores, or as configured.
+        OFF = 0,
+        // The server with the lowest expected wait is tried first: its median latency, times the
+        // number of queries in flight to it plus one.
+        LEAST_OUTSTANDING = 1,
+        // Of two servers picked at random, the one with the lowest expected wait is tried first.
+        TWO_CHOICES = 2,
+    };
+
+    // A server as order() sees it.
+    struct Candidate {
+        int inFlight = 0;
+        // Unknown for servers that haven't answered recently.
+        std::optional<std::chrono::microseconds> latency;
+    };
+
+    // Counts a query to |server| as in flight for as long as it lives, unless the mode is OFF.
+    class ScopedQuery {
+      public:
+        ScopedQuery(unsigned netid, const netdutils::IPSockAddr& server, Protocol protocol);
+        ~ScopedQuery();
+        ScopedQuery(const ScopedQuery&) = delete;
+        ScopedQuery& operator=(const ScopedQuery&) = delete;
+
+      private:
+        const std::optional<std::tuple<unsigned, netdutils::IPSockAddr, Protocol>> mKey;
+    };
+
+    static ServerLoad& getInstance() {
+        static ServerLoad instance;
+        return instance;
+    }
+
+    static Mode mode();
+
+    int inFlight(unsigned netid, const netdutils::IPSockAddr& server, Protocol protocol) const
+            EXCLUDES(mMutex);
+
+    // Returns the candidates of |servers| to order() them, with their |latency| as DnsStats has
+    // it, or std::nullopt. |latency| is called without the lock held, since it takes the locks
+    // of the resolver cache.
+    template <typename Latency>
+    std::vector<Candidate> candidates(unsigned netid,
+                                      std::span<const netdutils::IPSockAddr> servers,
+                                      Protocol protocol, Latency latency) const EXCLUDES(mMutex) {
+        std::vector<Candidate> out;
+        out.reserve(servers.size());
+        for (const auto& server : servers) out.push_back({.latency = latency(server)});
+        std::lock_guard guard(mMutex);
+        for (size_t i = 0; i < servers.size(); i++) {
+            const auto it = mInFlight.find({netid, servers[i], protocol});
+            if (it != mInFlight.end()) out[i].inFlight = it->second;
+        }
+        return out;
+    }
+
+    // Returns the indices of |candidates|, given in the order they are tried in otherwise, in the
+    // order |mode| tries them. Servers whose latency is unknown are taken to be as fast as the
+    // fastest of the others, so that they get tried. |random(n)| returns a number below n.
+    static std::vector<size_t> order(Mode mode, std::span<const Candidate> candidates,
+                                     uint32_t (*random)(uint32_t) = arc4random_uniform);
+
+  private:
+    using Key = std::tuple<unsigned, netdutils::IPSockAddr, Protocol>;
+
+    void add(const Key& key, int delta) EXCLUDES(mMutex);
+
+    mutable std::mutex mMutex;
+    // Servers with no query in flight aren't in it.
+    std::map<Key, int> mInFlight GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
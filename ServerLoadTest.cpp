@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Experiments.h"
+#include "ServerLoad.h"
+#include "tests/resolv_test_base.h"
+#include "tests/resolv_test_utils.h"
+
+namespace android::net {
+
+using netdutils::IPSockAddr;
+using std::chrono::milliseconds;
+using Mode = ServerLoad::Mode;
+using Order = std::vector<size_t>;
+
+namespace {
+
+constexpr unsigned kNetId = 30;
+const IPSockAddr kServer1 = IPSockAddr::toIPSockAddr("127.0.0.1", 53);
+const IPSockAddr kServer2 = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+
+// Returns the numbers in |sequence|, one per call.
+std::vector<uint32_t> sequence;
+uint32_t fakeRandom(uint32_t n) {
+    const uint32_t r = sequence.front();
+    sequence.erase(sequence.begin());
+    EXPECT_LT(r, n);
+    return r;
+}
+
+}  // namespace
+
+class ServerLoadTest : public ResolvTestBase {};
+
+TEST_F(ServerLoadTest, OffKeepsTheOrder) {
+    const std::vector<ServerLoad::Candidate> candidates = {{5, milliseconds(100)},
+                                                           {0, milliseconds(10)}};
+    EXPECT_EQ((Order{0, 1}), ServerLoad::order(Mode::OFF, candidates, fakeRandom));
+}
+
+TEST_F(ServerLoadTest, LeastOutstanding) {
+    const std::vector<ServerLoad::Candidate> candidates = {
+            {3, milliseconds(10)},  // 40ms
+            {0, milliseconds(30)},  // 30ms
+            {1, std::nullopt},      // As fast as the fastest: 20ms.
+            {0, milliseconds(40)},  // 40ms, after the first one.
+    };
+    EXPECT_EQ((Order{2, 1, 0, 3}), ServerLoad::order(Mode::LEAST_OUTSTANDING, candidates));
+
+    // With no latency known, it's the number of queries in flight that counts.
+    EXPECT_EQ((Order{1, 2, 0}), ServerLoad::order(Mode::LEAST_OUTSTANDING,
+                                                  std::vector<ServerLoad::Candidate>{
+                                                          {2, std::nullopt},
+                                                          {0, std::nullopt},
+                                                          {1, std::nullopt},
+                                                  }));
+}
+
+TEST_F(ServerLoadTest, TwoChoices) {
+    const std::vector<ServerLoad::Candidate> candidates = {
+            {0, milliseconds(10)},
+            {4, milliseconds(10)},
+            {1, milliseconds(10)},
+            {0, milliseconds(20)},
+    };
+    // Between servers 1 and 2, server 2 is less busy. The second pick skips the first one.
+    sequence = {1, 1};
+    EXPECT_EQ((Order{2, 0, 1, 3}), ServerLoad::order(Mode::TWO_CHOICES, candidates, fakeRandom));
+    // Between servers 3 and 1, server 3 is slower but expected to answer first.
+    sequence = {3, 1};
+    EXPECT_EQ((Order{3, 0, 1, 2}), ServerLoad::order(Mode::TWO_CHOICES, candidates, fakeRandom));
+    // Ties go to the server tried first otherwise.
+    sequence = {3, 2};
+    EXPECT_EQ((Order{2, 0, 1, 3}), ServerLoad::order(Mode::TWO_CHOICES, candidates, fakeRandom));
+    EXPECT_TRUE(sequence.empty());
+
+    // A single server isn't a choice.
+    EXPECT_EQ((Order{0}), ServerLoad::order(Mode::TWO_CHOICES,
+                                            std::vector<ServerLoad::Candidate>{{0, std::nullopt}},
+                                            fakeRandom));
+}
+
+TEST_F(ServerLoadTest, CountsQueriesInFlight) {
+    ServerLoad& load = ServerLoad::getInstance();
+    {
+        // Nothing is counted while the mode is OFF.
+        ServerLoad::ScopedQuery query(kNetId, kServer1, PROTO_UDP);
+        EXPECT_EQ(0, load.inFlight(kNetId, kServer1, PROTO_UDP));
+    }
+
+    ScopedSystemProperties flag("persist.device_config.netd_native.server_selection_mode", "1");
+    Experiments::getInstance()->update();
+    auto query1 = std::make_unique<ServerLoad::ScopedQuery>(kNetId, kServer1, PROTO_UDP);
+    auto query2 = std::make_unique<ServerLoad::ScopedQuery>(kNetId, kServer1, PROTO_UDP);
+    auto query3 = std::make_unique<ServerLoad::ScopedQuery>(kNetId, kServer1, PROTO_DOT);
+    EXPECT_EQ(2, load.inFlight(kNetId, kServer1, PROTO_UDP));
+    EXPECT_EQ(1, load.inFlight(kNetId, kServer1, PROTO_DOT));
+    EXPECT_EQ(0, load.inFlight(kNetId, kServer2, PROTO_UDP));
+    EXPECT_EQ(0, load.inFlight(kNetId + 1, kServer1, PROTO_UDP));
+
+    const std::vector<IPSockAddr> servers = {kServer1, kServer2};
+    const auto latency = [](const IPSockAddr& server) -> std::optional<milliseconds> {
+        if (server == kServer1) return milliseconds(5);
+        return std::nullopt;
+    };
+    const auto candidates = load.candidates(kNetId, servers, PROTO_UDP, latency);
+    ASSERT_EQ(2U, candidates.size());
+    EXPECT_EQ(2, candidates[0].inFlight);
+    EXPECT_EQ(milliseconds(5), candidates[0].latency);
+    EXPECT_EQ(0, candidates[1].inFlight);
+    EXPECT_EQ(std::nullopt, candidates[1].latency);
+    // 15ms for server 1, against 5ms for server 2, taken to be as fast.
+    EXPECT_EQ((Order{1, 0}), ServerLoad::order(ServerLoad::mode(), candidates));
+
+    query1.reset();
+    EXPECT_EQ(1, load.inFlight(kNetId, kServer1, PROTO_UDP));
+    query2.reset();
+    query3.reset();
+    EXPECT_EQ(0, load.inFlight(kNetId, kServer1, PROTO_UDP));
+    EXPECT_EQ(0, load.inFlight(kNetId, kServer1, PROTO_DOT));
+}
+
+}  // namespace android::net
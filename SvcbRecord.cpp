@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SvcbRecord.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "res_comp.h"
+
+namespace android::net {
+
+namespace {
+
+uint16_t get16(std::span<const uint8_t> data, size_t offset) {
+    return (data[offset] << 8) | data[offset + 1];
+}
+
+// Splits |value| into addresses of |size| bytes each. Returns false if it isn't a non-empty
+// whole number of them.
+bool splitAddresses(std::span<const uint8_t> value, size_t size, std::vector<std::string>* out) {
+    if (value.empty() || value.size() % size != 0) return false;
+    for (size_t i = 0; i < value.size(); i += size) {
+        out->emplace_back(reinterpret_cast<const char*>(value.data() + i), size);
+    }
+    return true;
+}
+
+}  // namespace
+
+std::optional<SvcbRecord> SvcbRecord::parse(const DnsMessageIndex& index,
+                                            const DnsMessageIndex::Record& rr) {
+    if (rr.type != kDnsTypeSvcb && rr.type != kDnsTypeHttps) return std::nullopt;
+    const std::span<const uint8_t> rdata = index.rdata(rr);
+    if (rdata.size() < NS_INT16SZ + 1) return std::nullopt;
+
+    SvcbRecord record;
+    record.priority = get16(rdata, 0);
+    // The target name must not be compressed, so it can't point out of the RDATA.
+    for (size_t p = NS_INT16SZ;;) {
+        if (p >= rdata.size() || (rdata[p] & NS_CMPRSFLGS) != 0) return std::nullopt;
+        if (rdata[p] == 0) break;
+        p += rdata[p] + 1;
+    }
+    char name[NS_MAXDNAME];
+    const int namelen = dn_expand(rdata.data(), rdata.data() + rdata.size(),
+                                  rdata.data() + NS_INT16SZ, name, sizeof(name));
+    if (namelen < 0) return std::nullopt;
+    record.target = name;
+
+    int lastKey = -1;
+    for (size_t p = NS_INT16SZ + namelen; p < rdata.size();) {
+        if (rdata.size() - p < 2 * NS_INT16SZ) return std::nullopt;
+        const uint16_t key = get16(rdata, p);
+        const uint16_t len = get16(rdata, p + NS_INT16SZ);
+        p += 2 * NS_INT16SZ;
+        if (key <= lastKey || rdata.size() - p < len) return std::nullopt;
+        lastKey = key;
+        const std::span<const uint8_t> value = rdata.subspan(p, len);
+        p += len;
+        if (key == kKeyIpv4Hint && !splitAddresses(value, sizeof(in_addr), &record.ipv4Hints)) {
+            return std::nullopt;
+        }
+        if (key == kKeyIpv6Hint && !splitAddresses(value, sizeof(in6_addr), &record.ipv6Hints)) {
+            return std::nullopt;
+        }
+    }
+    return record;
+}
+
+}  // namespace android::net
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "DnsMessageIndex.h"
+
+namespace android::net {
+
+// Not in <arpa/nameser.h> yet.
+constexpr uint16_t kDnsTypeSvcb = 64;
+constexpr uint16_t kDnsTypeHttps = 65;
+
+// What the resolver uses of an SVCB or HTTPS record (RFC 9460): where the service is, and the
+// addresses it hints at. The other parameters are left to the clients.
+struct SvcbRecord {
+    static constexpr uint16_t kKeyIpv4Hint = 4;
+    static constexpr uint16_t kKeyIpv6Hint = 6;
+
+    // 0 for AliasMode, in which the record only points at |target|.
+    uint16_t priority = 0;
+    // The expanded TargetName, "." if it is the owner name itself.
+    std::string target;
+    // The addresses of ipv4hint and ipv6hint, as raw bytes in network byte order.
+    std::vector<std::string> ipv4Hints;
+    std::vector<std::string> ipv6Hints;
+
+    bool isAlias() const { return priority == 0; }
+    // Whether the service runs on the owner name, which is what the hints are addresses of.
+    bool targetIsOwner() const { return target == "." || target.empty(); }
+
+    // Parses the RDATA of |rr|, a record of |index| of type SVCB or HTTPS. Returns std::nullopt
+    // if it is malformed: the target name is compressed or runs past it, the parameters aren't
+    // in strictly increasing key order, or a hint isn't a whole number of addresses.
+    static std::optional<SvcbRecord> parse(const DnsMessageIndex& index,
+                                           const DnsMessageIndex::Record& rr);
+};
+
+}  // namespace android::net
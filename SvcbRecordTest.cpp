@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/nameser.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "SvcbRecord.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+class SvcbRecordTest : public ResolvTestBase {
+  protected:
+    // Parses |rdata| as that of an HTTPS record, the only answer of a message.
+    static std::optional<SvcbRecord> parse(const std::vector<uint8_t>& rdata,
+                                           uint16_t type = kDnsTypeHttps) {
+        std::vector<uint8_t> msg = {0, 0, 0x81, 0x80, 0, 0, 0, 1, 0, 0, 0, 0};
+        const uint8_t fixed[] = {0, static_cast<uint8_t>(type >> 8), static_cast<uint8_t>(type),
+                                 0, 1, 0, 0, 1, 0x2c, static_cast<uint8_t>(rdata.size() >> 8),
+                                 static_cast<uint8_t>(rdata.size())};
+        msg.insert(msg.end(), std::begin(fixed), std::end(fixed));
+        msg.insert(msg.end(), rdata.begin(), rdata.end());
+        DnsMessageIndex index;
+        EXPECT_TRUE(index.parse(msg));
+        if (index.section(ns_s_an).size() != 1) return std::nullopt;
+        return SvcbRecord::parse(index, index.section(ns_s_an)[0]);
+    }
+};
+
+TEST_F(SvcbRecordTest, ServiceMode) {
+    // Priority 1, the owner name, alpn=h3, ipv4hint=192.0.2.1,192.0.2.2, ipv6hint=2001:db8::1.
+    const auto record = parse({0, 1, 0,
+                               0, 1, 0, 3, 2, 'h', '3',
+                               0, 4, 0, 8, 192, 0, 2, 1, 192, 0, 2, 2,
+                               0, 6, 0, 16, 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                               0, 1});
+    ASSERT_TRUE(record);
+    EXPECT_EQ(1, record->priority);
+    EXPECT_FALSE(record->isAlias());
+    EXPECT_TRUE(record->targetIsOwner());
+    EXPECT_EQ((std::vector<std::string>{std::string("\xc0\x00\x02\x01", 4),
+                                        std::string("\xc0\x00\x02\x02", 4)}),
+              record->ipv4Hints);
+    ASSERT_EQ(1U, record->ipv6Hints.size());
+    EXPECT_EQ(16U, record->ipv6Hints[0].size());
+    EXPECT_EQ('\x01', record->ipv6Hints[0].back());
+}
+
+TEST_F(SvcbRecordTest, AliasMode) {
+    const auto record = parse({0, 0, 3, 'c', 'd', 'n', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0},
+                              kDnsTypeSvcb);
+    ASSERT_TRUE(record);
+    EXPECT_TRUE(record->isAlias());
+    EXPECT_FALSE(record->targetIsOwner());
+    EXPECT_EQ("cdn.example", record->target);
+    EXPECT_TRUE(record->ipv4Hints.empty());
+    EXPECT_TRUE(record->ipv6Hints.empty());
+}
+
+TEST_F(SvcbRecordTest, Malformed) {
+    // A compressed target name.
+    EXPECT_FALSE(parse({0, 1, 0xc0, 0x0c}));
+    // A target name running past the RDATA.
+    EXPECT_FALSE(parse({0, 1, 3, 'c', 'd'}));
+    // Keys out of order.
+    EXPECT_FALSE(parse({0, 1, 0, 0, 6, 0, 0, 0, 4, 0, 0}));
+    // Half an IPv4 address.
+    EXPECT_FALSE(parse({0, 1, 0, 0, 4, 0, 2, 192, 0}));
+    // A value longer than what's left.
+    EXPECT_FALSE(parse({0, 1, 0, 0, 1, 0, 9, 'h'}));
+    // Not an SVCB record at all.
+    EXPECT_FALSE(parse({0, 1, 0}, ns_t_a));
+}
+
+}  // namespace android::net
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "TimerService.h"
+
+#include <vector>
+
+#include <netdutils/ThreadUtil.h>
+
+namespace android::net {
+
+TimerService::TimerService() {
+    mThread = std::thread(&TimerService::loop, this);
+}
+
+TimerService::~TimerService() {
+    {
+        std::lock_guard guard(mMutex);
+        mStopping = true;
+    }
+    mCv.notify_one();
+    mThread.join();
+}
+
+TimerService::Id TimerService::schedule(clock::duration delay, clock::duration slack,
+                                        Callback callback) {
+    const auto earliest = clock::now() + delay;
+    const auto latest = earliest + slack;
+    std::lock_guard guard(mMutex);
+    const Id id = mNextId++;
+    mTimers.emplace(id, Timer{earliest, latest, std::move(callback)});
+    mDeadlines.emplace(latest, id);
+    // The thread only needs waking if this timer is now the first that can't wait.
+    if (mDeadlines.begin()->second == id) mCv.notify_one();
+    return id;
+}
+
+bool TimerService::cancel(Id id) {
+    std::lock_guard guard(mMutex);
+    const auto it = mTimers.find(id);
+    if (it == mTimers.end()) return false;
+    mDeadlines.erase({it->second.latest, id});
+    mTimers.erase(it);
+    return true;
+}
+
+TimerService::Stats TimerService::stats() const {
+    std::lock_guard guard(mMutex);
+    Stats stats = mStats;
+    stats.pending = mTimers.size();
+    return stats;
+}
+
+void TimerService::loop() {
+    netdutils::setThreadName("TimerService");
+    std::unique_lock lock(mMutex);
+    while (!mStopping) {
+        if (mDeadlines.empty()) {
+            mCv.wait(lock);
+            continue;
+        }
+        if (clock::now() < mDeadlines.begin()->first) {
+            mCv.wait_until(lock, mDeadlines.begin()->first);
+            continue;
+        }
+
+        // Now that the thread is up anyway, run everything that may run, not only what must.
+        const auto now = clock::now();
+        std::vector<Callback> due;
+        for (auto it = mTimers.begin(); it != mTimers.end();) {
+            if (it->second.earliest > now) {
+                ++it;
+                continue;
+            }
+            mDeadlines.erase({it->second.latest, it->first});
+            due.push_back(std::move(it->second.callback));
+            it = mTimers.erase(it);
+        }
+        mStats.wakeups++;
+        mStats.fired += due.size();
+
+        lock.unlock();
+        for (auto& callback : due) callback();
+        lock.lock();
+    }
+}
+
+}  // namespace android::net
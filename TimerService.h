@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Runs the background timers of the resolver, such as the retries of DoT validation and DNS64
+// prefix discovery, on a thread they share, so that the device wakes up for them in batches
+// instead of at unrelated moments. Each timer may run up to its slack late: the thread sleeps
+// until the first timer that can't wait any longer, then runs every timer that is due by then.
+//
+// Callbacks run on the timer thread, one after the other, and must not block: work that may is
+// handed to a thread of its own. This class is thread-safe.
+class TimerService {
+  public:
+    using clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+    // Never 0.
+    using Id = uint64_t;
+
+    // schedule() without a slack gives timers that fraction of their delay.
+    static constexpr int kDefaultSlackDivisor = 10;
+
+    struct Stats {
+        // Times the thread woke up to run timers, and timers run.
+        uint64_t wakeups = 0;
+        uint64_t fired = 0;
+        size_t pending = 0;
+    };
+
+    TimerService();
+    // Drops the timers that haven't run.
+    ~TimerService();
+    TimerService(const TimerService&) = delete;
+    TimerService& operator=(const TimerService&) = delete;
+
+    static TimerService& getInstance() {
+        static TimerService instance;
+        return instance;
+    }
+
+    // Runs |callback| between |delay| and |delay| + |slack| from now.
+    Id schedule(clock::duration delay, clock::duration slack, Callback callback) EXCLUDES(mMutex);
+    Id schedule(clock::duration delay, Callback callback) EXCLUDES(mMutex) {
+        return schedule(delay, delay / kDefaultSlackDivisor, std::move(callback));
+    }
+    // Returns false if the timer already ran, or is running.
+    bool cancel(Id id) EXCLUDES(mMutex);
+
+    Stats stats() const EXCLUDES(mMutex);
+
+  private:
+    struct Timer {
+        clock::time_point earliest;
+        clock::time_point latest;
+        Callback callback;
+    };
+
+    void loop() EXCLUDES(mMutex);
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCv;
+    std::map<Id, Timer> mTimers GUARDED_BY(mMutex);
+    // The timers by the latest time they can run at.
+    std::set<std::pair<clock::time_point, Id>> mDeadlines GUARDED_BY(mMutex);
+    Id mNextId GUARDED_BY(mMutex) = 1;
+    Stats mStats GUARDED_BY(mMutex);
+    bool mStopping GUARDED_BY(mMutex) = false;
+    std::thread mThread;
+};
+
+}  // namespace android::net
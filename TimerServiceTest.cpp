@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "TimerService.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using clock = TimerService::clock;
+
+class TimerServiceTest : public ResolvTestBase {
+  protected:
+    // Returns a callback that records when it ran, as the |index|th timer.
+    TimerService::Callback record(int index) {
+        return [this, index] {
+            std::lock_guard guard(mMutex);
+            mFired.emplace_back(index, clock::now());
+            mCv.notify_all();
+        };
+    }
+
+    // Waits until |n| timers ran, for up to 2 seconds.
+    bool waitFor(size_t n) {
+        std::unique_lock lock(mMutex);
+        return mCv.wait_for(lock, 2s, [&] { return mFired.size() >= n; });
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::vector<std::pair<int, clock::time_point>> mFired;
+    // Declared last, so that its thread stops before the members its callbacks use go away.
+    TimerService mTimers;
+};
+
+TEST_F(TimerServiceTest, RunsAfterDelay) {
+    const auto start = clock::now();
+    mTimers.schedule(100ms, 0ms, record(1));
+    mTimers.schedule(50ms, 0ms, record(0));
+    ASSERT_TRUE(waitFor(2));
+    std::lock_guard guard(mMutex);
+    EXPECT_EQ(0, mFired[0].first);
+    EXPECT_EQ(1, mFired[1].first);
+    EXPECT_GE(mFired[0].second - start, 50ms);
+    EXPECT_GE(mFired[1].second - start, 100ms);
+}
+
+TEST_F(TimerServiceTest, CoalescesTimersWithinSlack) {
+    // The first can wait until 300ms, by when the second may run too.
+    mTimers.schedule(100ms, 200ms, record(0));
+    mTimers.schedule(150ms, 1s, record(1));
+    ASSERT_TRUE(waitFor(2));
+    const TimerService::Stats stats = mTimers.stats();
+    EXPECT_EQ(1U, stats.wakeups);
+    EXPECT_EQ(2U, stats.fired);
+    EXPECT_EQ(0U, stats.pending);
+
+    // One that may not run yet stays for later.
+    mTimers.schedule(50ms, 0ms, record(2));
+    mTimers.schedule(1s, 1s, record(3));
+    ASSERT_TRUE(waitFor(3));
+    EXPECT_EQ(1U, mTimers.stats().pending);
+}
+
+TEST_F(TimerServiceTest, Cancel) {
+    const TimerService::Id id = mTimers.schedule(50ms, 0ms, record(0));
+    EXPECT_NE(0U, id);
+    EXPECT_TRUE(mTimers.cancel(id));
+    EXPECT_FALSE(mTimers.cancel(id));
+
+    mTimers.schedule(100ms, 0ms, record(1));
+    ASSERT_TRUE(waitFor(1));
+    std::lock_guard guard(mMutex);
+    ASSERT_EQ(1U, mFired.size());
+    EXPECT_EQ(1, mFired[0].first);
+}
+
+}  // namespace android::net
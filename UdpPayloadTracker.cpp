@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "UdpPayloadTracker.h"
+
+#include <arpa/nameser.h>
+
+#include <algorithm>
+#include <cctype>
+
+#include <android-base/logging.h>
+
+#include "DnsMessageIndex.h"
+#include "Experiments.h"
+
+namespace android::net {
+
+using netdutils::IPSockAddr;
+
+namespace {
+
+constexpr size_t kNumPayloadSizes = std::size(UdpPayloadTracker::kPayloadSizes);
+
+const DnsMessageIndex::Record* findOpt(const DnsMessageIndex& index) {
+    for (const DnsMessageIndex::Record& rr : index.section(ns_s_ar)) {
+        if (rr.type == ns_t_opt) return &rr;
+    }
+    return nullptr;
+}
+
+}  // namespace
+
+bool UdpPayloadTracker::isEnabled() {
+    return Experiments::getInstance()->getFlag("adaptive_edns", 0) == 1;
+}
+
+uint16_t UdpPayloadTracker::getPayloadSize(std::span<const uint8_t> query) {
+    DnsMessageIndex index;
+    if (!index.parse(query)) return 0;
+    const DnsMessageIndex::Record* opt = findOpt(index);
+    // The payload size is the CLASS of the OPT record.
+    return opt == nullptr ? 0 : opt->rclass;
+}
+
+bool UdpPayloadTracker::setPayloadSize(std::span<uint8_t> query, uint16_t size) {
+    DnsMessageIndex index;
+    if (!index.parse(query)) return false;
+    const DnsMessageIndex::Record* opt = findOpt(index);
+    if (opt == nullptr) return false;
+    // CLASS is followed by TTL and RDLEN, which RDATA follows.
+    const size_t classOffset = opt->rdataOffset - NS_INT16SZ - NS_INT32SZ - NS_INT16SZ;
+    query[classOffset] = size >> 8;
+    query[classOffset + 1] = size;
+    return true;
+}
+
+UdpPayloadTracker::QuestionKey UdpPayloadTracker::questionOf(std::span<const uint8_t> query) {
+    DnsMessageIndex index;
+    if (!index.parse(query) || index.section(ns_s_qd).empty()) return {};
+    const DnsMessageIndex::Record& question = index.section(ns_s_qd)[0];
+    char name[NS_MAXDNAME];
+    if (!index.expandName(question.nameOffset, name, sizeof(name))) return {};
+    std::string key(name);
+    std::ranges::transform(key, key.begin(), [](unsigned char c) { return std::tolower(c); });
+    return {std::move(key), question.type};
+}
+
+uint16_t UdpPayloadTracker::payloadSize(unsigned netid, const IPSockAddr& server) const {
+    std::lock_guard guard(mMutex);
+    const auto network = mNetworks.find(netid);
+    if (network == mNetworks.end()) return kPayloadSizes[0];
+    const auto it = network->second.servers.find(server);
+    return kPayloadSizes[it == network->second.servers.end() ? 0 : it->second.level];
+}
+
+bool UdpPayloadTracker::expectsTruncation(unsigned netid, const IPSockAddr& server,
+                                          std::span<const uint8_t> query, clock::time_point now) {
+    const QuestionKey key = questionOf(query);
+    std::lock_guard guard(mMutex);
+    const auto network = mNetworks.find(netid);
+    if (network == mNetworks.end()) return false;
+
+    uint16_t offered = kPayloadSizes[0];
+    if (const auto it = network->second.servers.find(server);
+        it != network->second.servers.end()) {
+        const Server& s = it->second;
+        offered = kPayloadSizes[s.level];
+        if (s.truncations >= kServerTruncations && now < s.lastTruncated + kTruncationLifetime) {
+            return true;
+        }
+    }
+    if (key.first.empty()) return false;
+    const auto it = network->second.questions.find(key);
+    if (it == network->second.questions.end()) return false;
+    const Question& q = it->second;
+    if (now >= q.lastTruncated + kTruncationLifetime) {
+        network->second.questions.erase(it);
+        return false;
+    }
+    return q.truncations >= kQuestionTruncations && offered <= q.payloadSize;
+}
+
+void UdpPayloadTracker::onAnswer(unsigned netid, const IPSockAddr& server,
+                                 std::span<const uint8_t> query, uint16_t payloadSize,
+                                 bool truncated, clock::time_point now) {
+    const QuestionKey key = questionOf(query);
+    std::lock_guard guard(mMutex);
+    Network& network = mNetworks[netid];
+    Server& s = network.servers[server];
+    if (!truncated) {
+        s.truncations = 0;
+        network.questions.erase(key);
+        return;
+    }
+
+    s.truncations++;
+    s.lastTruncated = now;
+    // The server has more to say than it was offered room for: offer it more next time, unless
+    // that lost fragments recently.
+    if (payloadSize == kPayloadSizes[s.level] && s.level + 1 < kNumPayloadSizes &&
+        now >= s.holdUntil) {
+        s.level++;
+        LOG(DEBUG) << __func__ << ": " << server.toString() << " now offered "
+                   << kPayloadSizes[s.level];
+    }
+
+    if (key.first.empty()) return;
+    auto it = network.questions.find(key);
+    if (it == network.questions.end()) {
+        std::erase_if(network.questions, [now](const auto& entry) {
+            return now >= entry.second.lastTruncated + kTruncationLifetime;
+        });
+        if (network.questions.size() >= kMaxQuestionsPerNetwork) return;
+        it = network.questions.emplace(key, Question{}).first;
+    }
+    Question& q = it->second;
+    q.truncations++;
+    q.payloadSize = std::max(q.payloadSize, payloadSize);
+    q.lastTruncated = now;
+}
+
+void UdpPayloadTracker::onTimeout(unsigned netid, const IPSockAddr& server, uint16_t payloadSize,
+                                  clock::time_point now) {
+    if (payloadSize <= kPayloadSizes[0]) return;
+    std::lock_guard guard(mMutex);
+    const auto network = mNetworks.find(netid);
+    if (network == mNetworks.end()) return;
+    const auto it = network->second.servers.find(server);
+    if (it == network->second.servers.end()) return;
+    Server& s = it->second;
+    if (s.level == 0 || payloadSize != kPayloadSizes[s.level]) return;
+    s.level--;
+    s.holdUntil = now + kHoldDown;
+    LOG(DEBUG) << __func__ << ": " << server.toString() << " back to " << kPayloadSizes[s.level];
+}
+
+void UdpPayloadTracker::onTcpFailed(unsigned netid, const IPSockAddr& server,
+                                    std::span<const uint8_t> query) {
+    const QuestionKey key = questionOf(query);
+    std::lock_guard guard(mMutex);
+    const auto network = mNetworks.find(netid);
+    if (network == mNetworks.end()) return;
+    network->second.questions.erase(key);
+    if (const auto it = network->second.servers.find(server);
+        it != network->second.servers.end()) {
+        it->second.truncations = 0;
+    }
+}
+
+void UdpPayloadTracker::clear(unsigned netid) {
+    std::lock_guard guard(mMutex);
+    mNetworks.erase(netid);
+}
+
+}  // namespace android::net
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <span>
+#include <string>
+#include <utility>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/InternetAddresses.h>
+
+namespace android::net {
+
+// Learns, per server, the EDNS UDP payload size (RFC 6891 section 6.2.5) that gets its answers
+// through, and which questions and servers answer truncated, so that res_nsend() asks each server
+// for what the path to it carries, and sends the queries that would be truncated anyway over TCP
+// straight away instead of after a UDP round trip.
+//
+// A server starts at the first of kPayloadSizes, which avoids IP fragmentation on most paths. When
+// it truncates an answer at the size it was offered, it's offered the next size up. When a query
+// offering more than the first size times out, its fragments are taken to have been lost: the
+// server goes back down a size, and doesn't go up again for kHoldDown. This class is thread-safe.
+class UdpPayloadTracker {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr uint16_t kPayloadSizes[] = {1232, 2048, 4096};
+    static constexpr std::chrono::minutes kHoldDown{10};
+    // A question is sent over TCP first once its answer was truncated that many times in a row,
+    // and a server once that many of its answers in a row were.
+    static constexpr int kQuestionTruncations = 2;
+    static constexpr int kServerTruncations = 8;
+    // How long truncations are remembered, after which UDP is given another chance.
+    static constexpr std::chrono::minutes kTruncationLifetime{30};
+    // Questions remembered per network. New ones are ignored beyond that.
+    static constexpr size_t kMaxQuestionsPerNetwork = 256;
+
+    static UdpPayloadTracker& getInstance() {
+        static UdpPayloadTracker instance;
+        return instance;
+    }
+
+    // The "adaptive_edns" flag.
+    static bool isEnabled();
+
+    // The payload size advertised by the OPT record of |query|, or 0 if it has none.
+    static uint16_t getPayloadSize(std::span<const uint8_t> query);
+    // Sets the payload size advertised by the OPT record of |query|. Returns false if it has none.
+    static bool setPayloadSize(std::span<uint8_t> query, uint16_t size);
+
+    // The payload size to offer |server| of network |netid|.
+    uint16_t payloadSize(unsigned netid, const netdutils::IPSockAddr& server) const
+            EXCLUDES(mMutex);
+
+    // Whether the answer of |server| to |query| is expected to be truncated over UDP.
+    bool expectsTruncation(unsigned netid, const netdutils::IPSockAddr& server,
+                           std::span<const uint8_t> query, clock::time_point now = clock::now())
+            EXCLUDES(mMutex);
+
+    // Records the answer of |server| to |query| sent over UDP offering |payloadSize|.
+    void onAnswer(unsigned netid, const netdutils::IPSockAddr& server,
+                  std::span<const uint8_t> query, uint16_t payloadSize, bool truncated,
+                  clock::time_point now = clock::now()) EXCLUDES(mMutex);
+    // Records that a query to |server| sent over UDP offering |payloadSize| timed out.
+    void onTimeout(unsigned netid, const netdutils::IPSockAddr& server, uint16_t payloadSize,
+                   clock::time_point now = clock::now()) EXCLUDES(mMutex);
+    // Forgets that the answers of |server| to |query| are truncated, when sending it over TCP
+    // first failed.
+    void onTcpFailed(unsigned netid, const netdutils::IPSockAddr& server,
+                     std::span<const uint8_t> query) EXCLUDES(mMutex);
+
+    // Forgets everything learned on network |netid|.
+    void clear(unsigned netid) EXCLUDES(mMutex);
+
+  private:
+    struct Server {
+        // Into kPayloadSizes.
+        size_t level = 0;
+        clock::time_point holdUntil;
+        int truncations = 0;
+        clock::time_point lastTruncated;
+    };
+    struct Question {
+        int truncations = 0;
+        // The largest payload size the answer was truncated at: a server offered more may not
+        // truncate it.
+        uint16_t payloadSize = 0;
+        clock::time_point lastTruncated;
+    };
+    // Name, lower case and without the trailing dot, and type.
+    using QuestionKey = std::pair<std::string, uint16_t>;
+    struct Network {
+        std::map<netdutils::IPSockAddr, Server> servers;
+        std::map<QuestionKey, Question> questions;
+    };
+
+    // The key of the first question of |query|, or an empty name if it can't be parsed.
+    static QuestionKey questionOf(std::span<const uint8_t> query);
+
+    mutable std::mutex mMutex;
+    std::map<unsigned, Network> mNetworks GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/nameser.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "UdpPayloadTracker.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using netdutils::IPSockAddr;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr unsigned kNetId = 31;
+const IPSockAddr kServer1 = IPSockAddr::toIPSockAddr("127.0.0.1", 53);
+const IPSockAddr kServer2 = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+const UdpPayloadTracker::clock::time_point kStart;
+
+// A query for |label|.com A, with an OPT record advertising |payloadSize| if it's not 0.
+std::vector<uint8_t> makeQuery(char label, uint16_t payloadSize = 4096) {
+    std::vector<uint8_t> msg = {
+            0, 1, 1, 0, 0, 1, 0, 0, 0, 0, 0, uint8_t(payloadSize ? 1 : 0),
+            1, uint8_t(label), 3, 'c', 'o', 'm', 0, 0, ns_t_a, 0, ns_c_in,
+    };
+    if (payloadSize) {
+        const uint8_t opt[] = {0, 0, ns_t_opt, uint8_t(payloadSize >> 8), uint8_t(payloadSize),
+                               0, 0, 0, 0, 0, 0};
+        msg.insert(msg.end(), std::begin(opt), std::end(opt));
+    }
+    return msg;
+}
+
+}  // namespace
+
+class UdpPayloadTrackerTest : public ResolvTestBase {
+  protected:
+    void TearDown() override { mTracker.clear(kNetId); }
+
+    UdpPayloadTracker mTracker;
+};
+
+TEST_F(UdpPayloadTrackerTest, PayloadSizeOfQuery) {
+    std::vector<uint8_t> query = makeQuery('a', 4096);
+    EXPECT_EQ(4096, UdpPayloadTracker::getPayloadSize(query));
+    ASSERT_TRUE(UdpPayloadTracker::setPayloadSize(query, 1232));
+    EXPECT_EQ(1232, UdpPayloadTracker::getPayloadSize(query));
+    EXPECT_EQ(makeQuery('a', 1232), query);
+
+    std::vector<uint8_t> plain = makeQuery('a', 0);
+    EXPECT_EQ(0, UdpPayloadTracker::getPayloadSize(plain));
+    EXPECT_FALSE(UdpPayloadTracker::setPayloadSize(plain, 1232));
+    EXPECT_EQ(makeQuery('a', 0), plain);
+}
+
+TEST_F(UdpPayloadTrackerTest, GrowsOnTruncationAndShrinksOnTimeout) {
+    const auto query = makeQuery('a');
+    EXPECT_EQ(1232, mTracker.payloadSize(kNetId, kServer1));
+
+    mTracker.onAnswer(kNetId, kServer1, query, 1232, true, kStart);
+    EXPECT_EQ(2048, mTracker.payloadSize(kNetId, kServer1));
+    EXPECT_EQ(1232, mTracker.payloadSize(kNetId, kServer2));
+    // A truncation at a size the server isn't offered anymore says nothing new.
+    mTracker.onAnswer(kNetId, kServer1, query, 1232, true, kStart);
+    EXPECT_EQ(2048, mTracker.payloadSize(kNetId, kServer1));
+
+    // Fragments lost: back down, and held there.
+    mTracker.onTimeout(kNetId, kServer1, 2048, kStart + 1s);
+    EXPECT_EQ(1232, mTracker.payloadSize(kNetId, kServer1));
+    mTracker.onAnswer(kNetId, kServer1, query, 1232, true, kStart + 2s);
+    EXPECT_EQ(1232, mTracker.payloadSize(kNetId, kServer1));
+    mTracker.onAnswer(kNetId, kServer1, query, 1232, true,
+                      kStart + 1s + UdpPayloadTracker::kHoldDown);
+    EXPECT_EQ(2048, mTracker.payloadSize(kNetId, kServer1));
+
+    // Timeouts at the smallest size are only timeouts.
+    mTracker.onTimeout(kNetId, kServer2, 1232, kStart);
+    EXPECT_EQ(1232, mTracker.payloadSize(kNetId, kServer2));
+}
+
+TEST_F(UdpPayloadTrackerTest, ExpectsTruncatedQuestions) {
+    const auto query = makeQuery('a');
+    const auto other = makeQuery('b');
+    const auto upper = makeQuery('A');
+
+    // Truncated at every size, as the server is offered more each time.
+    for (uint16_t size : UdpPayloadTracker::kPayloadSizes) {
+        EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer1, query, kStart));
+        mTracker.onAnswer(kNetId, kServer1, query, size, true, kStart);
+    }
+    EXPECT_TRUE(mTracker.expectsTruncation(kNetId, kServer1, query, kStart));
+    EXPECT_TRUE(mTracker.expectsTruncation(kNetId, kServer1, upper, kStart));
+    EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer1, other, kStart));
+    // Another server is offered less, and truncates too.
+    EXPECT_TRUE(mTracker.expectsTruncation(kNetId, kServer2, query, kStart));
+
+    // Remembered for a while only.
+    EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer1, query,
+                                            kStart + UdpPayloadTracker::kTruncationLifetime));
+
+    for (int i = 0; i < UdpPayloadTracker::kQuestionTruncations; i++) {
+        mTracker.onAnswer(kNetId, kServer1, query, 4096, true, kStart);
+    }
+    EXPECT_TRUE(mTracker.expectsTruncation(kNetId, kServer1, query, kStart));
+    mTracker.onTcpFailed(kNetId, kServer1, query);
+    EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer1, query, kStart));
+
+    for (int i = 0; i < UdpPayloadTracker::kQuestionTruncations; i++) {
+        mTracker.onAnswer(kNetId, kServer1, query, 4096, true, kStart);
+    }
+    mTracker.onAnswer(kNetId, kServer1, query, 4096, false, kStart);
+    EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer1, query, kStart));
+}
+
+TEST_F(UdpPayloadTrackerTest, QuestionTruncatedAtLessThanOffered) {
+    const auto query = makeQuery('a');
+    // The server grows to 2048 on the first truncation, which the answer may fit in.
+    mTracker.onAnswer(kNetId, kServer1, query, 1232, true, kStart);
+    mTracker.onAnswer(kNetId, kServer2, query, 1232, true, kStart);
+    EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer1, query, kStart));
+    EXPECT_TRUE(mTracker.expectsTruncation(kNetId, kServer2, query, kStart));
+}
+
+TEST_F(UdpPayloadTrackerTest, ExpectsTruncatingServers) {
+    const auto query = makeQuery('a');
+    for (int i = 0; i < UdpPayloadTracker::kServerTruncations; i++) {
+        EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer1, query, kStart));
+        mTracker.onAnswer(kNetId, kServer1, makeQuery('a' + i), 4096, true, kStart);
+    }
+    EXPECT_TRUE(mTracker.expectsTruncation(kNetId, kServer1, makeQuery('z'), kStart));
+    EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer2, makeQuery('z'), kStart));
+
+    mTracker.clear(kNetId);
+    EXPECT_FALSE(mTracker.expectsTruncation(kNetId, kServer1, makeQuery('z'), kStart));
+}
+
+}  // namespace android::net
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ValidationScheduler.h"
+
+#include <android-base/logging.h>
+
+namespace android::net {
+
+bool ValidationScheduler::hasRoomLocked() const {
+    return mMaxConcurrent == 0 || mRunning < mMaxConcurrent;
+}
+
+void ValidationScheduler::start(int priority) {
+    std::unique_lock lock(mLock);
+    const std::pair<int, uint64_t> ticket = {priority, mNextTicket++};
+    mWaiting.insert(ticket);
+    mCv.wait(lock, [&]() REQUIRES(mLock) {
+        return hasRoomLocked() && *mWaiting.begin() == ticket;
+    });
+    mWaiting.erase(ticket);
+    ++mRunning;
+    // The next one in line may fit as well.
+    mCv.notify_all();
+}
+
+void ValidationScheduler::finish() {
+    std::lock_guard guard(mLock);
+    if (mRunning == 0) {
+        LOG(FATAL_WITHOUT_ABORT) << "Finished more validations than were started, this is a bug.";
+        return;
+    }
+    --mRunning;
+    mCv.notify_all();
+}
+
+void ValidationScheduler::setMaxConcurrent(size_t maxConcurrent) {
+    std::lock_guard guard(mLock);
+    if (mMaxConcurrent == maxConcurrent) return;
+    mMaxConcurrent = maxConcurrent;
+    mCv.notify_all();
+}
+
+size_t ValidationScheduler::running() const {
+    std::lock_guard guard(mLock);
+    return mRunning;
+}
+
+size_t ValidationScheduler::waiting() const {
+    std::lock_guard guard(mLock);
+    return mWaiting.size();
+}
+
+}  // namespace android::net
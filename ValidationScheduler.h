@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <utility>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Bounds the number of private DNS validations running at the same time, so that a network with
+// several unreachable servers doesn't tie up a thread and a socket for each. Validations that
+// have to wait are let through lowest |priority| first, and in the order they arrived for equal
+// priorities.
+//
+// The intended usage pattern is:
+//     scheduler.start(priority);
+//     // ...run the validation...
+//     scheduler.finish();
+//
+// This class is thread-safe.
+class ValidationScheduler {
+  public:
+    // No limit if |maxConcurrent| is 0.
+    explicit ValidationScheduler(size_t maxConcurrent) : mMaxConcurrent(maxConcurrent) {}
+
+    // Blocks until fewer than the maximum number of validations are running and no validation
+    // waiting before this one comes first.
+    void start(int priority) EXCLUDES(mLock);
+    // Each start() must be matched by exactly one finish().
+    void finish() EXCLUDES(mLock);
+
+    // Takes effect for the validations still waiting.
+    void setMaxConcurrent(size_t maxConcurrent) EXCLUDES(mLock);
+
+    size_t running() const EXCLUDES(mLock);
+    size_t waiting() const EXCLUDES(mLock);
+
+  private:
+    bool hasRoomLocked() const REQUIRES(mLock);
+
+    mutable std::mutex mLock;
+    std::condition_variable mCv;
+    size_t mMaxConcurrent GUARDED_BY(mLock);
+    size_t mRunning GUARDED_BY(mLock) = 0;
+    // Ordered by priority, then by arrival.
+    std::set<std::pair<int, uint64_t>> mWaiting GUARDED_BY(mLock);
+    uint64_t mNextTicket GUARDED_BY(mLock) = 0;
+};
+
+}  // namespace android::net
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ValidationScheduler.h"
+#include "tests/resolv_test_base.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+
+class ValidationSchedulerTest : public ResolvTestBase {
+  protected:
+    // Waits until |n| validations are waiting.
+    bool waitForWaiting(size_t n) {
+        for (int i = 0; i < 200; i++) {
+            if (mScheduler.waiting() == n) return true;
+            std::this_thread::sleep_for(10ms);
+        }
+        return false;
+    }
+
+    ValidationScheduler mScheduler{1};
+};
+
+TEST_F(ValidationSchedulerTest, Bounded) {
+    mScheduler.setMaxConcurrent(2);
+    mScheduler.start(0);
+    mScheduler.start(0);
+    EXPECT_EQ(2U, mScheduler.running());
+
+    std::atomic<bool> started = false;
+    std::thread third([&] {
+        mScheduler.start(0);
+        started = true;
+    });
+    ASSERT_TRUE(waitForWaiting(1));
+    EXPECT_FALSE(started);
+
+    mScheduler.finish();
+    third.join();
+    EXPECT_TRUE(started);
+    EXPECT_EQ(2U, mScheduler.running());
+    EXPECT_EQ(0U, mScheduler.waiting());
+    mScheduler.finish();
+    mScheduler.finish();
+    EXPECT_EQ(0U, mScheduler.running());
+}
+
+TEST_F(ValidationSchedulerTest, Priority) {
+    mScheduler.start(0);
+
+    std::mutex mutex;
+    std::vector<int> order;
+    std::vector<std::thread> threads;
+    // Each one waits before the next is started, so that equal priorities keep their order.
+    for (const int priority : {5, 1, 5, -1}) {
+        threads.emplace_back([&, priority] {
+            mScheduler.start(priority);
+            {
+                std::lock_guard guard(mutex);
+                order.push_back(priority);
+            }
+            mScheduler.finish();
+        });
+        ASSERT_TRUE(waitForWaiting(threads.size()));
+    }
+
+    mScheduler.finish();
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ(std::vector<int>({-1, 1, 5, 5}), order);
+}
+
+TEST_F(ValidationSchedulerTest, Unbounded) {
+    mScheduler.setMaxConcurrent(0);
+    for (int i = 0; i < 10; i++) mScheduler.start(i);
+    EXPECT_EQ(10U, mScheduler.running());
+    for (int i = 0; i < 10; i++) mScheduler.finish();
+}
+
+TEST_F(ValidationSchedulerTest, RaiseLimit) {
+    mScheduler.start(0);
+    std::thread second([&] { mScheduler.start(0); });
+    ASSERT_TRUE(waitForWaiting(1));
+
+    // Raising the limit lets the waiting validation through right away.
+    mScheduler.setMaxConcurrent(2);
+    second.join();
+    EXPECT_EQ(2U, mScheduler.running());
+    mScheduler.finish();
+    mScheduler.finish();
+}
+
+}  // namespace android::net
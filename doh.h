@@ -54,6 +54,27 @@ struct FeatureFlags {
     uint64_t probe_timeout_ms;
     uint64_t idle_timeout_ms;
     bool use_session_resumption;
+    uint32_t max_connections;
+    uint32_t max_streams_per_connection;
+    bool use_early_data;
+};
+
+/// Counts of the DoH connections, since the process started, that resumed a QUIC session, and of
+/// those that sent 0-RTT early data, by whether the server accepted it.
+struct SessionStats {
+    uint64_t resumed;
+    uint64_t early_data_accepted;
+    uint64_t early_data_rejected;
+};
+
+/// One of the queries of doh_query_batch().
+struct DohBatchQuery {
+    const uint8_t* query;
+    size_t query_len;
+    uint8_t* answer;
+    size_t answer_len;
+    /// Set by `doh_query_batch()` as `doh_query()` would return it.
+    ssize_t result;
 };
 
 using ValidationCallback = void (*)(uint32_t net_id, bool success, const char* ip_addr,
@@ -61,6 +82,9 @@ using ValidationCallback = void (*)(uint32_t net_id, bool success, const char* i
 
 using TagSocketCallback = void (*)(int32_t sock);
 
+using QueryCallback = void (*)(void* context, ssize_t result, const uint8_t* answer,
+                               size_t answer_len);
+
 extern "C" {
 
 /// Performs static initialization for android logger.
@@ -104,10 +128,43 @@ int32_t doh_net_new(DohDispatcher* doh, uint32_t net_id, const char* url, const
 ssize_t doh_query(DohDispatcher* doh, uint32_t net_id, uint8_t* dns_query, size_t dns_query_len,
                   uint8_t* response, size_t response_len, uint64_t timeout_ms);
 
+/// Sends a DNS query via the network associated to the given |net_id| like `doh_query()`, but
+/// returns at once instead of waiting for the response, so that the caller needn't park a thread
+/// per query. Returns 0 if the query was sent, in which case `callback` is called exactly once
+/// with `context` and the outcome, or DOH_RESULT_CAN_NOT_SEND, in which case it is never called.
+/// The outcome is either one of the public constant DOH_RESULT_* to indicate the error, or the
+/// size of the answer at `answer`, which is only valid during the call.
+/// `callback` runs on a thread of the DoH engine, and must not block.
+/// # Safety
+/// `doh` must be a non-null pointer previously created by `doh_dispatcher_new()`
+/// and not yet deleted by `doh_dispatcher_delete()`.
+/// `dns_query` must point to a buffer at least `dns_query_len` in size, which needn't outlive the
+/// call.
+/// `context` must be usable from any thread until `callback` is called with it.
+ssize_t doh_query_async(DohDispatcher* doh, uint32_t net_id, const uint8_t* dns_query,
+                        size_t dns_query_len, uint64_t timeout_ms, QueryCallback callback,
+                        void* context);
+
+/// Sends several DNS queries via the network associated to the given |net_id| like `doh_query()`,
+/// but in a single command to the DoH engine, which sends them all as concurrent streams, and
+/// waits for all of their responses for up to `timeout_ms`. Returns 0 if the queries were sent,
+/// in which case the `result` of each is set as `doh_query()` would return it, or
+/// DOH_RESULT_CAN_NOT_SEND, in which case none of them was sent.
+/// # Safety
+/// `doh` must be a non-null pointer previously created by `doh_dispatcher_new()`
+/// and not yet deleted by `doh_dispatcher_delete()`.
+/// `queries` must point to `count` queries, the `query` of each pointing to a buffer at least
+/// `query_len` in size, and its `answer` to one at least `answer_len` in size.
+ssize_t doh_query_batch(DohDispatcher* doh, uint32_t net_id, DohBatchQuery* queries, size_t count,
+                        uint64_t timeout_ms);
+
 /// Clears the DoH servers associated with the given |netid|.
 /// # Safety
 /// `doh` must be a non-null pointer previously created by `doh_dispatcher_new()`
 /// and not yet deleted by `doh_dispatcher_delete()`.
 void doh_net_delete(DohDispatcher* doh, uint32_t net_id);
 
+/// Fills |stats| with the QUIC session resumption counts.
+void doh_get_session_stats(SessionStats* stats);
+
 }  // extern "C"
@@ -74,6 +74,9 @@ impl Config {
         config.set_initial_max_streams_bidi(MAX_CONCURRENT_STREAM_SIZE);
         config.set_initial_max_streams_uni(MAX_CONCURRENT_STREAM_SIZE);
         config.set_disable_active_migration(true);
+        if key.enable_early_data {
+            config.enable_early_data();
+        }
         Ok(Self(Arc::new(Mutex::new(config))))
     }
 
@@ -126,6 +129,7 @@ pub struct Cache {
 pub struct Key {
     pub cert_path: Option<String>,
     pub max_idle_timeout: u64,
+    pub enable_early_data: bool,
 }
 
 impl Cache {
@@ -174,13 +178,19 @@ impl Cache {
 #[test]
 fn create_quiche_config() {
     assert!(
-        Config::from_key(&Key { cert_path: None, max_idle_timeout: 1000 }).is_ok(),
+        Config::from_key(&Key {
+            cert_path: None,
+            max_idle_timeout: 1000,
+            enable_early_data: false
+        })
+        .is_ok(),
         "quiche config without cert creating failed"
     );
     assert!(
         Config::from_key(&Key {
             cert_path: Some("data/local/tmp/".to_string()),
-            max_idle_timeout: 1000
+            max_idle_timeout: 1000,
+            enable_early_data: false,
         })
         .is_ok(),
         "quiche config with cert creating failed"
@@ -191,18 +201,24 @@ fn create_quiche_config() {
 fn shared_cache() {
     let cache_a = Cache::new();
     let cache_b = cache_a.clone();
-    let config_a = cache_a.get(&Key { cert_path: None, max_idle_timeout: 1000 }).unwrap();
+    let config_a = cache_a
+        .get(&Key { cert_path: None, max_idle_timeout: 1000, enable_early_data: false })
+        .unwrap();
     assert_eq!(Arc::strong_count(&config_a.0), 2);
-    let _config_b = cache_b.get(&Key { cert_path: None, max_idle_timeout: 1000 }).unwrap();
+    let _config_b = cache_b
+        .get(&Key { cert_path: None, max_idle_timeout: 1000, enable_early_data: false })
+        .unwrap();
     assert_eq!(Arc::strong_count(&config_a.0), 3);
 }
 
 #[test]
 fn different_keys() {
     let cache = Cache::new();
-    let key_a = Key { cert_path: None, max_idle_timeout: 1000 };
-    let key_b = Key { cert_path: Some("a".to_string()), max_idle_timeout: 1000 };
-    let key_c = Key { cert_path: Some("a".to_string()), max_idle_timeout: 5000 };
+    let key_a = Key { cert_path: None, max_idle_timeout: 1000, enable_early_data: false };
+    let key_b =
+        Key { cert_path: Some("a".to_string()), max_idle_timeout: 1000, enable_early_data: false };
+    let key_c =
+        Key { cert_path: Some("a".to_string()), max_idle_timeout: 5000, enable_early_data: false };
     let config_a = cache.get(&key_a).unwrap();
     let config_b = cache.get(&key_b).unwrap();
     let _config_b = cache.get(&key_b).unwrap();
@@ -220,9 +236,13 @@ fn different_keys() {
 #[test]
 fn lifetimes() {
     let cache = Cache::new();
-    let key_a = Key { cert_path: Some("a".to_string()), max_idle_timeout: 1000 };
-    let key_b = Key { cert_path: Some("b".to_string()), max_idle_timeout: 1000 };
-    let config_none = cache.get(&Key { cert_path: None, max_idle_timeout: 1000 }).unwrap();
+    let key_a =
+        Key { cert_path: Some("a".to_string()), max_idle_timeout: 1000, enable_early_data: false };
+    let key_b =
+        Key { cert_path: Some("b".to_string()), max_idle_timeout: 1000, enable_early_data: false };
+    let config_none = cache
+        .get(&Key { cert_path: None, max_idle_timeout: 1000, enable_early_data: false })
+        .unwrap();
     let config_a = cache.get(&key_a).unwrap();
     let config_b = cache.get(&key_b).unwrap();
 
@@ -268,7 +288,9 @@ fn lifetimes() {
 #[tokio::test]
 async fn quiche_connect() {
     use std::net::{Ipv4Addr, SocketAddr, SocketAddrV4};
-    let mut config = Config::from_key(&Key { cert_path: None, max_idle_timeout: 10 }).unwrap();
+    let mut config =
+        Config::from_key(&Key { cert_path: None, max_idle_timeout: 10, enable_early_data: false })
+            .unwrap();
     let socket_addr = SocketAddr::V4(SocketAddrV4::new(Ipv4Addr::new(127, 0, 0, 1), 42));
     let conn_id = quiche::ConnectionId::from_ref(&[]);
     quiche::connect(None, &conn_id, socket_addr, config.take().await.deref_mut()).unwrap();
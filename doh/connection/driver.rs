@@ -19,17 +19,18 @@ use crate::boot_time;
 use crate::boot_time::BootTime;
 use log::{debug, warn};
 use quiche::h3;
-use std::collections::HashMap;
+use std::collections::{HashMap, VecDeque};
 use std::default::Default;
 use std::future;
 use std::io;
 use std::pin::Pin;
+use std::sync::atomic::Ordering;
 use thiserror::Error;
 use tokio::net::UdpSocket;
 use tokio::select;
 use tokio::sync::{mpsc, oneshot, watch};
 
-use super::Status;
+use super::{SessionStore, Status, EARLY_DATA_ACCEPTED, EARLY_DATA_REJECTED, RESUMED};
 
 #[derive(Error, Debug)]
 pub enum Error {
@@ -87,6 +88,7 @@ struct Driver {
     // moves of the driver.
     buffer: Box<[u8; MAX_UDP_PACKET_SIZE]>,
     net_id: u32,
+    sessions: Option<SessionStore>,
     // Used to check if the connection has entered closing or draining state. A connection can
     // enter closing state if the sender of request_rx's channel has been dropped.
     // Note that we can't check if a receiver is dead without potentially receiving a message, and
@@ -104,6 +106,12 @@ struct H3Driver {
     h3_conn: h3::Connection,
     requests: HashMap<u64, Request>,
     streams: HashMap<u64, Stream>,
+    // Whether the requests are still being sent as early data, before the handshake completes.
+    early_data: bool,
+    // Requests sent as early data that the server rejected, in the order they were sent, waiting
+    // to be sent again over 1-RTT.
+    rejected_requests: VecDeque<Request>,
+    session_saved: bool,
 }
 
 async fn optional_timeout(timeout: Option<boot_time::Duration>, net_id: u32) {
@@ -122,8 +130,9 @@ pub async fn drive(
     quiche_conn: Pin<Box<quiche::Connection>>,
     socket: UdpSocket,
     net_id: u32,
+    sessions: Option<SessionStore>,
 ) -> Result<()> {
-    Driver::new(request_rx, status_tx, quiche_conn, socket, net_id).drive().await
+    Driver::new(request_rx, status_tx, quiche_conn, socket, net_id, sessions).drive().await
 }
 
 impl Driver {
@@ -133,6 +142,7 @@ impl Driver {
         quiche_conn: Pin<Box<quiche::Connection>>,
         socket: UdpSocket,
         net_id: u32,
+        sessions: Option<SessionStore>,
     ) -> Self {
         Self {
             request_rx,
@@ -141,10 +151,28 @@ impl Driver {
             socket,
             buffer: Box::new([0; MAX_UDP_PACKET_SIZE]),
             net_id,
+            sessions,
             closing: false,
         }
     }
 
+    // Returns whether there was a session to save.
+    fn save_session(&self) -> bool {
+        match (&self.sessions, self.quiche_conn.session()) {
+            (Some(sessions), Some(session)) => {
+                sessions.save(session);
+                true
+            }
+            _ => false,
+        }
+    }
+
+    fn report_dead(&self) {
+        self.save_session();
+        // We don't care if the receiver has hung up
+        let _ = self.status_tx.send(Status::Dead);
+    }
+
     async fn drive(mut self) -> Result<()> {
         // Prime connection
         self.flush_tx().await?;
@@ -162,8 +190,7 @@ impl Driver {
                 self.net_id,
                 self.quiche_conn.peer_error()
             );
-            // We don't care if the receiver has hung up
-            let _ = self.status_tx.send(Status::Dead { session: self.quiche_conn.session() });
+            self.report_dead();
             Err(Error::Closed)
         } else {
             Ok(())
@@ -179,8 +206,7 @@ impl Driver {
                 self.net_id,
                 self.quiche_conn.peer_error()
             );
-            // We don't care if the receiver has hung up
-            let _ = self.status_tx.send(Status::Dead { session: self.quiche_conn.session() });
+            self.report_dead();
 
             self.request_rx.close();
             // Drain the pending DNS requests from the queue to make their corresponding future
@@ -210,12 +236,14 @@ impl Driver {
         // Any of the actions in the select could require us to send packets to the peer
         self.flush_tx().await?;
 
-        // If the QUIC connection is live, but the HTTP/3 is not, try to bring it up
-        if self.quiche_conn.is_established() {
+        // If the QUIC connection is live, but the HTTP/3 is not, try to bring it up. A resumed
+        // connection can already carry requests as early data while the handshake completes.
+        if self.quiche_conn.is_established() || self.quiche_conn.is_in_early_data() {
             debug!(
-                "Connection {} established on network {}",
+                "Connection {} established on network {}, early_data={}",
                 self.quiche_conn.trace_id(),
-                self.net_id
+                self.net_id,
+                self.quiche_conn.is_in_early_data()
             );
             let h3_config = h3::Config::new()?;
             let h3_conn = h3::Connection::with_transport(&mut self.quiche_conn, &h3_config)?;
@@ -252,12 +280,19 @@ impl Driver {
 
 impl H3Driver {
     fn new(driver: Driver, h3_conn: h3::Connection) -> Self {
+        let early_data = !driver.quiche_conn.is_established();
+        if !early_data && driver.quiche_conn.is_resumed() {
+            RESUMED.fetch_add(1, Ordering::Relaxed);
+        }
         Self {
             driver,
             h3_conn,
             requests: HashMap::new(),
             streams: HashMap::new(),
             buffered_request: None,
+            early_data,
+            rejected_requests: VecDeque::new(),
+            session_saved: false,
         }
     }
 
@@ -265,10 +300,7 @@ impl H3Driver {
         let _ = self.driver.status_tx.send(Status::H3);
         loop {
             if let Err(e) = self.drive_once().await {
-                let _ = self
-                    .driver
-                    .status_tx
-                    .send(Status::Dead { session: self.driver.quiche_conn.session() });
+                self.driver.report_dead();
                 return Err(e)
             }
         }
@@ -283,6 +315,7 @@ impl H3Driver {
         if let Some(request) = self.buffered_request.take() {
             self.handle_request(request)?;
         }
+        self.resend_rejected_requests()?;
         select! {
             // Only attempt to enqueue new requests if we have no buffered request and aren't
             // closing
@@ -307,6 +340,15 @@ impl H3Driver {
         // Any of the actions in the select could require us to send packets to the peer
         self.driver.flush_tx().await?;
 
+        if self.early_data && self.driver.quiche_conn.is_established() {
+            self.end_early_data().await?;
+        }
+        // Save the session as soon as the server has sent a ticket, rather than only once the
+        // connection dies, so that it outlives a network torn down in the meantime.
+        if !self.session_saved {
+            self.session_saved = self.driver.save_session();
+        }
+
         // Process any incoming HTTP/3 events
         self.flush_h3().await?;
 
@@ -320,6 +362,53 @@ impl H3Driver {
         self.driver.handle_closed()
     }
 
+    async fn end_early_data(&mut self) -> Result<()> {
+        self.early_data = false;
+        if self.driver.quiche_conn.is_resumed() {
+            RESUMED.fetch_add(1, Ordering::Relaxed);
+            EARLY_DATA_ACCEPTED.fetch_add(1, Ordering::Relaxed);
+            return Ok(());
+        }
+        // The server discarded everything sent before the handshake completed, the HTTP/3
+        // control streams included. Start HTTP/3 again on the connection, which is now
+        // established, and send the requests again over 1-RTT: DNS queries are idempotent.
+        warn!("Early data rejected on network {}", self.driver.net_id);
+        EARLY_DATA_REJECTED.fetch_add(1, Ordering::Relaxed);
+        let h3_config = h3::Config::new()?;
+        match h3::Connection::with_transport(&mut self.driver.quiche_conn, &h3_config) {
+            Ok(h3_conn) => self.h3_conn = h3_conn,
+            Err(e) => {
+                // Fail the requests now rather than letting them time out, and stop new ones
+                // from coming.
+                warn!("Can't restart HTTP/3 on network {}: {:?}", self.driver.net_id, e);
+                self.requests.clear();
+                self.buffered_request = None;
+                self.driver.report_dead();
+                return self.shutdown(false, b"EARLY DATA REJECTED").await;
+            }
+        }
+        self.streams.clear();
+        let mut stream_ids: Vec<u64> = self.requests.keys().copied().collect();
+        stream_ids.sort_unstable();
+        for stream_id in stream_ids {
+            self.rejected_requests.extend(self.requests.remove(&stream_id));
+        }
+        self.rejected_requests.extend(self.buffered_request.take());
+        self.resend_rejected_requests()?;
+        self.driver.flush_tx().await
+    }
+
+    // Sends the rejected requests again, for as long as the connection can fit them.
+    fn resend_rejected_requests(&mut self) -> Result<()> {
+        while self.buffered_request.is_none() {
+            match self.rejected_requests.pop_front() {
+                Some(request) => self.handle_request(request)?,
+                None => break,
+            }
+        }
+        Ok(())
+    }
+
     fn handle_request(&mut self, request: Request) -> Result<()> {
         debug!("Handling DNS request on network {}, stats={:?}, peer_streams_left_bidi={}, peer_streams_left_uni={}",
                 self.driver.net_id, self.driver.quiche_conn.stats(), self.driver.quiche_conn.peer_streams_left_bidi(), self.driver.quiche_conn.peer_streams_left_uni());
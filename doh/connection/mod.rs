@@ -19,9 +19,12 @@ use crate::boot_time::BootTime;
 use crate::network::SocketTagger;
 use log::{debug, error, warn};
 use quiche::h3;
+use std::collections::HashMap;
 use std::future::Future;
 use std::io;
 use std::net::SocketAddr;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
 use thiserror::Error;
 use tokio::net::UdpSocket;
 use tokio::sync::{mpsc, oneshot, watch};
@@ -36,10 +39,70 @@ use driver::{drive, Request};
 pub enum Status {
     QUIC,
     H3,
-    Dead {
-        /// The session of the closed connection.
-        session: Option<Vec<u8>>,
-    },
+    Dead,
+}
+
+/// Identifies a server, as reached from a network, whose QUIC sessions can be resumed. A ticket
+/// links the connections that present it, so those of different networks are kept apart.
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
+pub struct SessionKey {
+    pub net_id: u32,
+    pub peer_addr: SocketAddr,
+    pub domain: Option<String>,
+}
+
+/// The latest QUIC session (TLS ticket and transport parameters) of each server on each network.
+/// It is owned by the dispatcher rather than by a network, so a network that is torn down and set
+/// up again can still resume, and send its first queries as 0-RTT early data if that is enabled.
+#[derive(Clone, Default)]
+pub struct SessionCache(Arc<Mutex<HashMap<SessionKey, Vec<u8>>>>);
+
+impl SessionCache {
+    pub fn new() -> Self {
+        Default::default()
+    }
+}
+
+/// A server's entry in a `SessionCache`, through which a connection resumes and saves sessions.
+#[derive(Clone)]
+pub struct SessionStore {
+    cache: SessionCache,
+    key: SessionKey,
+}
+
+impl SessionStore {
+    pub fn new(cache: SessionCache, key: SessionKey) -> Self {
+        Self { cache, key }
+    }
+
+    fn load(&self) -> Option<Vec<u8>> {
+        self.cache.0.lock().unwrap().get(&self.key).cloned()
+    }
+
+    fn save(&self, session: Vec<u8>) {
+        self.cache.0.lock().unwrap().insert(self.key.clone(), session);
+    }
+}
+
+static RESUMED: AtomicU64 = AtomicU64::new(0);
+static EARLY_DATA_ACCEPTED: AtomicU64 = AtomicU64::new(0);
+static EARLY_DATA_REJECTED: AtomicU64 = AtomicU64::new(0);
+
+/// Counts of the connections, since the process started, that resumed a session and that sent
+/// early data.
+#[derive(Debug, Default)]
+pub struct SessionStats {
+    pub resumed: u64,
+    pub early_data_accepted: u64,
+    pub early_data_rejected: u64,
+}
+
+pub fn session_stats() -> SessionStats {
+    SessionStats {
+        resumed: RESUMED.load(Ordering::Relaxed),
+        early_data_accepted: EARLY_DATA_ACCEPTED.load(Ordering::Relaxed),
+        early_data_rejected: EARLY_DATA_REJECTED.load(Ordering::Relaxed),
+    }
 }
 
 /// Quiche HTTP/3 connection
@@ -127,7 +190,8 @@ pub type Result<T> = std::result::Result<T, Error>;
 
 impl Connection {
     const MAX_PENDING_REQUESTS: usize = 10;
-    /// Create a new connection with a background task handling IO.
+    /// Create a new connection with a background task handling IO. With `sessions`, the
+    /// connection resumes the server's latest session, and saves its own for the next one.
     pub async fn new(
         server_name: Option<&str>,
         to: SocketAddr,
@@ -135,21 +199,21 @@ impl Connection {
         net_id: u32,
         tag_socket: &SocketTagger,
         config: &mut quiche::Config,
-        session: Option<Vec<u8>>,
+        sessions: Option<SessionStore>,
     ) -> Result<Self> {
         let (request_tx, request_rx) = mpsc::channel(Self::MAX_PENDING_REQUESTS);
         let (status_tx, status_rx) = watch::channel(Status::QUIC);
         let scid = new_scid();
         let mut quiche_conn =
             quiche::connect(server_name, &quiche::ConnectionId::from_ref(&scid), to, config)?;
-        if let Some(session) = session {
+        if let Some(session) = sessions.as_ref().and_then(SessionStore::load) {
             debug!("Setting session");
             quiche_conn.set_session(&session)?;
         }
 
         let socket = build_socket(to, socket_mark, tag_socket).await?;
         let driver = async move {
-            let result = drive(request_rx, status_tx, quiche_conn, socket, net_id).await;
+            let result = drive(request_rx, status_tx, quiche_conn, socket, net_id, sessions).await;
             if let Err(ref e) = result {
                 warn!("Connection driver returns some Err: {:?}", e);
             }
@@ -165,7 +229,7 @@ impl Connection {
         // borrow_and_update here.
         match &*self.status_rx.borrow() {
             Status::H3 => return true,
-            Status::Dead { .. } => return false,
+            Status::Dead => return false,
             Status::QUIC => (),
         }
         if self.status_rx.changed().await.is_err() {
@@ -184,11 +248,14 @@ impl Connection {
         }
     }
 
-    pub fn session(&self) -> Option<Vec<u8>> {
-        match &*self.status_rx.borrow() {
-            Status::Dead { session } => session.clone(),
-            _ => None,
-        }
+    /// Whether the connection has finished its handshake and can take queries, without waiting.
+    pub fn is_live(&self) -> bool {
+        matches!(*self.status_rx.borrow(), Status::H3)
+    }
+
+    /// Whether the connection has died and will never take queries again.
+    pub fn is_dead(&self) -> bool {
+        matches!(*self.status_rx.borrow(), Status::Dead)
     }
 
     /// Send a query, produce a future which will provide a response.
@@ -204,3 +271,26 @@ impl Connection {
         Ok(async move { response_rx.await.ok() })
     }
 }
+
+#[test]
+fn session_store() {
+    let cache = SessionCache::new();
+    let key = |net_id: u32, domain: &str| SessionKey {
+        net_id,
+        peer_addr: "127.0.0.1:443".parse().unwrap(),
+        domain: Some(domain.to_string()),
+    };
+    let a = SessionStore::new(cache.clone(), key(100, "a.example"));
+    let b = SessionStore::new(cache.clone(), key(100, "b.example"));
+    let other_network = SessionStore::new(cache.clone(), key(101, "a.example"));
+    assert_eq!(a.load(), None);
+    a.save(vec![1, 2, 3]);
+    assert_eq!(a.load(), Some(vec![1, 2, 3]));
+    assert_eq!(b.load(), None);
+    assert_eq!(other_network.load(), None);
+
+    // A store made later for the same server and network sees the saved session.
+    let a2 = SessionStore::new(cache, key(100, "a.example"));
+    a.save(vec![4]);
+    assert_eq!(a2.load(), Some(vec![4]));
+}
@@ -24,7 +24,7 @@ use tokio::sync::{mpsc, oneshot};
 
 use super::{Command, QueryError, Response};
 use crate::network::{Network, ServerInfo, SocketTagger, ValidationReporter};
-use crate::{config, network};
+use crate::{config, connection, network};
 
 pub struct Driver {
     command_rx: mpsc::Receiver<Command>,
@@ -32,6 +32,7 @@ pub struct Driver {
     validation: ValidationReporter,
     tagger: SocketTagger,
     config_cache: config::Cache,
+    session_cache: connection::SessionCache,
 }
 
 fn debug_err(r: Result<()>) {
@@ -52,6 +53,7 @@ impl Driver {
             validation,
             tagger,
             config_cache: config::Cache::new(),
+            session_cache: connection::SessionCache::new(),
         }
     }
 
@@ -69,6 +71,13 @@ impl Driver {
                 Command::Query { net_id, base64_query, expired_time, resp } => {
                     debug_err(self.query(net_id, base64_query, expired_time, resp).await)
                 }
+                Command::QueryBatch { net_id, base64_queries, expired_time, resps } => {
+                    // The network hands each to a stream of its own without waiting for the
+                    // answers, so they are all in flight together.
+                    for (base64_query, resp) in base64_queries.into_iter().zip(resps) {
+                        debug_err(self.query(net_id, base64_query, expired_time, resp).await)
+                    }
+                }
                 Command::Clear { net_id } => {
                     self.networks.remove(&net_id);
                     self.config_cache.garbage_collect();
@@ -117,11 +126,18 @@ impl Driver {
                 let key = config::Key {
                     cert_path: info.cert_path.clone(),
                     max_idle_timeout: info.idle_timeout_ms,
+                    enable_early_data: info.use_early_data,
                 };
                 let config = self.config_cache.get(&key)?;
                 vacant.insert(
-                    Network::new(info, config, self.validation.clone(), self.tagger.clone())
-                        .await?,
+                    Network::new(
+                        info,
+                        config,
+                        self.session_cache.clone(),
+                        self.validation.clone(),
+                        self.tagger.clone(),
+                    )
+                    .await?,
                 )
             }
         };
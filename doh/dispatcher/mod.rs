@@ -17,6 +17,7 @@
 use crate::boot_time::{BootTime, Duration};
 use anyhow::Result;
 use log::error;
+use std::future::Future;
 use tokio::runtime::{Builder, Runtime};
 use tokio::sync::{mpsc, oneshot};
 use tokio::task;
@@ -61,6 +62,13 @@ pub enum Command {
         expired_time: BootTime,
         resp: oneshot::Sender<Response>,
     },
+    /// Queries on the same network submitted together, each answered on its own `resps` entry.
+    QueryBatch {
+        net_id: u32,
+        base64_queries: Vec<String>,
+        expired_time: BootTime,
+        resps: Vec<oneshot::Sender<Response>>,
+    },
     Clear {
         net_id: u32,
     },
@@ -98,6 +106,21 @@ impl Dispatcher {
         Ok(())
     }
 
+    /// Like send_cmd(), but fails rather than waits if the command queue is full, so it never
+    /// blocks the caller.
+    pub fn try_send_cmd(&self, cmd: Command) -> Result<()> {
+        self.cmd_sender.try_send(cmd)?;
+        Ok(())
+    }
+
+    /// Runs `future` on the runtime of the dispatcher.
+    pub fn spawn<F>(&self, future: F)
+    where
+        F: Future<Output = ()> + Send + 'static,
+    {
+        self.runtime.spawn(future);
+    }
+
     pub fn exit_handler(&mut self) {
         if self.cmd_sender.blocking_send(Command::Exit).is_err() {
             return;
@@ -17,10 +17,12 @@
 //! C API for the DoH backend for the Android DnsResolver module.
 
 use crate::boot_time::{timeout, BootTime, Duration};
+use crate::connection;
 use crate::dispatcher::{Command, Dispatcher, Response, ServerInfo};
 use crate::network::{SocketTagger, ValidationReporter};
+use futures::future::join_all;
 use futures::FutureExt;
-use libc::{c_char, int32_t, size_t, ssize_t, uint32_t, uint64_t};
+use libc::{c_char, c_void, int32_t, size_t, ssize_t, uint32_t, uint64_t};
 use log::{error, warn};
 use std::ffi::CString;
 use std::net::{IpAddr, SocketAddr};
@@ -37,12 +39,51 @@ use url::Url;
 pub type ValidationCallback =
     extern "C" fn(net_id: uint32_t, success: bool, ip_addr: *const c_char, host: *const c_char);
 pub type TagSocketCallback = extern "C" fn(sock: RawFd);
+pub type QueryCallback =
+    extern "C" fn(context: *mut c_void, result: ssize_t, answer: *const u8, answer_len: size_t);
+
+/// The context of a QueryCallback, which the caller of `doh_query_async()` vouches can be used
+/// from any thread.
+struct QueryContext(*mut c_void);
+
+// SAFETY: See `doh_query_async()`.
+unsafe impl Send for QueryContext {}
+
+impl QueryContext {
+    // A method rather than the field, so that closures capture the whole context, which is Send.
+    fn get(&self) -> *mut c_void {
+        self.0
+    }
+}
 
 #[repr(C)]
 pub struct FeatureFlags {
     probe_timeout_ms: uint64_t,
     idle_timeout_ms: uint64_t,
     use_session_resumption: bool,
+    max_connections: uint32_t,
+    max_streams_per_connection: uint32_t,
+    use_early_data: bool,
+}
+
+/// One of the queries of `doh_query_batch()`.
+#[repr(C)]
+pub struct DohBatchQuery {
+    query: *const u8,
+    query_len: size_t,
+    answer: *mut u8,
+    answer_len: size_t,
+    /// Set by `doh_query_batch()` as `doh_query()` would return it.
+    result: ssize_t,
+}
+
+/// Counts of the DoH connections, since the process started, that resumed a QUIC session, and of
+/// those that sent 0-RTT early data, by whether the server accepted it.
+#[repr(C)]
+pub struct SessionStats {
+    resumed: uint64_t,
+    early_data_accepted: uint64_t,
+    early_data_rejected: uint64_t,
 }
 
 fn wrap_validation_callback(validation_fn: ValidationCallback) -> ValidationReporter {
@@ -233,6 +274,9 @@ pub unsafe extern "C" fn doh_net_new(
             cert_path,
             idle_timeout_ms: flags.idle_timeout_ms,
             use_session_resumption: flags.use_session_resumption,
+            max_connections: flags.max_connections,
+            max_streams_per_connection: flags.max_streams_per_connection,
+            use_early_data: flags.use_early_data,
         },
         timeout: Duration::from_millis(flags.probe_timeout_ms),
     };
@@ -315,6 +359,162 @@ pub unsafe extern "C" fn doh_query(
     }
 }
 
+/// Sends a DNS query via the network associated to the given |net_id| like `doh_query()`, but
+/// returns at once instead of waiting for the response, so that the caller needn't park a thread
+/// per query. Returns 0 if the query was sent, in which case `callback` is called exactly once
+/// with `context` and the outcome, or DOH_RESULT_CAN_NOT_SEND, in which case it is never called.
+/// The outcome is either one of the public constant DOH_RESULT_* to indicate the error, or the
+/// size of the answer at `answer`, which is only valid during the call.
+/// `callback` runs on a thread of the DoH engine, and must not block.
+/// # Safety
+/// `doh` must be a non-null pointer previously created by `doh_dispatcher_new()`
+/// and not yet deleted by `doh_dispatcher_delete()`.
+/// `dns_query` must point to a buffer at least `dns_query_len` in size, which needn't outlive the
+/// call.
+/// `context` must be usable from any thread until `callback` is called with it.
+#[no_mangle]
+pub unsafe extern "C" fn doh_query_async(
+    doh: &DohDispatcher,
+    net_id: uint32_t,
+    dns_query: *const u8,
+    dns_query_len: size_t,
+    timeout_ms: uint64_t,
+    callback: QueryCallback,
+    context: *mut c_void,
+) -> ssize_t {
+    let q = slice::from_raw_parts(dns_query, dns_query_len);
+
+    let (resp_tx, resp_rx) = oneshot::channel();
+    let t = Duration::from_millis(timeout_ms);
+    let expired_time = match BootTime::now().checked_add(t) {
+        Some(expired_time) => expired_time,
+        None => {
+            error!("Bad timeout parameter: {}", timeout_ms);
+            return DOH_RESULT_CAN_NOT_SEND;
+        }
+    };
+    let cmd = Command::Query {
+        net_id,
+        base64_query: base64::encode_config(q, base64::URL_SAFE_NO_PAD),
+        expired_time,
+        resp: resp_tx,
+    };
+
+    let dispatcher = doh.lock();
+    if let Err(e) = dispatcher.try_send_cmd(cmd) {
+        error!("Failed to send the query: {:?}", e);
+        return DOH_RESULT_CAN_NOT_SEND;
+    }
+    let context = QueryContext(context);
+    dispatcher.spawn(async move {
+        let (result, answer) = match timeout(t, resp_rx).await {
+            Ok(Ok(Response::Success { answer })) => {
+                if answer.len() > isize::MAX as usize {
+                    (DOH_RESULT_INTERNAL_ERROR, Vec::new())
+                } else {
+                    (answer.len() as ssize_t, answer)
+                }
+            }
+            Ok(Ok(rsp)) => {
+                error!("Non-successful response: {:?}", rsp);
+                (DOH_RESULT_CAN_NOT_SEND, Vec::new())
+            }
+            Ok(Err(e)) => {
+                error!("no result {}", e);
+                (DOH_RESULT_CAN_NOT_SEND, Vec::new())
+            }
+            Err(e) => {
+                error!("timeout: {}", e);
+                (DOH_RESULT_TIMEOUT, Vec::new())
+            }
+        };
+        callback(context.get(), result, answer.as_ptr(), answer.len());
+    });
+    0
+}
+
+/// Sends several DNS queries via the network associated to the given |net_id| like `doh_query()`,
+/// but in a single command to the DoH engine, which sends them all as concurrent streams, and
+/// waits for all of their responses for up to `timeout_ms`. Returns 0 if the queries were sent,
+/// in which case the `result` of each is set as `doh_query()` would return it, or
+/// DOH_RESULT_CAN_NOT_SEND, in which case none of them was sent.
+/// # Safety
+/// `doh` must be a non-null pointer previously created by `doh_dispatcher_new()`
+/// and not yet deleted by `doh_dispatcher_delete()`.
+/// `queries` must point to `count` queries, the `query` of each pointing to a buffer at least
+/// `query_len` in size, and its `answer` to one at least `answer_len` in size.
+#[no_mangle]
+pub unsafe extern "C" fn doh_query_batch(
+    doh: &DohDispatcher,
+    net_id: uint32_t,
+    queries: *mut DohBatchQuery,
+    count: size_t,
+    timeout_ms: uint64_t,
+) -> ssize_t {
+    let queries = slice::from_raw_parts_mut(queries, count);
+
+    let t = Duration::from_millis(timeout_ms);
+    let expired_time = match BootTime::now().checked_add(t) {
+        Some(expired_time) => expired_time,
+        None => {
+            error!("Bad timeout parameter: {}", timeout_ms);
+            return DOH_RESULT_CAN_NOT_SEND;
+        }
+    };
+    let mut base64_queries = Vec::with_capacity(count);
+    let mut resps = Vec::with_capacity(count);
+    let mut resp_rxs = Vec::with_capacity(count);
+    for q in queries.iter() {
+        let query = slice::from_raw_parts(q.query, q.query_len);
+        base64_queries.push(base64::encode_config(query, base64::URL_SAFE_NO_PAD));
+        let (resp_tx, resp_rx) = oneshot::channel();
+        resps.push(resp_tx);
+        resp_rxs.push(resp_rx);
+    }
+    let cmd = Command::QueryBatch { net_id, base64_queries, expired_time, resps };
+    if let Err(e) = doh.lock().send_cmd(cmd) {
+        error!("Failed to send the queries: {:?}", e);
+        return DOH_RESULT_CAN_NOT_SEND;
+    }
+
+    let rt = match Builder::new_current_thread().enable_all().build() {
+        Ok(rt) => rt,
+        Err(e) => {
+            error!("Failed to build the runtime: {:?}", e);
+            return DOH_RESULT_CAN_NOT_SEND;
+        }
+    };
+    let local = task::LocalSet::new();
+    // The timeouts all start now, as the queries were sent together.
+    let responses =
+        local.block_on(&rt, join_all(resp_rxs.into_iter().map(|resp_rx| timeout(t, resp_rx))));
+    for (q, response) in queries.iter_mut().zip(responses) {
+        q.result = match response {
+            Ok(Ok(Response::Success { answer })) => {
+                if answer.len() > q.answer_len || answer.len() > isize::MAX as usize {
+                    DOH_RESULT_INTERNAL_ERROR
+                } else {
+                    slice::from_raw_parts_mut(q.answer, answer.len()).copy_from_slice(&answer);
+                    answer.len() as ssize_t
+                }
+            }
+            Ok(Ok(rsp)) => {
+                error!("Non-successful response: {:?}", rsp);
+                DOH_RESULT_CAN_NOT_SEND
+            }
+            Ok(Err(e)) => {
+                error!("no result {}", e);
+                DOH_RESULT_CAN_NOT_SEND
+            }
+            Err(e) => {
+                error!("timeout: {}", e);
+                DOH_RESULT_TIMEOUT
+            }
+        };
+    }
+    0
+}
+
 /// Clears the DoH servers associated with the given |netid|.
 /// # Safety
 /// `doh` must be a non-null pointer previously created by `doh_dispatcher_new()`
@@ -326,6 +526,14 @@ pub extern "C" fn doh_net_delete(doh: &DohDispatcher, net_id: uint32_t) {
     }
 }
 
+/// Fills |stats| with the QUIC session resumption counts.
+#[no_mangle]
+pub extern "C" fn doh_get_session_stats(stats: &mut SessionStats) {
+    let connection::SessionStats { resumed, early_data_accepted, early_data_rejected } =
+        connection::session_stats();
+    *stats = SessionStats { resumed, early_data_accepted, early_data_rejected };
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -384,6 +592,9 @@ mod tests {
             cert_path: None,
             idle_timeout_ms: 0,
             use_session_resumption: true,
+            max_connections: 1,
+            max_streams_per_connection: 1,
+            use_early_data: false,
         };
 
         wrap_validation_callback(success_cb)(&info, true).await;
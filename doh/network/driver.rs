@@ -18,10 +18,11 @@
 
 use crate::boot_time::{timeout, BootTime, Duration};
 use crate::config::Config;
-use crate::connection::Connection;
+use crate::connection::{Connection, SessionCache, SessionKey, SessionStore};
 use crate::dispatcher::{QueryError, Response};
 use crate::encoding;
 use anyhow::{anyhow, bail, Result};
+use std::sync::atomic::{AtomicUsize, Ordering};
 use std::sync::Arc;
 use tokio::sync::{mpsc, watch};
 use tokio::task;
@@ -30,10 +31,46 @@ use super::{Query, ServerInfo, SocketTagger, ValidationReporter};
 
 use log::debug;
 
+/// A connection to the server, with the number of its streams still waiting for an answer.
+struct PooledConnection {
+    connection: Connection,
+    in_flight: Arc<AtomicUsize>,
+}
+
+impl PooledConnection {
+    fn new(connection: Connection) -> Self {
+        Self { connection, in_flight: Arc::new(AtomicUsize::new(0)) }
+    }
+
+    fn load(&self) -> usize {
+        self.in_flight.load(Ordering::Relaxed)
+    }
+}
+
+/// Counts a stream against its connection for as long as it is alive.
+struct StreamGuard(Arc<AtomicUsize>);
+
+impl StreamGuard {
+    fn new(in_flight: &Arc<AtomicUsize>) -> Self {
+        in_flight.fetch_add(1, Ordering::Relaxed);
+        Self(in_flight.clone())
+    }
+}
+
+impl Drop for StreamGuard {
+    fn drop(&mut self) {
+        self.0.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
 pub struct Driver {
     info: ServerInfo,
     config: Config,
-    connection: Connection,
+    /// Where connections resume from, if session resumption is enabled.
+    sessions: Option<SessionStore>,
+    /// Connections to the server. The first one is the one probed, and is always kept; the others
+    /// are dialed when it gets busy, and dropped once the server closes them.
+    pool: Vec<PooledConnection>,
     command_rx: mpsc::Receiver<Command>,
     status_tx: watch::Sender<Status>,
     validation: ValidationReporter,
@@ -76,7 +113,7 @@ async fn build_connection(
     info: &ServerInfo,
     tag_socket: &SocketTagger,
     config: &mut Config,
-    session: Option<Vec<u8>>,
+    sessions: &Option<SessionStore>,
 ) -> Result<Connection> {
     use std::ops::DerefMut;
     Ok(Connection::new(
@@ -86,7 +123,7 @@ async fn build_connection(
         info.net_id,
         tag_socket,
         config.take().await.deref_mut(),
-        session,
+        sessions.clone(),
     )
     .await?)
 }
@@ -97,14 +134,27 @@ impl Driver {
     pub async fn new(
         info: ServerInfo,
         mut config: Config,
+        session_cache: SessionCache,
         validation: ValidationReporter,
         tag_socket: SocketTagger,
     ) -> Result<(Self, mpsc::Sender<Command>, watch::Receiver<Status>)> {
         let (command_tx, command_rx) = mpsc::channel(Self::MAX_BUFFERED_COMMANDS);
         let (status_tx, status_rx) = watch::channel(Status::Unprobed);
-        let connection = build_connection(&info, &tag_socket, &mut config, None).await?;
+        let sessions = if info.use_session_resumption {
+            let key = SessionKey {
+                net_id: info.net_id,
+                peer_addr: info.peer_addr,
+                domain: info.domain.clone(),
+            };
+            Some(SessionStore::new(session_cache, key))
+        } else {
+            None
+        };
+        let pool = vec![PooledConnection::new(
+            build_connection(&info, &tag_socket, &mut config, &sessions).await?,
+        )];
         Ok((
-            Self { info, config, connection, status_tx, command_rx, validation, tag_socket },
+            Self { info, config, sessions, pool, status_tx, command_rx, validation, tag_socket },
             command_tx,
             status_rx,
         ))
@@ -127,8 +177,11 @@ impl Driver {
             debug!("Network is currently failed, reconnecting");
             // If our network is currently failed, it may be due to issues with the connection.
             // Re-establish before re-probing
-            self.connection =
-                build_connection(&self.info, &self.tag_socket, &mut self.config, None).await?;
+            self.pool.truncate(1);
+            self.pool[0] = PooledConnection::new(
+                build_connection(&self.info, &self.tag_socket, &mut self.config, &self.sessions)
+                    .await?,
+            );
             self.status_tx.send(Status::Unprobed)?;
         }
         if self.status_tx.borrow().is_live() {
@@ -145,7 +198,7 @@ impl Driver {
         let dns_request = encoding::dns_request(&probe, &self.info.url)?;
         let expiry = BootTime::now().checked_add(probe_timeout);
         let request = async {
-            match self.connection.query(dns_request, expiry).await {
+            match self.pool[0].connection.query(dns_request, expiry).await {
                 Err(e) => self.status_tx.send(Status::Failed(Arc::new(anyhow!(e)))),
                 Ok(rsp) => {
                     if let Some(_stream) = rsp.await {
@@ -180,16 +233,13 @@ impl Driver {
             bail!("Abandoning expired DNS request")
         }
 
-        if !self.connection.wait_for_live().await {
-            let session =
-                if self.info.use_session_resumption { self.connection.session() } else { None };
-            // Try reconnecting
-            self.connection =
-                build_connection(&self.info, &self.tag_socket, &mut self.config, session).await?;
-        }
+        let index = self.pick_connection().await?;
         let request = encoding::dns_request(&query.query, &self.info.url)?;
-        let stream_fut = self.connection.query(request, Some(query.expiry)).await?;
+        let pooled = &self.pool[index];
+        let stream_fut = pooled.connection.query(request, Some(query.expiry)).await?;
+        let guard = StreamGuard::new(&pooled.in_flight);
         task::spawn(async move {
+            let _guard = guard;
             let stream = match stream_fut.await {
                 Some(stream) => stream,
                 None => {
@@ -209,4 +259,65 @@ impl Driver {
         });
         Ok(())
     }
+
+    /// Returns the index of the connection the next query should go to: the live one with the
+    /// fewest streams in flight. If even that one is full, another connection is dialed so that
+    /// it's ready for the queries that come after; until its handshake completes, this one is
+    /// still used.
+    async fn pick_connection(&mut self) -> Result<usize> {
+        let mut i = 1;
+        while i < self.pool.len() {
+            if self.pool[i].connection.is_dead() {
+                self.pool.swap_remove(i);
+            } else {
+                i += 1;
+            }
+        }
+
+        let least_loaded = self
+            .pool
+            .iter()
+            .enumerate()
+            .filter(|(_, pooled)| pooled.connection.is_live())
+            .min_by_key(|(_, pooled)| pooled.load())
+            .map(|(index, _)| index);
+        let index = match least_loaded {
+            Some(index) => index,
+            None => {
+                if !self.pool[0].connection.wait_for_live().await {
+                    // Try reconnecting
+                    self.pool[0] = PooledConnection::new(
+                        build_connection(
+                            &self.info,
+                            &self.tag_socket,
+                            &mut self.config,
+                            &self.sessions,
+                        )
+                        .await?,
+                    );
+                }
+                0
+            }
+        };
+
+        let dialing = self.pool.iter().any(|pooled| !pooled.connection.is_live());
+        if self.pool[index].load() >= self.info.max_streams_per_connection as usize
+            && self.pool.len() < self.info.max_connections as usize
+            && !dialing
+        {
+            debug!(
+                "Dialing connection {} to server {} on Network {}",
+                self.pool.len() + 1,
+                self.info.peer_addr,
+                self.info.net_id
+            );
+            match build_connection(&self.info, &self.tag_socket, &mut self.config, &self.sessions)
+                .await
+            {
+                Ok(connection) => self.pool.push(PooledConnection::new(connection)),
+                Err(e) => debug!("Unable to dial another connection: {:?}", e),
+            }
+        }
+        Ok(index)
+    }
 }
@@ -18,6 +18,7 @@
 
 use crate::boot_time::{BootTime, Duration};
 use crate::config::Config;
+use crate::connection::SessionCache;
 use crate::dispatcher::{QueryError, Response};
 use anyhow::Result;
 use futures::future::BoxFuture;
@@ -49,6 +50,12 @@ pub struct ServerInfo {
     pub cert_path: Option<String>,
     pub idle_timeout_ms: u64,
     pub use_session_resumption: bool,
+    /// Whether resumed connections send queries as 0-RTT early data.
+    pub use_early_data: bool,
+    /// How many connections may be opened to the server at once.
+    pub max_connections: u32,
+    /// How many streams a connection carries before another connection is dialed.
+    pub max_streams_per_connection: u32,
 }
 
 #[derive(Debug)]
@@ -73,11 +80,12 @@ impl Network {
     pub async fn new(
         info: ServerInfo,
         config: Config,
+        sessions: SessionCache,
         validation: ValidationReporter,
         tagger: SocketTagger,
     ) -> Result<Network> {
         let (driver, command_tx, status_rx) =
-            Driver::new(info.clone(), config, validation, tagger).await?;
+            Driver::new(info.clone(), config, sessions, validation, tagger).await?;
         task::spawn(driver.drive());
         Ok(Network { info, command_tx, status_rx })
     }
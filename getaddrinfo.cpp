@@ -53,22 +53,46 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
 #include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 
+#include "AddrInfoBuilder.h"
+#include "DnsMessageIndex.h"
 #include "Experiments.h"
+#include "HostsFile.h"
+#include "PacketBuffer.h"
+#include "QueryTemplate.h"
+#include "QueryThreadPool.h"
+#include "QueryTrace.h"
+#include "SvcbRecord.h"
 #include "netd_resolv/resolv.h"
 #include "res_comp.h"
 #include "res_debug.h"
+#include "res_send.h"
 #include "resolv_cache.h"
 #include "resolv_private.h"
 #include "util.h"
 
 #define ANY 0
 
+using android::net::AddrInfoBuilder;
+using android::net::DnsMessageIndex;
 using android::net::NetworkDnsEventReported;
+using android::net::QueryStage;
+using android::net::QueryTemplate;
+using android::net::QueryThreadPool;
+using android::net::ScopedCacheOnlyLookup;
+using android::net::ScopedStageTimer;
 
 const char in_addrany[] = {0, 0, 0, 0};
 const char in_loopback[] = {127, 0, 0, 1};
@@ -117,10 +141,10 @@ const Explore explore_options[] = {
 
 struct res_target {
     struct res_target* next;
-    const char* name;                                                  // domain name
-    int qclass, qtype;                                                 // class and type of query
-    std::vector<uint8_t> answer = std::vector<uint8_t>(MAXPACKET, 0);  // buffer to put answer
-    int n = 0;                                                         // result length
+    const char* name;                   // domain name
+    int qclass, qtype;                  // class and type of query
+    android::net::PacketBuffer answer;  // buffer to put answer
+    int n = 0;                          // result length
 };
 
 static int str2number(const char*);
@@ -138,18 +162,18 @@ static int get_port(const struct addrinfo*, const char*, int);
 static const struct afd* find_afd(int);
 static int ip6_str2scopeid(const char*, struct sockaddr_in6*, uint32_t*);
 
-static struct addrinfo* getanswer(const std::vector<uint8_t>&, int, const char*, int,
-                                  const struct addrinfo*, int* herrno);
+static bool getanswer(std::span<const uint8_t>, int, const char*, int, const struct addrinfo*,
+                      AddrInfoBuilder* results, int* herrno);
 static int dns_getaddrinfo(const char* name, const addrinfo* pai,
                            const android_net_context* netcontext, addrinfo** rv,
                            NetworkDnsEventReported* event);
-static void _sethtent(FILE**);
-static void _endhtent(FILE**);
-static struct addrinfo* _gethtent(FILE**, const char*, const struct addrinfo*);
+static struct addrinfo* _gethtent(const android::net::HostsFile::Entry&, const struct addrinfo*);
 static struct addrinfo* getCustomHosts(const size_t netid, const char*, const struct addrinfo*);
 static bool files_getaddrinfo(const size_t netid, const char* name, const addrinfo* pai,
                               addrinfo** res);
 static int _find_src_addr(const struct sockaddr*, struct sockaddr*, unsigned, uid_t);
+static int find_src_addr_cached(unsigned, const struct sockaddr*, struct sockaddr*, unsigned,
+                                uid_t);
 
 static int res_queryN(const char* name, res_target* target, ResState* res, int* herrno);
 static int res_searchN(const char* name, res_target* target, ResState* res, int* herrno);
@@ -205,6 +229,10 @@ const char* gai_strerror(int ecode) {
 
 void freeaddrinfo(struct addrinfo* ai) {
     while (ai) {
+        if (AddrInfoBuilder::isBlock(ai)) {
+            ai = AddrInfoBuilder::freeBlock(ai);
+            continue;
+        }
         struct addrinfo* next = ai->ai_next;
         if (ai->ai_canonname) free(ai->ai_canonname);
         // Also frees ai->ai_addr which points to extra space beyond addrinfo
@@ -238,22 +266,22 @@ static int str2number(const char* p) {
  * on the local system". However, bionic doesn't currently support getifaddrs,
  * so checking for connectivity is the next best thing.
  */
-static int have_ipv6(unsigned mark, uid_t uid) {
+static int have_ipv6(unsigned netid, unsigned mark, uid_t uid) {
     static const struct sockaddr_in6 sin6_test = {
             .sin6_family = AF_INET6,
             .sin6_addr.s6_addr = {// 2000::
                                   0x20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}};
     sockaddr_union addr = {.sin6 = sin6_test};
-    return _find_src_addr(&addr.sa, NULL, mark, uid) == 1;
+    return find_src_addr_cached(netid, &addr.sa, NULL, mark, uid) == 1;
 }
 
-static int have_ipv4(unsigned mark, uid_t uid) {
+static int have_ipv4(unsigned netid, unsigned mark, uid_t uid) {
     static const struct sockaddr_in sin_test = {
             .sin_family = AF_INET,
             .sin_addr.s_addr = __constant_htonl(0x08080808L)  // 8.8.8.8
     };
     sockaddr_union addr = {.sin = sin_test};
-    return _find_src_addr(&addr.sa, NULL, mark, uid) == 1;
+    return find_src_addr_cached(netid, &addr.sa, NULL, mark, uid) == 1;
 }
 
 // Internal version of getaddrinfo(), but limited to AI_NUMERICHOST.
@@ -829,18 +857,21 @@ static int ip6_str2scopeid(const char* scope, struct sockaddr_in6* sin6, uint32_
         cp += (x);           \
     } while (0)
 
-#define BOUNDS_CHECK(ptr, count)     \
-    do {                             \
-        if (eom - (ptr) < (count)) { \
-            *herrno = NO_RECOVERY;   \
-            return NULL;             \
-        }                            \
+#define BOUNDS_CHECK(ptr, count)      \
+    do {                              \
+        if (eom - (ptr) < (count)) {  \
+            *herrno = NO_RECOVERY;    \
+            results->truncate(start); \
+            return false;             \
+        }                             \
     } while (0)
 
-static struct addrinfo* getanswer(const std::vector<uint8_t>& answer, int anslen, const char* qname,
-                                  int qtype, const struct addrinfo* pai, int* herrno) {
-    struct addrinfo sentinel = {};
-    struct addrinfo *cur;
+// Appends the addresses in |answer| to |results|. Returns false, leaving |results| as it was, if
+// there's none.
+static bool getanswer(std::span<const uint8_t> answer, int anslen, const char* qname, int qtype,
+                      const struct addrinfo* pai, AddrInfoBuilder* results, int* herrno) {
+    ScopedStageTimer timer(QueryStage::PARSE);
+    const size_t start = results->size();
     struct addrinfo ai;
     const struct afd* afd;
     char* canonname;
@@ -857,8 +888,6 @@ static struct addrinfo* getanswer(const std::vector<uint8_t>& answer, int anslen
     assert(qname != NULL);
     assert(pai != NULL);
 
-    cur = &sentinel;
-
     canonname = NULL;
     eom = answer.data() + anslen;
 
@@ -870,7 +899,7 @@ static struct addrinfo* getanswer(const std::vector<uint8_t>& answer, int anslen
             name_ok = res_hnok;
             break;
         default:
-            return NULL; /* XXX should be abort(); */
+            return false; /* XXX should be abort(); */
     }
     /*
      * find first satisfactory answer
@@ -884,12 +913,12 @@ static struct addrinfo* getanswer(const std::vector<uint8_t>& answer, int anslen
     BOUNDED_INCR(HFIXEDSZ);
     if (qdcount != 1) {
         *herrno = NO_RECOVERY;
-        return (NULL);
+        return false;
     }
     n = dn_expand(answer.data(), eom, cp, bp, ep - bp);
     if ((n < 0) || !(*name_ok)(bp)) {
         *herrno = NO_RECOVERY;
-        return (NULL);
+        return false;
     }
     BOUNDED_INCR(n + QFIXEDSZ);
     if (qtype == T_A || qtype == T_AAAA || qtype == T_ANY) {
@@ -900,7 +929,7 @@ static struct addrinfo* getanswer(const std::vector<uint8_t>& answer, int anslen
         n = strlen(bp) + 1; /* for the \0 */
         if (n >= MAXHOSTNAMELEN) {
             *herrno = NO_RECOVERY;
-            return (NULL);
+            return false;
         }
         canonname = bp;
         bp += n;
@@ -1000,9 +1029,12 @@ static struct addrinfo* getanswer(const std::vector<uint8_t>& answer, int anslen
                     cp += n;
                     continue;
                 }
-                cur->ai_next = get_ai(&ai, afd, (const char*) cp);
-                if (cur->ai_next == NULL) had_error++;
-                while (cur && cur->ai_next) cur = cur->ai_next;
+                {
+                    sockaddr_union addr = {};
+                    addr.sa.sa_family = afd->a_af;
+                    memcpy(reinterpret_cast<char*>(&addr) + afd->a_off, cp, afd->a_addrlen);
+                    results->add(ai, &addr.sa, afd->a_socklen);
+                }
                 cp += n;
                 break;
             default:
@@ -1011,20 +1043,20 @@ static struct addrinfo* getanswer(const std::vector<uint8_t>& answer, int anslen
         if (!had_error) haveanswer++;
     }
     if (haveanswer) {
-        if (!canonname)
-            (void) get_canonname(pai, sentinel.ai_next, qname);
-        else
-            (void) get_canonname(pai, sentinel.ai_next, canonname);
+        // As get_canonname() would.
+        if (pai->ai_flags & AI_CANONNAME) {
+            results->setCanonName(start, canonname ? canonname : qname);
+        }
         *herrno = NETDB_SUCCESS;
-        return sentinel.ai_next;
+        return true;
     }
 
     *herrno = NO_RECOVERY;
-    return NULL;
+    return false;
 }
 
 struct addrinfo_sort_elem {
-    struct addrinfo* ai;
+    const struct sockaddr* addr;
     int has_src_addr;
     sockaddr_union src_addr;
     int original_order;
@@ -1202,11 +1234,11 @@ static int _rfc6724_compare(const void* ptr1, const void* ptr2) {
 
     /* Rule 2: Prefer matching scope. */
     scope_src1 = _get_scope(&a1->src_addr.sa);
-    scope_dst1 = _get_scope(a1->ai->ai_addr);
+    scope_dst1 = _get_scope(a1->addr);
     scope_match1 = (scope_src1 == scope_dst1);
 
     scope_src2 = _get_scope(&a2->src_addr.sa);
-    scope_dst2 = _get_scope(a2->ai->ai_addr);
+    scope_dst2 = _get_scope(a2->addr);
     scope_match2 = (scope_src2 == scope_dst2);
 
     if (scope_match1 != scope_match2) {
@@ -1225,11 +1257,11 @@ static int _rfc6724_compare(const void* ptr1, const void* ptr2) {
 
     /* Rule 5: Prefer matching label. */
     label_src1 = _get_label(&a1->src_addr.sa);
-    label_dst1 = _get_label(a1->ai->ai_addr);
+    label_dst1 = _get_label(a1->addr);
     label_match1 = (label_src1 == label_dst1);
 
     label_src2 = _get_label(&a2->src_addr.sa);
-    label_dst2 = _get_label(a2->ai->ai_addr);
+    label_dst2 = _get_label(a2->addr);
     label_match2 = (label_src2 == label_dst2);
 
     if (label_match1 != label_match2) {
@@ -1237,8 +1269,8 @@ static int _rfc6724_compare(const void* ptr1, const void* ptr2) {
     }
 
     /* Rule 6: Prefer higher precedence. */
-    precedence1 = _get_precedence(a1->ai->ai_addr);
-    precedence2 = _get_precedence(a2->ai->ai_addr);
+    precedence1 = _get_precedence(a1->addr);
+    precedence2 = _get_precedence(a2->addr);
     if (precedence1 != precedence2) {
         return precedence2 - precedence1;
     }
@@ -1259,12 +1291,12 @@ static int _rfc6724_compare(const void* ptr1, const void* ptr2) {
      * to work very well directly applied to IPv4. (glibc uses information from
      * the routing table for a custom IPv4 implementation here.)
      */
-    if (a1->has_src_addr && a1->ai->ai_addr->sa_family == AF_INET6 && a2->has_src_addr &&
-        a2->ai->ai_addr->sa_family == AF_INET6) {
+    if (a1->has_src_addr && a1->addr->sa_family == AF_INET6 && a2->has_src_addr &&
+        a2->addr->sa_family == AF_INET6) {
         const struct sockaddr_in6* a1_src = &a1->src_addr.sin6;
-        const struct sockaddr_in6* a1_dst = (const struct sockaddr_in6*) a1->ai->ai_addr;
+        const struct sockaddr_in6* a1_dst = (const struct sockaddr_in6*) a1->addr;
         const struct sockaddr_in6* a2_src = &a2->src_addr.sin6;
-        const struct sockaddr_in6* a2_dst = (const struct sockaddr_in6*) a2->ai->ai_addr;
+        const struct sockaddr_in6* a2_dst = (const struct sockaddr_in6*) a2->addr;
         prefixlen1 = _common_prefix_len(&a1_src->sin6_addr, &a1_dst->sin6_addr);
         prefixlen2 = _common_prefix_len(&a2_src->sin6_addr, &a2_dst->sin6_addr);
         if (prefixlen1 != prefixlen2) {
@@ -1339,55 +1371,127 @@ static int _find_src_addr(const struct sockaddr* addr, struct sockaddr* src_addr
     return 1;
 }
 
+// Key of the result of _find_src_addr() in the source address cache. Routes hardly ever split an
+// IPv6 /64, so its addresses share their result; IPv4 addresses are kept one by one.
+static std::string srcAddrCacheKey(const struct sockaddr* addr, unsigned mark, uid_t uid) {
+    std::string key = android::base::StringPrintf("%u/%u/%d/", mark, uid, addr->sa_family);
+    if (addr->sa_family == AF_INET6) {
+        const auto* sin6 = (const struct sockaddr_in6*)addr;
+        key.append((const char*)sin6->sin6_addr.s6_addr, 8);
+        key += android::base::StringPrintf("%%%u", sin6->sin6_scope_id);
+    } else {
+        const auto* sin = (const struct sockaddr_in*)addr;
+        key.append((const char*)&sin->sin_addr, sizeof(sin->sin_addr));
+    }
+    return key;
+}
+
 /*
- * Sort the linked list starting at sentinel->ai_next in RFC6724 order.
- * Will leave the list unchanged if an error occurs.
+ * Same as _find_src_addr(), but with the "src_addr_cache" flag, reuses the results of the last
+ * few seconds on network |netid| rather than opening and connecting a socket every time.
  */
+static int find_src_addr_cached(unsigned netid, const struct sockaddr* addr,
+                                struct sockaddr* src_addr, unsigned mark, uid_t uid) {
+    if ((addr->sa_family != AF_INET && addr->sa_family != AF_INET6) ||
+        android::net::Experiments::getInstance()->getFlag("src_addr_cache", 0) != 1) {
+        return _find_src_addr(addr, src_addr, mark, uid);
+    }
+
+    const std::string key = srcAddrCacheKey(addr, mark, uid);
+    CachedSrcAddr cached = {};
+    if (!resolv_cache_lookup_src_addr(netid, key, &cached)) {
+        cached.reachable = _find_src_addr(addr, (struct sockaddr*)&cached.addr, mark, uid);
+        if (cached.reachable == -1) return -1;
+        resolv_cache_add_src_addr(netid, key, cached);
+    }
+    if (cached.reachable == 1 && src_addr) {
+        memcpy(src_addr, &cached.addr,
+               addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                           : sizeof(struct sockaddr_in));
+    }
+    return cached.reachable;
+}
 
-static void _rfc6724_sort(struct addrinfo* list_sentinel, unsigned mark, uid_t uid) {
-    struct addrinfo* cur;
-    int nelem = 0, i;
-    struct addrinfo_sort_elem* elems;
-
-    cur = list_sentinel->ai_next;
-    while (cur) {
-        ++nelem;
-        cur = cur->ai_next;
-    }
+/*
+ * Sort the results in RFC6724 order.
+ * Will leave the results unchanged if an error occurs.
+ */
 
-    elems = (struct addrinfo_sort_elem*) malloc(nelem * sizeof(struct addrinfo_sort_elem));
-    if (elems == NULL) {
-        goto error;
-    }
+static void _rfc6724_sort(AddrInfoBuilder* results, unsigned netid, unsigned mark, uid_t uid) {
+    ScopedStageTimer timer(QueryStage::SORT);
+    const int nelem = results->size();
+    std::vector<addrinfo_sort_elem> elems(nelem);
 
     /*
-     * Convert the linked list to an array that also contains the candidate
-     * source address for each destination address.
+     * Make an array that also contains the candidate source address for each destination
+     * address.
      */
-    for (i = 0, cur = list_sentinel->ai_next; i < nelem; ++i, cur = cur->ai_next) {
-        int has_src_addr;
-        assert(cur != NULL);
-        elems[i].ai = cur;
+    for (int i = 0; i < nelem; ++i) {
+        elems[i].addr = results->addr(i);
         elems[i].original_order = i;
 
-        has_src_addr = _find_src_addr(cur->ai_addr, &elems[i].src_addr.sa, mark, uid);
-        if (has_src_addr == -1) {
-            goto error;
-        }
+        const int has_src_addr =
+                find_src_addr_cached(netid, elems[i].addr, &elems[i].src_addr.sa, mark, uid);
+        if (has_src_addr == -1) return;
         elems[i].has_src_addr = has_src_addr;
     }
 
-    /* Sort the addresses, and rearrange the linked list so it matches the sorted order. */
-    qsort((void*) elems, nelem, sizeof(struct addrinfo_sort_elem), _rfc6724_compare);
+    /* Sort the addresses, and rearrange the results so they match the sorted order. */
+    qsort((void*) elems.data(), nelem, sizeof(struct addrinfo_sort_elem), _rfc6724_compare);
 
-    list_sentinel->ai_next = elems[0].ai;
-    for (i = 0; i < nelem - 1; ++i) {
-        elems[i].ai->ai_next = elems[i + 1].ai;
-    }
-    elems[nelem - 1].ai->ai_next = NULL;
+    std::vector<size_t> order(nelem);
+    for (int i = 0; i < nelem; ++i) order[i] = elems[i].original_order;
+    results->reorder(order);
+}
+
+// Key of the results of a DNS lookup in the addrinfo cache. Apart from the name and hints, the
+// results depend on the mark and UID, which may change the servers that are queried along with
+// the context flags, and on which families AI_ADDRCONFIG found connectivity for. The results
+// are sorted again on each hit, since the source addresses they're sorted by may have changed.
+static std::string addrinfoCacheKey(const char* name, const addrinfo* pai,
+                                    const android_net_context* netcontext, bool query_ipv6,
+                                    bool query_ipv4) {
+    return android::base::StringPrintf("%u/%u/%u/%d/%d/%d/%d/%d%d/%s", netcontext->uid,
+                                       netcontext->app_mark, netcontext->flags, pai->ai_flags,
+                                       pai->ai_family, pai->ai_socktype, pai->ai_protocol,
+                                       query_ipv6, query_ipv4, name);
+}
+
+// Returns how long the answer of |t| may be cached, as the packet cache would. Returns 0 if it
+// can't be cached.
+static uint32_t answerCacheTtl(const res_target& t) {
+    DnsMessageIndex index;
+    if (t.n <= 0 || !index.parse({t.answer.data(), static_cast<size_t>(t.n)})) return 0;
+    return index.cacheTtl();
+}
 
-error:
-    free(elems);
+static std::vector<CachedAddrInfo> addrinfoToCache(const addrinfo* ai) {
+    std::vector<CachedAddrInfo> addrs;
+    for (; ai; ai = ai->ai_next) {
+        CachedAddrInfo& cached = addrs.emplace_back();
+        cached.flags = ai->ai_flags;
+        cached.family = ai->ai_family;
+        cached.socktype = ai->ai_socktype;
+        cached.protocol = ai->ai_protocol;
+        memcpy(&cached.addr, ai->ai_addr, ai->ai_addrlen);
+        cached.addrlen = ai->ai_addrlen;
+        if (ai->ai_canonname) cached.canonname = ai->ai_canonname;
+    }
+    return addrs;
+}
+
+// Adds cached results to |results|.
+static void addrinfoFromCache(const std::vector<CachedAddrInfo>& addrs, AddrInfoBuilder* results) {
+    for (const CachedAddrInfo& cached : addrs) {
+        const addrinfo ai = {.ai_flags = cached.flags,
+                             .ai_family = cached.family,
+                             .ai_socktype = cached.socktype,
+                             .ai_protocol = cached.protocol};
+        results->add(ai, reinterpret_cast<const sockaddr*>(&cached.addr), cached.addrlen);
+        if (!cached.canonname.empty()) {
+            results->setCanonName(results->size() - 1, cached.canonname.c_str());
+        }
+    }
 }
 
 static int dns_getaddrinfo(const char* name, const addrinfo* pai,
@@ -1395,16 +1499,18 @@ static int dns_getaddrinfo(const char* name, const addrinfo* pai,
                            NetworkDnsEventReported* event) {
     res_target q = {};
     res_target q2 = {};
+    int query_ipv6 = 1, query_ipv4 = 1;
 
     switch (pai->ai_family) {
         case AF_UNSPEC: {
             /* prefer IPv6 */
             q.name = name;
             q.qclass = C_IN;
-            int query_ipv6 = 1, query_ipv4 = 1;
             if (pai->ai_flags & AI_ADDRCONFIG) {
-                query_ipv6 = have_ipv6(netcontext->app_mark, netcontext->uid);
-                query_ipv4 = have_ipv4(netcontext->app_mark, netcontext->uid);
+                query_ipv6 = have_ipv6(netcontext->app_netid, netcontext->app_mark,
+                                       netcontext->uid);
+                query_ipv4 = have_ipv4(netcontext->app_netid, netcontext->app_mark,
+                                       netcontext->uid);
             }
             if (query_ipv6) {
                 q.qtype = T_AAAA;
@@ -1439,6 +1545,25 @@ static int dns_getaddrinfo(const char* name, const addrinfo* pai,
 
     setMdnsFlag(name, res.netid, &(res.flags));
 
+    // The addrinfo cache skips building the queries and parsing their answers altogether.
+    const bool useAddrinfoCache =
+            !isMdnsResolution(res.flags) &&
+            android::net::Experiments::getInstance()->getFlag("addrinfo_cache", 0) == 1;
+    std::string cacheKey;
+    if (useAddrinfoCache) {
+        cacheKey = addrinfoCacheKey(name, pai, netcontext, query_ipv6, query_ipv4);
+        std::vector<CachedAddrInfo> cached;
+        if (resolv_cache_lookup_addrinfo(res.netid, cacheKey, &cached)) {
+            AddrInfoBuilder results;
+            addrinfoFromCache(cached, &results);
+            _rfc6724_sort(&results, netcontext->app_netid, netcontext->app_mark, netcontext->uid);
+            if ((*rv = results.release()) == nullptr) return EAI_MEMORY;
+            event->mutable_dns_query_events()->add_dns_query_event()->set_cache_hit(
+                    android::net::CS_FOUND);
+            return 0;
+        }
+    }
+
     int he;
     if (res_searchN(name, &q, &res, &he) < 0) {
         // Return h_errno (he) to catch more detailed errors rather than EAI_NODATA.
@@ -1446,89 +1571,51 @@ static int dns_getaddrinfo(const char* name, const addrinfo* pai,
         // See also herrnoToAiErrno().
         return herrnoToAiErrno(he);
     }
-
-    addrinfo sentinel = {};
-    addrinfo* cur = &sentinel;
-    addrinfo* ai = getanswer(q.answer, q.n, q.name, q.qtype, pai, &he);
-    if (ai) {
-        cur->ai_next = ai;
-        while (cur && cur->ai_next) cur = cur->ai_next;
+    // Some of the answers weren't in the cache; the lookup is done again by one that can send
+    // queries, and the partial results mustn't be sorted, nor cached.
+    if (const ScopedCacheOnlyLookup* cacheOnly = ScopedCacheOnlyLookup::current();
+        cacheOnly != nullptr && cacheOnly->missed()) {
+        return EAI_AGAIN;
     }
-    if (q.next) {
-        ai = getanswer(q2.answer, q2.n, q2.name, q2.qtype, pai, &he);
-        if (ai) cur->ai_next = ai;
-    }
-    if (sentinel.ai_next == NULL) {
+
+    // The results are sorted before they're allocated, all in one block.
+    AddrInfoBuilder results;
+    getanswer(q.answer, q.n, q.name, q.qtype, pai, &results, &he);
+    if (q.next) getanswer(q2.answer, q2.n, q2.name, q2.qtype, pai, &results, &he);
+    if (results.empty()) {
         // Note that getanswer() doesn't set the pair NETDB_INTERNAL and errno.
         // See also herrnoToAiErrno().
         return herrnoToAiErrno(he);
     }
 
-    _rfc6724_sort(&sentinel, netcontext->app_mark, netcontext->uid);
-
-    *rv = sentinel.ai_next;
-    return 0;
-}
+    _rfc6724_sort(&results, netcontext->app_netid, netcontext->app_mark, netcontext->uid);
+    if ((*rv = results.release()) == nullptr) return EAI_MEMORY;
 
-static void _sethtent(FILE** hostf) {
-    if (!*hostf)
-        *hostf = fopen(_PATH_HOSTS, "re");
-    else
-        rewind(*hostf);
-}
-
-static void _endhtent(FILE** hostf) {
-    if (*hostf) {
-        (void) fclose(*hostf);
-        *hostf = NULL;
+    if (useAddrinfoCache) {
+        uint32_t ttl = answerCacheTtl(q);
+        if (q.next) ttl = std::min(ttl, answerCacheTtl(q2));
+        resolv_cache_add_addrinfo(res.netid, cacheKey, addrinfoToCache(*rv), ttl);
     }
+    return 0;
 }
 
-static struct addrinfo* _gethtent(FILE** hostf, const char* name, const struct addrinfo* pai) {
-    char* p;
-    char *cp, *tname, *cname;
+// Returns the addresses of a line of the hosts file, or of a customized host, that names the host
+// being looked up.
+static struct addrinfo* _gethtent(const android::net::HostsFile::Entry& entry,
+                                  const struct addrinfo* pai) {
     struct addrinfo *res0, *res;
-    int error;
-    const char* addr;
-    char hostbuf[8 * 1024];
 
-    assert(name != NULL);
     assert(pai != NULL);
 
-    if (!*hostf && !(*hostf = fopen(_PATH_HOSTS, "re"))) return (NULL);
-again:
-    if (!(p = fgets(hostbuf, sizeof hostbuf, *hostf))) return (NULL);
-    if (*p == '#') goto again;
-    if (!(cp = strpbrk(p, "#\n"))) goto again;
-    *cp = '\0';
-    if (!(cp = strpbrk(p, " \t"))) goto again;
-    *cp++ = '\0';
-    addr = p;
-    /* if this is not something we're looking for, skip it. */
-    cname = NULL;
-    while (cp && *cp) {
-        if (*cp == ' ' || *cp == '\t') {
-            cp++;
-            continue;
-        }
-        if (!cname) cname = cp;
-        tname = cp;
-        if ((cp = strpbrk(cp, " \t")) != NULL) *cp++ = '\0';
-        if (strcasecmp(name, tname) == 0) goto found;
-    }
-    goto again;
-
-found:
-    error = getaddrinfo_numeric(addr, nullptr, *pai, &res0);
-    if (error) goto again;
+    if (getaddrinfo_numeric(entry.address.c_str(), nullptr, *pai, &res0) != 0) return NULL;
     for (res = res0; res; res = res->ai_next) {
         /* cover it up */
         res->ai_flags = pai->ai_flags;
 
         if (pai->ai_flags & AI_CANONNAME) {
-            if (get_canonname(pai, res, cname) != 0) {
+            if (get_canonname(pai, res, entry.names[0].c_str()) != 0) {
                 freeaddrinfo(res0);
-                goto again;
+                return NULL;
             }
         }
     }
@@ -1540,13 +1627,18 @@ static struct addrinfo* getCustomHosts(const size_t netid, const char* _Nonnull
     struct addrinfo sentinel = {};
     struct addrinfo *res0, *res;
     res = &sentinel;
-    std::vector<std::string> hosts = getCustomizedTableByName(netid, name);
-    for (const std::string& host : hosts) {
-        int error = getaddrinfo_numeric(host.c_str(), nullptr, *pai, &res0);
-        if (!error && res0 != nullptr) {
+    const auto hosts = resolv_get_customized_hosts(netid);
+    if (hosts == nullptr) return NULL;
+    for (uint32_t index : hosts->findByName(name)) {
+        const android::net::HostsFile::Entry& entry = hosts->entry(index);
+        // Not worth parsing: the address is of another family.
+        if (pai->ai_family != AF_UNSPEC && entry.family != AF_UNSPEC &&
+            entry.family != pai->ai_family) {
+            continue;
+        }
+        if ((res0 = _gethtent(entry, pai)) != nullptr) {
             res->ai_next = res0;
-            res = res0;
-            res0 = nullptr;
+            while (res->ai_next) res = res->ai_next;
         }
     }
     return sentinel.ai_next;
@@ -1556,15 +1648,15 @@ static bool files_getaddrinfo(const size_t netid, const char* name, const addrin
                               addrinfo** res) {
     struct addrinfo sentinel = {};
     struct addrinfo *p, *cur;
-    FILE* hostf = nullptr;
 
     cur = &sentinel;
-    _sethtent(&hostf);
-    while ((p = _gethtent(&hostf, name, pai)) != nullptr) {
-        cur->ai_next = p;
-        while (cur && cur->ai_next) cur = cur->ai_next;
+    if (const auto hosts = android::net::HostsFile::getInstance().get()) {
+        for (uint32_t index : hosts->findByName(name)) {
+            if ((p = _gethtent(hosts->entry(index), pai)) == nullptr) continue;
+            cur->ai_next = p;
+            while (cur && cur->ai_next) cur = cur->ai_next;
+        }
     }
-    _endhtent(&hostf);
 
     if ((p = getCustomHosts(netid, name, pai)) != nullptr) {
         cur->ai_next = p;
@@ -1609,7 +1701,7 @@ struct QueryResult {
     NetworkDnsEventReported event;
 };
 
-QueryResult doQuery(const char* name, res_target* t, ResState* res,
+QueryResult doQuery(const QueryTemplate* query, res_target* t, ResState* res,
                     std::chrono::milliseconds sleepTimeMs) {
     HEADER* hp = (HEADER*)(void*)t->answer.data();
 
@@ -1621,13 +1713,10 @@ QueryResult doQuery(const char* name, res_target* t, ResState* res,
 
     LOG(DEBUG) << __func__ << ": (" << cl << ", " << type << ")";
 
-    uint8_t buf[MAXPACKET];
-    int n = res_nmkquery(QUERY, name, cl, type, {}, buf, res->netcontext_flags);
-
-    if (n > 0 &&
-        (res->netcontext_flags & (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS))) {
-        n = res_nopt(res, n, buf, anslen);
-    }
+    uint8_t buf[QueryTemplate::kMaxSize];
+    const bool edns =
+            res->netcontext_flags & (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS);
+    int n = query->make(cl, type, edns, anslen, buf);
 
     NetworkDnsEventReported event;
     if (n <= 0) {
@@ -1653,7 +1742,7 @@ QueryResult doQuery(const char* name, res_target* t, ResState* res,
              (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
             (res_temp.flags & RES_F_EDNS0ERR)) {
             LOG(DEBUG) << __func__ << ": retry without EDNS0";
-            n = res_nmkquery(QUERY, name, cl, type, {}, buf, res_temp.netcontext_flags);
+            n = query->make(cl, type, false, anslen, buf);
             n = res_nsend(&res_temp, {buf, n}, {t->answer.data(), anslen}, &rcode, 0);
         }
     }
@@ -1669,29 +1758,43 @@ QueryResult doQuery(const char* name, res_target* t, ResState* res,
     };
 }
 
+// Starts doQuery() on a thread of the QueryThreadPool if there is one, or else on a new thread.
+std::future<QueryResult> doQueryAsync(const QueryTemplate* query, res_target* t, ResState* res,
+                                      std::chrono::milliseconds sleepTimeMs) {
+    if (QueryThreadPool* pool = QueryThreadPool::getInstance(); pool != nullptr) {
+        // std::function needs a copyable callable.
+        auto task = std::make_shared<std::packaged_task<QueryResult()>>(
+                [=] { return doQuery(query, t, res, sleepTimeMs); });
+        std::future<QueryResult> result = task->get_future();
+        if (pool->execute([task] { (*task)(); }, "res_queryN") == 0) return result;
+    }
+    return std::async(std::launch::async, doQuery, query, t, res, sleepTimeMs);
+}
+
 }  // namespace
 
 static int res_queryN_parallel(const char* name, res_target* target, ResState* res, int* herrno) {
-    std::vector<std::future<QueryResult>> results;
-    results.reserve(2);
+    const QueryTemplate query(name, res->netcontext_flags);
+    std::vector<std::future<QueryResult>> pending;
     std::chrono::milliseconds sleepTimeMs{};
-    for (res_target* t = target; t; t = t->next) {
-        results.emplace_back(std::async(std::launch::async, doQuery, name, t, res, sleepTimeMs));
+    res_target* t = target;
+    for (; t->next; t = t->next) {
+        pending.push_back(doQueryAsync(&query, t, res, sleepTimeMs));
         // Avoiding gateways drop packets if queries are sent too close together
         // Only needed if we have multiple queries in a row.
-        if (t->next) {
-            int sleepFlag = android::net::Experiments::getInstance()->getFlag(
-                    "parallel_lookup_sleep_time", SLEEP_TIME_MS);
-            if (sleepFlag > 1000) sleepFlag = 1000;
-            sleepTimeMs = std::chrono::milliseconds(sleepFlag);
-        }
+        int sleepFlag = android::net::Experiments::getInstance()->getFlag(
+                "parallel_lookup_sleep_time", SLEEP_TIME_MS);
+        if (sleepFlag > 1000) sleepFlag = 1000;
+        sleepTimeMs = std::chrono::milliseconds(sleepFlag);
     }
+    // The last query is sent from this thread, which would only be waiting otherwise.
+    const QueryResult last = doQuery(&query, t, res, sleepTimeMs);
 
     int ancount = 0;
     int rcode = 0;
 
-    for (auto& f : results) {
-        const QueryResult& r = f.get();
+    for (size_t i = 0; i <= pending.size(); i++) {
+        const QueryResult& r = i < pending.size() ? pending[i].get() : last;
         if (r.herrno == NO_RECOVERY) {
             *herrno = r.herrno;
             return -1;
@@ -1710,10 +1813,155 @@ static int res_queryN_parallel(const char* name, res_target* target, ResState* r
     return ancount;
 }
 
+// Most services that the HTTPS records of a name can have their addresses prefetched.
+constexpr size_t kMaxHttpsTargets = 2;
+
+// Prefetches the queries of |target| for the names, other than |name|, that the HTTPS records
+// in |answer| send clients to, so that they're cached by the time the client connects there.
+// They are all sent together by res_nsend_batch(), from one background task.
+static void prefetch_https_targets(const char* name, const res_target* target, ResState* res,
+                                   std::span<const uint8_t> answer, bool edns) {
+    android::net::DnsMessageIndex index;
+    if (!index.parse(answer) || index.getFlag(ns_f_rcode) != ns_r_noerror) return;
+    const auto sameName = [](std::string_view a, std::string_view b) {
+        if (a.ends_with('.')) a.remove_suffix(1);
+        if (b.ends_with('.')) b.remove_suffix(1);
+        return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+    };
+    std::vector<std::string> services;
+    for (const android::net::DnsMessageIndex::Record& rr : index.section(ns_s_an)) {
+        const auto record = android::net::SvcbRecord::parse(index, rr);
+        if (!record || record->targetIsOwner() || sameName(record->target, name)) continue;
+        if (std::any_of(services.begin(), services.end(),
+                        [&](const std::string& s) { return sameName(s, record->target); })) {
+            continue;
+        }
+        services.push_back(record->target);
+        if (services.size() == kMaxHttpsTargets) break;
+    }
+
+    std::vector<std::vector<uint8_t>> msgs;
+    for (const std::string& service : services) {
+        LOG(DEBUG) << __func__ << ": " << service;
+        const QueryTemplate query(service.c_str(), res->netcontext_flags);
+        for (const res_target* t = target; t; t = t->next) {
+            std::vector<uint8_t> buf(QueryTemplate::kMaxSize);
+            const int n = query.make(t->qclass, t->qtype, edns, t->answer.size(), buf);
+            if (n <= 0) continue;
+            buf.resize(n);
+            msgs.push_back(std::move(buf));
+        }
+    }
+    if (msgs.empty()) return;
+
+    auto event = std::make_shared<NetworkDnsEventReported>();
+    // The answers are for the cache, whether or not the client is still there.
+    auto state = std::make_shared<ResState>(res->clone(event.get()));
+    state->cancellation.reset();
+    const int rval = QueryThreadPool::executeBackground(
+            [state, event, msgs = std::move(msgs)] {
+                std::vector<android::net::PacketBuffer> answers(msgs.size());
+                std::vector<ResBatchQuery> queries;
+                for (size_t i = 0; i < msgs.size(); i++) {
+                    queries.push_back({.msg = msgs[i], .ans = answers[i]});
+                }
+                res_nsend_batch(state.get(), queries, 0);
+            },
+            "https_prefetch");
+    if (rval != 0) LOG(DEBUG) << __func__ << ": dropped: " << strerror(-rval);
+}
+
+// Same as res_queryN_parallel(), but from this thread: the queries for all targets are handed to
+// res_nsend_batch() together, so that they share sockets and syscalls.
+//
+// With the "https_prefetch" experiment flag, the HTTPS record of the name goes along with them,
+// for the client that looks it up next, and the services it points to are prefetched.
+static int res_queryN_batched(const char* name, res_target* target, ResState* res, int* herrno) {
+    const QueryTemplate query(name, res->netcontext_flags);
+    const bool edns =
+            res->netcontext_flags & (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS);
+    std::vector<std::vector<uint8_t>> bufs;
+    std::vector<ResBatchQuery> queries;
+    for (res_target* t = target; t; t = t->next) {
+        HEADER* hp = reinterpret_cast<HEADER*>(t->answer.data());
+        hp->rcode = NOERROR;  // default
+        LOG(DEBUG) << __func__ << ": (" << t->qclass << ", " << t->qtype << ")";
+
+        std::vector<uint8_t>& buf = bufs.emplace_back(QueryTemplate::kMaxSize);
+        const int n = query.make(t->qclass, t->qtype, edns, t->answer.size(), buf);
+        if (n <= 0) {
+            LOG(ERROR) << __func__ << ": res_nmkquery failed";
+            *herrno = NO_RECOVERY;
+            return -1;
+        }
+        queries.push_back({.msg = std::span(buf).first(n), .ans = t->answer});
+    }
+    const size_t numTargets = queries.size();
+    std::optional<android::net::PacketBuffer> httpsAnswer;
+    if (android::net::Experiments::getInstance()->getFlag("https_prefetch", 0) == 1) {
+        std::vector<uint8_t>& buf = bufs.emplace_back(QueryTemplate::kMaxSize);
+        httpsAnswer.emplace();
+        const int n = query.make(C_IN, android::net::kDnsTypeHttps, edns, httpsAnswer->size(), buf);
+        if (n > 0) {
+            queries.push_back(
+                    {.msg = std::span(buf).first(n), .ans = *httpsAnswer, .companion = true});
+        }
+    }
+
+    res_nsend_batch(res, queries, 0);
+
+    int ancount = 0;
+    int rcode = NOERROR;
+    int qerrno = 0;
+    res_target* t = target;
+    for (size_t i = 0; i < numTargets; i++, t = t->next) {
+        const HEADER* hp = reinterpret_cast<const HEADER*>(t->answer.data());
+        int n = queries[i].resplen;
+        int qrcode = queries[i].rcode;
+        if (n < 0 || hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
+            // To ensure that the rcode handling is identical to res_queryN().
+            if (qrcode != RCODE_TIMEOUT) qrcode = hp->rcode;
+            // if the query choked with EDNS0, retry without EDNS0
+            if (edns && (res->flags & RES_F_EDNS0ERR)) {
+                LOG(DEBUG) << __func__ << ": retry without EDNS0";
+                uint8_t buf[QueryTemplate::kMaxSize];
+                n = query.make(t->qclass, t->qtype, false, t->answer.size(), buf);
+                n = res_nsend(res, {buf, n}, t->answer, &qrcode, 0);
+            }
+        }
+        // Negative results report their errno the way res_nsend() callers expect it.
+        if (n < 0) qerrno = -n;
+        LOG(DEBUG) << __func__ << ": rcode=" << hp->rcode << ", ancount=" << ntohs(hp->ancount);
+        t->n = n;
+        ancount += ntohs(hp->ancount);
+        rcode = qrcode;
+    }
+    if (queries.size() > numTargets && queries.back().resplen > 0) {
+        const std::span<const uint8_t> answer = *httpsAnswer;
+        prefetch_https_targets(name, target, res, answer.first(queries.back().resplen), edns);
+    }
+    errno = qerrno;
+
+    if (ancount == 0) {
+        *herrno = getHerrnoFromRcode(rcode);
+        return -1;
+    }
+    return ancount;
+}
+
 static int res_queryN_wrapper(const char* name, res_target* target, ResState* res, int* herrno) {
     const bool parallel_lookup =
             android::net::Experiments::getInstance()->getFlag("parallel_lookup_release", 1);
-    if (parallel_lookup) return res_queryN_parallel(name, target, res, herrno);
+    // A lookup from the cache alone is only that on this thread, so it can't use any other.
+    if (ScopedCacheOnlyLookup::current() != nullptr) {
+        return res_queryN(name, target, res, herrno);
+    }
+    if (parallel_lookup) {
+        if (android::net::Experiments::getInstance()->getFlag("batched_lookup", 0) == 1) {
+            return res_queryN_batched(name, target, res, herrno);
+        }
+        return res_queryN_parallel(name, target, res, herrno);
+    }
 
     return res_queryN(name, target, res, herrno);
 }
@@ -1729,7 +1977,7 @@ static int res_queryN_wrapper(const char* name, res_target* target, ResState* re
  * Caller must parse answer and determine whether it answers the question.
  */
 static int res_queryN(const char* name, res_target* target, ResState* res, int* herrno) {
-    uint8_t buf[MAXPACKET];
+    uint8_t buf[QueryTemplate::kMaxSize];
     int n;
     struct res_target* t;
     int rcode;
@@ -1740,6 +1988,8 @@ static int res_queryN(const char* name, res_target* target, ResState* res, int*
 
     rcode = NOERROR;
     ancount = 0;
+    // The targets differ only in class and type, so the name is encoded once for all of them.
+    const QueryTemplate query(name, res->netcontext_flags);
 
     for (t = target; t; t = t->next) {
         HEADER* hp = (HEADER*)(void*)t->answer.data();
@@ -1753,12 +2003,11 @@ static int res_queryN(const char* name, res_target* target, ResState* res, int*
         const int anslen = t->answer.size();
 
         LOG(DEBUG) << __func__ << ": (" << cl << ", " << type << ")";
-        n = res_nmkquery(QUERY, name, cl, type, {}, buf, res->netcontext_flags);
-        if (n > 0 &&
-            (res->netcontext_flags &
-             (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
-            !retried)  // TODO:  remove the retry flag and provide a sufficient test coverage.
-            n = res_nopt(res, n, buf, anslen);
+        // TODO:  remove the retry flag and provide a sufficient test coverage.
+        const bool edns = (res->netcontext_flags &
+                           (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
+                          !retried;
+        n = query.make(cl, type, edns, anslen, buf);
         if (n <= 0) {
             LOG(ERROR) << __func__ << ": res_nmkquery failed";
             *herrno = NO_RECOVERY;
@@ -1847,8 +2096,42 @@ static int res_searchN(const char* name, res_target* target, ResState* res, int*
          */
         resolv_populate_res_for_net(res);
 
-        for (const auto& domain : res->search_domains) {
-            ret = res_querydomainN(name, domain.c_str(), target, res, herrno);
+        std::vector<std::future<ResSearchResult>> pending;
+        if (res_search_in_parallel(res)) {
+            std::vector<std::pair<int, int>> queries;
+            for (res_target* t = target; t; t = t->next) queries.emplace_back(t->qclass, t->qtype);
+            pending = res_search_async(
+                    res, [name = std::string(name), queries](ResState* res,
+                                                             const std::string& domain,
+                                                             ResSearchResult* result) {
+                        // The same queries as |target|, into answers of their own.
+                        std::vector<res_target> targets(queries.size());
+                        for (size_t i = 0; i < targets.size(); i++) {
+                            std::tie(targets[i].qclass, targets[i].qtype) = queries[i];
+                            targets[i].next = i + 1 < targets.size() ? &targets[i + 1] : nullptr;
+                        }
+                        result->ret = res_querydomainN(name.c_str(), domain.c_str(),
+                                                       targets.data(), res, &result->herrno);
+                        for (res_target& t : targets) {
+                            result->answers.push_back(std::move(t.answer));
+                            result->lengths.push_back(t.n);
+                        }
+                    });
+        }
+
+        for (size_t i = 0; i < res->search_domains.size(); i++) {
+            if (pending.empty()) {
+                ret = res_querydomainN(name, res->search_domains[i].c_str(), target, res, herrno);
+            } else {
+                const ResSearchResult result = pending[i].get();
+                size_t j = 0;
+                for (res_target* t = target; t; t = t->next, j++) {
+                    std::copy_n(result.answers[j].data(), result.answers[j].size(),
+                              t->answer.data());
+                    t->n = result.lengths[j];
+                }
+                ret = res_search_take(res, result, herrno);
+            }
             if (ret > 0) return ret;
 
             /*
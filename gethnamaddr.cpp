@@ -75,6 +75,8 @@
 #include <vector>
 
 #include "Experiments.h"
+#include "PacketBuffer.h"
+#include "QueryTrace.h"
 #include "hostent.h"
 #include "netd_resolv/resolv.h"
 #include "res_comp.h"
@@ -84,6 +86,9 @@
 #include "stats.pb.h"
 
 using android::net::NetworkDnsEventReported;
+using android::net::PacketBuffer;
+using android::net::QueryStage;
+using android::net::ScopedStageTimer;
 
 constexpr int MAXADDRS = 35;
 
@@ -112,6 +117,7 @@ static int dns_gethtbyname(ResState* res, const char* name, int af, getnamaddr*
 static struct hostent* getanswer(const querybuf* _Nonnull answer, int anslen,
                                  const char* _Nonnull qname, int qtype, struct hostent* hent,
                                  char* buf, size_t buflen, int* he) {
+    ScopedStageTimer timer(QueryStage::PARSE);
     const HEADER* hp;
     const uint8_t* cp;
     int n;
@@ -499,7 +505,8 @@ int resolv_gethostbyaddr(const void* _Nonnull addr, socklen_t len, int af, hoste
     info.hp = hp;
     info.buf = buf;
     info.buflen = buflen;
-    if (_hf_gethtbyaddr(uaddr, len, af, &info)) {
+    if (_hf_gethtbyaddr(uaddr, len, af, &info) &&
+        customized_gethtbyaddr(netcontext->dns_netid, uaddr, len, af, &info)) {
         int error = dns_gethtbyaddr(uaddr, len, af, netcontext, &info, event);
         if (error != 0) return error;
     }
@@ -507,95 +514,6 @@ int resolv_gethostbyaddr(const void* _Nonnull addr, socklen_t len, int af, hoste
     return 0;
 }
 
-// TODO: Consider leaving function without returning error code as _gethtent() does because
-// the error code of the caller does not currently return to netd.
-struct hostent* netbsd_gethostent_r(FILE* hf, struct hostent* hent, char* buf, size_t buflen,
-                                    int* he) {
-    char *name;
-    char* cp;
-    int af, len;
-    size_t anum;
-    struct in6_addr host_addr;
-    std::vector<char*> aliases;
-
-    if (hf == NULL) {
-        *he = NETDB_INTERNAL;
-        errno = EINVAL;
-        return NULL;
-    }
-    char* p = NULL;
-
-    // Allocate a new space to read file lines like upstream does.
-    const size_t line_buf_size = MAXPACKET;
-    if ((p = (char*) malloc(line_buf_size)) == NULL) {
-        goto nospc;
-    }
-    for (;;) {
-        if (!fgets(p, line_buf_size, hf)) {
-            free(p);
-            *he = HOST_NOT_FOUND;
-            return NULL;
-        }
-        if (*p == '#') {
-            continue;
-        }
-        if (!(cp = strpbrk(p, "#\n"))) {
-            continue;
-        }
-        *cp = '\0';
-        if (!(cp = strpbrk(p, " \t"))) continue;
-        *cp++ = '\0';
-        if (inet_pton(AF_INET6, p, &host_addr) > 0) {
-            af = AF_INET6;
-            len = NS_IN6ADDRSZ;
-        } else {
-            if (inet_pton(AF_INET, p, &host_addr) <= 0) continue;
-            af = AF_INET;
-            len = NS_INADDRSZ;
-        }
-
-        /* if this is not something we're looking for, skip it. */
-        if (hent->h_addrtype != 0 && hent->h_addrtype != af) continue;
-        if (hent->h_length != 0 && hent->h_length != len) continue;
-
-        while (*cp == ' ' || *cp == '\t') cp++;
-        if ((cp = strpbrk(name = cp, " \t")) != NULL) *cp++ = '\0';
-        while (cp && *cp) {
-            if (*cp == ' ' || *cp == '\t') {
-                cp++;
-                continue;
-            }
-            aliases.push_back(cp);
-            if ((cp = strpbrk(cp, " \t")) != NULL) *cp++ = '\0';
-        }
-        break;
-    }
-    hent->h_length = len;
-    hent->h_addrtype = af;
-    HENT_ARRAY(hent->h_addr_list, 1, buf, buflen);
-    anum = aliases.size();
-    HENT_ARRAY(hent->h_aliases, anum, buf, buflen);
-    HENT_COPY(hent->h_addr_list[0], &host_addr, hent->h_length, buf, buflen);
-    hent->h_addr_list[1] = NULL;
-
-    /* Reserve space for mapping IPv4 address to IPv6 address in place */
-    if (hent->h_addrtype == AF_INET) {
-        HENT_COPY(buf, NAT64_PAD, sizeof(NAT64_PAD), buf, buflen);
-    }
-
-    HENT_SCOPY(hent->h_name, name, buf, buflen);
-    for (size_t i = 0; i < anum; i++) HENT_SCOPY(hent->h_aliases[i], aliases[i], buf, buflen);
-    hent->h_aliases[anum] = NULL;
-    *he = NETDB_SUCCESS;
-    free(p);
-    return hent;
-nospc:
-    free(p);
-    errno = ENOSPC;
-    *he = NETDB_INTERNAL;
-    return NULL;
-}
-
 /* Reserve space for mapping IPv4 address to IPv6 address in place */
 static void pad_v4v6_hostent(struct hostent* _Nonnull hp, char** _Nonnull bpp, char* _Nonnull ep) {
     if (hp->h_addrtype != AF_INET || hp->h_length != NS_INADDRSZ) return;
@@ -630,10 +548,10 @@ static int dns_gethtbyname(ResState* res, const char* name, int addr_type, getna
         default:
             return EAI_FAMILY;
     }
-    auto buf = std::make_unique<querybuf>();
+    PacketBuffer buf;
 
     int he;
-    n = res_nsearch(res, name, C_IN, type, {buf->buf, (int)sizeof(buf->buf)}, &he);
+    n = res_nsearch(res, name, C_IN, type, buf, &he);
     if (n < 0) {
         LOG(DEBUG) << __func__ << ": res_nsearch failed (" << n << ")";
         // Return h_errno (he) to catch more detailed errors rather than EAI_NODATA.
@@ -641,7 +559,8 @@ static int dns_gethtbyname(ResState* res, const char* name, int addr_type, getna
         // See also herrnoToAiErrno().
         return herrnoToAiErrno(he);
     }
-    hostent* hp = getanswer(buf.get(), n, name, type, info->hp, info->buf, info->buflen, &he);
+    hostent* hp = getanswer(reinterpret_cast<const querybuf*>(buf.data()), n, name, type, info->hp,
+                            info->buf, info->buflen, &he);
     if (hp == NULL) return herrnoToAiErrno(he);
 
     return 0;
@@ -691,11 +610,11 @@ static int dns_gethtbyaddr(const unsigned char* uaddr, int len, int af,
             return EAI_FAMILY;
     }
 
-    auto buf = std::make_unique<querybuf>();
+    PacketBuffer buf;
 
     ResState res(netcontext, event);
     int he;
-    n = res_nquery(&res, qbuf, C_IN, T_PTR, {buf->buf, (int)sizeof(buf->buf)}, &he);
+    n = res_nquery(&res, qbuf, C_IN, T_PTR, buf, &he);
     if (n < 0) {
         LOG(DEBUG) << __func__ << ": res_nquery failed (" << n << ")";
         // Note that res_nquery() doesn't set the pair NETDB_INTERNAL and errno.
@@ -703,7 +622,8 @@ static int dns_gethtbyaddr(const unsigned char* uaddr, int len, int af,
         // See also herrnoToAiErrno().
         return herrnoToAiErrno(he);
     }
-    hostent* hp = getanswer(buf.get(), n, qbuf, T_PTR, info->hp, info->buf, info->buflen, &he);
+    hostent* hp = getanswer(reinterpret_cast<const querybuf*>(buf.data()), n, qbuf, T_PTR,
+                            info->hp, info->buf, info->buflen, &he);
     if (hp == NULL) return herrnoToAiErrno(he);
 
     char* bf = (char*) (hp->h_addr_list + 2);
@@ -42,7 +42,10 @@ struct getnamaddr {
 // /etc/hosts lookup
 int _hf_gethtbyaddr(const unsigned char* uaddr, int len, int af, getnamaddr* info);
 int _hf_gethtbyname2(const char* name, int af, getnamaddr* info);
-hostent* netbsd_gethostent_r(FILE*, struct hostent*, char*, size_t, int*);
+
+// Lookup in the customized hosts of a network, see ResolverOptionsParcel.hosts.
+int customized_gethtbyaddr(unsigned netid, const unsigned char* uaddr, int len, int af,
+                           getnamaddr* info);
 
 // Reserved padding for remapping IPv4 address to NAT64 synthesis IPv6 address
 static const char NAT64_PAD[NS_IN6ADDRSZ - NS_INADDRSZ] = {};
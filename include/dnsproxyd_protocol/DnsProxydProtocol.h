@@ -24,3 +24,50 @@
  * This flag must be kept in sync with the Network#getNetIdForResolv() usage.
  */
 #define NETID_USE_LOCAL_NAMESERVERS 0x80000000
+
+/*
+ * The most hosts a single "getaddrinfobatch" command may look up.
+ *
+ * The command is
+ *   getaddrinfobatch <service> <ai_flags> <ai_family> <ai_socktype> <ai_protocol> <netId>
+ *                    <host>...
+ * with the same encoding of the arguments as "getaddrinfo". The reply is the DnsProxyQueryResult
+ * code, followed by one result per host in the order they complete. Each result is the index of
+ * its host and an EAI_* error code, both 4-byte big-endian, followed, if the error code is 0, by
+ * the same list of addrinfo that "getaddrinfo" sends.
+ */
+#define DNSPROXYD_MAX_BATCH_HOSTS 16
+
+/*
+ * The most addresses a single "gethostbyaddrbatch" command may look up.
+ *
+ * The command is
+ *   gethostbyaddrbatch <netId> <addr>[,<addr>...]
+ * with the addresses in text form, IPv4 or IPv6, in a single argument. The reply is the
+ * DnsProxyQueryResult code, followed by one result per address: first those that the hosts file
+ * or the cache answer, then the others in the order they complete. Each result is the index of
+ * its address and an EAI_* error code, both 4-byte big-endian, followed, if the error code is 0,
+ * by the same hostent that "gethostbyaddr" sends.
+ */
+#define DNSPROXYD_MAX_BATCH_ADDRS 64
+
+/*
+ * "resnsendtagged <tag> <netId> <flags> <query>" is "resnsend" for clients that keep the socket
+ * open and have many queries in flight on it. Each answer comes as soon as it's known, preceded
+ * by the 4-byte big-endian tag of its query. A command whose tag can't be parsed is answered with
+ * this tag and -EINVAL.
+ */
+#define DNSPROXYD_INVALID_TAG 0xffffffffU
+
+/*
+ * A client may send its resnsend queries as binary frames rather than as commands, which saves
+ * encoding each query in base64 and parsing the command. A frame is
+ *   magic (1 byte), 0 (1 byte), query length (2 bytes), tag, netId, flags (4 bytes each), query
+ * with all integers big-endian, and is answered as "resnsendtagged" is. A socket that sends a
+ * frame must send nothing but frames. One whose frame can't be parsed, e.g. because its magic is
+ * wrong or its query is longer than DNSPROXYD_MAX_FRAMED_QUERY, is closed, after the answer to
+ * that frame if it has a tag.
+ */
+#define DNSPROXYD_RESNSEND_FRAME_MAGIC 0xd5
+#define DNSPROXYD_RESNSEND_FRAME_HEADER_SIZE 16
+#define DNSPROXYD_MAX_FRAMED_QUERY 4096
@@ -32,4 +32,7 @@ struct res_params {
     uint8_t max_samples;        // max # samples taken into account for statistics
     int base_timeout_msec;      // base query retry timeout (if 0, use RES_TIMEOUT)
     int retry_count;            // number of retries
+    // Bounds of the query timeout when it adapts to the measured latency of the servers.
+    int min_timeout_msec;       // if 0, use RES_MIN_ADAPTIVE_TIMEOUT
+    int max_timeout_msec;       // if 0, use RES_MAX_ADAPTIVE_TIMEOUT
 };
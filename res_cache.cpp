@@ -27,17 +27,31 @@
  */
 
 #define LOG_TAG "resolv"
+#define ATRACE_TAG ATRACE_TAG_NETWORK
 
 #include "resolv_cache.h"
 
+#include <inttypes.h>
 #include <resolv.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <optional>
 #include <set>
+#include <shared_mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -45,21 +59,39 @@
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/if.h>
 #include <net/if.h>
 #include <netdb.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <aidl/android/net/IDnsResolver.h>
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <android-base/thread_annotations.h>
 #include <android/multinetwork.h>  // ResNsendFlags
 
+#include <openssl/sha.h>
 #include <server_configurable_flags/get_flags.h>
+#include <utils/Trace.h>
 
+#include "AnswerInterner.h"
+#include "DnsMessageIndex.h"
 #include "DnsStats.h"
 #include "Experiments.h"
+#include "FrequencySketch.h"
+#include "HeavyHitters.h"
+#include "HostsFile.h"
+#include "QueryThreadPool.h"
+#include "QueryTrace.h"
+#include "ResolvTrace.h"
+#include "ServerLoad.h"
+#include "SvcbRecord.h"
 #include "res_comp.h"
 #include "res_debug.h"
 #include "resolv_private.h"
@@ -67,17 +99,31 @@
 
 using aidl::android::net::IDnsResolver;
 using aidl::android::net::ResolverOptionsParcel;
+using android::net::AnswerInterner;
+using android::net::DnsCacheStats;
+using android::net::DnsMessageIndex;
+using android::net::DnsNameCompressor;
 using android::net::DnsQueryEvent;
 using android::net::DnsStats;
 using android::net::Experiments;
+using android::net::FrequencySketch;
+using android::net::HeavyHitters;
+using android::net::HostsFile;
 using android::net::PROTO_DOH;
 using android::net::PROTO_DOT;
 using android::net::PROTO_MDNS;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
 using android::net::Protocol;
+using android::net::QueryStage;
+using android::net::kDnsTypeHttps;
+using android::net::ScopedStageTimer;
+using android::net::ServerLoad;
+using android::net::SvcbRecord;
+using android::net::traceMark;
 using android::netdutils::DumpWriter;
 using android::netdutils::IPSockAddr;
+using android::netdutils::ScopedIndent;
 using std::span;
 
 /* This code implements a small and *simple* DNS resolver cache.
@@ -157,13 +203,89 @@ using std::span;
  * *****************************************
  */
 const int CONFIG_MAX_ENTRIES = 64 * 2 * 5;
+// The capacity of a cache is a byte budget, which also caps the number of entries at one per
+// CACHE_BYTES_PER_ENTRY bytes. The default budget keeps CONFIG_MAX_ENTRIES entries.
+constexpr size_t CACHE_BYTES_PER_ENTRY = 512;
+constexpr size_t CACHE_DEFAULT_MAX_BYTES = CONFIG_MAX_ENTRIES * CACHE_BYTES_PER_ENTRY;
+// Ceiling on the bytes cached by all networks together, and so on any per-network budget.
+constexpr size_t CACHE_GLOBAL_MAX_BYTES = 8 * 1024 * 1024;
+// A cache that hasn't been used for CACHE_IDLE_TIMEOUT seconds is trimmed down to
+// 1/CACHE_IDLE_SHRINK_FACTOR of its budget. Idle caches are checked at most once every
+// CACHE_IDLE_CHECK_INTERVAL seconds.
+constexpr std::chrono::seconds CACHE_IDLE_TIMEOUT(300);
+// Most getaddrinfo results kept by the addrinfo cache of a network.
+constexpr size_t ADDRINFO_CACHE_MAX_ENTRIES = 128;
+// Source address results aren't tied to any TTL, and routes may change without the resolver
+// being told, so they are kept only for a few seconds.
+constexpr std::chrono::seconds SRC_ADDR_CACHE_TTL(5);
+constexpr size_t SRC_ADDR_CACHE_MAX_ENTRIES = 64;
+// RFC 2308 section 7 caps how long a server failure may be cached at five minutes.
+constexpr int FAILURE_CACHE_MAX_SEC = 300;
+constexpr size_t FAILURE_CACHE_MAX_ENTRIES = 256;
+constexpr size_t CACHE_IDLE_SHRINK_FACTOR = 8;
+constexpr std::chrono::seconds CACHE_IDLE_CHECK_INTERVAL(60);
+// With the "cache_snapshot" experiment, the cache of each network is saved to a file at most
+// once every CACHE_SNAPSHOT_INTERVAL seconds, and reloaded when the network is created again,
+// e.g. after the resolver restarts.
+constexpr std::chrono::seconds CACHE_SNAPSHOT_INTERVAL(60);
+constexpr char CACHE_SNAPSHOT_DEFAULT_DIR[] = "/data/misc/net/dns_cache";
+// With the "cache_generations" experiment, each sweep of a cache frees at most this many of the
+// entries an invalidation left behind.
+constexpr int CACHE_INVALIDATED_REMOVAL_BATCH = 32;
+// With the "cache_uid_partitions" experiment, each entry keeps the apps that may see it as a
+// 64-bit mask, so a cache tells that many apps apart; the app that added an answer least recently
+// gives its bit up to the next one.
+constexpr size_t CACHE_MAX_PARTITIONS = 64;
+constexpr uint64_t CACHE_ALL_PARTITIONS = ~uint64_t{0};
+// How many of the queries looked up most often each cache keeps track of, for dumpsys.
+constexpr size_t CACHE_TOP_QUERIES = 16;
+// Lookups are counted towards them one in this many, so that most lookups don't take the lock of
+// the counters.
+constexpr uint32_t CACHE_TOP_QUERIES_SAMPLE_EVERY = 16;
+// Answers added are counted by size in power-of-two buckets, from at most 64 bytes to more than
+// 4096.
+constexpr size_t CACHE_ANSWER_SIZE_BUCKETS = 8;
+constexpr int CACHE_ANSWER_SIZE_MIN_SHIFT = 6;
+// The statistics of each cache are reported along with at most one DNS event an interval.
+constexpr std::chrono::hours CACHE_STATS_REPORT_INTERVAL(1);
 constexpr int DNSEVENT_SUBSAMPLING_MAP_DEFAULT_KEY = -1;
 
-static time_t _time_now(void) {
-    struct timeval tv;
+// The clock that expiry is measured on: CLOCK_MONOTONIC_COARSE, which doesn't jump when the wall
+// clock is set and is as cheap to read as time(), at millisecond resolution. Lookups and
+// additions read it once and pass the time down.
+struct CacheClock {
+    using duration = std::chrono::milliseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<CacheClock>;
+    static constexpr bool is_steady = true;
+
+    static time_point now();
+};
+using CacheTime = CacheClock::time_point;
+
+// Replaces CLOCK_MONOTONIC_COARSE if set. See resolv_cache_set_clock().
+static std::atomic<std::chrono::milliseconds (*)()> sClock = nullptr;
+
+CacheTime CacheClock::now() {
+    if (const auto clock = sClock.load(std::memory_order_relaxed); clock != nullptr) {
+        return CacheTime(clock());
+    }
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return CacheTime(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+}
+
+static CacheTime _time_now(void) {
+    return CacheClock::now();
+}
 
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec;
+// The TTL, in whole seconds, of an answer expiring at |expires|. It is rounded up, so that an
+// answer the cache still serves doesn't go out with a TTL of 0, which would keep the client from
+// caching it at all.
+static uint32_t _ttl_left(CacheTime expires, CacheTime now) {
+    return std::chrono::ceil<std::chrono::seconds>(expires - now).count();
 }
 
 /* reminder: the general format of a DNS packet is the following:
@@ -257,6 +379,7 @@ static time_t _time_now(void) {
 #define DNS_TYPE_PTR "\00\014"  /* big-endian decimal 12 */
 #define DNS_TYPE_MX "\00\017"   /* big-endian decimal 15 */
 #define DNS_TYPE_AAAA "\00\034" /* big-endian decimal 28 */
+#define DNS_TYPE_HTTPS "\00\101" /* big-endian decimal 65 */
 #define DNS_TYPE_ALL "\00\0377" /* big-endian decimal 255 */
 
 #define DNS_CLASS_IN "\00\01" /* big-endian decimal 1 */
@@ -267,20 +390,51 @@ struct DnsPacket {
     const uint8_t* cursor;
 };
 
-static uint8_t res_tolower(uint8_t c) {
-    return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+// Labels are case-folded eight bytes at a time: load a (possibly partial) word, then set the 0x20
+// bit of every byte in 'A'..'Z' without branching. Bytes >= 0x80 are left alone, as they are not
+// letters.
+static constexpr uint64_t kBytesOf(uint8_t b) {
+    return 0x0101010101010101ULL * b;
+}
+
+static uint64_t res_loadWord(const uint8_t* p, size_t len) {
+    uint64_t w = 0;
+    if (len >= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        return w;
+    }
+    // Labels are short, so assemble the tail from fixed-size loads rather than call memcpy().
+    // 4..7 bytes are covered by two overlapping 32-bit loads, 1..3 bytes by three single bytes.
+    const auto load32 = [](const uint8_t* q) {
+        return uint64_t{q[0]} | uint64_t{q[1]} << 8 | uint64_t{q[2]} << 16 | uint64_t{q[3]} << 24;
+    };
+    if (len >= 4) return load32(p) | load32(p + len - 4) << (8 * (len - 4));
+    if (len > 0) {
+        w = uint64_t{p[0]} | uint64_t{p[len / 2]} << (8 * (len / 2)) |
+            uint64_t{p[len - 1]} << (8 * (len - 1));
+    }
+    return w;
+}
+
+static uint64_t res_tolowerWord(uint64_t w) {
+    const uint64_t heptets = w & kBytesOf(0x7f);
+    const uint64_t geA = heptets + kBytesOf(0x80 - 'A');
+    const uint64_t gtZ = heptets + kBytesOf(0x80 - 'Z' - 1);
+    const uint64_t upper = (geA ^ gtZ) & ~w & kBytesOf(0x80);
+    return w | (upper >> 2);
 }
 
-static int res_memcasecmp(const unsigned char *s1, const unsigned char *s2, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        int ch1 = *s1++;
-        int ch2 = *s2++;
-        int d = res_tolower(ch1) - res_tolower(ch2);
-        if (d != 0) {
-            return d;
+static bool res_isEqualLabel(const uint8_t* s1, const uint8_t* s2, size_t len) {
+    while (len > 0) {
+        const size_t n = std::min(len, sizeof(uint64_t));
+        if (res_tolowerWord(res_loadWord(s1, n)) != res_tolowerWord(res_loadWord(s2, n))) {
+            return false;
         }
+        s1 += n;
+        s2 += n;
+        len -= n;
     }
-    return 0;
+    return true;
 }
 
 static void _dnsPacket_init(DnsPacket* packet, const uint8_t* buff, int bufflen) {
@@ -369,6 +523,7 @@ static int _dnsPacket_checkQR(DnsPacket* packet) {
         !_dnsPacket_checkBytes(packet, 2, DNS_TYPE_PTR) &&
         !_dnsPacket_checkBytes(packet, 2, DNS_TYPE_MX) &&
         !_dnsPacket_checkBytes(packet, 2, DNS_TYPE_AAAA) &&
+        !_dnsPacket_checkBytes(packet, 2, DNS_TYPE_HTTPS) &&
         !_dnsPacket_checkBytes(packet, 2, DNS_TYPE_ALL)) {
         LOG(INFO) << __func__ << ": unsupported TYPE";
         return 0;
@@ -453,6 +608,20 @@ static int _dnsPacket_checkQuery(DnsPacket* packet) {
 #define FNV_MULT 16777619U
 #define FNV_BASIS 2166136261U
 
+// Hashes a case-folded label a word at a time, then folds the result into the running FNV hash.
+// Byte-at-a-time FNV is one multiply per character; this is one per eight. The hash is only used
+// in memory, so it doesn't need to match any other implementation.
+static unsigned res_hashLabel(const uint8_t* p, size_t len, unsigned hash) {
+    uint64_t h = 0;
+    while (len > 0) {
+        const size_t n = std::min(len, sizeof(uint64_t));
+        h = (std::rotl(h, 5) ^ res_tolowerWord(res_loadWord(p, n))) * 0x517cc1b727220a95ULL;
+        p += n;
+        len -= n;
+    }
+    return hash * FNV_MULT ^ static_cast<unsigned>(h >> 32);
+}
+
 static unsigned _dnsPacket_hashBytes(DnsPacket* packet, int numBytes, unsigned hash) {
     const uint8_t* p = packet->cursor;
     const uint8_t* end = packet->end;
@@ -488,12 +657,8 @@ static unsigned _dnsPacket_hashQName(DnsPacket* packet, unsigned hash) {
             break;
         }
 
-        while (c > 0) {
-            uint8_t ch = *p++;
-            ch = res_tolower(ch);
-            hash = hash * FNV_MULT ^ ch;
-            c--;
-        }
+        hash = res_hashLabel(p, c, hash);
+        p += c;
     }
     packet->cursor = p;
     return hash;
@@ -589,7 +754,7 @@ static int _dnsPacket_isEqualDomainName(DnsPacket* pack1, DnsPacket* pack2) {
             LOG(INFO) << __func__ << ": INTERNAL_ERROR: simple label read-overflow";
             break;
         }
-        if (res_memcasecmp(p1, p2, c1) != 0) break;
+        if (!res_isEqualLabel(p1, p2, c1)) break;
         p1 += c1;
         p2 += c1;
         /* we rely on the bound checks at the start of the loop */
@@ -709,110 +874,151 @@ struct Entry {
     int querylen;
     const uint8_t* answer;
     int answerlen;
-    time_t expires; /* time_t when the entry isn't valid any more */
-    int id;         /* for debugging purpose */
+    // With Cache::intern_answers, |answer| may be the bytes of a shared payload rather than a
+    // copy of the answer, and the ID and TTLs are those the answer had; see entry_copy_answer().
+    const AnswerInterner::Payload* payload;
+    const uint32_t* ttls;
+    uint16_t answer_id;
+    CacheTime expires; /* when the entry isn't valid any more */
+    int id;            /* for debugging purpose */
+    CacheTime refresh_time; /* when a caller was last asked to refresh this entry */
+    uint32_t ttl;        /* TTL the entry was added with */
+    size_t expiry_index; /* position in Cache::expiry_heap */
+    uint32_t generation; /* Cache::generation when added */
+    // The partitions that may see the entry, one bit per Cache::partitions. For a search key,
+    // the bit of the partition looking. All of them when the cache isn't partitioned.
+    uint64_t partitions = CACHE_ALL_PARTITIONS;
+
+    // Updated by lookups holding the NetConfig lock in shared mode, hence atomic.
+    std::atomic<int> hits;  /* number of lookups answered by this entry */
+    // Set by cache hits and cleared by eviction, which gives referenced entries a second chance.
+    // This is the CLOCK reference bit with the flat table, and stands in for moving the entry to
+    // the front of the MRU list for hits that can't modify the list.
+    std::atomic<bool> referenced;
 };
 
 /*
- * Find the TTL for a negative DNS result.  This is defined as the minimum
- * of the SOA records TTL and the MINIMUM-TTL field (RFC-2308).
+ * Find the appropriate smallest TTL among the answer records of a parsed
+ * answer, or the negative TTL given by its SOA record (RFC-2308) if it has
+ * none.
+ *
+ * The returned TTL is the number of seconds to
+ * keep the answer in the cache.
  *
- * Return 0 if not found.
+ * If the answer couldn't be parsed zero (0) is returned which
+ * indicates that the answer shall not be cached.
  */
-static uint32_t answer_getNegativeTTL(ns_msg handle) {
-    int n, nscount;
-    uint32_t result = 0;
-    ns_rr rr;
-
-    nscount = ns_msg_count(handle, ns_s_ns);
-    for (n = 0; n < nscount; n++) {
-        if ((ns_parserr(&handle, ns_s_ns, n, &rr) == 0) && (ns_rr_type(rr) == ns_t_soa)) {
-            const uint8_t* rdata = ns_rr_rdata(rr);          // find the data
-            const uint8_t* edata = rdata + ns_rr_rdlen(rr);  // add the len to find the end
-            int len;
-            uint32_t ttl, rec_result = rr.ttl;
-
-            // find the MINIMUM-TTL field from the blob of binary data for this record
-            // skip the server name
-            len = dn_skipname(rdata, edata);
-            if (len == -1) continue;  // error skipping
-            rdata += len;
-
-            // skip the admin name
-            len = dn_skipname(rdata, edata);
-            if (len == -1) continue;  // error skipping
-            rdata += len;
-
-            if (edata - rdata != 5 * NS_INT32SZ) continue;
-            // skip: serial number + refresh interval + retry interval + expiry
-            rdata += NS_INT32SZ * 4;
-            // finally read the MINIMUM TTL
-            ttl = ntohl(*reinterpret_cast<const uint32_t*>(rdata));
-            if (ttl < rec_result) {
-                rec_result = ttl;
-            }
-            // Now that the record is read successfully, apply the new min TTL
-            if (n == 0 || rec_result < result) {
-                result = rec_result;
-            }
-        }
-    }
+static uint32_t answer_getTTL(const DnsMessageIndex& index) {
+    if (index.message().empty()) LOG(INFO) << __func__ << ": answer can't be parsed";
+    const uint32_t result = index.cacheTtl();
+    LOG(INFO) << __func__ << ": TTL = " << result;
     return result;
 }
 
 /*
- * Parse the answer records and find the appropriate
- * smallest TTL among the records.  This might be from
- * the answer records if found or from the SOA record
- * if it's a negative result.
- *
- * The returned TTL is the number of seconds to
- * keep the answer in the cache.
- *
- * In case of parse error zero (0) is returned which
- * indicates that the answer shall not be cached.
+ * Lower the TTL of every record in |answer| to at most |ttl|, leaving the
+ * EDNS OPT pseudo-record alone. Used when serving an expired answer so that
+ * clients don't hold on to it for long.
  */
-static uint32_t answer_getTTL(span<const uint8_t> answer) {
-    ns_msg handle;
-    int ancount, n;
-    uint32_t result, ttl;
-    ns_rr rr;
-
-    result = 0;
-    if (ns_initparse(answer.data(), answer.size(), &handle) >= 0) {
-        // get number of answer records
-        ancount = ns_msg_count(handle, ns_s_an);
-
-        if (ancount == 0) {
-            // a response with no answers?  Cache this negative result.
-            result = answer_getNegativeTTL(handle);
-        } else {
-            for (n = 0; n < ancount; n++) {
-                if (ns_parserr(&handle, ns_s_an, n, &rr) == 0) {
-                    ttl = rr.ttl;
-                    if (n == 0 || ttl < result) {
-                        result = ttl;
-                    }
-                } else {
-                    PLOG(INFO) << __func__ << ": ns_parserr failed ancount no = " << n;
-                }
+static void answer_clampTTL(span<uint8_t> answer, uint32_t ttl) {
+    DnsMessageIndex index;
+    if (!index.parse(answer)) return;
+
+    for (const ns_sect sect : {ns_s_an, ns_s_ns, ns_s_ar}) {
+        for (const DnsMessageIndex::Record& rr : index.section(sect)) {
+            if (rr.type == ns_t_opt || rr.ttl <= ttl) continue;
+            // The TTL field sits right before the 16-bit RDLENGTH that precedes the RDATA.
+            const size_t offset = rr.rdataOffset - NS_INT16SZ - NS_INT32SZ;
+            const uint32_t nttl = htonl(ttl);
+            memcpy(answer.data() + offset, &nttl, sizeof(nttl));
+        }
+    }
+}
+
+// Copies |answer| to |out| without the records stub resolvers ignore: the authority section of
+// positive answers, and all of the additional section but the EDNS OPT pseudo-record, which is
+// kept verbatim. Negative answers keep their authority section, whose SOA gives the negative TTL
+// (RFC 2308). The kept records form a prefix of the packet, so compression pointers stay valid.
+// Returns false if |answer| can't be parsed or has nothing to remove.
+static bool answer_minimize(const DnsMessageIndex& index, std::vector<uint8_t>* out) {
+    if (index.message().empty()) return false;
+    const bool negative = index.section(ns_s_an).empty();
+    if ((negative || index.section(ns_s_ns).empty()) && index.section(ns_s_ar).empty()) {
+        return false;
+    }
+
+    const auto questions = index.section(ns_s_qd);
+    size_t kept_end = questions.empty() ? DNS_HEADER_SIZE : DnsMessageIndex::end(questions.back());
+    span<const uint8_t> opt;
+    uint16_t nscount = 0;
+    for (const ns_sect sect : {ns_s_an, ns_s_ns, ns_s_ar}) {
+        for (const DnsMessageIndex::Record& rr : index.section(sect)) {
+            if (sect == ns_s_an || (sect == ns_s_ns && negative)) {
+                kept_end = DnsMessageIndex::end(rr);
+                nscount += (sect == ns_s_ns);
+            } else if (sect == ns_s_ar && rr.type == ns_t_opt && opt.empty()) {
+                opt = index.message().subspan(rr.nameOffset,
+                                              DnsMessageIndex::end(rr) - rr.nameOffset);
             }
         }
-    } else {
-        PLOG(INFO) << __func__ << ": ns_initparse failed";
     }
 
-    LOG(INFO) << __func__ << ": TTL = " << result;
-    return result;
+    const span<const uint8_t> kept = index.message().first(kept_end);
+    out->assign(kept.begin(), kept.end());
+    out->insert(out->end(), opt.begin(), opt.end());
+    uint8_t* const header = out->data();
+    header[8] = nscount >> 8;
+    header[9] = nscount & 0xff;
+    header[10] = 0;
+    header[11] = !opt.empty();
+    return true;
 }
 
-static void entry_free(Entry* e) {
-    /* everything is allocated in a single memory block */
-    if (e) {
-        free(e);
+// Calls |fn| with the RDATA of every well-formed A and AAAA record in the answer section of
+// |answer|, i.e. with each address in network byte order.
+template <typename Fn>
+static void answer_forEachAddress(span<const uint8_t> answer, Fn fn) {
+    DnsMessageIndex index;
+    if (!index.parse(answer)) return;
+
+    for (const DnsMessageIndex::Record& rr : index.section(ns_s_an)) {
+        if ((rr.type == ns_t_a && rr.rdlen == sizeof(in_addr)) ||
+            (rr.type == ns_t_aaaa && rr.rdlen == sizeof(in6_addr))) {
+            const span<const uint8_t> rdata = index.rdata(rr);
+            fn(std::string(rdata.begin(), rdata.end()));
+        }
     }
 }
 
+// Returns true if |a| and |b| have the same RCODE and the same answer records, whatever their
+// order and TTLs. Names are compared without regard to case, but RDATA byte for byte.
+static bool answer_sameRecords(span<const uint8_t> a, span<const uint8_t> b) {
+    // Each record as its lowercase owner name, then its type, class and RDATA.
+    const auto records = [](span<const uint8_t> answer, std::vector<std::string>* out) {
+        DnsMessageIndex index;
+        if (!index.parse(answer)) return false;
+        for (const DnsMessageIndex::Record& rr : index.section(ns_s_an)) {
+            char name[NS_MAXDNAME];
+            if (!index.expandName(rr.nameOffset, name, sizeof(name))) return false;
+            std::string record;
+            for (const char* c = name; *c != '\0'; c++) {
+                record.push_back(*c >= 'A' && *c <= 'Z' ? *c | 0x20 : *c);
+            }
+            const uint16_t fixed[] = {0, rr.type, rr.rclass};
+            record.append(reinterpret_cast<const char*>(fixed), sizeof(fixed));
+            const span<const uint8_t> rdata = index.rdata(rr);
+            record.append(rdata.begin(), rdata.end());
+            out->push_back(std::move(record));
+        }
+        std::sort(out->begin(), out->end());
+        return true;
+    };
+    if (a.size() < DNS_HEADER_SIZE || b.size() < DNS_HEADER_SIZE) return false;
+    if ((a[3] & 0xf) != (b[3] & 0xf)) return false;
+    std::vector<std::string> ra, rb;
+    return records(a, &ra) && records(b, &rb) && ra == rb;
+}
+
 static void entry_mru_remove(Entry* e) {
     e->mru_prev->mru_next = e->mru_next;
     e->mru_next->mru_prev = e->mru_prev;
@@ -842,8 +1048,8 @@ static unsigned entry_hash(const Entry* e) {
 static int entry_init_key(Entry* e, span<const uint8_t> query) {
     DnsPacket pack[1];
 
-    memset(e, 0, sizeof(*e));
-
+    // Value-initialized, as in entry_alloc(): zeroed, but for the default of |partitions|.
+    new (e) Entry();
     e->query = query.data();
     e->querylen = query.size();
     e->hash = entry_hash(e);
@@ -853,29 +1059,200 @@ static int entry_init_key(Entry* e, span<const uint8_t> query) {
     return _dnsPacket_checkQuery(pack);
 }
 
-/* allocate a new entry as a cache node */
-static Entry* entry_alloc(const Entry* init, span<const uint8_t> answer) {
-    Entry* e;
-    int size;
+// The first question of the query of |e|, QNAME, QTYPE and QCLASS, in wire format.
+static std::string_view entry_question(const Entry* e) {
+    const int qnamelen = dn_skipname(e->query + DNS_HEADER_SIZE, e->query + e->querylen);
+    if (qnamelen < 0) return {};
+    const size_t len = std::min<size_t>(qnamelen + 2 * NS_INT16SZ, e->querylen - DNS_HEADER_SIZE);
+    return {reinterpret_cast<const char*>(e->query) + DNS_HEADER_SIZE, len};
+}
 
-    size = sizeof(*e) + init->querylen + answer.size();
-    e = (Entry*) calloc(size, 1);
-    if (e == NULL) return e;
+// Size-classed slab allocator for the entries of one cache. Blocks are carved out of large
+// slabs and recycled through per-slab free lists, so adding and evicting entries rarely goes to
+// malloc. Blocks are taken from the lowest slab with a free one, so that evictions leave the
+// others empty, and an empty slab is given back unless it's the only one of its class with free
+// blocks. Blocks too large for any size class are allocated individually.
+class EntryArena {
+  public:
+    ~EntryArena() { reset(); }
+
+    // The bytes allocate() takes for a block of |size| bytes.
+    static size_t blockSize(size_t size) {
+        const int sizeClass = getSizeClass(size);
+        return sizeClass < 0 ? size : kMinBlockSize << sizeClass;
+    }
 
-    e->hash = init->hash;
-    e->query = (const uint8_t*) (e + 1);
-    e->querylen = init->querylen;
+    // Returns a zeroed block of at least |size| bytes, or nullptr if out of memory.
+    void* allocate(size_t size) {
+        const int sizeClass = getSizeClass(size);
+        if (sizeClass < 0) {
+            void* p = calloc(size, 1);
+            if (p != nullptr) mLargeBytes += size;
+            mPeakBytes = std::max(mPeakBytes, bytes());
+            return p;
+        }
 
-    memcpy((char*) e->query, init->query, e->querylen);
+        if (mPartialSlabs[sizeClass].empty() && !grow(sizeClass)) return nullptr;
+        const auto partial = mPartialSlabs[sizeClass].begin();
+        Slab& slab = mSlabs.find(*partial)->second;
+        FreeBlock* block = slab.freeList;
+        slab.freeList = block->next;
+        slab.used++;
+        if (slab.freeList == nullptr) mPartialSlabs[sizeClass].erase(partial);
+        memset(block, 0, kMinBlockSize << sizeClass);
+        return block;
+    }
 
-    e->answer = e->query + e->querylen;
-    e->answerlen = answer.size();
+    // |size| must be the size passed to allocate().
+    void deallocate(void* p, size_t size) {
+        const int sizeClass = getSizeClass(size);
+        if (sizeClass < 0) {
+            free(p);
+            mLargeBytes -= size;
+            return;
+        }
+        // The slab starting at or before |p|.
+        auto it = std::prev(mSlabs.upper_bound(reinterpret_cast<uintptr_t>(p)));
+        Slab& slab = it->second;
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        block->next = slab.freeList;
+        slab.freeList = block;
+        slab.used--;
+        std::set<uintptr_t>& partial = mPartialSlabs[sizeClass];
+        partial.insert(it->first);
+        if (slab.used == 0 && partial.size() > 1) {
+            partial.erase(it->first);
+            mSlabs.erase(it);
+        }
+    }
+
+    // Releases all slabs. Only valid once every block from the slabs has been deallocated.
+    void reset() {
+        mSlabs.clear();
+        for (std::set<uintptr_t>& partial : mPartialSlabs) partial.clear();
+    }
+
+    // The memory held now, free blocks included, and the most it ever held.
+    size_t bytes() const { return mSlabs.size() * kSlabSize + mLargeBytes; }
+    size_t peakBytes() const { return mPeakBytes; }
+
+  private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct Slab {
+        std::unique_ptr<uint8_t[]> memory;
+        FreeBlock* freeList = nullptr;
+        // Blocks handed out.
+        size_t used = 0;
+    };
+
+    static constexpr size_t kMinBlockSize = 256;
+    static constexpr int kNumSizeClasses = 7;  // 256 to 16384 bytes
+    static constexpr size_t kSlabSize = 64 * 1024;
+
+    static int getSizeClass(size_t size) {
+        for (int i = 0; i < kNumSizeClasses; i++) {
+            if (size <= kMinBlockSize << i) return i;
+        }
+        return -1;
+    }
+
+    bool grow(int sizeClass) {
+        const size_t blockSize = kMinBlockSize << sizeClass;
+        Slab slab;
+        slab.memory.reset(new (std::nothrow) uint8_t[kSlabSize]);
+        if (slab.memory == nullptr) return false;
+        for (size_t offset = kSlabSize; offset >= blockSize; offset -= blockSize) {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(slab.memory.get() + offset - blockSize);
+            block->next = slab.freeList;
+            slab.freeList = block;
+        }
+        const uintptr_t start = reinterpret_cast<uintptr_t>(slab.memory.get());
+        mSlabs.emplace(start, std::move(slab));
+        mPartialSlabs[sizeClass].insert(start);
+        mPeakBytes = std::max(mPeakBytes, bytes());
+        return true;
+    }
+
+    // By start address.
+    std::map<uintptr_t, Slab> mSlabs;
+    // The slabs of each size class that have free blocks.
+    std::array<std::set<uintptr_t>, kNumSizeClasses> mPartialSlabs;
+    // The blocks too large for the slabs, which are allocated on their own.
+    size_t mLargeBytes = 0;
+    size_t mPeakBytes = 0;
+};
+
+// Number of bytes |e| accounts for in the cache, as if it held a copy of its answer: those of the
+// block the arena would take for it, so that what the size classes round up is counted too.
+static size_t entry_size(const Entry* e) {
+    return EntryArena::blockSize(sizeof(*e) + e->querylen + e->answerlen);
+}
+
+// Number of bytes allocated for |e|. Everything is allocated in a single memory block: the
+// entry, then the TTLs of an interned answer or else the answer, then the query.
+static size_t entry_block_size(const Entry* e) {
+    const size_t answer =
+            e->payload != nullptr ? e->payload->ttlCount() * sizeof(uint32_t) : e->answerlen;
+    return sizeof(*e) + answer + e->querylen;
+}
+
+/* allocate a new entry as a cache node */
+static Entry* entry_alloc(EntryArena* arena, const Entry* init, span<const uint8_t> answer,
+                          bool intern) {
+    std::vector<uint32_t> ttls;
+    const AnswerInterner::Payload* payload =
+            intern ? AnswerInterner::getInstance().intern(answer, entry_question(init), &ttls)
+                   : nullptr;
+    const size_t stored = payload != nullptr ? ttls.size() * sizeof(uint32_t) : answer.size();
+
+    void* block = arena->allocate(sizeof(Entry) + stored + init->querylen);
+    if (block == NULL) {
+        if (payload != nullptr) AnswerInterner::getInstance().release(payload);
+        return NULL;
+    }
+    Entry* e = new (block) Entry();
+    uint8_t* p = reinterpret_cast<uint8_t*>(e + 1);
 
-    memcpy((char*)e->answer, answer.data(), e->answerlen);
+    e->hash = init->hash;
+    e->answerlen = answer.size();
+    if (payload != nullptr) {
+        e->payload = payload;
+        e->answer = payload->bytes().data();
+        e->ttls = reinterpret_cast<const uint32_t*>(p);
+        e->answer_id = ns_get16(answer.data());
+        memcpy(p, ttls.data(), stored);
+    } else {
+        e->answer = p;
+        memcpy(p, answer.data(), stored);
+    }
+    e->query = p + stored;
+    e->querylen = init->querylen;
+    memcpy((char*)e->query, init->query, e->querylen);
 
     return e;
 }
 
+static void entry_free(EntryArena* arena, Entry* e) {
+    if (e) {
+        if (e->payload != nullptr) AnswerInterner::getInstance().release(e->payload);
+        arena->deallocate(e, entry_block_size(e));
+    }
+}
+
+// Copies the answer of |e| as it was added to |out|, which must hold e->answerlen bytes.
+static void entry_copy_answer(const Entry* e, uint8_t* out) {
+    if (e->payload == nullptr) {
+        memcpy(out, e->answer, e->answerlen);
+        return;
+    }
+    AnswerInterner::materialize(*e->payload, e->answer_id, entry_question(e),
+                                {e->ttls, e->payload->ttlCount()},
+                                {out, static_cast<size_t>(e->answerlen)});
+}
+
 static int entry_equals(const Entry* e1, const Entry* e2) {
     DnsPacket pack1[1], pack2[1];
 
@@ -895,10 +1272,24 @@ static int entry_equals(const Entry* e1, const Entry* e2) {
 
 /* Maximum time for a thread to wait for an pending request */
 constexpr int PENDING_REQUEST_TIMEOUT = 20;
+// With the "adaptive_pending_waits" experiment, a pending request is deemed slow once it has
+// taken this many times as long as they usually take, though never less than the minimum below;
+// see cache_pending_patience_locked().
+constexpr int PENDING_PATIENCE_FACTOR = 4;
+constexpr std::chrono::milliseconds PENDING_MIN_PATIENCE(200);
+
+// TTL given to expired answers served in serve-stale mode, as recommended by RFC 8767.
+constexpr uint32_t STALE_ANSWER_TTL = 30;
 
-// lock protecting everything in NetConfig.
-static std::mutex cache_mutex;
-static std::condition_variable cv;
+// Most TTL of an answer made of HTTPS hints. The address records a hint stands for may have a
+// shorter one, and are fetched right away to replace it.
+constexpr uint32_t HTTPS_HINT_TTL = 30;
+
+// With the "cache_prefetch" experiment flag, an entry that has answered at least
+// PREFETCH_MIN_HITS lookups is refreshed once it gets within the last 1/PREFETCH_TTL_FRACTION
+// of its TTL, so that popular names don't expire under their callers.
+constexpr int PREFETCH_MIN_HITS = 3;
+constexpr int PREFETCH_TTL_FRACTION = 10;
 
 namespace {
 
@@ -945,61 +1336,431 @@ std::unordered_map<int, uint32_t> resolv_get_dns_event_subsampling_map(bool isMd
 
 }  // namespace
 
+// A slot of the open-addressing hash table used when the "cache_flat_table" experiment is
+// enabled. The hash and query length of the entry are stored inline, so most probes are
+// resolved without dereferencing the entry.
+//
+// |entry| must stay the first member: _cache_lookup_p() hands out a slot as an Entry**, just
+// like a link of a collision chain.
+struct FlatSlot {
+    Entry* entry;
+    unsigned int hash;
+    uint16_t querylen;
+};
+
 // Note that Cache is not thread-safe per se, access to its members must be protected
-// by an external mutex.
+// by the lock of the NetConfig owning it.
 //
+// Number of slots of the flat hash table. Keeping the load factor under 50% keeps the linear
+// probe sequences short.
+static size_t flat_table_size(int max_entries) {
+    return std::bit_ceil(static_cast<size_t>(max_entries) * 2);
+}
+
+// Bytes cached by all networks, and the number of caches they are cached by.
+static std::atomic<size_t> sCacheTotalBytes{0};
+static std::atomic<size_t> sCacheCount{0};
+
+// The bytes a cache may keep while all of them together are over CACHE_GLOBAL_MAX_BYTES: an
+// equal share of the ceiling. A cache under its share doesn't evict its own entries to make room
+// under the ceiling; those over theirs give the bytes back when they next add or are trimmed.
+static size_t cache_global_share() {
+    return CACHE_GLOBAL_MAX_BYTES / std::max<size_t>(1, sCacheCount);
+}
+
+// Why an entry was removed, as counted in Cache::eviction_counts. Flushing isn't counted.
+enum EvictReason {
+    EVICT_EXPIRED,      // expired, and couldn't be served stale any more
+    EVICT_CAPACITY,     // made room for another
+    EVICT_REPLACED,     // a newer answer to the same query was added
+    EVICT_INVALIDATED,  // left behind by an invalidation of the cache
+    EVICT_REASON_COUNT
+};
+
 // TODO: move all cache manipulation code here and make data members private.
 struct Cache {
-    Cache() {
-        entries.resize(CONFIG_MAX_ENTRIES);
+    Cache()
+        : flat_table_enabled(Experiments::getInstance()->getFlag("cache_flat_table", 0) == 1),
+          minimize_answers(Experiments::getInstance()->getFlag("cache_minimize_answers", 0) == 1),
+          intern_answers(Experiments::getInstance()->getFlag("cache_intern_answers", 0) == 1),
+          rrset_enabled(Experiments::getInstance()->getFlag("cache_rrset", 0) == 1),
+          aggressive_nsec_enabled(
+                  Experiments::getInstance()->getFlag("cache_aggressive_nsec", 0) == 1),
+          generations_enabled(Experiments::getInstance()->getFlag("cache_generations", 0) == 1),
+          https_hints_enabled(Experiments::getInstance()->getFlag("https_prefetch", 0) == 1),
+          adaptive_pending_waits(
+                  Experiments::getInstance()->getFlag("adaptive_pending_waits", 0) == 1) {
+        if (Experiments::getInstance()->getFlag("cache_admission", 0) == 1) {
+            sketch.emplace(max_entries);
+        }
+        if (flat_table_enabled) {
+            flat_slots.resize(flat_table_size(max_entries));
+        } else {
+            entries = std::vector<Entry>(max_entries);
+        }
         mru_list.mru_prev = mru_list.mru_next = &mru_list;
+        sCacheCount++;
+    }
+    ~Cache() {
+        flush();
+        sCacheCount--;
     }
-    ~Cache() { flush(); }
 
     void flush() {
-        for (int nn = 0; nn < CONFIG_MAX_ENTRIES; nn++) {
+        if (flat_table_enabled) {
+            for (FlatSlot& slot : flat_slots) {
+                entry_free(&arena, slot.entry);
+                slot = {};
+            }
+            clock_hand = 0;
+        }
+        expiry_heap.clear();
+        for (size_t nn = 0; nn < entries.size(); nn++) {
             Entry** pnode = (Entry**)&entries[nn];
 
             while (*pnode) {
                 Entry* node = *pnode;
                 *pnode = node->hlink;
-                entry_free(node);
+                entry_free(&arena, node);
             }
         }
 
+        arena.reset();
+        addr_index.clear();
+        rrsets.clear();
+        rrset_lru.clear();
+        nsec_ranges.clear();
+        nsec3_zones.clear();
+        nsec_count = 0;
+        https_hints.clear();
         flushPendingRequests();
 
         mru_list.mru_next = mru_list.mru_prev = &mru_list;
         num_entries = 0;
+        invalidated_entries = 0;
         last_id = 0;
+        sCacheTotalBytes -= bytes;
+        bytes = 0;
 
         LOG(INFO) << "DNS cache flushed";
     }
 
     void flushPendingRequests() {
-        pending_req_info* ri = pending_requests.next;
-        while (ri) {
-            pending_req_info* tmp = ri;
-            ri = ri->next;
-            free(tmp);
+        for (auto& [_, request] : pending_requests) {
+            request->done = true;
+            request->cv.notify_all();
         }
-
-        pending_requests.next = nullptr;
-        cv.notify_all();
+        pending_requests.clear();
     }
 
     int num_entries = 0;
-
+    // Total size of the entries, and the limits set by the byte budget.
+    size_t bytes = 0;
+    size_t max_bytes = CACHE_DEFAULT_MAX_BYTES;
+    int max_entries = CONFIG_MAX_ENTRIES;
+    // When the cache was last looked up or added to, for trimming idle caches.
+    std::atomic<CacheTime> last_used = _time_now();
+
+    // With the flat table, entries are linked in insertion order and this list is only used to
+    // iterate over them; recency is tracked by the reference bits instead.
     // TODO: convert to std::list
     Entry mru_list;
     int last_id = 0;
     std::vector<Entry> entries;
+    // Backing memory of the entries. Emptied as a whole by flush() and when the last entry is
+    // removed.
+    EntryArena arena;
+
+    // Set at creation time from the "cache_flat_table" experiment flag. When true, entries are
+    // indexed by |flat_slots| and evicted with CLOCK instead of the chained table and LRU.
+    const bool flat_table_enabled;
+    std::vector<FlatSlot> flat_slots;
+    size_t clock_hand = 0;
+
+    // All entries, as a binary min-heap ordered by expiry time, so that expired entries can be
+    // found without scanning the whole cache.
+    std::vector<Entry*> expiry_heap;
+
+    // Maps each address found in the A and AAAA answers to the entries holding it, for
+    // resolv_gethostbyaddr_from_cache(). Keys are addresses in network byte order, so IPv4 and
+    // IPv6 keys differ in length.
+    std::unordered_multimap<std::string, Entry*> addr_index;
+
+    // Set at creation time from the "cache_minimize_answers" experiment flag. When true, answers
+    // are stored without the records stub resolvers ignore; see answer_minimize().
+    const bool minimize_answers;
+
+    // Set at creation time from the "cache_intern_answers" experiment flag. When true, entries
+    // share the bytes of identical answers with those of every cache; see AnswerInterner.
+    const bool intern_answers;
+
+    // Set at creation time from the "cache_rrset" experiment flag. When true, the A, AAAA and
+    // CNAME RRsets of positive answers from private DNS are also cached on their own, keyed by
+    // lowercase owner name and type, so that a query missing the cache can be answered by
+    // following CNAMEs learned from other queries. See cache_add_rrsets_locked().
+    const bool rrset_enabled;
+    using RRsetKey = std::pair<std::string, uint16_t>;
+    struct RRset {
+        CacheTime expires;
+        // Raw RDATA for A and AAAA, the expanded lowercase target name for CNAME.
+        std::vector<std::string> rdata;
+        // Where the RRset is in rrset_lru.
+        std::list<const RRsetKey*>::iterator lru;
+    };
+    std::map<RRsetKey, RRset> rrsets;
+    // The keys of |rrsets|, most recently stored first, so that a full cache evicts the RRset at
+    // the back without scanning.
+    std::list<const RRsetKey*> rrset_lru;
+
+    // Set at creation time from the "cache_aggressive_nsec" experiment flag. When true, the
+    // NSEC and NSEC3 records of validated NXDOMAIN answers are kept, and names they prove not to
+    // exist are answered NXDOMAIN from the cache (RFC 8198). See cache_add_nsec_locked().
+    const bool aggressive_nsec_enabled;
+    struct NsecRange {
+        std::string owner;
+        std::string next;  // canonical key of the next owner name
+        CacheTime expires;
+        // The owner is a delegation point or a DNAME, so names below it aren't proven absent.
+        bool cut;
+    };
+    // NSEC ranges keyed by the canonical key of their owner name; see nsec_canonical_key().
+    std::map<std::string, NsecRange> nsec_ranges;
+    struct Nsec3Range {
+        std::string next;  // next hashed owner name, as raw hash bytes
+        CacheTime expires;
+        bool opt_out;
+        bool cut;
+    };
+    struct Nsec3Zone {
+        uint16_t iterations;
+        std::string salt;
+        // Keyed by the raw hash of the owner name.
+        std::map<std::string, Nsec3Range> ranges;
+    };
+    // NSEC3 chains keyed by zone name. SHA-1 is the only defined hash algorithm.
+    std::map<std::string, Nsec3Zone> nsec3_zones;
+    size_t nsec_count = 0;
+
+    // A query being resolved upstream that other lookups of the same key wait for. Each one
+    // has its own condition variable so that completing it only wakes up its own waiters.
+    struct PendingRequest {
+        std::condition_variable_any cv;
+        bool done = false;
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        // With |adaptive_pending_waits|: the rcode the query failed with, if it was completed by
+        // resolv_cache_add_failure(), and whether a waiter gave up on it to send the query
+        // itself.
+        std::optional<int> failed_rcode;
+        bool raced = false;
+    };
+    // Keyed by entry hash. Waiters hold a reference, so a request stays valid after removal.
+    std::unordered_map<unsigned int, std::shared_ptr<PendingRequest>> pending_requests;
+
+    // Set at creation time from the "adaptive_pending_waits" experiment flag. When true, a lookup
+    // waiting for a pending request is told when that request failed, rather than sending the
+    // query again, and the first waiter still waiting once the request turns out to be slow
+    // races it with a query of its own; see cache_wait_pending_locked().
+    const bool adaptive_pending_waits;
+    // How long pending requests take to be answered, as an exponentially weighted moving
+    // average, or 0 until one is.
+    std::chrono::milliseconds pending_latency{0};
+
+    // Set at creation time from the "cache_generations" experiment flag. When true, invalidate()
+    // doesn't free the entries: it starts a new generation, and lookups don't see the entries of
+    // older ones, which _cache_remove_expired() frees a few at a time.
+    const bool generations_enabled;
+    uint32_t generation = 0;
+    // The entries of older generations still there. Nothing finds them to move them forward, so
+    // they're all at the back of the MRU list.
+    int invalidated_entries = 0;
+
+    // Set at creation time from the "cache_admission" experiment flag. Every lookup is recorded
+    // in it, hit or miss, and an answer that would evict an entry is only added if its query was
+    // looked up more often; see cache_admit_locked(). Flushing the cache keeps the counts.
+    std::optional<FrequencySketch> sketch;
+
+    // Set at creation time from the "https_prefetch" experiment flag. When true, the ipv4hint
+    // and ipv6hint of the HTTPS records of a name answer its A and AAAA queries until the
+    // address records themselves are cached; see cache_lookup_https_hints_locked().
+    const bool https_hints_enabled;
+    struct HttpsHints {
+        CacheTime expires;
+        // When the address records of each type were last asked to be fetched.
+        CacheTime refresh_time[2];
+        // Raw addresses, the same as the RDATA of A and AAAA records.
+        std::vector<std::string> ipv4;
+        std::vector<std::string> ipv6;
+    };
+    // Keyed by lowercase owner name.
+    std::map<std::string, HttpsHints> https_hints;
+
+    // Set by the network from the "cache_uid_partitions" experiment flag; see
+    // cache_update_partitioning_locked(). When true, each app only sees the entries of the answers
+    // it added itself, and an answer added by several apps is stored once, visible to each of
+    // them. The RRset, NSEC and HTTPS hint caches and the peers aren't used, since what they
+    // answer with may have been added by any app.
+    bool partitioned = false;
+    struct Partition {
+        uid_t uid;
+        // The value of |partition_adds| when the app last added an answer. Not a time, since apps
+        // adding answers within the same clock tick must still be told apart.
+        uint64_t last_used;
+    };
+    // The partition of each bit of Entry::partitions.
+    std::vector<Partition> partitions;
+    uint64_t partition_adds = 0;
+
+    // Counted since the network was created, for resolv_netconfig_dump() and
+    // resolv_cache_get_stats_report(). The results of lookups are counted after the lock is
+    // released, hence the atomics.
+    std::array<std::atomic<uint64_t>, RESOLV_CACHE_PREFETCH + 1> lookup_counts{};
+    // Lookups that found their entry expired, whether it could still be served or not.
+    uint64_t expired_count = 0;
+    // Lookups that waited for the answer to the same query sent by another, and those of them
+    // that gave up on a slow one to race it.
+    uint64_t pending_wait_count = 0;
+    uint64_t pending_race_count = 0;
+    // Answers added whose TTL the policy of the network stretched, raised to the floor, or
+    // lowered to the ceiling; see cache_apply_ttl_policy_locked(). An answer stretched and then
+    // capped counts as both.
+    uint64_t ttl_stretched_count = 0;
+    uint64_t ttl_floored_count = 0;
+    uint64_t ttl_capped_count = 0;
+    std::array<uint64_t, EVICT_REASON_COUNT> eviction_counts{};
+    // Answers that cache_admit_locked() turned away.
+    uint64_t not_admitted_count = 0;
+    // See answer_size_bucket().
+    std::array<uint64_t, CACHE_ANSWER_SIZE_BUCKETS> answer_size_counts{};
+    // The queries looked up most often, keyed by their wire-format question. The counts are
+    // estimates, from a sample of the lookups.
+    HeavyHitters top_queries{CACHE_TOP_QUERIES, CACHE_TOP_QUERIES_SAMPLE_EVERY};
+
+    // The parts of the cache that invalidate() takes out, for the caller to free once it has
+    // released the lock.
+    struct Detached {
+        std::map<RRsetKey, RRset> rrsets;
+        std::list<const RRsetKey*> rrset_lru;
+        std::map<std::string, NsecRange> nsec_ranges;
+        std::map<std::string, Nsec3Zone> nsec3_zones;
+        std::map<std::string, HttpsHints> https_hints;
+    };
+
+    // Drops all the entries, as flush() does, but without walking them if |generations_enabled|.
+    [[nodiscard]] Detached invalidate() {
+        Detached detached;
+        if (!generations_enabled) {
+            flush();
+            return detached;
+        }
+        detached.rrsets.swap(rrsets);
+        detached.rrset_lru.swap(rrset_lru);
+        detached.nsec_ranges.swap(nsec_ranges);
+        detached.nsec3_zones.swap(nsec3_zones);
+        detached.https_hints.swap(https_hints);
+        nsec_count = 0;
+        flushPendingRequests();
+        generation++;
+        invalidated_entries = num_entries;
+        LOG(INFO) << "DNS cache invalidated, generation " << generation;
+        return detached;
+    }
+};
+
+static void _cache_set_max_bytes(Cache* cache, size_t max_bytes);
+
+// Query samples recorded with the "stats_lazy_merge" flag, waiting to be merged into the stats of
+// a NetConfig. Each CPU adds to a shard of its own, so that finishing a query only takes a lock
+// which another thread rarely holds, instead of the NetConfig lock that cache lookups need.
+// Samples are merged in the order they were added, so the stats end up as if they had been
+// recorded right away.
+class PendingStats {
+  public:
+    struct Sample {
+        uint64_t seq;
+        IPSockAddr server;
+        // A DnsStats sample if set, and a res_stats one otherwise.
+        std::optional<DnsQueryEvent> event;
+        int revision_id;
+        res_sample sample;
+        int max_samples;
+    };
+
+    // Readers merge the samples in if the oldest is older than this.
+    static constexpr std::chrono::milliseconds kMaxStaleness{250};
+    // Writers merge them in themselves past this many.
+    static constexpr size_t kMaxSamples = 256;
+
+    // Returns whether there are now kMaxSamples or more.
+    bool add(Sample&& sample) {
+        const int cpu = sched_getcpu();
+        Shard& shard = mShards[cpu >= 0 ? cpu % kShards : 0];
+        size_t count;
+        {
+            // Numbered and counted under the shard lock, so that take() never subtracts a
+            // sample it took before the sample was counted.
+            std::lock_guard guard(shard.lock);
+            sample.seq = mNextSeq.fetch_add(1, std::memory_order_relaxed);
+            shard.samples.push_back(std::move(sample));
+            count = mCount.fetch_add(1, std::memory_order_acq_rel);
+        }
+        if (count == 0) {
+            mOldest.store(now(), std::memory_order_release);
+        }
+        return count + 1 >= kMaxSamples;
+    }
+
+    bool empty() const { return mCount.load(std::memory_order_acquire) == 0; }
+
+    // Whether readers that can do with slightly stale stats should merge the samples in.
+    bool due() const {
+        return !empty() && (mCount.load(std::memory_order_acquire) >= kMaxSamples ||
+                            now() - mOldest.load(std::memory_order_acquire) >= kMaxStaleness);
+    }
+
+    // Returns all the samples, oldest first.
+    std::vector<Sample> take() {
+        std::vector<Sample> samples;
+        for (Shard& shard : mShards) {
+            std::lock_guard guard(shard.lock);
+            std::move(shard.samples.begin(), shard.samples.end(), std::back_inserter(samples));
+            shard.samples.clear();
+        }
+        // Samples added meanwhile are dated from now, which is close enough.
+        if (mCount.fetch_sub(samples.size(), std::memory_order_acq_rel) > samples.size()) {
+            mOldest.store(now(), std::memory_order_release);
+        }
+        std::sort(samples.begin(), samples.end(),
+                  [](const Sample& a, const Sample& b) { return a.seq < b.seq; });
+        return samples;
+    }
+
+  private:
+    using Clock = std::chrono::steady_clock;
+    static Clock::time_point now() { return Clock::now(); }
+
+    static constexpr size_t kShards = 8;
+    struct alignas(64) Shard {
+        std::mutex lock;
+        std::vector<Sample> samples;
+    };
+    std::array<Shard, kShards> mShards;
+    std::atomic<uint64_t> mNextSeq = 0;
+    std::atomic<size_t> mCount = 0;
+    std::atomic<Clock::time_point> mOldest;
+};
+
+// The analysis doesn't see what std::unique_lock and std::shared_lock hold, so their holders
+// assert it. android::base::ScopedLockAssertion does that for a std::mutex only.
+class SCOPED_CAPABILITY ScopedExclusiveLockAssertion {
+  public:
+    explicit ScopedExclusiveLockAssertion(std::shared_mutex& mutex) ACQUIRE(mutex) {}
+    ~ScopedExclusiveLockAssertion() RELEASE() {}
+};
 
-    // TODO: convert to std::vector
-    struct pending_req_info {
-        unsigned int hash;
-        struct pending_req_info* next;
-    } pending_requests{};
+class SCOPED_CAPABILITY ScopedSharedLockAssertion {
+  public:
+    explicit ScopedSharedLockAssertion(std::shared_mutex& mutex) ACQUIRE_SHARED(mutex) {}
+    ~ScopedSharedLockAssertion() RELEASE() {}
 };
 
 struct NetConfig {
@@ -1007,14 +1768,24 @@ struct NetConfig {
         cache = std::make_unique<Cache>();
         dns_event_subsampling_map = resolv_get_dns_event_subsampling_map(false);
         mdns_event_subsampling_map = resolv_get_dns_event_subsampling_map(true);
+        for (const auto* map : {&dns_event_subsampling_map, &mdns_event_subsampling_map}) {
+            for (const auto& [return_code, denom] : *map) {
+                if (denom != 0 && (min_event_subsampling_denom == 0 ||
+                                   denom < min_event_subsampling_denom)) {
+                    min_event_subsampling_denom = denom;
+                }
+            }
+        }
     }
     int nameserverCount() { return nameserverSockAddrs.size(); }
     int setOptions(const ResolverOptionsParcel& resolverOptions) {
-        customizedTable.clear();
+        auto hosts = std::make_shared<HostsFile::Table>();
         for (const auto& host : resolverOptions.hosts) {
-            if (!host.hostName.empty() && !host.ipAddr.empty())
-                customizedTable.emplace(host.hostName, host.ipAddr);
+            if (!host.hostName.empty() && !host.ipAddr.empty()) {
+                hosts->add(host.ipAddr, {host.hostName});
+            }
         }
+        customizedTable = hosts->size() > 0 ? std::move(hosts) : nullptr;
 
         if (resolverOptions.tcMode < aidl::android::net::IDnsResolver::TC_MODE_DEFAULT ||
             resolverOptions.tcMode > aidl::android::net::IDnsResolver::TC_MODE_UDP_TCP) {
@@ -1022,11 +1793,57 @@ struct NetConfig {
                          << ", invalid TC mode: " << resolverOptions.tcMode;
             return -EINVAL;
         }
+        if (resolverOptions.serveStaleSec < 0) {
+            LOG(WARNING) << __func__ << ": netid = " << netid
+                         << ", invalid serve-stale window: " << resolverOptions.serveStaleSec;
+            return -EINVAL;
+        }
+        if (resolverOptions.cacheMaxBytes < 0) {
+            LOG(WARNING) << __func__ << ": netid = " << netid
+                         << ", invalid cache budget: " << resolverOptions.cacheMaxBytes;
+            return -EINVAL;
+        }
+        if (resolverOptions.failureCacheSec < 0 ||
+            resolverOptions.failureCacheSec > FAILURE_CACHE_MAX_SEC) {
+            LOG(WARNING) << __func__ << ": netid = " << netid
+                         << ", invalid failure cache lifetime: " << resolverOptions.failureCacheSec;
+            return -EINVAL;
+        }
+        if (resolverOptions.cacheMinTtlSec < 0 || resolverOptions.cacheMaxTtlSec < 0 ||
+            (resolverOptions.cacheMaxTtlSec > 0 &&
+             resolverOptions.cacheMinTtlSec > resolverOptions.cacheMaxTtlSec)) {
+            LOG(WARNING) << __func__ << ": netid = " << netid
+                         << ", invalid cache TTL bounds: " << resolverOptions.cacheMinTtlSec
+                         << ", " << resolverOptions.cacheMaxTtlSec;
+            return -EINVAL;
+        }
+        if (resolverOptions.cacheLowTtlSec < 0 || resolverOptions.cacheLowTtlStretch < 0) {
+            LOG(WARNING) << __func__ << ": netid = " << netid
+                         << ", invalid low TTL stretch: " << resolverOptions.cacheLowTtlSec
+                         << ", " << resolverOptions.cacheLowTtlStretch;
+            return -EINVAL;
+        }
         tc_mode = resolverOptions.tcMode;
         enforceDnsUid = resolverOptions.enforceDnsUid;
+        serve_stale_sec = resolverOptions.serveStaleSec;
+        min_ttl_sec = resolverOptions.cacheMinTtlSec;
+        max_ttl_sec = resolverOptions.cacheMaxTtlSec;
+        low_ttl_sec = resolverOptions.cacheLowTtlSec;
+        low_ttl_stretch = resolverOptions.cacheLowTtlStretch;
+        failure_cache_sec = resolverOptions.failureCacheSec;
+        _cache_set_max_bytes(cache.get(), resolverOptions.cacheMaxBytes > 0
+                                                  ? resolverOptions.cacheMaxBytes
+                                                  : CACHE_DEFAULT_MAX_BYTES);
         return 0;
     }
     const unsigned netid;
+    // Lock protecting everything in this NetConfig, including its cache. Each network has its
+    // own lock so that lookups on one network never serialize against lookups on another.
+    // Cache hits only take it in shared mode; see cache_lookup_shared().
+    std::shared_mutex lock;
+    // Set when the network is deleted, so that threads waiting for a pending request on this
+    // network can bail out even though they still hold a reference to it.
+    bool deleted = false;
     std::unique_ptr<Cache> cache;
     std::vector<std::string> nameservers;
     std::vector<IPSockAddr> nameserverSockAddrs;
@@ -1035,69 +1852,125 @@ struct NetConfig {
     res_stats nsstats[MAXNS]{};
     std::vector<std::string> search_domains;
     int wait_for_pending_req_timeout_count = 0;
+    int prefetch_count = 0;
+    // Whether the network shares answers with the other networks of its cache domain, and how
+    // many of its cache misses were answered from them.
+    bool in_cache_domain = false;
+    int shared_hit_count = 0;
     // Map format: ReturnCode:rate_denom
     std::unordered_map<int, uint32_t> dns_event_subsampling_map;
     std::unordered_map<int, uint32_t> mdns_event_subsampling_map;
+    // The lowest denominator of both maps but 0, i.e. the best chance an event has of being
+    // sampled, or 0 if none is ever sampled. Like the maps, it never changes.
+    uint32_t min_event_subsampling_denom = 0;
+    // The events resolv_cache_draw_event_sample() drew for sampling, and those it didn't.
+    std::atomic<uint64_t> event_drawn_count = 0;
+    std::atomic<uint64_t> event_not_drawn_count = 0;
     DnsStats dnsStats;
+    // Samples for |nsstats| and |dnsStats| not merged in yet; see merge_pending_stats_locked().
+    PendingStats pendingStats;
 
-    // Customized hostname/address table will be stored in customizedTable.
-    // If resolverParams.hosts is empty, the existing customized table will be erased.
-    typedef std::multimap<std::string /* hostname */, std::string /* IPv4/IPv6 address */>
-            HostMapping;
-    HostMapping customizedTable = {};
+    // Customized hostname/address table will be stored in customizedTable, indexed both ways like
+    // the hosts file. Lookups share it rather than copy it out. If resolverParams.hosts is empty,
+    // the existing customized table will be erased.
+    std::shared_ptr<const HostsFile::Table> customizedTable;
 
     int tc_mode = aidl::android::net::IDnsResolver::TC_MODE_DEFAULT;
     bool enforceDnsUid = false;
+    // When the cache was last saved to its snapshot file. Claimed under a shared lock, by the
+    // thread that saves it next.
+    std::atomic<CacheTime> last_snapshot = _time_now();
+    // Bumped when the snapshot file is removed, so that an image of the cache taken before isn't
+    // written afterwards.
+    uint32_t snapshot_epoch = 0;
+    // When resolv_cache_get_stats_report() last filled in the statistics of the cache.
+    std::optional<CacheTime> last_stats_report;
+    // How long past expiry an answer may still be served, or 0 if serve-stale is disabled.
+    int serve_stale_sec = 0;
+    // The TTL policy of cached answers; see cache_apply_ttl_policy_locked(). 0 disables each.
+    int min_ttl_sec = 0;
+    int max_ttl_sec = 0;
+    int low_ttl_sec = 0;
+    int low_ttl_stretch = 0;
+    // How long a question fails fast after a SERVFAIL or a timeout, or 0 if failures aren't
+    // remembered.
+    int failure_cache_sec = 0;
     std::vector<int32_t> transportTypes;
+
+    // The questions that failed in the last failure_cache_sec seconds, by failure_key(), and the
+    // rcode they failed with; see resolv_cache_add_failure().
+    struct FailedQuery {
+        int rcode;
+        CacheTime expires;
+    };
+    std::unordered_map<std::string, FailedQuery> failed_queries;
+
+    // Final getaddrinfo results by resolv_cache_lookup_addrinfo() key. They are derived from the
+    // answers in |cache| and the configuration above, so they go whenever either changes.
+    struct AddrInfoResult {
+        std::vector<CachedAddrInfo> addrs;
+        CacheTime expires;
+        uint32_t generation;
+        // Where the result is in addrinfo_lru.
+        std::list<const std::string*>::iterator lru;
+        // Set by lookups, which only hold a shared lock, for eviction to give the result a second
+        // chance.
+        mutable std::atomic<bool> referenced = false;
+    };
+    std::unordered_map<std::string, AddrInfoResult> addrinfo_cache;
+    // The keys of |addrinfo_cache|, most recently added or given a second chance first.
+    std::list<const std::string*> addrinfo_lru;
+
+    // Source address results by resolv_cache_lookup_src_addr() key, dropped along with
+    // |addrinfo_cache| except on option changes, which don't affect routing.
+    struct SrcAddrResult {
+        CachedSrcAddr result;
+        CacheTime expires;
+        uint32_t generation;
+    };
+    std::unordered_map<std::string, SrcAddrResult> src_addr_cache;
+    // With Cache::generations_enabled, results of older generations than these are dropped
+    // rather than the whole maps; see invalidate_results_locked().
+    uint32_t addrinfo_generation = 0;
+    uint32_t src_addr_generation = 0;
 };
 
-/* gets cache associated with a network, or NULL if none exists */
-static Cache* find_named_cache_locked(unsigned netid) REQUIRES(cache_mutex);
+// Get a NetConfig associated with a network, or nullptr if not found. The returned NetConfig
+// stays valid even if the network is deleted concurrently; callers must take its lock before
+// accessing it, and check NetConfig::deleted if they release the lock in between.
+static std::shared_ptr<NetConfig> find_netconfig(unsigned netid);
 
-// Return true - if there is a pending request in |cache| matching |key|.
-// Return false - if no pending request is found matching the key. Optionally
-//                link a new one if parameter append_if_not_found is true.
-static bool cache_has_pending_request_locked(Cache* cache, const Entry* key,
-                                             bool append_if_not_found) {
-    if (!cache || !key) return false;
+// Get the other networks in the same cache domain as |netid|; see resolv_set_cache_domain().
+static std::vector<std::shared_ptr<NetConfig>> find_cache_domain_peers(unsigned netid);
 
-    Cache::pending_req_info* ri = cache->pending_requests.next;
-    Cache::pending_req_info* prev = &cache->pending_requests;
-    while (ri) {
-        if (ri->hash == key->hash) {
-            return true;
-        }
-        prev = ri;
-        ri = ri->next;
+// Return the pending request in |cache| matching |key|, or nullptr if there is none.
+// If none is found and |append_if_not_found| is true, register a new one, which the caller
+// is then responsible for completing with cache_notify_waiting_tid_locked().
+static std::shared_ptr<Cache::PendingRequest> cache_find_pending_request_locked(
+        Cache* cache, const Entry* key, bool append_if_not_found) {
+    if (!cache || !key) return nullptr;
+
+    if (const auto it = cache->pending_requests.find(key->hash);
+        it != cache->pending_requests.end()) {
+        return it->second;
     }
 
     if (append_if_not_found) {
-        ri = (Cache::pending_req_info*)calloc(1, sizeof(Cache::pending_req_info));
-        if (ri) {
-            ri->hash = key->hash;
-            prev->next = ri;
-        }
+        cache->pending_requests.emplace(key->hash, std::make_shared<Cache::PendingRequest>());
     }
-    return false;
+    return nullptr;
 }
 
-// Notify all threads that the cache entry |key| has become available
+// Notify the threads waiting for the cache entry |key| that it has become available
 static void cache_notify_waiting_tid_locked(struct Cache* cache, const Entry* key) {
     if (!cache || !key) return;
 
-    Cache::pending_req_info* ri = cache->pending_requests.next;
-    Cache::pending_req_info* prev = &cache->pending_requests;
-    while (ri) {
-        if (ri->hash == key->hash) {
-            // remove item from list and destroy
-            prev->next = ri->next;
-            free(ri);
-            cv.notify_all();
-            return;
-        }
-        prev = ri;
-        ri = ri->next;
-    }
+    const auto it = cache->pending_requests.find(key->hash);
+    if (it == cache->pending_requests.end()) return;
+
+    it->second->done = true;
+    it->second->cv.notify_all();
+    cache->pending_requests.erase(it);
 }
 
 void _resolv_cache_query_failed(unsigned netid, span<const uint8_t> query, uint32_t flags) {
@@ -1109,16 +1982,106 @@ void _resolv_cache_query_failed(unsigned netid, span<const uint8_t> query, uint3
 
     if (!entry_init_key(key, query)) return;
 
-    std::lock_guard guard(cache_mutex);
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
 
-    Cache* cache = find_named_cache_locked(netid);
+    std::lock_guard guard(netconfig->lock);
+    cache_notify_waiting_tid_locked(netconfig->cache.get(), key);
+}
 
-    if (cache) {
-        cache_notify_waiting_tid_locked(cache, key);
+// The key of the question of |key| in NetConfig::failed_queries: the question in wire format, with
+// the name in lowercase. Label lengths are below 64, so they're left alone.
+static std::string failure_key(const Entry* key) {
+    std::string question(entry_question(key));
+    if (question.size() <= 2 * NS_INT16SZ) return {};
+    for (size_t i = 0; i < question.size() - 2 * NS_INT16SZ; i++) {
+        if (question[i] >= 'A' && question[i] <= 'Z') question[i] |= 0x20;
+    }
+    return question;
+}
+
+// Folds how long the pending request of |key|, which was just answered, took into
+// Cache::pending_latency.
+static void cache_record_pending_latency_locked(Cache* cache, const Entry* key) {
+    if (!cache->adaptive_pending_waits) return;
+    const auto it = cache->pending_requests.find(key->hash);
+    if (it == cache->pending_requests.end()) return;
+    const auto took = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - it->second->started);
+    cache->pending_latency = cache->pending_latency == std::chrono::milliseconds::zero()
+                                     ? took
+                                     : (cache->pending_latency * 7 + took) / 8;
+}
+
+void resolv_cache_add_failure(unsigned netid, span<const uint8_t> query, uint32_t flags,
+                              int rcode) {
+    if (flags & (ANDROID_RESOLV_NO_CACHE_STORE | ANDROID_RESOLV_NO_CACHE_LOOKUP)) {
+        return;
+    }
+    Entry key[1];
+
+    if (!entry_init_key(key, query)) return;
+
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
+
+    std::lock_guard guard(netconfig->lock);
+    // In a partitioned cache, the query may have failed only because the app's own traffic is
+    // blocked, which says nothing of the other apps.
+    if (std::string question = failure_key(key); netconfig->failure_cache_sec > 0 &&
+                                                  !netconfig->cache->partitioned &&
+                                                  !question.empty()) {
+        auto& failed = netconfig->failed_queries;
+        const CacheTime now = _time_now();
+        if (failed.size() >= FAILURE_CACHE_MAX_ENTRIES) {
+            std::erase_if(failed, [now](const auto& entry) { return now >= entry.second.expires; });
+        }
+        if (failed.size() < FAILURE_CACHE_MAX_ENTRIES || failed.contains(question)) {
+            failed[std::move(question)] = {
+                    .rcode = rcode,
+                    .expires = now + std::chrono::seconds(netconfig->failure_cache_sec)};
+        }
     }
+    // Those waiting for the answer find the failure.
+    Cache* cache = netconfig->cache.get();
+    if (const auto it = cache->pending_requests.find(key->hash);
+        cache->adaptive_pending_waits && it != cache->pending_requests.end()) {
+        it->second->failed_rcode = rcode;
+    }
+    cache_notify_waiting_tid_locked(cache, key);
+}
+
+void resolv_cache_clear_failures(unsigned netid) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
+
+    std::lock_guard guard(netconfig->lock);
+    netconfig->failed_queries.clear();
+}
+
+bool resolv_cache_lookup_failure(unsigned netid, span<const uint8_t> query, uint32_t flags,
+                                 int* rcode) {
+    if (flags & (ANDROID_RESOLV_NO_CACHE_STORE | ANDROID_RESOLV_NO_CACHE_LOOKUP)) {
+        return false;
+    }
+    Entry key[1];
+
+    if (!entry_init_key(key, query)) return false;
+
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return false;
+
+    std::shared_lock guard(netconfig->lock);
+    if (netconfig->failed_queries.empty() || netconfig->cache->partitioned) return false;
+    const auto it = netconfig->failed_queries.find(failure_key(key));
+    if (it == netconfig->failed_queries.end() || _time_now() >= it->second.expires) return false;
+    *rcode = it->second.rcode;
+    return true;
 }
 
 static void cache_dump_mru_locked(Cache* cache) {
+    // Walks the whole list, on every add.
+    if (!WOULD_LOG(INFO)) return;
     std::string buf = fmt::format("MRU LIST ({:2d}): ", cache->num_entries);
     for (Entry* e = cache->mru_list.mru_next; e != &cache->mru_list; e = e->mru_next) {
         fmt::format_to(std::back_inserter(buf), " {}", e->id);
@@ -1127,6 +2090,43 @@ static void cache_dump_mru_locked(Cache* cache) {
     LOG(INFO) << __func__ << ": " << buf;
 }
 
+// Same as _cache_lookup_p(), for the flat table. The returned pointer is the |entry| field of
+// either the matching slot or the empty slot ending the probe sequence. The table is never more
+// than half full, so there is always such an empty slot.
+static Entry** _cache_flat_lookup_p(Cache* cache, const Entry* key) {
+    const size_t mask = cache->flat_slots.size() - 1;
+
+    for (size_t i = key->hash & mask;; i = (i + 1) & mask) {
+        FlatSlot* slot = &cache->flat_slots[i];
+
+        if (slot->entry == nullptr) return &slot->entry;
+
+        if (slot->hash == key->hash && slot->querylen == key->querylen &&
+            slot->entry->generation == cache->generation && entry_equals(slot->entry, key)) {
+            return &slot->entry;
+        }
+    }
+}
+
+// Empties the flat table slot at |lookup|, then moves back the entries that follow it in the
+// same probe sequence so that lookups never need tombstones.
+static void _cache_flat_erase_p(Cache* cache, Entry** lookup) {
+    std::vector<FlatSlot>& slots = cache->flat_slots;
+    const size_t mask = slots.size() - 1;
+    size_t hole = reinterpret_cast<FlatSlot*>(lookup) - slots.data();
+
+    for (size_t i = (hole + 1) & mask; slots[i].entry != nullptr; i = (i + 1) & mask) {
+        // The entry can fill the hole only if the hole lies between its home slot and the slot
+        // it is stored in, taking the wrap-around into account.
+        const size_t home = slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            slots[hole] = slots[i];
+            hole = i;
+        }
+    }
+    slots[hole] = {};
+}
+
 /* This function tries to find a key within the hash table
  * In case of success, it will return a *pointer* to the hashed key.
  * In case of failure, it will return a *pointer* to NULL
@@ -1142,7 +2142,9 @@ static void cache_dump_mru_locked(Cache* cache) {
  * table.
  */
 static Entry** _cache_lookup_p(Cache* cache, Entry* key) {
-    int index = key->hash % CONFIG_MAX_ENTRIES;
+    if (cache->flat_table_enabled) return _cache_flat_lookup_p(cache, key);
+
+    int index = key->hash % cache->entries.size();
     Entry** pnode = (Entry**) &cache->entries[index];
 
     while (*pnode != NULL) {
@@ -1150,48 +2152,179 @@ static Entry** _cache_lookup_p(Cache* cache, Entry* key) {
 
         if (node == NULL) break;
 
-        if (node->hash == key->hash && entry_equals(node, key)) break;
+        if (node->hash == key->hash && node->generation == cache->generation &&
+            entry_equals(node, key))
+            break;
 
         pnode = &node->hlink;
     }
     return pnode;
 }
 
-/* Add a new entry to the hash table. 'lookup' must be the
- * result of an immediate previous failed _lookup_p() call
- * (i.e. with *lookup == NULL), and 'e' is the pointer to the
- * newly created entry
- */
-static void _cache_add_p(Cache* cache, Entry** lookup, Entry* e) {
-    *lookup = e;
-    e->id = ++cache->last_id;
-    entry_mru_add(e, &cache->mru_list);
-    cache->num_entries += 1;
+// Same as _cache_lookup_p(), but for |e| itself rather than an entry with its key, which may be
+// another one if |e| is of an older generation. Ends at the empty slot if |e| isn't there.
+static Entry** _cache_entry_p(Cache* cache, const Entry* e) {
+    if (cache->flat_table_enabled) {
+        const size_t mask = cache->flat_slots.size() - 1;
+        for (size_t i = e->hash & mask;; i = (i + 1) & mask) {
+            FlatSlot* slot = &cache->flat_slots[i];
+            if (slot->entry == nullptr || slot->entry == e) return &slot->entry;
+        }
+    }
 
-    LOG(INFO) << __func__ << ": entry " << e->id << " added (count=" << cache->num_entries << ")";
+    Entry** pnode = (Entry**)&cache->entries[e->hash % cache->entries.size()];
+    while (*pnode != nullptr && *pnode != e) pnode = &(*pnode)->hlink;
+    return pnode;
 }
 
-/* Remove an existing entry from the hash table,
- * 'lookup' must be the result of an immediate previous
- * and succesful _lookup_p() call.
- */
-static void _cache_remove_p(Cache* cache, Entry** lookup) {
-    Entry* e = *lookup;
+static void _cache_expiry_swap(Cache* cache, size_t i, size_t j) {
+    std::vector<Entry*>& heap = cache->expiry_heap;
+    std::swap(heap[i], heap[j]);
+    heap[i]->expiry_index = i;
+    heap[j]->expiry_index = j;
+}
+
+static void _cache_expiry_sift_up(Cache* cache, size_t i) {
+    std::vector<Entry*>& heap = cache->expiry_heap;
+    while (i > 0) {
+        const size_t parent = (i - 1) / 2;
+        if (heap[parent]->expires <= heap[i]->expires) break;
+        _cache_expiry_swap(cache, i, parent);
+        i = parent;
+    }
+}
+
+static void _cache_expiry_sift_down(Cache* cache, size_t i) {
+    std::vector<Entry*>& heap = cache->expiry_heap;
+    for (;;) {
+        size_t smallest = i;
+        for (const size_t child : {2 * i + 1, 2 * i + 2}) {
+            if (child < heap.size() && heap[child]->expires < heap[smallest]->expires) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) break;
+        _cache_expiry_swap(cache, i, smallest);
+        i = smallest;
+    }
+}
+
+static void _cache_expiry_add(Cache* cache, Entry* e) {
+    e->expiry_index = cache->expiry_heap.size();
+    cache->expiry_heap.push_back(e);
+    _cache_expiry_sift_up(cache, e->expiry_index);
+}
+
+static void _cache_expiry_remove(Cache* cache, Entry* e) {
+    const size_t i = e->expiry_index;
+    const size_t last = cache->expiry_heap.size() - 1;
+    if (i != last) {
+        _cache_expiry_swap(cache, i, last);
+    }
+    cache->expiry_heap.pop_back();
+    if (i != last) {
+        _cache_expiry_sift_up(cache, i);
+        _cache_expiry_sift_down(cache, i);
+    }
+}
+
+/* Add a new entry to the hash table. 'lookup' must be the
+ * result of an immediate previous failed _lookup_p() call
+ * (i.e. with *lookup == NULL), and 'e' is the pointer to the
+ * newly created entry
+ */
+static void _cache_add_p(Cache* cache, Entry** lookup, Entry* e) {
+    *lookup = e;
+    if (cache->flat_table_enabled) {
+        FlatSlot* slot = reinterpret_cast<FlatSlot*>(lookup);
+        slot->hash = e->hash;
+        slot->querylen = e->querylen;
+    }
+    e->id = ++cache->last_id;
+    e->generation = cache->generation;
+    entry_mru_add(e, &cache->mru_list);
+    _cache_expiry_add(cache, e);
+    answer_forEachAddress({e->answer, static_cast<size_t>(e->answerlen)},
+                          [&](std::string addr) { cache->addr_index.emplace(std::move(addr), e); });
+    cache->num_entries += 1;
+    cache->bytes += entry_size(e);
+    sCacheTotalBytes += entry_size(e);
+
+    LOG(INFO) << __func__ << ": entry " << e->id << " added (count=" << cache->num_entries << ")";
+}
+
+/* Remove an existing entry from the hash table,
+ * 'lookup' must be the result of an immediate previous
+ * and succesful _lookup_p() call.
+ */
+static void _cache_remove_p(Cache* cache, Entry** lookup, EvictReason reason) {
+    Entry* e = *lookup;
+    cache->eviction_counts[reason]++;
 
     LOG(INFO) << __func__ << ": entry " << e->id << " removed (count=" << cache->num_entries - 1
               << ")";
 
     entry_mru_remove(e);
-    *lookup = e->hlink;
-    entry_free(e);
+    _cache_expiry_remove(cache, e);
+    if (e->generation != cache->generation) cache->invalidated_entries -= 1;
+    answer_forEachAddress({e->answer, static_cast<size_t>(e->answerlen)}, [&](std::string addr) {
+        const auto [begin, end] = cache->addr_index.equal_range(addr);
+        const auto it = std::find_if(begin, end, [e](const auto& kv) { return kv.second == e; });
+        if (it != end) cache->addr_index.erase(it);
+    });
+    cache->bytes -= entry_size(e);
+    sCacheTotalBytes -= entry_size(e);
+    if (cache->flat_table_enabled) {
+        _cache_flat_erase_p(cache, lookup);
+    } else {
+        *lookup = e->hlink;
+    }
+    entry_free(&cache->arena, e);
     cache->num_entries -= 1;
 }
 
+// Removes one entry from the flat table, chosen by the CLOCK (second chance) policy: the hand
+// sweeps the slots clearing reference bits, and evicts the first entry that hasn't been hit
+// since the hand last passed it.
+static void _cache_flat_remove_clock(Cache* cache) {
+    std::vector<FlatSlot>& slots = cache->flat_slots;
+    const size_t mask = slots.size() - 1;
+
+    if (cache->num_entries == 0) return;
+
+    for (;; cache->clock_hand = (cache->clock_hand + 1) & mask) {
+        FlatSlot* slot = &slots[cache->clock_hand];
+        if (slot->entry == nullptr) continue;
+        if (slot->entry->referenced) {
+            slot->entry->referenced = false;
+            continue;
+        }
+        LOG(INFO) << __func__ << ": Cache full - removing entry " << slot->entry->id;
+        res_pquery({slot->entry->query, static_cast<size_t>(slot->entry->querylen)});
+        // The hand stays here, since the slot may be refilled by an entry moved back.
+        _cache_remove_p(cache, &slot->entry, EVICT_CAPACITY);
+        return;
+    }
+}
+
 /* Remove the oldest entry from the hash table.
  */
 static void _cache_remove_oldest(Cache* cache) {
+    if (cache->flat_table_enabled) {
+        _cache_flat_remove_clock(cache);
+        return;
+    }
+
+    // Hits under a shared lock only mark their entry; move such entries to the front now. Those
+    // of older generations were hit before they were invalidated, and stay at the back.
     Entry* oldest = cache->mru_list.mru_prev;
-    Entry** lookup = _cache_lookup_p(cache, oldest);
+    while (oldest->referenced && oldest->generation == cache->generation) {
+        oldest->referenced = false;
+        entry_mru_remove(oldest);
+        entry_mru_add(oldest, &cache->mru_list);
+        oldest = cache->mru_list.mru_prev;
+    }
+    Entry** lookup = _cache_entry_p(cache, oldest);
 
     if (*lookup == NULL) { /* should not happen */
         LOG(INFO) << __func__ << ": OLDEST NOT IN HTABLE ?";
@@ -1199,112 +2332,877 @@ static void _cache_remove_oldest(Cache* cache) {
     }
     LOG(INFO) << __func__ << ": Cache full - removing oldest";
     res_pquery({oldest->query, oldest->querylen});
-    _cache_remove_p(cache, lookup);
+    _cache_remove_p(cache, lookup, EVICT_CAPACITY);
 }
 
-/* Remove all expired entries from the hash table.
+// Returns the entry that _cache_remove_oldest() would remove, without moving anything, or nullptr
+// if the cache is empty.
+static const Entry* _cache_peek_oldest(const Cache* cache) {
+    if (cache->num_entries == 0) return nullptr;
+
+    if (cache->flat_table_enabled) {
+        const std::vector<FlatSlot>& slots = cache->flat_slots;
+        const size_t mask = slots.size() - 1;
+        const Entry* first = nullptr;
+        for (size_t n = 0, i = cache->clock_hand; n < slots.size(); n++, i = (i + 1) & mask) {
+            const Entry* e = slots[i].entry;
+            if (e == nullptr) continue;
+            if (!e->referenced) return e;
+            if (first == nullptr) first = e;
+        }
+        // The hand clears all the reference bits, and comes back to the first entry.
+        return first;
+    }
+
+    for (const Entry* e = cache->mru_list.mru_prev; e != &cache->mru_list; e = e->mru_prev) {
+        if (!e->referenced || e->generation != cache->generation) return e;
+    }
+    // All of them are moved to the front in turn, which brings the oldest back to the back.
+    return cache->mru_list.mru_prev;
+}
+
+// Removes up to |count| entries of older generations, from the back of the MRU list.
+static void _cache_remove_invalidated(Cache* cache, int count) {
+    while (cache->invalidated_entries > 0 && count-- > 0) {
+        Entry* e = cache->mru_list.mru_prev;
+        if (e->generation == cache->generation) { /* should not happen */
+            LOG(INFO) << __func__ << ": INVALIDATED ENTRY NOT AT THE BACK ?";
+            return;
+        }
+        _cache_remove_p(cache, _cache_entry_p(cache, e), EVICT_INVALIDATED);
+    }
+}
+
+/* Remove all entries from the hash table that expired at least
+ * 'grace' seconds ago, and a batch of those left over by invalidate().
+ * This only visits the entries being removed.
  */
-static void _cache_remove_expired(Cache* cache) {
-    Entry* e;
-    time_t now = _time_now();
-
-    for (e = cache->mru_list.mru_next; e != &cache->mru_list;) {
-        // Entry is old, remove
-        if (now >= e->expires) {
-            Entry** lookup = _cache_lookup_p(cache, e);
-            if (*lookup == NULL) { /* should not happen */
-                LOG(INFO) << __func__ << ": ENTRY NOT IN HTABLE ?";
-                return;
-            }
-            e = e->mru_next;
-            _cache_remove_p(cache, lookup);
-        } else {
-            e = e->mru_next;
+static void _cache_remove_expired(Cache* cache, CacheTime now,
+                                  std::chrono::seconds grace = {}) {
+    while (!cache->expiry_heap.empty() && now - cache->expiry_heap.front()->expires >= grace) {
+        Entry** lookup = _cache_entry_p(cache, cache->expiry_heap.front());
+        if (*lookup == NULL) { /* should not happen */
+            LOG(INFO) << __func__ << ": ENTRY NOT IN HTABLE ?";
+            return;
         }
+        _cache_remove_p(cache, lookup, EVICT_EXPIRED);
     }
+    // Spread over the sweeps that follow, so that none of them holds the lock for long.
+    _cache_remove_invalidated(cache, CACHE_INVALIDATED_REMOVAL_BATCH);
 }
 
-// Get a NetConfig associated with a network, or nullptr if not found.
-static NetConfig* find_netconfig_locked(unsigned netid) REQUIRES(cache_mutex);
+// Whether an entry of |incoming| bytes can only be added to |cache| by evicting another one.
+static bool _cache_is_full(const Cache* cache, size_t max_bytes, int max_entries,
+                           size_t incoming) {
+    return cache->num_entries > 0 &&
+           (cache->num_entries >= max_entries || cache->bytes + incoming > max_bytes ||
+            (sCacheTotalBytes + incoming > CACHE_GLOBAL_MAX_BYTES &&
+             cache->bytes + incoming > cache_global_share()));
+}
 
-ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
-                                      span<uint8_t> answer, int* answerlen, uint32_t flags) {
-    // Skip cache lookup, return RESOLV_CACHE_NOTFOUND directly so that it is
-    // possible to cache the answer of this query.
-    // If ANDROID_RESOLV_NO_CACHE_STORE is set, return RESOLV_CACHE_SKIP to skip possible cache
-    // storing.
-    // (b/150371903): ANDROID_RESOLV_NO_CACHE_STORE should imply ANDROID_RESOLV_NO_CACHE_LOOKUP
-    // to avoid side channel attack.
-    if (flags & (ANDROID_RESOLV_NO_CACHE_LOOKUP | ANDROID_RESOLV_NO_CACHE_STORE)) {
-        return flags & ANDROID_RESOLV_NO_CACHE_STORE ? RESOLV_CACHE_SKIP : RESOLV_CACHE_NOTFOUND;
+// Evicts entries, expired ones first, until the cache holds fewer than |max_entries| entries
+// and |incoming| more bytes fit in |max_bytes|, and in the global ceiling or the share of it
+// that the cache may keep. Returns true if anything was removed, which invalidates the result
+// of previous _cache_lookup_p() calls.
+static bool _cache_make_room(Cache* cache, CacheTime now, size_t max_bytes, int max_entries,
+                             size_t incoming) {
+    const auto full = [&]() { return _cache_is_full(cache, max_bytes, max_entries, incoming); };
+    if (!full()) return false;
+
+    _cache_remove_expired(cache, now);
+    while (full()) {
+        const int count = cache->num_entries;
+        _cache_remove_oldest(cache);
+        if (cache->num_entries == count) break; /* should not happen */
     }
-    Entry key;
-    Entry** lookup;
-    Entry* e;
-    time_t now;
+    return true;
+}
 
-    LOG(INFO) << __func__ << ": lookup";
+// Rebuilds the hash table for the current max_entries. Entries are not reallocated.
+static void _cache_rehash(Cache* cache) {
+    if (cache->flat_table_enabled) {
+        const size_t size = flat_table_size(cache->max_entries);
+        if (size == cache->flat_slots.size()) return;
+        cache->flat_slots.assign(size, {});
+        cache->clock_hand = 0;
+    } else {
+        if (static_cast<size_t>(cache->max_entries) == cache->entries.size()) return;
+        cache->entries = std::vector<Entry>(cache->max_entries);
+    }
 
-    /* we don't cache malformed queries */
-    if (!entry_init_key(&key, query)) {
-        LOG(INFO) << __func__ << ": unsupported query";
-        return RESOLV_CACHE_UNSUPPORTED;
+    for (Entry* e = cache->mru_list.mru_next; e != &cache->mru_list; e = e->mru_next) {
+        Entry** lookup = _cache_entry_p(cache, e);
+        *lookup = e;
+        if (cache->flat_table_enabled) {
+            FlatSlot* slot = reinterpret_cast<FlatSlot*>(lookup);
+            slot->hash = e->hash;
+            slot->querylen = e->querylen;
+        } else {
+            e->hlink = nullptr;
+        }
     }
-    /* lookup cache */
-    std::unique_lock lock(cache_mutex);
-    android::base::ScopedLockAssertion assume_lock(cache_mutex);
-    Cache* cache = find_named_cache_locked(netid);
-    if (cache == nullptr) {
-        return RESOLV_CACHE_UNSUPPORTED;
+}
+
+static void _cache_set_max_bytes(Cache* cache, size_t max_bytes) {
+    cache->max_bytes = std::min(max_bytes, CACHE_GLOBAL_MAX_BYTES);
+    const int max_entries = std::max<size_t>(1, cache->max_bytes / CACHE_BYTES_PER_ENTRY);
+    if (cache->sketch && max_entries != cache->max_entries) cache->sketch->resize(max_entries);
+    cache->max_entries = max_entries;
+    _cache_make_room(cache, _time_now(), cache->max_bytes, cache->max_entries, 0);
+    _cache_rehash(cache);
+}
+
+// Trims the caches of the networks that haven't used them for a while.
+static void resolv_cache_trim_idle();
+// Saves the cache of |netconfig| if it wasn't saved for CACHE_SNAPSHOT_INTERVAL. Called with no
+// lock held.
+static void cache_snapshot_maybe_write(const std::shared_ptr<NetConfig>& netconfig, CacheTime now);
+
+// Whether an answer to |key| taking |incoming| bytes should go into |cache|, which it does unless
+// it would evict an entry whose query was looked up at least as often recently. That keeps names
+// looked up once, such as the random subdomains of a scan, from pushing out the ones looked up
+// all the time. Expired entries may be removed, which invalidates the result of previous
+// _cache_lookup_p() calls.
+static bool cache_admit_locked(Cache* cache, CacheTime now, const Entry* key, size_t incoming) {
+    const auto full = [&]() {
+        return _cache_is_full(cache, cache->max_bytes, cache->max_entries, incoming);
+    };
+    if (!cache->sketch || !full()) return true;
+    _cache_remove_expired(cache, now);
+    if (!full()) return true;
+
+    // Entries of older generations can't be looked up any more.
+    const Entry* victim = _cache_peek_oldest(cache);
+    if (victim == nullptr || victim->generation != cache->generation) return true;
+    return cache->sketch->estimate(key->hash) > cache->sketch->estimate(victim->hash);
+}
+
+// Returns the bit of the partition of |uid| in Entry::partitions, 0 if it has none, or all of
+// them if the cache isn't partitioned. Only reads the cache, so the lock may be shared.
+static uint64_t cache_partition_locked(const Cache* cache, uid_t uid) {
+    if (!cache->partitioned) return CACHE_ALL_PARTITIONS;
+    for (size_t i = 0; i < cache->partitions.size(); i++) {
+        if (cache->partitions[i].uid == uid) return uint64_t{1} << i;
     }
+    return 0;
+}
 
-    /* see the description of _lookup_p to understand this.
-     * the function always return a non-NULL pointer.
-     */
-    lookup = _cache_lookup_p(cache, &key);
-    e = *lookup;
+// Same as cache_partition_locked(), but gives |uid| a partition if it has none. Once all of them
+// are taken, that of the app that added an answer least recently is taken back, with the entries
+// only it could see.
+static uint64_t cache_add_partition_locked(Cache* cache, uid_t uid) {
+    if (!cache->partitioned) return CACHE_ALL_PARTITIONS;
+    std::vector<Cache::Partition>& partitions = cache->partitions;
+    const uint64_t use = ++cache->partition_adds;
+    size_t lru = 0;
+    for (size_t i = 0; i < partitions.size(); i++) {
+        if (partitions[i].uid == uid) {
+            partitions[i].last_used = use;
+            return uint64_t{1} << i;
+        }
+        if (partitions[i].last_used < partitions[lru].last_used) lru = i;
+    }
+    if (partitions.size() < CACHE_MAX_PARTITIONS) {
+        partitions.push_back({uid, use});
+        return uint64_t{1} << (partitions.size() - 1);
+    }
 
-    if (e == NULL) {
-        LOG(INFO) << __func__ << ": NOT IN CACHE";
+    const uint64_t bit = uint64_t{1} << lru;
+    LOG(INFO) << __func__ << ": partition of uid " << partitions[lru].uid << " given to " << uid;
+    for (Entry* e = cache->mru_list.mru_next; e != &cache->mru_list;) {
+        Entry* next = e->mru_next;
+        e->partitions &= ~bit;
+        if (e->partitions == 0) _cache_remove_p(cache, _cache_entry_p(cache, e), EVICT_CAPACITY);
+        e = next;
+    }
+    partitions[lru] = {uid, use};
+    return bit;
+}
+
+// Longest CNAME chain followed when caching or synthesizing an answer from RRsets.
+constexpr int RRSET_MAX_CHAIN = 8;
 
-        if (!cache_has_pending_request_locked(cache, &key, true)) {
-            return RESOLV_CACHE_NOTFOUND;
+static std::string rrset_name(std::string_view name) {
+    std::string lower(name);
+    for (char& c : lower) {
+        if (c >= 'A' && c <= 'Z') c |= 0x20;
+    }
+    if (!lower.empty() && lower.back() == '.') lower.pop_back();
+    return lower;
+}
 
+// Stores |rrset| under |key|, in place of the least recently stored RRset if the cache is full.
+static void cache_put_rrset_locked(Cache* cache, Cache::RRsetKey key, Cache::RRset rrset) {
+    auto it = cache->rrsets.find(key);
+    if (it != cache->rrsets.end()) {
+        rrset.lru = it->second.lru;
+        it->second = std::move(rrset);
+        cache->rrset_lru.splice(cache->rrset_lru.begin(), cache->rrset_lru, it->second.lru);
+        return;
+    }
+    if (cache->rrsets.size() >= static_cast<size_t>(cache->max_entries)) {
+        cache->rrsets.erase(cache->rrsets.find(*cache->rrset_lru.back()));
+        cache->rrset_lru.pop_back();
+    }
+    it = cache->rrsets.emplace(std::move(key), std::move(rrset)).first;
+    cache->rrset_lru.push_front(&it->first);
+    it->second.lru = cache->rrset_lru.begin();
+}
+
+// Caches the A, AAAA and CNAME RRsets of a positive |answer|, each with its own TTL. Only the
+// records on the CNAME chain starting at the question name are kept. Since the RRsets answer
+// queries for other names, the caller only gives answers that came over private DNS, which an
+// off-path attacker can't forge; a chain may then lead to another provider, as CDN chains do.
+static void cache_add_rrsets_locked(Cache* cache, CacheTime now, const DnsMessageIndex& index) {
+    const auto questions = index.section(ns_s_qd);
+    if (index.getFlag(ns_f_rcode) != ns_r_noerror || index.getFlag(ns_f_tc) ||
+        questions.size() != 1 || questions[0].rclass != ns_c_in) {
+        return;
+    }
+    char name[NS_MAXDNAME];
+    if (!index.expandName(questions[0].nameOffset, name, sizeof(name))) return;
+    std::string owner = rrset_name(name);
+
+    std::map<Cache::RRsetKey, Cache::RRset> found;
+    for (const DnsMessageIndex::Record& rr : index.section(ns_s_an)) {
+        const uint16_t type = rr.type;
+        if (rr.rclass != ns_c_in || rr.ttl == 0) continue;
+
+        std::string rdata;
+        if ((type == ns_t_a && rr.rdlen == sizeof(in_addr)) ||
+            (type == ns_t_aaaa && rr.rdlen == sizeof(in6_addr))) {
+            const span<const uint8_t> bytes = index.rdata(rr);
+            rdata.assign(bytes.begin(), bytes.end());
+        } else if (type == ns_t_cname) {
+            if (!index.expandName(rr.rdataOffset, name, sizeof(name))) return;
+            rdata = rrset_name(name);
         } else {
-            LOG(INFO) << __func__ << ": Waiting for previous request";
-            // wait until (1) timeout OR
-            //            (2) cv is notified AND no pending request matching the |key|
-            // (cv notifier should delete pending request before sending notification.)
-            bool ret = cv.wait_for(lock, std::chrono::seconds(PENDING_REQUEST_TIMEOUT),
-                                   [netid, &cache, &key]() REQUIRES(cache_mutex) {
-                                       // Must update cache as it could have been deleted
-                                       cache = find_named_cache_locked(netid);
-                                       return !cache_has_pending_request_locked(cache, &key, false);
-                                   });
-            if (!cache) {
-                return RESOLV_CACHE_NOTFOUND;
-            }
-            if (ret == false) {
-                NetConfig* info = find_netconfig_locked(netid);
-                if (info != NULL) {
-                    info->wait_for_pending_req_timeout_count++;
-                }
+            continue;
+        }
+
+        // The TTL of an RRset is the lowest TTL of its records.
+        if (!index.expandName(rr.nameOffset, name, sizeof(name))) return;
+        auto [it, inserted] = found.try_emplace({rrset_name(name), type});
+        const CacheTime expires = now + std::chrono::seconds(rr.ttl);
+        if (inserted || expires < it->second.expires) it->second.expires = expires;
+        it->second.rdata.push_back(std::move(rdata));
+    }
+
+    for (int hops = 0; hops <= RRSET_MAX_CHAIN; hops++) {
+        std::string next;
+        for (const uint16_t type : {ns_t_a, ns_t_aaaa, ns_t_cname}) {
+            auto node = found.extract({owner, type});
+            if (node.empty()) continue;
+            if (type == ns_t_cname) {
+                // An owner name has at most one CNAME.
+                if (node.mapped().rdata.size() != 1) break;
+                next = node.mapped().rdata[0];
             }
-            lookup = _cache_lookup_p(cache, &key);
-            e = *lookup;
-            if (e == NULL) {
-                return RESOLV_CACHE_NOTFOUND;
+            cache_put_rrset_locked(cache, std::move(node.key()), std::move(node.mapped()));
+        }
+        if (next.empty()) break;
+        owner = std::move(next);
+    }
+}
+
+static uint8_t* rrset_put16(uint8_t* p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+// Starts a response synthesized from the cache by copying the header and question of |query| to
+// |answer|, with QR and RA set, AA and TC cleared, the given RCODE and empty sections. Opcode and
+// RD are the query's. Returns the length written, or 0 if |answer| is too short.
+static size_t answer_start_from_query(span<const uint8_t> query, span<uint8_t> answer, int rcode) {
+    const int qnamelen = dn_skipname(query.data() + DNS_HEADER_SIZE, query.data() + query.size());
+    if (qnamelen < 0) return 0;
+    const size_t questionlen = DNS_HEADER_SIZE + qnamelen + 2 * NS_INT16SZ;
+    if (questionlen > query.size() || questionlen > answer.size()) return 0;
+    memcpy(answer.data(), query.data(), questionlen);
+
+    uint8_t* const base = answer.data();
+    base[2] = (base[2] & 0x79) | 0x80;
+    base[3] = 0x80 | (rcode & 0x0f);
+    rrset_put16(base + 4, 1);   // QDCOUNT
+    rrset_put16(base + 6, 0);   // ANCOUNT
+    rrset_put16(base + 8, 0);   // NSCOUNT
+    rrset_put16(base + 10, 0);  // ARCOUNT
+    return questionlen;
+}
+
+// Answers an A or AAAA |query| from the cached RRsets, following cached CNAMEs from the question
+// name until an RRset of the queried type is found. The answer has the ID and question of the
+// query, and each record carries the remaining TTL of its RRset. Returns false if the chain
+// isn't fully cached or the answer doesn't fit.
+static bool cache_lookup_rrsets_locked(Cache* cache, CacheTime now, span<const uint8_t> query,
+                                       span<uint8_t> answer, int* answerlen) {
+    DnsMessageIndex index;
+    char name[NS_MAXDNAME];
+    if (!index.parse(query) || index.section(ns_s_qd).size() != 1) return false;
+    const DnsMessageIndex::Record& question = index.section(ns_s_qd)[0];
+    const uint16_t qtype = question.type;
+    if (question.rclass != ns_c_in || (qtype != ns_t_a && qtype != ns_t_aaaa)) return false;
+    if (!index.expandName(question.nameOffset, name, sizeof(name))) return false;
+
+    std::vector<std::pair<const std::string*, const Cache::RRset*>> chain;
+    const std::string qname = rrset_name(name);
+    const std::string* owner = &qname;
+    for (int hops = 0;; hops++) {
+        if (hops > RRSET_MAX_CHAIN) return false;
+        auto it = cache->rrsets.find({*owner, qtype});
+        if (it != cache->rrsets.end() && now < it->second.expires) {
+            chain.emplace_back(&it->first.first, &it->second);
+            break;
+        }
+        it = cache->rrsets.find({*owner, ns_t_cname});
+        if (it == cache->rrsets.end() || now >= it->second.expires) return false;
+        chain.emplace_back(&it->first.first, &it->second);
+        owner = &it->second.rdata[0];
+    }
+
+    // The question name is what the answer records are compressed against.
+    const size_t questionlen = answer_start_from_query(query, answer, ns_r_noerror);
+    if (questionlen == 0) return false;
+
+    uint8_t* const base = answer.data();
+    uint8_t* const end = base + answer.size();
+    DnsNameCompressor compressor(answer);
+    if (!compressor.addName(DNS_HEADER_SIZE)) return false;
+    uint8_t* p = base + questionlen;
+    int ancount = 0;
+
+    for (const auto& [name, rrset] : chain) {
+        const uint16_t type = (rrset == chain.back().second) ? qtype : ns_t_cname;
+        const uint32_t ttl = htonl(_ttl_left(rrset->expires, now));
+        for (const std::string& rdata : rrset->rdata) {
+            int n = compressor.compress(name->c_str(), p - base);
+            if (n < 0 || end - (p + n) < 3 * NS_INT16SZ + NS_INT32SZ) return false;
+            p = rrset_put16(p + n, type);
+            p = rrset_put16(p, ns_c_in);
+            memcpy(p, &ttl, sizeof(ttl));
+            p += sizeof(ttl);
+            uint8_t* const rdlen = p;
+            p += NS_INT16SZ;
+            if (type == ns_t_cname) {
+                n = compressor.compress(rdata.c_str(), p - base);
+                if (n < 0) return false;
+            } else {
+                n = rdata.size();
+                if (end - p < n) return false;
+                memcpy(p, rdata.data(), n);
             }
+            rrset_put16(rdlen, n);
+            p += n;
+            ancount++;
+        }
+    }
+
+    rrset_put16(base + 6, ancount);  // ANCOUNT
+    *answerlen = p - base;
+    return true;
+}
+
+// Keeps the ipv4hint and ipv6hint of the ServiceMode records of a positive answer to an HTTPS
+// query, if they are for the question name itself. A newer answer without hints drops those
+// kept for the name.
+static void cache_add_https_hints_locked(Cache* cache, CacheTime now,
+                                         const DnsMessageIndex& index) {
+    const auto questions = index.section(ns_s_qd);
+    if (index.getFlag(ns_f_rcode) != ns_r_noerror || index.getFlag(ns_f_tc) ||
+        questions.size() != 1 || questions[0].rclass != ns_c_in ||
+        questions[0].type != kDnsTypeHttps) {
+        return;
+    }
+    char name[NS_MAXDNAME];
+    if (!index.expandName(questions[0].nameOffset, name, sizeof(name))) return;
+    std::string owner = rrset_name(name);
+
+    Cache::HttpsHints hints;
+    uint32_t ttl = UINT32_MAX;
+    for (const DnsMessageIndex::Record& rr : index.section(ns_s_an)) {
+        if (rr.type != kDnsTypeHttps || rr.rclass != ns_c_in || rr.ttl == 0) continue;
+        if (!index.expandName(rr.nameOffset, name, sizeof(name)) || rrset_name(name) != owner) {
+            continue;
+        }
+        const std::optional<SvcbRecord> record = SvcbRecord::parse(index, rr);
+        if (!record || record->isAlias() || !record->targetIsOwner()) continue;
+        hints.ipv4.insert(hints.ipv4.end(), record->ipv4Hints.begin(), record->ipv4Hints.end());
+        hints.ipv6.insert(hints.ipv6.end(), record->ipv6Hints.begin(), record->ipv6Hints.end());
+        ttl = std::min(ttl, rr.ttl);
+    }
+    if (hints.ipv4.empty() && hints.ipv6.empty()) {
+        cache->https_hints.erase(owner);
+        return;
+    }
+    hints.expires = now + std::chrono::seconds(ttl);
+
+    if (cache->https_hints.size() >= static_cast<size_t>(cache->max_entries) &&
+        !cache->https_hints.contains(owner)) {
+        auto& all = cache->https_hints;
+        std::erase_if(all, [now](const auto& it) { return now >= it.second.expires; });
+        if (all.size() >= static_cast<size_t>(cache->max_entries)) {
+            all.erase(std::min_element(all.begin(), all.end(), [](const auto& a, const auto& b) {
+                return a.second.expires < b.second.expires;
+            }));
+        }
+    }
+    cache->https_hints.insert_or_assign(std::move(owner), std::move(hints));
+}
+
+// Answers an A or AAAA |query| with the hints of the HTTPS records cached for its name. Hints
+// may be stale (RFC 9460 section 7.3), so |refresh| is set to have the caller fetch the address
+// records, once per PENDING_REQUEST_TIMEOUT while they're missing. Returns false if there are no
+// hints for the queried family or the answer doesn't fit.
+static bool cache_lookup_https_hints_locked(Cache* cache, CacheTime now, span<const uint8_t> query,
+                                            span<uint8_t> answer, int* answerlen, bool* refresh) {
+    DnsMessageIndex index;
+    char name[NS_MAXDNAME];
+    if (!index.parse(query) || index.section(ns_s_qd).size() != 1) return false;
+    const DnsMessageIndex::Record& question = index.section(ns_s_qd)[0];
+    const uint16_t qtype = question.type;
+    if (question.rclass != ns_c_in || (qtype != ns_t_a && qtype != ns_t_aaaa)) return false;
+    if (!index.expandName(question.nameOffset, name, sizeof(name))) return false;
+
+    const auto it = cache->https_hints.find(rrset_name(name));
+    if (it == cache->https_hints.end() || now >= it->second.expires) return false;
+    Cache::HttpsHints& hints = it->second;
+    const std::vector<std::string>& addresses = (qtype == ns_t_a) ? hints.ipv4 : hints.ipv6;
+    if (addresses.empty()) return false;
+
+    const size_t questionlen = answer_start_from_query(query, answer, ns_r_noerror);
+    if (questionlen == 0) return false;
+    uint8_t* const base = answer.data();
+    uint8_t* const end = base + answer.size();
+    uint8_t* p = base + questionlen;
+    const uint32_t ttl = htonl(std::min(_ttl_left(hints.expires, now), HTTPS_HINT_TTL));
+    for (const std::string& address : addresses) {
+        if (static_cast<size_t>(end - p) < 4 * NS_INT16SZ + NS_INT32SZ + address.size()) {
+            return false;
+        }
+        // Every record is owned by the question name.
+        p = rrset_put16(p, 0xc000 | DNS_HEADER_SIZE);
+        p = rrset_put16(p, qtype);
+        p = rrset_put16(p, ns_c_in);
+        memcpy(p, &ttl, sizeof(ttl));
+        p += sizeof(ttl);
+        p = rrset_put16(p, address.size());
+        memcpy(p, address.data(), address.size());
+        p += address.size();
+    }
+    rrset_put16(base + 6, addresses.size());  // ANCOUNT
+    *answerlen = p - base;
+
+    CacheTime& refresh_time = hints.refresh_time[qtype == ns_t_a ? 0 : 1];
+    *refresh = now - refresh_time >= std::chrono::seconds(PENDING_REQUEST_TIMEOUT);
+    if (*refresh) refresh_time = now;
+    return true;
+}
+
+// Most SHA-1 iterations of an NSEC3 chain that is cached. RFC 9276 recommends treating zones
+// using more as insecure.
+constexpr uint16_t NSEC3_MAX_ITERATIONS = 100;
+constexpr uint8_t NSEC3_FLAG_OPT_OUT = 0x01;
+constexpr uint8_t NSEC3_HASH_SHA1 = 1;
+
+// Names handled by aggressive negative caching are lowercase, without the trailing dot, and
+// without escapes so that labels can be split at dots.
+
+// Whether |name| is |zone| or below it.
+static bool nsec_is_subdomain(const std::string& name, const std::string& zone) {
+    if (zone.empty()) return true;
+    if (!name.ends_with(zone)) return false;
+    return name.size() == zone.size() || name[name.size() - zone.size() - 1] == '.';
+}
+
+static std::string nsec_parent(const std::string& name) {
+    const size_t dot = name.find('.');
+    return dot == std::string::npos ? "" : name.substr(dot + 1);
+}
+
+// Sort key of a name in canonical DNS order (RFC 4034 section 6.1): its labels from the root
+// down, each followed by a NUL, which sorts a label before any longer label it prefixes.
+static std::string nsec_canonical_key(const std::string& name) {
+    std::string key;
+    size_t end = name.size();
+    while (end > 0) {
+        const size_t dot = name.rfind('.', end - 1);
+        const size_t begin = (dot == std::string::npos) ? 0 : dot + 1;
+        key.append(name, begin, end - begin).push_back('\0');
+        end = (dot == std::string::npos) ? 0 : dot;
+    }
+    return key;
+}
+
+// Whether |type| is set in the type bitmap of an NSEC or NSEC3 record (RFC 4034 section 4.1.2).
+static bool nsec_has_type(const uint8_t* p, const uint8_t* end, uint16_t type) {
+    while (end - p >= 2) {
+        const uint8_t window = p[0];
+        const uint8_t len = p[1];
+        p += 2;
+        if (len == 0 || len > 32 || end - p < len) return false;
+        if (window == type >> 8) {
+            const uint8_t bit = type & 0xff;
+            return bit / 8 < len && (p[bit / 8] & (0x80 >> (bit % 8)));
         }
+        p += len;
+    }
+    return false;
+}
+
+// Whether the owner of an NSEC or NSEC3 record is a zone cut or a DNAME, below which the record
+// proves nothing (RFC 4035 section 5.4, RFC 5155 section 8.3).
+static bool nsec_is_cut(const uint8_t* bitmap, const uint8_t* end) {
+    return (nsec_has_type(bitmap, end, ns_t_ns) && !nsec_has_type(bitmap, end, ns_t_soa)) ||
+           nsec_has_type(bitmap, end, ns_t_dname);
+}
+
+// Whether |key| falls strictly between |owner| and |next|. The last range of a chain wraps
+// around to the start.
+static bool nsec_range_covers(const std::string& owner, const std::string& next,
+                              const std::string& key) {
+    if (owner < next) return owner < key && key < next;
+    return owner < key || key < next;
+}
+
+// NSEC3 hash of |name| (RFC 5155 section 5), or an empty string if it isn't a valid name.
+static std::string nsec3_hash(const std::string& name, const std::string& salt,
+                              uint16_t iterations) {
+    std::string buf;
+    for (size_t begin = 0; begin < name.size();) {
+        const size_t dot = std::min(name.find('.', begin), name.size());
+        if (dot == begin || dot - begin > 63) return "";
+        buf.push_back(dot - begin);
+        buf.append(name, begin, dot - begin);
+        begin = dot + 1;
+    }
+    buf.push_back('\0');
+
+    uint8_t md[SHA_DIGEST_LENGTH];
+    for (int i = 0; i <= iterations; i++) {
+        buf += salt;
+        SHA1(reinterpret_cast<const uint8_t*>(buf.data()), buf.size(), md);
+        buf.assign(reinterpret_cast<const char*>(md), sizeof(md));
+    }
+    return buf;
+}
+
+// Decodes the Base32hex owner label of an NSEC3 record into the raw hash.
+static std::string nsec3_decode_label(std::string_view label) {
+    std::string out;
+    uint32_t bits = 0;
+    int nbits = 0;
+    for (const char c : label) {
+        int v;
+        if (c >= '0' && c <= '9') {
+            v = c - '0';
+        } else if (c >= 'a' && c <= 'v') {
+            v = c - 'a' + 10;
+        } else {
+            return "";
+        }
+        bits = (bits << 5) | v;
+        nbits += 5;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out.push_back(static_cast<char>(bits >> nbits));
+        }
+    }
+    return out;
+}
+
+// Keeps the NSEC and NSEC3 records cached under the entry limit. Expired ones are dropped
+// first; if that isn't enough, they are all dropped, as they're only an optimization.
+static void cache_trim_nsec_locked(Cache* cache, CacheTime now) {
+    if (cache->nsec_count < static_cast<size_t>(cache->max_entries)) return;
+    const auto expired = [now](const auto& it) { return now >= it.second.expires; };
+    cache->nsec_count -= std::erase_if(cache->nsec_ranges, expired);
+    for (auto& [_, zone] : cache->nsec3_zones) {
+        cache->nsec_count -= std::erase_if(zone.ranges, expired);
+    }
+    std::erase_if(cache->nsec3_zones, [](const auto& it) { return it.second.ranges.empty(); });
+    if (cache->nsec_count >= static_cast<size_t>(cache->max_entries)) {
+        cache->nsec_ranges.clear();
+        cache->nsec3_zones.clear();
+        cache->nsec_count = 0;
+    }
+}
+
+// Keeps the NSEC and NSEC3 records of an NXDOMAIN |answer| that the upstream resolver validated,
+// as indicated by the AD bit. Callers only pass answers from validated private DNS servers, since
+// nothing protects the AD bit of a cleartext answer. Their TTL is capped by the negative TTL of
+// the answer (RFC 8198 section 5.4).
+static void cache_add_nsec_locked(Cache* cache, CacheTime now, const DnsMessageIndex& index) {
+    if (index.getFlag(ns_f_rcode) != ns_r_nxdomain || !index.getFlag(ns_f_ad)) return;
+    const uint32_t negative_ttl = index.negativeTtl();
+    if (negative_ttl == 0) return;
+
+    for (const DnsMessageIndex::Record& rr : index.section(ns_s_ns)) {
+        const uint16_t type = rr.type;
+        if (rr.rclass != ns_c_in || (type != ns_t_nsec && type != ns_t_nsec3)) continue;
+        char name[NS_MAXDNAME];
+        if (!index.expandName(rr.nameOffset, name, sizeof(name))) return;
+        const std::string owner = rrset_name(name);
+        if (owner.find('\\') != std::string::npos) continue;
+        const CacheTime expires = now + std::chrono::seconds(std::min(rr.ttl, negative_ttl));
+        const span<const uint8_t> rdata = index.rdata(rr);
+        const uint8_t* p = rdata.data();
+        const uint8_t* const end = p + rdata.size();
+
+        cache_trim_nsec_locked(cache, now);
+        if (type == ns_t_nsec) {
+            char buf[NS_MAXDNAME];
+            std::string_view next;
+            const int len = dn_expand(index.message(), p, buf, &next);
+            if (len < 0 || len > end - p) continue;
+            Cache::NsecRange range = {.owner = owner,
+                                      .next = rrset_name(next),
+                                      .expires = expires,
+                                      .cut = nsec_is_cut(p + len, end)};
+            if (range.next.find('\\') != std::string::npos) continue;
+            const auto [it, inserted] =
+                    cache->nsec_ranges.insert_or_assign(nsec_canonical_key(owner), range);
+            if (inserted) cache->nsec_count++;
+            continue;
+        }
+
+        // NSEC3 RDATA: hash algorithm, flags, iterations, salt length, salt, hash length, next
+        // hashed owner name, type bitmap.
+        if (end - p < 5 || p[0] != NSEC3_HASH_SHA1) continue;
+        const uint8_t flags = p[1];
+        const uint16_t iterations = (p[2] << 8) | p[3];
+        const uint8_t saltlen = p[4];
+        p += 5;
+        if (iterations > NSEC3_MAX_ITERATIONS || end - p < saltlen + 1) continue;
+        const std::string salt(reinterpret_cast<const char*>(p), saltlen);
+        p += saltlen;
+        const uint8_t hashlen = *p++;
+        if (hashlen != SHA_DIGEST_LENGTH || end - p < hashlen) continue;
+        Cache::Nsec3Range range = {.next = std::string(reinterpret_cast<const char*>(p), hashlen),
+                                   .expires = expires,
+                                   .opt_out = (flags & NSEC3_FLAG_OPT_OUT) != 0,
+                                   .cut = nsec_is_cut(p + hashlen, end)};
+        const std::string hash = nsec3_decode_label(owner.substr(0, owner.find('.')));
+        if (hash.size() != SHA_DIGEST_LENGTH) continue;
+
+        // A zone whose parameters changed has been re-signed; its old chain is useless.
+        Cache::Nsec3Zone& zone = cache->nsec3_zones[nsec_parent(owner)];
+        if (zone.iterations != iterations || zone.salt != salt) {
+            cache->nsec_count -= zone.ranges.size();
+            zone.ranges.clear();
+            zone.iterations = iterations;
+            zone.salt = salt;
+        }
+        const auto [it, inserted] = zone.ranges.insert_or_assign(hash, std::move(range));
+        if (inserted) cache->nsec_count++;
+    }
+}
+
+// Returns the unexpired NSEC range covering |name|, or nullptr if there is none or |name|
+// is known to exist.
+static const Cache::NsecRange* nsec_find_covering(const Cache* cache, const std::string& name,
+                                                  CacheTime now) {
+    const std::string key = nsec_canonical_key(name);
+    auto it = cache->nsec_ranges.upper_bound(key);
+    if (it == cache->nsec_ranges.begin()) return nullptr;
+    --it;
+    const Cache::NsecRange& range = it->second;
+    if (now >= range.expires || it->first == key) return nullptr;
+    // The last range of a zone wraps around to the apex, and only covers names in the zone.
+    const std::string next_key = nsec_canonical_key(range.next);
+    if (it->first < next_key ? key >= next_key : !nsec_is_subdomain(name, range.next)) {
+        return nullptr;
+    }
+    if (range.cut && nsec_is_subdomain(name, range.owner)) return nullptr;
+    return &range;
+}
+
+// Whether cached NSEC records prove that |qname| doesn't exist: one covering it, and one covering
+// the wildcard at its closest encloser (RFC 4035 section 5.4).
+static bool nsec_proves_nxdomain(const Cache* cache, const std::string& qname, CacheTime now) {
+    const Cache::NsecRange* range = nsec_find_covering(cache, qname, now);
+    if (range == nullptr) return false;
+    const auto common_ancestor = [&qname](std::string name) {
+        while (!nsec_is_subdomain(qname, name)) name = nsec_parent(name);
+        return name;
+    };
+    std::string encloser = common_ancestor(range->owner);
+    if (std::string other = common_ancestor(range->next); other.size() > encloser.size()) {
+        encloser = std::move(other);
+    }
+    return nsec_find_covering(cache, encloser.empty() ? "*" : "*." + encloser, now) != nullptr;
+}
+
+// Whether cached NSEC3 records prove that |qname| doesn't exist: a closest encloser proof, and
+// one covering the wildcard at the closest encloser (RFC 5155 section 8.4). Ranges with the
+// Opt-Out flag can't prove anything.
+static bool nsec3_proves_nxdomain(const Cache* cache, const std::string& qname, CacheTime now) {
+    std::string zone_name = qname;
+    auto zone_it = cache->nsec3_zones.find(zone_name);
+    while (zone_it == cache->nsec3_zones.end()) {
+        if (zone_name.empty()) return false;
+        zone_name = nsec_parent(zone_name);
+        zone_it = cache->nsec3_zones.find(zone_name);
+    }
+    const Cache::Nsec3Zone& zone = zone_it->second;
+    const auto hash = [&zone](const std::string& name) {
+        return nsec3_hash(name, zone.salt, zone.iterations);
+    };
+    const auto matches = [&zone, now](const std::string& h) {
+        const auto it = zone.ranges.find(h);
+        return it != zone.ranges.end() && now < it->second.expires ? &it->second : nullptr;
+    };
+    const auto covered = [&zone, now](const std::string& h) {
+        if (h.empty() || zone.ranges.empty()) return false;
+        auto it = zone.ranges.upper_bound(h);
+        it = (it == zone.ranges.begin()) ? std::prev(zone.ranges.end()) : std::prev(it);
+        return now < it->second.expires && !it->second.opt_out && it->first != h &&
+               nsec_range_covers(it->first, it->second.next, h);
+    };
+
+    // Walk up from |qname| to the closest encloser, the deepest ancestor known to exist.
+    std::string encloser = qname;
+    std::string next_closer;
+    const Cache::Nsec3Range* encloser_range;
+    while ((encloser_range = matches(hash(encloser))) == nullptr) {
+        if (encloser == zone_name) return false;
+        next_closer = encloser;
+        encloser = nsec_parent(encloser);
+    }
+    if (next_closer.empty() || encloser_range->cut) return false;
+    return covered(hash(next_closer)) && covered(hash(encloser.empty() ? "*" : "*." + encloser));
+}
+
+// Answers |query| with NXDOMAIN if the cached NSEC or NSEC3 records prove that its name doesn't
+// exist (RFC 8198). Returns false otherwise.
+static bool cache_lookup_nsec_locked(const Cache* cache, CacheTime now, span<const uint8_t> query,
+                                     span<uint8_t> answer, int* answerlen) {
+    DnsMessageIndex index;
+    char name[NS_MAXDNAME];
+    if (!index.parse(query) || index.section(ns_s_qd).size() != 1) return false;
+    const DnsMessageIndex::Record& question = index.section(ns_s_qd)[0];
+    if (question.rclass != ns_c_in ||
+        !index.expandName(question.nameOffset, name, sizeof(name))) {
+        return false;
+    }
+    const std::string qname = rrset_name(name);
+    if (qname.find('\\') != std::string::npos) return false;
+
+    if (!nsec_proves_nxdomain(cache, qname, now) && !nsec3_proves_nxdomain(cache, qname, now)) {
+        return false;
+    }
+    const size_t len = answer_start_from_query(query, answer, ns_r_nxdomain);
+    if (len == 0) return false;
+    *answerlen = len;
+    return true;
+}
+
+// Counts a lookup of |key| towards the queries looked up most often. The header isn't part of
+// what is counted, so that queries differing only in their ID or flags are counted together.
+static void cache_record_query(Cache* cache, const Entry* key) {
+    const std::string_view question = entry_question(key);
+    if (question.empty()) return;
+    cache->top_queries.record(std::hash<std::string_view>{}(question), question);
+}
+
+// The fast path of resolv_cache_lookup(), taking |netconfig|'s lock in shared mode so that hits
+// on the same network don't serialize. It only handles fresh hits that need no refresh, and
+// returns std::nullopt for everything else, to be retried with the lock held exclusively. Since
+// the MRU list can't be modified here, a hit only sets the reference bit of its entry.
+//
+// A |peek| gives up rather than wait for the lock, and only counts the query if it hits: the
+// lookup that follows a miss counts it.
+static std::optional<ResolvCacheStatus> cache_lookup_shared(NetConfig* netconfig, CacheTime now,
+                                                            Entry* key, span<uint8_t> answer,
+                                                            int* answerlen, uid_t uid,
+                                                            bool peek = false) {
+    std::shared_lock guard(netconfig->lock, std::defer_lock);
+    if (!peek) {
+        guard.lock();
+    } else if (!guard.try_lock()) {
+        return std::nullopt;
+    }
+    Cache* cache = netconfig->cache.get();
+    const auto record = [cache, key] {
+        if (cache->sketch) cache->sketch->record(key->hash);
+        cache_record_query(cache, key);
+    };
+    if (!peek) record();
+    // Avoid writing to the shared cache line on every hit; idleness is measured in minutes.
+    if (now - cache->last_used.load(std::memory_order_relaxed) >= std::chrono::seconds(1)) {
+        cache->last_used.store(now, std::memory_order_relaxed);
+    }
+
+    key->partitions = cache_partition_locked(cache, uid);
+    Entry* e = *_cache_lookup_p(cache, key);
+    if (e == nullptr || now >= e->expires || !(e->partitions & key->partitions)) {
+        return std::nullopt;
+    }
+
+    const bool prefetch =
+            e->hits.load(std::memory_order_relaxed) + 1 >= PREFETCH_MIN_HITS &&
+            (e->expires - now) * PREFETCH_TTL_FRACTION <= std::chrono::seconds(e->ttl) &&
+            now - e->refresh_time >= std::chrono::seconds(PENDING_REQUEST_TIMEOUT) &&
+            Experiments::getInstance()->getFlag("cache_prefetch", 0) == 1;
+    if (prefetch) return std::nullopt;
+
+    *answerlen = e->answerlen;
+    if (e->answerlen > answer.size()) {
+        /* NOTE: we return UNSUPPORTED if the answer buffer is too short */
+        LOG(INFO) << __func__ << ": ANSWER TOO LONG";
+        return RESOLV_CACHE_UNSUPPORTED;
+    }
+    entry_copy_answer(e, answer.data());
+
+    if (!e->referenced.load(std::memory_order_relaxed)) {
+        e->referenced.store(true, std::memory_order_relaxed);
+    }
+    e->hits.fetch_add(1, std::memory_order_relaxed);
+    if (peek) record();
+
+    LOG(INFO) << __func__ << ": FOUND IN CACHE entry=" << e;
+    return RESOLV_CACHE_FOUND;
+}
+
+// An answer copied out of the cache of another network in the same cache domain.
+struct PeerAnswer {
+    std::vector<uint8_t> answer;
+    CacheTime expires;
+    int ttl;
+};
+
+// Look up |key| in the caches of the other networks in the cache domain of |netid|. The
+// caller must not hold any NetConfig lock: the peers' locks are taken one at a time, so that
+// two networks looking up each other's caches can't deadlock.
+static std::optional<PeerAnswer> cache_lookup_peers(unsigned netid, CacheTime now, Entry* key) {
+    for (const auto& peer : find_cache_domain_peers(netid)) {
+        std::shared_lock guard(peer->lock);
+        if (peer->deleted || peer->cache->partitioned) continue;
+        const Entry* e = *_cache_lookup_p(peer->cache.get(), key);
+        if (e == nullptr || now >= e->expires) continue;
+        LOG(INFO) << __func__ << ": FOUND IN CACHE OF NETWORK " << peer->netid;
+        std::vector<uint8_t> answer(e->answerlen);
+        entry_copy_answer(e, answer.data());
+        return PeerAnswer{std::move(answer), e->expires, e->ttl};
     }
+    return std::nullopt;
+}
 
-    now = _time_now();
+// Answers |key| from its entry at |lookup|, which the caller found. Returns RESOLV_CACHE_NOTFOUND
+// if the entry has been expired for too long to be served, which also removes it.
+static ResolvCacheStatus cache_answer_locked(NetConfig* netconfig, CacheTime now, Entry** lookup,
+                                             span<uint8_t> answer, int* answerlen)
+        REQUIRES(netconfig->lock) {
+    Cache* cache = netconfig->cache.get();
+    Entry* e = *lookup;
 
-    /* remove stale entries here */
-    if (now >= e->expires) {
+    /* remove stale entries here, unless they can still be served */
+    const bool stale = now >= e->expires;
+    if (stale) cache->expired_count++;
+    if (stale && now - e->expires >= std::chrono::seconds(netconfig->serve_stale_sec)) {
         LOG(INFO) << __func__ << ": NOT IN CACHE (STALE ENTRY " << *lookup << "DISCARDED)";
         res_pquery({e->query, e->querylen});
-        _cache_remove_p(cache, lookup);
+        _cache_remove_p(cache, lookup, EVICT_EXPIRED);
         return RESOLV_CACHE_NOTFOUND;
     }
 
@@ -1315,42 +3213,376 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
         return RESOLV_CACHE_UNSUPPORTED;
     }
 
-    memcpy(answer.data(), e->answer, e->answerlen);
+    entry_copy_answer(e, answer.data());
+    if (stale) {
+        answer_clampTTL(answer.first(e->answerlen), STALE_ANSWER_TTL);
+    }
 
-    /* bump up this entry to the top of the MRU list */
-    if (e != cache->mru_list.mru_next) {
+    if (cache->flat_table_enabled) {
+        // A hit only sets the reference bit; CLOCK eviction takes care of the rest.
+        e->referenced = true;
+    } else if (e != cache->mru_list.mru_next) {
+        /* bump up this entry to the top of the MRU list */
         entry_mru_remove(e);
         entry_mru_add(e, &cache->mru_list);
     }
 
+    e->hits++;
+    const bool prefetch =
+            !stale && e->hits >= PREFETCH_MIN_HITS &&
+            (e->expires - now) * PREFETCH_TTL_FRACTION <= std::chrono::seconds(e->ttl) &&
+            Experiments::getInstance()->getFlag("cache_prefetch", 0) == 1;
+
+    // Only one caller at a time is asked to refresh an entry. If its refresh fails, the entry
+    // is handed out again once that query would have timed out.
+    if ((stale || prefetch) &&
+        now - e->refresh_time >= std::chrono::seconds(PENDING_REQUEST_TIMEOUT)) {
+        e->refresh_time = now;
+        if (stale) {
+            LOG(INFO) << __func__ << ": FOUND STALE IN CACHE entry=" << e;
+            return RESOLV_CACHE_STALE;
+        }
+        LOG(INFO) << __func__ << ": FOUND IN CACHE, PREFETCHING entry=" << e;
+        netconfig->prefetch_count++;
+        return RESOLV_CACHE_PREFETCH;
+    }
+
     LOG(INFO) << __func__ << ": FOUND IN CACHE entry=" << e;
     return RESOLV_CACHE_FOUND;
 }
 
-int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8_t> answer) {
-    Entry key[1];
-    Entry* e;
-    Entry** lookup;
-    uint32_t ttl;
-    Cache* cache = NULL;
+// Answers |key| from the cache of |netconfig|, its RRset and NSEC caches, or the caches of its
+// peers, which may unlock |lock| for a while. Returns std::nullopt if none of them has it, and
+// leaves the pending requests to the caller. |key| must be in the partition looking.
+static std::optional<ResolvCacheStatus> cache_probe_locked(
+        NetConfig* netconfig, std::unique_lock<std::shared_mutex>& lock, CacheTime now, Entry* key,
+        span<const uint8_t> query, span<uint8_t> answer, int* answerlen)
+        REQUIRES(netconfig->lock) {
+    Cache* cache = netconfig->cache.get();
 
-    /* don't assume that the query has already been cached
+    /* see the description of _lookup_p to understand this.
+     * the function always return a non-NULL pointer.
      */
-    if (!entry_init_key(key, query)) {
-        LOG(INFO) << __func__ << ": passed invalid query?";
-        return -EINVAL;
+    Entry** lookup = _cache_lookup_p(cache, key);
+    Entry* e = *lookup;
+
+    // An entry another app added is missed, for the caller to add its own answer to it.
+    if (cache->partitioned && (e == NULL || !(e->partitions & key->partitions))) {
+        return std::nullopt;
+    }
+
+    if (e == NULL) {
+        if (cache->rrset_enabled &&
+            cache_lookup_rrsets_locked(cache, now, query, answer, answerlen)) {
+            LOG(INFO) << __func__ << ": FOUND IN CACHED RRSETS";
+            return RESOLV_CACHE_FOUND;
+        }
+        if (cache->aggressive_nsec_enabled &&
+            cache_lookup_nsec_locked(cache, now, query, answer, answerlen)) {
+            LOG(INFO) << __func__ << ": NXDOMAIN PROVEN BY CACHED NSEC";
+            return RESOLV_CACHE_FOUND;
+        }
+        if (netconfig->in_cache_domain) {
+            // Our lock can't be held while looking at the peers, so the cache may have changed
+            // by the time the answer is copied in. Add it only if it is still missing.
+            lock.unlock();
+            auto peer = cache_lookup_peers(netconfig->netid, now, key);
+            lock.lock();
+            if (netconfig->deleted) return RESOLV_CACHE_NOTFOUND;
+            lookup = _cache_lookup_p(cache, key);
+            e = *lookup;
+            if (e == NULL && peer) {
+                answer_clampTTL(peer->answer, _ttl_left(peer->expires, now));
+                if (_cache_make_room(cache, now, cache->max_bytes, cache->max_entries,
+                                     sizeof(Entry) + key->querylen + peer->answer.size())) {
+                    lookup = _cache_lookup_p(cache, key);
+                }
+                e = entry_alloc(&cache->arena, key, peer->answer, cache->intern_answers);
+                if (e == NULL) return RESOLV_CACHE_NOTFOUND;
+                e->expires = peer->expires;
+                e->ttl = peer->ttl;
+                _cache_add_p(cache, lookup, e);
+                netconfig->shared_hit_count++;
+            }
+        }
     }
 
-    std::lock_guard guard(cache_mutex);
+    if (e == NULL) {
+        // Answers made up of hints are the last resort, since they're only a guess.
+        bool refresh = false;
+        if (cache->https_hints_enabled &&
+            cache_lookup_https_hints_locked(cache, now, query, answer, answerlen, &refresh)) {
+            if (!refresh) {
+                LOG(INFO) << __func__ << ": ANSWERED BY CACHED HTTPS HINTS";
+                return RESOLV_CACHE_FOUND;
+            }
+            LOG(INFO) << __func__ << ": ANSWERED BY CACHED HTTPS HINTS, PREFETCHING";
+            netconfig->prefetch_count++;
+            return RESOLV_CACHE_PREFETCH;
+        }
+        return std::nullopt;
+    }
+    return cache_answer_locked(netconfig, now, lookup, answer, answerlen);
+}
 
-    cache = find_named_cache_locked(netid);
-    if (cache == nullptr) {
-        return -ENONET;
+// How long a pending request of |netconfig| may take before its waiters deem it slow: a few
+// times as long as they usually take, but never longer than the first timeout of a query, after
+// which the query is likely stuck on a server that doesn't answer.
+static std::chrono::milliseconds cache_pending_patience_locked(const NetConfig* netconfig)
+        REQUIRES_SHARED(netconfig->lock) {
+    const std::chrono::milliseconds timeout(
+            netconfig->params.base_timeout_msec > 0 ? netconfig->params.base_timeout_msec
+                                                    : RES_TIMEOUT);
+    const std::chrono::milliseconds latency = netconfig->cache->pending_latency;
+    if (latency == std::chrono::milliseconds::zero()) return timeout;
+    return std::clamp(latency * PENDING_PATIENCE_FACTOR, std::min(PENDING_MIN_PATIENCE, timeout),
+                      timeout);
+}
+
+// Waits, with |lock| held on entry and exit, until |pending| is done or |deadline| passes.
+// With Cache::adaptive_pending_waits and a non-null |race|, the first waiter still waiting when
+// |pending| turns out to be slow stops there instead, with *race set, to send the query itself;
+// the others keep waiting for either query. Returns false if the network was deleted meanwhile.
+static bool cache_wait_pending_locked(NetConfig* netconfig,
+                                      std::unique_lock<std::shared_mutex>& lock,
+                                      const std::shared_ptr<Cache::PendingRequest>& pending,
+                                      std::chrono::steady_clock::time_point deadline,
+                                      bool* race = nullptr) REQUIRES(netconfig->lock) {
+    ATRACE_NAME("resolv_cache_lookup wait");
+    ScopedStageTimer waitTimer(QueryStage::PENDING_WAIT);
+    Cache* cache = netconfig->cache.get();
+    const auto ready = [&netconfig, &pending]() REQUIRES(netconfig->lock) {
+        return netconfig->deleted || pending->done;
+    };
+    bool done = false;
+    if (race != nullptr && cache->adaptive_pending_waits && !pending->raced) {
+        const auto slow = pending->started + cache_pending_patience_locked(netconfig);
+        done = pending->cv.wait_until(lock, std::min(slow, deadline), ready);
+        // Another waiter may have woken up first.
+        if (!done && !pending->raced && slow < deadline) {
+            LOG(INFO) << __func__ << ": previous request is slow, racing it";
+            pending->raced = true;
+            *race = true;
+            cache->pending_wait_count++;
+            cache->pending_race_count++;
+            return true;
+        }
     }
+    if (!done) done = pending->cv.wait_until(lock, deadline, ready);
+    cache->pending_wait_count++;
+    if (netconfig->deleted) return false;
+    if (!done) netconfig->wait_for_pending_req_timeout_count++;
+    return true;
+}
+
+// The part of cache_lookup() once the network is found.
+static ResolvCacheStatus cache_lookup_net(NetConfig* netconfig, Entry* key,
+                                          span<const uint8_t> query, span<uint8_t> answer,
+                                          int* answerlen, uid_t uid,
+                                          std::optional<int>* leader_failure) {
+    const CacheTime now = _time_now();
+    if (const auto status = cache_lookup_shared(netconfig, now, key, answer, answerlen, uid)) {
+        return *status;
+    }
+
+    std::unique_lock lock(netconfig->lock);
+    ScopedExclusiveLockAssertion assume_lock(netconfig->lock);
+    Cache* cache = netconfig->cache.get();
+    cache->last_used = now;
+    key->partitions = cache_partition_locked(cache, uid);
+
+    if (const auto status =
+                cache_probe_locked(netconfig, lock, now, key, query, answer, answerlen)) {
+        return *status;
+    }
+
+    LOG(INFO) << __func__ << ": NOT IN CACHE";
+    const auto pending = cache_find_pending_request_locked(cache, key, true);
+    if (pending == nullptr) return RESOLV_CACHE_NOTFOUND;
+
+    LOG(INFO) << __func__ << ": Waiting for previous request";
+    // wait until (1) timeout OR
+    //            (2) the pending request is completed, or dropped because the cache was
+    //                flushed or the network deleted, OR
+    //            (3) the pending request is slow, and this lookup is to race it.
+    bool race = false;
+    if (!cache_wait_pending_locked(
+                netconfig, lock, pending,
+                std::chrono::steady_clock::now() + std::chrono::seconds(PENDING_REQUEST_TIMEOUT),
+                &race) ||
+        race) {
+        return RESOLV_CACHE_NOTFOUND;
+    }
+    if (pending->failed_rcode) {
+        if (leader_failure != nullptr) *leader_failure = pending->failed_rcode;
+        return RESOLV_CACHE_NOTFOUND;
+    }
+    // The wait may have been long, and the answer added by another app.
+    key->partitions = cache_partition_locked(cache, uid);
+    Entry** lookup = _cache_lookup_p(cache, key);
+    if (*lookup == NULL || !((*lookup)->partitions & key->partitions)) return RESOLV_CACHE_NOTFOUND;
+    return cache_answer_locked(netconfig, _time_now(), lookup, answer, answerlen);
+}
+
+static ResolvCacheStatus cache_lookup(unsigned netid, span<const uint8_t> query,
+                                      span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                      uid_t uid, std::optional<int>* leader_failure) {
+    // Skip cache lookup, return RESOLV_CACHE_NOTFOUND directly so that it is
+    // possible to cache the answer of this query.
+    // If ANDROID_RESOLV_NO_CACHE_STORE is set, return RESOLV_CACHE_SKIP to skip possible cache
+    // storing.
+    // (b/150371903): ANDROID_RESOLV_NO_CACHE_STORE should imply ANDROID_RESOLV_NO_CACHE_LOOKUP
+    // to avoid side channel attack.
+    if (flags & (ANDROID_RESOLV_NO_CACHE_LOOKUP | ANDROID_RESOLV_NO_CACHE_STORE)) {
+        return flags & ANDROID_RESOLV_NO_CACHE_STORE ? RESOLV_CACHE_SKIP : RESOLV_CACHE_NOTFOUND;
+    }
+    Entry key;
+
+    LOG(INFO) << __func__ << ": lookup";
+
+    /* we don't cache malformed queries */
+    if (!entry_init_key(&key, query)) {
+        LOG(INFO) << __func__ << ": unsupported query";
+        return RESOLV_CACHE_UNSUPPORTED;
+    }
+    /* lookup cache */
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
+        return RESOLV_CACHE_UNSUPPORTED;
+    }
+    const ResolvCacheStatus status =
+            cache_lookup_net(netconfig.get(), &key, query, answer, answerlen, uid, leader_failure);
+    netconfig->cache->lookup_counts[status].fetch_add(1, std::memory_order_relaxed);
+    return status;
+}
+
+static const char* cache_status_name(ResolvCacheStatus status) {
+    switch (status) {
+        case RESOLV_CACHE_UNSUPPORTED:
+            return "unsupported";
+        case RESOLV_CACHE_NOTFOUND:
+            return "miss";
+        case RESOLV_CACHE_FOUND:
+            return "hit";
+        case RESOLV_CACHE_SKIP:
+            return "skip";
+        case RESOLV_CACHE_STALE:
+            return "stale";
+        case RESOLV_CACHE_PREFETCH:
+            return "prefetch";
+    }
+    return "unknown";
+}
+
+ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
+                                      span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                      uid_t uid, std::optional<int>* leader_failure) {
+    ATRACE_CALL();
+    ScopedStageTimer timer(QueryStage::CACHE_LOOKUP);
+    const ResolvCacheStatus status =
+            cache_lookup(netid, query, answer, answerlen, flags, uid, leader_failure);
+    traceMark(cache_status_name(status));
+    return status;
+}
+
+ResolvCacheStatus resolv_cache_peek(unsigned netid, span<const uint8_t> query,
+                                    span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                    uid_t uid) {
+    ATRACE_CALL();
+    if (flags & (ANDROID_RESOLV_NO_CACHE_LOOKUP | ANDROID_RESOLV_NO_CACHE_STORE)) {
+        return RESOLV_CACHE_NOTFOUND;
+    }
+    Entry key;
+    if (!entry_init_key(&key, query)) return RESOLV_CACHE_UNSUPPORTED;
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return RESOLV_CACHE_UNSUPPORTED;
+
+    const auto status = cache_lookup_shared(netconfig.get(), _time_now(), &key, answer, answerlen,
+                                            uid, /*peek=*/true);
+    if (status != RESOLV_CACHE_FOUND) return RESOLV_CACHE_NOTFOUND;
+    netconfig->cache->lookup_counts[RESOLV_CACHE_FOUND].fetch_add(1, std::memory_order_relaxed);
+    return RESOLV_CACHE_FOUND;
+}
+
+// The bucket of Cache::answer_size_counts that an answer of |size| bytes is counted in: bucket i
+// holds the answers of at most 64 << i bytes, and the last one all those larger.
+static size_t answer_size_bucket(size_t size) {
+    size_t bucket = 0;
+    while (bucket + 1 < CACHE_ANSWER_SIZE_BUCKETS &&
+           size > size_t{1} << (CACHE_ANSWER_SIZE_MIN_SHIFT + bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// Returns how long to cache the answer |index| holds, whose TTL is |ttl|, under the policy of
+// |netconfig|: a positive answer whose TTL is below low_ttl_sec has it multiplied by
+// low_ttl_stretch, but not past low_ttl_sec, then raised to min_ttl_sec; any answer is then
+// lowered to max_ttl_sec. The records themselves keep their TTLs, which lookups only ever lower.
+// Negative answers aren't stretched or floored, so that a name which starts to exist isn't
+// hidden for longer than its zone asks for, nor are answers that can't be cached at all.
+static uint32_t cache_apply_ttl_policy_locked(NetConfig* netconfig, const DnsMessageIndex& index,
+                                              uint32_t ttl) REQUIRES(netconfig->lock) {
+    Cache* const cache = netconfig->cache.get();
+    if (!index.section(ns_s_an).empty()) {
+        const uint32_t low = netconfig->low_ttl_sec;
+        if (ttl > 0 && ttl < low && netconfig->low_ttl_stretch > 1) {
+            ttl = std::min<uint64_t>(uint64_t{ttl} * netconfig->low_ttl_stretch, low);
+            cache->ttl_stretched_count++;
+        }
+        if (ttl < uint32_t(netconfig->min_ttl_sec)) {
+            ttl = netconfig->min_ttl_sec;
+            cache->ttl_floored_count++;
+        }
+    }
+    if (netconfig->max_ttl_sec > 0 && ttl > uint32_t(netconfig->max_ttl_sec)) {
+        ttl = netconfig->max_ttl_sec;
+        cache->ttl_capped_count++;
+    }
+    return ttl;
+}
+
+// Adds |answer| for |key| to the cache of |netconfig|, and completes its pending request.
+static int cache_add_locked(NetConfig* netconfig, CacheTime now, Entry* key,
+                            span<const uint8_t> answer, bool private_dns = false)
+        REQUIRES(netconfig->lock) {
+    Entry* e;
+    Entry** lookup;
+    uint32_t ttl;
+    Cache* cache = netconfig->cache.get();
+    cache->last_used = now;
+
+    // Sweep out the entries that can no longer be served. This is cheap enough to do on every
+    // insertion since it only touches expired entries.
+    _cache_remove_expired(cache, now, std::chrono::seconds(netconfig->serve_stale_sec));
 
     lookup = _cache_lookup_p(cache, key);
     e = *lookup;
 
+    // An expired entry still present is one kept for serve-stale, and an entry that a caller was
+    // asked to refresh is being prefetched. Replace either with the new answer, keeping its hit
+    // count so that a popular name stays eligible for prefetching.
+    // In a partitioned cache, an entry that the partition adding can't see is one another app
+    // added. The apps that got the same records share the entry, those that didn't lose it.
+    int hits = 0;
+    uint64_t partitions = key->partitions;
+    const bool refreshed = e != NULL && (now >= e->expires || e->refresh_time != CacheTime());
+    if (e != NULL && (refreshed || !(e->partitions & key->partitions))) {
+        const span<const uint8_t> cached = {e->answer, static_cast<size_t>(e->answerlen)};
+        const bool same = cache->partitioned && answer_sameRecords(cached, answer);
+        if (same && !refreshed) {
+            LOG(INFO) << __func__ << ": ALREADY IN CACHE (" << e << "), SHARED WITH PARTITION";
+            e->partitions |= key->partitions;
+            cache_notify_waiting_tid_locked(cache, key);
+            return 0;
+        }
+        if (same) partitions |= e->partitions;
+        hits = e->hits;
+        _cache_remove_p(cache, lookup, EVICT_REPLACED);
+        lookup = _cache_lookup_p(cache, key);
+        e = *lookup;
+    }
+
     // Should only happen on ANDROID_RESOLV_NO_CACHE_LOOKUP
     if (e != NULL) {
         LOG(INFO) << __func__ << ": ALREADY IN CACHE (" << e << ") ? IGNORING ADD";
@@ -1358,11 +3590,27 @@ int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8
         return -EEXIST;
     }
 
-    if (cache->num_entries >= CONFIG_MAX_ENTRIES) {
-        _cache_remove_expired(cache);
-        if (cache->num_entries >= CONFIG_MAX_ENTRIES) {
-            _cache_remove_oldest(cache);
-        }
+    // As received, whether it ends up stored or not.
+    cache->answer_size_counts[answer_size_bucket(answer.size())]++;
+
+    // The answer as stored, minimized if the cache is configured to.
+    // The answer is parsed once for the TTL, minimizing, and the RRset and NSEC caches.
+    DnsMessageIndex index;
+    index.parse(answer);
+    std::vector<uint8_t> minimized;
+    span<const uint8_t> stored = answer;
+    if (cache->minimize_answers && answer_minimize(index, &minimized)) stored = minimized;
+
+    const size_t incoming = EntryArena::blockSize(sizeof(Entry) + key->querylen + stored.size());
+    const bool admitted = cache_admit_locked(cache, now, key, incoming);
+    if (!admitted) {
+        cache->not_admitted_count++;
+        LOG(VERBOSE) << __func__ << ": NOT ADMITTED, looked up less often than the oldest entry";
+    }
+    lookup = _cache_lookup_p(cache, key);
+
+    if (admitted &&
+        _cache_make_room(cache, now, cache->max_bytes, cache->max_entries, incoming)) {
         // TODO: It looks useless, remove below code after having test to prove it.
         lookup = _cache_lookup_p(cache, key);
         e = *lookup;
@@ -1373,154 +3621,650 @@ int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8
         }
     }
 
-    ttl = answer_getTTL(answer);
-    if (ttl > 0) {
-        e = entry_alloc(key, answer);
+    ttl = cache_apply_ttl_policy_locked(netconfig, index, answer_getTTL(index));
+    if (ttl > 0 && admitted) {
+        e = entry_alloc(&cache->arena, key, stored, cache->intern_answers);
         if (e != NULL) {
-            e->expires = ttl + _time_now();
+            e->expires = now + std::chrono::seconds(ttl);
+            e->ttl = ttl;
+            e->hits = hits;
+            e->partitions = partitions;
             _cache_add_p(cache, lookup, e);
         }
     }
+    if (!cache->partitioned) {
+        if (cache->rrset_enabled && private_dns) cache_add_rrsets_locked(cache, now, index);
+        if (cache->aggressive_nsec_enabled && private_dns) {
+            cache_add_nsec_locked(cache, now, index);
+        }
+        if (cache->https_hints_enabled) cache_add_https_hints_locked(cache, now, index);
+    }
+
+    cache_dump_mru_locked(cache);
+    cache_record_pending_latency_locked(cache, key);
+    cache_notify_waiting_tid_locked(cache, key);
+
+    return 0;
+}
+
+int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8_t> answer,
+                     uid_t uid, bool private_dns) {
+    Entry key[1];
+
+    /* don't assume that the query has already been cached
+     */
+    if (!entry_init_key(key, query)) {
+        LOG(INFO) << __func__ << ": passed invalid query?";
+        return -EINVAL;
+    }
+
+    resolv_cache_trim_idle();
+
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
+        return -ENONET;
+    }
+
+    const CacheTime now = _time_now();
+    int rc;
+    {
+        std::lock_guard guard(netconfig->lock);
+        key->partitions = cache_add_partition_locked(netconfig->cache.get(), uid);
+        rc = cache_add_locked(netconfig.get(), now, key, answer, private_dns);
+    }
+    cache_snapshot_maybe_write(netconfig, now);
+    return rc;
+}
+
+void resolv_cache_lookup_batch(unsigned netid, span<ResolvCacheBatchEntry> entries,
+                               uint32_t flags, uid_t uid) {
+    ATRACE_CALL();
+    ScopedStageTimer timer(QueryStage::CACHE_LOOKUP);
+    // As in cache_lookup().
+    if (flags & (ANDROID_RESOLV_NO_CACHE_LOOKUP | ANDROID_RESOLV_NO_CACHE_STORE)) {
+        for (ResolvCacheBatchEntry& entry : entries) {
+            entry.status = flags & ANDROID_RESOLV_NO_CACHE_STORE ? RESOLV_CACHE_SKIP
+                                                                 : RESOLV_CACHE_NOTFOUND;
+        }
+        return;
+    }
+
+    /* we don't cache malformed queries */
+    std::vector<Entry> keys(entries.size());
+    std::vector<bool> supported(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].status = RESOLV_CACHE_UNSUPPORTED;
+        supported[i] = entry_init_key(&keys[i], entries[i].query);
+    }
+
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
+
+    std::unique_lock lock(netconfig->lock);
+    ScopedExclusiveLockAssertion assume_lock(netconfig->lock);
+    Cache* cache = netconfig->cache.get();
+    const CacheTime now = _time_now();
+    cache->last_used = now;
+    for (Entry& key : keys) key.partitions = cache_partition_locked(cache, uid);
+
+    // The entries that missed, and those of them that another lookup is resolving.
+    std::vector<size_t> missed;
+    std::vector<std::pair<size_t, std::shared_ptr<Cache::PendingRequest>>> waiting;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (!supported[i]) continue;
+        ResolvCacheBatchEntry& entry = entries[i];
+        if (cache->sketch) cache->sketch->record(keys[i].hash);
+        cache_record_query(cache, &keys[i]);
+        if (const auto status = cache_probe_locked(netconfig.get(), lock, now, &keys[i],
+                                                   entry.query, entry.answer, &entry.answerlen)) {
+            entry.status = *status;
+            if (*status != RESOLV_CACHE_NOTFOUND) continue;
+        }
+        // The peers may have been looked up with the lock released.
+        if (netconfig->deleted) {
+            entry.status = RESOLV_CACHE_NOTFOUND;
+            continue;
+        }
+        if (auto pending = cache_find_pending_request_locked(cache, &keys[i], false)) {
+            waiting.emplace_back(i, std::move(pending));
+        } else {
+            missed.push_back(i);
+        }
+    }
+
+    // They are all given as long as a single lookup would wait for one. No request is registered
+    // for the others yet, so that two batches waiting for each other can't deadlock.
+    const auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(PENDING_REQUEST_TIMEOUT);
+    for (const auto& [i, pending] : waiting) {
+        LOG(INFO) << __func__ << ": Waiting for previous request";
+        if (!cache_wait_pending_locked(netconfig.get(), lock, pending, deadline)) break;
+    }
+    const CacheTime waited = waiting.empty() ? now : _time_now();
+    const uint64_t partition = cache_partition_locked(cache, uid);
+    for (const auto& [i, _] : waiting) {
+        ResolvCacheBatchEntry& entry = entries[i];
+        entry.status = RESOLV_CACHE_NOTFOUND;
+        if (netconfig->deleted) continue;
+        Entry** lookup = _cache_lookup_p(cache, &keys[i]);
+        if (*lookup != NULL && ((*lookup)->partitions & partition)) {
+            entry.status = cache_answer_locked(netconfig.get(), waited, lookup, entry.answer,
+                                               &entry.answerlen);
+        }
+    }
+    const auto count_lookups = [&] {
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (!supported[i]) continue;
+            cache->lookup_counts[entries[i].status].fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+    if (netconfig->deleted) {
+        for (const size_t i : missed) entries[i].status = RESOLV_CACHE_NOTFOUND;
+        count_lookups();
+        return;
+    }
+
+    // One request stands for all the entries this batch is now expected to resolve; it is
+    // completed along with the last of them, by resolv_cache_add_batch().
+    std::shared_ptr<Cache::PendingRequest> request;
+    for (const size_t i : missed) {
+        entries[i].status = RESOLV_CACHE_NOTFOUND;
+        // A previous entry of the batch may be the same query.
+        if (cache_find_pending_request_locked(cache, &keys[i], false)) continue;
+        if (request == nullptr) request = std::make_shared<Cache::PendingRequest>();
+        cache->pending_requests.emplace(keys[i].hash, request);
+    }
+    count_lookups();
+    LOG(INFO) << __func__ << ": " << missed.size() << " of " << entries.size()
+              << " NOT IN CACHE";
+}
+
+void resolv_cache_add_batch(unsigned netid, span<const ResolvCacheBatchEntry> entries,
+                            uint32_t flags, uid_t uid) {
+    resolv_cache_trim_idle();
+
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
+
+    const CacheTime now = _time_now();
+    {
+        // Waiters are only woken up once the lock is released, after the whole batch is in.
+        std::lock_guard guard(netconfig->lock);
+        for (const ResolvCacheBatchEntry& entry : entries) {
+            if (entry.status != RESOLV_CACHE_NOTFOUND) continue;
+            Entry key[1];
+            if (!entry_init_key(key, entry.query)) continue;
+            if (entry.answerlen > 0) {
+                key->partitions = cache_add_partition_locked(netconfig->cache.get(), uid);
+                cache_add_locked(netconfig.get(), now, key, entry.answer.first(entry.answerlen));
+            } else if (!(flags &
+                         (ANDROID_RESOLV_NO_CACHE_STORE | ANDROID_RESOLV_NO_CACHE_LOOKUP))) {
+                // As in _resolv_cache_query_failed().
+                cache_notify_waiting_tid_locked(netconfig->cache.get(), key);
+            }
+        }
+    }
+    cache_snapshot_maybe_write(netconfig, now);
+}
+
+bool resolv_gethostbyaddr_from_cache(unsigned netid, char domain_name[], size_t domain_name_size,
+                                     const char* ip_address, int af) {
+    if (domain_name_size > NS_MAXDNAME) {
+        LOG(WARNING) << __func__ << ": invalid domain_name_size " << domain_name_size;
+        return false;
+    } else if (ip_address == nullptr || ip_address[0] == '\0') {
+        LOG(WARNING) << __func__ << ": invalid ip_address";
+        return false;
+    } else if (af != AF_INET && af != AF_INET6) {
+        LOG(WARNING) << __func__ << ": unsupported AF";
+        return false;
+    }
+
+    uint8_t addr[sizeof(in6_addr)];
+    if (inet_pton(af, ip_address, addr) != 1) {
+        LOG(WARNING) << __func__ << ": inet_pton() fail";
+        return false;
+    }
+    const size_t addrlen = (af == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr);
+
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
+        return false;
+    }
+
+    std::lock_guard guard(netconfig->lock);
+    Cache* cache = netconfig->cache.get();
+    // There's no app to find the entries of.
+    if (cache->partitioned) return false;
+
+    // Several entries may hold the address; prefer the one added last.
+    Entry* node = nullptr;
+    const auto [begin, end] =
+            cache->addr_index.equal_range(std::string(reinterpret_cast<char*>(addr), addrlen));
+    for (auto it = begin; it != end; ++it) {
+        if (it->second->generation != cache->generation) continue;
+        if (node == nullptr || it->second->id > node->id) node = it->second;
+    }
+    if (node == nullptr) {
+        return false;
+    }
+
+    std::vector<uint8_t> answer(node->answerlen);
+    entry_copy_answer(node, answer.data());
+    DnsMessageIndex index;
+    if (!index.parse(answer)) {
+        return false;
+    }
+    for (const DnsMessageIndex::Record& question : index.section(ns_s_qd)) {
+        char name[NS_MAXDNAME];
+        if (!index.expandName(question.nameOffset, name, sizeof(name))) {
+            continue;
+        }
+        strlcpy(domain_name, name, domain_name_size);
+        if (domain_name[0] != '\0') {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Lock protecting sNetConfigMap only. It is taken exclusively when networks are created or
+// deleted, and shared on every other access, so lookups on different networks can run in
+// parallel. The per-network state is protected by NetConfig::lock.
+static std::shared_mutex sNetConfigMapLock;
+static std::unordered_map<unsigned, std::shared_ptr<NetConfig>> sNetConfigMap
+        GUARDED_BY(sNetConfigMapLock);
+// The cache domain of each network that has one. Networks in the same domain look up each
+// other's caches on a miss.
+static std::unordered_map<unsigned, std::string> sCacheDomains GUARDED_BY(sNetConfigMapLock);
+
+// Rate-limited, so it's cheap to call often.
+static void resolv_cache_trim_idle() {
+    static std::atomic<CacheTime> sLastIdleCheck{};
+    const CacheTime now = _time_now();
+    CacheTime last = sLastIdleCheck;
+    if (now - last < CACHE_IDLE_CHECK_INTERVAL ||
+        !sLastIdleCheck.compare_exchange_strong(last, now)) {
+        return;
+    }
+
+    std::vector<std::shared_ptr<NetConfig>> netconfigs;
+    {
+        std::shared_lock guard(sNetConfigMapLock);
+        ScopedSharedLockAssertion assume_lock(sNetConfigMapLock);
+        for (const auto& [_, netconfig] : sNetConfigMap) netconfigs.push_back(netconfig);
+    }
+    for (const auto& netconfig : netconfigs) {
+        std::lock_guard guard(netconfig->lock);
+        Cache* cache = netconfig->cache.get();
+        // Those over their share of the global ceiling give the bytes back, idle or not.
+        _cache_make_room(cache, now, cache->max_bytes, cache->max_entries, 0);
+        if (now - cache->last_used.load() < CACHE_IDLE_TIMEOUT) continue;
+        _cache_remove_expired(cache, now, std::chrono::seconds(netconfig->serve_stale_sec));
+        _cache_make_room(cache, now, cache->max_bytes / CACHE_IDLE_SHRINK_FACTOR,
+                         std::max<int>(1, cache->max_entries / CACHE_IDLE_SHRINK_FACTOR), 0);
+    }
+}
+
+// Held while a snapshot file is written or removed, so that those of a network follow each other.
+static std::mutex sCacheSnapshotLock;
+// Directory of the cache snapshot files, one per network and named after the netid.
+static std::string sCacheSnapshotDir GUARDED_BY(sCacheSnapshotLock) = CACHE_SNAPSHOT_DEFAULT_DIR;
+
+// A snapshot file holds the header, followed by |count| records, each of them followed by the
+// query and the answer of its entry. Fields are in host byte order, and records are unaligned.
+struct CacheSnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    // Netids are only meaningful within a boot, so snapshots from an earlier one are ignored.
+    char boot_id[40];
+    uint32_t count;
+};
+
+struct CacheSnapshotRecord {
+    // Milliseconds of CLOCK_MONOTONIC_COARSE, which only the boot ID makes meaningful.
+    int64_t expires;
+    uint32_t ttl;
+    uint32_t querylen;
+    uint32_t answerlen;
+};
 
-    cache_dump_mru_locked(cache);
-    cache_notify_waiting_tid_locked(cache, key);
+constexpr uint32_t CACHE_SNAPSHOT_MAGIC = 0x444e5343;  // "DNSC"
+constexpr uint32_t CACHE_SNAPSHOT_VERSION = 2;
 
-    return 0;
+static bool cache_snapshot_enabled() {
+    return Experiments::getInstance()->getFlag("cache_snapshot", 0) == 1;
 }
 
-bool resolv_gethostbyaddr_from_cache(unsigned netid, char domain_name[], size_t domain_name_size,
-                                     const char* ip_address, int af) {
-    if (domain_name_size > NS_MAXDNAME) {
-        LOG(WARNING) << __func__ << ": invalid domain_name_size " << domain_name_size;
-        return false;
-    } else if (ip_address == nullptr || ip_address[0] == '\0') {
-        LOG(WARNING) << __func__ << ": invalid ip_address";
-        return false;
-    } else if (af != AF_INET && af != AF_INET6) {
-        LOG(WARNING) << __func__ << ": unsupported AF";
-        return false;
-    }
-
-    Cache* cache = nullptr;
-    Entry* node = nullptr;
+static std::string cache_snapshot_path(unsigned netid) REQUIRES(sCacheSnapshotLock) {
+    return fmt::format("{}/{}", sCacheSnapshotDir, netid);
+}
 
-    ns_rr rr;
-    ns_msg handle;
-    ns_rr rr_query;
+static const std::string& cache_snapshot_boot_id() {
+    static const std::string bootId = []() {
+        std::string id;
+        android::base::ReadFileToString("/proc/sys/kernel/random/boot_id", &id);
+        return android::base::Trim(id);
+    }();
+    return bootId;
+}
 
-    struct sockaddr_in sa;
-    struct sockaddr_in6 sa6;
-    char* addr_buf = nullptr;
+// Copies the entries of the cache of |netconfig| that can still be served into a snapshot image,
+// oldest first so that reloading them in order restores the MRU list.
+static std::vector<uint8_t> cache_snapshot_image_locked(NetConfig* netconfig)
+        REQUIRES_SHARED(netconfig->lock) {
+    const Cache* cache = netconfig->cache.get();
+    size_t size = sizeof(CacheSnapshotHeader);
+    uint32_t count = 0;
+    for (Entry* e = cache->mru_list.mru_next; e != &cache->mru_list; e = e->mru_next) {
+        if (e->generation != cache->generation) continue;
+        size += sizeof(CacheSnapshotRecord) + e->querylen + e->answerlen;
+        count++;
+    }
 
-    std::lock_guard guard(cache_mutex);
+    std::vector<uint8_t> image(size);
+    CacheSnapshotHeader header = {
+            .magic = CACHE_SNAPSHOT_MAGIC,
+            .version = CACHE_SNAPSHOT_VERSION,
+            .count = count,
+    };
+    strlcpy(header.boot_id, cache_snapshot_boot_id().c_str(), sizeof(header.boot_id));
+    uint8_t* p = image.data();
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (Entry* e = cache->mru_list.mru_prev; e != &cache->mru_list; e = e->mru_prev) {
+        if (e->generation != cache->generation) continue;
+        const CacheSnapshotRecord record = {
+                .expires = e->expires.time_since_epoch().count(),
+                .ttl = e->ttl,
+                .querylen = static_cast<uint32_t>(e->querylen),
+                .answerlen = static_cast<uint32_t>(e->answerlen),
+        };
+        memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+        memcpy(p, e->query, e->querylen);
+        p += e->querylen;
+        entry_copy_answer(e, p);
+        p += e->answerlen;
+    }
+    return image;
+}
 
-    cache = find_named_cache_locked(netid);
-    if (cache == nullptr) {
-        return false;
+// Writes |image|, taken from the cache of |netconfig| at |epoch|, to its snapshot file through a
+// temporary file that then replaces the previous snapshot. The image is dropped if the snapshot
+// was removed since. Called with no lock held, since it waits for the disk.
+static int cache_snapshot_write(NetConfig* netconfig, uint32_t epoch,
+                                const std::vector<uint8_t>& image) {
+    std::lock_guard snapshotGuard(sCacheSnapshotLock);
+    {
+        std::shared_lock guard(netconfig->lock);
+        if (netconfig->deleted || netconfig->snapshot_epoch != epoch) return -ECANCELED;
     }
 
-    for (node = cache->mru_list.mru_next; node != nullptr && node != &cache->mru_list;
-         node = node->mru_next) {
-        if (node->answer == nullptr) {
-            continue;
-        }
+    if (mkdir(sCacheSnapshotDir.c_str(), 0700) == -1 && errno != EEXIST) {
+        PLOG(WARNING) << __func__ << ": failed to create " << sCacheSnapshotDir;
+        return -errno;
+    }
+    const std::string path = cache_snapshot_path(netconfig->netid);
+    const std::string tmpPath = path + ".tmp";
+    android::base::unique_fd fd(
+            open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd == -1) {
+        PLOG(WARNING) << __func__ << ": failed to create " << tmpPath;
+        return -errno;
+    }
+    if (!android::base::WriteFully(fd, image.data(), image.size())) {
+        PLOG(WARNING) << __func__ << ": failed to write " << tmpPath;
+        const int err = errno;
+        unlink(tmpPath.c_str());
+        return -err;
+    }
+    fd.reset();
 
-        memset(&handle, 0, sizeof(handle));
+    if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+        PLOG(WARNING) << __func__ << ": failed to rename " << tmpPath;
+        const int err = errno;
+        unlink(tmpPath.c_str());
+        return -err;
+    }
+    CacheSnapshotHeader header;
+    memcpy(&header, image.data(), sizeof(header));
+    LOG(INFO) << __func__ << ": netid = " << netconfig->netid << ", " << header.count
+              << " entries";
+    return 0;
+}
 
-        if (ns_initparse(node->answer, node->answerlen, &handle) < 0) {
-            continue;
-        }
+// Copies the cache of |netconfig| under a shared lock, and writes it with no lock held.
+static int cache_snapshot_take(NetConfig* netconfig, CacheTime now) {
+    std::vector<uint8_t> image;
+    uint32_t epoch;
+    {
+        std::shared_lock guard(netconfig->lock);
+        ScopedSharedLockAssertion assume_lock(netconfig->lock);
+        netconfig->last_snapshot = now;
+        image = cache_snapshot_image_locked(netconfig);
+        epoch = netconfig->snapshot_epoch;
+    }
+    return cache_snapshot_write(netconfig, epoch, image);
+}
 
-        for (int n = 0; n < ns_msg_count(handle, ns_s_an); n++) {
-            memset(&rr, 0, sizeof(rr));
+// Saves the cache of |netconfig| on a background thread if it's time to, so that neither the copy
+// nor the disk holds up the query that added to the cache.
+static void cache_snapshot_maybe_write(const std::shared_ptr<NetConfig>& netconfig, CacheTime now) {
+    if (!cache_snapshot_enabled()) return;
+    CacheTime last = netconfig->last_snapshot.load(std::memory_order_relaxed);
+    if (now - last < CACHE_SNAPSHOT_INTERVAL) return;
+    // Only the thread that moves last_snapshot forward saves the cache.
+    if (!netconfig->last_snapshot.compare_exchange_strong(last, now)) return;
+    const int rval = QueryThreadPool::executeBackground(
+            [netconfig, now] {
+                {
+                    // Apps can't see each other's answers in a partitioned cache, nor in a
+                    // reload of it.
+                    std::shared_lock guard(netconfig->lock);
+                    if (netconfig->cache->partitioned) return;
+                }
+                cache_snapshot_take(netconfig.get(), now);
+            },
+            "DnsCacheSnapshot");
+    // Left to the next answer added.
+    if (rval != 0) netconfig->last_snapshot = last;
+}
 
-            if (ns_parserr(&handle, ns_s_an, n, &rr)) {
-                continue;
-            }
+static void cache_snapshot_remove(unsigned netid) {
+    if (!cache_snapshot_enabled()) return;
+    std::lock_guard guard(sCacheSnapshotLock);
+    const std::string path = cache_snapshot_path(netid);
+    if (unlink(path.c_str()) == -1 && errno != ENOENT) {
+        PLOG(WARNING) << __func__ << ": failed to remove " << path;
+    }
+}
 
-            if (ns_rr_type(rr) == ns_t_a && af == AF_INET) {
-                addr_buf = (char*)&(sa.sin_addr);
-            } else if (ns_rr_type(rr) == ns_t_aaaa && af == AF_INET6) {
-                addr_buf = (char*)&(sa6.sin6_addr);
-            } else {
-                continue;
-            }
+// Fills the cache of |netconfig|, which must not be shared yet, from its snapshot file if there
+// is a valid one. The TTLs of the answers are lowered to the time they have left.
+static void cache_snapshot_load(NetConfig* netconfig) {
+    if (!cache_snapshot_enabled()) return;
 
-            if (inet_pton(af, ip_address, addr_buf) != 1) {
-                LOG(WARNING) << __func__ << ": inet_pton() fail";
-                return false;
-            }
+    std::string path;
+    {
+        std::lock_guard guard(sCacheSnapshotLock);
+        path = cache_snapshot_path(netconfig->netid);
+    }
+    android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(CacheSnapshotHeader))) {
+        return;
+    }
+    const size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        PLOG(WARNING) << __func__ << ": failed to map " << path;
+        return;
+    }
+    const span<const uint8_t> image(static_cast<const uint8_t*>(map), size);
+
+    CacheSnapshotHeader header;
+    memcpy(&header, image.data(), sizeof(header));
+    header.boot_id[sizeof(header.boot_id) - 1] = '\0';
+    if (header.magic != CACHE_SNAPSHOT_MAGIC || header.version != CACHE_SNAPSHOT_VERSION ||
+        cache_snapshot_boot_id() != header.boot_id) {
+        LOG(INFO) << __func__ << ": ignoring stale or invalid snapshot " << path;
+        munmap(map, size);
+        return;
+    }
 
-            if (memcmp(ns_rr_rdata(rr), addr_buf, ns_rr_rdlen(rr)) == 0) {
-                int query_count = ns_msg_count(handle, ns_s_qd);
-                for (int i = 0; i < query_count; i++) {
-                    memset(&rr_query, 0, sizeof(rr_query));
-                    if (ns_parserr(&handle, ns_s_qd, i, &rr_query)) {
-                        continue;
-                    }
-                    strlcpy(domain_name, ns_rr_name(rr_query), domain_name_size);
-                    if (domain_name[0] != '\0') {
-                        return true;
-                    }
-                }
-            }
+    Cache* cache = netconfig->cache.get();
+    const CacheTime now = _time_now();
+    int loaded = 0;
+    size_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.count; i++) {
+        CacheSnapshotRecord record;
+        if (size - offset < sizeof(record)) break;
+        memcpy(&record, image.data() + offset, sizeof(record));
+        offset += sizeof(record);
+        if (size - offset < static_cast<size_t>(record.querylen) + record.answerlen) break;
+        const auto query = image.subspan(offset, record.querylen);
+        std::vector<uint8_t> answer(image.begin() + offset + record.querylen,
+                                    image.begin() + offset + record.querylen + record.answerlen);
+        offset += record.querylen + record.answerlen;
+        const CacheTime expires{std::chrono::milliseconds(record.expires)};
+        if (expires <= now) continue;
+
+        Entry key;
+        if (!entry_init_key(&key, query)) continue;
+        answer_clampTTL(answer, _ttl_left(expires, now));
+        Entry** lookup = _cache_lookup_p(cache, &key);
+        if (*lookup != nullptr) continue;
+        if (_cache_make_room(cache, now, cache->max_bytes, cache->max_entries,
+                             sizeof(Entry) + key.querylen + answer.size())) {
+            lookup = _cache_lookup_p(cache, &key);
         }
+        Entry* e = entry_alloc(&cache->arena, &key, answer, cache->intern_answers);
+        if (e == nullptr) break;
+        e->expires = expires;
+        e->ttl = record.ttl;
+        _cache_add_p(cache, lookup, e);
+        loaded++;
     }
+    munmap(map, size);
+    LOG(INFO) << __func__ << ": netid = " << netconfig->netid << ", " << loaded << " entries";
+}
 
-    return false;
+int resolv_cache_write_snapshot(unsigned netid) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return -ENONET;
+
+    return cache_snapshot_take(netconfig.get(), _time_now());
+}
+
+void resolv_cache_set_snapshot_dir(const std::string& dir) {
+    std::lock_guard guard(sCacheSnapshotLock);
+    sCacheSnapshotDir = dir;
+}
+
+std::chrono::milliseconds resolv_cache_now() {
+    return _time_now().time_since_epoch();
 }
 
-static std::unordered_map<unsigned, std::unique_ptr<NetConfig>> sNetConfigMap
-        GUARDED_BY(cache_mutex);
+void resolv_cache_set_clock(std::chrono::milliseconds (*clock)()) {
+    sClock = clock;
+}
 
 // Clears nameservers set for |netconfig| and clears the stats
-static void free_nameservers_locked(NetConfig* netconfig);
+static void free_nameservers_locked(NetConfig* netconfig) REQUIRES(netconfig->lock);
+// Drops the results in the addrinfo cache of |netconfig|, and in its source address cache too
+// if |src_addrs|.
+static void invalidate_results_locked(NetConfig* netconfig, bool src_addrs)
+        REQUIRES(netconfig->lock);
+// Replaces the nameservers of |netconfig|, carrying the stats of those that remain along with them.
+static void replace_nameservers_locked(NetConfig* netconfig, std::vector<std::string> nameservers,
+                                       std::vector<IPSockAddr> sockAddrs)
+        REQUIRES(netconfig->lock);
+static void cache_update_partitioning_locked(NetConfig* netconfig) REQUIRES(netconfig->lock);
 // Order-insensitive comparison for the two set of servers.
 static bool resolv_is_nameservers_equal(const std::vector<std::string>& oldServers,
                                         const std::vector<std::string>& newServers);
 // clears the stats samples contained withing the given netconfig.
-static void res_cache_clear_stats_locked(NetConfig* netconfig);
+static void res_cache_clear_stats_locked(NetConfig* netconfig) REQUIRES(netconfig->lock);
+// Merges the pending samples of |netconfig| into its stats: all of them if |force|, as needed
+// before the stats are reported or the servers change, and otherwise only once they're due.
+static void merge_pending_stats_locked(NetConfig* netconfig, bool force)
+        REQUIRES(netconfig->lock);
 
 // public API for netd to query if name server is set on specific netid
 bool resolv_has_nameservers(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
-    return (info != nullptr) && (info->nameserverCount() > 0);
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return false;
+    std::lock_guard guard(info->lock);
+    return info->nameserverCount() > 0;
 }
 
 int resolv_create_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
+    // Load the snapshot before taking the map lock, since nothing else can see the new network.
+    auto netconfig = std::make_shared<NetConfig>(netid);
+    cache_snapshot_load(netconfig.get());
+
+    std::lock_guard guard(sNetConfigMapLock);
     if (sNetConfigMap.find(netid) != sNetConfigMap.end()) {
         LOG(ERROR) << __func__ << ": Cache is already created, netId: " << netid;
         return -EEXIST;
     }
 
-    sNetConfigMap[netid] = std::make_unique<NetConfig>(netid);
+    sNetConfigMap[netid] = std::move(netconfig);
 
     return 0;
 }
 
 void resolv_delete_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    sNetConfigMap.erase(netid);
+    std::shared_ptr<NetConfig> netconfig;
+    {
+        std::lock_guard guard(sNetConfigMapLock);
+        auto it = sNetConfigMap.find(netid);
+        if (it == sNetConfigMap.end()) return;
+        netconfig = std::move(it->second);
+        sNetConfigMap.erase(it);
+        sCacheDomains.erase(netid);
+    }
+
+    // Wake up the threads waiting for pending requests on this network. The NetConfig itself
+    // is freed when the last of them drops its reference.
+    {
+        Cache::Detached detached;  // Freed once the lock is released.
+        std::lock_guard guard(netconfig->lock);
+        netconfig->deleted = true;
+        detached = netconfig->cache->invalidate();
+        invalidate_results_locked(netconfig.get(), true);
+    }
+    // Once the lock is released, since a snapshot being written takes it after the file lock.
+    cache_snapshot_remove(netid);
 }
 
 int resolv_flush_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) {
         return -ENONET;
     }
-    netconfig->cache->flush();
 
-    // Also clear the NS statistics.
-    res_cache_clear_stats_locked(netconfig);
+    {
+        Cache::Detached detached;  // Freed once the lock is released.
+        std::lock_guard guard(netconfig->lock);
+        detached = netconfig->cache->invalidate();
+        invalidate_results_locked(netconfig.get(), true);
+        netconfig->snapshot_epoch++;
+
+        // Also clear the NS statistics.
+        res_cache_clear_stats_locked(netconfig.get());
+    }
+    // As in resolv_delete_cache_for_net().
+    cache_snapshot_remove(netid);
     return 0;
 }
 
 std::vector<unsigned> resolv_list_caches() {
-    std::lock_guard guard(cache_mutex);
+    std::shared_lock guard(sNetConfigMapLock);
+    ScopedSharedLockAssertion assume_lock(sNetConfigMapLock);
     std::vector<unsigned> result;
     result.reserve(sNetConfigMap.size());
     for (const auto& [netId, _] : sNetConfigMap) {
@@ -1529,17 +4273,47 @@ std::vector<unsigned> resolv_list_caches() {
     return result;
 }
 
-static Cache* find_named_cache_locked(unsigned netid) {
-    NetConfig* info = find_netconfig_locked(netid);
-    if (info != nullptr) return info->cache.get();
+static std::shared_ptr<NetConfig> find_netconfig(unsigned netid) {
+    std::shared_lock guard(sNetConfigMapLock);
+    ScopedSharedLockAssertion assume_lock(sNetConfigMapLock);
+    if (auto it = sNetConfigMap.find(netid); it != sNetConfigMap.end()) {
+        return it->second;
+    }
     return nullptr;
 }
 
-static NetConfig* find_netconfig_locked(unsigned netid) {
-    if (auto it = sNetConfigMap.find(netid); it != sNetConfigMap.end()) {
-        return it->second.get();
+static std::vector<std::shared_ptr<NetConfig>> find_cache_domain_peers(unsigned netid) {
+    std::shared_lock guard(sNetConfigMapLock);
+    ScopedSharedLockAssertion assume_lock(sNetConfigMapLock);
+    std::vector<std::shared_ptr<NetConfig>> peers;
+    const auto domain = sCacheDomains.find(netid);
+    if (domain == sCacheDomains.end()) return peers;
+    for (const auto& [peerId, peerDomain] : sCacheDomains) {
+        if (peerId == netid || peerDomain != domain->second) continue;
+        if (auto it = sNetConfigMap.find(peerId); it != sNetConfigMap.end()) {
+            peers.push_back(it->second);
+        }
     }
-    return nullptr;
+    return peers;
+}
+
+int resolv_set_cache_domain(unsigned netid, const std::string& domain) {
+    std::shared_ptr<NetConfig> netconfig;
+    {
+        std::lock_guard guard(sNetConfigMapLock);
+        auto it = sNetConfigMap.find(netid);
+        if (it == sNetConfigMap.end()) return -ENONET;
+        netconfig = it->second;
+        if (domain.empty()) {
+            sCacheDomains.erase(netid);
+        } else {
+            sCacheDomains[netid] = domain;
+        }
+    }
+    LOG(INFO) << __func__ << ": netid = " << netid << (domain.empty() ? ", no domain" : "");
+    std::lock_guard guard(netconfig->lock);
+    netconfig->in_cache_domain = !domain.empty();
+    return 0;
 }
 
 static void resolv_set_experiment_params(res_params* params) {
@@ -1551,12 +4325,23 @@ static void resolv_set_experiment_params(res_params* params) {
         params->base_timeout_msec =
                 getExperimentFlagInt("retransmission_time_interval", RES_TIMEOUT);
     }
+
+    if (params->min_timeout_msec == 0) {
+        params->min_timeout_msec =
+                getExperimentFlagInt("adaptive_timeout_min_msec", RES_MIN_ADAPTIVE_TIMEOUT);
+    }
+
+    if (params->max_timeout_msec == 0) {
+        params->max_timeout_msec =
+                getExperimentFlagInt("adaptive_timeout_max_msec", RES_MAX_ADAPTIVE_TIMEOUT);
+    }
 }
 
 android::net::NetworkType resolv_get_network_types_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return android::net::NT_UNKNOWN;
+
+    std::lock_guard guard(netconfig->lock);
     return convert_network_type(netconfig->transportTypes);
 }
 
@@ -1570,9 +4355,10 @@ bool is_mdns_supported_transport_types(const std::vector<int32_t>& transportType
 }
 
 bool is_mdns_supported_network(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return false;
+
+    std::lock_guard guard(netconfig->lock);
     return is_mdns_supported_transport_types(netconfig->transportTypes);
 }
 
@@ -1621,15 +4407,19 @@ bool isValidServer(const std::string& server) {
 
 }  // namespace
 
-std::vector<std::string> getCustomizedTableByName(const size_t netid, const char* hostname) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+std::shared_ptr<const HostsFile::Table> resolv_get_customized_hosts(unsigned netid) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return nullptr;
 
+    std::shared_lock guard(netconfig->lock);
+    return netconfig->customizedTable;
+}
+
+std::vector<std::string> getCustomizedTableByName(const size_t netid, const char* hostname) {
     std::vector<std::string> result;
-    if (netconfig != nullptr) {
-        const auto& hosts = netconfig->customizedTable.equal_range(hostname);
-        for (auto i = hosts.first; i != hosts.second; ++i) {
-            result.push_back(i->second);
+    if (const auto hosts = resolv_get_customized_hosts(netid)) {
+        for (uint32_t index : hosts->findByName(hostname)) {
+            result.push_back(hosts->entry(index).address);
         }
     }
     return result;
@@ -1653,17 +4443,35 @@ int resolv_set_nameservers(unsigned netid, const std::vector<std::string>& serve
         ipSockAddrs.push_back(IPSockAddr::toIPSockAddr(server, 53));
     }
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
-
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return -ENONET;
 
+    std::lock_guard guard(netconfig->lock);
+    // The samples were taken with the servers and parameters being replaced.
+    merge_pending_stats_locked(netconfig.get(), true);
+    // Any of the settings below may change what getaddrinfo returns. This is also how the
+    // resolver hears of link changes, which may move routes and source addresses.
+    invalidate_results_locked(netconfig.get(), true);
+
     uint8_t old_max_samples = netconfig->params.max_samples;
     netconfig->params = params;
     resolv_set_experiment_params(&netconfig->params);
-    if (!resolv_is_nameservers_equal(netconfig->nameservers, nameservers)) {
+    if (Experiments::getInstance()->getFlag("keep_nameserver_stats", 0) == 1) {
+        // The framework pushes the same servers again on every link change, and often just one
+        // more or fewer: only what changed loses its history.
+        if (netconfig->params.max_samples != old_max_samples) {
+            res_cache_clear_stats_locked(netconfig.get());
+        }
+        if (netconfig->nameserverSockAddrs != ipSockAddrs) {
+            for (const auto& server : nameservers) {
+                LOG(INFO) << __func__ << ": netid = " << netid << ", addr = " << server;
+            }
+            replace_nameservers_locked(netconfig.get(), std::move(nameservers),
+                                       std::move(ipSockAddrs));
+        }
+    } else if (!resolv_is_nameservers_equal(netconfig->nameservers, nameservers)) {
         // free current before adding new
-        free_nameservers_locked(netconfig);
+        free_nameservers_locked(netconfig.get());
         netconfig->nameservers = std::move(nameservers);
         for (int i = 0; i < numservers; i++) {
             LOG(INFO) << __func__ << ": netid = " << netid
@@ -1677,7 +4485,7 @@ int resolv_set_nameservers(unsigned netid, const std::vector<std::string>& serve
             // All other parameters do not affect shared state: Changing these parameters does
             // not invalidate the samples, as they only affect aggregation and the conditions
             // under which servers are considered usable.
-            res_cache_clear_stats_locked(netconfig);
+            res_cache_clear_stats_locked(netconfig.get());
         }
     }
 
@@ -1692,19 +4500,24 @@ int resolv_set_nameservers(unsigned netid, const std::vector<std::string>& serve
         return -EINVAL;
     }
     netconfig->transportTypes = transportTypes;
+    int rv = 0;
     if (optionalResolverOptions.has_value()) {
         const ResolverOptionsParcel& resolverOptions = optionalResolverOptions.value();
-        return netconfig->setOptions(resolverOptions);
+        rv = netconfig->setOptions(resolverOptions);
     }
-    return 0;
+    cache_update_partitioning_locked(netconfig.get());
+    return rv;
 }
 
 int resolv_set_options(unsigned netid, const ResolverOptionsParcel& options) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
-
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return -ENONET;
-    return netconfig->setOptions(options);
+
+    std::lock_guard guard(netconfig->lock);
+    invalidate_results_locked(netconfig.get(), false);
+    const int rv = netconfig->setOptions(options);
+    cache_update_partitioning_locked(netconfig.get());
+    return rv;
 }
 
 static bool resolv_is_nameservers_equal(const std::vector<std::string>& oldServers,
@@ -1726,20 +4539,87 @@ static void free_nameservers_locked(NetConfig* netconfig) {
     res_cache_clear_stats_locked(netconfig);
 }
 
+static void invalidate_results_locked(NetConfig* netconfig, bool src_addrs) {
+    // Other servers, or options, may well answer.
+    netconfig->failed_queries.clear();
+    if (!netconfig->cache->generations_enabled) {
+        netconfig->addrinfo_cache.clear();
+        netconfig->addrinfo_lru.clear();
+        if (src_addrs) netconfig->src_addr_cache.clear();
+        return;
+    }
+    // The old results are replaced or evicted by the next ones.
+    netconfig->addrinfo_generation++;
+    if (src_addrs) netconfig->src_addr_generation++;
+}
+
+// Partitions the cache of |netconfig| by UID if its queries are sent with the UID of the app
+// asking, which may keep them from going out, and the "cache_uid_partitions" experiment flag is
+// set. With enforceDnsUid, they're all sent as AID_DNS, so the cache is shared as usual.
+static void cache_update_partitioning_locked(NetConfig* netconfig) {
+    Cache* cache = netconfig->cache.get();
+    const bool partitioned =
+            !netconfig->enforceDnsUid &&
+            Experiments::getInstance()->getFlag("cache_uid_partitions", 0) == 1;
+    if (partitioned == cache->partitioned) return;
+    // Any app may have added the entries there, or had its query fail.
+    if (partitioned) {
+        cache->flush();
+        netconfig->failed_queries.clear();
+    }
+    cache->partitioned = partitioned;
+    LOG(INFO) << __func__ << ": netid = " << netconfig->netid << ", partitioned = " << partitioned;
+}
+
+static void replace_nameservers_locked(NetConfig* netconfig, std::vector<std::string> nameservers,
+                                       std::vector<IPSockAddr> sockAddrs) {
+    // The samples are kept with the index of their server, and the new servers start with none.
+    // The revision id stays: samples still in flight are matched to their server by address.
+    const std::vector<IPSockAddr>& old = netconfig->nameserverSockAddrs;
+    res_stats stats[MAXNS]{};
+    for (size_t i = 0; i < sockAddrs.size() && i < MAXNS; i++) {
+        const size_t j = std::find(old.begin(), old.end(), sockAddrs[i]) - old.begin();
+        if (j < old.size() && j < MAXNS) stats[i] = netconfig->nsstats[j];
+    }
+    std::copy(std::begin(stats), std::end(stats), netconfig->nsstats);
+    netconfig->nameservers = std::move(nameservers);
+    netconfig->nameserverSockAddrs = std::move(sockAddrs);
+}
+
 void resolv_populate_res_for_net(ResState* statp) {
     if (statp == nullptr) {
         return;
     }
     LOG(INFO) << __func__ << ": netid=" << statp->netid;
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(statp->netid);
+    const auto info = find_netconfig(statp->netid);
     if (info == nullptr) return;
 
-    const bool sortNameservers = Experiments::getInstance()->getFlag("sort_nameservers", 0);
+    std::lock_guard guard(info->lock);
+    merge_pending_stats_locked(info.get(), false);
+
+    // Hedged queries are only worth it if the first server tried is the best one.
+    const bool sortNameservers = Experiments::getInstance()->getFlag("sort_nameservers", 0) ||
+                                 Experiments::getInstance()->getFlag("hedged_queries", 0) == 1;
     statp->sort_nameservers = sortNameservers;
-    statp->nsaddrs = sortNameservers ? info->dnsStats.getSortedServers(PROTO_UDP)
-                                     : info->nameserverSockAddrs;
+    if (statp->pinned_server) {
+        statp->nsaddrs = {*statp->pinned_server};
+    } else {
+        statp->nsaddrs = sortNameservers ? info->dnsStats.getSortedServers(PROTO_UDP)
+                                         : info->nameserverSockAddrs;
+        // The server to start with can also depend on how many queries it's answering now.
+        if (const auto mode = ServerLoad::mode(); mode != ServerLoad::Mode::OFF) {
+            const auto candidates = ServerLoad::getInstance().candidates(
+                    statp->netid, statp->nsaddrs, PROTO_UDP, [&](const IPSockAddr& server) {
+                        return info->dnsStats.getLatencyPercentileUs(server, PROTO_UDP, 50);
+                    });
+            std::vector<IPSockAddr> ordered;
+            for (size_t i : ServerLoad::order(mode, candidates)) {
+                ordered.push_back(statp->nsaddrs[i]);
+            }
+            statp->nsaddrs = std::move(ordered);
+        }
+    }
     statp->search_domains = info->search_domains;
     statp->tc_mode = info->tc_mode;
     statp->enforce_dns_uid = info->enforceDnsUid;
@@ -1775,14 +4655,48 @@ static void res_cache_clear_stats_locked(NetConfig* netconfig) {
     ++netconfig->revision_id;
 }
 
+static void add_resolver_stats_sample_locked(NetConfig* info, int revision_id,
+                                             const IPSockAddr& serverSockAddr,
+                                             const res_sample& sample, int max_samples)
+        REQUIRES(info->lock) {
+    if (info->revision_id == revision_id) {
+        const int serverNum = std::min(MAXNS, static_cast<int>(info->nameserverSockAddrs.size()));
+        for (int ns = 0; ns < serverNum; ns++) {
+            if (serverSockAddr == info->nameserverSockAddrs[ns]) {
+                res_cache_add_stats_sample_locked(&info->nsstats[ns], sample, max_samples);
+                return;
+            }
+        }
+    }
+}
+
+static void merge_pending_stats_locked(NetConfig* netconfig, bool force) {
+    if (force ? netconfig->pendingStats.empty() : !netconfig->pendingStats.due()) return;
+    for (const auto& sample : netconfig->pendingStats.take()) {
+        if (sample.event) {
+            netconfig->dnsStats.addStats(sample.server, *sample.event);
+        } else {
+            add_resolver_stats_sample_locked(netconfig, sample.revision_id, sample.server,
+                                             sample.sample, sample.max_samples);
+        }
+    }
+}
+
+// Whether query samples are buffered in PendingStats instead of being recorded right away.
+static bool use_lazy_stats_merge() {
+    return Experiments::getInstance()->getFlag("stats_lazy_merge", 0) == 1;
+}
+
 int android_net_res_stats_get_info_for_net(unsigned netid, int* nscount,
                                            struct sockaddr_storage servers[MAXNS], int* dcount,
                                            char domains[MAXDNSRCH][MAXDNSRCHPATH],
                                            res_params* params, struct res_stats stats[MAXNS],
                                            int* wait_for_pending_req_timeout_count) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
-    if (!info) return -1;
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return -1;
+
+    std::lock_guard guard(info->lock);
+    merge_pending_stats_locked(info.get(), true);
 
     const int num = info->nameserverCount();
     if (num > MAXNS) {
@@ -1809,9 +4723,10 @@ int android_net_res_stats_get_info_for_net(unsigned netid, int* nscount,
 }
 
 std::vector<std::string> resolv_cache_dump_subsampling_map(unsigned netid, bool is_mdns) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return {};
+
+    std::lock_guard guard(netconfig->lock);
     std::vector<std::string> result;
     const auto& subsampling_map = (!is_mdns) ? netconfig->dns_event_subsampling_map
                                              : netconfig->mdns_event_subsampling_map;
@@ -1831,9 +4746,10 @@ std::vector<std::string> resolv_cache_dump_subsampling_map(unsigned netid, bool
 //
 // Returns the subsampling rate if the event should be sampled, or 0 if it should be discarded.
 uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code, bool is_mdns) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return 0;  // Don't log anything at all.
+
+    std::lock_guard guard(netconfig->lock);
     const auto& subsampling_map = (!is_mdns) ? netconfig->dns_event_subsampling_map
                                              : netconfig->mdns_event_subsampling_map;
     auto search_returnCode = subsampling_map.find(return_code);
@@ -1847,11 +4763,24 @@ uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code, boo
     return denom;
 }
 
+uint32_t resolv_cache_draw_event_sample(unsigned netid) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return 0;
+
+    const uint32_t denom = netconfig->min_event_subsampling_denom;
+    const bool drawn = denom != 0 && arc4random_uniform(denom) == 0;
+    (drawn ? netconfig->event_drawn_count : netconfig->event_not_drawn_count)
+            .fetch_add(1, std::memory_order_relaxed);
+    return drawn ? denom : 0;
+}
+
 int resolv_cache_get_resolver_stats(unsigned netid, res_params* params, res_stats stats[MAXNS],
                                     const std::vector<IPSockAddr>& serverSockAddrs) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
-    if (!info) return -1;
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return -1;
+
+    std::lock_guard guard(info->lock);
+    merge_pending_stats_locked(info.get(), false);
 
     for (size_t i = 0; i < serverSockAddrs.size(); i++) {
         for (size_t j = 0; j < info->nameserverSockAddrs.size(); j++) {
@@ -1881,28 +4810,36 @@ void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id,
                                             const res_sample& sample, int max_samples) {
     if (max_samples <= 0) return;
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return;
+
+    const bool lazy = use_lazy_stats_merge();
+    if (lazy) {
+        const bool full = info->pendingStats.add({
+                .server = serverSockAddr,
+                .revision_id = revision_id,
+                .sample = sample,
+                .max_samples = max_samples,
+        });
+        if (!full) return;
+    }
 
-    if (info && info->revision_id == revision_id) {
-        const int serverNum = std::min(MAXNS, static_cast<int>(info->nameserverSockAddrs.size()));
-        for (int ns = 0; ns < serverNum; ns++) {
-            if (serverSockAddr == info->nameserverSockAddrs[ns]) {
-                res_cache_add_stats_sample_locked(&info->nsstats[ns], sample, max_samples);
-                return;
-            }
-        }
+    std::lock_guard guard(info->lock);
+    merge_pending_stats_locked(info.get(), true);
+    if (!lazy) {
+        add_resolver_stats_sample_locked(info.get(), revision_id, serverSockAddr, sample,
+                                         max_samples);
     }
 }
 
 bool has_named_cache(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    return find_named_cache_locked(netid) != nullptr;
+    return find_netconfig(netid) != nullptr;
 }
 
-int resolv_cache_get_expiration(unsigned netid, span<const uint8_t> query, time_t* expiration) {
+int resolv_cache_get_expiration(unsigned netid, span<const uint8_t> query,
+                                std::chrono::milliseconds* expiration) {
     Entry key;
-    *expiration = -1;
+    *expiration = std::chrono::milliseconds(-1);
 
     // A malformed query is not allowed.
     if (!entry_init_key(&key, query)) {
@@ -1911,13 +4848,13 @@ int resolv_cache_get_expiration(unsigned netid, span<const uint8_t> query, time_
     }
 
     // lookup cache.
-    Cache* cache;
-    std::lock_guard guard(cache_mutex);
-    if (cache = find_named_cache_locked(netid); cache == nullptr) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
         LOG(WARNING) << __func__ << ": cache not created in the network " << netid;
         return -ENONET;
     }
-    Entry** lookup = _cache_lookup_p(cache, &key);
+    std::lock_guard guard(netconfig->lock);
+    Entry** lookup = _cache_lookup_p(netconfig->cache.get(), &key);
     Entry* e = *lookup;
     if (e == NULL) {
         LOG(WARNING) << __func__ << ": not in cache";
@@ -1929,10 +4866,17 @@ int resolv_cache_get_expiration(unsigned netid, span<const uint8_t> query, time_
         return -ENODATA;
     }
 
-    *expiration = e->expires;
+    *expiration = e->expires.time_since_epoch();
     return 0;
 }
 
+bool resolv_cache_hash_query(span<const uint8_t> query, unsigned* hash) {
+    Entry key;
+    if (!entry_init_key(&key, query)) return false;
+    *hash = key.hash;
+    return true;
+}
+
 static const char* protocol_to_str(const Protocol proto) {
     switch (proto) {
         case PROTO_UDP:
@@ -1950,13 +4894,183 @@ static const char* protocol_to_str(const Protocol proto) {
     }
 }
 
+int resolv_cache_get_prefetch_count(unsigned netid) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return 0;
+
+    std::lock_guard guard(netconfig->lock);
+    return netconfig->prefetch_count;
+}
+
+bool resolv_cache_lookup_addrinfo(unsigned netid, const std::string& key,
+                                  std::vector<CachedAddrInfo>* addrs) {
+    ScopedStageTimer timer(QueryStage::CACHE_LOOKUP);
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return false;
+
+    std::shared_lock guard(netconfig->lock);
+    const auto it = netconfig->addrinfo_cache.find(key);
+    // Expired and invalidated results are left for resolv_cache_add_addrinfo() to replace.
+    if (it == netconfig->addrinfo_cache.end() || it->second.expires <= _time_now() ||
+        it->second.generation != netconfig->addrinfo_generation) {
+        return false;
+    }
+    it->second.referenced.store(true, std::memory_order_relaxed);
+    *addrs = it->second.addrs;
+    return true;
+}
+
+void resolv_cache_add_addrinfo(unsigned netid, const std::string& key,
+                               std::vector<CachedAddrInfo> addrs, uint32_t ttl) {
+    if (ttl == 0 || addrs.empty()) return;
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
+
+    std::lock_guard guard(netconfig->lock);
+    auto& results = netconfig->addrinfo_cache;
+    auto& lru = netconfig->addrinfo_lru;
+    const CacheTime now = _time_now();
+    const uint32_t generation = netconfig->addrinfo_generation;
+    auto it = results.find(key);
+    if (it == results.end()) {
+        // Evicts the least recently used result, approximately: those looked up since they
+        // were last passed over go back to the front once.
+        while (results.size() >= ADDRINFO_CACHE_MAX_ENTRIES) {
+            const auto oldest = results.find(*lru.back());
+            auto& result = oldest->second;
+            const bool live = result.expires > now && result.generation == generation;
+            if (live && result.referenced.exchange(false, std::memory_order_relaxed)) {
+                lru.splice(lru.begin(), lru, result.lru);
+                continue;
+            }
+            lru.pop_back();
+            results.erase(oldest);
+        }
+        it = results.try_emplace(key).first;
+        lru.push_front(&it->first);
+        it->second.lru = lru.begin();
+    } else {
+        lru.splice(lru.begin(), lru, it->second.lru);
+    }
+    it->second.addrs = std::move(addrs);
+    it->second.expires = now + std::chrono::seconds(ttl);
+    it->second.generation = generation;
+    it->second.referenced.store(false, std::memory_order_relaxed);
+}
+
+bool resolv_cache_lookup_src_addr(unsigned netid, const std::string& key, CachedSrcAddr* result) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return false;
+
+    std::shared_lock guard(netconfig->lock);
+    const auto it = netconfig->src_addr_cache.find(key);
+    if (it == netconfig->src_addr_cache.end() || it->second.expires <= _time_now() ||
+        it->second.generation != netconfig->src_addr_generation) {
+        return false;
+    }
+    *result = it->second.result;
+    return true;
+}
+
+void resolv_cache_add_src_addr(unsigned netid, const std::string& key,
+                               const CachedSrcAddr& result) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
+
+    std::lock_guard guard(netconfig->lock);
+    auto& results = netconfig->src_addr_cache;
+    const CacheTime now = _time_now();
+    const uint32_t generation = netconfig->src_addr_generation;
+    if (results.size() >= SRC_ADDR_CACHE_MAX_ENTRIES && results.find(key) == results.end()) {
+        std::erase_if(results, [now, generation](const auto& item) {
+            return item.second.expires <= now || item.second.generation != generation;
+        });
+        if (results.size() >= SRC_ADDR_CACHE_MAX_ENTRIES) results.erase(results.begin());
+    }
+    results[key] = {result, now + SRC_ADDR_CACHE_TTL, generation};
+}
+
+int resolv_cache_get_shared_hit_count(unsigned netid) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return 0;
+
+    std::lock_guard guard(netconfig->lock);
+    return netconfig->shared_hit_count;
+}
+
+std::vector<ResolvCacheQuestion> resolv_cache_get_hot_questions(unsigned netid, size_t max) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr || max == 0) return {};
+
+    // Counted as lookups go, for the dump, so that the entries needn't be walked.
+    std::vector<HeavyHitters::Item> top;
+    {
+        std::shared_lock guard(netconfig->lock);
+        ScopedSharedLockAssertion assume_lock(netconfig->lock);
+        top = netconfig->cache->top_queries.top();
+    }
+
+    std::vector<ResolvCacheQuestion> questions;
+    for (const HeavyHitters::Item& item : top) {
+        if (questions.size() == max) break;
+        const auto* const p = reinterpret_cast<const uint8_t*>(item.key.data());
+        const uint8_t* const end = p + item.key.size();
+        char name[NS_MAXDNAME];
+        const int len = dn_expand(p, end, p, name, sizeof(name));
+        if (len < 0 || end - p - len < 2 * NS_INT16SZ) continue;
+        if (ns_get16(p + len + NS_INT16SZ) != ns_c_in) continue;
+        questions.push_back({name, ns_get16(p + len)});
+    }
+    return questions;
+}
+
+bool resolv_cache_get_stats_report(unsigned netid, DnsCacheStats* stats) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return false;
+
+    std::lock_guard guard(netconfig->lock);
+    const CacheTime now = _time_now();
+    if (netconfig->last_stats_report &&
+        now - *netconfig->last_stats_report < CACHE_STATS_REPORT_INTERVAL) {
+        return false;
+    }
+    netconfig->last_stats_report = now;
+
+    const Cache* cache = netconfig->cache.get();
+    const auto count = [cache](ResolvCacheStatus status) {
+        return cache->lookup_counts[status].load(std::memory_order_relaxed);
+    };
+    stats->set_hits(count(RESOLV_CACHE_FOUND) + count(RESOLV_CACHE_STALE) +
+                    count(RESOLV_CACHE_PREFETCH));
+    stats->set_misses(count(RESOLV_CACHE_NOTFOUND));
+    stats->set_stale(count(RESOLV_CACHE_STALE));
+    stats->set_expired(cache->expired_count);
+    stats->set_pending_waits(cache->pending_wait_count);
+    stats->set_evicted_expired(cache->eviction_counts[EVICT_EXPIRED]);
+    stats->set_evicted_capacity(cache->eviction_counts[EVICT_CAPACITY]);
+    stats->set_evicted_replaced(cache->eviction_counts[EVICT_REPLACED]);
+    stats->set_evicted_invalidated(cache->eviction_counts[EVICT_INVALIDATED]);
+    for (const uint64_t n : cache->answer_size_counts) stats->add_answer_size_buckets(n);
+    for (const HeavyHitters::Item& item : cache->top_queries.top()) {
+        stats->add_top_query_counts(item.count);
+    }
+    stats->set_entries(cache->num_entries);
+    stats->set_bytes(cache->bytes);
+    stats->set_max_bytes(cache->max_bytes);
+    stats->set_ttl_stretched(cache->ttl_stretched_count);
+    stats->set_ttl_floored(cache->ttl_floored_count);
+    stats->set_ttl_capped(cache->ttl_capped_count);
+    return true;
+}
+
 int resolv_stats_set_addrs(unsigned netid, Protocol proto, const std::vector<std::string>& addrs,
                            int port) {
-    std::lock_guard guard(cache_mutex);
-    const auto info = find_netconfig_locked(netid);
-
+    const auto info = find_netconfig(netid);
     if (info == nullptr) return -ENONET;
 
+    std::lock_guard guard(info->lock);
+    merge_pending_stats_locked(info.get(), true);
+
     std::vector<IPSockAddr> sockAddrs;
     sockAddrs.reserve(addrs.size());
     for (const auto& addr : addrs) {
@@ -1976,13 +5090,51 @@ bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& serv
                       const DnsQueryEvent* record) {
     if (record == nullptr) return false;
 
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
-        return info->dnsStats.addStats(server, *record);
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        const bool lazy = use_lazy_stats_merge();
+        if (lazy) {
+            const bool full = info->pendingStats.add({.server = server, .event = *record});
+            // Whether the server is known isn't checked until the sample is merged.
+            if (!full) return true;
+        }
+        std::lock_guard guard(info->lock);
+        merge_pending_stats_locked(info.get(), true);
+        return lazy || info->dnsStats.addStats(server, *record);
     }
     return false;
 }
 
+std::vector<android::netdutils::IPSockAddr> resolv_stats_get_sorted_servers(unsigned netid,
+                                                                            Protocol proto) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->lock);
+        merge_pending_stats_locked(info.get(), false);
+        return info->dnsStats.getSortedServers(proto);
+    }
+    return {};
+}
+
+std::optional<std::chrono::microseconds> resolv_stats_get_retransmit_timeout(
+        unsigned netid, const android::netdutils::IPSockAddr& server, Protocol proto) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->lock);
+        merge_pending_stats_locked(info.get(), false);
+        return info->dnsStats.getRetransmitTimeoutUs(server, proto);
+    }
+    return std::nullopt;
+}
+
+std::optional<std::chrono::microseconds> resolv_stats_get_latency_percentile(
+        unsigned netid, const android::netdutils::IPSockAddr& server, Protocol proto,
+        int percentile) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->lock);
+        merge_pending_stats_locked(info.get(), false);
+        return info->dnsStats.getLatencyPercentileUs(server, proto, percentile);
+    }
+    return std::nullopt;
+}
+
 static const char* tc_mode_to_str(const int mode) {
     switch (mode) {
         case aidl::android::net::IDnsResolver::TC_MODE_DEFAULT:
@@ -2076,12 +5228,235 @@ static const char* transport_type_to_str(const std::vector<int32_t>& transportTy
     }
 }
 
+// |question| as entry_question() returns it, as text.
+static std::string question_to_string(std::string_view question) {
+    const auto* const p = reinterpret_cast<const uint8_t*>(question.data());
+    const uint8_t* const end = p + question.size();
+    char name[NS_MAXDNAME];
+    const int len = dn_expand(p, end, p, name, sizeof(name));
+    if (len < 0 || end - p - len < 2 * NS_INT16SZ) return "?";
+    return std::string(name) + " " + p_type(ns_get16(p + len));
+}
+
+// What resolv_netconfig_dump() prints of a network and its cache. It's copied under the lock of
+// the network and printed once that is released: the reader of a dump may be slow to drain it,
+// and queries on the network would wait for the lock meanwhile.
+struct NetConfigDump {
+    DnsStats dns_stats;
+    int tc_mode = 0;
+    int serve_stale_sec = 0;
+    int failure_cache_sec = 0;
+    size_t failed_queries = 0;
+    int min_ttl_sec = 0;
+    int max_ttl_sec = 0;
+    int low_ttl_sec = 0;
+    int low_ttl_stretch = 0;
+    int num_entries = 0;
+    size_t bytes = 0;
+    size_t max_bytes = 0;
+    bool flat_table_enabled = false;
+    std::array<uint64_t, RESOLV_CACHE_PREFETCH + 1> lookup_counts{};
+    uint64_t expired_count = 0;
+    uint64_t pending_wait_count = 0;
+    uint64_t pending_race_count = 0;
+    uint64_t ttl_stretched_count = 0;
+    uint64_t ttl_floored_count = 0;
+    uint64_t ttl_capped_count = 0;
+    std::array<uint64_t, EVICT_REASON_COUNT> eviction_counts{};
+    uint64_t not_admitted_count = 0;
+    std::array<uint64_t, CACHE_ANSWER_SIZE_BUCKETS> answer_size_counts{};
+    std::vector<HeavyHitters::Item> top_queries;
+    size_t addrinfo_entries = 0;
+    size_t src_addr_entries = 0;
+    bool in_cache_domain = false;
+    int shared_hit_count = 0;
+    std::vector<int32_t> transport_types;
+};
+
+static void netconfig_get_dump_locked(const NetConfig* info, NetConfigDump* d)
+        REQUIRES_SHARED(info->lock) {
+    const Cache* cache = info->cache.get();
+    d->dns_stats = info->dnsStats;
+    d->tc_mode = info->tc_mode;
+    d->serve_stale_sec = info->serve_stale_sec;
+    d->failure_cache_sec = info->failure_cache_sec;
+    d->failed_queries = info->failed_queries.size();
+    d->min_ttl_sec = info->min_ttl_sec;
+    d->max_ttl_sec = info->max_ttl_sec;
+    d->low_ttl_sec = info->low_ttl_sec;
+    d->low_ttl_stretch = info->low_ttl_stretch;
+    d->num_entries = cache->num_entries;
+    d->bytes = cache->bytes;
+    d->max_bytes = cache->max_bytes;
+    d->flat_table_enabled = cache->flat_table_enabled;
+    for (size_t i = 0; i < d->lookup_counts.size(); i++) {
+        d->lookup_counts[i] = cache->lookup_counts[i].load(std::memory_order_relaxed);
+    }
+    d->expired_count = cache->expired_count;
+    d->pending_wait_count = cache->pending_wait_count;
+    d->pending_race_count = cache->pending_race_count;
+    d->ttl_stretched_count = cache->ttl_stretched_count;
+    d->ttl_floored_count = cache->ttl_floored_count;
+    d->ttl_capped_count = cache->ttl_capped_count;
+    d->eviction_counts = cache->eviction_counts;
+    d->not_admitted_count = cache->not_admitted_count;
+    d->answer_size_counts = cache->answer_size_counts;
+    d->top_queries = cache->top_queries.top();
+    d->addrinfo_entries = info->addrinfo_cache.size();
+    d->src_addr_entries = info->src_addr_cache.size();
+    d->in_cache_domain = info->in_cache_domain;
+    d->shared_hit_count = info->shared_hit_count;
+    d->transport_types = info->transportTypes;
+}
+
+static void cache_dump_stats(DumpWriter& dw, const NetConfigDump& d) {
+    const auto count = [&d](ResolvCacheStatus status) { return d.lookup_counts[status]; };
+    const uint64_t hits =
+            count(RESOLV_CACHE_FOUND) + count(RESOLV_CACHE_STALE) + count(RESOLV_CACHE_PREFETCH);
+    const uint64_t lookups = hits + count(RESOLV_CACHE_NOTFOUND) + count(RESOLV_CACHE_UNSUPPORTED);
+    dw.println("Cache lookups: %" PRIu64 ", hits: %" PRIu64 " (%" PRIu64 "%%)", lookups, hits,
+               lookups > 0 ? hits * 100 / lookups : 0);
+    ScopedIndent indent(dw);
+    dw.println("stale: %" PRIu64 ", prefetching: %" PRIu64 ", misses: %" PRIu64
+               ", unsupported: %" PRIu64,
+               count(RESOLV_CACHE_STALE), count(RESOLV_CACHE_PREFETCH),
+               count(RESOLV_CACHE_NOTFOUND), count(RESOLV_CACHE_UNSUPPORTED));
+    dw.println("found expired: %" PRIu64 ", waited for pending: %" PRIu64
+               ", raced slow pending: %" PRIu64,
+               d.expired_count, d.pending_wait_count, d.pending_race_count);
+    dw.println("TTLs stretched: %" PRIu64 ", floored: %" PRIu64 ", capped: %" PRIu64,
+               d.ttl_stretched_count, d.ttl_floored_count, d.ttl_capped_count);
+    dw.println("evicted expired: %" PRIu64 ", for capacity: %" PRIu64 ", replaced: %" PRIu64
+               ", invalidated: %" PRIu64,
+               d.eviction_counts[EVICT_EXPIRED], d.eviction_counts[EVICT_CAPACITY],
+               d.eviction_counts[EVICT_REPLACED], d.eviction_counts[EVICT_INVALIDATED]);
+    dw.println("not admitted: %" PRIu64, d.not_admitted_count);
+    std::string sizes;
+    for (size_t i = 0; i < CACHE_ANSWER_SIZE_BUCKETS; i++) {
+        // The last bucket holds what the one before doesn't.
+        const bool last = i + 1 == CACHE_ANSWER_SIZE_BUCKETS;
+        const size_t bound = size_t{1} << (CACHE_ANSWER_SIZE_MIN_SHIFT + i - last);
+        if (i > 0) sizes += ", ";
+        sizes += (last ? ">" : "<=") + std::to_string(bound) + ": " +
+                 std::to_string(d.answer_size_counts[i]);
+    }
+    dw.println("answer sizes: %s", sizes.c_str());
+    if (d.top_queries.empty()) return;
+    dw.println("most looked up:");
+    ScopedIndent topIndent(dw);
+    for (const HeavyHitters::Item& item : d.top_queries) {
+        dw.println("%s: %" PRIu64 " (error %" PRIu64 ")", question_to_string(item.key).c_str(),
+                   item.count, item.error);
+    }
+}
+
+// Approximations of the memory held by standard containers, for resolv_cache_get_memory_usage():
+// what their elements take, plus a few pointers per node of the trees and hash tables.
+template <typename T>
+static size_t vector_bytes(const std::vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+template <typename Map>
+static size_t tree_bytes(const Map& m) {
+    return m.size() * (sizeof(typename Map::value_type) + 4 * sizeof(void*));
+}
+
+template <typename Map>
+static size_t hash_bytes(const Map& m) {
+    return m.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*)) +
+           m.bucket_count() * sizeof(void*);
+}
+
+// Only what a string holds outside of itself, which short strings don't.
+static size_t string_bytes(const std::string& s) {
+    return s.capacity() + 1 > sizeof(std::string) ? s.capacity() + 1 : 0;
+}
+
+static size_t strings_bytes(const std::vector<std::string>& v) {
+    size_t bytes = vector_bytes(v);
+    for (const auto& s : v) bytes += string_bytes(s);
+    return bytes;
+}
+
+static size_t cache_memory_usage_locked(const Cache* cache) {
+    size_t bytes = cache->arena.bytes() + vector_bytes(cache->entries) +
+                   vector_bytes(cache->flat_slots) + vector_bytes(cache->expiry_heap) +
+                   hash_bytes(cache->addr_index) + hash_bytes(cache->pending_requests) +
+                   vector_bytes(cache->partitions);
+    bytes += tree_bytes(cache->rrsets) + cache->rrset_lru.size() * 3 * sizeof(void*);
+    for (const auto& [key, rrset] : cache->rrsets) {
+        bytes += string_bytes(key.first) + strings_bytes(rrset.rdata);
+    }
+    bytes += tree_bytes(cache->nsec_ranges);
+    for (const auto& [key, range] : cache->nsec_ranges) {
+        bytes += string_bytes(key) + string_bytes(range.owner) + string_bytes(range.next);
+    }
+    bytes += tree_bytes(cache->nsec3_zones);
+    for (const auto& [name, zone] : cache->nsec3_zones) {
+        bytes += string_bytes(name) + string_bytes(zone.salt) + tree_bytes(zone.ranges);
+        for (const auto& [hash, range] : zone.ranges) {
+            bytes += string_bytes(hash) + string_bytes(range.next);
+        }
+    }
+    bytes += tree_bytes(cache->https_hints);
+    for (const auto& [name, hints] : cache->https_hints) {
+        bytes += string_bytes(name) + strings_bytes(hints.ipv4) + strings_bytes(hints.ipv6);
+    }
+    return bytes;
+}
+
+bool resolv_cache_get_memory_usage(unsigned netid, ResolvCacheMemoryUsage* usage) {
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return false;
+    std::shared_lock guard(info->lock);
+
+    usage->cache = cache_memory_usage_locked(info->cache.get()) + hash_bytes(info->addrinfo_cache) +
+                   info->addrinfo_lru.size() * 3 * sizeof(void*) + hash_bytes(info->src_addr_cache);
+    for (const auto& [key, result] : info->addrinfo_cache) {
+        usage->cache += string_bytes(key) + vector_bytes(result.addrs);
+        for (const auto& addr : result.addrs) usage->cache += string_bytes(addr.canonname);
+    }
+    for (const auto& [key, result] : info->src_addr_cache) usage->cache += string_bytes(key);
+    usage->cache_peak = info->cache->arena.peakBytes();
+    usage->hosts = info->customizedTable != nullptr ? info->customizedTable->memoryUsage() : 0;
+    usage->stats = info->dnsStats.memoryUsage() + sizeof(info->nsstats);
+    return true;
+}
+
 void resolv_netconfig_dump(DumpWriter& dw, unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
-        info->dnsStats.dump(dw);
-        // TODO: dump info->hosts
-        dw.println("TC mode: %s", tc_mode_to_str(info->tc_mode));
-        dw.println("TransportType: %s", transport_type_to_str(info->transportTypes));
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return;
+    NetConfigDump d;
+    {
+        std::lock_guard guard(info->lock);
+        merge_pending_stats_locked(info.get(), true);
+        netconfig_get_dump_locked(info.get(), &d);
+    }
+
+    d.dns_stats.dump(dw);
+    // TODO: dump info->hosts
+    dw.println("TC mode: %s", tc_mode_to_str(d.tc_mode));
+    dw.println("Serve stale: %ds", d.serve_stale_sec);
+    if (d.failure_cache_sec > 0) {
+        dw.println("Failure cache: %ds, %zu questions", d.failure_cache_sec, d.failed_queries);
+    }
+    dw.println("Cache TTL: min %ds, max %ds, stretch below %ds by %d", d.min_ttl_sec,
+               d.max_ttl_sec, d.low_ttl_sec, d.low_ttl_stretch);
+    dw.println("Cache size: %d entries, %zu of %zu bytes", d.num_entries, d.bytes, d.max_bytes);
+    dw.println("Cache table: %s", d.flat_table_enabled ? "flat" : "chained");
+    cache_dump_stats(dw, d);
+    if (d.addrinfo_entries > 0) {
+        dw.println("Addrinfo cache size: %zu entries", d.addrinfo_entries);
+    }
+    if (d.src_addr_entries > 0) {
+        dw.println("Source address cache size: %zu entries", d.src_addr_entries);
+    }
+    if (d.in_cache_domain) {
+        dw.println("Cache domain: shared, %d hits from peers", d.shared_hit_count);
     }
+    dw.println("DnsEvent sampling: %" PRIu64 " drawn, %" PRIu64 " not drawn",
+               info->event_drawn_count.load(std::memory_order_relaxed),
+               info->event_not_drawn_count.load(std::memory_order_relaxed));
+    dw.println("TransportType: %s", transport_type_to_str(d.transport_types));
 }
@@ -73,10 +73,48 @@
 #include "res_comp.h"
 
 #include <arpa/nameser.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <unistd.h>
 
+namespace {
+
+// The EDNS0 bitstring label type (RFC 2673), which only ns_name_uncompress() knows how to print.
+constexpr uint8_t kLabelTypeBitstring = 0x41;
+
+// Characters that ns_name_ntop() escapes with a backslash.
+bool isSpecial(uint8_t c) {
+    switch (c) {
+        case '"':
+        case '.':
+        case ';':
+        case '\\':
+        case '(':
+        case ')':
+        case '@':
+        case '$':
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool isPrintable(uint8_t c) {
+    return c > 0x20 && c < 0x7f;
+}
+
+uint8_t toLower(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+int fail() {
+    errno = EMSGSIZE;
+    return -1;
+}
+
+}  // namespace
+
 /*
  * Expand compressed domain name 'src' to full domain name.
  * 'msg' is a pointer to the begining of the message,
@@ -85,10 +123,84 @@
  * Return size of compressed name or -1 if there was an error.
  */
 int dn_expand(const uint8_t* msg, const uint8_t* eom, const uint8_t* src, char* dst, int dstsiz) {
-    int n = ns_name_uncompress(msg, eom, src, dst, (size_t) dstsiz);
+    if (eom < msg || dstsiz < 0) return fail();
+    return dn_expand({msg, eom}, src, {dst, static_cast<size_t>(dstsiz)}, nullptr);
+}
 
-    if (n > 0 && dst[0] == '.') dst[0] = '\0';
-    return n;
+// ns_name_uncompress() unpacks the name into wire format, then prints that. This does both in the
+// same pass, with the same checks, and so the same results.
+int dn_expand(std::span<const uint8_t> msg, const uint8_t* src, std::span<char> dst,
+              std::string_view* name) {
+    const uint8_t* const eom = msg.data() + msg.size();
+    if (src < msg.data() || src >= eom) return fail();
+    char* dn = dst.data();
+    char* const dnEnd = dn + dst.size();
+    const uint8_t* p = src;
+    int len = -1;
+    size_t checked = 0;
+    // Of the name in wire format, without the root label.
+    size_t wireLen = 0;
+
+    while (const uint8_t n = *p++) {
+        switch (n & NS_CMPRSFLGS) {
+            case 0:
+                if (wireLen + n + 1 >= NS_MAXCDNAME || p + n >= eom) return fail();
+                wireLen += n + 1;
+                checked += n + 1;
+                if (dn != dst.data()) {
+                    if (dn >= dnEnd) return fail();
+                    *dn++ = '.';
+                }
+                if (dn + n >= dnEnd) return fail();
+                for (const uint8_t* const labelEnd = p + n; p < labelEnd; p++) {
+                    const uint8_t c = *p;
+                    if (isSpecial(c)) {
+                        if (dn + 1 >= dnEnd) return fail();
+                        *dn++ = '\\';
+                        *dn++ = c;
+                    } else if (!isPrintable(c)) {
+                        if (dn + 3 >= dnEnd) return fail();
+                        *dn++ = '\\';
+                        *dn++ = '0' + c / 100;
+                        *dn++ = '0' + c % 100 / 10;
+                        *dn++ = '0' + c % 10;
+                    } else {
+                        if (dn >= dnEnd) return fail();
+                        *dn++ = c;
+                    }
+                }
+                break;
+            case NS_CMPRSFLGS: {
+                if (p >= eom) return fail();
+                if (len < 0) len = p - src + 1;
+                const size_t target = ((n & 0x3f) << 8) | *p;
+                if (target >= msg.size()) return fail();
+                p = msg.data() + target;
+                // Having looked at the whole message means there's a loop.
+                checked += 2;
+                if (checked >= msg.size()) return fail();
+                break;
+            }
+            default:
+                if (n != kLabelTypeBitstring) return fail();
+                len = ns_name_uncompress(msg.data(), eom, src, dst.data(), dst.size());
+                if (len > 0 && dst[0] == '.') dst[0] = '\0';
+                if (len > 0 && name != nullptr) *name = dst.data();
+                return len;
+        }
+    }
+    if (len < 0) len = p - src;
+
+    if (dn == dst.data()) {
+        // The root is printed as ".", but dn_expand() has always returned it as "".
+        if (dst.size() < 2) return fail();
+        *dn = '\0';
+    } else {
+        if (dn >= dnEnd) return fail();
+        *dn = '\0';
+    }
+    if (name != nullptr) *name = std::string_view(dst.data(), dn - dst.data());
+    return len;
 }
 
 /*
@@ -111,6 +223,139 @@ int dn_skipname(const uint8_t* ptr, const uint8_t* eom) {
     return (ptr - saveptr);
 }
 
+namespace android::net {
+
+namespace {
+
+// The hash of the suffix starting with the label at |p|, given that of the suffix after it.
+uint32_t suffixHash(const uint8_t* p, uint32_t next) {
+    // FNV-1a, seeded with the rest of the name.
+    uint32_t hash = next ^ 2166136261u;
+    for (const uint8_t* const end = p + 1 + *p; p < end; p++) {
+        hash = (hash ^ toLower(*p)) * 16777619u;
+    }
+    return hash;
+}
+
+// Where pointers can point.
+constexpr size_t kMaxPointerOffset = 0x3fff;
+
+}  // namespace
+
+bool DnsNameCompressor::matches(size_t offset, const uint8_t* labels) const {
+    // Bounds the pointers followed, against loops.
+    for (size_t hops = 0; hops < NS_MAXCDNAME;) {
+        if (offset >= mMsg.size()) return false;
+        const uint8_t n = mMsg[offset];
+        if ((n & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+            if (offset + 1 >= mMsg.size()) return false;
+            offset = ((n & 0x3f) << 8) | mMsg[offset + 1];
+            hops++;
+            continue;
+        }
+        if (n != *labels || offset + 1 + n > mMsg.size()) return false;
+        if (n == 0) return true;
+        for (size_t i = 1; i <= n; i++) {
+            if (toLower(mMsg[offset + i]) != toLower(labels[i])) return false;
+        }
+        offset += 1 + n;
+        labels += 1 + n;
+    }
+    return false;
+}
+
+int DnsNameCompressor::find(uint32_t hash, const uint8_t* labels) const {
+    for (size_t i = hash % mSlots.size();; i = (i + 1) % mSlots.size()) {
+        const Slot& slot = mSlots[i];
+        if (slot.offset == 0) return -1;
+        if (slot.hash == hash && matches(slot.offset, labels)) return slot.offset;
+    }
+}
+
+void DnsNameCompressor::insert(uint32_t hash, size_t offset) {
+    // Keeps a free slot, which ends the probing in find(). Slots taken first are probed first, so
+    // the first of equal suffixes is the one pointed to, as with dn_comp().
+    if (offset == 0 || offset > kMaxPointerOffset || mSuffixes >= kMaxSuffixes) return;
+    size_t i = hash % mSlots.size();
+    while (mSlots[i].offset != 0) i = (i + 1) % mSlots.size();
+    mSlots[i] = {.hash = hash, .offset = static_cast<uint16_t>(offset)};
+    mSuffixes++;
+}
+
+bool DnsNameCompressor::addName(size_t offset) {
+    // The name, with the place in the message of each of its labels up to the first pointer.
+    uint8_t wire[NS_MAXCDNAME];
+    size_t labels[NS_MAXCDNAME / 2];
+    size_t count = 0;
+    size_t literal = 0;
+    size_t len = 0;
+    bool pointed = false;
+    for (size_t hops = 0; offset < mMsg.size();) {
+        const uint8_t n = mMsg[offset];
+        if ((n & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+            if (offset + 1 >= mMsg.size() || ++hops >= NS_MAXCDNAME) return false;
+            offset = ((n & 0x3f) << 8) | mMsg[offset + 1];
+            pointed = true;
+            continue;
+        }
+        if ((n & NS_CMPRSFLGS) != 0 || offset + 1 + n > mMsg.size() || len + 1 + n > sizeof(wire)) {
+            return false;
+        }
+        memcpy(wire + len, &mMsg[offset], 1 + n);
+        if (n == 0) break;
+        if (!pointed) labels[literal++] = offset;
+        len += 1 + n;
+        count++;
+        offset += 1 + n;
+    }
+    if (offset >= mMsg.size()) return false;
+
+    // Hashes each suffix from the last, to add those starting before the first pointer.
+    uint32_t hashes[NS_MAXCDNAME / 2];
+    uint32_t hash = 0;
+    const uint8_t* p = wire;
+    const uint8_t* starts[NS_MAXCDNAME / 2];
+    for (size_t i = 0; i < count; i++, p += 1 + *p) starts[i] = p;
+    for (size_t i = count; i-- > 0;) hashes[i] = hash = suffixHash(starts[i], hash);
+    for (size_t i = 0; i < literal; i++) insert(hashes[i], labels[i]);
+    return true;
+}
+
+int DnsNameCompressor::compress(const char* name, size_t offset) {
+    uint8_t wire[NS_MAXCDNAME];
+    if (ns_name_pton(name, wire, sizeof(wire)) < 0) return -1;
+
+    const uint8_t* starts[NS_MAXCDNAME / 2];
+    size_t count = 0;
+    const uint8_t* root = wire;
+    for (; *root != 0; root += 1 + *root) starts[count++] = root;
+    uint32_t hashes[NS_MAXCDNAME / 2];
+    uint32_t hash = 0;
+    for (size_t i = count; i-- > 0;) hashes[i] = hash = suffixHash(starts[i], hash);
+
+    // The longest suffix already in the message is the first one found.
+    size_t literal = count;
+    int target = -1;
+    for (size_t i = 0; i < count && target < 0; i++) {
+        target = find(hashes[i], starts[i]);
+        if (target >= 0) literal = i;
+    }
+    const size_t literalLen = (target >= 0 ? starts[literal] : root + 1) - wire;
+    const size_t size = literalLen + (target >= 0 ? NS_INT16SZ : 0);
+    if (offset > mMsg.size() || mMsg.size() - offset < size) return -1;
+
+    uint8_t* const dst = mMsg.data() + offset;
+    memcpy(dst, wire, literalLen);
+    if (target >= 0) {
+        dst[literalLen] = NS_CMPRSFLGS | (target >> 8);
+        dst[literalLen + 1] = target;
+    }
+    for (size_t i = 0; i < literal; i++) insert(hashes[i], offset + (starts[i] - wire));
+    return size;
+}
+
+}  // namespace android::net
+
 /*
  * Verify that a domain name uses an acceptable character set.
  */
@@ -16,11 +16,60 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <array>
+#include <span>
+#include <string_view>
+
 int dn_expand(const uint8_t* msg, const uint8_t* eom, const uint8_t* src, char* dst, int dstsiz);
+// As above, and points |name|, if not null, at the expanded name in |dst|.
+int dn_expand(std::span<const uint8_t> msg, const uint8_t* src, std::span<char> dst,
+              std::string_view* name);
 int dn_comp(const char* src, uint8_t* dst, int dstsiz, uint8_t** dnptrs, uint8_t** lastdnptr);
 int dn_skipname(const uint8_t* ptr, const uint8_t* eom);
 
 bool res_hnok(const char* dn);
 bool res_dnok(const char* dn);
+
+namespace android::net {
+
+// Compresses the names written to a message, as dn_comp() does with a list of the names written
+// so far. dn_comp() compares each suffix of a new name with every suffix of those names; this
+// looks each suffix up in a hash table of them instead. This class is not thread-safe.
+class DnsNameCompressor {
+  public:
+    // For the message being written to |msg|.
+    explicit DnsNameCompressor(std::span<uint8_t> msg) : mMsg(msg) {}
+
+    // Lets later names point to the name already in the message at |offset|, e.g. the question
+    // copied from a query. Returns false if it isn't a valid name.
+    bool addName(size_t offset);
+
+    // Writes |name|, in presentation format, to the message at |offset|, pointing to the longest
+    // suffix of it already there. Returns the size of the compressed name, or -1 if |name| isn't
+    // valid or doesn't fit.
+    int compress(const char* name, size_t offset);
+
+  private:
+    // Suffixes past this many are written without being added, so later names point to them less.
+    static constexpr size_t kMaxSuffixes = 48;
+
+    struct Slot {
+        uint32_t hash;
+        // Of the suffix in mMsg. 0, where the header is, for an empty slot.
+        uint16_t offset;
+    };
+
+    // Whether the name at |offset| in the message is |labels|, ignoring ASCII case.
+    bool matches(size_t offset, const uint8_t* labels) const;
+    int find(uint32_t hash, const uint8_t* labels) const;
+    void insert(uint32_t hash, size_t offset);
+
+    const std::span<uint8_t> mMsg;
+    std::array<Slot, 64> mSlots{};
+    size_t mSuffixes = 0;
+};
+
+}  // namespace android::net
@@ -82,10 +82,14 @@
 #include <android-base/logging.h>
 #include <netd_resolv/resolv.h>  // NET_CONTEXT_FLAG_USE_DNS_OVER_TLS
 
+#include "QueryTrace.h"
 #include "res_comp.h"
 #include "res_debug.h"
 #include "resolv_private.h"  // ResState*
 
+using android::net::QueryStage;
+using android::net::ScopedStageTimer;
+
 // Queries will be padded to a multiple of this length when EDNS0 is active.
 constexpr uint16_t kEdns0Padding = 128;
 
@@ -103,6 +107,7 @@ int res_nmkquery(int op,                         // opcode of query
                  std::span<const uint8_t> data,  // resource record data
                  std::span<uint8_t> buf,         // buffer to put query
                  int netcontext_flags) {
+    ScopedStageTimer timer(QueryStage::QUERY_BUILD);
     HEADER* hp;
     uint8_t *cp, *ep;
     int n;
@@ -189,9 +194,13 @@ int res_nmkquery(int op,                         // opcode of query
     return (cp - buf.data());
 }
 
-int res_nopt(ResState* statp, int n0, /* current offset in buffer */
-             std::span<uint8_t> buf,  /* buffer to put query */
-             int anslen)              /* UDP answer buffer size */
+int res_nopt(ResState* statp, int n0, std::span<uint8_t> buf, int anslen) {
+    return res_nopt(statp->netcontext_flags, n0, buf, anslen);
+}
+
+int res_nopt(uint32_t netcontext_flags, int n0, /* current offset in buffer */
+             std::span<uint8_t> buf,            /* buffer to put query */
+             int anslen)                        /* UDP answer buffer size */
 {
     HEADER* hp = reinterpret_cast<HEADER*>(buf.data());
     uint8_t *cp, *ep;
@@ -214,7 +223,7 @@ int res_nopt(ResState* statp, int n0, /* current offset in buffer */
     cp += INT16SZ;
     *cp++ = NOERROR; /* extended RCODE */
     *cp++ = 0;       /* EDNS version */
-    if (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_DNS_OVER_TLS) {
+    if (netcontext_flags & NET_CONTEXT_FLAG_USE_DNS_OVER_TLS) {
         LOG(DEBUG) << __func__ << ": ENDS0 DNSSEC";
         flags |= NS_OPT_DNSSEC_OK;
     }
@@ -83,9 +83,16 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
 #include <android-base/logging.h>
 
+#include "Experiments.h"
+#include "QueryThreadPool.h"
 #include "res_debug.h"
+#include "res_send.h"
 #include "resolv_cache.h"
 #include "resolv_private.h"
 
@@ -248,10 +255,30 @@ int res_nsearch(ResState* statp, const char* name, /* domain name */
          */
         resolv_populate_res_for_net(statp);
 
-        for (const auto& domain : statp->search_domains) {
+        std::vector<std::future<ResSearchResult>> pending;
+        if (res_search_in_parallel(statp)) {
+            pending = res_search_async(
+                    statp, [name = std::string(name), cl, type, size = answer.size()](
+                                   ResState* res, const std::string& domain,
+                                   ResSearchResult* result) {
+                        android::net::PacketBuffer& ans = result->answers.emplace_back(size);
+                        result->ret = res_nquerydomain(res, name.c_str(), domain.c_str(), cl, type,
+                                                       ans, &result->herrno);
+                        result->lengths.push_back(result->ret);
+                    });
+        }
+
+        for (size_t i = 0; i < statp->search_domains.size(); i++) {
+            const std::string& domain = statp->search_domains[i];
             if (domain == "." || domain == "") ++root_on_list;
 
-            ret = res_nquerydomain(statp, name, domain.c_str(), cl, type, answer, herrno);
+            if (pending.empty()) {
+                ret = res_nquerydomain(statp, name, domain.c_str(), cl, type, answer, herrno);
+            } else {
+                const ResSearchResult result = pending[i].get();
+                std::copy_n(result.answers[0].data(), result.answers[0].size(), answer.begin());
+                ret = res_search_take(statp, result, herrno);
+            }
             if (ret > 0) return ret;
 
             /*
@@ -317,6 +344,67 @@ int res_nsearch(ResState* statp, const char* name, /* domain name */
     return -1;
 }
 
+// The most search domains of a lookup that res_search_async() queries at once.
+constexpr size_t kMaxParallelSearchDomains = 3;
+
+bool res_search_in_parallel(const ResState* statp) {
+    return statp->search_domains.size() > 1 &&
+           android::net::Experiments::getInstance()->getFlag("parallel_search", 0) == 1 &&
+           android::net::QueryThreadPool::getInstance() != nullptr &&
+           android::net::ScopedCacheOnlyLookup::current() == nullptr;
+}
+
+std::vector<std::future<ResSearchResult>> res_search_async(ResState* statp,
+                                                           const ResSearchQuery& query) {
+    // Shared with the workers, so that the futures don't wait for them when dropped, as
+    // std::async() ones would.
+    struct Search {
+        ResSearchQuery query;
+        std::vector<ResState> states;
+        std::vector<std::string> domains;
+        std::vector<std::promise<ResSearchResult>> promises;
+        std::atomic<size_t> next = 0;
+    };
+    auto search = std::make_shared<Search>();
+    search->query = query;
+    search->domains = statp->search_domains;
+    search->promises.resize(search->domains.size());
+    std::vector<std::future<ResSearchResult>> results;
+    for (size_t i = 0; i < search->domains.size(); i++) {
+        search->states.push_back(statp->clone());
+        results.push_back(search->promises[i].get_future());
+    }
+
+    // Each worker takes the next domain in search list order, so the first ones go first.
+    const auto work = [search] {
+        for (size_t i; (i = search->next++) < search->domains.size();) {
+            ResSearchResult result;
+            ResState& res = search->states[i];
+            res.event = &result.event;
+            errno = 0;
+            search->query(&res, search->domains[i], &result);
+            result.qerrno = errno;
+            search->promises[i].set_value(std::move(result));
+        }
+    };
+    android::net::QueryThreadPool* const pool = android::net::QueryThreadPool::getInstance();
+    size_t started = 0;
+    for (size_t i = 0; i < std::min(search->domains.size(), kMaxParallelSearchDomains); i++) {
+        if (pool == nullptr || pool->execute(work, "res_search") != 0) break;
+        started++;
+    }
+    // Nothing else would fulfill the promises.
+    if (started == 0) work();
+    return results;
+}
+
+int res_search_take(ResState* statp, const ResSearchResult& result, int* herrno) {
+    statp->event->MergeFrom(result.event);
+    *herrno = result.herrno;
+    errno = result.qerrno;
+    return result.ret;
+}
+
 /*
  * Perform a call on res_query on the concatenation of name and domain,
  * removing a trailing dot from name if domain is NULL.
@@ -75,8 +75,19 @@
  */
 
 #define LOG_TAG "resolv"
+#define ATRACE_TAG ATRACE_TAG_NETWORK
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <sys/param.h>
 #include <sys/socket.h>
@@ -99,20 +110,33 @@
 
 #include <android-base/logging.h>
 #include <android-base/result.h>
+#include <android-base/thread_annotations.h>
 #include <android/multinetwork.h>  // ResNsendFlags
 
 #include <netdutils/Slice.h>
 #include <netdutils/Stopwatch.h>
+#include <utils/Trace.h>
+#include "CircuitBreaker.h"
+#include "DnsTcpConnection.h"
 #include "DnsTlsDispatcher.h"
 #include "DnsTlsTransport.h"
+#include "DnsUdpReactor.h"
 #include "Experiments.h"
+#include "MdnsCache.h"
 #include "PrivateDnsConfiguration.h"
+#include "QueryLimiter.h"
+#include "QueryThreadPool.h"
+#include "QueryTrace.h"
+#include "ResolvTrace.h"
+#include "ServerLoad.h"
+#include "UdpPayloadTracker.h"
 #include "netd_resolv/resolv.h"
 #include "private/android_filesystem_config.h"
 
 #include "doh.h"
 #include "res_comp.h"
 #include "res_debug.h"
+#include "res_send.h"
 #include "resolv_cache.h"
 #include "stats.h"
 #include "stats.pb.h"
@@ -125,15 +149,19 @@ using android::base::Result;
 using android::base::unique_fd;
 using android::net::CacheStatus;
 using android::net::DnsQueryEvent;
+using android::net::DnsTcpConnection;
+using android::net::DnsTcpConnectionPool;
 using android::net::DnsTlsDispatcher;
 using android::net::DnsTlsServer;
 using android::net::DnsTlsTransport;
+using android::net::DnsUdpReactor;
 using android::net::Experiments;
 using android::net::IpVersion;
 using android::net::IV_IPV4;
 using android::net::IV_IPV6;
 using android::net::IV_UNKNOWN;
 using android::net::LinuxErrno;
+using android::net::MdnsCache;
 using android::net::NetworkDnsEventReported;
 using android::net::NS_T_AAAA;
 using android::net::NS_T_INVALID;
@@ -142,11 +170,17 @@ using android::net::NsType;
 using android::net::PrivateDnsConfiguration;
 using android::net::PrivateDnsMode;
 using android::net::PrivateDnsModes;
+using android::net::CircuitBreaker;
 using android::net::PrivateDnsStatus;
 using android::net::PROTO_DOH;
+using android::net::PROTO_DOT;
 using android::net::PROTO_MDNS;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
+using android::net::QueryStage;
+using android::net::ScopedCacheOnlyLookup;
+using android::net::ScopedStageTimer;
+using android::net::ServerLoad;
 using android::netdutils::IPSockAddr;
 using android::netdutils::Slice;
 using android::netdutils::Stopwatch;
@@ -156,13 +190,17 @@ const std::vector<IPSockAddr> mdns_addrs = {IPSockAddr::toIPSockAddr("ff02::fb",
                                             IPSockAddr::toIPSockAddr("224.0.0.251", 5353)};
 
 static int setupUdpSocket(ResState* statp, const sockaddr* sockap, unique_fd* fd_out, int* terrno);
+static void releaseUdpSockets(ResState* statp);
+static int get_hedge_delay_ms(ResState* statp, const res_params* params, size_t ns);
 static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
                    int* terrno, size_t* ns, int* v_circuit, int* gotsomewhere, time_t* at,
-                   int* rcode, int* delay);
+                   int* rcode, int* delay, int hedge_delay_ms, bool listen_all);
 static int send_vc(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
                    int* terrno, size_t ns, time_t* at, int* rcode, int* delay);
 static int send_mdns(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int* terrno,
-                     int* rcode);
+                     int* rcode, size_t* group);
+static int send_mdns_parallel(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                              int* terrno, int* rcode, size_t* group);
 static void dump_error(const char*, const struct sockaddr*);
 
 static int sock_eq(struct sockaddr*, struct sockaddr*);
@@ -170,9 +208,13 @@ static int connect_with_timeout(int sock, const struct sockaddr* nsap, socklen_t
                                 const struct timespec timeout);
 static int retrying_poll(const int sock, short events, const struct timespec* finish);
 static int res_private_dns_send(ResState*, const Slice query, const Slice answer, int* rcode,
-                                bool* fallback);
+                                bool* fallback, uint32_t flags,
+                                android::net::Protocol* answeredBy);
 static int res_tls_send(const std::list<DnsTlsServer>& tlsServers, ResState*, const Slice query,
                         const Slice answer, int* rcode, PrivateDnsMode mode);
+static int res_tls_race_send(const std::list<DnsTlsServer>& tlsServers, ResState*,
+                             const Slice query, const Slice answer, int* rcode, bool* fallback,
+                             uint32_t flags, android::net::Protocol* answeredBy);
 static ssize_t res_doh_send(ResState*, const Slice query, const Slice answer, int* rcode);
 
 NsType getQueryType(span<const uint8_t> msg) {
@@ -437,8 +479,111 @@ static bool isNetworkRestricted(int terrno) {
     return (terrno == EPERM);
 }
 
+// Takes the servers whose circuit breaker for |protocol| is open out of |usable_servers|, unless
+// that leaves none, and returns how many it took out.
+static int skip_open_circuits(ResState* statp, android::net::Protocol protocol,
+                              bool usable_servers[]) {
+    CircuitBreaker& breaker = CircuitBreaker::getInstance();
+    bool open[MAXNS] = {};
+    int usable = 0;
+    int opened = 0;
+    for (int ns = 0; ns < statp->nameserverCount(); ns++) {
+        if (!usable_servers[ns]) continue;
+        usable++;
+        open[ns] = !breaker.allows(statp->netid, statp->nsaddrs[ns], protocol);
+        if (open[ns]) opened++;
+    }
+    if (opened == 0 || opened == usable) return 0;
+    for (int ns = 0; ns < statp->nameserverCount(); ns++) {
+        if (open[ns]) usable_servers[ns] = false;
+    }
+    return opened;
+}
+
+// Tells the circuit breaker of server |ns| whether the query sent to it over |protocol| was
+// answered or timed out.
+static void record_circuit_outcome(ResState* statp, size_t ns, android::net::Protocol protocol,
+                                   bool answered, int terrno, int timeoutsToOpen) {
+    if (timeoutsToOpen <= 0 || isNetworkRestricted(terrno)) return;
+    CircuitBreaker& breaker = CircuitBreaker::getInstance();
+    if (answered) {
+        breaker.onAnswer(statp->netid, statp->nsaddrs[ns], protocol);
+    } else if (terrno == ETIMEDOUT) {
+        breaker.onTimeout(statp->netid, statp->nsaddrs[ns], protocol, statp->mark,
+                          timeoutsToOpen);
+    }
+}
+
+bool res_nprefetch(ResState* statp, span<const uint8_t> msg, uint32_t flags,
+                  std::function<void()> done) {
+    auto event = std::make_shared<NetworkDnsEventReported>();
+    // The answer is for the cache, whether or not the client is still there.
+    auto state = std::make_shared<ResState>(statp->clone(event.get()));
+    state->cancellation.reset();
+    const int rval = QueryThreadPool::executeBackground(
+            [state, event, query = std::vector<uint8_t>(msg.begin(), msg.end()), flags, done] {
+                std::vector<uint8_t> ans(MAXPACKET);
+                int rcode;
+                res_nsend(state.get(), query, ans, &rcode, flags);
+                if (done) done();
+            },
+            "res_nprefetch");
+    if (rval != 0) {
+        LOG(DEBUG) << __func__ << ": dropped: " << strerror(-rval);
+        return false;
+    }
+    return true;
+}
+
+namespace android::net {
+
+namespace {
+
+thread_local ScopedCacheOnlyLookup* tCurrentLookup = nullptr;
+
+}  // namespace
+
+ScopedCacheOnlyLookup::ScopedCacheOnlyLookup() : mPrevious(tCurrentLookup) {
+    tCurrentLookup = this;
+}
+
+ScopedCacheOnlyLookup::~ScopedCacheOnlyLookup() {
+    tCurrentLookup = mPrevious;
+}
+
+ScopedCacheOnlyLookup* ScopedCacheOnlyLookup::current() {
+    return tCurrentLookup;
+}
+
+}  // namespace android::net
+
+// Resolve |msg| again with res_nprefetch(), bypassing the cache lookup, so that the expired or
+// expiring answer that was just served gets replaced by a fresh one. The refresh counts against
+// the limits of the client it's for, and is skipped if they're reached.
+static void refresh_cached_answer(ResState* statp, span<const uint8_t> msg, uint32_t flags) {
+    auto& limiter = android::net::getQueryLimiter();
+    const uid_t uid = statp->uid;
+    if (!limiter.start(uid, true)) return;
+    if (!res_nprefetch(statp, msg, flags | ANDROID_RESOLV_NO_CACHE_LOOKUP,
+                       [&limiter, uid] { limiter.finish(uid); })) {
+        limiter.finish(uid);
+    }
+}
+
+// Tells the cache that |msg| failed with |rcode|. SERVFAIL and timeouts are remembered, so that
+// asking again fails fast; a query that was cancelled didn't really time out.
+static void cache_query_failed(ResState* statp, span<const uint8_t> msg, uint32_t flags,
+                               int rcode) {
+    if (!statp->isCancelled() && (rcode == SERVFAIL || rcode == RCODE_TIMEOUT)) {
+        resolv_cache_add_failure(statp->netid, msg, flags, rcode);
+    } else {
+        _resolv_cache_query_failed(statp->netid, msg, flags);
+    }
+}
+
 int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int* rcode,
               uint32_t flags, std::chrono::milliseconds sleepTimeMs) {
+    ATRACE_CALL();
     LOG(DEBUG) << __func__;
 
     // Should not happen
@@ -451,32 +596,84 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
 
     int anslen = 0;
     Stopwatch cacheStopwatch;
-    ResolvCacheStatus cache_status = resolv_cache_lookup(statp->netid, msg, ans, &anslen, flags);
+    ScopedCacheOnlyLookup* const cacheOnly = ScopedCacheOnlyLookup::current();
+    std::optional<int> leaderFailure;
+    ResolvCacheStatus cache_status =
+            cacheOnly != nullptr
+                    ? resolv_cache_peek(statp->netid, msg, ans, &anslen, flags, statp->uid)
+                    : resolv_cache_lookup(statp->netid, msg, ans, &anslen, flags, statp->uid,
+                                          &leaderFailure);
+    if (cacheOnly != nullptr && cache_status != RESOLV_CACHE_FOUND) {
+        cacheOnly->setMissed();
+        errno = EWOULDBLOCK;
+        return -EWOULDBLOCK;
+    }
     const int32_t cacheLatencyUs = saturate_cast<int32_t>(cacheStopwatch.timeTakenUs());
-    if (cache_status == RESOLV_CACHE_FOUND) {
+    if (cache_status == RESOLV_CACHE_FOUND || cache_status == RESOLV_CACHE_STALE ||
+        cache_status == RESOLV_CACHE_PREFETCH) {
         HEADER* hp = (HEADER*)(void*)ans.data();
         *rcode = hp->rcode;
         DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
         dnsQueryEvent->set_latency_micros(cacheLatencyUs);
-        dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
+        // An answer that needs refreshing is still a cache hit as far as the caller is concerned.
+        dnsQueryEvent->set_cache_hit(CacheStatus::CS_FOUND);
         dnsQueryEvent->set_type(getQueryType(msg));
+        if (cache_status != RESOLV_CACHE_FOUND) {
+            refresh_cached_answer(statp, msg, flags);
+        }
         return anslen;
     } else if (cache_status != RESOLV_CACHE_UNSUPPORTED) {
         // had a cache miss for a known network, so populate the thread private
         // data so the normal resolve path can do its thing
         resolv_populate_res_for_net(statp);
     }
+    if (leaderFailure) {
+        // The same query, sent by another lookup that this one waited for, just failed.
+        *rcode = *leaderFailure;
+        LOG(DEBUG) << __func__ << ": failed while waited for with rcode " << *rcode;
+        // TODO: Remove errno once callers stop using it
+        errno = ETIMEDOUT;
+        return -ETIMEDOUT;
+    }
+    if (cache_status == RESOLV_CACHE_NOTFOUND &&
+        resolv_cache_lookup_failure(statp->netid, msg, flags, rcode)) {
+        LOG(DEBUG) << __func__ << ": failed recently with rcode " << *rcode;
+        _resolv_cache_query_failed(statp->netid, msg, flags);
+        // TODO: Remove errno once callers stop using it
+        errno = ETIMEDOUT;
+        return -ETIMEDOUT;
+    }
 
     // MDNS
     if (isMdnsResolution(statp->flags)) {
+        // Answers from multicast responders go in an MdnsCache of their own, which honors their
+        // goodbyes and cache-flush bits.
+        const bool useMdnsCache = MdnsCache::isEnabled();
+        if (useMdnsCache) {
+            Stopwatch mdnsCacheStopwatch;
+            MdnsCache::getInstance().listen(statp->netid, statp->mark);
+            const int resplen = MdnsCache::getInstance().lookup(statp->netid, msg, ans);
+            if (resplen > 0) {
+                _resolv_cache_query_failed(statp->netid, msg, flags);
+                *rcode = NOERROR;
+                DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
+                dnsQueryEvent->set_latency_micros(
+                        saturate_cast<int32_t>(mdnsCacheStopwatch.timeTakenUs()));
+                dnsQueryEvent->set_cache_hit(CacheStatus::CS_FOUND);
+                dnsQueryEvent->set_protocol(PROTO_MDNS);
+                dnsQueryEvent->set_type(getQueryType(msg));
+                return resplen;
+            }
+        }
+
         // Use an impossible error code as default value.
         int terrno = ETIME;
         int resplen = 0;
         *rcode = RCODE_INTERNAL_ERROR;
         Stopwatch queryStopwatch;
-        resplen = send_mdns(statp, msg, ans, &terrno, rcode);
-        const IPSockAddr& receivedMdnsAddr =
-                (getQueryType(msg) == NS_T_AAAA) ? mdns_addrs[0] : mdns_addrs[1];
+        size_t group = (getQueryType(msg) == NS_T_AAAA) ? 0 : 1;
+        resplen = send_mdns(statp, msg, ans, &terrno, rcode, &group);
+        const IPSockAddr& receivedMdnsAddr = mdns_addrs[group];
         DnsQueryEvent* mDnsQueryEvent = addDnsQueryEvent(statp->event);
         mDnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
         mDnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(queryStopwatch.timeTakenUs()));
@@ -491,8 +688,12 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             LOG(DEBUG) << __func__ << ": got answer from mDNS:";
             res_pquery(ans.first(resplen));
 
-            if (cache_status == RESOLV_CACHE_NOTFOUND) {
-                resolv_cache_add(statp->netid, msg, {ans.data(), resplen});
+            if (useMdnsCache) {
+                MdnsCache::getInstance().absorb(statp->netid, MdnsCache::kUnknownInterface,
+                                                ans.first(resplen));
+                _resolv_cache_query_failed(statp->netid, msg, flags);
+            } else if (cache_status == RESOLV_CACHE_NOTFOUND) {
+                resolv_cache_add(statp->netid, msg, {ans.data(), resplen}, statp->uid);
             }
             return resplen;
         }
@@ -513,19 +714,22 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
     // Private DNS
     if (!(statp->netcontext_flags & NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS)) {
         bool fallback = false;
-        int resplen =
-                res_private_dns_send(statp, Slice(const_cast<uint8_t*>(msg.data()), msg.size()),
-                                     Slice(ans.data(), ans.size()), rcode, &fallback);
+        android::net::Protocol answeredBy = PROTO_DOT;
+        int resplen = res_private_dns_send(
+                statp, Slice(const_cast<uint8_t*>(msg.data()), msg.size()),
+                Slice(ans.data(), ans.size()), rcode, &fallback, flags, &answeredBy);
         if (resplen > 0) {
             LOG(DEBUG) << __func__ << ": got answer from Private DNS";
             res_pquery(ans.first(resplen));
             if (cache_status == RESOLV_CACHE_NOTFOUND) {
-                resolv_cache_add(statp->netid, msg, ans.first(resplen));
+                // The cleartext query of a DoT race may have answered instead.
+                const bool privateDns = answeredBy == PROTO_DOT || answeredBy == PROTO_DOH;
+                resolv_cache_add(statp->netid, msg, ans.first(resplen), statp->uid, privateDns);
             }
             return resplen;
         }
         if (!fallback) {
-            _resolv_cache_query_failed(statp->netid, msg, flags);
+            cache_query_failed(statp, msg, flags, *rcode);
             return -ETIMEDOUT;
         }
     }
@@ -557,6 +761,13 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
         }
     }
 
+    // Servers that stopped answering are skipped until a probe gets an answer from them.
+    const int timeoutsToOpen = CircuitBreaker::timeoutsToOpen();
+    if (timeoutsToOpen > 0) {
+        usableServersCount -= skip_open_circuits(
+                statp, msg.size() > PACKETSZ ? PROTO_TCP : PROTO_UDP, usable_servers);
+    }
+
     // TODO: Let it always choose the first nameserver when sort_nameservers is enabled.
     if ((flags & ANDROID_RESOLV_NO_RETRY) && usableServersCount > 1) {
         auto hp = reinterpret_cast<const HEADER*>(msg.data());
@@ -573,10 +784,41 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
 
     // Use an impossible error code as default value
     int terrno = ETIME;
+    // With hedged queries, the first round doesn't wait for a server to time out before querying
+    // the next one, and takes the first answer from any of them.
+    const bool hedgedQueries = !(flags & ANDROID_RESOLV_NO_RETRY) &&
+                               Experiments::getInstance()->getFlag("hedged_queries", 0) == 1;
+    int hedgeAttempts = 0;
+    int hedgeAttemptOf[MAXNS] = {};
+    // When each server that the hedged query moved on from was queried, until its outcome is
+    // recorded: it only timed out if it still hasn't answered once the race is over, whether
+    // another server answered or none did.
+    time_t hedgedPastAt[MAXNS] = {};
+    const auto recordHedgedTimeouts = [&](std::optional<size_t> winner) {
+        for (size_t i = 0; i < statp->nsaddrs.size(); ++i) {
+            if (hedgedPastAt[i] == 0) continue;
+            const time_t at = std::exchange(hedgedPastAt[i], 0);
+            if (winner == i) continue;
+            res_sample sample;
+            res_stats_set_sample(&sample, at, RCODE_TIMEOUT, 0);
+            resolv_cache_add_resolver_stats_sample(statp->netid, revision_id, statp->nsaddrs[i],
+                                                   sample, params.max_samples);
+            record_circuit_outcome(statp, i, PROTO_UDP, false, ETIMEDOUT, timeoutsToOpen);
+        }
+    };
+    // With adaptive EDNS, each server is offered the UDP payload size learned for it, in a copy of
+    // the query, and the answers it's known to truncate are asked for over TCP straight away.
+    UdpPayloadTracker& payloadTracker = UdpPayloadTracker::getInstance();
+    const uint16_t queryPayloadSize =
+            UdpPayloadTracker::isEnabled() ? UdpPayloadTracker::getPayloadSize(msg) : 0;
+    std::vector<uint8_t> udpMsg;
+    if (queryPayloadSize > 0) udpMsg.assign(msg.begin(), msg.end());
     // plaintext DNS
-    for (int attempt = 0; attempt < retryTimes; ++attempt) {
+    for (int attempt = 0; attempt < retryTimes && !statp->isCancelled(); ++attempt) {
         for (size_t ns = 0; ns < statp->nsaddrs.size(); ++ns) {
             if (!usable_servers[ns]) continue;
+            // Nobody is left to read the answer.
+            if (statp->isCancelled()) break;
 
             *rcode = RCODE_INTERNAL_ERROR;
 
@@ -585,6 +827,14 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             LOG(DEBUG) << __func__ << ": Querying server (# " << ns + 1
                        << ") address = " << serverSockAddr.toString();
 
+            bool speculativeTcp = false;
+            if (!useTcp && queryPayloadSize > 0 &&
+                payloadTracker.expectsTruncation(statp->netid, serverSockAddr, msg)) {
+                LOG(DEBUG) << __func__ << ": answer expected to be truncated, using TCP";
+                useTcp = true;
+                speculativeTcp = true;
+            }
+
             ::android::net::Protocol query_proto = useTcp ? PROTO_TCP : PROTO_UDP;
             time_t query_time = 0;
             int delay = 0;
@@ -594,13 +844,18 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             Stopwatch queryStopwatch;
             int retry_count_for_event = 0;
             size_t actualNs = ns;
+            bool hedgeFired = false;
             // Use an impossible error code as default value
             terrno = ETIME;
             if (useTcp) {
-                // TCP; at most one attempt per server.
-                attempt = retryTimes;
-                resplen =
-                        send_vc(statp, &params, msg, ans, &terrno, ns, &query_time, rcode, &delay);
+                // TCP; at most one attempt per server, unless it's sent instead of UDP.
+                if (!speculativeTcp) attempt = retryTimes;
+                {
+                    ATRACE_NAME("res_nsend tcp attempt");
+                    ServerLoad::ScopedQuery load(statp->netid, serverSockAddr, PROTO_TCP);
+                    resplen = send_vc(statp, &params, msg, ans, &terrno, ns, &query_time, rcode,
+                                      &delay);
+                }
 
                 if (msg.size() <= PACKETSZ && resplen <= 0 &&
                     statp->tc_mode == aidl::android::net::IDnsResolver::TC_MODE_UDP_TCP) {
@@ -608,12 +863,51 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
                     // TCP fallback retry and current server does not support TCP connectin
                     useTcp = false;
                 }
+                if (speculativeTcp && resplen <= 0) {
+                    // Ask the same server again over UDP, and stop expecting truncation from it.
+                    payloadTracker.onTcpFailed(statp->netid, serverSockAddr, msg);
+                    useTcp = false;
+                }
                 LOG(INFO) << __func__ << ": used send_vc " << resplen << " terrno: " << terrno;
             } else {
                 // UDP
-                resplen = send_dg(statp, &params, msg, ans, &terrno, &actualNs, &useTcp,
-                                  &gotsomewhere, &query_time, rcode, &delay);
+                int hedgeDelayMs = 0;
+                if (hedgedQueries && attempt == 0 &&
+                    std::any_of(usable_servers + ns + 1, usable_servers + statp->nameserverCount(),
+                                [](bool usable) { return usable; })) {
+                    hedgeDelayMs = get_hedge_delay_ms(statp, &params, ns);
+                }
+                const bool racing = hedgeAttempts > 0;
+                if (hedgeDelayMs > 0 || racing) hedgeAttemptOf[ns] = ++hedgeAttempts;
+                span<const uint8_t> udpQuery = msg;
+                uint16_t payloadSize = 0;
+                if (queryPayloadSize > 0) {
+                    payloadSize =
+                            std::min(queryPayloadSize,
+                                     payloadTracker.payloadSize(statp->netid, serverSockAddr));
+                    UdpPayloadTracker::setPayloadSize(udpMsg, payloadSize);
+                    udpQuery = udpMsg;
+                }
+                {
+                    ATRACE_NAME("res_nsend udp attempt");
+                    ServerLoad::ScopedQuery load(statp->netid, serverSockAddr, PROTO_UDP);
+                    resplen = send_dg(statp, &params, udpQuery, ans, &terrno, &actualNs, &useTcp,
+                                      &gotsomewhere, &query_time, rcode, &delay, hedgeDelayMs,
+                                      racing);
+                }
+                // Not getting an answer in time only means the next server gets queried too.
+                hedgeFired = hedgeDelayMs > 0 && resplen == 0 && terrno == ETIMEDOUT;
+                if (hedgeFired) hedgedPastAt[ns] = query_time;
                 fallbackTCP = useTcp ? true : false;
+                // An answer from a server raced against this one wasn't offered |payloadSize|.
+                if (payloadSize > 0 && actualNs == ns) {
+                    if (resplen > 0) {
+                        payloadTracker.onAnswer(statp->netid, serverSockAddr, msg, payloadSize,
+                                                fallbackTCP);
+                    } else if (terrno == ETIMEDOUT && !hedgeFired) {
+                        payloadTracker.onTimeout(statp->netid, serverSockAddr, payloadSize);
+                    }
+                }
                 retry_count_for_event = attempt;
                 LOG(INFO) << __func__ << ": used send_dg " << resplen << " terrno: " << terrno;
             }
@@ -634,11 +928,22 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             dnsQueryEvent->set_protocol(query_proto);
             dnsQueryEvent->set_type(getQueryType(msg));
             dnsQueryEvent->set_linux_errno(static_cast<LinuxErrno>(terrno));
+            if (!useTcp && hedgeAttemptOf[ns] > 0) {
+                dnsQueryEvent->set_hedge_attempt(hedgeAttemptOf[ns]);
+                if (resplen > 0) dnsQueryEvent->set_hedge_winner(hedgeAttemptOf[actualNs]);
+            }
+
+            // Every attempt counts towards the circuit breaker, which is about timeouts in a row.
+            if (actualNs == ns && !hedgeFired) {
+                record_circuit_outcome(statp, ns, query_proto, resplen > 0, terrno,
+                                       timeoutsToOpen);
+            }
 
             // Only record stats the first time we try a query. This ensures that
             // queries that deterministically fail (e.g., a name that always returns
             // SERVFAIL or times out) do not unduly affect the stats.
-            if (shouldRecordStats) {
+            // A server that was merely raced against the next one hasn't timed out either.
+            if (shouldRecordStats && !hedgeFired) {
                 // (b/151166599): This is a workaround to prevent that DnsResolver calculates the
                 // reliability of DNS servers from being broken when network restricted mode is
                 // enabled.
@@ -655,11 +960,11 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
                 }
             }
 
-            if (resplen == 0) continue;
-            if (fallbackTCP) {
+            if (fallbackTCP || (speculativeTcp && resplen <= 0)) {
                 ns--;
                 continue;
             }
+            if (resplen == 0) continue;
             if (resplen < 0) {
                 _resolv_cache_query_failed(statp->netid, msg, flags);
                 statp->closeSockets();
@@ -668,13 +973,17 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
 
             LOG(DEBUG) << __func__ << ": got answer:";
             res_pquery(ans.first(resplen));
+            recordHedgedTimeouts(actualNs);
 
             if (cache_status == RESOLV_CACHE_NOTFOUND) {
-                resolv_cache_add(statp->netid, msg, {ans.data(), resplen});
+                resolv_cache_add(statp->netid, msg, {ans.data(), resplen}, statp->uid);
             }
+            releaseUdpSockets(statp);
             statp->closeSockets();
             return (resplen);
         }  // for each ns
+        // Only the first round is hedged. Nobody waited for the servers of a cancelled query.
+        if (!statp->isCancelled()) recordHedgedTimeouts(std::nullopt);
     }  // for each retry
     statp->closeSockets();
     terrno = useTcp ? terrno : gotsomewhere ? ETIMEDOUT : ECONNREFUSED;
@@ -683,22 +992,34 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
                    : gotsomewhere ? ETIMEDOUT /* no answer obtained */
                                   : ECONNREFUSED /* no nameservers found */;
 
-    _resolv_cache_query_failed(statp->netid, msg, flags);
+    cache_query_failed(statp, msg, flags, *rcode);
     return -terrno;
 }
 
-static struct timespec get_timeout(ResState* statp, const res_params* params, const int addrIndex) {
+static struct timespec get_timeout(ResState* statp, const res_params* params, const int addrIndex,
+                                   ::android::net::Protocol proto) {
     int msec;
-    msec = params->base_timeout_msec << addrIndex;
-    // Legacy algorithm which scales the timeout by nameserver number.
-    // For instance, with 4 nameservers: 5s, 2.5s, 5s, 10s
-    // This has no effect with 1 or 2 nameservers
-    if (addrIndex > 0) {
-        msec /= statp->nameserverCount();
-    }
-    // For safety, don't allow OEMs and experiments to configure a timeout shorter than 1s.
-    if (msec < 1000) {
-        msec = 1000;  // Use at least 1000ms
+    const auto rto = Experiments::getInstance()->getFlag("adaptive_timeout", 0) == 1
+                             ? resolv_stats_get_retransmit_timeout(
+                                       statp->netid, statp->nsaddrs[addrIndex], proto)
+                             : std::nullopt;
+    if (rto) {
+        // Adapt to how fast the server usually answers, within the configured bounds.
+        const int64_t rtoMs = rto->count() / 1000;
+        msec = std::clamp<int64_t>(rtoMs, params->min_timeout_msec,
+                                   std::max(params->min_timeout_msec, params->max_timeout_msec));
+    } else {
+        msec = params->base_timeout_msec << addrIndex;
+        // Legacy algorithm which scales the timeout by nameserver number.
+        // For instance, with 4 nameservers: 5s, 2.5s, 5s, 10s
+        // This has no effect with 1 or 2 nameservers
+        if (addrIndex > 0) {
+            msec /= statp->nameserverCount();
+        }
+        // For safety, don't allow OEMs and experiments to configure a timeout shorter than 1s.
+        if (msec < 1000) {
+            msec = 1000;  // Use at least 1000ms
+        }
     }
     LOG(INFO) << __func__ << ": using timeout of " << msec << " msec";
 
@@ -708,6 +1029,134 @@ static struct timespec get_timeout(ResState* statp, const res_params* params, co
     return result;
 }
 
+// With hedged queries, the next server is queried once the current one took longer than this
+// percentile of its latency, or the default delay if it is unknown.
+constexpr int kHedgeLatencyPercentile = 90;
+constexpr int kHedgeMinDelayMs = 50;
+constexpr int kHedgeDefaultDelayMs = 500;
+
+// Returns how long to wait for an answer from server |ns| before also querying the next server,
+// or 0 if the next server is only queried once |ns| timed out.
+static int get_hedge_delay_ms(ResState* statp, const res_params* params, size_t ns) {
+    const auto latency = resolv_stats_get_latency_percentile(statp->netid, statp->nsaddrs[ns],
+                                                             PROTO_UDP, kHedgeLatencyPercentile);
+    const int msec = latency ? std::max<int>(kHedgeMinDelayMs, latency->count() / 1000)
+                             : kHedgeDefaultDelayMs;
+    const timespec timeout = get_timeout(statp, params, ns, PROTO_UDP);
+    if (msec >= timeout.tv_sec * 1000 + timeout.tv_nsec / 1000000) return 0;
+    LOG(INFO) << __func__ << ": hedging after " << msec << " msec";
+    return msec;
+}
+
+// return  1 - setup tcp socket success.
+// return  0 - bind error, connect error, protocol error.
+// return -1 - create socket fail, except |EPROTONOSUPPORT| EPFNOSUPPORT |EAFNOSUPPORT|.
+//             set socket option fail.
+static int setupTcpSocket(ResState* statp, const res_params* params, size_t ns, unique_fd* fd_out,
+                          int* terrno, int* rcode) {
+    ScopedStageTimer timer(QueryStage::SOCKET_SETUP);
+    const sockaddr_storage ss = statp->nsaddrs[ns];
+    const sockaddr* nsap = reinterpret_cast<const sockaddr*>(&ss);
+
+    fd_out->reset(socket(nsap->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (*fd_out < 0) {
+        *terrno = errno;
+        PLOG(DEBUG) << __func__ << ": socket(vc): ";
+        switch (errno) {
+            case EPROTONOSUPPORT:
+            case EPFNOSUPPORT:
+            case EAFNOSUPPORT:
+                return 0;
+            default:
+                return -1;
+        }
+    }
+    const uid_t uid = statp->enforce_dns_uid ? AID_DNS : statp->uid;
+    resolv_tag_socket(*fd_out, uid, statp->pid);
+    if (statp->mark != MARK_UNSET) {
+        if (setsockopt(*fd_out, SOL_SOCKET, SO_MARK, &statp->mark, sizeof(statp->mark)) < 0) {
+            *terrno = errno;
+            PLOG(DEBUG) << __func__ << ": setsockopt: ";
+            fd_out->reset();
+            return -1;
+        }
+    }
+    errno = 0;
+    if (random_bind(*fd_out, nsap->sa_family) < 0) {
+        *terrno = errno;
+        dump_error("bind/vc", nsap);
+        return 0;
+    }
+    if (connect_with_timeout(*fd_out, nsap, sockaddrSize(nsap),
+                             get_timeout(statp, params, ns, PROTO_TCP)) < 0) {
+        *terrno = errno;
+        dump_error("connect/vc", nsap);
+        /*
+         * The way connect_with_timeout() is implemented prevents us from reliably
+         * determining whether this was really a timeout or e.g. ECONNREFUSED. Since
+         * currently both cases are handled in the same way, there is no need to
+         * change this (yet). If we ever need to reliably distinguish between these
+         * cases, both connect_with_timeout() and retrying_poll() need to be
+         * modified, though.
+         */
+        *rcode = RCODE_TIMEOUT;
+        return 0;
+    }
+    return 1;
+}
+
+// Like send_vc(), but over a connection kept open between queries and shared with the other
+// queries to the same server. A kept connection the server closed in the meantime is replaced
+// by a new one.
+static int send_vc_pooled(ResState* statp, res_params* params, span<const uint8_t> msg,
+                          span<uint8_t> ans, int* terrno, size_t ns, int* rcode, int* delay,
+                          std::chrono::milliseconds idleTimeout) {
+    auto& pool = DnsTcpConnectionPool::getInstance();
+    const DnsTcpConnectionPool::Key key = {
+            .netid = statp->netid,
+            .mark = statp->mark,
+            .uid = statp->enforce_dns_uid ? AID_DNS : statp->uid,
+            .server = statp->nsaddrs[ns],
+    };
+    for (bool retried = false;; retried = true) {
+        std::shared_ptr<DnsTcpConnection> connection = pool.get(key, idleTimeout);
+        const bool reused = connection != nullptr;
+        if (!reused) {
+            unique_fd fd;
+            if (int result = setupTcpSocket(statp, params, ns, &fd, terrno, rcode); result <= 0) {
+                return result;
+            }
+            connection = std::make_shared<DnsTcpConnection>(std::move(fd));
+            pool.put(key, connection, idleTimeout);
+        }
+        LOG(DEBUG) << __func__ << (reused ? ": reused VC connection" : ": new VC connection");
+
+        const timespec start_time = evNowTime();
+        const timespec timeout = get_timeout(statp, params, ns, PROTO_TCP);
+        const auto deadline = DnsTcpConnection::clock::now() +
+                              std::chrono::seconds(timeout.tv_sec) +
+                              std::chrono::nanoseconds(timeout.tv_nsec);
+        int resplen;
+        {
+            ScopedStageTimer timer(QueryStage::UPSTREAM_WAIT);
+            resplen = connection->query(msg, ans, deadline);
+        }
+        if (resplen > 0) {
+            timespec done = evNowTime();
+            *delay = res_stats_calculate_rtt(&done, &start_time);
+            *rcode = reinterpret_cast<const HEADER*>(ans.data())->rcode;
+            *terrno = 0;
+            return resplen;
+        }
+        *terrno = -resplen;
+        if (resplen == -ETIMEDOUT) {
+            *rcode = RCODE_TIMEOUT;
+            return 0;
+        }
+        if (!reused || retried) return 0;
+    }
+}
+
 static int send_vc(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
                    int* terrno, size_t ns, time_t* at, int* rcode, int* delay) {
     *at = time(NULL);
@@ -715,7 +1164,6 @@ static int send_vc(ResState* statp, res_params* params, span<const uint8_t> msg,
     const HEADER* hp = (const HEADER*)(const void*)msg.data();
     HEADER* anhp = (HEADER*)(void*)ans.data();
     struct sockaddr* nsap;
-    int nsaplen;
     int truncating, connreset, n;
     uint8_t* cp;
 
@@ -728,9 +1176,15 @@ static int send_vc(ResState* statp, res_params* params, span<const uint8_t> msg,
         return -1;
     }
 
+    if (const int idleTimeoutMs =
+                Experiments::getInstance()->getFlag("tcp_connection_idle_timeout_ms", 0);
+        idleTimeoutMs > 0) {
+        return send_vc_pooled(statp, params, msg, ans, terrno, ns, rcode, delay,
+                              std::chrono::milliseconds(idleTimeoutMs));
+    }
+
     sockaddr_storage ss = statp->nsaddrs[ns];
     nsap = reinterpret_cast<sockaddr*>(&ss);
-    nsaplen = sockaddrSize(nsap);
 
     connreset = 0;
 same_ns:
@@ -755,51 +1209,10 @@ same_ns:
     if (statp->tcp_nssock < 0 || (statp->flags & RES_F_VC) == 0) {
         if (statp->tcp_nssock >= 0) statp->closeSockets();
 
-        statp->tcp_nssock.reset(socket(nsap->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0));
-        if (statp->tcp_nssock < 0) {
-            *terrno = errno;
-            PLOG(DEBUG) << __func__ << ": socket(vc): ";
-            switch (errno) {
-                case EPROTONOSUPPORT:
-                case EPFNOSUPPORT:
-                case EAFNOSUPPORT:
-                    return 0;
-                default:
-                    return -1;
-            }
-        }
-        const uid_t uid = statp->enforce_dns_uid ? AID_DNS : statp->uid;
-        resolv_tag_socket(statp->tcp_nssock, uid, statp->pid);
-        if (statp->mark != MARK_UNSET) {
-            if (setsockopt(statp->tcp_nssock, SOL_SOCKET, SO_MARK, &statp->mark,
-                           sizeof(statp->mark)) < 0) {
-                *terrno = errno;
-                PLOG(DEBUG) << __func__ << ": setsockopt: ";
-                return -1;
-            }
-        }
-        errno = 0;
-        if (random_bind(statp->tcp_nssock, nsap->sa_family) < 0) {
-            *terrno = errno;
-            dump_error("bind/vc", nsap);
-            statp->closeSockets();
-            return (0);
-        }
-        if (connect_with_timeout(statp->tcp_nssock, nsap, (socklen_t)nsaplen,
-                                 get_timeout(statp, params, ns)) < 0) {
-            *terrno = errno;
-            dump_error("connect/vc", nsap);
-            statp->closeSockets();
-            /*
-             * The way connect_with_timeout() is implemented prevents us from reliably
-             * determining whether this was really a timeout or e.g. ECONNREFUSED. Since
-             * currently both cases are handled in the same way, there is no need to
-             * change this (yet). If we ever need to reliably distinguish between these
-             * cases, both connect_with_timeout() and retrying_poll() need to be
-             * modified, though.
-             */
-            *rcode = RCODE_TIMEOUT;
-            return (0);
+        const int result = setupTcpSocket(statp, params, ns, &statp->tcp_nssock, terrno, rcode);
+        if (result <= 0) {
+            if (statp->tcp_nssock >= 0) statp->closeSockets();
+            return result;
         }
         statp->flags |= RES_F_VC;
     }
@@ -825,9 +1238,12 @@ same_ns:
 read_len:
     cp = ans.data();
     len = INT16SZ;
-    while ((n = read(statp->tcp_nssock, (char*)cp, (size_t)len)) > 0) {
-        cp += n;
-        if ((len -= n) == 0) break;
+    {
+        ScopedStageTimer timer(QueryStage::UPSTREAM_WAIT);
+        while ((n = read(statp->tcp_nssock, (char*)cp, (size_t)len)) > 0) {
+            cp += n;
+            if ((len -= n) == 0) break;
+        }
     }
     if (n <= 0) {
         *terrno = errno;
@@ -1019,11 +1435,47 @@ static Result<std::vector<int>> udpRetryingPoll(ResState* statp, const timespec*
     }
 }
 
+// Same as udpRetryingPoll, or retrying_poll on the socket of server |addrInfo| if it's not -1,
+// but waits on the shared reactor thread instead of polling from this one.
+static Result<std::vector<int>> udpReactorPoll(ResState* statp, int addrInfo,
+                                               const timespec* finish) {
+    std::vector<int> fds;
+    for (size_t i = 0; i < statp->nsaddrs.size(); ++i) {
+        if (addrInfo != -1 && i != static_cast<size_t>(addrInfo)) continue;
+        if (statp->udpsocks[i] != -1) fds.push_back(statp->udpsocks[i]);
+    }
+    const timespec now = evNowTime();
+    const timespec timeout = (evCmpTime(*finish, now) > 0) ? evSubTime(*finish, now)
+                                                           : evConsTime(0L, 0L);
+    const auto deadline = DnsUdpReactor::clock::now() + std::chrono::seconds(timeout.tv_sec) +
+                          std::chrono::nanoseconds(timeout.tv_nsec);
+    auto result = DnsUdpReactor::getInstance().wait(fds, deadline).get();
+    if (!result.ok()) {
+        errno = result.error().code();
+        PLOG(INFO) << __func__ << ": failed";
+        return result;
+    }
+    if (addrInfo != -1) {
+        int error;
+        socklen_t len = sizeof(error);
+        if (getsockopt(fds[0], SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+            errno = error;
+            PLOG(INFO) << __func__ << ": getsockopt failed";
+            return ErrnoError();
+        }
+    }
+    return result;
+}
+
 static Result<std::vector<int>> udpRetryingPollWrapper(ResState* statp, int addrInfo,
-                                                       const timespec* finish) {
+                                                       bool listenAll, const timespec* finish) {
+    ScopedStageTimer timer(QueryStage::UPSTREAM_WAIT);
     const bool keepListeningUdp =
             android::net::Experiments::getInstance()->getFlag("keep_listening_udp", 0);
-    if (keepListeningUdp) return udpRetryingPoll(statp, finish);
+    if (DnsUdpReactor::isEnabled()) {
+        return udpReactorPoll(statp, (keepListeningUdp || listenAll) ? -1 : addrInfo, finish);
+    }
+    if (keepListeningUdp || listenAll) return udpRetryingPoll(statp, finish);
 
     if (int n = retrying_poll(statp->udpsocks[addrInfo], POLLIN, finish); n <= 0) {
         return ErrnoError();
@@ -1082,6 +1534,14 @@ static int setupUdpSocket(ResState* statp, const sockaddr* sockap, unique_fd* fd
         }
     }
 
+    if (Experiments::getInstance()->getFlag("udp_rx_timestamps", 0) == 1) {
+        // Best effort: without it, answers are timed when they are read.
+        const int on = 1;
+        if (setsockopt(*fd_out, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+            PLOG(DEBUG) << __func__ << ": setsockopt(SO_TIMESTAMPNS): ";
+        }
+    }
+
     if (random_bind(*fd_out, sockap->sa_family) < 0) {
         *terrno = errno;
         dump_error("bind", sockap);
@@ -1090,9 +1550,197 @@ static int setupUdpSocket(ResState* statp, const sockaddr* sockap, unique_fd* fd
     return 1;
 }
 
+// Room for the control message that SO_TIMESTAMPNS adds to each datagram.
+constexpr size_t kRxTimestampControlSize = CMSG_SPACE(sizeof(timespec));
+
+// When the kernel received the datagram that |msg| was read into, if the socket has
+// SO_TIMESTAMPNS on, or else now. Unlike the time a datagram is read at, that leaves out how long
+// the reading thread took to get scheduled, so it's what server RTTs are measured with.
+static timespec rx_time(const msghdr& msg) {
+    for (const cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&msg), const_cast<cmsghdr*>(cmsg))) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS &&
+            cmsg->cmsg_len >= CMSG_LEN(sizeof(timespec))) {
+            timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return ts;
+        }
+    }
+    return evNowTime();
+}
+
+// recvfrom() that also returns in |rxtime| when the datagram was received, as rx_time() does.
+static ssize_t recvfrom_timestamped(int fd, span<uint8_t> buf, int flags, sockaddr_storage* from,
+                                    timespec* rxtime) {
+    iovec iov = {.iov_base = buf.data(), .iov_len = buf.size()};
+    alignas(cmsghdr) uint8_t control[kRxTimestampControlSize];
+    msghdr msg = {.msg_name = from,
+                  .msg_namelen = sizeof(*from),
+                  .msg_iov = &iov,
+                  .msg_iovlen = 1,
+                  .msg_control = control,
+                  .msg_controllen = sizeof(control)};
+    const ssize_t n = recvmsg(fd, &msg, flags);
+    if (n >= 0) *rxtime = rx_time(msg);
+    return n;
+}
+
+// The RTT, in milliseconds, of a query sent at |start| and answered at |rxtime|. A late answer to
+// an earlier attempt may have been received before the query was sent again.
+static int rtt_ms(const timespec& rxtime, const timespec& start) {
+    return std::max(0, res_stats_calculate_rtt(&rxtime, &start));
+}
+
+namespace {
+
+// How long a UDP socket may be reused after it was set up. Each socket keeps its source port
+// for its whole lifetime, so this bounds how long a port stays the same.
+constexpr auto kPooledUdpSocketLifetime = 5s;
+// Upper bound on the number of idle sockets kept across all networks and apps.
+constexpr size_t kMaxPooledUdpSockets = 64;
+
+// Idle UDP sockets, already marked, tagged and randomly bound, keyed by everything that was
+// set on them. Queries take a socket from here instead of setting up a new one, and give it
+// back when they are done with it.
+class UdpSocketPool {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    static UdpSocketPool& getInstance() {
+        static UdpSocketPool instance;
+        return instance;
+    }
+
+    static bool isEnabled() {
+        return Experiments::getInstance()->getFlag("udp_socket_pool", 0) == 1;
+    }
+
+    // Returns an idle socket suitable for |statp| and |family|, or an invalid fd if there is none.
+    unique_fd take(const ResState* statp, int family, clock::time_point* expiry) {
+        std::lock_guard guard(mMutex);
+        auto it = mIdle.find(keyOf(statp, family));
+        if (it == mIdle.end()) return {};
+        const auto now = clock::now();
+        while (!it->second.empty()) {
+            Idle idle = std::move(it->second.back());
+            it->second.pop_back();
+            mCount--;
+            if (now < idle.expiry) {
+                *expiry = idle.expiry;
+                return std::move(idle.fd);
+            }
+        }
+        return {};
+    }
+
+    // Disconnects |fd| and keeps it for a later query, unless it is too old or the pool is full.
+    void give(const ResState* statp, int family, unique_fd fd, clock::time_point expiry) {
+        if (clock::now() >= expiry) return;
+        const sockaddr unspec = {.sa_family = AF_UNSPEC};
+        if (connect(fd, &unspec, sizeof(unspec)) != 0) return;
+        // Clear any ICMP error reported on the previous peer.
+        int error;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+        std::lock_guard guard(mMutex);
+        if (mCount >= kMaxPooledUdpSockets) expireLocked();
+        if (mCount >= kMaxPooledUdpSockets) return;
+        mIdle[keyOf(statp, family)].push_back({std::move(fd), expiry});
+        mCount++;
+    }
+
+  private:
+    struct Key {
+        unsigned netid;
+        unsigned mark;
+        uid_t uid;
+        int family;
+        auto operator<=>(const Key&) const = default;
+    };
+    struct Idle {
+        unique_fd fd;
+        clock::time_point expiry;
+    };
+
+    static Key keyOf(const ResState* statp, int family) {
+        return {statp->netid, statp->mark, statp->enforce_dns_uid ? AID_DNS : statp->uid, family};
+    }
+
+    void expireLocked() REQUIRES(mMutex) {
+        const auto now = clock::now();
+        for (auto it = mIdle.begin(); it != mIdle.end();) {
+            auto& sockets = it->second;
+            const size_t before = sockets.size();
+            std::erase_if(sockets, [now](const Idle& idle) { return now >= idle.expiry; });
+            mCount -= before - sockets.size();
+            it = sockets.empty() ? mIdle.erase(it) : std::next(it);
+        }
+    }
+
+    std::mutex mMutex;
+    std::map<Key, std::vector<Idle>> mIdle GUARDED_BY(mMutex);
+    size_t mCount GUARDED_BY(mMutex) = 0;
+};
+
+// Discards whatever was queued on a reused socket before it was connected to its new peer.
+void drainUdpSocket(int fd) {
+    uint8_t junk[PACKETSZ];
+    while (recv(fd, junk, sizeof(junk), MSG_DONTWAIT) >= 0) {
+    }
+}
+
+}  // namespace
+
+// Gives the UDP sockets of |statp| back to the pool once its query has been answered.
+static void releaseUdpSockets(ResState* statp) {
+    if (!UdpSocketPool::isEnabled()) return;
+    for (size_t i = 0; i < statp->nsaddrs.size(); i++) {
+        if (statp->udpsocks[i] == -1) continue;
+        UdpSocketPool::getInstance().give(statp, statp->nsaddrs[i].family(),
+                                          std::move(statp->udpsocks[i]), statp->udpsocks_expiry[i]);
+    }
+}
+
+// Sets up the UDP socket of server |ns| of |statp|, connected to the server, unless it's already
+// open. Returns the same as setupUdpSocket.
+static int openUdpSocket(ResState* statp, size_t ns, int* terrno) {
+    if (statp->udpsocks[ns] != -1) return 1;
+    ScopedStageTimer timer(QueryStage::SOCKET_SETUP);
+
+    const sockaddr_storage ss = statp->nsaddrs[ns];
+    const sockaddr* nsap = reinterpret_cast<const sockaddr*>(&ss);
+    const bool pooled = UdpSocketPool::isEnabled();
+    if (pooled) {
+        statp->udpsocks[ns] = UdpSocketPool::getInstance().take(statp, nsap->sa_family,
+                                                                &statp->udpsocks_expiry[ns]);
+    }
+    const bool reused = statp->udpsocks[ns] != -1;
+    if (!reused) {
+        int result = setupUdpSocket(statp, nsap, &statp->udpsocks[ns], terrno);
+        if (result <= 0) return result;
+        statp->udpsocks_expiry[ns] =
+                UdpSocketPool::clock::now() + (pooled ? kPooledUdpSocketLifetime : 0s);
+    }
+
+    // Use a "connected" datagram socket to receive an ECONNREFUSED error
+    // on the next socket operation when the server responds with an
+    // ICMP port-unreachable error. This way we can detect the absence of
+    // a nameserver without timing out.
+    if (connect(statp->udpsocks[ns], nsap, sockaddrSize(nsap)) < 0) {
+        *terrno = errno;
+        dump_error("connect(dg)", nsap);
+        statp->closeSockets();
+        return 0;
+    }
+    if (reused) drainUdpSocket(statp->udpsocks[ns]);
+    LOG(DEBUG) << __func__ << (reused ? ": reused DG socket" : ": new DG socket");
+    return 1;
+}
+
 static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
                    int* terrno, size_t* ns, int* v_circuit, int* gotsomewhere, time_t* at,
-                   int* rcode, int* delay) {
+                   int* rcode, int* delay, int hedge_delay_ms, bool listen_all) {
     // It should never happen, but just in case.
     if (*ns >= statp->nsaddrs.size()) {
         LOG(ERROR) << __func__ << ": Out-of-bound indexing: " << ns;
@@ -1102,25 +1750,7 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
 
     *at = time(nullptr);
     *delay = 0;
-    const sockaddr_storage ss = statp->nsaddrs[*ns];
-    const sockaddr* nsap = reinterpret_cast<const sockaddr*>(&ss);
-
-    if (statp->udpsocks[*ns] == -1) {
-        int result = setupUdpSocket(statp, nsap, &statp->udpsocks[*ns], terrno);
-        if (result <= 0) return result;
-
-        // Use a "connected" datagram socket to receive an ECONNREFUSED error
-        // on the next socket operation when the server responds with an
-        // ICMP port-unreachable error. This way we can detect the absence of
-        // a nameserver without timing out.
-        if (connect(statp->udpsocks[*ns], nsap, sockaddrSize(nsap)) < 0) {
-            *terrno = errno;
-            dump_error("connect(dg)", nsap);
-            statp->closeSockets();
-            return 0;
-        }
-        LOG(DEBUG) << __func__ << ": new DG socket";
-    }
+    if (int result = openUdpSocket(statp, *ns, terrno); result <= 0) return result;
     if (send(statp->udpsocks[*ns], msg.data(), msg.size(), 0) != msg.size()) {
         *terrno = errno;
         PLOG(DEBUG) << __func__ << ": send: ";
@@ -1128,12 +1758,14 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
         return 0;
     }
 
-    timespec timeout = get_timeout(statp, params, *ns);
+    timespec timeout = hedge_delay_ms > 0 ? evConsTime(hedge_delay_ms / 1000,
+                                                       (hedge_delay_ms % 1000) * 1000000)
+                                          : get_timeout(statp, params, *ns, PROTO_UDP);
     timespec start_time = evNowTime();
     timespec finish = evAddTime(start_time, timeout);
     for (;;) {
         // Wait for reply.
-        auto result = udpRetryingPollWrapper(statp, *ns, &finish);
+        auto result = udpRetryingPollWrapper(statp, *ns, listen_all, &finish);
 
         if (!result.has_value()) {
             const bool isTimeout = (result.error().code() == ETIMEDOUT);
@@ -1150,9 +1782,8 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
         for (int fd : result.value()) {
             needRetry = false;
             sockaddr_storage from;
-            socklen_t fromlen = sizeof(from);
-            int resplen =
-                    recvfrom(fd, ans.data(), ans.size(), 0, (sockaddr*)(void*)&from, &fromlen);
+            timespec rxtime;
+            int resplen = recvfrom_timestamped(fd, ans, 0, &from, &rxtime);
             if (resplen <= 0) {
                 *terrno = errno;
                 PLOG(DEBUG) << __func__ << ": recvfrom: ";
@@ -1186,8 +1817,7 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
                 continue;
             }
 
-            timespec done = evNowTime();
-            *delay = res_stats_calculate_rtt(&done, &start_time);
+            *delay = rtt_ms(rxtime, start_time);
             if (anhp->rcode == SERVFAIL || anhp->rcode == NOTIMP || anhp->rcode == REFUSED) {
                 LOG(DEBUG) << __func__ << ": server rejected query:";
                 res_pquery({ans.data(), (resplen > ans.size()) ? ans.size() : resplen});
@@ -1216,9 +1846,13 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
 
 // return length - when receiving valid packets.
 // return 0      - when mdns packets transfer error.
+// |*group| is the index in mdns_addrs of the group that is queried, or that answered.
 static int send_mdns(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int* terrno,
-                     int* rcode) {
-    const sockaddr_storage ss = (getQueryType(msg) == NS_T_AAAA) ? mdns_addrs[0] : mdns_addrs[1];
+                     int* rcode, size_t* group) {
+    if (Experiments::getInstance()->getFlag("mdns_parallel_groups", 0) == 1) {
+        return send_mdns_parallel(statp, msg, ans, terrno, rcode, group);
+    }
+    const sockaddr_storage ss = mdns_addrs[*group];
     const sockaddr* mdnsap = reinterpret_cast<const sockaddr*>(&ss);
     unique_fd fd;
 
@@ -1267,6 +1901,92 @@ static int send_mdns(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans
     return resplen;
 }
 
+// Same as send_mdns, but sends the query to both groups at once and returns the first answer from
+// either, so that a responder on only one of them doesn't cost a timeout. With
+// "mdns_aggregation_ms" set, answers are still read for that long after the first one, and the one
+// with the most answer records wins: when several hosts answer, the first may not be complete.
+static int send_mdns_parallel(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                              int* terrno, int* rcode, size_t* group) {
+    std::vector<unique_fd> fds(mdns_addrs.size());
+    std::vector<pollfd> fdset;
+    std::vector<size_t> groups;
+    for (size_t i = 0; i < mdns_addrs.size(); ++i) {
+        const sockaddr_storage ss = mdns_addrs[i];
+        const sockaddr* mdnsap = reinterpret_cast<const sockaddr*>(&ss);
+        // A family without a route or an address just leaves the other one.
+        if (setupUdpSocket(statp, mdnsap, &fds[i], terrno) <= 0) continue;
+        if (sendto(fds[i], msg.data(), msg.size(), 0, mdnsap, sockaddrSize(mdnsap)) !=
+            static_cast<ssize_t>(msg.size())) {
+            *terrno = errno;
+            continue;
+        }
+        fdset.push_back({.fd = fds[i].get(), .events = POLLIN});
+        groups.push_back(i);
+    }
+    if (fdset.empty()) return 0;
+
+    timespec finish = evAddTime(evNowTime(), {2, 2000000});
+    const int aggregationMs = Experiments::getInstance()->getFlag("mdns_aggregation_ms", 0);
+    std::vector<uint8_t> buf(ans.size());
+    int resplen = 0;
+    int answers = -1;
+    while (true) {
+        const timespec now = evNowTime();
+        timespec timeout =
+                (evCmpTime(finish, now) > 0) ? evSubTime(finish, now) : evConsTime(0L, 0L);
+        const int n = ppoll(fdset.data(), fdset.size(), &timeout, /*__mask=*/nullptr);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (resplen > 0) break;
+            *terrno = (n == 0) ? ETIMEDOUT : errno;
+            if (*terrno == ETIMEDOUT) *rcode = RCODE_TIMEOUT;
+            LOG(ERROR) << __func__ << ": " << ((*terrno == ETIMEDOUT) ? "timeout" : "poll failed");
+            return 0;
+        }
+
+        for (size_t i = 0; i < fdset.size(); ++i) {
+            if (!(fdset[i].revents & (POLLIN | POLLERR))) continue;
+            const int len = recvfrom(fdset[i].fd, buf.data(), buf.size(), MSG_DONTWAIT, nullptr,
+                                     nullptr);
+            // Unlike send_mdns, a bad answer from one group still leaves the other to wait for.
+            if (len < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) *terrno = errno;
+                continue;
+            }
+            if (len < HFIXEDSZ) {
+                LOG(ERROR) << __func__ << ": undersized: " << len;
+                *terrno = EMSGSIZE;
+                continue;
+            }
+            const HEADER* anhp = reinterpret_cast<const HEADER*>(buf.data());
+            if (anhp->tc) {
+                LOG(DEBUG) << __func__ << ": truncated answer";
+                *terrno = E2BIG;
+                continue;
+            }
+            // mDNS responders don't send negative answers, but legacy DNS servers on the port may:
+            // one without records is only returned if nothing better arrives.
+            const bool first = answers <= 0;
+            if (ntohs(anhp->ancount) > answers) {
+                answers = ntohs(anhp->ancount);
+                std::copy(buf.begin(), buf.begin() + len, ans.begin());
+                resplen = len;
+                *rcode = anhp->rcode;
+                *group = groups[i];
+            }
+            if (first && answers > 0 && aggregationMs > 0) {
+                const timespec window = evAddTime(
+                        evNowTime(),
+                        evConsTime(aggregationMs / 1000, (aggregationMs % 1000) * 1000000L));
+                if (evCmpTime(window, finish) < 0) finish = window;
+            }
+        }
+        if (answers > 0 && aggregationMs <= 0) break;
+    }
+    *terrno = 0;
+    return resplen;
+}
+
 static void dump_error(const char* str, const struct sockaddr* address) {
     char hbuf[NI_MAXHOST];
     char sbuf[NI_MAXSERV];
@@ -1322,37 +2042,47 @@ PrivateDnsModes convertEnumType(PrivateDnsMode privateDnsmode) {
     }
 }
 
+// Sets |*answeredBy| to the protocol of the query that got the answer, if any.
 static int res_private_dns_send(ResState* statp, const Slice query, const Slice answer, int* rcode,
-                                bool* fallback) {
+                                bool* fallback, uint32_t flags,
+                                android::net::Protocol* answeredBy) {
     const unsigned netId = statp->netid;
 
     auto& privateDnsConfiguration = PrivateDnsConfiguration::getInstance();
-    PrivateDnsStatus privateDnsStatus = privateDnsConfiguration.getStatus(netId);
-    statp->event->set_private_dns_modes(convertEnumType(privateDnsStatus.mode));
+    auto privateDnsStatus = privateDnsConfiguration.getStatusSnapshot(netId);
+    statp->event->set_private_dns_modes(convertEnumType(privateDnsStatus->mode));
 
     const bool enableDoH = isDoHEnabled();
     ssize_t result = -1;
-    switch (privateDnsStatus.mode) {
+    switch (privateDnsStatus->mode) {
         case PrivateDnsMode::OFF: {
             *fallback = true;
             return -1;
         }
         case PrivateDnsMode::OPPORTUNISTIC: {
             *fallback = true;
-            if (enableDoH && privateDnsStatus.hasValidatedDohServers()) {
+            if (enableDoH && privateDnsStatus->hasValidatedDohServers()) {
                 result = res_doh_send(statp, query, answer, rcode);
+                *answeredBy = PROTO_DOH;
                 if (result != DOH_RESULT_CAN_NOT_SEND) return result;
             }
-            return res_tls_send(privateDnsStatus.validatedServers(), statp, query, answer, rcode,
-                                privateDnsStatus.mode);
+            if (Experiments::getInstance()->getFlag("dot_cleartext_race", 0) == 1 &&
+                statp->nameserverCount() > 0 && !isMdnsResolution(statp->flags)) {
+                return res_tls_race_send(privateDnsStatus->validatedServers(), statp, query,
+                                         answer, rcode, fallback, flags, answeredBy);
+            }
+            *answeredBy = PROTO_DOT;
+            return res_tls_send(privateDnsStatus->validatedServers(), statp, query, answer, rcode,
+                                privateDnsStatus->mode);
         }
         case PrivateDnsMode::STRICT: {
             *fallback = false;
-            if (enableDoH && privateDnsStatus.hasValidatedDohServers()) {
+            if (enableDoH && privateDnsStatus->hasValidatedDohServers()) {
                 result = res_doh_send(statp, query, answer, rcode);
+                *answeredBy = PROTO_DOH;
                 if (result != DOH_RESULT_CAN_NOT_SEND) return result;
             }
-            if (privateDnsStatus.validatedServers().empty()) {
+            if (privateDnsStatus->validatedServers().empty()) {
                 // Sleep and iterate some small number of times checking for the
                 // arrival of resolved and validated server IP addresses, instead
                 // of returning an immediate error.
@@ -1366,81 +2096,97 @@ static int res_private_dns_send(ResState* statp, const Slice query, const Slice
                 // TODO: see if there is a better way to address this problem, such as buffering the
                 // queries in a queue or only blocking queries for the first few seconds after a
                 // default network change.
-                for (int i = 0; i < 42; i++) {
+                for (int i = 0; i < 42 && !statp->isCancelled(); i++) {
                     std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-                    // Calling getStatus() to merely check if there's any validated server seems
-                    // wasteful. Consider adding a new method in PrivateDnsConfiguration for speed
-                    // ups.
-                    privateDnsStatus = privateDnsConfiguration.getStatus(netId);
+                    privateDnsStatus = privateDnsConfiguration.getStatusSnapshot(netId);
 
-                    if (enableDoH && privateDnsStatus.hasValidatedDohServers()) {
+                    if (enableDoH && privateDnsStatus->hasValidatedDohServers()) {
                         result = res_doh_send(statp, query, answer, rcode);
+                        *answeredBy = PROTO_DOH;
                         if (result != DOH_RESULT_CAN_NOT_SEND) return result;
                     }
 
                     // Switch to use the DoT servers if they are validated.
-                    if (!privateDnsStatus.validatedServers().empty()) {
+                    if (!privateDnsStatus->validatedServers().empty()) {
                         break;
                     }
                 }
             }
-            return res_tls_send(privateDnsStatus.validatedServers(), statp, query, answer, rcode,
-                                privateDnsStatus.mode);
+            *answeredBy = PROTO_DOT;
+            return res_tls_send(privateDnsStatus->validatedServers(), statp, query, answer, rcode,
+                                privateDnsStatus->mode);
         }
     }
     LOG(ERROR) << __func__ << ": unknown private DNS mode";
     return -1;
 }
 
-ssize_t res_doh_send(ResState* statp, const Slice query, const Slice answer, int* rcode) {
-    auto& privateDnsConfiguration = PrivateDnsConfiguration::getInstance();
-    const unsigned netId = statp->netid;
-    LOG(INFO) << __func__ << ": performing query over Https";
-    Stopwatch queryStopwatch;
-    int queryTimeout = Experiments::getInstance()->getFlag(
+// The timeout of DoH queries, from the "doh_query_timeout_ms" flag.
+static int doh_query_timeout_ms() {
+    const int queryTimeout = Experiments::getInstance()->getFlag(
             "doh_query_timeout_ms", PrivateDnsConfiguration::kDohQueryDefaultTimeoutMs);
-    if (queryTimeout < 1000) {
-        queryTimeout = 1000;
-    }
-    ssize_t result = privateDnsConfiguration.dohQuery(netId, query, answer, queryTimeout);
-    LOG(INFO) << __func__ << ": Https query result: " << result << ", netid=" << netId;
-
-    if (result == DOH_RESULT_CAN_NOT_SEND) return DOH_RESULT_CAN_NOT_SEND;
+    return std::max(queryTimeout, 1000);
+}
 
+// Records the DoH query |query|, which got |result| into |answer| after |latencyUs|, and sets
+// |rcode| from the answer or the error.
+static void report_doh_query(ResState* statp, span<const uint8_t> query,
+                             span<const uint8_t> answer, ssize_t result, int32_t latencyUs,
+                             int* rcode) {
+    const unsigned netId = statp->netid;
     DnsQueryEvent* dnsQueryEvent = statp->event->mutable_dns_query_events()->add_dns_query_event();
-    dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(queryStopwatch.timeTakenUs()));
+    dnsQueryEvent->set_latency_micros(latencyUs);
     // TODO: Make this information available.
     // dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(?));
     if (result > 0) {
-        *rcode = reinterpret_cast<HEADER*>(answer.base())->rcode;
+        *rcode = reinterpret_cast<const HEADER*>(answer.data())->rcode;
     } else {
         *rcode = -result;
     }
     dnsQueryEvent->set_rcode(static_cast<NsRcode>(*rcode));
     dnsQueryEvent->set_protocol(PROTO_DOH);
-    span<const uint8_t> msg(query.base(), query.size());
-    dnsQueryEvent->set_type(getQueryType(msg));
+    dnsQueryEvent->set_type(getQueryType(query));
 
-    auto dohServerAddr = privateDnsConfiguration.getDohServer(netId);
+    auto dohServerAddr = PrivateDnsConfiguration::getInstance().getDohServer(netId);
     if (dohServerAddr.ok()) {
         resolv_stats_add(netId, dohServerAddr.value(), dnsQueryEvent);
     }
+}
+
+ssize_t res_doh_send(ResState* statp, const Slice query, const Slice answer, int* rcode) {
+    ATRACE_CALL();
+    if (statp->isCancelled()) return DOH_RESULT_CAN_NOT_SEND;
+    auto& privateDnsConfiguration = PrivateDnsConfiguration::getInstance();
+    const unsigned netId = statp->netid;
+    LOG(INFO) << __func__ << ": performing query over Https";
+    Stopwatch queryStopwatch;
+    ssize_t result =
+            privateDnsConfiguration.dohQuery(netId, query, answer, doh_query_timeout_ms());
+    LOG(INFO) << __func__ << ": Https query result: " << result << ", netid=" << netId;
+
+    if (result == DOH_RESULT_CAN_NOT_SEND) return DOH_RESULT_CAN_NOT_SEND;
 
+    report_doh_query(statp, {query.base(), query.size()}, {answer.base(), answer.size()}, result,
+                     saturate_cast<int32_t>(queryStopwatch.timeTakenUs()), rcode);
     return result;
 }
 
 int res_tls_send(const std::list<DnsTlsServer>& tlsServers, ResState* statp, const Slice query,
                  const Slice answer, int* rcode, PrivateDnsMode mode) {
-    if (tlsServers.empty()) return -1;
+    if (tlsServers.empty() || statp->isCancelled()) return -1;
     LOG(INFO) << __func__ << ": performing query over TLS";
     const bool dotQuickFallback =
             (mode == PrivateDnsMode::STRICT)
                     ? 0
                     : Experiments::getInstance()->getFlag("dot_quick_fallback", 1);
     int resplen = 0;
-    const auto response = DnsTlsDispatcher::getInstance().query(tlsServers, statp, query, answer,
-                                                                &resplen, dotQuickFallback);
+    DnsTlsTransport::Response response;
+    {
+        ScopedStageTimer timer(QueryStage::UPSTREAM_WAIT);
+        response = DnsTlsDispatcher::getInstance().query(tlsServers, statp, query, answer,
+                                                         &resplen, dotQuickFallback);
+    }
 
     LOG(INFO) << __func__ << ": TLS query result: " << static_cast<int>(response);
     if (mode == PrivateDnsMode::OPPORTUNISTIC) {
@@ -1478,6 +2224,172 @@ int res_tls_send(const std::list<DnsTlsServer>& tlsServers, ResState* statp, con
     }
 }
 
+namespace {
+
+// The DoT and cleartext queries of res_tls_race_send(). Each runs on a thread of the pool or of
+// its own, which keeps running once the race is over, so this is shared with them.
+//
+// Legs still running are capped, since the leg that loses keeps its thread until its query is
+// over: past the cap, queries aren't raced.
+constexpr size_t kMaxRaceLegsInFlight = 32;
+std::atomic<size_t> sRaceLegsInFlight = 0;
+
+struct TransportRace {
+    // Guarded by |lock|, except for |ans| and |event|, which only the thread of the leg writes,
+    // until it sets |done|.
+    struct Leg {
+        explicit Leg(size_t anslen) : ans(anslen) {}
+        bool done = false;
+        int resplen = -1;
+        int rcode = RCODE_INTERNAL_ERROR;
+        std::vector<uint8_t> ans;
+        NetworkDnsEventReported event;
+    };
+
+    explicit TransportRace(size_t anslen) : dot(anslen), cleartext(anslen) {}
+
+    bool answered(const Leg& leg) const { return leg.done && leg.resplen > 0; }
+
+    std::mutex lock;
+    std::condition_variable cv;
+    Leg dot;
+    Leg cleartext;
+};
+
+// How long DoT gets before the cleartext query starts: the usual latency of the first server.
+std::chrono::milliseconds get_dot_race_delay(unsigned netid,
+                                             const std::list<DnsTlsServer>& tlsServers) {
+    const auto latency = resolv_stats_get_latency_percentile(
+            netid, IPSockAddr::toIPSockAddr(tlsServers.front().ss), PROTO_DOT,
+            kHedgeLatencyPercentile);
+    const int msec = latency ? std::max<int>(kHedgeMinDelayMs, latency->count() / 1000)
+                             : kHedgeDefaultDelayMs;
+    return std::chrono::milliseconds(msec);
+}
+
+// Calls |send| on the QueryThreadPool, or on a detached thread without one, and records what it
+// returns in |leg| of |race|. Returns false, without calling |send|, if there are
+// kMaxRaceLegsInFlight legs running already or the leg couldn't be started.
+template <typename Send>
+bool start_race_leg(std::shared_ptr<TransportRace> race, TransportRace::Leg* leg, Send send) {
+    if (sRaceLegsInFlight.fetch_add(1, std::memory_order_relaxed) >= kMaxRaceLegsInFlight) {
+        sRaceLegsInFlight.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    auto run = [race = std::move(race), leg,
+                send = std::make_shared<Send>(std::move(send))]() {
+        int rcode = RCODE_INTERNAL_ERROR;
+        const int resplen = (*send)(span<uint8_t>(leg->ans), &rcode);
+        sRaceLegsInFlight.fetch_sub(1, std::memory_order_relaxed);
+        std::lock_guard guard(race->lock);
+        leg->done = true;
+        leg->resplen = resplen;
+        leg->rcode = rcode;
+        race->cv.notify_all();
+    };
+    if (QueryThreadPool* pool = QueryThreadPool::getInstance(); pool != nullptr) {
+        if (pool->execute(std::move(run), "res_tls_race") == 0) return true;
+        sRaceLegsInFlight.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    std::thread(std::move(run)).detach();
+    return true;
+}
+
+// The protocol of the query of |leg| that got its answer, which is its last one.
+std::optional<::android::net::Protocol> race_leg_protocol(const TransportRace::Leg& leg) {
+    if (leg.event.dns_query_events().dns_query_event().empty()) return std::nullopt;
+    return leg.event.dns_query_events().dns_query_event().rbegin()->protocol();
+}
+
+// Appends the query events of the legs of |race| that are done to |event|, marked with
+// |winnerProtocol| if it's set.
+void merge_race_events(const TransportRace& race,
+                       std::optional<::android::net::Protocol> winnerProtocol,
+                       NetworkDnsEventReported* event) {
+    for (const TransportRace::Leg* leg : {&race.dot, &race.cleartext}) {
+        if (!leg->done) continue;
+        for (const DnsQueryEvent& e : leg->event.dns_query_events().dns_query_event()) {
+            DnsQueryEvent* merged = addDnsQueryEvent(event);
+            *merged = e;
+            if (winnerProtocol) merged->set_race_winner(*winnerProtocol);
+        }
+    }
+}
+
+}  // namespace
+
+// Opportunistic mode only: sends |query| over DoT, and if no answer has come within the usual DoT
+// latency, to the cleartext servers too. The first answer wins; the other query is left to finish
+// on its own. Clears |*fallback| once the cleartext query is sent, since it does the fallback.
+// Sets |*answeredBy| to the protocol of the winning query.
+static int res_tls_race_send(const std::list<DnsTlsServer>& tlsServers, ResState* statp,
+                             const Slice query, const Slice answer, int* rcode, bool* fallback,
+                             uint32_t flags, android::net::Protocol* answeredBy) {
+    if (tlsServers.empty() || statp->isCancelled()) return -1;
+    const std::vector<uint8_t> msg(query.base(), query.base() + query.size());
+    auto race = std::make_shared<TransportRace>(answer.size());
+
+    const bool started = start_race_leg(
+            race, &race->dot,
+            [state = statp->clone(&race->dot.event), tlsServers, msg](span<uint8_t> ans,
+                                                                     int* rcode) mutable {
+                return res_tls_send(tlsServers, &state,
+                                    Slice(const_cast<uint8_t*>(msg.data()), msg.size()),
+                                    Slice(ans.data(), ans.size()), rcode,
+                                    PrivateDnsMode::OPPORTUNISTIC);
+            });
+    *answeredBy = PROTO_DOT;
+    if (!started) {
+        return res_tls_send(tlsServers, statp, query, answer, rcode,
+                            PrivateDnsMode::OPPORTUNISTIC);
+    }
+
+    const auto delay = get_dot_race_delay(statp->netid, tlsServers);
+    std::unique_lock lock(race->lock);
+    bool raced = !race->cv.wait_for(lock, delay, [&] { return race->dot.done; });
+    if (raced) {
+        ResState state = statp->clone(&race->cleartext.event);
+        state.netcontext_flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
+        raced = start_race_leg(race, &race->cleartext,
+                               [state = std::move(state), msg, flags](span<uint8_t> ans,
+                                                                      int* rcode) mutable {
+                                   // The caller caches whichever answer wins.
+                                   return res_nsend(&state, msg, ans, rcode,
+                                                    flags | ANDROID_RESOLV_NO_CACHE_LOOKUP |
+                                                            ANDROID_RESOLV_NO_CACHE_STORE);
+                               });
+    }
+    if (!raced) {
+        // The DoT query alone, as if there were no race.
+        race->cv.wait(lock, [&] { return race->dot.done; });
+    } else {
+        LOG(INFO) << __func__ << ": no DoT answer after " << delay.count()
+                  << " msec, querying cleartext servers too";
+        *fallback = false;
+        race->cv.wait(lock, [&] {
+            return race->answered(race->dot) || race->answered(race->cleartext) ||
+                   (race->dot.done && race->cleartext.done);
+        });
+    }
+
+    TransportRace::Leg* winner = race->answered(race->dot)         ? &race->dot
+                                 : race->answered(race->cleartext) ? &race->cleartext
+                                                                   : nullptr;
+    std::optional<::android::net::Protocol> winnerProtocol;
+    if (winner == &race->dot) {
+        winnerProtocol = PROTO_DOT;
+    } else if (winner == &race->cleartext) {
+        winnerProtocol = race_leg_protocol(race->cleartext).value_or(PROTO_UDP);
+    }
+    merge_race_events(*race, raced ? winnerProtocol : std::nullopt, statp->event);
+    if (winner == nullptr) return -1;
+    *answeredBy = *winnerProtocol;
+    std::copy(winner->ans.begin(), winner->ans.begin() + winner->resplen, answer.base());
+    *rcode = winner->rcode;
+    return winner->resplen;
+}
+
 int resolv_res_nsend(const android_net_context* netContext, span<const uint8_t> msg,
                      span<uint8_t> ans, int* rcode, uint32_t flags,
                      NetworkDnsEventReported* event) {
@@ -1487,3 +2399,809 @@ int resolv_res_nsend(const android_net_context* netContext, span<const uint8_t>
     *rcode = NOERROR;
     return res_nsend(&res, msg, ans, rcode, flags);
 }
+
+namespace {
+
+// A query of res_nsend_batch() on its way to the servers.
+struct BatchEntry {
+    ResBatchQuery* query;
+    // Of its query, to complete with resolv_cache_add_batch().
+    ResolvCacheBatchEntry* cacheEntry;
+    ResolvCacheStatus cacheStatus;
+    // Answered, or failed for good.
+    bool done = false;
+    // Has to be sent again with res_nsend(), e.g. over TCP.
+    bool fallback = false;
+    // The outcome of sending it to the current server.
+    bool roundOver = false;
+    int rcode = RCODE_INTERNAL_ERROR;
+    int terrno = ETIME;
+    int delay = 0;
+    size_t answeredBy = 0;
+};
+
+constexpr size_t kMaxBatchMessages = 8;
+
+}  // namespace
+
+// Sends the queries of |batch| over DoH in a single call, as res_doh_send() would each. The
+// answered ones are done, and so are those that failed in strict mode; the others are left for
+// cleartext DNS. Those that couldn't be sent at all are sent again with res_nsend(), which may go
+// over DoT instead, and so are companions, as nobody waits for them.
+static void res_doh_send_batch(ResState* statp, std::vector<BatchEntry>& batch, bool strict) {
+    ATRACE_CALL();
+    std::vector<DohBatchQuery> queries;
+    std::vector<BatchEntry*> sent;
+    for (BatchEntry& e : batch) {
+        if (e.query->companion) {
+            e.fallback = e.done = true;
+            continue;
+        }
+        queries.push_back({.query = e.query->msg.data(),
+                           .query_len = e.query->msg.size(),
+                           .answer = e.query->ans.data(),
+                           .answer_len = e.query->ans.size(),
+                           .result = DOH_RESULT_CAN_NOT_SEND});
+        sent.push_back(&e);
+    }
+    if (queries.empty()) return;
+
+    LOG(INFO) << __func__ << ": performing " << queries.size() << " queries over Https";
+    Stopwatch queryStopwatch;
+    const ssize_t rv = statp->isCancelled()
+                               ? DOH_RESULT_CAN_NOT_SEND
+                               : PrivateDnsConfiguration::getInstance().dohQueryBatch(
+                                         statp->netid, queries, doh_query_timeout_ms());
+    const int32_t latencyUs = saturate_cast<int32_t>(queryStopwatch.timeTakenUs());
+    for (size_t i = 0; i < sent.size(); i++) {
+        BatchEntry& e = *sent[i];
+        const ssize_t result = rv == 0 ? queries[i].result : DOH_RESULT_CAN_NOT_SEND;
+        if (result == DOH_RESULT_CAN_NOT_SEND) {
+            e.fallback = e.done = true;
+            continue;
+        }
+        report_doh_query(statp, e.query->msg, e.query->ans, result, latencyUs, &e.query->rcode);
+        if (result > 0) {
+            e.query->resplen = result;
+            e.done = true;
+        } else if (strict) {
+            e.query->resplen = -ETIMEDOUT;
+            e.done = true;
+        }
+    }
+}
+
+// Hands the answers of |batch| to the cache, and sends again what has to go on its own.
+static void res_nsend_batch_finish(ResState* statp, std::vector<BatchEntry>& batch,
+                                   span<const ResolvCacheBatchEntry> cacheEntries, uint32_t flags,
+                                   int gotsomewhere) {
+    bool answered = false;
+    for (BatchEntry& e : batch) {
+        ResBatchQuery* q = e.query;
+        if (e.done && !e.fallback && q->resplen > 0) {
+            LOG(DEBUG) << __func__ << ": got answer:";
+            res_pquery(q->ans.first(q->resplen));
+            e.cacheEntry->answerlen = q->resplen;
+            answered = true;
+            continue;
+        }
+        if (e.fallback) continue;
+        if (!e.done) q->resplen = gotsomewhere ? -ETIMEDOUT : -ECONNREFUSED;
+    }
+    // The truncated ones too: res_nsend() below looks them up again, and adds them on its own.
+    resolv_cache_add_batch(statp->netid, cacheEntries, flags, statp->uid);
+    if (answered) releaseUdpSockets(statp);
+    statp->closeSockets();
+
+    // Truncated answers are retried one at a time, which takes care of TCP. Companions are
+    // retried in the background.
+    for (BatchEntry& e : batch) {
+        if (!e.fallback) continue;
+        ResBatchQuery* q = e.query;
+        if (q->companion) {
+            q->resplen = -ETIMEDOUT;
+            res_nprefetch(statp, q->msg, flags);
+            continue;
+        }
+        q->resplen = res_nsend(statp, q->msg, q->ans, &q->rcode, flags);
+    }
+}
+
+// Takes the answers queued on the socket of server |from| and hands them to the queries of
+// |batch| they answer, while server |ns| is being queried. Returns false if the server is
+// unreachable.
+static bool recv_dg_batch(ResState* statp, size_t from, size_t ns, std::vector<BatchEntry>& batch,
+                          span<uint8_t> buf, const timespec& start, int* gotsomewhere) {
+    const size_t msgsize = buf.size() / kMaxBatchMessages;
+    iovec iovs[kMaxBatchMessages];
+    alignas(cmsghdr) uint8_t controls[kMaxBatchMessages][kRxTimestampControlSize];
+    mmsghdr msgs[kMaxBatchMessages] = {};
+    for (size_t i = 0; i < kMaxBatchMessages; i++) {
+        iovs[i] = {.iov_base = buf.data() + i * msgsize, .iov_len = msgsize};
+    }
+
+    for (;;) {
+        // recvmmsg() overwrites the lengths of what it returns.
+        for (size_t i = 0; i < kMaxBatchMessages; i++) {
+            msgs[i].msg_hdr = {.msg_iov = &iovs[i],
+                               .msg_iovlen = 1,
+                               .msg_control = controls[i],
+                               .msg_controllen = sizeof(controls[i])};
+        }
+        const int n = recvmmsg(statp->udpsocks[from], msgs, kMaxBatchMessages, MSG_DONTWAIT,
+                               nullptr);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            PLOG(DEBUG) << __func__ << ": recvmmsg: ";
+            return false;
+        }
+        for (int i = 0; i < n; i++) {
+            const span<const uint8_t> ans(buf.data() + i * msgsize, msgs[i].msg_len);
+            if (ans.size() < HFIXEDSZ) {
+                LOG(DEBUG) << __func__ << ": undersized: " << ans.size();
+                continue;
+            }
+            *gotsomewhere = 1;
+            const HEADER* anhp = reinterpret_cast<const HEADER*>(ans.data());
+            auto e = std::find_if(batch.begin(), batch.end(), [&](const BatchEntry& e) {
+                const span<const uint8_t> msg = e.query->msg;
+                return !e.done && reinterpret_cast<const HEADER*>(msg.data())->id == anhp->id &&
+                       res_queriesmatch(msg.data(), msg.data() + msg.size(), ans.data(),
+                                        ans.data() + ans.size());
+            });
+            const bool rejected =
+                    anhp->rcode == SERVFAIL || anhp->rcode == NOTIMP || anhp->rcode == REFUSED;
+            // A server tried before giving up late doesn't stop waiting for the current one.
+            if (e != batch.end() && rejected && from != ns) continue;
+            if (e == batch.end()) {
+                // Either a late answer to a query already answered, or not ours at all.
+                LOG(DEBUG) << __func__ << ": unexpected answer:";
+                res_pquery(ans);
+                continue;
+            }
+
+            // Like send_dg, leave whatever the server said in the answer buffer.
+            if (ans.size() <= e->query->ans.size()) {
+                std::copy(ans.begin(), ans.end(), e->query->ans.begin());
+            }
+            e->delay = rtt_ms(rx_time(msgs[i].msg_hdr), start);
+            e->answeredBy = from;
+            e->rcode = anhp->rcode;
+            e->roundOver = true;
+            if (anhp->rcode == FORMERR && (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_EDNS)) {
+                // Reported to the caller, which retries without EDNS0.
+                LOG(DEBUG) << __func__ << ": server rejected query with EDNS0:";
+                statp->flags |= RES_F_EDNS0ERR;
+                e->terrno = EREMOTEIO;
+                e->query->rcode = anhp->rcode;
+                e->query->resplen = -EREMOTEIO;
+                e->done = true;
+                continue;
+            }
+            if (rejected) {
+                LOG(DEBUG) << __func__ << ": server rejected query:";
+                res_pquery(ans);
+                continue;
+            }
+            if (anhp->tc || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+                ans.size() > e->query->ans.size()) {
+                LOG(DEBUG) << __func__ << ": truncated answer";
+                e->terrno = E2BIG;
+                e->fallback = true;
+                e->done = true;
+                continue;
+            }
+            e->query->resplen = ans.size();
+            e->query->rcode = anhp->rcode;
+            e->terrno = 0;
+            e->done = true;
+        }
+    }
+}
+
+void res_nsend_batch(ResState* statp, span<ResBatchQuery> queries, uint32_t flags) {
+    LOG(DEBUG) << __func__ << ": " << queries.size() << " queries";
+
+    // Peeked at one by one: a batch lookup would register the misses for others to wait for.
+    // Nobody waits for a companion, so it is left for a lookup that sends queries to fetch.
+    if (ScopedCacheOnlyLookup::current() != nullptr) {
+        for (ResBatchQuery& q : queries) {
+            q.resplen = q.companion ? -ETIMEDOUT : res_nsend(statp, q.msg, q.ans, &q.rcode, flags);
+        }
+        return;
+    }
+
+    // Anything but cleartext DNS to the configured servers is left to res_nsend(), but DoH with
+    // the "doh_batch_queries" flag: the queries then go to the DoH engine together.
+    bool batchable = !isMdnsResolution(statp->flags);
+    bool overDoh = false;
+    bool strict = false;
+    if (batchable && !(statp->netcontext_flags & NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS)) {
+        const auto status = PrivateDnsConfiguration::getInstance().getStatusSnapshot(statp->netid);
+        statp->event->set_private_dns_modes(convertEnumType(status->mode));
+        overDoh = status->mode != PrivateDnsMode::OFF && isDoHEnabled() &&
+                  status->hasValidatedDohServers() &&
+                  Experiments::getInstance()->getFlag("doh_batch_queries", 0) == 1;
+        strict = status->mode == PrivateDnsMode::STRICT;
+        batchable = status->mode == PrivateDnsMode::OFF || overDoh;
+    }
+
+    std::vector<ResBatchQuery*> cacheable;
+    for (ResBatchQuery& q : queries) {
+        if (!batchable || q.msg.size() > PACKETSZ || q.ans.size() < HFIXEDSZ) {
+            // A companion sent on its own would be waited for.
+            if (q.companion) {
+                q.resplen = -ETIMEDOUT;
+                continue;
+            }
+            q.resplen = res_nsend(statp, q.msg, q.ans, &q.rcode, flags);
+            continue;
+        }
+        res_pquery(q.msg);
+        cacheable.push_back(&q);
+    }
+
+    // A and AAAA are looked up, and later added, under a single lock of the cache.
+    std::vector<ResolvCacheBatchEntry> cacheEntries(cacheable.size());
+    for (size_t i = 0; i < cacheable.size(); i++) {
+        cacheEntries[i] = {.query = cacheable[i]->msg, .answer = cacheable[i]->ans};
+    }
+    Stopwatch cacheStopwatch;
+    resolv_cache_lookup_batch(statp->netid, cacheEntries, flags, statp->uid);
+    const int32_t cacheLatencyUs = saturate_cast<int32_t>(cacheStopwatch.timeTakenUs());
+
+    std::vector<BatchEntry> batch;
+    size_t maxAnsSize = 0;
+    for (size_t i = 0; i < cacheable.size(); i++) {
+        ResBatchQuery& q = *cacheable[i];
+        ResolvCacheBatchEntry& cacheEntry = cacheEntries[i];
+        const ResolvCacheStatus cacheStatus = cacheEntry.status;
+        if (cacheStatus == RESOLV_CACHE_FOUND || cacheStatus == RESOLV_CACHE_STALE ||
+            cacheStatus == RESOLV_CACHE_PREFETCH) {
+            q.rcode = reinterpret_cast<const HEADER*>(q.ans.data())->rcode;
+            // A companion already cached is what its caller wanted, not an answer to look at.
+            q.resplen = q.companion ? 0 : cacheEntry.answerlen;
+            DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
+            dnsQueryEvent->set_latency_micros(cacheLatencyUs);
+            dnsQueryEvent->set_cache_hit(CacheStatus::CS_FOUND);
+            dnsQueryEvent->set_type(getQueryType(q.msg));
+            if (cacheStatus != RESOLV_CACHE_FOUND) refresh_cached_answer(statp, q.msg, flags);
+            continue;
+        }
+        // Only an answer is added; until then, the entry stands for a failure.
+        cacheEntry.answerlen = 0;
+        batch.push_back({.query = &q, .cacheEntry = &cacheEntry, .cacheStatus = cacheStatus});
+        maxAnsSize = std::max(maxAnsSize, q.ans.size());
+    }
+    if (batch.empty()) return;
+    const auto companion = [](const BatchEntry& e) { return e.query->companion; };
+    if (std::all_of(batch.begin(), batch.end(), companion)) {
+        for (BatchEntry& e : batch) e.query->resplen = -ETIMEDOUT;
+        resolv_cache_add_batch(statp->netid, cacheEntries, flags, statp->uid);
+        return;
+    }
+    if (std::any_of(batch.begin(), batch.end(), [](const BatchEntry& e) {
+            return e.cacheStatus != RESOLV_CACHE_UNSUPPORTED;
+        })) {
+        resolv_populate_res_for_net(statp);
+    }
+
+    if (overDoh) {
+        res_doh_send_batch(statp, batch, strict);
+        if (std::all_of(batch.begin(), batch.end(), [](const BatchEntry& e) { return e.done; })) {
+            res_nsend_batch_finish(statp, batch, cacheEntries, flags, /*gotsomewhere=*/1);
+            return;
+        }
+    }
+
+    res_stats stats[MAXNS]{};
+    res_params params;
+    const int revision_id =
+            statp->nameserverCount() == 0
+                    ? -1
+                    : resolv_cache_get_resolver_stats(statp->netid, &params, stats, statp->nsaddrs);
+    if (revision_id < 0) {
+        for (BatchEntry& e : batch) {
+            if (e.done) continue;
+            e.query->resplen = -ESRCH;
+            e.done = true;
+        }
+        res_nsend_batch_finish(statp, batch, cacheEntries, flags, /*gotsomewhere=*/1);
+        return;
+    }
+    bool usable_servers[MAXNS];
+    android_net_res_stats_get_usable_servers(&params, stats, statp->nameserverCount(),
+                                             usable_servers);
+    if (statp->sort_nameservers) std::fill_n(usable_servers, statp->nameserverCount(), true);
+    const int timeoutsToOpen = CircuitBreaker::timeoutsToOpen();
+    if (timeoutsToOpen > 0) skip_open_circuits(statp, PROTO_UDP, usable_servers);
+
+    std::vector<uint8_t> recvBuf(kMaxBatchMessages * maxAnsSize);
+    int gotsomewhere = 0;
+    const int retryTimes = (flags & ANDROID_RESOLV_NO_RETRY) ? 1 : params.retry_count;
+    for (int attempt = 0; attempt < retryTimes && !statp->isCancelled(); ++attempt) {
+        for (size_t ns = 0; ns < statp->nsaddrs.size(); ++ns) {
+            if (!usable_servers[ns]) continue;
+            if (statp->isCancelled()) break;
+            std::vector<BatchEntry*> round;
+            for (BatchEntry& e : batch) {
+                if (e.done) continue;
+                e.roundOver = false;
+                e.rcode = RCODE_INTERNAL_ERROR;
+                e.delay = 0;
+                e.terrno = ETIME;
+                round.push_back(&e);
+            }
+            if (std::all_of(round.begin(), round.end(),
+                            [&](const BatchEntry* e) { return companion(*e); })) {
+                break;
+            }
+
+            LOG(DEBUG) << __func__ << ": Querying server (# " << ns + 1
+                       << ") address = " << statp->nsaddrs[ns].toString();
+            const time_t query_time = time(nullptr);
+            Stopwatch queryStopwatch;
+            int terrno = ETIME;
+            bool sent = false;
+            if (openUdpSocket(statp, ns, &terrno) > 0) {
+                // Both A and AAAA, and whatever else is pending, go out in a single syscall.
+                std::vector<iovec> iovs(round.size());
+                std::vector<mmsghdr> msgs(round.size());
+                for (size_t i = 0; i < round.size(); i++) {
+                    const span<const uint8_t> msg = round[i]->query->msg;
+                    iovs[i] = {.iov_base = const_cast<uint8_t*>(msg.data()), .iov_len = msg.size()};
+                    msgs[i] = {.msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1}};
+                }
+                const int n = sendmmsg(statp->udpsocks[ns], msgs.data(), msgs.size(), 0);
+                sent = n == static_cast<int>(msgs.size());
+                if (!sent) {
+                    terrno = n < 0 ? errno : EAGAIN;
+                    PLOG(DEBUG) << __func__ << ": sendmmsg: ";
+                    statp->udpsocks[ns].reset();
+                }
+            }
+            for (BatchEntry* e : round) e->terrno = terrno;
+
+            const timespec start_time = evNowTime();
+            const timespec finish =
+                    evAddTime(start_time, get_timeout(statp, &params, ns, PROTO_UDP));
+            bool timedOut = false;
+            while (sent && std::any_of(round.begin(), round.end(), [](const BatchEntry* e) {
+                       return !e->roundOver && !e->query->companion;
+                   })) {
+                // Keep listening on the servers tried before, which may still answer.
+                std::vector<pollfd> fdset = extractUdpFdset(statp);
+                const timespec now = evNowTime();
+                const timespec timeout = (evCmpTime(finish, now) > 0) ? evSubTime(finish, now)
+                                                                      : evConsTime(0L, 0L);
+                const int n = ppoll(fdset.data(), fdset.size(), &timeout, /*__mask=*/nullptr);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    timedOut = n == 0;
+                    if (timedOut) gotsomewhere = 1;
+                    break;
+                }
+                bool unreachable = false;
+                for (size_t i = 0; i < fdset.size(); i++) {
+                    if (!(fdset[i].revents & (POLLIN | POLLERR))) continue;
+                    if (!recv_dg_batch(statp, i, ns, batch, recvBuf, start_time, &gotsomewhere)) {
+                        // Only the server being queried matters; the others had their chance.
+                        if (i == ns) unreachable = true;
+                        statp->udpsocks[i].reset();
+                    }
+                }
+                if (unreachable) {
+                    for (BatchEntry* e : round) e->terrno = ECONNREFUSED;
+                    break;
+                }
+            }
+
+            for (BatchEntry* e : round) {
+                const bool heard = e->roundOver;
+                // Not waited for, so not held against the server either.
+                if (!heard && e->query->companion) continue;
+                if (!heard && timedOut) {
+                    e->rcode = RCODE_TIMEOUT;
+                    e->terrno = ETIMEDOUT;
+                }
+                const size_t actualNs = heard ? e->answeredBy : ns;
+                DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
+                dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(e->cacheStatus));
+                dnsQueryEvent->set_latency_micros(
+                        (actualNs == ns) ? saturate_cast<int32_t>(queryStopwatch.timeTakenUs())
+                                         : -1);
+                dnsQueryEvent->set_dns_server_index(actualNs);
+                dnsQueryEvent->set_ip_version(
+                        ipFamilyToIPVersion(statp->nsaddrs[actualNs].family()));
+                dnsQueryEvent->set_retry_times(attempt);
+                dnsQueryEvent->set_rcode(static_cast<NsRcode>(e->rcode));
+                dnsQueryEvent->set_protocol(PROTO_UDP);
+                dnsQueryEvent->set_type(getQueryType(e->query->msg));
+                dnsQueryEvent->set_linux_errno(static_cast<LinuxErrno>(e->terrno));
+                if (actualNs == ns) {
+                    record_circuit_outcome(statp, ns, PROTO_UDP, heard, e->terrno,
+                                           timeoutsToOpen);
+                }
+                // As in res_nsend(), only the first attempt counts towards the server stats.
+                if (attempt == 0 && !isNetworkRestricted(e->terrno)) {
+                    res_sample sample;
+                    res_stats_set_sample(&sample, query_time, e->rcode, e->delay);
+                    resolv_cache_add_resolver_stats_sample(statp->netid, revision_id,
+                                                           statp->nsaddrs[ns], sample,
+                                                           params.max_samples);
+                    resolv_stats_add(statp->netid, statp->nsaddrs[actualNs], dnsQueryEvent);
+                }
+                if (!e->done) e->query->rcode = e->rcode;
+            }
+        }
+    }
+
+    res_nsend_batch_finish(statp, batch, cacheEntries, flags, gotsomewhere);
+}
+
+namespace {
+
+// res_nsend() of a cleartext UDP query that missed the cache, as a state machine that the
+// DnsUdpReactor drives instead of a blocked thread. Sending and receiving run on the reactor
+// thread, so none of them may block; what may block, from adding the answer to the cache to
+// calling back, runs on the QueryThreadPool. So do the server stats samples, which take the lock
+// of the network, and are added together when the query ends.
+class AsyncUdpQuery : public std::enable_shared_from_this<AsyncUdpQuery> {
+  public:
+    using Callback = std::function<void(int resplen, int rcode)>;
+
+    AsyncUdpQuery(std::unique_ptr<ResState> statp, span<const uint8_t> msg, span<uint8_t> ans,
+                  uint32_t flags, ResolvCacheStatus cacheStatus, Callback callback)
+        : mStatp(std::move(statp)),
+          mMsg(msg),
+          mAns(ans),
+          mFlags(flags),
+          mCacheStatus(cacheStatus),
+          mCallback(std::move(callback)) {}
+
+    // Picks the servers to query, the same way res_nsend() does. Returns false if there's
+    // nothing to query.
+    bool init() {
+        res_stats stats[MAXNS]{};
+        mRevisionId = resolv_cache_get_resolver_stats(mStatp->netid, &mParams, stats,
+                                                      mStatp->nsaddrs);
+        if (mRevisionId < 0) return false;
+        int usableServersCount = android_net_res_stats_get_usable_servers(
+                &mParams, stats, mStatp->nameserverCount(), mUsableServers);
+        if (mStatp->sort_nameservers) {
+            std::fill_n(mUsableServers, mStatp->nameserverCount(), true);
+        }
+        mTimeoutsToOpen = CircuitBreaker::timeoutsToOpen();
+        if (mTimeoutsToOpen > 0) {
+            usableServersCount -= skip_open_circuits(mStatp.get(), PROTO_UDP, mUsableServers);
+        }
+        if ((mFlags & ANDROID_RESOLV_NO_RETRY) && usableServersCount > 1) {
+            auto hp = reinterpret_cast<const HEADER*>(mMsg.data());
+            res_set_usable_server((hp->id % usableServersCount) + 1, mStatp->nameserverCount(),
+                                  mUsableServers);
+        }
+        mRetryTimes = (mFlags & ANDROID_RESOLV_NO_RETRY) ? 1 : mParams.retry_count;
+        for (size_t i = 0; i < mStatp->nsaddrs.size(); i++) {
+            if (!mUsableServers[i]) continue;
+            const timespec timeout = get_timeout(mStatp.get(), &mParams, i, PROTO_UDP);
+            mTimeouts[i] = std::chrono::seconds(timeout.tv_sec) +
+                           std::chrono::nanoseconds(timeout.tv_nsec);
+        }
+        return true;
+    }
+
+    // Sends the query to the next usable server, or gives up if there's none left.
+    void queryNextServer() {
+        for (;;) {
+            if (++mNs >= mStatp->nsaddrs.size()) {
+                mNs = 0;
+                mAttempt++;
+            }
+            if (mAttempt >= mRetryTimes || mStatp->isCancelled()) {
+                finish(mGotsomewhere ? -ETIMEDOUT : -ECONNREFUSED);
+                return;
+            }
+            if (!mUsableServers[mNs]) continue;
+
+            LOG(DEBUG) << __func__ << ": Querying server (# " << mNs + 1
+                       << ") address = " << mStatp->nsaddrs[mNs].toString();
+            mRcode = RCODE_INTERNAL_ERROR;
+            mTerrno = ETIME;
+            mDelay = 0;
+            mQueryTime = time(nullptr);
+            mStartTime = evNowTime();
+            mSentAt = std::chrono::steady_clock::now();
+            if (openUdpSocket(mStatp.get(), mNs, &mTerrno) <= 0) {
+                recordAttempt(mNs);
+                continue;
+            }
+            if (send(mStatp->udpsocks[mNs], mMsg.data(), mMsg.size(), 0) != mMsg.size()) {
+                mTerrno = errno;
+                PLOG(DEBUG) << __func__ << ": send: ";
+                mStatp->closeSockets();
+                recordAttempt(mNs);
+                continue;
+            }
+            mDeadline = std::chrono::steady_clock::now() + mTimeouts[mNs];
+            watch();
+            return;
+        }
+    }
+
+  private:
+    // Waits for an answer on the sockets of all servers queried so far.
+    void watch() {
+        std::vector<int> fds;
+        for (size_t i = 0; i < mStatp->nsaddrs.size(); i++) {
+            if (mStatp->udpsocks[i] != -1) fds.push_back(mStatp->udpsocks[i]);
+        }
+        DnsUdpReactor::getInstance().watch(
+                fds, mDeadline,
+                [self = shared_from_this()](DnsUdpReactor::Result result) {
+                    self->onReady(std::move(result));
+                });
+    }
+
+    void onReady(DnsUdpReactor::Result result) {
+        if (!result.ok()) {
+            if (result.error().code() == ETIMEDOUT) {
+                mRcode = RCODE_TIMEOUT;
+                mTerrno = ETIMEDOUT;
+                mGotsomewhere = 1;
+            } else {
+                mTerrno = result.error().code();
+                mStatp->closeSockets();
+            }
+            recordAttempt(mNs);
+            queryNextServer();
+            return;
+        }
+
+        // Set when the server being queried has had its say without answering.
+        bool serverFailed = false;
+        for (int fd : *result) {
+            for (;;) {
+                sockaddr_storage from;
+                timespec rxtime;
+                const int resplen = recvfrom_timestamped(fd, mAns, MSG_DONTWAIT, &from, &rxtime);
+                if (resplen < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && fd == mStatp->udpsocks[mNs]) {
+                        mTerrno = errno;
+                        PLOG(DEBUG) << __func__ << ": recvfrom: ";
+                        serverFailed = true;
+                    }
+                    break;
+                }
+                mGotsomewhere = 1;
+                if (resplen < HFIXEDSZ) {
+                    LOG(DEBUG) << __func__ << ": undersized: " << resplen;
+                    mTerrno = EMSGSIZE;
+                    continue;
+                }
+                int receivedFromNs = mNs;
+                if (ignoreInvalidAnswer(mStatp.get(), from, mMsg, mAns, &receivedFromNs)) {
+                    res_pquery(mAns.first(std::min<size_t>(resplen, mAns.size())));
+                    continue;
+                }
+
+                const HEADER* anhp = reinterpret_cast<const HEADER*>(mAns.data());
+                if (anhp->rcode == FORMERR &&
+                    (mStatp->netcontext_flags & NET_CONTEXT_FLAG_USE_EDNS)) {
+                    LOG(DEBUG) << __func__ << ": server rejected query with EDNS0:";
+                    mStatp->flags |= RES_F_EDNS0ERR;
+                    mTerrno = EREMOTEIO;
+                    continue;
+                }
+                mDelay = rtt_ms(rxtime, mStartTime);
+                if (anhp->rcode == SERVFAIL || anhp->rcode == NOTIMP || anhp->rcode == REFUSED) {
+                    LOG(DEBUG) << __func__ << ": server rejected query:";
+                    res_pquery(mAns.first(std::min<size_t>(resplen, mAns.size())));
+                    if (static_cast<size_t>(receivedFromNs) == mNs) {
+                        mRcode = anhp->rcode;
+                        serverFailed = true;
+                    }
+                    continue;
+                }
+                if (anhp->tc) {
+                    LOG(DEBUG) << __func__ << ": truncated answer";
+                    mTerrno = E2BIG;
+                    recordAttempt(mNs);
+                    retryBlocking();
+                    return;
+                }
+                mRcode = anhp->rcode;
+                mTerrno = 0;
+                finish(resplen, receivedFromNs);
+                return;
+            }
+        }
+        if (serverFailed) {
+            recordAttempt(mNs);
+            queryNextServer();
+            return;
+        }
+        watch();
+    }
+
+    // Reports the outcome of querying the current server, as res_nsend() does.
+    void recordAttempt(size_t actualNs) {
+        DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(mStatp->event);
+        dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(mCacheStatus));
+        const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - mSentAt);
+        dnsQueryEvent->set_latency_micros(
+                (actualNs == mNs) ? saturate_cast<int32_t>(latency.count()) : -1);
+        dnsQueryEvent->set_dns_server_index(actualNs);
+        dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(mStatp->nsaddrs[actualNs].family()));
+        dnsQueryEvent->set_retry_times(mAttempt);
+        dnsQueryEvent->set_rcode(static_cast<NsRcode>(mRcode));
+        dnsQueryEvent->set_protocol(PROTO_UDP);
+        dnsQueryEvent->set_type(getQueryType(mMsg));
+        dnsQueryEvent->set_linux_errno(static_cast<LinuxErrno>(mTerrno));
+        if (actualNs == mNs) {
+            record_circuit_outcome(mStatp.get(), mNs, PROTO_UDP, mTerrno == 0, mTerrno,
+                                   mTimeoutsToOpen);
+        }
+        if (mAttempt == 0 && !isNetworkRestricted(mTerrno)) {
+            PendingSample& pending = mPendingSamples.emplace_back();
+            pending.ns = mNs;
+            pending.actualNs = actualNs;
+            res_stats_set_sample(&pending.sample, mQueryTime, mRcode, mDelay);
+            pending.event = dnsQueryEvent;
+        }
+    }
+
+    // Adds the stats samples of the attempts so far. Runs on the pool.
+    void addPendingSamples() {
+        for (const PendingSample& pending : mPendingSamples) {
+            resolv_cache_add_resolver_stats_sample(mStatp->netid, mRevisionId,
+                                                   mStatp->nsaddrs[pending.ns], pending.sample,
+                                                   mParams.max_samples);
+            resolv_stats_add(mStatp->netid, mStatp->nsaddrs[pending.actualNs], pending.event);
+        }
+        mPendingSamples.clear();
+    }
+
+    // Ends the query on the pool: reports the answer |answeredBy| gave, if any, caches it and
+    // calls back. Runs inline if the pool can't take it.
+    void finish(int resplen, std::optional<size_t> answeredBy = std::nullopt) {
+        const QueryThreadPool::Task done = [self = shared_from_this(), resplen, answeredBy]() {
+            if (answeredBy) self->recordAttempt(*answeredBy);
+            self->addPendingSamples();
+            self->complete(resplen);
+        };
+        if (QueryThreadPool::getInstance()->execute(done, "res_nsend_async") != 0) done();
+    }
+
+    void complete(int resplen) {
+        if (resplen > 0) {
+            LOG(DEBUG) << __func__ << ": got answer:";
+            res_pquery(mAns.first(resplen));
+            if (mCacheStatus == RESOLV_CACHE_NOTFOUND) {
+                resolv_cache_add(mStatp->netid, mMsg, mAns.first(resplen), mStatp->uid);
+            }
+            releaseUdpSockets(mStatp.get());
+        } else {
+            cache_query_failed(mStatp.get(), mMsg, mFlags, mRcode);
+        }
+        mStatp->closeSockets();
+        mCallback(resplen, mRcode);
+    }
+
+    // Hands the query to res_nsend() on the pool, for what only it does, like retrying over TCP
+    // after a truncated answer. Fails the query if the pool can't take it, rather than block
+    // the reactor.
+    void retryBlocking() {
+        _resolv_cache_query_failed(mStatp->netid, mMsg, mFlags);
+        mStatp->closeSockets();
+        const int rval = QueryThreadPool::getInstance()->execute(
+                [self = shared_from_this()]() {
+                    self->addPendingSamples();
+                    int rcode = RCODE_INTERNAL_ERROR;
+                    const int resplen = res_nsend(self->mStatp.get(), self->mMsg, self->mAns,
+                                                  &rcode, self->mFlags);
+                    self->mCallback(resplen, rcode);
+                },
+                "res_nsend_async");
+        if (rval != 0) mCallback(rval, RCODE_INTERNAL_ERROR);
+    }
+
+    const std::unique_ptr<ResState> mStatp;
+    const span<const uint8_t> mMsg;
+    const span<uint8_t> mAns;
+    const uint32_t mFlags;
+    const ResolvCacheStatus mCacheStatus;
+    const Callback mCallback;
+
+    // A stats sample of the first attempt at server |ns|, answered by |actualNs|.
+    struct PendingSample {
+        size_t ns;
+        size_t actualNs;
+        res_sample sample;
+        const DnsQueryEvent* event;
+    };
+
+    res_params mParams;
+    int mRevisionId = -1;
+    bool mUsableServers[MAXNS];
+    // How long to wait for each server, as get_timeout() gives it when the query starts.
+    std::chrono::steady_clock::duration mTimeouts[MAXNS] = {};
+    std::vector<PendingSample> mPendingSamples;
+    int mRetryTimes = 0;
+    int mTimeoutsToOpen = 0;
+    int mAttempt = 0;
+    // The server being queried; starts one before the first.
+    size_t mNs = SIZE_MAX;
+    int mGotsomewhere = 0;
+    int mRcode = RCODE_INTERNAL_ERROR;
+    int mTerrno = ETIME;
+    int mDelay = 0;
+    time_t mQueryTime = 0;
+    timespec mStartTime = {};
+    std::chrono::steady_clock::time_point mSentAt;
+    std::chrono::steady_clock::time_point mDeadline;
+};
+
+}  // namespace
+
+bool resolv_res_nsend_async(const android_net_context* netContext, span<const uint8_t> msg,
+                            span<uint8_t> ans, uint32_t flags, NetworkDnsEventReported* event,
+                            std::function<void(int resplen, int rcode)> callback) {
+    assert(event != nullptr);
+    // Without the pool, the steps that may block would have to run on the reactor thread.
+    if (QueryThreadPool::getInstance() == nullptr) return false;
+    auto statp = std::make_unique<ResState>(netContext, event);
+    resolv_populate_res_for_net(statp.get());
+
+    // Anything but a cleartext UDP query is left to res_nsend().
+    if (ans.size() < HFIXEDSZ || msg.size() > PACKETSZ || isMdnsResolution(statp->flags) ||
+        statp->nameserverCount() == 0) {
+        return false;
+    }
+    if (!(statp->netcontext_flags & NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS)) {
+        const PrivateDnsMode mode =
+                PrivateDnsConfiguration::getInstance().getStatusSnapshot(statp->netid)->mode;
+        if (mode != PrivateDnsMode::OFF) return false;
+        statp->event->set_private_dns_modes(convertEnumType(mode));
+    }
+
+    LOG(DEBUG) << __func__;
+    res_pquery(msg);
+    int anslen = 0;
+    Stopwatch cacheStopwatch;
+    std::optional<int> leaderFailure;
+    const ResolvCacheStatus cacheStatus =
+            resolv_cache_lookup(statp->netid, msg, ans, &anslen, flags, statp->uid, &leaderFailure);
+    if (cacheStatus == RESOLV_CACHE_FOUND || cacheStatus == RESOLV_CACHE_STALE ||
+        cacheStatus == RESOLV_CACHE_PREFETCH) {
+        DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
+        dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(cacheStopwatch.timeTakenUs()));
+        dnsQueryEvent->set_cache_hit(CacheStatus::CS_FOUND);
+        dnsQueryEvent->set_type(getQueryType(msg));
+        if (cacheStatus != RESOLV_CACHE_FOUND) refresh_cached_answer(statp.get(), msg, flags);
+        callback(anslen, reinterpret_cast<const HEADER*>(ans.data())->rcode);
+        return true;
+    }
+    if (cacheStatus != RESOLV_CACHE_UNSUPPORTED) resolv_populate_res_for_net(statp.get());
+    if (leaderFailure) {
+        callback(-ETIMEDOUT, *leaderFailure);
+        return true;
+    }
+    if (int rcode; cacheStatus == RESOLV_CACHE_NOTFOUND &&
+                   resolv_cache_lookup_failure(statp->netid, msg, flags, &rcode)) {
+        _resolv_cache_query_failed(statp->netid, msg, flags);
+        callback(-ETIMEDOUT, rcode);
+        return true;
+    }
+
+    auto query = std::make_shared<AsyncUdpQuery>(std::move(statp), msg, ans, flags, cacheStatus,
+                                                 std::move(callback));
+    if (!query->init()) {
+        _resolv_cache_query_failed(netContext->dns_netid, msg, flags);
+        return false;
+    }
+    query->queryNextServer();
+    return true;
+}
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <functional>
 #include <span>
 
 #include "netd_resolv/resolv.h"  // struct android_net_context
@@ -25,3 +26,40 @@
 int resolv_res_nsend(const android_net_context* netContext, std::span<const uint8_t> msg,
                      std::span<uint8_t> ans, int* rcode, uint32_t flags,
                      android::net::NetworkDnsEventReported* event);
+
+// Like resolv_res_nsend(), but returns as soon as the query is sent, and calls |callback| with
+// the answer length (or a negative errno) and rcode once it arrives. The callback may run on the
+// calling thread or on the QueryThreadPool; |msg|, |ans| and |event| must stay valid until then.
+// Returns false, without calling |callback|, for queries that can only go through
+// resolv_res_nsend(), such as those using private DNS or mDNS, and when there's no pool.
+bool resolv_res_nsend_async(const android_net_context* netContext, std::span<const uint8_t> msg,
+                            std::span<uint8_t> ans, uint32_t flags,
+                            android::net::NetworkDnsEventReported* event,
+                            std::function<void(int resplen, int rcode)> callback);
+
+namespace android::net {
+
+// Makes the lookups of this thread answer from the cache alone during its lifetime: a query that
+// resolv_cache_peek() can't answer isn't sent, and fails with -EWOULDBLOCK. DnsProxyListener
+// answers the requests that hit the cache this way on its listener thread, and hands those that
+// missed() to a worker thread, to be resolved again from the start.
+class ScopedCacheOnlyLookup {
+  public:
+    ScopedCacheOnlyLookup();
+    ~ScopedCacheOnlyLookup();
+    ScopedCacheOnlyLookup(const ScopedCacheOnlyLookup&) = delete;
+    ScopedCacheOnlyLookup& operator=(const ScopedCacheOnlyLookup&) = delete;
+
+    // The scope of this thread, or nullptr.
+    static ScopedCacheOnlyLookup* current();
+
+    // Whether a query of the lookup would have had to be sent.
+    bool missed() const { return mMissed; }
+    void setMissed() { mMissed = true; }
+
+  private:
+    ScopedCacheOnlyLookup* const mPrevious;
+    bool mMissed = false;
+};
+
+}  // namespace android::net
@@ -28,7 +28,13 @@
 
 #pragma once
 
+#include <sys/socket.h>
+
+#include <chrono>
+#include <memory>
+#include <optional>
 #include <span>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -37,8 +43,10 @@
 
 #include <netdutils/DumpWriter.h>
 #include <netdutils/InternetAddresses.h>
+#include <private/android_filesystem_config.h>
 #include <stats.pb.h>
 
+#include "HostsFile.h"
 #include "ResolverStats.h"
 #include "params.h"
 #include "stats.h"
@@ -54,26 +62,134 @@ std::vector<unsigned> resolv_list_caches();
 std::vector<std::string> resolv_cache_dump_subsampling_map(unsigned netid, bool is_mdns);
 uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code, bool is_mdns);
 
+// Draws whether the event of a lookup that just arrived on a given network may be sampled, before
+// its return code is known: with the best chance any return code has, 1 / the lowest denominator
+// of the subsampling maps. Returns that denominator if it was drawn, or else 0, in which case
+// the event is not to be sampled whatever its return code. The draws are counted in the dump.
+uint32_t resolv_cache_draw_event_sample(unsigned netid);
+
 typedef enum {
     RESOLV_CACHE_UNSUPPORTED, /* the cache can't handle that kind of queries */
                               /* or the answer buffer is too small */
     RESOLV_CACHE_NOTFOUND,    /* the cache doesn't know about this query */
     RESOLV_CACHE_FOUND,       /* the cache found the answer */
-    RESOLV_CACHE_SKIP         /* Don't do anything on cache */
+    RESOLV_CACHE_SKIP,        /* Don't do anything on cache */
+    RESOLV_CACHE_STALE,       /* the cache served an expired answer and the caller */
+                              /* should refresh it in the background */
+    RESOLV_CACHE_PREFETCH     /* the cache found the answer, which is about to expire; */
+                              /* the caller should refresh it in the background */
 } ResolvCacheStatus;
 
+// |uid| is the app the lookup is for. It only matters on networks whose cache is partitioned by
+// UID, where each app only sees the answers it added itself; an answer added by several apps is
+// still stored once.
+// With the "adaptive_pending_waits" experiment, a lookup that waited for another lookup of the
+// same query, which then failed with SERVFAIL or a timeout, returns RESOLV_CACHE_NOTFOUND with
+// |leader_failure| set to the rcode, if it isn't null, for the caller to fail as well rather than
+// send the query again.
 ResolvCacheStatus resolv_cache_lookup(unsigned netid, std::span<const uint8_t> query,
-                                      std::span<uint8_t> answer, int* answerlen, uint32_t flags);
+                                      std::span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                      uid_t uid = AID_DNS,
+                                      std::optional<int>* leader_failure = nullptr);
+
+// Like resolv_cache_lookup(), but never waits: neither for the cache lock, nor for another lookup
+// of the same query. Only answers that are fresh and need no refresh are returned, as
+// RESOLV_CACHE_FOUND; anything else is RESOLV_CACHE_NOTFOUND, for resolv_cache_lookup() to handle.
+// A query that isn't found is left uncounted, and isn't registered as pending.
+ResolvCacheStatus resolv_cache_peek(unsigned netid, std::span<const uint8_t> query,
+                                    std::span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                    uid_t uid = AID_DNS);
 
 // add a (query,answer) to the cache. If the pair has been in the cache, no new entry will be added
-// in the cache.
+// in the cache. |private_dns| tells that the answer came from a validated private DNS server,
+// without which its AD bit can't be trusted: an on-path attacker could have set it.
 int resolv_cache_add(unsigned netid, std::span<const uint8_t> query,
-                     std::span<const uint8_t> answer);
+                     std::span<const uint8_t> answer, uid_t uid = AID_DNS,
+                     bool private_dns = false);
 
 /* Notify the cache a request failed */
 void _resolv_cache_query_failed(unsigned netid, std::span<const uint8_t> query, uint32_t flags);
 
-// Get a customized table for a given network.
+// Like _resolv_cache_query_failed(), for a query that failed with SERVFAIL from the servers, or
+// RCODE_TIMEOUT when none answered. With a failure cache lifetime set in the options of the
+// network, the question is remembered that long as having failed with |rcode| (RFC 2308 section
+// 7), so that asking it again fails fast. Not in a cache partitioned by UID.
+void resolv_cache_add_failure(unsigned netid, std::span<const uint8_t> query, uint32_t flags,
+                              int rcode);
+
+// Forget the questions that failed on |netid|, e.g. once its private DNS servers changed state,
+// since queries may go to other servers now.
+void resolv_cache_clear_failures(unsigned netid);
+
+// Returns whether the question of |query| failed recently on |netid|, and fills in the rcode it
+// failed with.
+bool resolv_cache_lookup_failure(unsigned netid, std::span<const uint8_t> query, uint32_t flags,
+                                 int* rcode);
+
+// One of the related queries, such as the A and AAAA queries for a name, that a batch looks up
+// and adds together.
+struct ResolvCacheBatchEntry {
+    std::span<const uint8_t> query;
+    // Filled in by resolv_cache_lookup_batch() when the status says the cache has an answer,
+    // and by the caller with the answer it got otherwise. Left empty if the query failed.
+    std::span<uint8_t> answer;
+    int answerlen = 0;
+    ResolvCacheStatus status = RESOLV_CACHE_UNSUPPORTED;
+};
+
+// Like resolv_cache_lookup() for each of |entries|, under a single acquisition of the cache lock.
+// Entries another lookup is already resolving are waited for together. The caller must then
+// resolve the RESOLV_CACHE_NOTFOUND entries and complete them with resolv_cache_add_batch().
+void resolv_cache_lookup_batch(unsigned netid, std::span<ResolvCacheBatchEntry> entries,
+                               uint32_t flags, uid_t uid = AID_DNS);
+
+// Adds the answers of the RESOLV_CACHE_NOTFOUND entries of a batch that was looked up, and
+// notifies the cache that those without an answer failed. Lookups waiting for any of them are
+// released once all of them are done. |flags| and |uid| must be those of the lookup.
+void resolv_cache_add_batch(unsigned netid, std::span<const ResolvCacheBatchEntry> entries,
+                            uint32_t flags, uid_t uid = AID_DNS);
+
+// A result of getaddrinfo as kept by the addrinfo cache.
+struct CachedAddrInfo {
+    int flags;
+    int family;
+    int socktype;
+    int protocol;
+    sockaddr_storage addr;
+    socklen_t addrlen;
+    // Empty if the result has no canonical name.
+    std::string canonname;
+};
+
+// Look up the final, sorted results of a getaddrinfo DNS lookup on a given network. |key| must
+// identify everything the results depend on apart from the network's configuration and cache,
+// whose changes drop all results. Returns false if there are none, or they've expired.
+bool resolv_cache_lookup_addrinfo(unsigned netid, const std::string& key,
+                                  std::vector<CachedAddrInfo>* addrs);
+
+// Keep the results of a getaddrinfo DNS lookup for |ttl| seconds.
+void resolv_cache_add_addrinfo(unsigned netid, const std::string& key,
+                               std::vector<CachedAddrInfo> addrs, uint32_t ttl);
+
+// A result of _find_src_addr() as kept by the source address cache.
+struct CachedSrcAddr {
+    // 1 if the destination is reachable, in which case |addr| is the source address, else 0.
+    int reachable;
+    sockaddr_storage addr;
+};
+
+// Look up which source address a destination was found to be reached from on a given network.
+// |key| must identify the destination, mark and UID. Returns false if there's no result, or it's
+// older than a few seconds.
+bool resolv_cache_lookup_src_addr(unsigned netid, const std::string& key, CachedSrcAddr* result);
+
+// Keep a source address result until it expires or the network's configuration changes.
+void resolv_cache_add_src_addr(unsigned netid, const std::string& key, const CachedSrcAddr& result);
+
+// Get the customized hosts of a given network, or nullptr if it has none.
+std::shared_ptr<const android::net::HostsFile::Table> resolv_get_customized_hosts(unsigned netid);
+
+// Get the customized addresses of |hostname| on a given network.
 std::vector<std::string> getCustomizedTableByName(const size_t netid, const char* hostname);
 
 // Sets name servers for a given network.
@@ -108,9 +224,63 @@ bool is_mdns_supported_network(unsigned netid);
 bool has_named_cache(unsigned netid);
 
 // For test only.
-// Get the expiration time of a cache entry. Return 0 on success; otherwise, an negative error is
-// returned if the expiration time can't be acquired.
-int resolv_cache_get_expiration(unsigned netid, std::span<const uint8_t> query, time_t* expiration);
+// Get the expiration time of a cache entry, on the clock of resolv_cache_now(). Return 0 on
+// success; otherwise, an negative error is returned if the expiration time can't be acquired.
+int resolv_cache_get_expiration(unsigned netid, std::span<const uint8_t> query,
+                                std::chrono::milliseconds* expiration);
+
+// For test only.
+// Compute the hash that caches index a given query by. Return false if the cache doesn't support
+// the query.
+bool resolv_cache_hash_query(std::span<const uint8_t> query, unsigned* hash);
+
+// Return the number of cache entries refreshed ahead of expiry for a given network, or 0 if the
+// network has no cache.
+int resolv_cache_get_prefetch_count(unsigned netid);
+
+// Return the number of cache misses of a given network answered from the cache of another network
+// in its cache domain, or 0 if the network has no cache.
+int resolv_cache_get_shared_hit_count(unsigned netid);
+
+// A question that cache entries answer, as a name and an ns_type.
+struct ResolvCacheQuestion {
+    std::string name;
+    int type;
+};
+
+// Return the questions, of class IN, looked up most often in the cache of a given network, hit or
+// miss, most looked up first, and at most |max| of them. Only the few questions the cache keeps
+// counts of for its dump are known.
+std::vector<ResolvCacheQuestion> resolv_cache_get_hot_questions(unsigned netid, size_t max);
+
+// Fill |stats| with the cache statistics of a given network, if it has a cache and they weren't
+// reported in the last hour. Return true if |stats| was filled.
+bool resolv_cache_get_stats_report(unsigned netid, android::net::DnsCacheStats* stats);
+
+// Put a given network in a cache domain. On a cache miss, networks look up the caches of the other
+// networks in the same domain before querying their servers. Only networks whose answers are
+// interchangeable, i.e. that have the same public or authenticated upstream servers and private
+// DNS setup, may share a domain. An empty domain isolates the network's cache again.
+int resolv_set_cache_domain(unsigned netid, const std::string& domain);
+
+// Save the cache of a given network to its snapshot file, to be reloaded if the network is
+// created again. Snapshots are also saved periodically while the cache is in use.
+int resolv_cache_write_snapshot(unsigned netid);
+
+// For test only.
+// Set the directory where cache snapshots are saved.
+void resolv_cache_set_snapshot_dir(const std::string& dir);
+
+// For test only.
+// The time the caches measure expiry against: milliseconds of CLOCK_MONOTONIC_COARSE, unless
+// resolv_cache_set_clock() replaced it.
+std::chrono::milliseconds resolv_cache_now();
+
+// For test only.
+// Make the caches read the time from |clock| instead of CLOCK_MONOTONIC_COARSE, e.g. to replay a
+// trace of lookups faster than it was captured. |clock| must never go backwards. nullptr brings
+// back the real clock.
+void resolv_cache_set_clock(std::chrono::milliseconds (*clock)());
 
 // Set addresses to DnsStats for a given network.
 int resolv_stats_set_addrs(unsigned netid, android::net::Protocol proto,
@@ -120,6 +290,21 @@ int resolv_stats_set_addrs(unsigned netid, android::net::Protocol proto,
 bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& server,
                       const android::net::DnsQueryEvent* record);
 
+// Return the |percentile|th percentile of the latency of a given server of a given network, or
+// std::nullopt if it's unknown.
+std::optional<std::chrono::microseconds> resolv_stats_get_latency_percentile(
+        unsigned netid, const android::netdutils::IPSockAddr& server, android::net::Protocol proto,
+        int percentile);
+
+// Return the servers of a given protocol of a given network, best score first.
+std::vector<android::netdutils::IPSockAddr> resolv_stats_get_sorted_servers(
+        unsigned netid, android::net::Protocol proto);
+
+// Return the retransmission timeout estimated from the latency of a given server of a given
+// network, or std::nullopt if it's unknown.
+std::optional<std::chrono::microseconds> resolv_stats_get_retransmit_timeout(
+        unsigned netid, const android::netdutils::IPSockAddr& server, android::net::Protocol proto);
+
 /* Retrieve a local copy of the stats for the given netid. The buffer must have space for
  * MAXNS __resolver_stats. Returns the revision id of the resolvers used.
  */
@@ -139,3 +324,18 @@ android::net::NetworkType convert_network_type(const std::vector<int32_t>& trans
 
 // Dump net configuration log for a given network.
 void resolv_netconfig_dump(android::netdutils::DumpWriter& dw, unsigned netid);
+
+// Approximate bytes of memory held for a network by its cache and configuration.
+struct ResolvCacheMemoryUsage {
+    // The answers and what indexes them, and the getaddrinfo and source address results.
+    size_t cache;
+    // The most the answers alone ever held, which |cache| was at least as large as.
+    size_t cache_peak;
+    // The hosts set by the resolver options.
+    size_t hosts;
+    // The server statistics.
+    size_t stats;
+};
+
+// Returns false if the network doesn't exist.
+bool resolv_cache_get_memory_usage(unsigned netid, ResolvCacheMemoryUsage* usage);
@@ -54,11 +54,18 @@
 
 #include <net/if.h>
 #include <time.h>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
 #include <span>
 #include <string>
 #include <vector>
 
+#include "CancellationToken.h"
 #include "DnsResolver.h"
+#include "PacketBuffer.h"
 #include "netd_resolv/resolv.h"
 #include "params.h"
 #include "stats.pb.h"
@@ -75,6 +82,8 @@
  */
 #define RES_TIMEOUT 5000 /* min. milliseconds between retries */
 #define RES_DFLRETRY 2    /* Default #/tries. */
+#define RES_MIN_ADAPTIVE_TIMEOUT 250    /* min. adaptive timeout in milliseconds */
+#define RES_MAX_ADAPTIVE_TIMEOUT 10000  /* max. adaptive timeout in milliseconds */
 
 // Flags for ResState::flags
 #define RES_F_VC 0x00000001        // socket is TCP
@@ -96,7 +105,8 @@ struct ResState {
           pid(netcontext->pid),
           mark(netcontext->dns_mark),
           event(dnsEvent),
-          netcontext_flags(netcontext->flags) {}
+          netcontext_flags(netcontext->flags),
+          cancellation(android::net::CancellationToken::current()) {}
 
     ResState clone(android::net::NetworkDnsEventReported* dnsEvent = nullptr) {
         // TODO: Separate non-copyable members to other structures and let default copy
@@ -115,6 +125,8 @@ struct ResState {
         copy.tc_mode = tc_mode;
         copy.enforce_dns_uid = enforce_dns_uid;
         copy.sort_nameservers = sort_nameservers;
+        copy.cancellation = cancellation;
+        copy.pinned_server = pinned_server;
         return copy;
     }
     void closeSockets() {
@@ -128,6 +140,9 @@ struct ResState {
 
     int nameserverCount() { return nsaddrs.size(); }
 
+    // Whether the client has gone, so that sending more queries would be wasted effort.
+    bool isCancelled() { return cancellation && cancellation->isCancelled(); }
+
     // clang-format off
     unsigned netid;                             // NetId: cache key and socket mark
     uid_t uid;                                  // uid of the app that sent the DNS lookup
@@ -135,6 +150,7 @@ struct ResState {
     std::vector<std::string> search_domains{};  // domains to search
     std::vector<android::netdutils::IPSockAddr> nsaddrs;
     android::base::unique_fd udpsocks[MAXNS];   // UDP sockets to nameservers
+    std::chrono::steady_clock::time_point udpsocks_expiry[MAXNS]{};  // when they stop being reused
     unsigned ndots : 4 = 1;                     // threshold for initial abs. query
     unsigned mark;                              // Socket mark to be used by all DNS query sockets
     android::base::unique_fd tcp_nssock;        // TCP socket (but why not one per nameserver?)
@@ -144,6 +160,9 @@ struct ResState {
     int tc_mode = 0;
     bool enforce_dns_uid = false;
     bool sort_nameservers = false;              // True if nsaddrs has been sorted.
+    std::shared_ptr<android::net::CancellationToken> cancellation;  // of the client's request
+    // The only nameserver to query, in place of those of the network, if set.
+    std::optional<android::netdutils::IPSockAddr> pinned_server;
     // clang-format on
 
   private:
@@ -175,6 +194,66 @@ int res_nmkquery(int op, const char* qname, int cl, int type, std::span<const ui
 int res_nsend(ResState* statp, std::span<const uint8_t> msg, std::span<uint8_t> ans, int* rcode,
               uint32_t flags, std::chrono::milliseconds sleepTimeMs = {});
 int res_nopt(ResState*, int, std::span<uint8_t>, int);
+// As above, for queries with these NET_CONTEXT_FLAG_* flags.
+int res_nopt(uint32_t netcontext_flags, int, std::span<uint8_t>, int);
+
+// One of the queries given to res_nsend_batch().
+struct ResBatchQuery {
+    std::span<const uint8_t> msg;
+    std::span<uint8_t> ans;
+    int rcode = NOERROR;
+    // The answer length, or a negative errno, as returned by res_nsend().
+    int resplen = 0;
+    // Only wanted for the cache: sent with the other queries if any of them has to go to the
+    // servers, and given up with -ETIMEDOUT once they are all answered. Its |resplen| is 0 if
+    // it was already cached.
+    bool companion = false;
+};
+
+// Same as calling res_nsend() on each of |queries|, except that the queries that go over
+// cleartext UDP are sent together: one sendmmsg() per server carries all of those still
+// unanswered, and answers are received with recvmmsg() and matched back to their query. With
+// the "doh_batch_queries" flag, those that would go over DoH are handed to it in one call.
+void res_nsend_batch(ResState* statp, std::span<ResBatchQuery> queries, uint32_t flags);
+
+// Sends |msg| with res_nsend() in the background, for its answer to be cached, and then calls
+// |done| if set. Returns false if too many are running in the background already, in which case
+// |done| is never called.
+bool res_nprefetch(ResState* statp, std::span<const uint8_t> msg, uint32_t flags,
+                   std::function<void()> done = nullptr);
+
+// What the query for one search domain returned, as run by res_search_async().
+struct ResSearchResult {
+    int ret = -1;  // As returned by res_nquerydomain().
+    int herrno = HOST_NOT_FOUND;
+    int qerrno = 0;  // errno once the query returned.
+    android::net::NetworkDnsEventReported event;
+    // The answers the query wrote, and the length of each.
+    std::vector<android::net::PacketBuffer> answers;
+    std::vector<int> lengths;
+};
+
+// Sends the query for one expansion of a name with |domain| from |statp|, filling in everything
+// in |result| but qerrno and event.
+using ResSearchQuery =
+        std::function<void(ResState* statp, const std::string& domain, ResSearchResult* result)>;
+
+// Whether the search domains of |statp| are to be tried in parallel, which the "parallel_search"
+// flag enables when there are several of them and a QueryThreadPool, unless the lookup is from
+// the cache alone.
+bool res_search_in_parallel(const ResState* statp);
+
+// Starts |query| for every search domain of |statp|, each on a copy of |statp|, in search list
+// order and a few at a time on the QueryThreadPool, and returns the results in that order. A
+// search takes the results in that order and stops at the one the sequential search would have
+// stopped at; the queries still running are then left to finish in the background, and their
+// results are dropped. So |query| must not refer to anything the caller owns.
+std::vector<std::future<ResSearchResult>> res_search_async(ResState* statp,
+                                                           const ResSearchQuery& query);
+
+// Takes |result| as if its query had just been sent from |statp|: adds its event to the one of
+// |statp|, sets errno and *herrno, and returns ret. Copying the answers is up to the caller.
+int res_search_take(ResState* statp, const ResSearchResult& result, int* herrno);
 
 int getaddrinfo_numeric(const char* hostname, const char* servname, addrinfo hints,
                         addrinfo** result);
@@ -40,24 +40,40 @@
 #include <string.h>
 #include <sys/param.h>
 
+#include "HostsFile.h"
 #include "hostent.h"
+#include "resolv_cache.h"
 #include "resolv_private.h"
 
+using android::net::HostsFile;
+
 constexpr int MAXALIASES = 35;
 constexpr int MAXADDRS = 35;
 
-static void sethostent_r(FILE** hf) {
-    if (!*hf)
-        *hf = fopen(_PATH_HOSTS, "re");
-    else
-        rewind(*hf);
-}
+// Fills |hent| and |buf| with a line of the hosts file. Returns NULL if |buf| is too small.
+static struct hostent* hostent_from_entry(const HostsFile::Entry& entry, struct hostent* hent,
+                                          char* buf, size_t buflen) {
+    const size_t anum = entry.names.empty() ? 0 : entry.names.size() - 1;
+    hent->h_length = entry.family == AF_INET6 ? NS_IN6ADDRSZ : NS_INADDRSZ;
+    hent->h_addrtype = entry.family;
+    HENT_ARRAY(hent->h_addr_list, 1, buf, buflen);
+    HENT_ARRAY(hent->h_aliases, anum, buf, buflen);
+    HENT_COPY(hent->h_addr_list[0], &entry.addr, hent->h_length, buf, buflen);
+    hent->h_addr_list[1] = NULL;
+
+    /* Reserve space for mapping IPv4 address to IPv6 address in place */
+    if (hent->h_addrtype == AF_INET) {
+        HENT_COPY(buf, NAT64_PAD, sizeof(NAT64_PAD), buf, buflen);
+    }
 
-static void endhostent_r(FILE** hf) {
-    if (*hf) {
-        (void) fclose(*hf);
-        *hf = NULL;
+    HENT_SCOPY(hent->h_name, entry.names.empty() ? "" : entry.names[0].c_str(), buf, buflen);
+    for (size_t i = 0; i < anum; i++) {
+        HENT_SCOPY(hent->h_aliases[i], entry.names[i + 1].c_str(), buf, buflen);
     }
+    hent->h_aliases[anum] = NULL;
+    return hent;
+nospc:
+    return NULL;
 }
 
 // TODO: Consider returning a boolean result as files_getaddrinfo() does because the error code
@@ -69,9 +85,8 @@ int _hf_gethtbyname2(const char* name, int af, getnamaddr* info) {
     char* aliases[MAXALIASES];
     char* addr_ptrs[MAXADDRS];
 
-    FILE* hf = NULL;
-    sethostent_r(&hf);
-    if (hf == NULL) {
+    const auto hosts = HostsFile::getInstance().get();
+    if (hosts == nullptr) {
         // TODO: Consider converting to a private extended EAI_* error code.
         // Currently, the EAI_* value has no corresponding error code for invalid argument socket
         // length. In order to not rely on errno, convert the original error code pair, EAI_SYSTEM
@@ -88,26 +103,14 @@ int _hf_gethtbyname2(const char* name, int af, getnamaddr* info) {
     hent.h_length = 0;
 
     size_t anum = 0;
-    for (num = 0; num < MAXADDRS; /**/) {
-        info->hp->h_addrtype = af;
-        info->hp->h_length = 0;
-
-        int he;
-        hp = netbsd_gethostent_r(hf, info->hp, info->buf, info->buflen, &he);
-        if (hp == NULL) {
-            if (he == NETDB_INTERNAL && errno == ENOSPC) {
-                goto nospc;  // glibc compatibility.
-            }
-            break;
-        }
+    num = 0;
+    for (uint32_t index : hosts->findByName(name)) {
+        const HostsFile::Entry& entry = hosts->entry(index);
+        if (num >= MAXADDRS) break;
+        if (entry.family != af) continue;
 
-        if (strcasecmp(hp->h_name, name) != 0) {
-            char** cp;
-            for (cp = hp->h_aliases; *cp != NULL; cp++)
-                if (strcasecmp(*cp, name) == 0) break;
-            // NOTE: does not increment num
-            if (*cp == NULL) continue;
-        }
+        hp = hostent_from_entry(entry, info->hp, info->buf, info->buflen);
+        if (hp == NULL) goto nospc;  // glibc compatibility.
 
         if (num == 0) {
             hent.h_addrtype = hp->h_addrtype;
@@ -127,7 +130,6 @@ int _hf_gethtbyname2(const char* name, int af, getnamaddr* info) {
 
         num++;
     }
-    endhostent_r(&hf);
 
     if (num == 0) {
         free(buf);
@@ -171,33 +173,38 @@ nospc:
     return EAI_MEMORY;
 }
 
+static int gethtbyaddr_table(const HostsFile::Table& hosts, const unsigned char* uaddr, int len,
+                             int af, getnamaddr* info) {
+    const HostsFile::Entry* entry = hosts.findByAddr(af, uaddr, len);
+    if (entry == nullptr) {
+        // TODO: Perhaps convert HOST_NOT_FOUND to EAI_NONAME instead.
+        // The original return error number is h_errno HOST_NOT_FOUND which was converted to
+        // EAI_NODATA.
+        return EAI_NODATA;
+    }
+    if (hostent_from_entry(*entry, info->hp, info->buf, info->buflen) == NULL) {
+        return EAI_MEMORY;  // glibc compatibility.
+    }
+    return 0;
+}
+
 // TODO: Consider returning a boolean result as files_getaddrinfo() does because the error code
 // does not currently return to netd.
 int _hf_gethtbyaddr(const unsigned char* uaddr, int len, int af, getnamaddr* info) {
-    info->hp->h_length = len;
-    info->hp->h_addrtype = af;
-
-    FILE* hf = NULL;
-    sethostent_r(&hf);
-    if (hf == NULL) {
+    const auto hosts = HostsFile::getInstance().get();
+    if (hosts == nullptr) {
         // TODO: Consider converting to a private extended EAI_* error code.
         // Currently, the EAI_* value has no corresponding error code for invalid argument socket
         // length. In order to not rely on errno, convert the original error code pair, EAI_SYSTEM
         // and EINVAL, to EAI_FAIL.
         return EAI_FAIL;
     }
-    struct hostent* hp;
-    int he;
-    while ((hp = netbsd_gethostent_r(hf, info->hp, info->buf, info->buflen, &he)) != NULL)
-        if (!memcmp(hp->h_addr_list[0], uaddr, (size_t) hp->h_length)) break;
-    endhostent_r(&hf);
-
-    if (hp == NULL) {
-        if (errno == ENOSPC) return EAI_MEMORY;  // glibc compatibility.
-        // TODO: Perhaps convert HOST_NOT_FOUND to EAI_NONAME instead.
-        // The original return error number is h_errno HOST_NOT_FOUND which was converted to
-        // EAI_NODATA.
-        return EAI_NODATA;
-    }
-    return 0;
+    return gethtbyaddr_table(*hosts, uaddr, len, af, info);
+}
+
+int customized_gethtbyaddr(unsigned netid, const unsigned char* uaddr, int len, int af,
+                           getnamaddr* info) {
+    const auto hosts = resolv_get_customized_hosts(netid);
+    if (hosts == nullptr) return EAI_NODATA;
+    return gethtbyaddr_table(*hosts, uaddr, len, af, info);
 }
@@ -22,6 +22,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/socket.h>
@@ -31,7 +32,9 @@
 
 #include <chrono>
 #include <iostream>
+#include <queue>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 #define LOG_TAG "DNSResponder"
@@ -45,6 +48,7 @@ using android::base::unique_fd;
 using android::netdutils::BackoffSequence;
 using android::netdutils::enableSockopt;
 using android::netdutils::ScopedAddrinfo;
+using std::chrono::microseconds;
 using std::chrono::milliseconds;
 
 namespace test {
@@ -500,22 +504,26 @@ DNSResponder::~DNSResponder() {
 void DNSResponder::addMapping(const std::string& name, ns_type type, const std::string& addr) {
     std::lock_guard lock(mappings_mutex_);
     mappings_[{name, type}] = addr;
+    answers_generation_++;
 }
 
 void DNSResponder::addMappingDnsHeader(const std::string& name, ns_type type,
                                        const DNSHeader& header) {
     std::lock_guard lock(mappings_mutex_);
     dnsheader_mappings_[{name, type}] = header;
+    answers_generation_++;
 }
 
 void DNSResponder::addMappingBinaryPacket(const std::vector<uint8_t>& query,
                                           const std::vector<uint8_t>& response) {
     std::lock_guard lock(mappings_mutex_);
     packet_mappings_[query] = response;
+    answers_generation_++;
 }
 
 void DNSResponder::removeMapping(const std::string& name, ns_type type) {
     std::lock_guard lock(mappings_mutex_);
+    answers_generation_++;
     if (!mappings_.erase({name, type})) {
         LOG(ERROR) << "Cannot remove mapping from (" << name << ", " << dnstype2str(type)
                    << "), not present in registered mappings";
@@ -524,6 +532,7 @@ void DNSResponder::removeMapping(const std::string& name, ns_type type) {
 
 void DNSResponder::removeMappingDnsHeader(const std::string& name, ns_type type) {
     std::lock_guard lock(mappings_mutex_);
+    answers_generation_++;
     if (!dnsheader_mappings_.erase({name, type})) {
         LOG(ERROR) << "Cannot remove mapping from (" << name << ", " << dnstype2str(type)
                    << "), not present in registered DnsHeader mappings";
@@ -532,6 +541,7 @@ void DNSResponder::removeMappingDnsHeader(const std::string& name, ns_type type)
 
 void DNSResponder::removeMappingBinaryPacket(const std::vector<uint8_t>& query) {
     std::lock_guard lock(mappings_mutex_);
+    answers_generation_++;
     if (!packet_mappings_.erase(query)) {
         LOG(ERROR) << "Cannot remove mapping, not present in registered BinaryPacket mappings";
         LOG(INFO) << "Hex dump:";
@@ -552,6 +562,7 @@ void DNSResponder::setResponseDelayMs(unsigned timeMs) {
 // Set response probability on specific protocol. It's caller's duty to ensure that the |protocol|
 // can be supported by DNSResponder.
 void DNSResponder::setResponseProbability(double response_probability, int protocol) {
+    answers_generation_++;
     switch (protocol) {
         case IPPROTO_TCP:
             response_probability_tcp_ = response_probability;
@@ -579,10 +590,26 @@ double DNSResponder::getResponseProbability(int protocol) const {
 
 void DNSResponder::setEdns(Edns edns) {
     edns_ = edns;
+    answers_generation_++;
 }
 
 void DNSResponder::setTtl(unsigned ttl) {
     answer_record_ttl_sec_ = ttl;
+    answers_generation_++;
+}
+
+DNSResponder::LatencyFn DNSResponder::uniformLatency(microseconds min, microseconds max) {
+    return [min, max](std::minstd_rand& rng) {
+        return microseconds(
+                std::uniform_int_distribution<int64_t>(min.count(), max.count())(rng));
+    };
+}
+
+DNSResponder::LatencyFn DNSResponder::exponentialLatency(microseconds mean) {
+    return [mean](std::minstd_rand& rng) {
+        return microseconds(static_cast<int64_t>(
+                std::exponential_distribution<double>(1.0 / mean.count())(rng)));
+    };
 }
 
 bool DNSResponder::running() const {
@@ -599,10 +626,30 @@ bool DNSResponder::startServer() {
     }
 
     // Create UDP, TCP socket
-    if (udp_socket_ = createListeningSocket(SOCK_DGRAM); udp_socket_.get() < 0) {
+    const bool reuse_port = throughput_config_.has_value();
+    if (udp_socket_ = createListeningSocket(SOCK_DGRAM, reuse_port); udp_socket_.get() < 0) {
         PLOG(ERROR) << "failed to create UDP socket";
         return false;
     }
+    if (throughput_config_) {
+        // Multicast queries would reach every socket of the group, and be answered as many times.
+        const unsigned workers = (listen_service_ == kDefaultMdnsListenService)
+                                         ? 1
+                                         : std::max(throughput_config_->workers, 1U);
+        for (unsigned i = 1; i < workers; i++) {
+            unique_fd fd = createListeningSocket(SOCK_DGRAM, reuse_port);
+            if (fd.get() < 0) {
+                PLOG(ERROR) << "failed to create UDP socket of worker " << i;
+                return false;
+            }
+            worker_sockets_.push_back(std::move(fd));
+        }
+        worker_stop_fd_.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        if (worker_stop_fd_.get() == -1) {
+            PLOG(ERROR) << "failed to create the eventfd of the workers";
+            return false;
+        }
+    }
 
     if (listen_service_ != kDefaultMdnsListenService) {
         if (tcp_socket_ = createListeningSocket(SOCK_STREAM); tcp_socket_.get() < 0) {
@@ -631,7 +678,7 @@ bool DNSResponder::startServer() {
     }
 
     LOG(INFO) << "adding UDP socket to epoll";
-    if (!addFd(udp_socket_.get(), EPOLLIN)) {
+    if (!throughput_config_ && !addFd(udp_socket_.get(), EPOLLIN)) {
         LOG(ERROR) << "failed to add the UDP socket to epoll";
         return false;
     }
@@ -653,6 +700,13 @@ bool DNSResponder::startServer() {
     {
         std::lock_guard lock(update_mutex_);
         handler_thread_ = std::thread(&DNSResponder::requestHandler, this);
+        if (throughput_config_) {
+            worker_threads_.emplace_back(&DNSResponder::workerHandler, this, udp_socket_.get(), 0);
+            for (size_t i = 0; i < worker_sockets_.size(); i++) {
+                worker_threads_.emplace_back(&DNSResponder::workerHandler, this,
+                                             worker_sockets_[i].get(), i + 1);
+            }
+        }
     }
     LOG(INFO) << "server started successfully";
     return true;
@@ -669,9 +723,20 @@ bool DNSResponder::stopServer() {
         return false;
     }
     handler_thread_.join();
+    if (!worker_threads_.empty()) {
+        const uint64_t data = 1;
+        if (write(worker_stop_fd_.get(), &data, sizeof(data)) != sizeof(data)) {
+            PLOG(ERROR) << "failed to stop the workers";
+            return false;
+        }
+        for (std::thread& worker : worker_threads_) worker.join();
+        worker_threads_.clear();
+    }
     epoll_fd_.reset();
     event_fd_.reset();
+    worker_stop_fd_.reset();
     udp_socket_.reset();
+    worker_sockets_.clear();
     tcp_socket_.reset();
     LOG(INFO) << "server stopped successfully";
     return true;
@@ -734,7 +799,8 @@ void DNSResponder::requestHandler() {
 }
 
 bool DNSResponder::handleDNSRequest(const char* buffer, ssize_t len, int protocol, char* response,
-                                    size_t* response_len) const {
+                                    size_t* response_len,
+                                    std::vector<QueryInfo>* questions) const {
     LOG(DEBUG) << "request: '" << bytesToHexStr({reinterpret_cast<const uint8_t*>(buffer), len})
                << "', on " << dnsproto2str(protocol);
     const char* buffer_end = buffer + len;
@@ -777,7 +843,11 @@ bool DNSResponder::handleDNSRequest(const char* buffer, ssize_t len, int protoco
         // No response.
         return false;
     }
-    {
+    if (questions) {
+        for (const DNSQuestion& question : header.questions) {
+            questions->push_back({question.qname.name, ns_type(question.qtype), protocol});
+        }
+    } else {
         std::lock_guard lock(queries_mutex_);
         for (const DNSQuestion& question : header.questions) {
             queries_.push_back({question.qname.name, ns_type(question.qtype), protocol});
@@ -1200,6 +1270,162 @@ void DNSResponder::handleQuery(int protocol) {
     return;
 }
 
+void DNSResponder::workerHandler(int fd, unsigned index) {
+    constexpr size_t kBatchSize = 32;
+    constexpr size_t kMaxQuerySize = 4096;
+    constexpr size_t kMaxAnswers = 65536;
+    using Clock = std::chrono::steady_clock;
+
+    struct Answer {
+        Clock::time_point deadline;
+        sockaddr_storage sa;
+        socklen_t sa_len;
+        std::vector<char> response;
+        bool operator>(const Answer& o) const { return deadline > o.deadline; }
+    };
+    // What a query got, keyed by the query without its ID. |response| is empty if it got none.
+    struct Encoded {
+        std::vector<char> response;
+        std::vector<QueryInfo> questions;
+    };
+
+    const ThroughputConfig& config = *throughput_config_;
+    std::minstd_rand rng(std::random_device{}() + index);
+    std::bernoulli_distribution start_loss(config.loss_probability /
+                                           std::max(config.loss_burst, 1U));
+    unsigned losses_left = 0;
+    std::unordered_map<std::string, Encoded> encoded;
+    uint64_t generation = answers_generation_;
+
+    std::vector<char> buffers(kBatchSize * kMaxQuerySize);
+    sockaddr_storage addrs[kBatchSize];
+    iovec iovs[kBatchSize];
+    mmsghdr msgs[kBatchSize];
+    std::vector<Answer> ready;
+    std::priority_queue<Answer, std::vector<Answer>, std::greater<Answer>> delayed;
+    std::vector<QueryInfo> questions;
+
+    enum { SOCKET_FD = 0, STOP_FD = 1 };
+    pollfd fds[2] = {{.fd = fd, .events = POLLIN}, {.fd = worker_stop_fd_.get(), .events = POLLIN}};
+    while (true) {
+        timespec timeout;
+        if (!delayed.empty()) {
+            const auto wait = std::max(delayed.top().deadline - Clock::now(), Clock::duration(0));
+            const auto secs = std::chrono::duration_cast<std::chrono::seconds>(wait);
+            timeout = {.tv_sec = secs.count(),
+                       .tv_nsec = std::chrono::nanoseconds(wait - secs).count()};
+        }
+        if (ppoll(fds, std::size(fds), delayed.empty() ? nullptr : &timeout, nullptr) < 0) {
+            if (errno == EINTR) continue;
+            PLOG(ERROR) << "ppoll() failed";
+            return;
+        }
+        if (fds[STOP_FD].revents & (POLLIN | POLLERR)) return;
+
+        int n = 0;
+        if (fds[SOCKET_FD].revents & (POLLIN | POLLERR)) {
+            for (size_t i = 0; i < kBatchSize; i++) {
+                iovs[i] = {.iov_base = &buffers[i * kMaxQuerySize], .iov_len = kMaxQuerySize};
+                msgs[i].msg_hdr = {.msg_name = &addrs[i],
+                                   .msg_namelen = sizeof(addrs[i]),
+                                   .msg_iov = &iovs[i],
+                                   .msg_iovlen = 1};
+            }
+            n = recvmmsg(fd, msgs, kBatchSize, MSG_DONTWAIT, nullptr);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                PLOG(ERROR) << "recvmmsg() failed";
+                return;
+            }
+        }
+
+        if (const uint64_t current = answers_generation_; current != generation) {
+            encoded.clear();
+            generation = current;
+        }
+        // The answers can be reused only as long as no query is dropped or answered with an error
+        // on purpose, and as long as they don't come from a packet mapping, which includes IDs.
+        const bool reusable = getResponseProbability(IPPROTO_UDP) >= 1 &&
+                              mapping_type_ != MappingType::BINARY_PACKET;
+        const Clock::time_point now = Clock::now();
+        for (int i = 0; i < n; i++) {
+            const char* query = &buffers[i * kMaxQuerySize];
+            const size_t len = msgs[i].msg_len;
+            if (len < 2) continue;
+            Answer answer = {.sa = addrs[i], .sa_len = msgs[i].msg_hdr.msg_namelen};
+            const std::string key(query + 2, len - 2);
+            if (const auto it = encoded.find(key); reusable && it != encoded.end()) {
+                questions.insert(questions.end(), it->second.questions.begin(),
+                                 it->second.questions.end());
+                answer.response = it->second.response;
+                // Reused with the ID of the query they answer.
+                if (!answer.response.empty()) memcpy(answer.response.data(), query, 2);
+            } else {
+                const size_t questions_before = questions.size();
+                char response[16384];
+                size_t response_len = sizeof(response);
+                if (handleDNSRequest(query, len, IPPROTO_UDP, response, &response_len,
+                                     &questions)) {
+                    answer.response.assign(response, response + response_len);
+                }
+                if (reusable) {
+                    if (encoded.size() >= kMaxAnswers) encoded.clear();
+                    encoded[key] = {answer.response,
+                                    {questions.begin() + questions_before, questions.end()}};
+                }
+            }
+            if (answer.response.empty()) continue;
+
+            if (losses_left > 0 || start_loss(rng)) {
+                losses_left = (losses_left > 0 ? losses_left : std::max(config.loss_burst, 1U)) - 1;
+                continue;
+            }
+            if (config.latency) {
+                answer.deadline = now + config.latency(rng);
+                delayed.push(std::move(answer));
+            } else {
+                ready.push_back(std::move(answer));
+            }
+        }
+        if (!questions.empty()) {
+            {
+                std::lock_guard lock(queries_mutex_);
+                queries_.insert(queries_.end(), questions.begin(), questions.end());
+            }
+            questions.clear();
+            std::lock_guard lock(cv_mutex_);
+            cv.notify_one();
+        }
+
+        const Clock::time_point sent = Clock::now();
+        while (!delayed.empty() && delayed.top().deadline <= sent) {
+            // The top of a priority_queue is const, but it is popped right away.
+            ready.push_back(std::move(const_cast<Answer&>(delayed.top())));
+            delayed.pop();
+        }
+        for (size_t first = 0; first < ready.size(); first += kBatchSize) {
+            const size_t count = std::min(kBatchSize, ready.size() - first);
+            for (size_t i = 0; i < count; i++) {
+                Answer& answer = ready[first + i];
+                iovs[i] = {.iov_base = answer.response.data(), .iov_len = answer.response.size()};
+                msgs[i].msg_hdr = {.msg_name = &answer.sa,
+                                   .msg_namelen = answer.sa_len,
+                                   .msg_iov = &iovs[i],
+                                   .msg_iovlen = 1};
+            }
+            for (size_t done = 0; done < count;) {
+                const int rv = sendmmsg(fd, msgs + done, count - done, 0);
+                if (rv < 0) {
+                    if (errno == EINTR) continue;
+                    PLOG(ERROR) << "sendmmsg() failed, dropping " << count - done << " answers";
+                    break;
+                }
+                done += rv;
+            }
+        }
+        ready.clear();
+    }
+}
+
 bool DNSResponder::sendToEventFd() {
     const uint64_t data = 1;
     if (const ssize_t rt = write(event_fd_.get(), &data, sizeof(data)); rt != sizeof(data)) {
@@ -1216,7 +1442,7 @@ void DNSResponder::handleEventFd() {
     }
 }
 
-unique_fd DNSResponder::createListeningSocket(int socket_type) {
+unique_fd DNSResponder::createListeningSocket(int socket_type, bool reuse_port) {
     addrinfo ai_hints{
             .ai_flags = AI_PASSIVE,
             .ai_family = AF_UNSPEC,
@@ -1239,6 +1465,10 @@ unique_fd DNSResponder::createListeningSocket(int socket_type) {
         }
 
         enableSockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR).ignoreError();
+        if (reuse_port && !enableSockopt(fd.get(), SOL_SOCKET, SO_REUSEPORT).ok()) {
+            PLOG(ERROR) << "failed to set SO_REUSEPORT";
+            return {};
+        }
         const std::string host_str = addr2str(ai->ai_addr, ai->ai_addrlen);
         if ((listen_service_ == kDefaultMdnsListenService) && (socket_type == SOCK_DGRAM)) {
             const int mdns_port = 5353;
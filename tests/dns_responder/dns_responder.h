@@ -21,8 +21,12 @@
 #include <arpa/nameser.h>
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
+#include <optional>
+#include <random>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -150,6 +154,30 @@ class DNSResponder {
         int protocol;  // Either IPPROTO_TCP or IPPROTO_UDP
     };
 
+    // Returns how long to hold an answer back. Called concurrently from the worker threads, each
+    // with a generator of its own.
+    using LatencyFn = std::function<std::chrono::microseconds(std::minstd_rand& rng)>;
+
+    // Settings of the high-throughput mode, for load tests. UDP queries are served by |workers|
+    // threads instead of the handler thread, each listening on a socket of its own bound with
+    // SO_REUSEPORT and reading and answering queries in batches with recvmmsg()/sendmmsg(). A
+    // worker encodes the answer to a query once and reuses it for identical queries until the
+    // mappings or settings change. setResponseDelayMs() and setDeferredResp() don't apply to the
+    // answers of the workers; |latency| and |loss_probability| stand in for them. TCP queries
+    // are still served by the handler thread, and an mDNS responder always has a single worker.
+    struct ThroughputConfig {
+        unsigned workers = 1;
+        // Answers right away if unset.
+        LatencyFn latency;
+        // Fraction of the queries dropped without an answer. They are dropped in runs of
+        // |loss_burst| queries on a worker, like on a congested link.
+        double loss_probability = 0;
+        unsigned loss_burst = 1;
+    };
+
+    static LatencyFn uniformLatency(std::chrono::microseconds min, std::chrono::microseconds max);
+    static LatencyFn exponentialLatency(std::chrono::microseconds mean);
+
     DNSResponder(std::string listen_address = kDefaultListenAddr,
                  std::string listen_service = kDefaultListenService,
                  ns_rcode error_rcode = kDefaultErrorCode,
@@ -177,10 +205,16 @@ class DNSResponder {
     void removeMappingDnsHeader(const std::string& name, ns_type type);
     void removeMappingBinaryPacket(const std::vector<uint8_t>& query);
 
+    // Must be called before startServer().
+    void setThroughputConfig(const ThroughputConfig& config) { throughput_config_ = config; }
+
     void setResponseProbability(double response_probability);
     void setResponseProbability(double response_probability, int protocol);
     void setResponseDelayMs(unsigned);
-    void setErrorRcode(ns_rcode error_rcode) { error_rcode_ = error_rcode; }
+    void setErrorRcode(ns_rcode error_rcode) {
+        error_rcode_ = error_rcode;
+        answers_generation_++;
+    }
     void setEdns(Edns edns);
     void setTtl(unsigned ttl);
     bool running() const;
@@ -200,7 +234,8 @@ class DNSResponder {
     // is necessary only for multinetwork tests. Since binding sockets to a network requires
     // the dependency of libnetd_client, and DNSResponder is also widely used in other tests like
     // resolv_unit_test which doesn't need that dependency, so expose the socket fds to let the
-    // callers perform binding operations by themselves. Callers MUST not close the fds.
+    // callers perform binding operations by themselves. Callers MUST not close the fds. In the
+    // high-throughput mode, getUdpSocket() only returns the socket of the first worker.
     void setNetwork(unsigned netId) { mNetId = netId; }
     std::optional<unsigned> getNetwork() const { return mNetId; }
     int getUdpSocket() const { return udp_socket_.get(); }
@@ -253,8 +288,10 @@ class DNSResponder {
     // Parses and generates a response message for incoming DNS requests.
     // Returns false to ignore the request, which might be due to either parsing error
     // or unresponsiveness.
+    // The questions of the request are recorded in |queries_|, or appended to |questions| if
+    // it is given.
     bool handleDNSRequest(const char* buffer, ssize_t buffer_len, int protocol, char* response,
-                          size_t* response_len) const;
+                          size_t* response_len, std::vector<QueryInfo>* questions = nullptr) const;
 
     bool addAnswerRecords(const DNSQuestion& question, std::vector<DNSRecord>* answers) const;
 
@@ -286,6 +323,9 @@ class DNSResponder {
     // makes sure the I/O communicated with the client is correct.
     void handleQuery(int protocol);
 
+    // Serves the UDP queries arriving on |fd| in the high-throughput mode.
+    void workerHandler(int fd, unsigned index);
+
     // Trigger the handler thread to terminate.
     bool sendToEventFd();
 
@@ -293,7 +333,7 @@ class DNSResponder {
     void handleEventFd();
 
     // TODO: Move createListeningSocket to resolv_test_utils.h
-    android::base::unique_fd createListeningSocket(int socket_type);
+    android::base::unique_fd createListeningSocket(int socket_type, bool reuse_port = false);
 
     double getResponseProbability(int protocol) const;
 
@@ -317,6 +357,11 @@ class DNSResponder {
 
     std::atomic<unsigned> response_delayed_ms_ = 0;
 
+    std::optional<ThroughputConfig> throughput_config_;
+    // Bumped whenever the answer to a query may change, so that the workers drop the answers
+    // they encoded before.
+    std::atomic<uint64_t> answers_generation_ = 0;
+
     // Maximum number of fds for epoll.
     const int EPOLL_MAX_EVENTS = 2;
 
@@ -351,6 +396,12 @@ class DNSResponder {
     android::base::unique_fd event_fd_;
     // Thread for handling incoming threads.
     std::thread handler_thread_ GUARDED_BY(update_mutex_);
+    // The sockets and threads of the workers but the first, whose socket is |udp_socket_|.
+    std::vector<android::base::unique_fd> worker_sockets_;
+    std::vector<std::thread> worker_threads_ GUARDED_BY(update_mutex_);
+    // Eventfd signalling the workers to terminate. Unlike |event_fd_|, it is never read, so that
+    // every worker sees it.
+    android::base::unique_fd worker_stop_fd_;
     std::mutex update_mutex_;
     std::condition_variable cv;
     std::mutex cv_mutex_;
@@ -17,6 +17,7 @@
 #include "dns_tls_frontend.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -127,33 +128,23 @@ bool DnsTlsFrontend::startServer() {
         break;
     }
 
-    if (listen(socket_.get(), 1) < 0) {
+    if (listen(socket_.get(), workers_ > 0 ? SOMAXCONN : 1) < 0) {
         PLOG(INFO) << "failed to listen socket " << socket_.get();
         return false;
     }
-
-    // Set up UDP client socket to backend.
-    addrinfo backend_ai_hints{.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
-    addrinfo* backend_ai_res = nullptr;
-    rv = getaddrinfo(backend_address_.c_str(), backend_service_.c_str(), &backend_ai_hints,
-                     &backend_ai_res);
-    ScopedAddrinfo backend_ai_res_cleanup(backend_ai_res);
-    if (rv) {
-        LOG(ERROR) << "backend getaddrinfo(" << listen_address_.c_str() << ", "
-                   << listen_service_.c_str() << ") failed: " << gai_strerror(rv);
-        return false;
-    }
-    backend_socket_.reset(socket(backend_ai_res->ai_family, backend_ai_res->ai_socktype,
-                                 backend_ai_res->ai_protocol));
-    if (backend_socket_.get() < 0) {
-        PLOG(INFO) << "backend socket " << backend_socket_.get() << " creation failed";
+    // All the workers are woken up by a new connection, and only one of them gets it.
+    if (workers_ > 0 && fcntl(socket_.get(), F_SETFL, O_NONBLOCK) < 0) {
+        PLOG(INFO) << "failed to make socket " << socket_.get() << " non-blocking";
         return false;
     }
 
-    // connect() always fails in the test DnsTlsSocketTest.SlowDestructor because of
-    // no backend server. Don't check it.
-    static_cast<void>(
-            connect(backend_socket_.get(), backend_ai_res->ai_addr, backend_ai_res->ai_addrlen));
+    // Set up UDP client socket to backend.
+    if (backend_socket_ = createBackendSocket(); backend_socket_.get() < 0) return false;
+    for (unsigned i = 0; i < workers_; i++) {
+        android::base::unique_fd fd = createBackendSocket();
+        if (fd.get() < 0) return false;
+        worker_backend_sockets_.push_back(std::move(fd));
+    }
 
     // Set up eventfd socket.
     event_fd_.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
@@ -164,7 +155,12 @@ bool DnsTlsFrontend::startServer() {
 
     {
         std::lock_guard lock(update_mutex_);
-        handler_thread_ = std::thread(&DnsTlsFrontend::requestHandler, this);
+        if (workers_ == 0) {
+            handler_thread_ = std::thread(&DnsTlsFrontend::requestHandler, this);
+        }
+        for (const android::base::unique_fd& fd : worker_backend_sockets_) {
+            worker_threads_.emplace_back(&DnsTlsFrontend::workerHandler, this, fd.get());
+        }
     }
     LOG(INFO) << "server started successfully";
     return true;
@@ -291,7 +287,9 @@ again:
         if (queryCounts >= delayQueries_) {
             break;
         }
-    } while (poll(&fds, 1, delayQueriesTimeout_) > 0);
+        // Queries may come several to a TLS record, in which case the next one is already
+        // buffered in |ssl| rather than waiting on the socket.
+    } while (SSL_pending(ssl) > 0 || poll(&fds, 1, delayQueriesTimeout_) > 0);
 
     if (queryCounts < delayQueries_) {
         LOG(WARNING) << "Expect " << delayQueries_ << " queries, but actually received "
@@ -306,6 +304,7 @@ again:
 
     // Poll again because the same DoT probe might be sent again.
     if (isDotProbe && queryCounts == 1) {
+        if (SSL_pending(ssl) > 0) goto again;
         int n = poll(&fds, 1, 50);
         if (n > 0 && fds.revents & POLLIN) {
             goto again;
@@ -316,6 +315,125 @@ again:
     return queryCounts;
 }
 
+void DnsTlsFrontend::workerHandler(int backendFd) {
+    enum { EVENT_FD = 0, LISTEN_FD = 1 };
+    pollfd fds[2] = {{.fd = event_fd_.get(), .events = POLLIN},
+                     {.fd = socket_.get(), .events = POLLIN}};
+
+    while (true) {
+        if (poll(fds, std::size(fds), -1) <= 0) {
+            if (errno == EINTR) continue;
+            PLOG(WARNING) << "Poll failed";
+            return;
+        }
+        if (fds[EVENT_FD].revents & (POLLIN | POLLERR)) return;
+        if (!(fds[LISTEN_FD].revents & (POLLIN | POLLERR))) continue;
+
+        android::base::unique_fd client(accept4(socket_.get(), nullptr, nullptr, SOCK_CLOEXEC));
+        if (client.get() < 0) {
+            // Another worker took the connection.
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            PLOG(INFO) << "failed to accept client socket";
+            return;
+        }
+        accept_connection_count_++;
+
+        bssl::UniquePtr<SSL> ssl(SSL_new(ctx_.get()));
+        SSL_set_fd(ssl.get(), client.get());
+        if (SSL_accept(ssl.get()) <= 0) {
+            LOG(INFO) << "SSL negotiation failure";
+            continue;
+        }
+        relayRequests(ssl.get(), client.get(), backendFd);
+    }
+}
+
+void DnsTlsFrontend::relayRequests(SSL* ssl, int clientFd, int backendFd) {
+    enum { EVENT_FD = 0, CLIENT_FD = 1, BACKEND_FD = 2 };
+    pollfd fds[3] = {{.fd = event_fd_.get(), .events = POLLIN},
+                     {.fd = clientFd, .events = POLLIN},
+                     {.fd = backendFd, .events = POLLIN}};
+    std::vector<uint8_t> reply;
+
+    while (true) {
+        // Queries may come several to a TLS record, in which case the next one is already
+        // buffered in |ssl| rather than waiting on the socket.
+        const bool pending = SSL_pending(ssl) > 0;
+        if (poll(fds, std::size(fds), pending ? 0 : -1) < 0) {
+            if (errno == EINTR) continue;
+            PLOG(WARNING) << "Poll failed";
+            return;
+        }
+        if (fds[EVENT_FD].revents & (POLLIN | POLLERR)) return;
+
+        if (pending || (fds[CLIENT_FD].revents & (POLLIN | POLLERR | POLLHUP))) {
+            uint8_t queryHeader[2];
+            if (SSL_read(ssl, &queryHeader, 2) != 2) {
+                LOG(DEBUG) << "Connection closed";
+                return;
+            }
+            const uint16_t qlen = (queryHeader[0] << 8) | queryHeader[1];
+            std::vector<uint8_t> query(qlen);
+            for (size_t qbytes = 0; qbytes < qlen;) {
+                const int ret = SSL_read(ssl, query.data() + qbytes, qlen - qbytes);
+                if (ret <= 0) {
+                    LOG(INFO) << "Error while reading query";
+                    return;
+                }
+                qbytes += ret;
+            }
+            if (send(backendFd, query.data(), qlen, 0) != qlen) {
+                PLOG(INFO) << "Failed to send query";
+                return;
+            }
+        }
+
+        if (fds[BACKEND_FD].revents & (POLLIN | POLLERR)) {
+            // Write all the answers that are in at once.
+            int answers = 0;
+            uint8_t recv_buffer[4096];
+            int rlen;
+            while ((rlen = recv(backendFd, recv_buffer, sizeof(recv_buffer), MSG_DONTWAIT)) > 0) {
+                reply.push_back(rlen >> 8);
+                reply.push_back(rlen);
+                reply.insert(reply.end(), recv_buffer, recv_buffer + rlen);
+                ++answers;
+            }
+            const int replyLen = reply.size();
+            if (replyLen > 0 && SSL_write(ssl, reply.data(), replyLen) != replyLen) {
+                LOG(WARNING) << "Failed to write response body";
+                return;
+            }
+            reply.clear();
+            queries_ += answers;
+        }
+    }
+}
+
+android::base::unique_fd DnsTlsFrontend::createBackendSocket() {
+    addrinfo backend_ai_hints{.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+    addrinfo* backend_ai_res = nullptr;
+    const int rv = getaddrinfo(backend_address_.c_str(), backend_service_.c_str(),
+                               &backend_ai_hints, &backend_ai_res);
+    ScopedAddrinfo backend_ai_res_cleanup(backend_ai_res);
+    if (rv) {
+        LOG(ERROR) << "backend getaddrinfo(" << listen_address_.c_str() << ", "
+                   << listen_service_.c_str() << ") failed: " << gai_strerror(rv);
+        return {};
+    }
+    android::base::unique_fd fd(socket(backend_ai_res->ai_family, backend_ai_res->ai_socktype,
+                                       backend_ai_res->ai_protocol));
+    if (fd.get() < 0) {
+        PLOG(INFO) << "backend socket " << fd.get() << " creation failed";
+        return {};
+    }
+
+    // connect() always fails in the test DnsTlsSocketTest.SlowDestructor because of
+    // no backend server. Don't check it.
+    static_cast<void>(connect(fd.get(), backend_ai_res->ai_addr, backend_ai_res->ai_addrlen));
+    return fd;
+}
+
 bool DnsTlsFrontend::stopServer() {
     std::lock_guard lock(update_mutex_);
     if (!running()) {
@@ -327,9 +445,12 @@ bool DnsTlsFrontend::stopServer() {
     if (!sendToEventFd()) {
         return false;
     }
-    handler_thread_.join();
+    if (handler_thread_.joinable()) handler_thread_.join();
+    for (std::thread& worker : worker_threads_) worker.join();
+    worker_threads_.clear();
     socket_.reset();
     backend_socket_.reset();
+    worker_backend_sockets_.clear();
     event_fd_.reset();
     ctx_.reset();
     LOG(INFO) << "frontend stopped successfully";
@@ -69,6 +69,13 @@ class DnsTlsFrontend {
 
     void setPassiveClose(bool passiveClose) { passiveClose_ = passiveClose; }
 
+    // Serves connections from |workers| threads at once, for load tests. A worker keeps a
+    // connection until the client closes it, and relays each query to the backend through a
+    // socket of its own as soon as it's read, without waiting for the answers to the earlier
+    // ones. setHangOnHandshakeForTesting(), setDelayQueries() and setPassiveClose() don't apply to
+    // the workers. Must be called before startServer().
+    void setWorkers(unsigned workers) { workers_ = workers; }
+
     static constexpr char kDefaultListenAddr[] = "127.0.0.3";
     static constexpr char kDefaultListenService[] = "853";
     static constexpr char kDefaultBackendAddr[] = "127.0.0.3";
@@ -77,6 +84,12 @@ class DnsTlsFrontend {
   private:
     void requestHandler();
     int handleRequests(SSL* ssl, int clientFd);
+    void workerHandler(int backendFd);
+    // Relays queries and answers between the client and the backend until either side fails.
+    void relayRequests(SSL* ssl, int clientFd, int backendFd);
+
+    // Returns a UDP socket connected to the backend.
+    android::base::unique_fd createBackendSocket();
 
     // Trigger the handler thread to terminate.
     bool sendToEventFd();
@@ -98,6 +111,11 @@ class DnsTlsFrontend {
     std::atomic<int> queries_ = 0;
     std::atomic<int> accept_connection_count_ = 0;
     std::thread handler_thread_ GUARDED_BY(update_mutex_);
+    unsigned workers_ = 0;
+    // The workers wait on |socket_| and |event_fd_| along with one another, and don't read
+    // |event_fd_|, so that all of them see it.
+    std::vector<std::thread> worker_threads_ GUARDED_BY(update_mutex_);
+    std::vector<android::base::unique_fd> worker_backend_sockets_;
     std::mutex update_mutex_;
     int chain_length_ = 1;
     std::atomic<bool> hangOnHandshake_ = false;
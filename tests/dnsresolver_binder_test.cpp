@@ -18,6 +18,7 @@
 #undef NDEBUG
 #endif
 
+#include <arpa/nameser.h>
 #include <netdb.h>
 
 #include <iostream>
@@ -27,6 +28,7 @@
 #include <vector>
 
 #include <aidl/android/net/IDnsResolver.h>
+#include <aidl/android/net/resolv/aidl/CacheWarmupQueryParcel.h>
 #include <android-base/file.h>
 #include <android-base/format.h>
 #include <android-base/strings.h>
@@ -44,6 +46,7 @@
 #include "ResolverStats.h"
 #include "dns_responder.h"
 #include "dns_responder_client_ndk.h"
+#include "stats.pb.h"
 #include "tests/resolv_test_base.h"
 
 using aidl::android::net::IDnsResolver;
@@ -51,6 +54,7 @@ using aidl::android::net::ResolverHostsParcel;
 using aidl::android::net::ResolverOptionsParcel;
 using aidl::android::net::ResolverParamsParcel;
 using aidl::android::net::metrics::INetdEventListener;
+using aidl::android::net::resolv::aidl::CacheWarmupQueryParcel;
 using android::base::ReadFdToString;
 using android::base::unique_fd;
 using android::net::ResolverStats;
@@ -554,6 +558,45 @@ TEST_F(DnsResolverBinderTest, GetResolverInfo) {
     EXPECT_THAT(res_domains, testing::UnorderedElementsAreArray(domains));
 }
 
+TEST_F(DnsResolverBinderTest, GetResolverInfoSnapshot) {
+    std::vector<std::string> servers = {"127.0.0.1", "127.0.0.2"};
+    std::vector<std::string> domains = {"example.com"};
+    std::vector<int> testParams = {300, 25, 8, 8, 100, 3};
+    auto resolverParams = DnsResponderClient::makeResolverParamsParcel(
+            TEST_NETID, testParams, servers, domains, "", {});
+    ::ndk::ScopedAStatus status = mDnsResolver->setResolverConfiguration(resolverParams);
+    EXPECT_TRUE(status.isOk()) << status.getMessage();
+    mExpectedLogDataWithPacel.push_back(toSetResolverConfigurationLogData(resolverParams));
+
+    std::vector<uint8_t> bytes;
+    status = mDnsResolver->getResolverInfoSnapshot(TEST_NETID, &bytes);
+    EXPECT_TRUE(status.isOk()) << status.getMessage();
+
+    android::net::ResolverInfoSnapshot snapshot;
+    ASSERT_TRUE(snapshot.ParseFromArray(bytes.data(), bytes.size()));
+    EXPECT_EQ(1, snapshot.version());
+    EXPECT_EQ(TEST_NETID, snapshot.net_id());
+    ASSERT_EQ(servers.size(), static_cast<size_t>(snapshot.servers_size()));
+    EXPECT_EQ(servers[0], snapshot.servers(0).address());
+    EXPECT_EQ(servers[1], snapshot.servers(1).address());
+    ASSERT_EQ(1, snapshot.domains_size());
+    EXPECT_EQ(domains[0], snapshot.domains(0));
+    EXPECT_EQ(0, snapshot.tls_servers_size());
+    EXPECT_EQ(300, snapshot.sample_validity_sec());
+    EXPECT_EQ(3, snapshot.retry_count());
+
+    // A new configuration shows up right away.
+    resolverParams.servers = {"127.0.0.3"};
+    status = mDnsResolver->setResolverConfiguration(resolverParams);
+    EXPECT_TRUE(status.isOk()) << status.getMessage();
+    mExpectedLogDataWithPacel.push_back(toSetResolverConfigurationLogData(resolverParams));
+    status = mDnsResolver->getResolverInfoSnapshot(TEST_NETID, &bytes);
+    EXPECT_TRUE(status.isOk()) << status.getMessage();
+    ASSERT_TRUE(snapshot.ParseFromArray(bytes.data(), bytes.size()));
+    ASSERT_EQ(1, snapshot.servers_size());
+    EXPECT_EQ("127.0.0.3", snapshot.servers(0).address());
+}
+
 TEST_F(DnsResolverBinderTest, CreateDestroyNetworkCache) {
     // Must not be the same as TEST_NETID
     const int ANOTHER_TEST_NETID = TEST_NETID + 1;
@@ -598,6 +641,52 @@ TEST_F(DnsResolverBinderTest, FlushNetworkCache) {
              "flushNetworkCache.*-1.*64"});
 }
 
+TEST_F(DnsResolverBinderTest, WarmNetworkCache) {
+    SKIP_IF_REMOTE_VERSION_LESS_THAN(mDnsResolver.get(), 11);
+    // cache has beed created in DnsResolverBinderTest constructor
+    EXPECT_TRUE(mDnsResolver->warmNetworkCache(TEST_NETID, {}).isOk());
+    mExpectedLogData.push_back({"warmNetworkCache(30, [])", "warmNetworkCache.*30"});
+    EXPECT_EQ(ENONET, mDnsResolver->warmNetworkCache(-1, {}).getServiceSpecificError());
+    mExpectedLogData.push_back(
+            {"warmNetworkCache(-1, []) -> ServiceSpecificException(64, \"Machine is not on the "
+             "network\")",
+             "warmNetworkCache.*-1.*64"});
+
+    CacheWarmupQueryParcel query;
+    query.hostName = "";
+    query.type = ns_t_a;
+    EXPECT_EQ(EINVAL,
+              mDnsResolver->warmNetworkCache(TEST_NETID, {query}).getServiceSpecificError());
+}
+
+TEST_F(DnsResolverBinderTest, HandOverNetworkCache) {
+    SKIP_IF_REMOTE_VERSION_LESS_THAN(mDnsResolver.get(), 11);
+    // Nothing was looked up, so there is nothing to warm.
+    EXPECT_TRUE(mDnsResolver->handOverNetworkCache(TEST_NETID, TEST_NETID, 16).isOk());
+    mExpectedLogData.push_back(
+            {"handOverNetworkCache(30, 30, 16)", "handOverNetworkCache.*30.*30.*16"});
+    EXPECT_EQ(ENONET, mDnsResolver->handOverNetworkCache(TEST_NETID, -1, 16)
+                              .getServiceSpecificError());
+    mExpectedLogData.push_back(
+            {"handOverNetworkCache(30, -1, 16) -> ServiceSpecificException(64, \"Machine is not "
+             "on the network\")",
+             "handOverNetworkCache.*-1.*64"});
+    EXPECT_EQ(EINVAL, mDnsResolver->handOverNetworkCache(TEST_NETID, TEST_NETID, -1)
+                              .getServiceSpecificError());
+    mExpectedLogData.push_back(
+            {"handOverNetworkCache(30, 30, -1) -> ServiceSpecificException(22, \"Invalid "
+             "argument\")",
+             "handOverNetworkCache.*-1.*22"});
+}
+
+TEST_F(DnsResolverBinderTest, SetForegroundUids) {
+    SKIP_IF_REMOTE_VERSION_LESS_THAN(mDnsResolver.get(), 11);
+    EXPECT_TRUE(mDnsResolver->setForegroundUids({10001, 10002}).isOk());
+    mExpectedLogData.push_back({"setForegroundUids([10001, 10002])", "setForegroundUids.*10001"});
+    EXPECT_TRUE(mDnsResolver->setForegroundUids({}).isOk());
+    mExpectedLogData.push_back({"setForegroundUids([])", "setForegroundUids.*\\[\\]"});
+}
+
 TEST_F(DnsResolverBinderTest, setLogSeverity) {
     // Expect fail
     EXPECT_EQ(EINVAL, mDnsResolver->setLogSeverity(-1).getServiceSpecificError());
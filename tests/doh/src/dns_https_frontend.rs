@@ -22,6 +22,7 @@ use crate::stats::Stats;
 use anyhow::{bail, ensure, Result};
 use lazy_static::lazy_static;
 use log::{debug, error, warn};
+use std::collections::HashSet;
 use std::fs::File;
 use std::io::Write;
 use std::os::unix::io::{AsRawFd, FromRawFd};
@@ -348,25 +349,33 @@ async fn worker_thread(params: WorkerParams) -> Result<()> {
                 event_tx.send(InternalCommand::MaybeWrite{connection_id})?;
             }
 
-            Ok((len, src)) = backend_socket.recv_from(&mut backend_buf) => {
-                debug!("Got {} bytes from {}", len, src);
-                if len < DNS_HEADER_SIZE {
-                    error!("Received insufficient bytes for DNS header");
-                    continue;
-                }
+            Ok(len) = backend_socket.recv(&mut backend_buf) => {
+                // Handle all the answers that are in, so that a connection they belong to is
+                // written once for all of them rather than once for each.
+                let mut to_write = HashSet::new();
+                let mut received = Some(len);
+                while let Some(len) = received {
+                    debug!("Got {} bytes from backend", len);
+                    if len < DNS_HEADER_SIZE {
+                        error!("Received insufficient bytes for DNS header");
+                    } else {
+                        let query_id = [backend_buf[0], backend_buf[1]];
+                        for (_, client) in clients.iter_mut() {
+                            if client.is_waiting_for_query(&query_id) {
+                                if let Err(e) = client.handle_backend_message(&backend_buf[..len]) {
+                                    error!("Failed to handle message from backend: {}", e);
+                                }
+                                to_write.insert(client.connection_id().clone());
 
-                let query_id = [backend_buf[0], backend_buf[1]];
-                for (_, client) in clients.iter_mut() {
-                    if client.is_waiting_for_query(&query_id) {
-                        if let Err(e) = client.handle_backend_message(&backend_buf[..len]) {
-                            error!("Failed to handle message from backend: {}", e);
+                                // It's a bug if more than one client is waiting for this query.
+                                break;
+                            }
                         }
-                        let connection_id = client.connection_id().clone();
-                        event_tx.send(InternalCommand::MaybeWrite{connection_id})?;
-
-                        // It's a bug if more than one client is waiting for this query.
-                        break;
                     }
+                    received = backend_socket.try_recv(&mut backend_buf).ok();
+                }
+                for connection_id in to_write {
+                    event_tx.send(InternalCommand::MaybeWrite{connection_id})?;
                 }
             }
 
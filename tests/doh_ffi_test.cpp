@@ -57,6 +57,9 @@ TEST(DoHFFITest, SmokeTest) {
             .probe_timeout_ms = TIMEOUT_MS,
             .idle_timeout_ms = TIMEOUT_MS,
             .use_session_resumption = true,
+            .max_connections = 1,
+            .max_streams_per_connection = 1,
+            .use_early_data = false,
     };
 
     // TODO: Use a local server instead of dns.google.
@@ -76,8 +79,29 @@ TEST(DoHFFITest, SmokeTest) {
                               nullptr, buf.data(), MAXPACKET);
     uint8_t answer[8192];
 
+    const ssize_t queryLen = len;
     len = doh_query(doh, dnsNetId, buf.data(), len, answer, sizeof answer, TIMEOUT_MS);
     EXPECT_GT(len, 0);
+
+    // The same query without waiting for the answer.
+    ssize_t asyncLen = 0;
+    auto query_cb = [](void* context, ssize_t result, const uint8_t* answer, size_t answer_len) {
+        if (result > 0) {
+            EXPECT_EQ(result, static_cast<ssize_t>(answer_len));
+            EXPECT_NE(answer, nullptr);
+        }
+        std::lock_guard guard(m);
+        *static_cast<ssize_t*>(context) = result;
+        cv.notify_one();
+    };
+    ASSERT_EQ(doh_query_async(doh, dnsNetId, buf.data(), queryLen, TIMEOUT_MS, query_cb, &asyncLen),
+              0);
+    {
+        std::unique_lock<std::mutex> lk(m);
+        EXPECT_TRUE(cv.wait_for(lk, std::chrono::milliseconds(TIMEOUT_MS * 2),
+                                [&] { return asyncLen != 0; }));
+    }
+    EXPECT_GT(asyncLen, 0);
     doh_net_delete(doh, dnsNetId);
     doh_dispatcher_delete(doh);
 }
@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmarks of the resolver's hot paths. None of them touches the network: lookups are
+// answered from caches filled by the benchmarks themselves, and the nameserver is never queried.
+
+#include <arpa/nameser.h>
+#include <netdb.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+#include <netdutils/InternetAddresses.h>
+#include <netdutils/Slice.h>
+
+#include "DnsStats.h"
+#include "DnsTlsQueryMap.h"
+#include "Experiments.h"
+#include "LockedQueue.h"
+#include "OperationLimiter.h"
+#include "getaddrinfo.h"
+#include "res_comp.h"
+#include "netd_resolv/resolv.h"
+#include "resolv_cache.h"
+#include "resolv_private.h"
+#include "stats.pb.h"
+#include "tests/dns_responder/dns_responder.h"
+
+namespace android::net {
+namespace {
+
+using android::base::StringPrintf;
+using netdutils::IPSockAddr;
+
+constexpr unsigned kNetId = 40;
+// Sync'd from res_cache.cpp.
+constexpr int kCacheEntries = 64 * 2 * 5;
+constexpr unsigned kTtl = 3600;
+
+std::vector<uint8_t> makeQuery(const std::string& name, int type) {
+    uint8_t buf[MAXPACKET] = {};
+    const int len =
+            res_nmkquery(QUERY, name.c_str(), ns_c_in, type, {}, buf, /*netcontext_flags=*/0);
+    return std::vector<uint8_t>(buf, buf + std::max(len, 0));
+}
+
+// An answer to |query| with a record of each of |rdata|.
+std::vector<uint8_t> makeAnswer(const std::vector<uint8_t>& query,
+                                const std::vector<std::string>& rdata) {
+    test::DNSHeader header;
+    header.read(reinterpret_cast<const char*>(query.data()),
+                reinterpret_cast<const char*>(query.data()) + query.size());
+    header.qr = true;
+    const test::DNSQuestion& question = header.questions.front();
+    for (const std::string& r : rdata) {
+        test::DNSRecord record{
+                .name = {.name = question.qname.name},
+                .rtype = question.qtype,
+                .rclass = question.qclass,
+                .ttl = kTtl,
+        };
+        test::DNSResponder::fillRdata(r, record);
+        header.answers.push_back(std::move(record));
+    }
+    char answer[MAXPACKET] = {};
+    char* end = header.write(answer, answer + sizeof(answer));
+    return std::vector<uint8_t>(answer, end);
+}
+
+std::string nameOf(int i) {
+    return StringPrintf("host%d.bench.example", i);
+}
+
+// Creates the network that the cache benchmarks use, once for all of them, so that the threads of
+// a benchmark share its cache.
+void setUpNetwork() {
+    static const bool created = [] {
+        resolv_create_cache_for_net(kNetId);
+        const res_params params = {
+                .sample_validity = 300,
+                .success_threshold = 25,
+                .min_samples = 8,
+                .max_samples = 8,
+                .base_timeout_msec = 1000,
+                .retry_count = 2,
+        };
+        // From TEST-NET-1, so that nothing would answer if it were ever queried.
+        resolv_set_nameservers(kNetId, {"192.0.2.53"}, {}, params, std::nullopt);
+        return true;
+    }();
+    (void)created;
+}
+
+// Empties the cache and adds an A answer for each of the first |count| names.
+void fillCache(int count) {
+    setUpNetwork();
+    resolv_flush_cache_for_net(kNetId);
+    for (int i = 0; i < count; i++) {
+        const std::vector<uint8_t> query = makeQuery(nameOf(i), ns_t_a);
+        resolv_cache_add(kNetId, query, makeAnswer(query, {"192.0.2.1"}));
+    }
+}
+
+// Hits on a half full cache. Threads look up the same names from different offsets, and hits
+// only take the lock of the network in shared mode, so they shouldn't wait for each other.
+void BM_CacheLookupHit(benchmark::State& state) {
+    constexpr int kNames = kCacheEntries / 2;
+    if (state.thread_index() == 0) fillCache(kNames);
+    std::vector<std::vector<uint8_t>> queries;
+    for (int i = 0; i < kNames; i++) queries.push_back(makeQuery(nameOf(i), ns_t_a));
+    uint8_t answer[MAXPACKET];
+    int i = state.thread_index();
+    for (auto _ : state) {
+        int anslen = 0;
+        const ResolvCacheStatus status =
+                resolv_cache_lookup(kNetId, queries[i++ % kNames], answer, &anslen, 0);
+        if (status != RESOLV_CACHE_FOUND) {
+            state.SkipWithError("cache miss");
+            break;
+        }
+        benchmark::DoNotOptimize(anslen);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheLookupHit)->ThreadRange(1, 8)->UseRealTime();
+
+// Hits on names made of two labels of the length given as argument, in mixed case, so that
+// hashing and comparing the names dominates.
+void BM_CacheLookupNameLength(benchmark::State& state) {
+    constexpr int kNames = 64;
+    const size_t labelLength = state.range(0);
+    fillCache(0);
+    std::vector<std::vector<uint8_t>> queries;
+    for (int i = 0; i < kNames; i++) {
+        const std::string label(labelLength, 'A' + i % 26);
+        queries.push_back(makeQuery(
+                StringPrintf("%s.%s.%02d.eXaMpLe.CoM", label.c_str(), label.c_str(), i), ns_t_a));
+        resolv_cache_add(kNetId, queries.back(), makeAnswer(queries.back(), {"192.0.2.1"}));
+    }
+    uint8_t answer[MAXPACKET];
+    int i = 0;
+    for (auto _ : state) {
+        int anslen = 0;
+        const ResolvCacheStatus status =
+                resolv_cache_lookup(kNetId, queries[i++ % kNames], answer, &anslen, 0);
+        if (status != RESOLV_CACHE_FOUND) {
+            state.SkipWithError("cache miss");
+            break;
+        }
+        benchmark::DoNotOptimize(anslen);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheLookupNameLength)->Arg(4)->Arg(16)->Arg(63);
+
+// A miss, given up on as a failed query would be, so that the next one doesn't wait for it.
+void BM_CacheLookupMiss(benchmark::State& state) {
+    fillCache(kCacheEntries / 2);
+    const std::vector<uint8_t> query = makeQuery("missing.bench.example", ns_t_a);
+    uint8_t answer[MAXPACKET];
+    for (auto _ : state) {
+        int anslen = 0;
+        const ResolvCacheStatus status = resolv_cache_lookup(kNetId, query, answer, &anslen, 0);
+        if (status != RESOLV_CACHE_NOTFOUND) {
+            state.SkipWithError("unexpected cache hit");
+            break;
+        }
+        _resolv_cache_query_failed(kNetId, query, 0);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheLookupMiss);
+
+// Adds to a cache with room left. The cache is emptied, untimed, once every name is in it.
+void BM_CacheAdd(benchmark::State& state) {
+    constexpr int kNames = kCacheEntries / 2;
+    std::vector<std::vector<uint8_t>> queries, answers;
+    for (int i = 0; i < kNames; i++) {
+        queries.push_back(makeQuery(nameOf(i), ns_t_a));
+        answers.push_back(makeAnswer(queries.back(), {"192.0.2.1"}));
+    }
+    fillCache(0);
+    int i = 0;
+    for (auto _ : state) {
+        if (i == kNames) {
+            state.PauseTiming();
+            resolv_flush_cache_for_net(kNetId);
+            i = 0;
+            state.ResumeTiming();
+        }
+        benchmark::DoNotOptimize(resolv_cache_add(kNetId, queries[i], answers[i]));
+        i++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheAdd);
+
+// Adds to a full cache, cycling through twice as many names as it holds, so that every add evicts
+// the least recently used entry.
+void BM_CacheAddEvict(benchmark::State& state) {
+    constexpr int kNames = kCacheEntries * 2;
+    std::vector<std::vector<uint8_t>> queries, answers;
+    for (int i = 0; i < kNames; i++) {
+        queries.push_back(makeQuery(nameOf(i), ns_t_a));
+        answers.push_back(makeAnswer(queries.back(), {"192.0.2.1"}));
+    }
+    fillCache(0);
+    for (int i = 0; i < kCacheEntries; i++) resolv_cache_add(kNetId, queries[i], answers[i]);
+    int i = kCacheEntries;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(resolv_cache_add(kNetId, queries[i], answers[i]));
+        i = (i + 1) % kNames;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheAddEvict);
+
+// The hit ratio of names looked up over and over, while a scan looks up kScanPerLookup names once
+// each for every one of them. The argument is the "cache_admission" flag: without it, the scan
+// evicts the popular names before they're looked up again.
+void BM_CacheHitRatioScan(benchmark::State& state) {
+    constexpr unsigned kScanNetId = kNetId + 1;
+    constexpr int kPopular = kCacheEntries / 2;
+    constexpr int kScanPerLookup = 2;
+    android::base::SetProperty("persist.device_config.netd_native.cache_admission",
+                               std::to_string(state.range(0)));
+    Experiments::getInstance()->update();
+    resolv_create_cache_for_net(kScanNetId);
+
+    std::vector<std::vector<uint8_t>> queries, answers;
+    for (int i = 0; i < kPopular; i++) {
+        queries.push_back(makeQuery(nameOf(i), ns_t_a));
+        answers.push_back(makeAnswer(queries.back(), {"192.0.2.1"}));
+    }
+    uint8_t answer[MAXPACKET];
+    // Looks up |query|, and adds |ans| if it missed, as res_nsend() would once answered.
+    const auto resolve = [&](const std::vector<uint8_t>& query, const std::vector<uint8_t>& ans) {
+        int anslen = 0;
+        if (resolv_cache_lookup(kScanNetId, query, answer, &anslen, 0) == RESOLV_CACHE_FOUND) {
+            return true;
+        }
+        resolv_cache_add(kScanNetId, query, ans);
+        return false;
+    };
+
+    int i = 0;
+    int64_t hits = 0;
+    for (auto _ : state) {
+        if (resolve(queries[i % kPopular], answers[i % kPopular])) hits++;
+        state.PauseTiming();
+        std::vector<std::vector<uint8_t>> scan, scanAnswers;
+        for (int j = 0; j < kScanPerLookup; j++) {
+            scan.push_back(makeQuery(StringPrintf("scan%d-%d.bench.example", i, j), ns_t_a));
+            scanAnswers.push_back(makeAnswer(scan.back(), {"192.0.2.2"}));
+        }
+        state.ResumeTiming();
+        for (int j = 0; j < kScanPerLookup; j++) resolve(scan[j], scanAnswers[j]);
+        i++;
+    }
+    state.counters["hit_ratio"] = static_cast<double>(hits) / std::max<int64_t>(1, i);
+
+    resolv_delete_cache_for_net(kScanNetId);
+    android::base::SetProperty("persist.device_config.netd_native.cache_admission", "");
+    Experiments::getInstance()->update();
+}
+BENCHMARK(BM_CacheHitRatioScan)->Arg(0)->Arg(1);
+
+void BM_HashQuery(benchmark::State& state) {
+    const std::vector<uint8_t> query =
+            makeQuery("a-fairly-long-label.www.bench.example", ns_t_aaaa);
+    for (auto _ : state) {
+        unsigned hash = 0;
+        if (!resolv_cache_hash_query(query, &hash)) {
+            state.SkipWithError("unsupported query");
+            break;
+        }
+        benchmark::DoNotOptimize(hash);
+    }
+}
+BENCHMARK(BM_HashQuery);
+
+// Expands a name ending in a compression pointer, as parsing every answer does.
+void BM_DnExpand(benchmark::State& state) {
+    // "www.example.com", then "mail" and a pointer to "example.com".
+    std::vector<uint8_t> msg(NS_HFIXEDSZ);
+    const uint8_t names[] = {3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+                             3, 'c', 'o', 'm', 0, 4, 'm', 'a', 'i', 'l', 0xc0, 16};
+    msg.insert(msg.end(), std::begin(names), std::end(names));
+    char buf[NS_MAXDNAME];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(dn_expand(msg, msg.data() + 29, buf, nullptr));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DnExpand);
+
+std::vector<std::string> makeSharedSuffixNames() {
+    std::vector<std::string> names;
+    for (int i = 0; i < 24; i++) names.push_back(StringPrintf("host%d.cdn.example.com", i));
+    return names;
+}
+
+// Compresses a message of names sharing suffixes with dn_comp(), which does worse the more
+// names there are.
+void BM_DnComp(benchmark::State& state) {
+    const std::vector<std::string> names = makeSharedSuffixNames();
+    std::vector<uint8_t> msg(4096);
+    for (auto _ : state) {
+        uint8_t* dnptrs[64] = {msg.data()};
+        uint8_t* p = msg.data() + NS_HFIXEDSZ;
+        for (const std::string& name : names) {
+            p += dn_comp(name.c_str(), p, msg.data() + msg.size() - p, dnptrs, std::end(dnptrs));
+        }
+        benchmark::DoNotOptimize(p);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DnComp);
+
+// The same message with DnsNameCompressor.
+void BM_DnsNameCompressor(benchmark::State& state) {
+    const std::vector<std::string> names = makeSharedSuffixNames();
+    std::vector<uint8_t> msg(4096);
+    for (auto _ : state) {
+        DnsNameCompressor compressor(msg);
+        size_t offset = NS_HFIXEDSZ;
+        for (const std::string& name : names) offset += compressor.compress(name.c_str(), offset);
+        benchmark::DoNotOptimize(offset);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DnsNameCompressor);
+
+void BM_MakeQuery(benchmark::State& state) {
+    uint8_t buf[MAXPACKET];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(res_nmkquery(QUERY, "www.bench.example", ns_c_in, ns_t_aaaa, {},
+                                              buf, /*netcontext_flags=*/0));
+    }
+}
+BENCHMARK(BM_MakeQuery);
+
+// A whole getaddrinfo() answered from the cache, which is mostly parsing the A and AAAA answers
+// in getanswer() and sorting their addresses with _rfc6724_sort(). The argument is the number of
+// addresses of each family.
+void BM_GetAddrInfo(benchmark::State& state) {
+    const std::string name = "gai.bench.example";
+    fillCache(0);
+    std::vector<std::string> v4, v6;
+    for (int i = 0; i < state.range(0); i++) {
+        v4.push_back(StringPrintf("192.0.2.%d", i + 1));
+        v6.push_back(StringPrintf("2001:db8::%x", i + 1));
+    }
+    const std::vector<uint8_t> query4 = makeQuery(name, ns_t_a);
+    const std::vector<uint8_t> query6 = makeQuery(name, ns_t_aaaa);
+    resolv_cache_add(kNetId, query4, makeAnswer(query4, v4));
+    resolv_cache_add(kNetId, query6, makeAnswer(query6, v6));
+
+    const android_net_context netcontext = {
+            .app_netid = kNetId,
+            .app_mark = MARK_UNSET,
+            .dns_netid = kNetId,
+            .dns_mark = MARK_UNSET,
+            .uid = NET_CONTEXT_INVALID_UID,
+    };
+    const addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    for (auto _ : state) {
+        addrinfo* result = nullptr;
+        NetworkDnsEventReported event;
+        if (resolv_getaddrinfo(name.c_str(), nullptr, &hints, &netcontext, &result, &event) != 0) {
+            state.SkipWithError("getaddrinfo failed");
+            break;
+        }
+        freeaddrinfo(result);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetAddrInfo)->Arg(1)->Arg(8);
+
+std::vector<IPSockAddr> makeServers() {
+    std::vector<IPSockAddr> servers;
+    for (int i = 1; i <= 4; i++) {
+        servers.push_back(IPSockAddr::toIPSockAddr(StringPrintf("192.0.2.%d", i), 53));
+    }
+    return servers;
+}
+
+DnsQueryEvent makeDnsQueryEvent(int latencyMs) {
+    DnsQueryEvent event;
+    event.set_protocol(PROTO_UDP);
+    event.set_rcode(NS_R_NO_ERROR);
+    event.set_latency_micros(latencyMs * 1000);
+    return event;
+}
+
+void BM_DnsStatsAddStats(benchmark::State& state) {
+    DnsStats stats;
+    const std::vector<IPSockAddr> servers = makeServers();
+    stats.setAddrs(servers, PROTO_UDP);
+    std::vector<DnsQueryEvent> events;
+    for (int i = 0; i < 100; i++) events.push_back(makeDnsQueryEvent(i));
+    size_t i = 0;
+    for (auto _ : state) {
+        stats.addStats(servers[i % servers.size()], events[i % events.size()]);
+        i++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DnsStatsAddStats);
+
+void BM_DnsStatsGetSortedServers(benchmark::State& state) {
+    DnsStats stats;
+    const std::vector<IPSockAddr> servers = makeServers();
+    stats.setAddrs(servers, PROTO_UDP);
+    for (int i = 0; i < 1000; i++) {
+        stats.addStats(servers[i % servers.size()], makeDnsQueryEvent(i % 100));
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(stats.getSortedServers(PROTO_UDP));
+    }
+}
+BENCHMARK(BM_DnsStatsGetSortedServers);
+
+// Pushes records once the window is full, as on every query but the first kLogSize ones.
+void BM_StatsRecordsPush(benchmark::State& state) {
+    StatsRecords records(IPSockAddr::toIPSockAddr("192.0.2.1", 53), DnsStats::kLogSize);
+    for (size_t i = 0; i < DnsStats::kLogSize; i++) {
+        records.push({.rcode = NS_R_NO_ERROR, .latencyUs = std::chrono::microseconds(i)});
+    }
+    int i = 0;
+    for (auto _ : state) {
+        records.push({
+                .rcode = (i % 10 == 0) ? NS_R_TIMEOUT : NS_R_NO_ERROR,
+                .linux_errno = 0,
+                .latencyUs = std::chrono::microseconds(i % 100000),
+        });
+        i++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_StatsRecordsPush);
+
+// Records a query and answers the oldest one in flight. The argument is the number of queries
+// kept in flight.
+void BM_QueryMap(benchmark::State& state) {
+    const std::vector<uint8_t> query = makeQuery("www.bench.example", ns_t_a);
+    const size_t inFlight = state.range(0);
+    DnsTlsQueryMap map;
+    std::deque<std::unique_ptr<DnsTlsQueryMap::QueryFuture>> futures;
+    const auto answerOldest = [&]() {
+        std::vector<uint8_t> answer = query;
+        answer[0] = futures.front()->query.newId >> 8;
+        answer[1] = futures.front()->query.newId;
+        map.onResponse(std::move(answer));
+        benchmark::DoNotOptimize(futures.front()->result.get().code);
+        futures.pop_front();
+    };
+    for (auto _ : state) {
+        futures.push_back(map.recordQuery(netdutils::makeSlice(query)));
+        if (!futures.back()) {
+            futures.pop_back();
+            state.SkipWithError("out of IDs");
+            break;
+        }
+        if (futures.size() > inFlight) answerOldest();
+    }
+    while (!futures.empty()) answerOldest();
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueryMap)->Arg(1)->Arg(100)->Arg(10000)->Arg(60000);
+
+// Pushes items from the given number of threads while one thread takes them, as query threads
+// and the DnsTlsSocket loop do.
+template <typename Queue>
+void BM_SocketQueue(benchmark::State& state) {
+    constexpr int kItems = 10000;
+    const int producers = state.range(0);
+    for (auto _ : state) {
+        Queue queue;
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++) {
+            threads.emplace_back([&]() {
+                for (int i = 0; i < kItems; i++) queue.push(std::vector<uint8_t>(64));
+            });
+        }
+        std::deque<std::vector<uint8_t>> out;
+        for (size_t taken = 0; taken < size_t(producers * kItems); taken += out.size()) {
+            queue.swap(out);
+        }
+        for (std::thread& t : threads) t.join();
+    }
+    state.SetItemsProcessed(state.iterations() * producers * kItems);
+}
+BENCHMARK_TEMPLATE(BM_SocketQueue, LockedQueue<std::vector<uint8_t>>)
+        ->Arg(1)
+        ->Arg(4)
+        ->Arg(16)
+        ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SocketQueue, MpscQueue<std::vector<uint8_t>>)
+        ->Arg(1)
+        ->Arg(4)
+        ->Arg(16)
+        ->UseRealTime();
+
+// Starts and finishes an operation, with each thread as a different UID, as the DNS proxy does
+// for every query.
+void BM_OperationLimiter(benchmark::State& state) {
+    static netdutils::OperationLimiter<uid_t> limiter(/*limitPerKey=*/256);
+    const uid_t uid = 10000 + state.thread_index();
+    for (auto _ : state) {
+        if (!limiter.start(uid)) {
+            state.SkipWithError("limited");
+            break;
+        }
+        limiter.finish(uid);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_OperationLimiter)->ThreadRange(1, 8)->UseRealTime();
+
+}  // namespace
+}  // namespace android::net
+
+BENCHMARK_MAIN();
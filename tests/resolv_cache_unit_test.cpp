@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <netdb.h>
+#include <unistd.h>
 
 #include <array>
 #include <atomic>
@@ -23,13 +25,19 @@
 #include <span>
 #include <thread>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <android/multinetwork.h>
 #include <arpa/inet.h>
 #include <cutils/properties.h>
 #include <gmock/gmock-matchers.h>
 #include <gtest/gtest.h>
+#include <openssl/sha.h>
 
+#include "AnswerInterner.h"
+#include "Experiments.h"
 #include "resolv_cache.h"
 #include "resolv_private.h"
 #include "stats.h"
@@ -39,6 +47,8 @@
 
 using namespace std::chrono_literals;
 
+using android::base::unique_fd;
+using android::netdutils::DumpWriter;
 using android::netdutils::IPSockAddr;
 
 constexpr int TEST_NETID_2 = 31;
@@ -98,9 +108,50 @@ std::vector<uint8_t> makeAnswer(const std::vector<uint8_t>& query, const char* r
     return std::vector<uint8_t>(answer, answer_end);
 }
 
-// Get the current time in unix timestamp since the Epoch.
-time_t currentTime() {
-    return std::time(nullptr);
+// Name in wire format, e.g. "a.example." is {1, 'a', 7, 'e', ..., 0}.
+std::vector<char> makeWireName(const std::string& name) {
+    std::vector<char> wire;
+    for (const std::string& label : android::base::Split(name, ".")) {
+        if (label.empty()) continue;
+        wire.push_back(label.size());
+        wire.insert(wire.end(), label.begin(), label.end());
+    }
+    wire.push_back(0);
+    return wire;
+}
+
+// NXDOMAIN answer to |query| with the given authority records and a SOA with a 300s negative TTL.
+std::vector<uint8_t> makeNxdomainAnswer(const std::vector<uint8_t>& query, const std::string& zone,
+                                        std::vector<test::DNSRecord> authorities, bool ad) {
+    test::DNSHeader header;
+    header.read(reinterpret_cast<const char*>(query.data()),
+                reinterpret_cast<const char*>(query.data()) + query.size());
+    header.qr = true;
+    header.ad = ad;
+    header.rcode = ns_r_nxdomain;
+
+    test::DNSRecord soa{.name = {.name = zone}, .rtype = ns_t_soa, .rclass = ns_c_in, .ttl = 300};
+    soa.rdata = makeWireName("ns." + zone);
+    const std::vector<char> rname = makeWireName("admin." + zone);
+    soa.rdata.insert(soa.rdata.end(), rname.begin(), rname.end());
+    // Serial, refresh, retry, expire and minimum.
+    for (const uint32_t field : {1, 7200, 3600, 1209600, 300}) {
+        const uint32_t nfield = htonl(field);
+        const char* bytes = reinterpret_cast<const char*>(&nfield);
+        soa.rdata.insert(soa.rdata.end(), bytes, bytes + sizeof(nfield));
+    }
+    header.authorities.push_back(std::move(soa));
+    for (test::DNSRecord& record : authorities) header.authorities.push_back(std::move(record));
+
+    std::vector<uint8_t> answer;
+    header.write(&answer);
+    return answer;
+}
+
+// What the caches take to be the time once a test sets their clock to fakeClock().
+std::atomic<std::chrono::milliseconds> fakeTime;
+std::chrono::milliseconds fakeClock() {
+    return fakeTime.load();
 }
 
 // Comparison for res_sample.
@@ -191,7 +242,8 @@ class ResolvCacheTest : public ResolvTestBase {
         return resolv_cache_add(netId, query, answer);
     }
 
-    int cacheGetExpiration(uint32_t netId, const std::vector<uint8_t>& query, time_t* expiration) {
+    int cacheGetExpiration(uint32_t netId, const std::vector<uint8_t>& query,
+                           std::chrono::milliseconds* expiration) {
         return resolv_cache_get_expiration(netId, query, expiration);
     }
 
@@ -199,6 +251,21 @@ class ResolvCacheTest : public ResolvTestBase {
         _resolv_cache_query_failed(netId, ce.query, flags);
     }
 
+    // Looks up |ces| together, with an answer buffer of its own for each. The entries returned
+    // refer to the queries in |ces|.
+    std::vector<ResolvCacheBatchEntry> cacheLookupBatch(uint32_t netId,
+                                                        std::span<const CacheEntry> ces,
+                                                        std::vector<std::vector<uint8_t>>* answers,
+                                                        uint32_t flags = 0) {
+        answers->assign(ces.size(), std::vector<uint8_t>(MAXPACKET));
+        std::vector<ResolvCacheBatchEntry> entries(ces.size());
+        for (size_t i = 0; i < ces.size(); i++) {
+            entries[i] = {.query = ces[i].query, .answer = (*answers)[i]};
+        }
+        resolv_cache_lookup_batch(netId, entries, flags);
+        return entries;
+    }
+
     int cacheSetupResolver(uint32_t netId, const SetupParams& setup) {
         return resolv_set_nameservers(netId, setup.servers, setup.domains, setup.params,
                                       setup.resolverOptions, setup.transportTypes);
@@ -280,6 +347,54 @@ TEST_F(ResolvCacheTest, CreateAndDeleteCache) {
     EXPECT_TRUE(has_named_cache(TEST_NETID_2));
 }
 
+TEST_F(ResolvCacheTest, MemoryUsage) {
+    ResolvCacheMemoryUsage before;
+    EXPECT_FALSE(resolv_cache_get_memory_usage(TEST_NETID, &before));
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    ASSERT_TRUE(resolv_cache_get_memory_usage(TEST_NETID, &before));
+
+    for (int i = 0; i < 50; i++) {
+        const std::string name = "host" + std::to_string(i) + ".example";
+        const CacheEntry ce = makeCacheEntry(QUERY, name.c_str(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+    ResolvCacheMemoryUsage after;
+    ASSERT_TRUE(resolv_cache_get_memory_usage(TEST_NETID, &after));
+    EXPECT_GT(after.cache, before.cache);
+    EXPECT_GE(after.cache_peak, before.cache_peak);
+    EXPECT_EQ(before.hosts, after.hosts);
+
+    // The peak outlives the entries.
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    ResolvCacheMemoryUsage flushed;
+    ASSERT_TRUE(resolv_cache_get_memory_usage(TEST_NETID, &flushed));
+    EXPECT_GE(flushed.cache_peak, after.cache_peak);
+}
+
+TEST_F(ResolvCacheTest, EvictionReleasesMemory) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    aidl::android::net::ResolverOptionsParcel options;
+    options.cacheMaxBytes = 4 * MAX_ENTRIES * 512;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+    for (int i = 0; i < 2000; i++) {
+        const std::string name = fmt::format("host{:04d}.example", i);
+        const CacheEntry ce = makeCacheEntry(QUERY, name.c_str(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+    ResolvCacheMemoryUsage full;
+    ASSERT_TRUE(resolv_cache_get_memory_usage(TEST_NETID, &full));
+
+    // Evicting most of the entries gives the memory they took back, without a flush. The budget
+    // is restored so that the hash table is the same size as before.
+    options.cacheMaxBytes = MAX_ENTRIES * 512 / 4;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+    options.cacheMaxBytes = 4 * MAX_ENTRIES * 512;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+    ResolvCacheMemoryUsage evicted;
+    ASSERT_TRUE(resolv_cache_get_memory_usage(TEST_NETID, &evicted));
+    EXPECT_LT(evicted.cache + 256 * 1024, full.cache);
+}
+
 // Missing checks for the argument 'answer'.
 TEST_F(ResolvCacheTest, CacheAdd_InvalidArgs) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
@@ -298,7 +413,7 @@ TEST_F(ResolvCacheTest, CacheAdd_InvalidArgs) {
 TEST_F(ResolvCacheTest, CacheAdd_DuplicateEntry) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     CacheEntry ce = makeCacheEntry(QUERY, "existent.in.cache", ns_c_in, ns_t_a, "1.2.3.4");
-    time_t now = currentTime();
+    const auto now = resolv_cache_now();
 
     // Add the cache entry.
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
@@ -306,14 +421,14 @@ TEST_F(ResolvCacheTest, CacheAdd_DuplicateEntry) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
 
     // Get the expiration time and verify its value is greater than now.
-    time_t expiration1;
+    std::chrono::milliseconds expiration1;
     EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &expiration1));
     EXPECT_GT(expiration1, now);
 
     // Adding the duplicate entry will return an error, and the expiration time won't be modified.
     EXPECT_EQ(-EEXIST, cacheAdd(TEST_NETID, ce));
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
-    time_t expiration2;
+    std::chrono::milliseconds expiration2;
     EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &expiration2));
     EXPECT_EQ(expiration1, expiration2);
 }
@@ -433,13 +548,702 @@ TEST_F(ResolvCacheTest, CacheLookup_Expired) {
 
     // Cache found.
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
-    time_t expiration;
+    std::chrono::milliseconds expiration;
     EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &expiration));
 
     // Wait for the cache expired.
     std::this_thread::sleep_for(1500ms);
-    EXPECT_GE(currentTime(), expiration);
+    EXPECT_GE(resolv_cache_now(), expiration);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_ExpiresToTheMillisecond) {
+    fakeTime = 1000s + 400ms;
+    resolv_cache_set_clock(fakeClock);
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    CacheEntry ce = makeCacheEntry(QUERY, "expired.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    std::chrono::milliseconds expiration;
+    EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &expiration));
+    EXPECT_EQ(fakeTime.load() + 1s, expiration);
+
+    // Not a second in, passing a second boundary: a clock counting seconds would expire it here.
+    fakeTime = 1001s + 399ms;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    fakeTime = 1001s + 400ms;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    cacheQueryFailed(TEST_NETID, ce, 0);
+
+    resolv_cache_set_clock(nullptr);
+}
+
+TEST_F(ResolvCacheTest, FailureCache) {
+    fakeTime = 1000s;
+    resolv_cache_set_clock(fakeClock);
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const std::vector<uint8_t> query = makeQuery(QUERY, "failing.example", ns_c_in, ns_t_a);
+    int rcode = 0;
+
+    // Not remembered by default.
+    resolv_cache_add_failure(TEST_NETID, query, 0, ns_r_servfail);
+    EXPECT_FALSE(resolv_cache_lookup_failure(TEST_NETID, query, 0, &rcode));
+
+    aidl::android::net::ResolverOptionsParcel options;
+    options.failureCacheSec = -1;
+    EXPECT_EQ(-EINVAL, resolv_set_options(TEST_NETID, options));
+    options.failureCacheSec = 301;
+    EXPECT_EQ(-EINVAL, resolv_set_options(TEST_NETID, options));
+    options.failureCacheSec = 5;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+
+    resolv_cache_add_failure(TEST_NETID, query, 0, ns_r_servfail);
+    EXPECT_TRUE(resolv_cache_lookup_failure(TEST_NETID, query, 0, &rcode));
+    EXPECT_EQ(ns_r_servfail, rcode);
+    // Names match whatever their case, but not other types, nor lookups that skip the cache.
+    EXPECT_TRUE(resolv_cache_lookup_failure(
+            TEST_NETID, makeQuery(QUERY, "FaIlInG.example", ns_c_in, ns_t_a), 0, &rcode));
+    EXPECT_FALSE(resolv_cache_lookup_failure(
+            TEST_NETID, makeQuery(QUERY, "failing.example", ns_c_in, ns_t_aaaa), 0, &rcode));
+    EXPECT_FALSE(resolv_cache_lookup_failure(TEST_NETID, query, ANDROID_RESOLV_NO_CACHE_LOOKUP,
+                                             &rcode));
+
+    // A timeout replaces the SERVFAIL, and expires after the lifetime.
+    fakeTime = 1003s;
+    resolv_cache_add_failure(TEST_NETID, query, 0, RCODE_TIMEOUT);
+    fakeTime = 1007s;
+    EXPECT_TRUE(resolv_cache_lookup_failure(TEST_NETID, query, 0, &rcode));
+    EXPECT_EQ(RCODE_TIMEOUT, rcode);
+    fakeTime = 1008s;
+    EXPECT_FALSE(resolv_cache_lookup_failure(TEST_NETID, query, 0, &rcode));
+
+    // Flushing the cache forgets failures, and so does a private DNS server changing state.
+    resolv_cache_add_failure(TEST_NETID, query, 0, ns_r_servfail);
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    EXPECT_FALSE(resolv_cache_lookup_failure(TEST_NETID, query, 0, &rcode));
+    resolv_cache_add_failure(TEST_NETID, query, 0, ns_r_servfail);
+    resolv_cache_clear_failures(TEST_NETID);
+    EXPECT_FALSE(resolv_cache_lookup_failure(TEST_NETID, query, 0, &rcode));
+
+    resolv_cache_set_clock(nullptr);
+}
+
+TEST_F(ResolvCacheTest, FailureCache_NotPartitioned) {
+    ScopedSystemProperties sp("persist.device_config.netd_native.cache_uid_partitions", "1");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    SetupParams setup = {.servers = {"127.0.0.1"}, .params = kParams};
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    aidl::android::net::ResolverOptionsParcel options;
+    options.failureCacheSec = 5;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+
+    // The query of one app failing says nothing of those of the others.
+    const std::vector<uint8_t> query = makeQuery(QUERY, "failing.example", ns_c_in, ns_t_a);
+    int rcode = 0;
+    resolv_cache_add_failure(TEST_NETID, query, 0, ns_r_servfail);
+    EXPECT_FALSE(resolv_cache_lookup_failure(TEST_NETID, query, 0, &rcode));
+
+    cacheDelete(TEST_NETID);
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_ServeStale) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    aidl::android::net::ResolverOptionsParcel options;
+    options.serveStaleSec = -1;
+    EXPECT_EQ(-EINVAL, resolv_set_options(TEST_NETID, options));
+    options.serveStaleSec = 2;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+
+    CacheEntry ce = makeCacheEntry(QUERY, "expired.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    std::this_thread::sleep_for(1500ms);
+
+    // The first caller gets the expired answer and is asked to refresh it. Others keep getting
+    // the expired answer while that refresh is in flight.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_STALE, TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+    // The refreshed answer replaces the expired one.
+    CacheEntry refreshed = makeCacheEntry(QUERY, "expired.in.1s", ns_c_in, ns_t_a, "5.6.7.8");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, refreshed));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, refreshed));
+
+    // Past the serve-stale window, the answer is dropped.
+    ce = makeCacheEntry(QUERY, "expired.in.1s.too", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    std::this_thread::sleep_for(3500ms);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_Prefetch) {
+    {
+        ScopedSystemProperties prefetch("persist.device_config.netd_native.cache_prefetch", "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+        CacheEntry hot = makeCacheEntry(QUERY, "hot.in.10s", ns_c_in, ns_t_a, "1.2.3.4", 10s);
+        CacheEntry cold = makeCacheEntry(QUERY, "cold.in.10s", ns_c_in, ns_t_a, "1.2.3.4", 10s);
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, hot));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, cold));
+        for (int i = 0; i < 3; i++) {
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, hot));
+        }
+
+        // Wait until both entries are in the last 10% of their TTL. Only the popular one is
+        // prefetched, and only once.
+        std::this_thread::sleep_for(9200ms);
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_PREFETCH, TEST_NETID, hot));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, hot));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, cold));
+        EXPECT_EQ(1, resolv_cache_get_prefetch_count(TEST_NETID));
+
+        // The prefetched answer replaces the entry in place.
+        CacheEntry refreshed =
+                makeCacheEntry(QUERY, "hot.in.10s", ns_c_in, ns_t_a, "5.6.7.8", 10s);
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, refreshed));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, refreshed));
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, GetHotQuestions) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_TRUE(resolv_cache_get_hot_questions(TEST_NETID_2, 10).empty());
+
+    const CacheEntry hot = makeCacheEntry(QUERY, "hot.example", ns_c_in, ns_t_aaaa, "::1");
+    const CacheEntry warm = makeCacheEntry(QUERY, "warm.example", ns_c_in, ns_t_a, "1.2.3.4");
+    const CacheEntry cold = makeCacheEntry(QUERY, "cold.example", ns_c_in, ns_t_a, "1.2.3.4");
+    for (const CacheEntry* ce : {&hot, &warm, &cold}) {
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, *ce));
+    }
+    for (int i = 0; i < 3; i++) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, hot));
+    }
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, warm));
+
+    // |cold| was never looked up.
+    std::vector<ResolvCacheQuestion> questions = resolv_cache_get_hot_questions(TEST_NETID, 10);
+    ASSERT_EQ(2U, questions.size());
+    EXPECT_EQ("hot.example", questions[0].name);
+    EXPECT_EQ(ns_t_aaaa, questions[0].type);
+    EXPECT_EQ("warm.example", questions[1].name);
+    EXPECT_EQ(ns_t_a, questions[1].type);
+
+    questions = resolv_cache_get_hot_questions(TEST_NETID, 1);
+    ASSERT_EQ(1U, questions.size());
+    EXPECT_EQ("hot.example", questions[0].name);
+}
+
+TEST_F(ResolvCacheTest, DumpDoesNotBlockQueries) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const CacheEntry ce = makeCacheEntry(QUERY, "dumped.name", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    // A dump into a full pipe blocks on its first write, until the pipe is read.
+    int fds[2];
+    ASSERT_EQ(0, pipe2(fds, O_NONBLOCK | O_CLOEXEC));
+    unique_fd readFd(fds[0]), writeFd(fds[1]);
+    const std::vector<char> fill(4096);
+    while (write(writeFd.get(), fill.data(), fill.size()) > 0) {}
+    while (write(writeFd.get(), fill.data(), 1) > 0) {}
+    ASSERT_EQ(0, fcntl(writeFd.get(), F_SETFL, 0));
+    std::atomic<bool> dumped = false;
+    std::thread dumper([&] {
+        DumpWriter dw(writeFd.get());
+        resolv_netconfig_dump(dw, TEST_NETID);
+        dumped = true;
+    });
+    std::this_thread::sleep_for(100ms);
+
+    // Meanwhile, queries go on, even those that take the lock of the network exclusively.
+    const CacheEntry ce2 = makeCacheEntry(QUERY, "added.name", ns_c_in, ns_t_a, "1.2.3.5");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce2));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce2));
+    EXPECT_FALSE(dumped);
+
+    std::vector<char> buf(fill.size());
+    while (!dumped) {
+        if (read(readFd.get(), buf.data(), buf.size()) <= 0) std::this_thread::sleep_for(1ms);
+    }
+    dumper.join();
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_CaseInsensitive) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // Labels longer than a word, and shorter ones, are folded alike.
+    CacheEntry ce = makeCacheEntry(QUERY, "A-LoNg-MiXeD-CaSe-LaBeL.Of.eXaMpLe", ns_c_in, ns_t_a,
+                                   "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    CacheEntry lower = ce;
+    lower.query = makeQuery(QUERY, "a-long-mixed-case-label.of.example", ns_c_in, ns_t_a);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, lower));
+
+    // Characters that differ only in the 0x20 bit but are not letters don't match.
+    for (const auto& [added, other] : {std::pair{"at@sign.example", "at`sign.example"},
+                                       std::pair{"bracket[.example", "bracket{.example"}}) {
+        CacheEntry addedEntry = makeCacheEntry(QUERY, added, ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, addedEntry));
+        CacheEntry otherEntry = makeCacheEntry(QUERY, other, ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, otherEntry)) << other;
+        cacheQueryFailed(TEST_NETID, otherEntry, 0);
+    }
+}
+
+TEST_F(ResolvCacheTest, RRsetCache_CnameChain) {
+    // Answer records are given as {owner, type, TTL, rdata}.
+    const auto makeChainAnswer =
+            [](const std::vector<uint8_t>& query,
+               const std::vector<std::tuple<std::string, unsigned, unsigned, std::string>>& rrs) {
+                test::DNSHeader header;
+                header.read(reinterpret_cast<const char*>(query.data()),
+                            reinterpret_cast<const char*>(query.data()) + query.size());
+                header.qr = true;
+                for (const auto& [owner, rtype, ttl, rdata] : rrs) {
+                    test::DNSRecord record{
+                            .name = {.name = owner}, .rtype = rtype, .rclass = ns_c_in, .ttl = ttl};
+                    test::DNSResponder::fillRdata(rdata, record);
+                    header.answers.push_back(std::move(record));
+                }
+                char answer[MAXPACKET] = {};
+                char* answer_end = header.write(answer, answer + sizeof(answer));
+                return std::vector<uint8_t>(answer, answer_end);
+            };
+    const std::vector<uint8_t> query = makeQuery(QUERY, "a.cdn.example", ns_c_in, ns_t_a);
+    const std::vector<uint8_t> answer =
+            makeChainAnswer(query, {{"a.cdn.example.", ns_t_cname, 300, "edge.cdn.example."},
+                                    {"edge.cdn.example.", ns_t_a, 10, "1.2.3.4"},
+                                    {"unrelated.example.", ns_t_a, 300, "6.6.6.6"}});
+    // A chain leading to another provider, as CDN chains do.
+    const std::vector<uint8_t> outQuery = makeQuery(QUERY, "b.cdn.example", ns_c_in, ns_t_a);
+    const std::vector<uint8_t> outAnswer =
+            makeChainAnswer(outQuery, {{"b.cdn.example.", ns_t_cname, 300, "edge.cdn.test."},
+                                       {"edge.cdn.test.", ns_t_a, 300, "5.6.7.8"}});
+    // An answer from a cleartext server, which could be forged.
+    const std::vector<uint8_t> cleartextQuery = makeQuery(QUERY, "x.example", ns_c_in, ns_t_a);
+    const std::vector<uint8_t> cleartextAnswer =
+            makeChainAnswer(cleartextQuery, {{"x.example.", ns_t_cname, 300, "www.example."},
+                                             {"www.example.", ns_t_a, 300, "6.6.6.6"}});
+
+    for (const bool enabled : {false, true}) {
+        ScopedSystemProperties sp("persist.device_config.netd_native.cache_rrset",
+                                  enabled ? "1" : "0");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, resolv_cache_add(TEST_NETID, query, answer, AID_DNS, /*private_dns=*/true));
+        EXPECT_EQ(0, resolv_cache_add(TEST_NETID, outQuery, outAnswer, AID_DNS,
+                                      /*private_dns=*/true));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, cleartextQuery, cleartextAnswer));
+
+        // The target of the CNAME is answered from its own RRset.
+        const std::vector<uint8_t> edgeQuery =
+                makeQuery(QUERY, "Edge.CDN.example", ns_c_in, ns_t_a);
+        std::vector<uint8_t> edgeAnswer(MAXPACKET);
+        int anslen = 0;
+        EXPECT_EQ(enabled ? RESOLV_CACHE_FOUND : RESOLV_CACHE_NOTFOUND,
+                  resolv_cache_lookup(TEST_NETID, edgeQuery, edgeAnswer, &anslen, 0));
+        if (enabled) {
+            test::DNSHeader header;
+            ASSERT_NE(nullptr, header.read(reinterpret_cast<const char*>(edgeAnswer.data()),
+                                           reinterpret_cast<const char*>(edgeAnswer.data()) +
+                                                   anslen));
+            EXPECT_EQ(static_cast<unsigned>(edgeQuery[0] << 8 | edgeQuery[1]), header.id);
+            ASSERT_EQ(1U, header.questions.size());
+            EXPECT_EQ("Edge.CDN.example.", header.questions[0].qname.name);
+            ASSERT_EQ(1U, header.answers.size());
+            EXPECT_EQ(static_cast<unsigned>(ns_t_a), header.answers[0].rtype);
+            EXPECT_EQ(std::vector<char>({1, 2, 3, 4}), header.answers[0].rdata);
+        } else {
+            cacheQueryFailed(TEST_NETID, {edgeQuery, {}}, 0);
+        }
+
+        // So is the end of a chain to another provider.
+        const std::vector<uint8_t> crossQuery = makeQuery(QUERY, "edge.cdn.test", ns_c_in, ns_t_a);
+        EXPECT_EQ(enabled ? RESOLV_CACHE_FOUND : RESOLV_CACHE_NOTFOUND,
+                  resolv_cache_lookup(TEST_NETID, crossQuery, edgeAnswer, &anslen, 0));
+        if (!enabled) cacheQueryFailed(TEST_NETID, {crossQuery, {}}, 0);
+
+        // Records off the CNAME chain or from cleartext answers aren't cached, nor are RRsets of
+        // other types.
+        for (const auto& [name, type] : {std::pair{"unrelated.example", ns_t_a},
+                                         std::pair{"www.example", ns_t_a},
+                                         std::pair{"a.cdn.example", ns_t_aaaa}}) {
+            const CacheEntry ce = {makeQuery(QUERY, name, ns_c_in, type), {}};
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce)) << name;
+            cacheQueryFailed(TEST_NETID, ce, 0);
+        }
+        cacheDelete(TEST_NETID);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, HttpsHints) {
+    ScopedSystemProperties sp("persist.device_config.netd_native.https_prefetch", "1");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // ServiceMode, on the owner name, with ipv4hint=192.0.2.1.
+    const std::vector<uint8_t> httpsQuery = makeQuery(QUERY, "h3.example", ns_c_in, 65);
+    test::DNSHeader header;
+    header.read(reinterpret_cast<const char*>(httpsQuery.data()),
+                reinterpret_cast<const char*>(httpsQuery.data()) + httpsQuery.size());
+    header.qr = true;
+    header.answers.push_back({.name = {.name = "h3.example."},
+                              .rtype = 65,
+                              .rclass = ns_c_in,
+                              .ttl = 300,
+                              .rdata = {0, 1, 0, 0, 4, 0, 4, static_cast<char>(192), 0, 2, 1}});
+    char buf[MAXPACKET] = {};
+    char* end = header.write(buf, buf + sizeof(buf));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, httpsQuery, std::vector<uint8_t>(buf, end)));
+
+    // The hint answers A, and the first lookup is asked to fetch the address record itself.
+    const CacheEntry ce = makeCacheEntry(QUERY, "H3.example", ns_c_in, ns_t_a, "1.2.3.4");
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    EXPECT_EQ(RESOLV_CACHE_PREFETCH, resolv_cache_lookup(TEST_NETID, ce.query, answer, &anslen, 0));
+    test::DNSHeader hinted;
+    ASSERT_NE(nullptr, hinted.read(reinterpret_cast<const char*>(answer.data()),
+                                   reinterpret_cast<const char*>(answer.data()) + anslen));
+    ASSERT_EQ(1U, hinted.answers.size());
+    EXPECT_EQ(static_cast<unsigned>(ns_t_a), hinted.answers[0].rtype);
+    EXPECT_EQ(30U, hinted.answers[0].ttl);
+    EXPECT_EQ(std::vector<char>({static_cast<char>(192), 0, 2, 1}), hinted.answers[0].rdata);
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_lookup(TEST_NETID, ce.query, answer, &anslen, 0));
+
+    // There's no hint for AAAA.
+    const CacheEntry aaaa = {makeQuery(QUERY, "h3.example", ns_c_in, ns_t_aaaa), {}};
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, aaaa));
+    cacheQueryFailed(TEST_NETID, aaaa, 0);
+
+    // Once fetched, the address record replaces the hint.
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+    cacheDelete(TEST_NETID);
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, UidPartitions) {
+    ScopedSystemProperties sp("persist.device_config.netd_native.cache_uid_partitions", "1");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    SetupParams setup = {.servers = {"127.0.0.1"}, .params = kParams};
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+
+    constexpr uid_t kUid1 = 10001;
+    constexpr uid_t kUid2 = 10002;
+    constexpr uid_t kUid3 = 10003;
+    const auto lookup = [](const CacheEntry& ce, uid_t uid) {
+        std::vector<uint8_t> answer(MAXPACKET);
+        int anslen = 0;
+        return resolv_cache_lookup(TEST_NETID, ce.query, answer, &anslen, 0, uid);
+    };
+
+    // Only the app that added the answer sees it.
+    const CacheEntry ce = makeCacheEntry(QUERY, "partitioned.example", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, lookup(ce, kUid1));
+    EXPECT_EQ(0, resolv_cache_add(TEST_NETID, ce.query, ce.answer, kUid1));
+    EXPECT_EQ(RESOLV_CACHE_FOUND, lookup(ce, kUid1));
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, lookup(ce, kUid2));
+
+    // The same records with another TTL are added to the entry's partitions, not stored again.
+    std::chrono::milliseconds expiration;
+    EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &expiration));
+    const CacheEntry same =
+            makeCacheEntry(QUERY, "partitioned.example", ns_c_in, ns_t_a, "1.2.3.4", 5s);
+    EXPECT_EQ(0, resolv_cache_add(TEST_NETID, same.query, same.answer, kUid2));
+    EXPECT_EQ(RESOLV_CACHE_FOUND, lookup(ce, kUid2));
+    std::chrono::milliseconds sharedExpiration;
+    EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &sharedExpiration));
+    EXPECT_EQ(expiration, sharedExpiration);
+
+    // Other records replace them, for the app that got them only.
+    const CacheEntry other =
+            makeCacheEntry(QUERY, "partitioned.example", ns_c_in, ns_t_a, "5.6.7.8");
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, lookup(ce, kUid3));
+    EXPECT_EQ(0, resolv_cache_add(TEST_NETID, other.query, other.answer, kUid3));
+    EXPECT_EQ(RESOLV_CACHE_FOUND, lookup(ce, kUid3));
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, lookup(ce, kUid1));
+    cacheQueryFailed(TEST_NETID, ce, 0);
+
+    // Networks sending all queries as AID_DNS share their cache.
+    setup.resolverOptions.enforceDnsUid = true;
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, other));
+
+    cacheDelete(TEST_NETID);
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, AggressiveNsec) {
+    ScopedSystemProperties sp("persist.device_config.netd_native.cache_aggressive_nsec", "1");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // Type bitmaps with A, and with NS and SOA as at a zone apex.
+    const std::vector<char> bitmapA = {0, 1, 0x40};
+    const std::vector<char> bitmapApex = {0, 1, 0x22};
+    const auto makeNsec = [](const std::string& owner, const std::string& next,
+                             const std::vector<char>& bitmap) {
+        test::DNSRecord record{
+                .name = {.name = owner}, .rtype = ns_t_nsec, .rclass = ns_c_in, .ttl = 600};
+        record.rdata = makeWireName(next);
+        record.rdata.insert(record.rdata.end(), bitmap.begin(), bitmap.end());
+        return record;
+    };
+    const auto expectNxdomain = [](const char* name, bool nxdomain) {
+        const std::vector<uint8_t> query = makeQuery(QUERY, name, ns_c_in, ns_t_a);
+        std::vector<uint8_t> answer(MAXPACKET);
+        int anslen = 0;
+        const ResolvCacheStatus status =
+                resolv_cache_lookup(TEST_NETID, query, answer, &anslen, 0);
+        if (nxdomain) {
+            EXPECT_EQ(RESOLV_CACHE_FOUND, status) << name;
+            EXPECT_EQ(ns_r_nxdomain, answer[3] & 0x0f) << name;
+            EXPECT_EQ(static_cast<int>(query.size()), anslen) << name;
+        } else {
+            EXPECT_EQ(RESOLV_CACHE_NOTFOUND, status) << name;
+            _resolv_cache_query_failed(TEST_NETID, query, 0);
+        }
+    };
+
+    // b.example. doesn't exist: the NSEC at a.example. covers it, and the one at the apex
+    // covers the wildcard *.example.
+    const std::vector<test::DNSRecord> nsecs = {
+            makeNsec("a.example.", "d.example.", bitmapA),
+            makeNsec("example.", "a.example.", bitmapApex),
+    };
+    // Unvalidated answers aren't used.
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, makeQuery(QUERY, "b.example", ns_c_in, ns_t_a),
+                          makeNxdomainAnswer(makeQuery(QUERY, "b.example", ns_c_in, ns_t_a),
+                                             "example.", nsecs, /*ad=*/false)));
+    expectNxdomain("c.example", false);
+
+    // Nor are validated answers, unless they came from a validated private DNS server.
+    const std::vector<uint8_t> cleartextQuery = makeQuery(QUERY, "ba.example", ns_c_in, ns_t_a);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, cleartextQuery,
+                          makeNxdomainAnswer(cleartextQuery, "example.", nsecs, /*ad=*/true)));
+    expectNxdomain("c.example", false);
+
+    const std::vector<uint8_t> query = makeQuery(QUERY, "bb.example", ns_c_in, ns_t_a);
+    EXPECT_EQ(0, resolv_cache_add(TEST_NETID, query,
+                                  makeNxdomainAnswer(query, "example.", nsecs, /*ad=*/true),
+                                  AID_DNS, /*private_dns=*/true));
+    expectNxdomain("c.example", true);
+    expectNxdomain("x.C.example", true);
+    expectNxdomain("a.example", false);
+    expectNxdomain("d.example", false);
+    expectNxdomain("e.example", false);
+    expectNxdomain("c.example.net", false);
+
+    // NSEC3 (RFC 5155): a single-record chain for example.org. matches the apex and covers every
+    // other hash, unless it has the Opt-Out flag.
+    const std::string salt = "\xab\xcd";
+    constexpr uint16_t iterations = 2;
+    std::vector<char> wire = makeWireName("example.org.");
+    std::string hash(wire.begin(), wire.end());
+    uint8_t md[SHA_DIGEST_LENGTH];
+    for (int i = 0; i <= iterations; i++) {
+        hash += salt;
+        SHA1(reinterpret_cast<const uint8_t*>(hash.data()), hash.size(), md);
+        hash.assign(reinterpret_cast<const char*>(md), sizeof(md));
+    }
+    std::string label;
+    for (size_t bit = 0; bit < hash.size() * 8; bit += 5) {
+        // Base32hex, 5 bits at a time; SHA-1 hashes are a multiple of 5 bits long.
+        int v = 0;
+        for (size_t i = bit; i < bit + 5; i++) {
+            v = (v << 1) | ((static_cast<uint8_t>(hash[i / 8]) >> (7 - i % 8)) & 1);
+        }
+        label.push_back("0123456789abcdefghijklmnopqrstuv"[v]);
+    }
+    for (const uint8_t flags : {1, 0}) {
+        test::DNSRecord record{.name = {.name = label + ".example.org."},
+                               .rtype = ns_t_nsec3,
+                               .rclass = ns_c_in,
+                               .ttl = 600};
+        record.rdata = {1, static_cast<char>(flags), 0, iterations, static_cast<char>(salt.size())};
+        record.rdata.insert(record.rdata.end(), salt.begin(), salt.end());
+        record.rdata.push_back(hash.size());
+        record.rdata.insert(record.rdata.end(), hash.begin(), hash.end());
+        record.rdata.insert(record.rdata.end(), bitmapApex.begin(), bitmapApex.end());
+        const std::vector<uint8_t> nsec3Query =
+                makeQuery(QUERY, flags ? "q1.example.org" : "q2.example.org", ns_c_in, ns_t_a);
+        const std::vector<uint8_t> nsec3Answer =
+                makeNxdomainAnswer(nsec3Query, "example.org.", {record}, /*ad=*/true);
+        EXPECT_EQ(0, resolv_cache_add(TEST_NETID, nsec3Query, nsec3Answer, AID_DNS,
+                                      /*private_dns=*/true));
+        expectNxdomain("www.example.org", flags == 0);
+        expectNxdomain("a.b.example.org", flags == 0);
+    }
+    expectNxdomain("example.org", false);
+
+    // Flushing drops the negative ranges along with the entries.
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    expectNxdomain("c.example", false);
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, MinimizeAnswers) {
+    const std::vector<uint8_t> query = makeQuery(QUERY, "www.example", ns_c_in, ns_t_a);
+    test::DNSHeader header;
+    header.read(reinterpret_cast<const char*>(query.data()),
+                reinterpret_cast<const char*>(query.data()) + query.size());
+    header.qr = true;
+    test::DNSRecord a{.name = {.name = "www.example."}, .rtype = ns_t_a, .rclass = ns_c_in,
+                      .ttl = 60};
+    test::DNSResponder::fillRdata("1.2.3.4", a);
+    header.answers.push_back(a);
+    test::DNSRecord ns{.name = {.name = "example."}, .rtype = ns_t_ns, .rclass = ns_c_in,
+                       .ttl = 60};
+    test::DNSResponder::fillRdata("ns.example.", ns);
+    header.authorities.push_back(ns);
+    test::DNSRecord glue{.name = {.name = "ns.example."}, .rtype = ns_t_a, .rclass = ns_c_in,
+                         .ttl = 60};
+    test::DNSResponder::fillRdata("5.6.7.8", glue);
+    header.additionals.push_back(glue);
+    // EDNS OPT with a 1232-byte payload size and the DO bit.
+    header.additionals.push_back(
+            {.name = {.name = ""}, .rtype = ns_t_opt, .rclass = 1232, .ttl = 0x8000});
+    std::vector<uint8_t> answer;
+    ASSERT_TRUE(header.write(&answer));
+
+    for (const bool enabled : {false, true}) {
+        ScopedSystemProperties sp("persist.device_config.netd_native.cache_minimize_answers",
+                                  enabled ? "1" : "0");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, query, answer));
+
+        std::vector<uint8_t> cached(MAXPACKET);
+        int anslen = 0;
+        ASSERT_EQ(RESOLV_CACHE_FOUND, resolv_cache_lookup(TEST_NETID, query, cached, &anslen, 0));
+        cached.resize(anslen);
+        if (!enabled) {
+            EXPECT_EQ(answer, cached);
+            cacheDelete(TEST_NETID);
+            continue;
+        }
+
+        // Only the answer and the OPT record are left, the latter unchanged.
+        ns_msg handle;
+        ns_rr rr;
+        ASSERT_EQ(0, ns_initparse(cached.data(), cached.size(), &handle));
+        EXPECT_EQ(1, ns_msg_count(handle, ns_s_an));
+        EXPECT_EQ(0, ns_msg_count(handle, ns_s_ns));
+        ASSERT_EQ(1, ns_msg_count(handle, ns_s_ar));
+        ASSERT_EQ(0, ns_parserr(&handle, ns_s_an, 0, &rr));
+        EXPECT_STREQ("www.example", ns_rr_name(rr));
+        ASSERT_EQ(0, ns_parserr(&handle, ns_s_ar, 0, &rr));
+        EXPECT_EQ(ns_t_opt, ns_rr_type(rr));
+        EXPECT_EQ(1232, ns_rr_class(rr));
+        EXPECT_EQ(0x8000U, rr.ttl);
+        EXPECT_LT(cached.size(), answer.size());
+        cacheDelete(TEST_NETID);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, InternAnswers) {
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.cache_intern_answers", "1");
+        android::net::Experiments::getInstance()->update();
+        const auto before = android::net::AnswerInterner::getInstance().stats();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+
+        // The same answer, but for its ID and TTL, on two networks.
+        CacheEntry ce1 = makeCacheEntry(QUERY, "interned.example", ns_c_in, ns_t_a, "1.2.3.4", 60s);
+        CacheEntry ce2 = makeCacheEntry(QUERY, "interned.example", ns_c_in, ns_t_a, "1.2.3.4", 30s);
+        ce2.query[1] ^= 0xff;
+        ce2.answer[1] ^= 0xff;
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID_2, ce2));
+        auto stats = android::net::AnswerInterner::getInstance().stats();
+        EXPECT_EQ(before.payloads + 1, stats.payloads);
+        EXPECT_EQ(before.references + 2, stats.references);
+
+        // Each network gets its own back.
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce1));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce2));
+
+        cacheDelete(TEST_NETID);
+        cacheDelete(TEST_NETID_2);
+        stats = android::net::AnswerInterner::getInstance().stats();
+        EXPECT_EQ(before.payloads, stats.payloads);
+        EXPECT_EQ(before.references, stats.references);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, CacheDomain) {
+    constexpr uint32_t kIsolatedNetId = TEST_NETID_2 + 1;
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+    EXPECT_EQ(0, cacheCreate(kIsolatedNetId));
+    EXPECT_EQ(-ENONET, resolv_set_cache_domain(TEST_NETID_2 + 2, "servers"));
+    EXPECT_EQ(0, resolv_set_cache_domain(TEST_NETID, "servers"));
+    EXPECT_EQ(0, resolv_set_cache_domain(TEST_NETID_2, "servers"));
+    EXPECT_EQ(0, resolv_set_cache_domain(kIsolatedNetId, "other servers"));
+
+    const CacheEntry ce = makeCacheEntry(QUERY, "shared.domain", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    // The answer is copied to the cache of the network that missed.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce));
+    EXPECT_EQ(1, resolv_cache_get_shared_hit_count(TEST_NETID_2));
+    cacheDelete(TEST_NETID);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce));
+    EXPECT_EQ(1, resolv_cache_get_shared_hit_count(TEST_NETID_2));
+
+    // Other domains don't see it, and leaving the domain stops the sharing.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, kIsolatedNetId, ce));
+    cacheQueryFailed(kIsolatedNetId, ce, 0);
+    const CacheEntry ce2 = makeCacheEntry(QUERY, "isolated.domain", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID_2, ce2));
+    EXPECT_EQ(0, resolv_set_cache_domain(kIsolatedNetId, "servers"));
+    EXPECT_EQ(0, resolv_set_cache_domain(TEST_NETID_2, ""));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, kIsolatedNetId, ce2));
+    cacheQueryFailed(kIsolatedNetId, ce2, 0);
+    EXPECT_EQ(0, resolv_cache_get_shared_hit_count(kIsolatedNetId));
+    cacheDelete(TEST_NETID_2);
+    cacheDelete(kIsolatedNetId);
+}
+
+TEST_F(ResolvCacheTest, CachePeek) {
+    fakeTime = 1000s;
+    resolv_cache_set_clock(fakeClock);
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    aidl::android::net::ResolverOptionsParcel options;
+    options.serveStaleSec = 10;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+
+    CacheEntry ce = makeCacheEntry(QUERY, "peek.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+
+    // A miss isn't registered as pending, so the lookup that follows doesn't wait for it.
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_peek(TEST_NETID, ce.query, answer, &anslen, 0));
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_peek(TEST_NETID, ce.query, answer, &anslen, 0));
+    answer.resize(anslen);
+    EXPECT_EQ(ce.answer, answer);
+    answer.resize(MAXPACKET);
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_peek(TEST_NETID, ce.query, answer, &anslen,
+                                                       ANDROID_RESOLV_NO_CACHE_LOOKUP));
+
+    // A stale answer needs refreshing, which is left to the lookup.
+    fakeTime = 1002s;
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_peek(TEST_NETID, ce.query, answer, &anslen, 0));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_STALE, TEST_NETID, ce));
+
+    resolv_cache_set_clock(nullptr);
 }
 
 TEST_F(ResolvCacheTest, PendingRequest_QueryDeferred) {
@@ -488,6 +1292,40 @@ TEST_F(ResolvCacheTest, PendingRequest_QueryDeferred) {
     }
 }
 
+TEST_F(ResolvCacheTest, PendingRequest_IndependentKeys) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    CacheEntry ce1 = makeCacheEntry(QUERY, "query.deferred.1", ns_c_in, ns_t_a, "1.2.3.4");
+    CacheEntry ce2 = makeCacheEntry(QUERY, "query.deferred.2", ns_c_in, ns_t_a, "1.2.3.4");
+    std::atomic_bool done1(false);
+    std::atomic_bool done2(false);
+
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce1));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce2));
+
+    std::vector<std::thread> threads(6);
+    for (size_t i = 0; i < threads.size(); i++) {
+        const bool first = i % 2 == 0;
+        threads[i] = std::thread([&, first]() {
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, first ? ce1 : ce2));
+            EXPECT_TRUE(first ? done1 : done2);
+        });
+    }
+    std::this_thread::sleep_for(100ms);
+
+    // Completing one request only releases the lookups waiting for that key.
+    done2 = true;
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce2));
+    std::this_thread::sleep_for(100ms);
+
+    done1 = true;
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
 TEST_F(ResolvCacheTest, PendingRequest_QueryFailed) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
 
@@ -518,6 +1356,71 @@ TEST_F(ResolvCacheTest, PendingRequest_QueryFailed) {
     }
 }
 
+TEST_F(ResolvCacheTest, PendingRequest_LeaderFailed) {
+    ScopedSystemProperties sp("persist.device_config.netd_native.adaptive_pending_waits", "1");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    CacheEntry ce = makeCacheEntry(QUERY, "leader.failed", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+
+    std::vector<std::thread> threads(5);
+    for (std::thread& thread : threads) {
+        thread = std::thread([&]() {
+            std::vector<uint8_t> answer(MAXPACKET);
+            int anslen = 0;
+            std::optional<int> leaderFailure;
+            EXPECT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_lookup(TEST_NETID, ce.query, answer,
+                                                                 &anslen, 0, AID_DNS,
+                                                                 &leaderFailure));
+            EXPECT_EQ(ns_r_servfail, leaderFailure.value_or(-1));
+        });
+    }
+    std::this_thread::sleep_for(100ms);
+    resolv_cache_add_failure(TEST_NETID, ce.query, 0, ns_r_servfail);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, PendingRequest_SlowLeaderRaced) {
+    ScopedSystemProperties sp("persist.device_config.netd_native.adaptive_pending_waits", "1");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // Pending requests are answered at once, so the next one is slow after the minimum patience.
+    CacheEntry fast = makeCacheEntry(QUERY, "fast.leader", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, fast));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, fast));
+
+    CacheEntry slow = makeCacheEntry(QUERY, "slow.leader", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, slow));
+    std::atomic<int> raced = 0;
+    std::atomic<int> found = 0;
+    std::vector<std::thread> threads(3);
+    for (std::thread& thread : threads) {
+        thread = std::thread([&]() {
+            std::vector<uint8_t> answer(MAXPACKET);
+            int anslen = 0;
+            const auto status = resolv_cache_lookup(TEST_NETID, slow.query, answer, &anslen, 0);
+            (status == RESOLV_CACHE_FOUND ? found : raced)++;
+        });
+    }
+
+    // One waiter races the slow request, and the others wait for either query.
+    std::this_thread::sleep_for(500ms);
+    EXPECT_EQ(1, raced);
+    EXPECT_EQ(0, found);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, slow));
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(1, raced);
+    EXPECT_EQ(2, found);
+    android::net::Experiments::getInstance()->update();
+}
+
 TEST_F(ResolvCacheTest, PendingRequest_CacheDestroyed) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
@@ -555,6 +1458,119 @@ TEST_F(ResolvCacheTest, PendingRequest_CacheDestroyed) {
     }
 }
 
+TEST_F(ResolvCacheTest, CacheLookupBatch) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    const CacheEntry a = makeCacheEntry(QUERY, "batch.lookup", ns_c_in, ns_t_a, "1.2.3.4");
+    const CacheEntry aaaa =
+            makeCacheEntry(QUERY, "batch.lookup", ns_c_in, ns_t_aaaa, "2001:db8::1");
+    const CacheEntry malformed = {.query = std::vector<uint8_t>(DNS_HEADER_SIZE - 1)};
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, a));
+
+    const std::vector<CacheEntry> batch = {a, aaaa, malformed};
+    std::vector<std::vector<uint8_t>> answers;
+    auto entries = cacheLookupBatch(TEST_NETID, batch, &answers);
+    ASSERT_EQ(3U, entries.size());
+    EXPECT_EQ(RESOLV_CACHE_FOUND, entries[0].status);
+    answers[0].resize(entries[0].answerlen);
+    EXPECT_EQ(a.answer, answers[0]);
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, entries[1].status);
+    EXPECT_EQ(RESOLV_CACHE_UNSUPPORTED, entries[2].status);
+
+    // The batch is now resolving AAAA, which a single lookup waits for.
+    std::atomic_bool done(false);
+    std::thread thread([&]() {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, aaaa));
+        EXPECT_TRUE(done);
+    });
+    std::this_thread::sleep_for(100ms);
+
+    // Only the entries that missed are added; the answer of a hit is left alone.
+    std::copy(aaaa.answer.begin(), aaaa.answer.end(), answers[1].begin());
+    entries[1].answerlen = aaaa.answer.size();
+    entries[0].answerlen = 0;
+    done = true;
+    resolv_cache_add_batch(TEST_NETID, entries, 0);
+    thread.join();
+
+    entries = cacheLookupBatch(TEST_NETID, std::span(batch).first(2), &answers);
+    EXPECT_EQ(RESOLV_CACHE_FOUND, entries[0].status);
+    EXPECT_EQ(RESOLV_CACHE_FOUND, entries[1].status);
+
+    // Nothing is found on a network without a cache.
+    entries = cacheLookupBatch(TEST_NETID_2, std::span(batch).first(1), &answers);
+    EXPECT_EQ(RESOLV_CACHE_UNSUPPORTED, entries[0].status);
+}
+
+TEST_F(ResolvCacheTest, CacheLookupBatch_CacheFlags) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    const CacheEntry ce = makeCacheEntry(QUERY, "batch.flags", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    std::vector<std::vector<uint8_t>> answers;
+    auto entries = cacheLookupBatch(TEST_NETID, {&ce, 1}, &answers, ANDROID_RESOLV_NO_CACHE_LOOKUP);
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, entries[0].status);
+    entries = cacheLookupBatch(TEST_NETID, {&ce, 1}, &answers, ANDROID_RESOLV_NO_CACHE_STORE);
+    EXPECT_EQ(RESOLV_CACHE_SKIP, entries[0].status);
+
+    // Neither registered a pending request, which would make this one wait.
+    const CacheEntry other = makeCacheEntry(QUERY, "batch.flags.2", ns_c_in, ns_t_a, "1.2.3.4");
+    entries = cacheLookupBatch(TEST_NETID, {&other, 1}, &answers, ANDROID_RESOLV_NO_CACHE_LOOKUP);
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, entries[0].status);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, other));
+    cacheQueryFailed(TEST_NETID, other, 0);
+}
+
+TEST_F(ResolvCacheTest, PendingRequest_Batch) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    const CacheEntry ce1 = makeCacheEntry(QUERY, "batch.pending.1", ns_c_in, ns_t_a, "1.2.3.4");
+    const CacheEntry ce2 = makeCacheEntry(QUERY, "batch.pending.2", ns_c_in, ns_t_a, "1.2.3.4");
+    const CacheEntry ce3 = makeCacheEntry(QUERY, "batch.pending.3", ns_c_in, ns_t_a, "1.2.3.4");
+    std::atomic_bool done1(false);
+    std::atomic_bool done2(false);
+
+    // A single lookup is resolving ce1, which the batch waits for.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce1));
+    std::thread batch([&]() {
+        const std::vector<CacheEntry> ces = {ce1, ce2, ce3};
+        std::vector<std::vector<uint8_t>> answers;
+        auto entries = cacheLookupBatch(TEST_NETID, ces, &answers);
+        EXPECT_TRUE(done1);
+        EXPECT_EQ(RESOLV_CACHE_FOUND, entries[0].status);
+        EXPECT_EQ(RESOLV_CACHE_NOTFOUND, entries[1].status);
+        EXPECT_EQ(RESOLV_CACHE_NOTFOUND, entries[2].status);
+
+        // ce2 is answered and ce3 fails. Neither releases the waiters before the other is done.
+        std::this_thread::sleep_for(100ms);
+        std::copy(ce2.answer.begin(), ce2.answer.end(), answers[1].begin());
+        entries[1].answerlen = ce2.answer.size();
+        done2 = true;
+        resolv_cache_add_batch(TEST_NETID, entries, 0);
+    });
+    std::this_thread::sleep_for(100ms);
+    done1 = true;
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    // Let the batch register its own request.
+    std::this_thread::sleep_for(50ms);
+
+    std::vector<std::thread> threads;
+    for (const CacheEntry* ce : {&ce2, &ce3}) {
+        threads.emplace_back([&, ce]() {
+            const bool answered = ce == &ce2;
+            EXPECT_TRUE(cacheLookup(answered ? RESOLV_CACHE_FOUND : RESOLV_CACHE_NOTFOUND,
+                                    TEST_NETID, *ce));
+            EXPECT_TRUE(done2);
+        });
+    }
+
+    batch.join();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
 TEST_F(ResolvCacheTest, MaxEntries) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     std::vector<CacheEntry> ces;
@@ -581,6 +1597,143 @@ TEST_F(ResolvCacheTest, MaxEntries) {
     }
 }
 
+TEST_F(ResolvCacheTest, MaxBytes) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    aidl::android::net::ResolverOptionsParcel options;
+    options.cacheMaxBytes = -1;
+    EXPECT_EQ(-EINVAL, resolv_set_options(TEST_NETID, options));
+
+    // A larger budget lets the cache hold more than the default number of entries.
+    options.cacheMaxBytes = 4 * MAX_ENTRIES * 512;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < 2 * MAX_ENTRIES; i++) {
+        std::string qname = fmt::format("cache.{:04d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        ces.emplace_back(ce);
+    }
+    for (const CacheEntry& ce : ces) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    }
+
+    // Shrinking the budget evicts the least recently used entries right away.
+    options.cacheMaxBytes = MAX_ENTRIES * 512 / 4;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ces[0]));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ces.back()));
+}
+
+TEST_F(ResolvCacheTest, GlobalCeilingShared) {
+    constexpr int kMaxBytes = 8 * 1024 * 1024;
+    aidl::android::net::ResolverOptionsParcel options;
+    options.cacheMaxBytes = kMaxBytes;
+    for (const uint32_t netId : {TEST_NETID, TEST_NETID_2}) {
+        EXPECT_EQ(0, cacheCreate(netId));
+        EXPECT_EQ(0, resolv_set_options(netId, options));
+    }
+    // Answers of 64 A records, so that the bytes run out before the entries do.
+    const auto makeLargeEntry = [this](const std::string& qname) {
+        CacheEntry ce = makeCacheEntry(QUERY, qname.c_str(), ns_c_in, ns_t_a, "1.2.3.4");
+        test::DNSHeader header;
+        header.read(reinterpret_cast<const char*>(ce.query.data()),
+                    reinterpret_cast<const char*>(ce.query.data()) + ce.query.size());
+        for (int i = 0; i < 64; i++) {
+            test::DNSRecord record{
+                    .name = {.name = header.questions[0].qname.name},
+                    .rtype = ns_t_a,
+                    .rclass = ns_c_in,
+                    .ttl = 10,
+            };
+            test::DNSResponder::fillRdata(fmt::format("10.0.0.{}", i), record);
+            header.answers.push_back(std::move(record));
+        }
+        char answer[MAXPACKET] = {};
+        ce.answer.assign(answer, header.write(answer, answer + sizeof(answer)));
+        return ce;
+    };
+
+    // The first network takes up all the bytes the ceiling allows...
+    const size_t entryBytes = makeLargeEntry("cache.0000").answer.size();
+    const int entries = kMaxBytes / entryBytes + 1;
+    for (int i = 0; i < entries; i++) {
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, makeLargeEntry(fmt::format("cache.{:04d}", i))));
+    }
+
+    // ...and the second one still keeps what it adds, up to its share of them, rather than
+    // evicting its own entries for each new one.
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < 100; i++) {
+        ces.push_back(makeLargeEntry(fmt::format("other.{:04d}", i)));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID_2, ces.back()));
+    }
+    for (const CacheEntry& ce : ces) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce));
+    }
+
+    // The first network, over its share, makes room under the ceiling with its own entries.
+    const CacheEntry last = makeLargeEntry("cache.last");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, last));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, last));
+    for (const CacheEntry& ce : ces) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce));
+    }
+}
+
+TEST_F(ResolvCacheTest, TtlPolicy) {
+    fakeTime = 1000s;
+    resolv_cache_set_clock(fakeClock);
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    aidl::android::net::ResolverOptionsParcel options;
+    options.cacheMinTtlSec = 10;
+    options.cacheMaxTtlSec = 5;
+    EXPECT_EQ(-EINVAL, resolv_set_options(TEST_NETID, options));
+    options.cacheMaxTtlSec = -1;
+    EXPECT_EQ(-EINVAL, resolv_set_options(TEST_NETID, options));
+    options.cacheMaxTtlSec = 0;
+    options.cacheLowTtlStretch = -1;
+    EXPECT_EQ(-EINVAL, resolv_set_options(TEST_NETID, options));
+
+    // Stretched from 2s to at most 5s, floored to 3s, and capped to 100s.
+    options.cacheMinTtlSec = 3;
+    options.cacheMaxTtlSec = 100;
+    options.cacheLowTtlSec = 5;
+    options.cacheLowTtlStretch = 4;
+    EXPECT_EQ(0, resolv_set_options(TEST_NETID, options));
+    const CacheEntry stretched =
+            makeCacheEntry(QUERY, "stretched.ttl", ns_c_in, ns_t_a, "1.2.3.4", 2s);
+    const CacheEntry floored = makeCacheEntry(QUERY, "floored.ttl", ns_c_in, ns_t_a, "1.2.3.4", 0s);
+    const CacheEntry capped = makeCacheEntry(QUERY, "capped.ttl", ns_c_in, ns_t_a, "1.2.3.4", 1h);
+    for (const CacheEntry* ce : {&stretched, &floored, &capped}) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, *ce));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, *ce));
+    }
+
+    fakeTime = 1002s + 500ms;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, stretched));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, floored));
+    fakeTime = 1004s;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, stretched));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, floored));
+    cacheQueryFailed(TEST_NETID, floored, 0);
+    fakeTime = 1005s;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, stretched));
+    cacheQueryFailed(TEST_NETID, stretched, 0);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, capped));
+    fakeTime = 1100s;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, capped));
+    cacheQueryFailed(TEST_NETID, capped, 0);
+
+    android::net::DnsCacheStats stats;
+    ASSERT_TRUE(resolv_cache_get_stats_report(TEST_NETID, &stats));
+    EXPECT_EQ(1, stats.ttl_stretched());
+    EXPECT_EQ(1, stats.ttl_floored());
+    EXPECT_EQ(1, stats.ttl_capped());
+
+    resolv_cache_set_clock(nullptr);
+}
+
 TEST_F(ResolvCacheTest, CacheFull) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
 
@@ -617,6 +1770,137 @@ TEST_F(ResolvCacheTest, CacheFull) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce1));
 }
 
+TEST_F(ResolvCacheTest, FlatTable) {
+    {
+        // The table layout is chosen when the cache is created.
+        ScopedSystemProperties flatTable("persist.device_config.netd_native.cache_flat_table", "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    CacheEntry hot = makeCacheEntry(QUERY, "cache.hot", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, hot));
+    std::vector<CacheEntry> ces;
+    for (int i = 1; i < MAX_ENTRIES; i++) {
+        std::string qname = fmt::format("cache.{:04d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        ces.emplace_back(ce);
+    }
+
+    // Overfill the cache while keeping one entry referenced. CLOCK eviction gives the
+    // referenced entry a second chance, so it outlives the ones nobody looked up.
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        std::string qname = fmt::format("cache.overfilled.{:04d}", i);
+        SCOPED_TRACE(qname);
+        if (i % 16 == 0) EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, hot));
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, hot));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ces[0]));
+
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, hot));
+}
+
+TEST_F(ResolvCacheTest, Admission) {
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.cache_admission", "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    // Fill the cache with names looked up three times each.
+    std::vector<CacheEntry> popular;
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        std::string qname = fmt::format("cache.{:04d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+        popular.emplace_back(ce);
+    }
+
+    // Names looked up once don't push them out, unlike with LRU alone (see MaxEntries). The few
+    // whose counts collide with those of popular names may get in.
+    int admitted = 0;
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        std::string qname = fmt::format("scan.{:04d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        std::chrono::milliseconds expiration;
+        if (cacheGetExpiration(TEST_NETID, ce.query, &expiration) == 0) admitted++;
+    }
+    EXPECT_LE(admitted, MAX_ENTRIES / 100);
+    int evicted = 0;
+    for (const CacheEntry& ce : popular) {
+        std::chrono::milliseconds expiration;
+        if (cacheGetExpiration(TEST_NETID, ce.query, &expiration) != 0) evicted++;
+    }
+    EXPECT_LE(evicted, admitted);
+
+    // A name looked up more often than the oldest entry replaces it.
+    CacheEntry ce = makeCacheEntry(QUERY, "cache.new", ns_c_in, ns_t_a, "1.2.3.4");
+    for (int i = 0; i < 5; i++) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+        cacheQueryFailed(TEST_NETID, ce, 0);
+    }
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+}
+
+TEST_F(ResolvCacheTest, Snapshot) {
+    TemporaryDir snapshotDir;
+    resolv_cache_set_snapshot_dir(snapshotDir.path);
+    const std::string path = fmt::format("{}/{}", snapshotDir.path, TEST_NETID);
+    ScopedSystemProperties snapshot("persist.device_config.netd_native.cache_snapshot", "1");
+    android::net::Experiments::getInstance()->update();
+
+    CacheEntry ce1 = makeCacheEntry(QUERY, "cache.0000", ns_c_in, ns_t_a, "1.2.3.4", 100s);
+    CacheEntry ce2 = makeCacheEntry(QUERY, "cache.0001", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce2));
+    EXPECT_EQ(0, resolv_cache_write_snapshot(TEST_NETID));
+
+    // Deleting the network also deletes its snapshot, so keep a copy to simulate a restart.
+    std::string image;
+    ASSERT_TRUE(android::base::ReadFileToString(path, &image));
+    cacheDelete(TEST_NETID);
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+    ASSERT_TRUE(android::base::WriteStringToFile(image, path));
+    std::this_thread::sleep_for(1500ms);
+
+    // Expired entries are dropped, and the others come back with the TTL they have left.
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    int anslen = 0;
+    std::vector<uint8_t> answer(MAXPACKET);
+    EXPECT_EQ(RESOLV_CACHE_FOUND,
+              resolv_cache_lookup(TEST_NETID, ce1.query, answer, &anslen, 0));
+    answer.resize(anslen);
+    EXPECT_EQ(ce1.answer.size(), answer.size());
+    ns_msg handle;
+    ns_rr rr;
+    ASSERT_EQ(0, ns_initparse(answer.data(), answer.size(), &handle));
+    ASSERT_EQ(0, ns_parserr(&handle, ns_s_an, 0, &rr));
+    EXPECT_LT(ns_rr_ttl(rr), 100U);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce2));
+    cacheQueryFailed(TEST_NETID, ce2, 0);
+
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+
+    android::net::Experiments::getInstance()->update();
+}
+
 TEST_F(ResolvCacheTest, ResolverSetup) {
     const SetupParams setup = {
             .servers = {"127.0.0.1", "::127.0.0.2", "fe80::3"},
@@ -735,6 +2019,44 @@ TEST_F(ResolvCacheTest, GetStats) {
     expectCacheStats("GetStats", TEST_NETID, cacheStats);
 }
 
+TEST_F(ResolvCacheTest, GetStatsReport) {
+    fakeTime = 1000s;
+    resolv_cache_set_clock(fakeClock);
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    const CacheEntry ce = makeCacheEntry(QUERY, "stats.example", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    fakeTime = 1001s;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    cacheQueryFailed(TEST_NETID, ce, 0);
+
+    android::net::DnsCacheStats stats;
+    ASSERT_TRUE(resolv_cache_get_stats_report(TEST_NETID, &stats));
+    EXPECT_EQ(2, stats.hits());
+    EXPECT_EQ(2, stats.misses());
+    EXPECT_EQ(1, stats.expired());
+    EXPECT_EQ(1, stats.evicted_expired());
+    EXPECT_EQ(0, stats.evicted_capacity());
+    // The answer is less than 64 bytes.
+    ASSERT_EQ(8, stats.answer_size_buckets_size());
+    EXPECT_EQ(1, stats.answer_size_buckets(0));
+    // One in 16 lookups is counted, so the 4 of them are counted as 16 or not at all.
+    ASSERT_GE(1, stats.top_query_counts_size());
+    if (stats.top_query_counts_size() == 1) EXPECT_EQ(16, stats.top_query_counts(0));
+    EXPECT_EQ(0, stats.entries());
+
+    // At most once an hour.
+    EXPECT_FALSE(resolv_cache_get_stats_report(TEST_NETID, &stats));
+    fakeTime = 1001s + 1h;
+    EXPECT_TRUE(resolv_cache_get_stats_report(TEST_NETID, &stats));
+    EXPECT_FALSE(resolv_cache_get_stats_report(TEST_NETID + 1, &stats));
+
+    resolv_cache_set_clock(nullptr);
+}
+
 TEST_F(ResolvCacheTest, FlushCache) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     const SetupParams setup = {
@@ -766,6 +2088,144 @@ TEST_F(ResolvCacheTest, FlushCache) {
     expectCacheStats("FlushCache: no record in cache stats", TEST_NETID, cacheStats_empty);
 }
 
+TEST_F(ResolvCacheTest, FlushCache_Refill) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        std::string qname = fmt::format("cache.{:04d}", i);
+        ces.emplace_back(makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4"));
+    }
+
+    // Entries added after a flush reuse the cache memory and must come back intact.
+    for (int round = 0; round < 3; round++) {
+        SCOPED_TRACE(fmt::format("round {}", round));
+        for (const CacheEntry& ce : ces) {
+            EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        }
+        for (const CacheEntry& ce : ces) {
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+        }
+        EXPECT_EQ(0, cacheFlush(TEST_NETID));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ces[0]));
+        cacheQueryFailed(TEST_NETID, ces[0], 0);
+    }
+}
+
+TEST_F(ResolvCacheTest, FlushCache_Generations) {
+    for (const char* flatTable : {"0", "1"}) {
+        SCOPED_TRACE(fmt::format("flat table {}", flatTable));
+        ScopedSystemProperties sp("persist.device_config.netd_native.cache_generations", "1");
+        ScopedSystemProperties flat("persist.device_config.netd_native.cache_flat_table",
+                                    flatTable);
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        std::vector<CacheEntry> ces;
+        for (int i = 0; i < MAX_ENTRIES; i++) {
+            std::string qname = fmt::format("cache.{:04d}", i);
+            ces.emplace_back(makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4"));
+            EXPECT_EQ(0, cacheAdd(TEST_NETID, ces.back()));
+        }
+        resolv_cache_add_addrinfo(TEST_NETID, "key", {CachedAddrInfo{}}, 300);
+
+        // The flush leaves the entries in place, but they can no longer be found.
+        EXPECT_EQ(0, cacheFlush(TEST_NETID));
+        std::vector<CachedAddrInfo> addrs;
+        EXPECT_FALSE(resolv_cache_lookup_addrinfo(TEST_NETID, "key", &addrs));
+        char domain[NS_MAXDNAME];
+        EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain, sizeof(domain),
+                                                     "1.2.3.4", AF_INET));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ces[0]));
+        cacheQueryFailed(TEST_NETID, ces[0], 0);
+
+        // New entries take their keys and their place.
+        const CacheEntry replaced = makeCacheEntry(QUERY, "cache.0000", ns_c_in, ns_t_a, "5.6.7.8");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, replaced));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, replaced));
+        for (int i = 1; i < MAX_ENTRIES; i++) {
+            std::string qname = fmt::format("new.{:04d}", i);
+            ces[i] = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+            EXPECT_EQ(0, cacheAdd(TEST_NETID, ces[i]));
+        }
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, replaced));
+        for (int i = 1; i < MAX_ENTRIES; i++) {
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ces[i])) << i;
+        }
+        cacheDelete(TEST_NETID);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, AddrInfoCache) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    CachedAddrInfo cached = {.family = AF_INET, .socktype = SOCK_STREAM, .protocol = IPPROTO_TCP};
+    sockaddr_in sin = {.sin_family = AF_INET};
+    ASSERT_EQ(1, inet_pton(AF_INET, "1.2.3.4", &sin.sin_addr));
+    memcpy(&cached.addr, &sin, sizeof(sin));
+    cached.addrlen = sizeof(sin);
+    cached.canonname = "hello.example.com";
+
+    std::vector<CachedAddrInfo> addrs;
+    EXPECT_FALSE(resolv_cache_lookup_addrinfo(TEST_NETID, "key", &addrs));
+    // Nothing is kept without a TTL.
+    resolv_cache_add_addrinfo(TEST_NETID, "key", {cached}, 0);
+    EXPECT_FALSE(resolv_cache_lookup_addrinfo(TEST_NETID, "key", &addrs));
+
+    resolv_cache_add_addrinfo(TEST_NETID, "key", {cached}, 10);
+    ASSERT_TRUE(resolv_cache_lookup_addrinfo(TEST_NETID, "key", &addrs));
+    ASSERT_EQ(1U, addrs.size());
+    EXPECT_EQ(AF_INET, addrs[0].family);
+    EXPECT_EQ(sizeof(sin), addrs[0].addrlen);
+    EXPECT_EQ(0, memcmp(&sin, &addrs[0].addr, sizeof(sin)));
+    EXPECT_EQ("hello.example.com", addrs[0].canonname);
+    EXPECT_FALSE(resolv_cache_lookup_addrinfo(TEST_NETID, "other", &addrs));
+    EXPECT_FALSE(resolv_cache_lookup_addrinfo(TEST_NETID + 1, "key", &addrs));
+
+    // Results resolved with the old servers are dropped along with the DNS cache.
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    EXPECT_FALSE(resolv_cache_lookup_addrinfo(TEST_NETID, "key", &addrs));
+
+    resolv_cache_add_addrinfo(TEST_NETID, "key", {cached}, 10);
+    const SetupParams setup = {
+            .servers = {"127.0.0.1"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    EXPECT_FALSE(resolv_cache_lookup_addrinfo(TEST_NETID, "key", &addrs));
+
+    resolv_cache_add_addrinfo(TEST_NETID, "key", {cached}, 1);
+    EXPECT_TRUE(resolv_cache_lookup_addrinfo(TEST_NETID, "key", &addrs));
+    std::this_thread::sleep_for(2000ms);
+    EXPECT_FALSE(resolv_cache_lookup_addrinfo(TEST_NETID, "key", &addrs));
+}
+
+TEST_F(ResolvCacheTest, SrcAddrCache) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    CachedSrcAddr cached = {.reachable = 1};
+    cached.addr.ss_family = AF_INET6;
+
+    CachedSrcAddr result;
+    EXPECT_FALSE(resolv_cache_lookup_src_addr(TEST_NETID, "key", &result));
+    resolv_cache_add_src_addr(TEST_NETID, "key", cached);
+    ASSERT_TRUE(resolv_cache_lookup_src_addr(TEST_NETID, "key", &result));
+    EXPECT_EQ(1, result.reachable);
+    EXPECT_EQ(AF_INET6, result.addr.ss_family);
+    EXPECT_FALSE(resolv_cache_lookup_src_addr(TEST_NETID + 1, "key", &result));
+
+    // Network changes reach the resolver as new configurations.
+    const SetupParams setup = {
+            .servers = {"127.0.0.1"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    EXPECT_FALSE(resolv_cache_lookup_src_addr(TEST_NETID, "key", &result));
+
+    resolv_cache_add_src_addr(TEST_NETID, "key", cached);
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    EXPECT_FALSE(resolv_cache_lookup_src_addr(TEST_NETID, "key", &result));
+}
+
 TEST_F(ResolvCacheTest, GetHostByAddrFromCache_InvalidArgs) {
     char domain_name[NS_MAXDNAME] = {};
     const char query_v4[] = "1.2.3.5";
@@ -845,6 +2305,43 @@ TEST_F(ResolvCacheTest, GetHostByAddrFromCache) {
     EXPECT_STREQ(answer, domain_name);
 }
 
+TEST_F(ResolvCacheTest, GetHostByAddrFromCache_Evicted) {
+    char domain_name[NS_MAXDNAME] = {};
+    const char query_v4[] = "1.2.3.5";
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // The entry added last wins when several hold the same address.
+    CacheEntry ce1 = makeCacheEntry(QUERY, "first.in.cache", ns_c_in, ns_t_a, query_v4);
+    CacheEntry ce2 = makeCacheEntry(QUERY, "second.in.cache", ns_c_in, ns_t_a, query_v4);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce2));
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                AF_INET));
+    EXPECT_STREQ("second.in.cache", domain_name);
+
+    // Evict both entries by filling up the cache.
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        std::string qname = fmt::format("cache.{:04d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+    memset(domain_name, 0, NS_MAXDNAME);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                 AF_INET));
+    EXPECT_STREQ("", domain_name);
+
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                AF_INET));
+    EXPECT_STREQ("first.in.cache", domain_name);
+
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    memset(domain_name, 0, NS_MAXDNAME);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                 AF_INET));
+}
+
 TEST_F(ResolvCacheTest, GetResolverStats) {
     const res_sample sample1 = {.at = time(nullptr), .rtt = 100, .rcode = ns_r_noerror};
     const res_sample sample2 = {.at = time(nullptr), .rtt = 200, .rcode = ns_r_noerror};
@@ -904,6 +2401,111 @@ TEST_F(ResolvCacheTest, GetResolverStats) {
     }
 }
 
+TEST_F(ResolvCacheTest, GetResolverStats_LazyMerge) {
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.stats_lazy_merge", "1");
+        android::net::Experiments::getInstance()->update();
+        const res_sample sample = {.at = time(nullptr), .rtt = 100, .rcode = ns_r_noerror};
+        std::vector<IPSockAddr> nameserverSockAddrs = {
+                IPSockAddr::toIPSockAddr("127.0.0.1", DNS_PORT),
+        };
+        const SetupParams setup = {
+                .servers = {"127.0.0.1"},
+                .domains = {"domain1.com"},
+                .params = kParams,
+        };
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+
+        // Samples from many threads all make it in.
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; i++) {
+            threads.emplace_back([&] {
+                for (int j = 0; j < 100; j++) {
+                    cacheAddStats(TEST_NETID, 1 /*revision_id*/, nameserverSockAddrs[0], sample,
+                                  setup.params.max_samples);
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+
+        // Reporting the stats merges whatever is pending.
+        int nscount = -1;
+        sockaddr_storage servers[MAXNS];
+        int dcount = -1;
+        char domains[MAXDNSRCH][MAXDNSRCHPATH];
+        res_stats stats[MAXNS]{};
+        res_params params;
+        int timeouts;
+        EXPECT_EQ(1, android_net_res_stats_get_info_for_net(TEST_NETID, &nscount, servers, &dcount,
+                                                            domains, &params, stats, &timeouts));
+        EXPECT_EQ(setup.params.max_samples, stats[0].sample_count);
+
+        // Queries see a sample once it's been pending for long enough.
+        cacheAddStats(TEST_NETID, 1, nameserverSockAddrs[0], sample, setup.params.max_samples);
+        std::this_thread::sleep_for(300ms);
+        res_stats cacheStats[MAXNS]{};
+        EXPECT_EQ(1, resolv_cache_get_resolver_stats(TEST_NETID, &params, cacheStats,
+                                                     nameserverSockAddrs));
+        EXPECT_EQ((stats[0].sample_next + 1) % setup.params.max_samples,
+                  cacheStats[0].sample_next);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
+TEST_F(ResolvCacheTest, GetResolverStats_KeptAcrossSetup) {
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.keep_nameserver_stats", "1");
+        android::net::Experiments::getInstance()->update();
+        const res_sample sample1 = {.at = time(nullptr), .rtt = 100, .rcode = ns_r_noerror};
+        const res_sample sample2 = {.at = time(nullptr), .rtt = 200, .rcode = ns_r_noerror};
+        const IPSockAddr server1 = IPSockAddr::toIPSockAddr("127.0.0.1", DNS_PORT);
+        const IPSockAddr server2 = IPSockAddr::toIPSockAddr("::127.0.0.2", DNS_PORT);
+        const IPSockAddr server3 = IPSockAddr::toIPSockAddr("fe80::3", DNS_PORT);
+        SetupParams setup = {
+                .servers = {"127.0.0.1", "::127.0.0.2"},
+                .domains = {"domain1.com"},
+                .params = kParams,
+        };
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+        res_stats cacheStats[MAXNS]{};
+        res_params params;
+        const int revision_id = resolv_cache_get_resolver_stats(TEST_NETID, &params, cacheStats,
+                                                                {server1, server2});
+        cacheAddStats(TEST_NETID, revision_id, server1, sample1, setup.params.max_samples);
+        cacheAddStats(TEST_NETID, revision_id, server2, sample2, setup.params.max_samples);
+
+        // The servers in a new order, one of them dropped and another added.
+        setup.servers = {"fe80::3", "::127.0.0.2"};
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+        const res_stats expectedStats[MAXNS] = {
+                {{}, 0 /*sample_count*/, 0 /*sample_next*/},
+                {{sample2}, 1, 1},
+        };
+        const std::vector<IPSockAddr> servers = {server3, server2};
+        EXPECT_EQ(revision_id,
+                  resolv_cache_get_resolver_stats(TEST_NETID, &params, cacheStats, servers));
+        for (size_t i = 0; i < MAXNS; i++) {
+            EXPECT_TRUE(cacheStats[i] == expectedStats[i]) << i;
+        }
+
+        // Samples of queries sent before the change still count.
+        cacheAddStats(TEST_NETID, revision_id, server2, sample1, setup.params.max_samples);
+        EXPECT_EQ(revision_id,
+                  resolv_cache_get_resolver_stats(TEST_NETID, &params, cacheStats, servers));
+        EXPECT_EQ(2, cacheStats[1].sample_count);
+
+        // New parameters for the samples do clear them.
+        setup.params.max_samples++;
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+        EXPECT_EQ(revision_id + 1,
+                  resolv_cache_get_resolver_stats(TEST_NETID, &params, cacheStats, servers));
+        EXPECT_EQ(0, cacheStats[1].sample_count);
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
 namespace {
 
 constexpr int EAI_OK = 0;
@@ -22,10 +22,13 @@
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/result.h>
+#include <android-base/strings.h>
 #include <gmock/gmock-matchers.h>
 #include <gtest/gtest.h>
 
+#include "Experiments.h"
 #include "PrivateDnsConfiguration.h"
+#include "QueryTrace.h"
 #include "getaddrinfo.h"
 #include "gethnamaddr.h"
 #include "golddata.pb.h"
@@ -41,6 +44,7 @@ namespace android::net {
 
 using android::base::Result;
 using android::netdutils::ScopedAddrinfo;
+using std::chrono::microseconds;
 using std::chrono::milliseconds;
 
 enum class DnsProtocol { CLEARTEXT, TLS };
@@ -454,4 +458,191 @@ TEST_P(ResolvGoldTest, GoldData) {
     VerifyResolver(goldtest, dns, tls, protocol);
 }
 
+// Replays a trace of lookups with the cache telling the time from the trace, so that a day of
+// lookups takes as long as the resolver needs to serve them. Reports the cache hit ratio, the
+// queries sent upstream per second of the trace, and the time lookups spent in each stage, to
+// compare cache policies such as eviction, prefetch or serve-stale on the same lookups. The trace
+// is a ReplayTrace .pb file named by RESOLV_GOLD_TRACE, or else made up. RESOLV_GOLD_TRACE_FLAGS
+// sets experiment flags, as in "cache_prefetch=1,cache_flat_table=1", and
+// RESOLV_GOLD_SERVE_STALE_SEC enables serve-stale.
+class ResolvTraceReplay : public TestBase {
+  protected:
+    // Lookups of names of a Zipf-like popularity, each with a TTL of its own, about 5 a second.
+    static ReplayTrace MakeTrace() {
+        constexpr int kHosts = 2000;
+        constexpr int kLookups = 20000;
+        constexpr uint32_t kTtls[] = {30, 300, 3600};
+        std::mt19937 rng(1);
+        std::vector<double> weights(kHosts);
+        for (int i = 0; i < kHosts; i++) weights[i] = 1.0 / (i + 1);
+        std::discrete_distribution<int> pickHost(weights.begin(), weights.end());
+        std::exponential_distribution<double> gapMs(1.0 / 200);
+
+        ReplayTrace trace;
+        double timeMs = 0;
+        for (int i = 0; i < kLookups; i++) {
+            timeMs += gapMs(rng);
+            const int host = pickHost(rng);
+            ReplayTrace::Lookup* lookup = trace.add_lookups();
+            lookup->set_time_ms(static_cast<uint64_t>(timeMs));
+            lookup->set_host(fmt::format("host{}.example.com", host));
+            lookup->set_family(host % 4 == 0 ? GT_AF_UNSPEC : GT_AF_INET);
+            lookup->set_ttl(kTtls[host % std::size(kTtls)]);
+        }
+        return trace;
+    }
+
+    static Result<ReplayTrace> LoadTrace(const std::string& path) {
+        std::string content;
+        if (!android::base::ReadFileToString(path, &content)) {
+            return Errorf("Read {} failed: {}", path, strerror(errno));
+        }
+        ReplayTrace trace;
+        if (!trace.ParseFromString(content)) return Errorf("Parse {} failed", path);
+        return trace;
+    }
+
+    // Answers the lookups of |trace| with the TTL of the first lookup of each name.
+    static void SetupMappings(const ReplayTrace& trace, test::DNSResponder& dns) {
+        std::set<std::string> mapped;
+        for (const auto& lookup : trace.lookups()) {
+            const std::string name = lookup.host().ends_with('.') ? lookup.host()
+                                                                  : lookup.host() + ".";
+            if (!mapped.insert(name).second) continue;
+            for (const auto& [type, addr] : {std::pair{ns_type::ns_t_a, "192.0.2.1"},
+                                             std::pair{ns_type::ns_t_aaaa, "2001:db8::1"}}) {
+                test::DNSHeader header(kDefaultDnsHeader);
+                header.questions.push_back({.qname = {.name = name}, .qtype = type,
+                                            .qclass = ns_c_in});
+                test::DNSRecord record{
+                        .name = {.name = name},
+                        .rtype = type,
+                        .rclass = ns_c_in,
+                        .ttl = lookup.ttl(),
+                };
+                ASSERT_TRUE(test::DNSResponder::fillRdata(addr, record));
+                header.answers.push_back(std::move(record));
+                dns.addMappingDnsHeader(name, type, header);
+            }
+        }
+    }
+};
+
+// What the caches take to be the time while a trace is replayed: when the current lookup was made.
+static std::atomic<milliseconds> sReplayTime;
+
+// Not a pass/fail test: logs and records the results as test properties.
+TEST_F(ResolvTraceReplay, Replay) {
+    std::vector<std::unique_ptr<ScopedSystemProperties>> flags;
+    flags.push_back(std::make_unique<ScopedSystemProperties>(
+            "persist.device_config.netd_native.query_stage_tracing", "1"));
+    if (const char* env = getenv("RESOLV_GOLD_TRACE_FLAGS"); env != nullptr) {
+        for (const std::string& flag : android::base::Split(env, ",")) {
+            const std::vector<std::string> kv = android::base::Split(flag, "=");
+            ASSERT_EQ(2U, kv.size()) << "Bad flag: " << flag;
+            flags.push_back(std::make_unique<ScopedSystemProperties>(
+                    "persist.device_config.netd_native." + kv[0], kv[1]));
+        }
+    }
+    Experiments::getInstance()->update();
+
+    ReplayTrace trace;
+    if (const char* path = getenv("RESOLV_GOLD_TRACE"); path != nullptr) {
+        Result<ReplayTrace> loaded = LoadTrace(path);
+        ASSERT_TRUE(loaded.ok()) << loaded.error().message();
+        trace = std::move(loaded.value());
+    } else {
+        trace = MakeTrace();
+    }
+    ASSERT_GT(trace.lookups_size(), 0);
+
+    test::DNSResponder dns(test::DNSResponder::MappingType::DNS_HEADER);
+    ASSERT_NO_FATAL_FAILURE(SetupMappings(trace, dns));
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_NO_FATAL_FAILURE(SetResolvers());
+    if (const char* env = getenv("RESOLV_GOLD_SERVE_STALE_SEC"); env != nullptr) {
+        aidl::android::net::ResolverOptionsParcel options;
+        options.serveStaleSec = atoi(env);
+        ASSERT_EQ(0, resolv_set_options(TEST_NETID, options));
+    }
+    dns.clearQueries();
+
+    const milliseconds start = resolv_cache_now();
+    sReplayTime = start;
+    resolv_cache_set_clock([]() { return sReplayTime.load(); });
+    size_t hits = 0;
+    size_t errors = 0;
+    std::vector<int64_t> latencies;
+    latencies.reserve(trace.lookups_size());
+    std::array<microseconds, kQueryStageCount> stages{};
+    for (const auto& lookup : trace.lookups()) {
+        sReplayTime = start + milliseconds(lookup.time_ms());
+        const addrinfo hints = {.ai_family = lookup.family(), .ai_socktype = SOCK_DGRAM};
+        addrinfo* res = nullptr;
+        NetworkDnsEventReported event;
+        ScopedQueryTrace scopedTrace;
+        const auto before = std::chrono::steady_clock::now();
+        const int rv = resolv_getaddrinfo(lookup.host().c_str(), nullptr, &hints, &kNetcontext,
+                                          &res, &event);
+        latencies.push_back(std::chrono::duration_cast<microseconds>(
+                                    std::chrono::steady_clock::now() - before)
+                                    .count());
+        ScopedAddrinfo result(res);
+        if (rv != 0) errors++;
+
+        const auto& queries = event.dns_query_events().dns_query_event();
+        if (!queries.empty() && std::all_of(queries.begin(), queries.end(), [](const auto& q) {
+                return q.cache_hit() == CS_FOUND;
+            })) {
+            hits++;
+        }
+        if (const QueryTrace* queryTrace = QueryTrace::current(); queryTrace != nullptr) {
+            for (size_t i = 0; i < kQueryStageCount; i++) {
+                stages[i] += std::chrono::duration_cast<microseconds>(
+                        queryTrace->get(static_cast<QueryStage>(i)));
+            }
+        }
+    }
+    resolv_cache_set_clock(nullptr);
+
+    const size_t lookups = trace.lookups_size();
+    const size_t upstream = dns.queries().size();
+    const double traceSec =
+            std::max(1.0, trace.lookups(trace.lookups_size() - 1).time_ms() / 1000.0);
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double p) {
+        return latencies[static_cast<size_t>((latencies.size() - 1) * p)];
+    };
+    const double hitRatio = static_cast<double>(hits) / lookups;
+
+    RecordProperty("lookups", lookups);
+    RecordProperty("errors", errors);
+    RecordProperty("hit_ratio", fmt::format("{:.3f}", hitRatio));
+    RecordProperty("upstream_queries", upstream);
+    RecordProperty("upstream_qps", fmt::format("{:.2f}", upstream / traceSec));
+    RecordProperty("prefetches", resolv_cache_get_prefetch_count(TEST_NETID));
+    RecordProperty("p50_us", percentile(0.5));
+    RecordProperty("p99_us", percentile(0.99));
+    LOG(INFO) << fmt::format(
+            "{} lookups over {:.0f}s: {} errors, hit ratio {:.3f}, {} upstream queries ({:.2f} "
+            "qps), {} prefetches, p50 {}us, p99 {}us",
+            lookups, traceSec, errors, hitRatio, upstream,
+            upstream / traceSec, resolv_cache_get_prefetch_count(TEST_NETID), percentile(0.5),
+            percentile(0.99));
+
+    static constexpr const char* kStageNames[] = {
+            "cache_lookup", "pending_wait", "query_build", "socket_setup", "upstream_wait",
+            "parse",        "sort",         "dns64",       "response_write",
+    };
+    static_assert(std::size(kStageNames) == kQueryStageCount);
+    for (size_t i = 0; i < kQueryStageCount; i++) {
+        const int64_t average = stages[i].count() / static_cast<int64_t>(lookups);
+        RecordProperty(fmt::format("{}_avg_us", kStageNames[i]), average);
+        LOG(INFO) << fmt::format("{}: {}us per lookup", kStageNames[i], average);
+    }
+
+    flags.clear();
+    Experiments::getInstance()->update();
+}
+
 }  // namespace android::net
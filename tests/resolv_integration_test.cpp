@@ -20,6 +20,7 @@
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/result.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <android/multinetwork.h>  // ResNsendFlags
 #include <arpa/inet.h>
@@ -48,9 +49,11 @@
 #include <algorithm>
 #include <chrono>
 #include <iterator>
+#include <map>
 #include <numeric>
 #include <thread>
 #include <unordered_set>
+#include <variant>
 
 #include <DnsProxydProtocol.h>  // NETID_USE_LOCAL_NAMESERVERS
 #include <aidl/android/net/IDnsResolver.h>
@@ -79,6 +82,10 @@ constexpr int TEST_VPN_NETID = 65502;
 constexpr int MAXPACKET = (8 * 1024);
 
 const std::string kSortNameserversFlag("persist.device_config.netd_native.sort_nameservers");
+const std::string kDns64ParallelDiscoveryFlag(
+        "persist.device_config.netd_native.dns64_parallel_discovery");
+const std::string kDns64RaPrefixPreferredFlag(
+        "persist.device_config.netd_native.dns64_ra_prefix_preferred");
 const std::string kDotConnectTimeoutMsFlag(
         "persist.device_config.netd_native.dot_connect_timeout_ms");
 const std::string kDotAsyncHandshakeFlag("persist.device_config.netd_native.dot_async_handshake");
@@ -93,6 +100,13 @@ const std::string kDotValidationLatencyFactorFlag(
 const std::string kDotValidationLatencyOffsetMsFlag(
         "persist.device_config.netd_native.dot_validation_latency_offset_ms");
 const std::string kDotQuickFallbackFlag("persist.device_config.netd_native.dot_quick_fallback");
+const std::string kDotCleartextRaceFlag("persist.device_config.netd_native.dot_cleartext_race");
+const std::string kCacheAggressiveNsecFlag(
+        "persist.device_config.netd_native.cache_aggressive_nsec");
+const std::string kDotValidationReuseConnectionFlag(
+        "persist.device_config.netd_native.dot_validation_reuse_connection");
+const std::string kMdnsParallelGroupsFlag(
+        "persist.device_config.netd_native.mdns_parallel_groups");
 // Semi-public Bionic hook used by the NDK (frameworks/base/native/android/net.c)
 // Tested here for convenience.
 extern "C" int android_getaddrinfofornet(const char* hostname, const char* servname,
@@ -1905,6 +1919,30 @@ TEST_F(ResolverTest, GetHostByName_Tls) {
     EXPECT_EQ("1.2.3.3", ToString(result));
 }
 
+// Verifies that with the flag set, the first query goes over the connection validation opened.
+TEST_F(ResolverTest, GetHostByName_TlsReusesValidationConnection) {
+    constexpr char listen_addr[] = "127.0.0.3";
+    constexpr char host_name[] = "tls1.example.com.";
+    ScopedSystemProperties sp(kDotValidationReuseConnectionFlag, "1");
+    resetNetwork();
+
+    test::DNSResponder dns;
+    StartDns(dns, {{host_name, ns_type::ns_t_a, "1.2.3.1"}});
+    test::DnsTlsFrontend tls(listen_addr, "853", listen_addr, "53");
+    ASSERT_TRUE(tls.startServer());
+    ASSERT_TRUE(mDnsClient.SetResolversWithTls({listen_addr}, kDefaultSearchDomains,
+                                               kDefaultParams, ""));
+    EXPECT_TRUE(WaitForPrivateDnsValidation(tls.listen_address(), true));
+    EXPECT_TRUE(tls.waitForQueries(1));
+    EXPECT_EQ(1, tls.acceptConnectionsCount());
+
+    const hostent* result = gethostbyname("tls1");
+    ASSERT_FALSE(result == nullptr);
+    EXPECT_EQ("1.2.3.1", ToString(result));
+    EXPECT_TRUE(tls.waitForQueries(2));
+    EXPECT_EQ(1, tls.acceptConnectionsCount());
+}
+
 TEST_F(ResolverTest, GetHostByName_TlsFailover) {
     constexpr char listen_addr1[] = "127.0.0.3";
     constexpr char listen_addr2[] = "127.0.0.4";
@@ -4188,6 +4226,69 @@ TEST_F(ResolverTest, SetAndClearNat64Prefix) {
     EXPECT_EQ(0, sUnsolicitedEventListener->getUnexpectedNat64PrefixUpdates());
 }
 
+TEST_F(ResolverTest, Nat64PrefixDiscoveryRacesNameservers) {
+    ScopedSystemProperties sp(kDns64ParallelDiscoveryFlag, "1");
+    constexpr char listen_addr0[] = "127.0.0.7";
+    constexpr char listen_addr1[] = "127.0.0.8";
+    const std::vector<DnsRecord> records = {
+            {"ipv4only.arpa.", ns_type::ns_t_aaaa, "64:ff9b::192.0.0.170"},
+            {"v4only.example.com.", ns_type::ns_t_a, "1.2.3.4"},
+    };
+
+    // The first nameserver never answers, which would hold up a discovery asking one nameserver
+    // after the other for longer than WaitForNat64Prefix() waits.
+    test::DNSResponder dns0(listen_addr0);
+    test::DNSResponder dns1(listen_addr1);
+    dns0.setResponseProbability(0.0);
+    StartDns(dns0, records);
+    StartDns(dns1, records);
+    // Re-setup test network to make experiment flag take effect.
+    resetNetwork();
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr0, listen_addr1}));
+
+    EXPECT_TRUE(mDnsClient.resolvService()->startPrefix64Discovery(TEST_NETID).isOk());
+    EXPECT_TRUE(WaitForNat64Prefix(EXPECT_FOUND));
+    EXPECT_EQ(1U, GetNumQueries(dns0, "ipv4only.arpa."));
+    EXPECT_EQ(1U, GetNumQueries(dns1, "ipv4only.arpa."));
+
+    const addrinfo hints = {.ai_family = AF_INET6};
+    ScopedAddrinfo result = safe_getaddrinfo("v4only.example.com", nullptr, &hints);
+    ASSERT_FALSE(result == nullptr);
+    EXPECT_EQ("64:ff9b::102:304", ToString(result));
+
+    EXPECT_TRUE(mDnsClient.resolvService()->stopPrefix64Discovery(TEST_NETID).isOk());
+    EXPECT_TRUE(WaitForNat64Prefix(EXPECT_NOT_FOUND));
+}
+
+TEST_F(ResolverTest, RaNat64PrefixStopsDiscovery) {
+    ScopedSystemProperties sp(kDns64RaPrefixPreferredFlag, "1");
+    constexpr char listen_addr[] = "::1";
+    // No ipv4only.arpa. record, so that the discovery keeps on retrying.
+    test::DNSResponder dns(listen_addr);
+    StartDns(dns, {{"v4.example.com.", ns_type::ns_t_a, "1.2.3.4"}});
+    resetNetwork();
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr}));
+    auto resolvService = mDnsClient.resolvService();
+
+    EXPECT_TRUE(resolvService->startPrefix64Discovery(TEST_NETID).isOk());
+    // A PREF64 option from a Router Advertisement (RFC 8781) is taken over the discovery.
+    EXPECT_TRUE(resolvService->setPrefix64(TEST_NETID, kNat64Prefix).isOk());
+    std::string prefix;
+    EXPECT_TRUE(resolvService->getPrefix64(TEST_NETID, &prefix).isOk());
+    EXPECT_EQ(kNat64Prefix, prefix);
+
+    const addrinfo hints = {.ai_family = AF_INET6};
+    ScopedAddrinfo result = safe_getaddrinfo("v4.example.com", nullptr, &hints);
+    ASSERT_FALSE(result == nullptr);
+    EXPECT_EQ("64:ff9b::102:304", ToString(result));
+
+    // The discovery doesn't try again.
+    dns.clearQueries();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    EXPECT_EQ(0U, GetNumQueries(dns, "ipv4only.arpa."));
+    EXPECT_TRUE(resolvService->setPrefix64(TEST_NETID, "").isOk());
+}
+
 namespace {
 
 class ScopedSetNetworkForProcess {
@@ -4232,6 +4333,99 @@ int readResponseCode(int fd) {
     return result;
 }
 
+// Reads exactly |len| bytes from |fd|.
+bool readFully(int fd, void* buf, size_t len) {
+    auto* p = static_cast<uint8_t*>(buf);
+    while (len > 0) {
+        const ssize_t rc = TEMP_FAILURE_RETRY(read(fd, p, len));
+        if (rc <= 0) return false;
+        p += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+struct BatchResult {
+    int32_t rv = -1;
+    std::vector<std::string> addrs;
+};
+
+// The client side of the getaddrinfobatch command: looks up |hosts| in one go, and returns their
+// results in the same order.
+std::vector<BatchResult> getaddrinfoBatch(unsigned netId, const std::vector<std::string>& hosts,
+                                          int family) {
+    std::vector<BatchResult> results(hosts.size());
+    unique_fd fd(dns_open_proxy());
+    EXPECT_TRUE(fd > 0);
+    std::string cmd = fmt::format("getaddrinfobatch ^ -1 {} -1 -1 {}", family, netId);
+    for (const auto& host : hosts) cmd += " " + host;
+    sendCommand(fd, cmd);
+    EXPECT_EQ(ResponseCode::DnsProxyQueryResult, readResponseCode(fd));
+
+    for (size_t i = 0; i < hosts.size(); i++) {
+        const uint32_t index = readBE32(fd);
+        const int32_t rv = readBE32(fd);
+        if (index >= hosts.size()) {
+            ADD_FAILURE() << "bad index " << index;
+            break;
+        }
+        results[index].rv = rv;
+        if (rv != 0) continue;
+        while (readBE32(fd) == 1) {
+            int32_t fields[4];  // ai_flags, ai_family, ai_socktype, ai_protocol
+            EXPECT_TRUE(readFully(fd, fields, sizeof(fields)));
+            sockaddr_storage addr = {};
+            const int32_t addrLen = readBE32(fd);
+            if (addrLen > static_cast<int32_t>(sizeof(addr)) || !readFully(fd, &addr, addrLen)) {
+                ADD_FAILURE() << "bad address of length " << addrLen;
+                return results;
+            }
+            std::vector<char> canonName(readBE32(fd));
+            EXPECT_TRUE(readFully(fd, canonName.data(), canonName.size()));
+            results[index].addrs.push_back(ToString(&addr));
+        }
+    }
+    return results;
+}
+
+// Reads the data of a length-prefixed field of a hostent, which is empty at the end of a list.
+std::string readLenAndData(int fd) {
+    std::string data(readBE32(fd), '\0');
+    EXPECT_TRUE(readFully(fd, data.data(), data.size()));
+    if (!data.empty()) data.pop_back();  // The terminating NUL.
+    return data;
+}
+
+// The client side of the gethostbyaddrbatch command: looks up |addrs| in one go, and returns the
+// name each one is found to have, or the error code, in the same order.
+std::vector<std::variant<int32_t, std::string>> gethostbyaddrBatch(
+        unsigned netId, const std::vector<std::string>& addrs) {
+    std::vector<std::variant<int32_t, std::string>> results(addrs.size(), -1);
+    unique_fd fd(dns_open_proxy());
+    EXPECT_TRUE(fd > 0);
+    sendCommand(fd, fmt::format("gethostbyaddrbatch {} {}", netId, fmt::join(addrs, ",")));
+    EXPECT_EQ(ResponseCode::DnsProxyQueryResult, readResponseCode(fd));
+
+    for (size_t i = 0; i < addrs.size(); i++) {
+        const uint32_t index = readBE32(fd);
+        const int32_t rv = readBE32(fd);
+        if (index >= addrs.size()) {
+            ADD_FAILURE() << "bad index " << index;
+            break;
+        }
+        results[index] = rv;
+        if (rv != 0) continue;
+        results[index] = readLenAndData(fd);
+        while (!readLenAndData(fd).empty()) {
+        }
+        readBE32(fd);  // h_addrtype
+        readBE32(fd);  // h_length
+        while (!readLenAndData(fd).empty()) {
+        }
+    }
+    return results;
+}
+
 bool checkAndClearUseLocalNameserversFlag(unsigned* netid) {
     if (netid == nullptr || ((*netid) & NETID_USE_LOCAL_NAMESERVERS) == 0) {
         return false;
@@ -4343,6 +4537,181 @@ TEST_F(ResolverTest, getDnsNetId) {
     EXPECT_EQ(500, readResponseCode(fd));
 }
 
+TEST_F(ResolverTest, GetAddrInfoBatch) {
+    constexpr char listen_addr[] = "127.0.0.4";
+    constexpr int kHosts = 5;
+    test::DNSResponder dns(listen_addr);
+    StartDns(dns, {});
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr}));
+
+    std::vector<std::string> hosts;
+    for (int i = 0; i < kHosts; i++) {
+        hosts.push_back(fmt::format("batch{}.example.com", i));
+        dns.addMapping(hosts.back() + ".", ns_type::ns_t_a, fmt::format("1.2.3.{}", i));
+    }
+    hosts.push_back("nonexistent.example.com");
+
+    const auto results = getaddrinfoBatch(TEST_NETID, hosts, AF_INET);
+    ASSERT_EQ(hosts.size(), results.size());
+    for (int i = 0; i < kHosts; i++) {
+        EXPECT_EQ(0, results[i].rv) << hosts[i];
+        EXPECT_EQ(std::vector<std::string>{fmt::format("1.2.3.{}", i)}, results[i].addrs);
+        EXPECT_EQ(1U, GetNumQueries(dns, (hosts[i] + ".").c_str()));
+    }
+    EXPECT_NE(0, results[kHosts].rv);
+    EXPECT_TRUE(results[kHosts].addrs.empty());
+}
+
+TEST_F(ResolverTest, GetHostByAddrBatch) {
+    constexpr char listen_addr[] = "127.0.0.4";
+    constexpr int kAddrs = 5;
+    test::DNSResponder dns(listen_addr);
+    StartDns(dns, {});
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr}));
+
+    std::vector<std::string> addrs;
+    for (int i = 0; i < kAddrs; i++) {
+        addrs.push_back(fmt::format("192.0.2.{}", i + 1));
+        dns.addMapping(fmt::format("{}.2.0.192.in-addr.arpa.", i + 1), ns_type::ns_t_ptr,
+                       fmt::format("batch{}.example.com.", i));
+    }
+    addrs.push_back("192.0.2.100");
+
+    auto results = gethostbyaddrBatch(TEST_NETID, addrs);
+    ASSERT_EQ(addrs.size(), results.size());
+    for (int i = 0; i < kAddrs; i++) {
+        EXPECT_EQ(fmt::format("batch{}.example.com", i), std::get<std::string>(results[i]));
+    }
+    EXPECT_NE(0, std::get<int32_t>(results[kAddrs]));
+
+    // Answered from the cache the second time.
+    dns.clearQueries();
+    results = gethostbyaddrBatch(TEST_NETID, addrs);
+    for (int i = 0; i < kAddrs; i++) {
+        EXPECT_EQ(fmt::format("batch{}.example.com", i), std::get<std::string>(results[i]));
+        const std::string ptr = fmt::format("{}.2.0.192.in-addr.arpa.", i + 1);
+        EXPECT_EQ(0U, GetNumQueries(dns, ptr.c_str())) << dns.dumpQueries();
+    }
+
+    // Malformed addresses fail the whole command.
+    unique_fd fd(dns_open_proxy());
+    sendCommand(fd, fmt::format("gethostbyaddrbatch {} 192.0.2.1,bad", TEST_NETID));
+    EXPECT_EQ(ResponseCode::CommandParameterError, readResponseCode(fd));
+}
+
+TEST_F(ResolverTest, ResNSendTagged) {
+    constexpr char listen_addr[] = "127.0.0.4";
+    constexpr char host_name[] = "howdy.example.com.";
+    // This is raw data of query "howdy.example.com" type 1 class 1
+    constexpr char query[] = "81sBAAABAAAAAAAABWhvd2R5B2V4YW1wbGUDY29tAAABAAE=";
+    constexpr uint32_t kQueries = 5;
+    constexpr uint32_t kBadTag = 100;
+    test::DNSResponder dns(listen_addr);
+    StartDns(dns, {{host_name, ns_type::ns_t_a, "1.2.3.4"}});
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr}));
+
+    // All queries go out on one socket before any answer is read.
+    unique_fd fd(dns_open_proxy());
+    ASSERT_TRUE(fd > 0);
+    for (uint32_t tag = 0; tag < kQueries; tag++) {
+        sendCommand(fd, fmt::format("resnsendtagged {} {} {} {}", tag, TEST_NETID,
+                                    ANDROID_RESOLV_NO_CACHE_LOOKUP, query));
+    }
+    sendCommand(fd, fmt::format("resnsendtagged {} {} 0 16-52512#", kBadTag, TEST_NETID));
+    sendCommand(fd, "resnsendtagged notatag 0 0 x");
+
+    std::map<uint32_t, int32_t> results;
+    for (uint32_t i = 0; i < kQueries + 2; i++) {
+        const uint32_t tag = readBE32(fd);
+        const int32_t rcodeOrError = readBE32(fd);
+        results[tag] = rcodeOrError;
+        if (rcodeOrError < 0) continue;
+        std::vector<uint8_t> answer(readBE32(fd));
+        ASSERT_TRUE(readFully(fd, answer.data(), answer.size()));
+        EXPECT_EQ("1.2.3.4", toString(answer.data(), answer.size(), AF_INET));
+    }
+    for (uint32_t tag = 0; tag < kQueries; tag++) EXPECT_EQ(ns_r_noerror, results[tag]) << tag;
+    EXPECT_EQ(-EILSEQ, results[kBadTag]);
+    EXPECT_EQ(-EINVAL, results[DNSPROXYD_INVALID_TAG]);
+    EXPECT_EQ(kQueries, GetNumQueries(dns, host_name));
+}
+
+namespace {
+
+std::vector<uint8_t> resNSendFrame(uint32_t tag, uint32_t netId, uint32_t flags,
+                                   const std::vector<uint8_t>& query) {
+    std::vector<uint8_t> frame = {DNSPROXYD_RESNSEND_FRAME_MAGIC, 0, uint8_t(query.size() >> 8),
+                                  uint8_t(query.size())};
+    for (const uint32_t field : {tag, netId, flags}) {
+        frame.insert(frame.end(), {uint8_t(field >> 24), uint8_t(field >> 16),
+                                   uint8_t(field >> 8), uint8_t(field)});
+    }
+    frame.insert(frame.end(), query.begin(), query.end());
+    return frame;
+}
+
+void sendFrames(int fd, const std::vector<uint8_t>& frames) {
+    EXPECT_EQ(static_cast<ssize_t>(frames.size()),
+              TEMP_FAILURE_RETRY(write(fd, frames.data(), frames.size())));
+}
+
+}  // namespace
+
+TEST_F(ResolverTest, ResNSendFramed) {
+    constexpr char listen_addr[] = "127.0.0.4";
+    constexpr char host_name[] = "howdy.example.com.";
+    // The query "howdy.example.com" type 1 class 1.
+    const std::vector<uint8_t> query = {0xf3, 0x5b, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+                                        0x00, 0x00, 0x00, 5,    'h',  'o',  'w',  'd',  'y',
+                                        7,    'e',  'x',  'a',  'm',  'p',  'l',  'e',  3,
+                                        'c',  'o',  'm',  0,    0x00, 0x01, 0x00, 0x01};
+    constexpr uint32_t kQueries = 5;
+    constexpr uint32_t kBadQueryTag = 100;
+    test::DNSResponder dns(listen_addr);
+    StartDns(dns, {{host_name, ns_type::ns_t_a, "1.2.3.4"}});
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr}));
+
+    unique_fd fd(dns_open_proxy());
+    ASSERT_TRUE(fd > 0);
+    // Several frames in one write, then one frame split across two.
+    std::vector<uint8_t> frames;
+    for (uint32_t tag = 0; tag < kQueries - 1; tag++) {
+        const auto frame = resNSendFrame(tag, TEST_NETID, ANDROID_RESOLV_NO_CACHE_LOOKUP, query);
+        frames.insert(frames.end(), frame.begin(), frame.end());
+    }
+    const auto bad = resNSendFrame(kBadQueryTag, TEST_NETID, 0, {1, 2, 3});
+    frames.insert(frames.end(), bad.begin(), bad.end());
+    sendFrames(fd, frames);
+    const auto split =
+            resNSendFrame(kQueries - 1, TEST_NETID, ANDROID_RESOLV_NO_CACHE_LOOKUP, query);
+    sendFrames(fd, {split.begin(), split.begin() + 6});
+    std::this_thread::sleep_for(50ms);
+    sendFrames(fd, {split.begin() + 6, split.end()});
+
+    std::map<uint32_t, int32_t> results;
+    for (uint32_t i = 0; i < kQueries + 1; i++) {
+        const uint32_t tag = readBE32(fd);
+        const int32_t rcodeOrError = readBE32(fd);
+        results[tag] = rcodeOrError;
+        if (rcodeOrError < 0) continue;
+        std::vector<uint8_t> answer(readBE32(fd));
+        ASSERT_TRUE(readFully(fd, answer.data(), answer.size()));
+        EXPECT_EQ("1.2.3.4", toString(answer.data(), answer.size(), AF_INET));
+    }
+    for (uint32_t tag = 0; tag < kQueries; tag++) EXPECT_EQ(ns_r_noerror, results[tag]) << tag;
+    EXPECT_EQ(-EINVAL, results[kBadQueryTag]);
+    EXPECT_EQ(kQueries, GetNumQueries(dns, host_name));
+
+    // A frame that's too long is answered, and closes the socket.
+    sendFrames(fd, resNSendFrame(kBadQueryTag, TEST_NETID, 0,
+                                 std::vector<uint8_t>(DNSPROXYD_MAX_FRAMED_QUERY + 1)));
+    EXPECT_EQ(kBadQueryTag, static_cast<uint32_t>(readBE32(fd)));
+    EXPECT_EQ(-EINVAL, readBE32(fd));
+    // The rest of the frame was never read, so the socket may be reset rather than shut down.
+    uint8_t byte;
+    EXPECT_GE(0, TEMP_FAILURE_RETRY(read(fd, &byte, 1)));
+}
+
 // TODO(b/219434602): find an alternative way to block DNS packets on T+.
 TEST_F(ResolverTest, BlockDnsQueryWithUidRule) {
     if (android::modules::sdklevel::IsAtLeastT()) GTEST_SKIP() << "T+ device.";
@@ -5093,6 +5462,129 @@ TEST_F(ResolverTest, DotQuickFallback) {
     }
 }
 
+// Verifies that in opportunistic mode, a slow DoT server is raced by the cleartext one.
+TEST_F(ResolverTest, DotCleartextRace) {
+    constexpr int DOT_DELAY_MS = 2000;
+    const std::string addr = getUniqueIPv4Address();
+    test::DNSResponder dns(addr);
+    test::DnsTlsFrontend dot(addr, "853", addr, "53");
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_aaaa, kHelloExampleComAddrV6);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_TRUE(dot.startServer());
+
+    ScopedSystemProperties sp(kDotCleartextRaceFlag, "1");
+    resetNetwork();
+    auto parcel = DnsResponderClient::GetDefaultResolverParamsParcel();
+    parcel.servers = {addr};
+    parcel.tlsServers = {addr};
+    ASSERT_TRUE(mDnsClient.SetResolversFromParcel(parcel));
+    EXPECT_TRUE(WaitForPrivateDnsValidation(dot.listen_address(), true));
+    EXPECT_TRUE(dot.waitForQueries(1));
+    dot.clearQueries();
+    dns.clearQueries();
+
+    // The DoT server holds its answer, waiting for a second query that doesn't come.
+    dot.setDelayQueries(2);
+    dot.setDelayQueriesTimeout(DOT_DELAY_MS);
+
+    Stopwatch s;
+    int fd = resNetworkQuery(TEST_NETID, kHelloExampleCom, ns_c_in, ns_t_aaaa,
+                             ANDROID_RESOLV_NO_CACHE_LOOKUP);
+    expectAnswersValid(fd, AF_INET6, kHelloExampleComAddrV6);
+    EXPECT_LT(s.timeTakenUs() / 1000, DOT_DELAY_MS);
+    // The query went over DoT, then over cleartext, whose answer won. The DoT server forwards it
+    // to the same backend, which sees both.
+    EXPECT_TRUE(dot.waitForQueries(1));
+    EXPECT_EQ(2U, GetNumQueries(dns, kHelloExampleCom));
+
+    // Let the DoT answer come before the next test.
+    std::this_thread::sleep_for(std::chrono::milliseconds(DOT_DELAY_MS));
+}
+
+// Verifies that a validated answer won by the cleartext query of a DoT race isn't trusted as a
+// private DNS one, so its NSEC records aren't used to synthesize NXDOMAIN answers.
+TEST_F(ResolverTest, DotCleartextRace_NoNsecFromCleartext) {
+    constexpr int DOT_DELAY_MS = 2000;
+    const auto wireName = [](const std::string& name) {
+        std::vector<char> wire;
+        for (const std::string& label : android::base::Split(name, ".")) {
+            if (label.empty()) continue;
+            wire.push_back(label.size());
+            wire.insert(wire.end(), label.begin(), label.end());
+        }
+        wire.push_back(0);
+        return wire;
+    };
+    const auto nsec = [&](const std::string& owner, const std::string& next,
+                          const std::vector<char>& bitmap) {
+        test::DNSRecord record{
+                .name = {.name = owner}, .rtype = ns_t_nsec, .rclass = ns_c_in, .ttl = 600};
+        record.rdata = wireName(next);
+        record.rdata.insert(record.rdata.end(), bitmap.begin(), bitmap.end());
+        return record;
+    };
+
+    // b.example. doesn't exist: the NSEC at a.example. covers it and c.example., and the one at
+    // the apex covers the wildcard *.example.
+    test::DNSHeader header;
+    header.qr = true;
+    header.ad = true;
+    header.rcode = ns_r_nxdomain;
+    header.questions.push_back(
+            {.qname = {.name = "b.example."}, .qtype = ns_t_a, .qclass = ns_c_in});
+    test::DNSRecord soa{.name = {.name = "example."}, .rtype = ns_t_soa, .rclass = ns_c_in,
+                        .ttl = 300};
+    soa.rdata = wireName("ns.example.");
+    const std::vector<char> rname = wireName("admin.example.");
+    soa.rdata.insert(soa.rdata.end(), rname.begin(), rname.end());
+    // Serial, refresh, retry, expire and a 300s minimum TTL.
+    const std::vector<char> soaTimers = {0, 0, 0, 1, 0, 0, 0x0e, 0x10, 0, 0, 0x0e, 0x10,
+                                         0, 0, 0x0e, 0x10, 0, 0, 0x01, 0x2c};
+    soa.rdata.insert(soa.rdata.end(), soaTimers.begin(), soaTimers.end());
+    header.authorities.push_back(std::move(soa));
+    header.authorities.push_back(nsec("a.example.", "d.example.", {0, 1, 0x40}));
+    header.authorities.push_back(nsec("example.", "a.example.", {0, 1, 0x22}));
+
+    const std::string addr = getUniqueIPv4Address();
+    test::DNSResponder dns(addr, test::kDefaultListenService, test::kDefaultErrorCode,
+                           test::DNSResponder::MappingType::DNS_HEADER);
+    test::DnsTlsFrontend dot(addr, "853", addr, "53");
+    dns.addMappingDnsHeader("b.example.", ns_t_a, header);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_TRUE(dot.startServer());
+
+    ScopedSystemProperties sp1(kDotCleartextRaceFlag, "1");
+    ScopedSystemProperties sp2(kCacheAggressiveNsecFlag, "1");
+    resetNetwork();
+    auto parcel = DnsResponderClient::GetDefaultResolverParamsParcel();
+    parcel.servers = {addr};
+    parcel.tlsServers = {addr};
+    ASSERT_TRUE(mDnsClient.SetResolversFromParcel(parcel));
+    EXPECT_TRUE(WaitForPrivateDnsValidation(dot.listen_address(), true));
+    EXPECT_TRUE(dot.waitForQueries(1));
+    dot.clearQueries();
+    dns.clearQueries();
+
+    dot.setDelayQueries(2);
+    dot.setDelayQueriesTimeout(DOT_DELAY_MS);
+
+    // The cleartext query wins the race.
+    Stopwatch s;
+    int fd = resNetworkQuery(TEST_NETID, "b.example", ns_c_in, ns_t_a, 0);
+    int rcode = -1;
+    uint8_t buf[MAXPACKET] = {};
+    EXPECT_GT(getAsyncResponse(fd, &rcode, buf, MAXPACKET), 0);
+    EXPECT_EQ(ns_r_nxdomain, rcode);
+    EXPECT_LT(s.timeTakenUs() / 1000, DOT_DELAY_MS);
+
+    // c.example. isn't answered from the NSEC records in the cache.
+    fd = resNetworkQuery(TEST_NETID, "c.example", ns_c_in, ns_t_a, 0);
+    getAsyncResponse(fd, &rcode, buf, MAXPACKET);
+    EXPECT_LE(1U, GetNumQueries(dns, "c.example."));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(DOT_DELAY_MS));
+}
+
 TEST_F(ResolverTest, FlushNetworkCache) {
     SKIP_IF_REMOTE_VERSION_LESS_THAN(mDnsClient.resolvService(), 4);
     test::DNSResponder dns;
@@ -5941,6 +6433,222 @@ TEST_F(ResolverTest, KeepListeningUDP) {
     EXPECT_TRUE(result_str == "::1.2.3.4") << ", result_str='" << result_str << "'";
 }
 
+TEST_F(ResolverTest, UdpSocketPool) {
+    constexpr char listen_addr1[] = "127.0.0.4";
+    constexpr char listen_addr2[] = "127.0.0.5";
+    const std::vector<DnsRecord> records = {
+            {"first.example.com.", ns_type::ns_t_a, "1.1.1.1"},
+            {"second.example.com.", ns_type::ns_t_a, "2.2.2.2"},
+    };
+    const std::vector<int> params = {300, 25, 8, 8, 1000 /* BASE_TIMEOUT_MSEC */,
+                                     1 /* retry count */};
+
+    // |delayedDns| answers after the query timed out, which the resolver then gets on a socket
+    // it has given back to the pool.
+    test::DNSResponder delayedDns(listen_addr1);
+    delayedDns.setResponseDelayMs(1500);
+    StartDns(delayedDns, records);
+    test::DNSResponder dns(listen_addr2);
+    StartDns(dns, records);
+    ScopedSystemProperties scopedSystemProperties(
+            "persist.device_config.netd_native.udp_socket_pool", "1");
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr1, listen_addr2},
+                                                  kDefaultSearchDomains, params));
+
+    const addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    ScopedAddrinfo result = safe_getaddrinfo("first.example.com", nullptr, &hints);
+    EXPECT_EQ("1.1.1.1", ToString(result));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    // The late answer must not be taken for the answer to a later query.
+    result = safe_getaddrinfo("second.example.com", nullptr, &hints);
+    EXPECT_EQ("2.2.2.2", ToString(result));
+    for (int i = 0; i < 10; i++) {
+        const std::string hostName = fmt::format("pooled{}.example.com.", i);
+        dns.addMapping(hostName, ns_type::ns_t_a, "3.3.3.3");
+        delayedDns.addMapping(hostName, ns_type::ns_t_a, "3.3.3.3");
+        result = safe_getaddrinfo(hostName.c_str(), nullptr, &hints);
+        EXPECT_EQ("3.3.3.3", ToString(result));
+    }
+}
+
+TEST_F(ResolverTest, HedgedQueries) {
+    constexpr char listen_addr1[] = "127.0.0.4";
+    constexpr char listen_addr2[] = "127.0.0.5";
+    constexpr int DNS_TIMEOUT_MS = 2000;
+    constexpr int HEDGE_DELAY_MS = 500;  // No latency stats yet, so the default delay is used.
+    constexpr int TIMING_TOLERANCE_MS = 200;
+    const std::vector<int> params = {300, 25, 8, 8, DNS_TIMEOUT_MS /* BASE_TIMEOUT_MSEC */,
+                                     1 /* retry count */};
+
+    test::DNSResponder neverRespondDns(listen_addr1, "53", static_cast<ns_rcode>(-1));
+    neverRespondDns.setResponseProbability(0.0);
+    StartDns(neverRespondDns, {});
+    test::DNSResponder dns(listen_addr2);
+    StartDns(dns, {});
+
+    for (const bool hedged : {false, true}) {
+        SCOPED_TRACE(fmt::format("hedged: {}", hedged));
+        ScopedSystemProperties sp("persist.device_config.netd_native.hedged_queries",
+                                  hedged ? "1" : "0");
+        resetNetwork();
+        ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr1, listen_addr2},
+                                                      kDefaultSearchDomains, params));
+        const std::string hostName = fmt::format("hedged{}.example.com.", hedged);
+        dns.addMapping(hostName, ns_type::ns_t_a, "1.2.3.4");
+
+        const addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+        auto [result, timeTakenMs] = safe_getaddrinfo_time_taken(hostName.c_str(), nullptr, hints);
+        EXPECT_EQ("1.2.3.4", ToString(result));
+        EXPECT_NEAR(hedged ? HEDGE_DELAY_MS : DNS_TIMEOUT_MS, timeTakenMs, TIMING_TOLERANCE_MS);
+        EXPECT_EQ(1U, GetNumQueries(neverRespondDns, hostName.c_str()));
+        EXPECT_EQ(1U, GetNumQueries(dns, hostName.c_str()));
+    }
+}
+
+TEST_F(ResolverTest, UdpReactor) {
+    constexpr char listen_addr1[] = "127.0.0.4";
+    constexpr char listen_addr2[] = "127.0.0.5";
+    constexpr int DNS_TIMEOUT_MS = 1000;
+    constexpr int TIMING_TOLERANCE_MS = 200;
+    constexpr int kQueries = 20;
+    const std::vector<int> params = {300, 25, 8, 8, DNS_TIMEOUT_MS /* BASE_TIMEOUT_MSEC */,
+                                     1 /* retry count */};
+
+    test::DNSResponder neverRespondDns(listen_addr1, "53", static_cast<ns_rcode>(-1));
+    neverRespondDns.setResponseProbability(0.0);
+    StartDns(neverRespondDns, {});
+    test::DNSResponder dns(listen_addr2);
+    StartDns(dns, {});
+    ScopedSystemProperties sp("persist.device_config.netd_native.udp_reactor", "1");
+    resetNetwork();
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr1, listen_addr2},
+                                                  kDefaultSearchDomains, params));
+
+    // Every query times out on the first server, from the reactor thread, and then gets its
+    // answer from the second one.
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kQueries; i++) {
+        const std::string hostName = fmt::format("reactor{}.example.com.", i);
+        dns.addMapping(hostName, ns_type::ns_t_a, "1.2.3.4");
+        threads.emplace_back([hostName]() {
+            const addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+            auto [result, timeTakenMs] =
+                    safe_getaddrinfo_time_taken(hostName.c_str(), nullptr, hints);
+            EXPECT_EQ("1.2.3.4", ToString(result));
+            EXPECT_NEAR(DNS_TIMEOUT_MS, timeTakenMs, TIMING_TOLERANCE_MS);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ(static_cast<size_t>(kQueries), dns.queries().size());
+}
+
+TEST_F(ResolverTest, BatchedLookup) {
+    constexpr char listen_addr1[] = "127.0.0.4";
+    constexpr char listen_addr2[] = "127.0.0.5";
+    constexpr char host_name[] = "batched.example.com.";
+    constexpr int DNS_TIMEOUT_MS = 1000;
+    constexpr int TIMING_TOLERANCE_MS = 200;
+    const std::vector<DnsRecord> records = {
+            {host_name, ns_type::ns_t_a, "1.2.3.4"},
+            {host_name, ns_type::ns_t_aaaa, "::1.2.3.4"},
+    };
+    const std::vector<int> params = {300, 25, 8, 8, DNS_TIMEOUT_MS /* BASE_TIMEOUT_MSEC */,
+                                     1 /* retry count */};
+
+    test::DNSResponder neverRespondDns(listen_addr1, "53", static_cast<ns_rcode>(-1));
+    neverRespondDns.setResponseProbability(0.0);
+    StartDns(neverRespondDns, records);
+    test::DNSResponder dns(listen_addr2);
+    StartDns(dns, records);
+    ScopedSystemProperties sp("persist.device_config.netd_native.batched_lookup", "1");
+    resetNetwork();
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr1, listen_addr2},
+                                                  kDefaultSearchDomains, params));
+
+    // Both queries time out together on the first server, and are answered by the second.
+    const addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+    auto [result, timeTakenMs] = safe_getaddrinfo_time_taken(host_name, nullptr, hints);
+    EXPECT_THAT(ToStrings(result), testing::UnorderedElementsAreArray({"1.2.3.4", "::1.2.3.4"}));
+    EXPECT_NEAR(DNS_TIMEOUT_MS, timeTakenMs, TIMING_TOLERANCE_MS);
+    EXPECT_EQ(2U, GetNumQueries(neverRespondDns, host_name));
+    EXPECT_EQ(2U, GetNumQueries(dns, host_name));
+
+    // The answers were cached.
+    result = safe_getaddrinfo(host_name, nullptr, &hints);
+    EXPECT_THAT(ToStrings(result), testing::UnorderedElementsAreArray({"1.2.3.4", "::1.2.3.4"}));
+    EXPECT_EQ(2U, GetNumQueries(dns, host_name));
+}
+
+TEST_F(ResolverTest, BatchedLookup_HttpsPrefetch) {
+    constexpr char listen_addr[] = "127.0.0.4";
+    constexpr char host_name[] = "h3.example.com.";
+    constexpr auto kHttps = static_cast<ns_type>(65);
+    const std::vector<DnsRecord> records = {
+            {host_name, ns_type::ns_t_a, "1.2.3.4"},
+            {host_name, ns_type::ns_t_aaaa, "::1.2.3.4"},
+    };
+    test::DNSResponder dns(listen_addr);
+    StartDns(dns, records);
+    ScopedSystemProperties batched("persist.device_config.netd_native.batched_lookup", "1");
+    ScopedSystemProperties https("persist.device_config.netd_native.https_prefetch", "1");
+    resetNetwork();
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr}));
+
+    // The HTTPS record is asked for along with the addresses.
+    const addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+    ScopedAddrinfo result = safe_getaddrinfo(host_name, nullptr, &hints);
+    EXPECT_THAT(ToStrings(result), testing::UnorderedElementsAreArray({"1.2.3.4", "::1.2.3.4"}));
+    EXPECT_EQ(1U, GetNumQueriesForType(dns, ns_type::ns_t_a, host_name));
+    EXPECT_EQ(1U, GetNumQueriesForType(dns, ns_type::ns_t_aaaa, host_name));
+    EXPECT_EQ(1U, GetNumQueriesForType(dns, kHttps, host_name));
+
+    // But not on its own once the addresses are cached.
+    result = safe_getaddrinfo(host_name, nullptr, &hints);
+    EXPECT_THAT(ToStrings(result), testing::UnorderedElementsAreArray({"1.2.3.4", "::1.2.3.4"}));
+    EXPECT_EQ(3U, GetNumQueries(dns, host_name));
+}
+
+TEST_F(ResolverTest, AsyncResNSend) {
+    constexpr char listen_addr1[] = "127.0.0.4";
+    constexpr char listen_addr2[] = "127.0.0.5";
+    constexpr int DNS_TIMEOUT_MS = 1000;
+    constexpr int TIMING_TOLERANCE_MS = 200;
+    constexpr int kQueries = 20;
+    const std::vector<int> params = {300, 25, 8, 8, DNS_TIMEOUT_MS /* BASE_TIMEOUT_MSEC */,
+                                     1 /* retry count */};
+
+    test::DNSResponder neverRespondDns(listen_addr1, "53", static_cast<ns_rcode>(-1));
+    neverRespondDns.setResponseProbability(0.0);
+    StartDns(neverRespondDns, {});
+    test::DNSResponder dns(listen_addr2);
+    StartDns(dns, {});
+    ScopedSystemProperties sp("persist.device_config.netd_native.async_resnsend", "1");
+    resetNetwork();
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork({listen_addr1, listen_addr2},
+                                                  kDefaultSearchDomains, params));
+
+    // All queries wait out the first server at once, none of them holding a thread.
+    Stopwatch s;
+    std::vector<int> fds;
+    for (int i = 0; i < kQueries; i++) {
+        const std::string hostName = fmt::format("async{}.example.com.", i);
+        dns.addMapping(hostName, ns_type::ns_t_a, "1.2.3.4");
+        const int fd = resNetworkQuery(TEST_NETID, hostName.c_str(), ns_c_in, ns_t_a, 0);
+        ASSERT_TRUE(fd != -1);
+        fds.push_back(fd);
+    }
+    for (int fd : fds) expectAnswersValid(fd, AF_INET, "1.2.3.4");
+    EXPECT_NEAR(DNS_TIMEOUT_MS, s.timeTakenUs() / 1000, TIMING_TOLERANCE_MS);
+    EXPECT_EQ(static_cast<size_t>(kQueries), dns.queries().size());
+
+    // The answers were cached as usual.
+    dns.clearQueries();
+    expectAnswersValid(resNetworkQuery(TEST_NETID, "async0.example.com.", ns_c_in, ns_t_a, 0),
+                       AF_INET, "1.2.3.4");
+    EXPECT_EQ(0U, dns.queries().size());
+}
+
 TEST_F(ResolverTest, GetAddrInfoParallelLookupTimeout) {
     constexpr char listen_addr[] = "127.0.0.4";
     constexpr char host_name[] = "howdy.example.com.";
@@ -6521,6 +7229,29 @@ TEST_F(ResolverTest, MdnsGetAddrInfo) {
     }
 }
 
+TEST_F(ResolverTest, MdnsGetAddrInfo_parallelGroups) {
+    constexpr char v4addr[] = "127.0.0.3";
+    constexpr char host_name[] = "hello.local.";
+    // Only the responder on the IPv6 group knows the IPv4 address; the other answers SERVFAIL.
+    test::DNSResponder mdnsv4("127.0.0.3", test::kDefaultMdnsListenService);
+    test::DNSResponder mdnsv6("::1", test::kDefaultMdnsListenService);
+    mdnsv6.addMapping(host_name, ns_type::ns_t_a, v4addr);
+    ASSERT_TRUE(mdnsv4.startServer());
+    ASSERT_TRUE(mdnsv6.startServer());
+
+    ScopedSystemProperties sp(kMdnsParallelGroupsFlag, "1");
+    resetNetwork();
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork());
+
+    const addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    ScopedAddrinfo result = safe_getaddrinfo("hello.local", nullptr, &hints);
+    ASSERT_TRUE(result != nullptr);
+    EXPECT_EQ(v4addr, ToString(result));
+    // Both groups were asked the same question.
+    EXPECT_EQ(1U, GetNumQueries(mdnsv4, host_name));
+    EXPECT_EQ(1U, GetNumQueries(mdnsv6, host_name));
+}
+
 TEST_F(ResolverTest, MdnsGetAddrInfo_transportTypes) {
     constexpr char v6addr[] = "::127.0.0.3";
     constexpr char v4addr[] = "127.0.0.3";
@@ -6824,6 +7555,9 @@ class ResolverMultinetworkTest : public ResolverTest {
         Result<DnsServerPair> addIpv4Dns() { return addDns(ConnectivityType::V4); }
         Result<DnsServerPair> addIpv6Dns() { return addDns(ConnectivityType::V6); }
         bool startTunForwarder() { return mTunForwarder->startForwarding(); }
+        // Impairs the packets that go to and come from the server of |pair|.
+        bool impairDns(const DnsServerPair& pair, const TunForwarder::Impairment& toServer,
+                       const TunForwarder::Impairment& fromServer);
         bool setDnsConfiguration() const;
         bool clearDnsConfiguration() const;
         unsigned netId() const { return mNetId; }
@@ -7100,6 +7834,17 @@ Result<ResolverMultinetworkTest::DnsServerPair> ResolverMultinetworkTest::Scoped
     return mDnsServerPairs.emplace_back(std::make_shared<test::DNSResponder>(mNetId, dst2), dst1);
 }
 
+bool ResolverMultinetworkTest::ScopedNetwork::impairDns(
+        const DnsServerPair& pair, const TunForwarder::Impairment& toServer,
+        const TunForwarder::Impairment& fromServer) {
+    // The addresses the packets have before they are translated; see addDns().
+    const bool isV4 = (pair.dnsAddr.find(':') == std::string::npos);
+    const std::string client = isV4 ? makeIpv4AddrString(1) : makeIpv6AddrString(1);
+    return mTunForwarder->setImpairment({client, pair.dnsAddr}, toServer) &&
+           mTunForwarder->setImpairment({pair.dnsServer->listen_address(), pair.dnsAddr},
+                                        fromServer);
+}
+
 bool ResolverMultinetworkTest::ScopedNetwork::setDnsConfiguration() const {
     if (mDnsResolvSrv == nullptr) return false;
     ResolverParamsParcel parcel = DnsResponderClient::GetDefaultResolverParamsParcel();
@@ -7231,6 +7976,36 @@ TEST_F(ResolverMultinetworkTest, NetworkDestroyedDuringQueryInFlight) {
     lookup.join();
 }
 
+TEST_F(ResolverMultinetworkTest, ImpairedLink) {
+    constexpr char host_name[] = "ohayou.example.com.";
+    constexpr std::chrono::milliseconds delay = 200ms;
+
+    ScopedPhysicalNetwork network = CreateScopedPhysicalNetwork(ConnectivityType::V4);
+    ASSERT_RESULT_OK(network.init());
+    const Result<DnsServerPair> dnsPair = network.addIpv4Dns();
+    ASSERT_RESULT_OK(dnsPair);
+    StartDns(*dnsPair->dnsServer, {{host_name, ns_type::ns_t_a, "1.2.3.4"}});
+    ASSERT_TRUE(network.setDnsConfiguration());
+    ASSERT_TRUE(network.startTunForwarder());
+
+    // The delay applies to each direction.
+    ASSERT_TRUE(network.impairDns(*dnsPair, {.delay = delay}, {.delay = delay}));
+    Stopwatch s;
+    int fd = resNetworkQuery(network.netId(), host_name, ns_c_in, ns_t_a, 0);
+    ASSERT_TRUE(fd != -1);
+    expectAnswersValid(fd, AF_INET, "1.2.3.4");
+    EXPECT_GE(s.getTimeAndResetUs(), 2 * std::chrono::microseconds(delay).count());
+
+    // With every query lost, the lookup times out without reaching the server.
+    ASSERT_TRUE(network.impairDns(*dnsPair, {.loss = 1}, {}));
+    dnsPair->dnsServer->clearQueries();
+    EXPECT_TRUE(mDnsClient.resolvService()->flushNetworkCache(network.netId()).isOk());
+    fd = resNetworkQuery(network.netId(), host_name, ns_c_in, ns_t_a, 0);
+    ASSERT_TRUE(fd != -1);
+    expectAnswersNotValid(fd, -ETIMEDOUT);
+    EXPECT_EQ(0U, GetNumQueries(*dnsPair->dnsServer, host_name));
+}
+
 TEST_F(ResolverMultinetworkTest, OneCachePerNetwork) {
     SKIP_IF_REMOTE_VERSION_LESS_THAN(mDnsClient.resolvService(), 4);
     constexpr char host_name[] = "ohayou.example.com.";
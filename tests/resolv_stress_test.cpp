@@ -17,20 +17,43 @@
 
 #define LOG_TAG "resolv_stress_test"
 
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <memory>
+#include <optional>
 #include <thread>
+#include <utility>
+#include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
 #include <gmock/gmock-matchers.h>
 #include <gtest/gtest.h>
 
 #include "ResolverStats.h"
 #include "dns_responder/dns_responder_client_ndk.h"
+#include "dns_responder/dns_tls_frontend.h"
+#include "doh_frontend.h"
 #include "params.h"  // MAX_NS
 #include "resolv_test_utils.h"
 #include "tests/resolv_test_base.h"
 
+using namespace std::chrono_literals;
+
+using android::base::ParseInt;
+using android::base::ParseUint;
 using android::net::ResolverStats;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
 
 class ResolverStressTest : public ResolvTestBase {
   public:
@@ -108,3 +131,436 @@ TEST_F(ResolverStressTest, GetAddrInfoStressTest_100000) {
     const unsigned num_queries = 100;
     ASSERT_NO_FATAL_FAILURE(RunGetAddrInfoStressTest(num_hosts, num_threads, num_queries));
 }
+
+namespace {
+
+// How the load tests run. Each setting can be changed from the environment, so that the tests can
+// be tuned on a device without rebuilding, e.g.
+//   RESOLV_LOAD_QPS=2000 RESOLV_LOAD_THREADS=1,16,64 resolv_stress_test
+//           --gtest_filter='Load/*' --gtest_output=json:/data/local/tmp/load.json
+// The results are recorded as properties of each test in the gtest output.
+//
+// With RESOLV_LOAD_CORES, e.g. RESOLV_LOAD_CORES=1,2,4,8, CoreScaling measures how the throughput
+// of cache hits scales with the number of cores netd may run on. Compare runs with and without
+// the "listener_shards" flag.
+struct LoadConfig {
+    // Queries per second over all the threads, or 0 for as many as they can make.
+    unsigned qps = 0;
+    // The numbers of threads to make queries with, one run each.
+    std::vector<unsigned> threads = {1, 8, 32};
+    // The percentage of queries for names looked up before the run, which the cache answers. The
+    // others are for names that haven't been looked up in a while.
+    unsigned hitPercent = 50;
+    std::chrono::milliseconds duration = 2s;
+    // The numbers of cores to restrict netd to, one run each, for CoreScaling.
+    std::vector<unsigned> cores;
+};
+
+LoadConfig loadConfigFromEnvironment() {
+    LoadConfig config;
+    const auto read = [](const char* name, unsigned* value) {
+        const char* str = getenv(name);
+        if (str != nullptr && !ParseUint(str, value)) ADD_FAILURE() << name << ": " << str;
+    };
+    read("RESOLV_LOAD_QPS", &config.qps);
+    read("RESOLV_LOAD_HIT_PERCENT", &config.hitPercent);
+    unsigned durationMs = config.duration.count();
+    read("RESOLV_LOAD_DURATION_MS", &durationMs);
+    config.duration = std::chrono::milliseconds(durationMs);
+    const auto readList = [](const char* name, std::vector<unsigned>* values) {
+        const char* str = getenv(name);
+        if (str == nullptr) return;
+        values->clear();
+        for (const std::string& value : android::base::Split(str, ",")) {
+            unsigned n = 0;
+            if (!ParseUint(value, &n) || n == 0) {
+                ADD_FAILURE() << name << ": " << str;
+                continue;
+            }
+            values->push_back(n);
+        }
+    };
+    readList("RESOLV_LOAD_THREADS", &config.threads);
+    readList("RESOLV_LOAD_CORES", &config.cores);
+    EXPECT_LE(config.hitPercent, 100U);
+    return config;
+}
+
+// Returns the PID of netd, which hosts the resolver, or std::nullopt if it isn't running.
+std::optional<pid_t> netdPid() {
+    std::unique_ptr<DIR, decltype(&closedir)> proc(opendir("/proc"), closedir);
+    if (proc == nullptr) return std::nullopt;
+    while (const dirent* entry = readdir(proc.get())) {
+        pid_t pid = 0;
+        std::string comm;
+        if (ParseInt(entry->d_name, &pid) &&
+            android::base::ReadFileToString(fmt::format("/proc/{}/comm", pid), &comm) &&
+            android::base::Trim(comm) == "netd") {
+            return pid;
+        }
+    }
+    return std::nullopt;
+}
+
+// Returns the CPU time used so far by netd, or std::nullopt if it can't be read.
+std::optional<microseconds> resolverCpuTime() {
+    const std::optional<pid_t> pid = netdPid();
+    std::string stat;
+    if (!pid || !android::base::ReadFileToString(fmt::format("/proc/{}/stat", *pid), &stat)) {
+        return std::nullopt;
+    }
+    // The fields after the command, which may contain spaces but ends with the last ')', start at
+    // the 3rd. utime and stime are the 14th and 15th.
+    const size_t commEnd = stat.rfind(')');
+    if (commEnd == std::string::npos || commEnd + 2 > stat.size()) return std::nullopt;
+    const std::vector<std::string> fields = android::base::Split(stat.substr(commEnd + 2), " ");
+    uint64_t utime = 0;
+    uint64_t stime = 0;
+    if (fields.size() < 13 || !ParseUint(fields[11], &utime) || !ParseUint(fields[12], &stime)) {
+        return std::nullopt;
+    }
+    return microseconds((utime + stime) * 1000000 / sysconf(_SC_CLK_TCK));
+}
+
+// Restricts the threads of netd to the first |cores| cores, and gives each its affinity back when
+// destroyed. Threads that netd pinned to the other cores are moved too, so that what's measured
+// is the resolver on fewer cores, and not its threads competing for them with others. Shards and
+// workers started while netd is restricted aren't pinned at all.
+class ScopedNetdCores {
+  public:
+    ScopedNetdCores(pid_t pid, unsigned cores) {
+        cpu_set_t restricted;
+        CPU_ZERO(&restricted);
+        for (unsigned i = 0; i < cores; i++) CPU_SET(i, &restricted);
+        std::unique_ptr<DIR, decltype(&closedir)> tasks(
+                opendir(fmt::format("/proc/{}/task", pid).c_str()), closedir);
+        mOk = tasks != nullptr;
+        while (mOk) {
+            const dirent* entry = readdir(tasks.get());
+            if (entry == nullptr) break;
+            pid_t tid = 0;
+            cpu_set_t saved;
+            // Or it's gone already.
+            if (!ParseInt(entry->d_name, &tid) ||
+                sched_getaffinity(tid, sizeof(saved), &saved) != 0) {
+                continue;
+            }
+            mOk = sched_setaffinity(tid, sizeof(restricted), &restricted) == 0;
+            if (mOk) mSaved.emplace_back(tid, saved);
+        }
+    }
+    ~ScopedNetdCores() {
+        for (const auto& [tid, saved] : mSaved) sched_setaffinity(tid, sizeof(saved), &saved);
+    }
+    ScopedNetdCores(const ScopedNetdCores&) = delete;
+    ScopedNetdCores& operator=(const ScopedNetdCores&) = delete;
+
+    bool ok() const { return mOk; }
+
+  private:
+    bool mOk;
+    std::vector<std::pair<pid_t, cpu_set_t>> mSaved;
+};
+
+struct LoadResult {
+    size_t queries = 0;
+    size_t errors = 0;
+    double qps = 0;
+    microseconds p50{};
+    microseconds p99{};
+    microseconds p999{};
+    // std::nullopt if netd's CPU time can't be read.
+    std::optional<double> cpuUsPerQuery;
+};
+
+enum class LoadMode { CLEARTEXT, DOT, DOH, MDNS };
+
+}  // namespace
+
+// Measures the throughput and latency of getaddrinfo() over one transport, for each number of
+// threads of the LoadConfig.
+class ResolverLoadTest : public ResolverStressTest, public testing::WithParamInterface<LoadMode> {
+  public:
+    static void SetUpTestSuite() { test::DohFrontend::initRustAndroidLogger(); }
+
+  protected:
+    using Mapping = DnsResponderClient::Mapping;
+
+    // Enough names for the misses of a run not to repeat, in a cache that only holds hundreds.
+    static constexpr unsigned kHosts = 20000;
+    // The names that hits are for.
+    static constexpr unsigned kHotHosts = 16;
+    // Long enough for the hot names not to expire during a run.
+    static constexpr unsigned kTtlSec = 600;
+    // Threads of the servers, enough for them not to be what limits the throughput.
+    static constexpr unsigned kServerWorkers = 4;
+
+    void startServers() {
+        const bool mdns = GetParam() == LoadMode::MDNS;
+        mDnsClient.SetupMappings(kHosts, {mdns ? "local" : "example.com"}, &mMappings);
+        const auto addMappings = [&](test::DNSResponder& dns) {
+            for (const Mapping& mapping : mMappings) {
+                dns.addMapping(mapping.entry, ns_type::ns_t_a, mapping.ip4);
+                dns.addMapping(mapping.entry, ns_type::ns_t_aaaa, mapping.ip6);
+            }
+            dns.setTtl(kTtlSec);
+            dns.setThroughputConfig({.workers = kServerWorkers});
+            ASSERT_TRUE(dns.startServer());
+        };
+        ASSERT_NO_FATAL_FAILURE(addMappings(mDns));
+
+        switch (GetParam()) {
+            case LoadMode::CLEARTEXT:
+                ASSERT_TRUE(mDnsClient.SetResolversForNetwork());
+                break;
+            case LoadMode::DOT:
+                ASSERT_NO_FATAL_FAILURE(addMappings(mDotBackend));
+                mDot.setWorkers(kServerWorkers);
+                ASSERT_TRUE(mDot.startServer());
+                ASSERT_TRUE(mDnsClient.SetResolversFromParcel(
+                        DnsResponderClient::GetDefaultResolverParamsParcel()));
+                ASSERT_TRUE(waitForTransport());
+                break;
+            case LoadMode::DOH:
+                mDohFlag = std::make_unique<ScopedSystemProperties>(
+                        "persist.device_config.netd_native.doh", "1");
+                ASSERT_NO_FATAL_FAILURE(addMappings(mDohBackend));
+                ASSERT_TRUE(mDoh.startServer());
+                ASSERT_TRUE(mDnsClient.SetResolversFromParcel(
+                        DnsResponderClient::GetDefaultResolverParamsParcel()));
+                ASSERT_TRUE(waitForTransport());
+                break;
+            case LoadMode::MDNS:
+                ASSERT_NO_FATAL_FAILURE(addMappings(mMdnsV4));
+                ASSERT_NO_FATAL_FAILURE(addMappings(mMdnsV6));
+                SetMdnsRoute();
+                mMdnsRouteSet = true;
+                ASSERT_TRUE(mDnsClient.SetResolversForNetwork());
+                break;
+        }
+    }
+
+    void TearDown() override {
+        if (mMdnsRouteSet) RemoveMdnsRoute();
+    }
+
+    // The number of queries received over the transport under test since the last clear.
+    size_t transportQueries() const {
+        switch (GetParam()) {
+            case LoadMode::CLEARTEXT:
+                return mDns.queries().size();
+            case LoadMode::DOT:
+                return mDot.queries();
+            case LoadMode::DOH:
+                return mDoh.queries();
+            case LoadMode::MDNS:
+                break;
+        }
+        return mMdnsV4.queries().size() + mMdnsV6.queries().size();
+    }
+
+    void clearQueries() {
+        mDns.clearQueries();
+        mDot.clearQueries();
+        mDoh.clearQueries();
+        mMdnsV4.clearQueries();
+        mMdnsV6.clearQueries();
+    }
+
+    // Lookups go to the cleartext server until the private DNS server is validated, so wait until
+    // a lookup of a new name reaches it.
+    bool waitForTransport() {
+        for (int i = 0; i < 100; i++) {
+            const size_t before = transportQueries();
+            lookup(nextFreshHost());
+            if (transportQueries() > before) return true;
+            std::this_thread::sleep_for(50ms);
+        }
+        return false;
+    }
+
+    const Mapping& nextFreshHost() {
+        return mMappings[kHotHosts + mNextFresh++ % (kHosts - kHotHosts)];
+    }
+
+    // Returns false if the lookup fails or returns an address that |mapping| doesn't have.
+    static bool lookup(const Mapping& mapping) {
+        // Without the root, so that ".local" names are looked up over mDNS.
+        const std::string name = mapping.entry.substr(0, mapping.entry.size() - 1);
+        addrinfo* result = nullptr;
+        const int rv = getaddrinfo(name.c_str(), nullptr, nullptr, &result);
+        if (rv != 0) return false;
+        const std::string address = ToString(result);
+        freeaddrinfo(result);
+        return address == mapping.ip4 || address == mapping.ip6;
+    }
+
+    LoadResult runLoad(const LoadConfig& config, unsigned numThreads) {
+        for (unsigned i = 0; i < kHotHosts; i++) EXPECT_TRUE(lookup(mMappings[i]));
+
+        std::vector<std::vector<microseconds>> latencies(numThreads);
+        std::atomic<size_t> errors = 0;
+        // Between two queries of a thread, for the threads together to make |config.qps|.
+        const nanoseconds interval = config.qps ? nanoseconds(1s) * numThreads / config.qps : 0ns;
+        const std::optional<microseconds> cpuBefore = resolverCpuTime();
+        const auto start = steady_clock::now();
+        const auto end = start + config.duration;
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < numThreads; t++) {
+            threads.emplace_back([&, t]() {
+                for (auto scheduled = start + interval * t / numThreads;; scheduled += interval) {
+                    if (interval > 0ns) std::this_thread::sleep_until(scheduled);
+                    const auto sent = steady_clock::now();
+                    if (sent >= end) break;
+                    const bool hit = arc4random_uniform(100) < config.hitPercent;
+                    const bool ok = lookup(hit ? mMappings[arc4random_uniform(kHotHosts)]
+                                               : nextFreshHost());
+                    // With a target rate, a query that a slow one held up was late from when it
+                    // should have been made, not from when it was.
+                    latencies[t].push_back(duration_cast<microseconds>(
+                            steady_clock::now() - (interval > 0ns ? scheduled : sent)));
+                    if (!ok) errors++;
+                }
+            });
+        }
+        for (std::thread& thread : threads) thread.join();
+        const std::chrono::duration<double> elapsed = steady_clock::now() - start;
+        const std::optional<microseconds> cpuAfter = resolverCpuTime();
+
+        std::vector<microseconds> all;
+        for (const auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+        LoadResult result;
+        result.queries = all.size();
+        result.errors = errors;
+        if (all.empty()) return result;
+        const auto percentile = [&](double p) {
+            return all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+        };
+        result.qps = all.size() / elapsed.count();
+        result.p50 = percentile(0.5);
+        result.p99 = percentile(0.99);
+        result.p999 = percentile(0.999);
+        if (cpuBefore && cpuAfter) {
+            result.cpuUsPerQuery = double((*cpuAfter - *cpuBefore).count()) / all.size();
+        }
+        return result;
+    }
+
+    void recordResult(unsigned threads, const LoadResult& result) {
+        LOG(INFO) << fmt::format(
+                "{} threads: {} queries, {} errors, {:.0f} qps, p50 {}us, p99 {}us, p999 {}us, "
+                "{} netd CPU us/query",
+                threads, result.queries, result.errors, result.qps, result.p50.count(),
+                result.p99.count(), result.p999.count(),
+                result.cpuUsPerQuery ? fmt::format("{:.1f}", *result.cpuUsPerQuery) : "unknown");
+        const std::string prefix = fmt::format("threads_{}_", threads);
+        RecordProperty(prefix + "queries", result.queries);
+        RecordProperty(prefix + "errors", result.errors);
+        RecordProperty(prefix + "qps", static_cast<int>(result.qps));
+        RecordProperty(prefix + "p50_us", result.p50.count());
+        RecordProperty(prefix + "p99_us", result.p99.count());
+        RecordProperty(prefix + "p999_us", result.p999.count());
+        if (result.cpuUsPerQuery) {
+            RecordProperty(prefix + "cpu_us_per_query",
+                           fmt::format("{:.1f}", *result.cpuUsPerQuery));
+        }
+    }
+
+    std::vector<Mapping> mMappings;
+    std::atomic<unsigned> mNextFresh = 0;
+    bool mMdnsRouteSet = false;
+    std::unique_ptr<ScopedSystemProperties> mDohFlag;
+
+    // The cleartext server, and that of the private DNS server while it's being validated.
+    test::DNSResponder mDns{test::kDefaultListenAddr, test::kDefaultListenService,
+                            ns_rcode::ns_r_servfail};
+    test::DNSResponder mDotBackend{"127.0.2.3", test::kDefaultListenService,
+                                   ns_rcode::ns_r_servfail};
+    test::DnsTlsFrontend mDot{test::kDefaultListenAddr, "853", "127.0.2.3",
+                              test::kDefaultListenService};
+    test::DNSResponder mDohBackend{"127.0.1.3", test::kDefaultListenService,
+                                   ns_rcode::ns_r_servfail};
+    test::DohFrontend mDoh{test::kDefaultListenAddr, "443", "127.0.1.3",
+                           test::kDefaultListenService};
+    test::DNSResponder mMdnsV4{"127.0.0.3", test::kDefaultMdnsListenService,
+                               ns_rcode::ns_r_servfail};
+    test::DNSResponder mMdnsV6{"::1", test::kDefaultMdnsListenService, ns_rcode::ns_r_servfail};
+};
+
+TEST_P(ResolverLoadTest, Sweep) {
+    const LoadConfig config = loadConfigFromEnvironment();
+    ASSERT_NO_FATAL_FAILURE(startServers());
+    RecordProperty("target_qps", config.qps);
+    RecordProperty("hit_percent", config.hitPercent);
+    RecordProperty("duration_ms", config.duration.count());
+    for (const unsigned threads : config.threads) {
+        clearQueries();
+        const LoadResult result = runLoad(config, threads);
+        recordResult(threads, result);
+        EXPECT_EQ(0U, result.errors) << threads << " threads";
+        // The misses go over the transport under test.
+        if (config.hitPercent < 100) {
+            EXPECT_GT(transportQueries(), 0U) << threads << " threads";
+        }
+    }
+}
+
+// How the throughput of cache hits grows with the cores netd runs on. All queries hit the cache,
+// and each core gets the same number of client threads, so that what limits the throughput is how
+// the resolver takes requests in and answers them on its cores.
+TEST_P(ResolverLoadTest, CoreScaling) {
+    constexpr unsigned kThreadsPerCore = 8;
+    LoadConfig config = loadConfigFromEnvironment();
+    if (config.cores.empty()) GTEST_SKIP() << "RESOLV_LOAD_CORES isn't set";
+    if (GetParam() != LoadMode::CLEARTEXT) GTEST_SKIP() << "Hits don't depend on the transport";
+    const std::optional<pid_t> pid = netdPid();
+    ASSERT_TRUE(pid) << "netd isn't running";
+    ASSERT_NO_FATAL_FAILURE(startServers());
+    config.qps = 0;
+    config.hitPercent = 100;
+    RecordProperty("duration_ms", config.duration.count());
+
+    // Queries per second per core of the first run, that the others are compared to.
+    double firstQpsPerCore = 0;
+    for (const unsigned cores : config.cores) {
+        if (cores > std::thread::hardware_concurrency()) {
+            ADD_FAILURE() << "Only " << std::thread::hardware_concurrency() << " cores";
+            continue;
+        }
+        LoadResult result;
+        {
+            ScopedNetdCores restricted(*pid, cores);
+            ASSERT_TRUE(restricted.ok()) << "Can't restrict netd to " << cores << " cores";
+            result = runLoad(config, cores * kThreadsPerCore);
+        }
+        EXPECT_EQ(0U, result.errors) << cores << " cores";
+        if (firstQpsPerCore == 0) firstQpsPerCore = result.qps / cores;
+        // 1 if the throughput grows in proportion to the cores.
+        const double efficiency = firstQpsPerCore > 0 ? result.qps / cores / firstQpsPerCore : 0;
+        LOG(INFO) << fmt::format("{} cores: {:.0f} qps, p50 {}us, p99 {}us, efficiency {:.2f}",
+                                 cores, result.qps, result.p50.count(), result.p99.count(),
+                                 efficiency);
+        const std::string prefix = fmt::format("cores_{}_", cores);
+        RecordProperty(prefix + "qps", static_cast<int>(result.qps));
+        RecordProperty(prefix + "p99_us", result.p99.count());
+        RecordProperty(prefix + "efficiency", fmt::format("{:.2f}", efficiency));
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(Load, ResolverLoadTest,
+                         testing::Values(LoadMode::CLEARTEXT, LoadMode::DOT, LoadMode::DOH,
+                                         LoadMode::MDNS),
+                         [](const testing::TestParamInfo<LoadMode>& info) -> std::string {
+                             switch (info.param) {
+                                 case LoadMode::CLEARTEXT:
+                                     return "Cleartext";
+                                 case LoadMode::DOT:
+                                     return "DoT";
+                                 case LoadMode::DOH:
+                                     return "DoH";
+                                 case LoadMode::MDNS:
+                                     break;
+                             }
+                             return "Mdns";
+                         });
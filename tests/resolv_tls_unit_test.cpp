@@ -18,7 +18,10 @@
 
 #include <arpa/inet.h>
 
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <thread>
 
 #include <android-base/logging.h>
 #include <android-base/macros.h>
@@ -36,8 +39,10 @@
 #include "IDnsTlsSocket.h"
 #include "IDnsTlsSocketFactory.h"
 #include "IDnsTlsSocketObserver.h"
+#include "LockedQueue.h"
 #include "tests/dns_responder/dns_tls_frontend.h"
 #include "tests/resolv_test_base.h"
+#include "tests/resolv_test_utils.h"
 
 namespace android {
 namespace net {
@@ -459,7 +464,7 @@ TEST_F(TransportTest, CloseRetryFail) {
 
     // Reconnections might be triggered depending on the flag.
     EXPECT_EQ(transport.getConnectCounter(),
-              Experiments::getInstance()->getFlag(DOT_MAXTRIES_FLAG, DnsTlsQueryMap::kMaxTries));
+              Experiments::getInstance()->getFlag("dot_maxtries", DnsTlsQueryMap::kMaxTries));
 }
 
 // Simulate a server that occasionally closes the connection and silently
@@ -556,7 +561,7 @@ TEST_F(TransportTest, SilentDrop) {
 
     // Reconnections might be triggered depending on the flag.
     EXPECT_EQ(transport.getConnectCounter(),
-              Experiments::getInstance()->getFlag(DOT_MAXTRIES_FLAG, DnsTlsQueryMap::kMaxTries));
+              Experiments::getInstance()->getFlag("dot_maxtries", DnsTlsQueryMap::kMaxTries));
 }
 
 TEST_F(TransportTest, PartialDrop) {
@@ -759,6 +764,127 @@ TEST_F(DispatcherTest, Dispatching) {
     }
 }
 
+// Holds every response until sTarget queries have arrived, over all sockets.
+class FakeSocketBarrier : public IDnsTlsSocket {
+  public:
+    explicit FakeSocketBarrier(IDnsTlsSocketObserver* observer) : mObserver(observer) {}
+    ~FakeSocketBarrier() {
+        std::lock_guard guard(mLock);
+        for (auto& thread : mThreads) {
+            thread.join();
+        }
+    }
+    inline static int sTarget = 1;
+    inline static std::atomic<int> sQueries = 0;
+
+    bool query(uint16_t id, const Slice query) override {
+        std::lock_guard guard(mLock);
+        sQueries++;
+        mThreads.emplace_back([this, echo = make_echo(id, query)]() {
+            while (sQueries < sTarget) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            mObserver->onResponse(echo);
+        });
+        return true;
+    }
+    bool startHandshake() override { return true; }
+
+  private:
+    std::mutex mLock;
+    std::vector<std::thread> mThreads GUARDED_BY(mLock);
+    IDnsTlsSocketObserver* const mObserver;
+};
+
+TEST_F(DispatcherTest, ConnectionPool) {
+    {
+        ScopedSystemProperties maxConnections(
+                "persist.device_config.netd_native.dot_max_connections", "2");
+        ScopedSystemProperties depth("persist.device_config.netd_native.dot_pool_depth_threshold",
+                                     "2");
+        Experiments::getInstance()->update();
+
+        // No query completes before all four are sent: two fill the first connection, and the
+        // next two go to a second one.
+        FakeSocketBarrier::sTarget = 4;
+        FakeSocketBarrier::sQueries = 0;
+        auto factory = std::make_unique<TrackingFakeSocketFactory<FakeSocketBarrier>>();
+        auto* weak_factory = factory.get();  // Valid as long as dispatcher is in scope.
+        DnsTlsDispatcher dispatcher(std::move(factory));
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([this, &dispatcher, i]() {
+                auto q = make_query(i, SIZE);
+                bytevec ans(4096);
+                int resplen = 0;
+                bool connectTriggered = false;
+                auto r = dispatcher.query(SERVER1, NETID, MARK, makeSlice(q), makeSlice(ans),
+                                          &resplen, &connectTriggered);
+                EXPECT_EQ(DnsTlsTransport::Response::success, r);
+                ans.resize(resplen);
+                EXPECT_EQ(q, ans);
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        EXPECT_EQ(2U, weak_factory->keys.count(std::make_pair(MARK, SERVER1)));
+    }
+    // Back to a single connection per server for the other tests.
+    Experiments::getInstance()->update();
+}
+
+TEST_F(DispatcherTest, ForceCleanup) {
+    auto factory = std::make_unique<TrackingFakeSocketFactory<FakeSocketEcho>>();
+    auto* weak_factory = factory.get();  // Valid as long as dispatcher is in scope.
+    DnsTlsDispatcher dispatcher(std::move(factory));
+
+    // Servers on two networks, which are likely to be in different shards of the dispatcher.
+    const std::pair<unsigned, DnsTlsServer> keys[] = {{MARK, SERVER1},
+                                                      {MARK + 1, DnsTlsServer(V4ADDR2)}};
+    const auto queryAll = [&]() {
+        for (const auto& [mark, server] : keys) {
+            auto q = make_query(mark, SIZE);
+            bytevec ans(4096);
+            int resplen = 0;
+            bool connectTriggered = false;
+            EXPECT_EQ(DnsTlsTransport::Response::success,
+                      dispatcher.query(server, mark, mark, makeSlice(q), makeSlice(ans), &resplen,
+                                       &connectTriggered));
+        }
+    };
+    queryAll();
+    dispatcher.forceCleanup(MARK);
+    queryAll();
+
+    // Only the transport on the network that was cleaned up is opened again.
+    EXPECT_EQ(2U, weak_factory->keys.count(keys[0]));
+    EXPECT_EQ(1U, weak_factory->keys.count(keys[1]));
+}
+
+TEST_F(DispatcherTest, WarmUp) {
+    auto factory = std::make_unique<TrackingFakeSocketFactory<FakeSocketEcho>>();
+    auto* weak_factory = factory.get();  // Valid as long as dispatcher is in scope.
+    DnsTlsDispatcher dispatcher(std::move(factory));
+    const std::pair<unsigned, DnsTlsServer> key = {MARK, SERVER1};
+
+    EXPECT_TRUE(dispatcher.warmUp(SERVER1, MARK, MARK));
+    EXPECT_EQ(1U, weak_factory->keys.count(key));
+    EXPECT_TRUE(dispatcher.warmUp(SERVER1, MARK, MARK));
+
+    // The first query goes out on the connection that is already open.
+    auto q = make_query(MARK, SIZE);
+    bytevec ans(4096);
+    int resplen = 0;
+    bool connectTriggered = true;
+    EXPECT_EQ(DnsTlsTransport::Response::success,
+              dispatcher.query(SERVER1, MARK, MARK, makeSlice(q), makeSlice(ans), &resplen,
+                               &connectTriggered));
+    EXPECT_FALSE(connectTriggered);
+    EXPECT_EQ(1U, weak_factory->keys.count(key));
+}
+
 // Check DnsTlsServer's comparison logic.
 AddressComparator ADDRESS_COMPARATOR;
 bool isAddressEqual(const DnsTlsServer& s1, const DnsTlsServer& s2) {
@@ -967,6 +1093,116 @@ TEST(QueryMapTest, FillHole) {
     EXPECT_FALSE(map.recordQuery(makeSlice(QUERY)));
 }
 
+TEST(QueryMapTest, Coalesce) {
+    // A query for |name| A, with RD set.
+    const auto makeQuestion = [](uint16_t id, const std::string& name) {
+        bytevec q = {uint8_t(id >> 8), uint8_t(id), 1, 0, 0, 1, 0, 0, 0, 0, 0, 0,
+                     uint8_t(name.size())};
+        q.insert(q.end(), name.begin(), name.end());
+        q.insert(q.end(), {0, 0, 1, 0, 1});
+        return q;
+    };
+    std::unique_ptr<DnsTlsQueryMap> coalescing;
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.dot_coalesce_queries", "1");
+        Experiments::getInstance()->update();
+        coalescing = std::make_unique<DnsTlsQueryMap>();
+    }
+    // The flag is only read by the constructor.
+    Experiments::getInstance()->update();
+    DnsTlsQueryMap& map = *coalescing;
+
+    auto f0 = map.recordQuery(makeSlice(makeQuestion(999, "example")));
+    // The case of the name makes no difference.
+    auto f1 = map.recordQuery(makeSlice(makeQuestion(888, "EXAMPLE")));
+    auto f2 = map.recordQuery(makeSlice(makeQuestion(777, "another")));
+    ASSERT_TRUE(f0 && f1 && f2);
+    EXPECT_FALSE(f0->joined);
+    EXPECT_TRUE(f1->joined);
+    EXPECT_EQ(f0->query.newId, f1->query.newId);
+    EXPECT_FALSE(f2->joined);
+    EXPECT_EQ(2U, map.getAll().size());
+
+    bytevec answer = makeQuestion(f0->query.newId, "example");
+    answer[2] |= 0x80;
+    map.onResponse(answer);
+    const auto r0 = f0->result.get();
+    const auto r1 = f1->result.get();
+    ASSERT_EQ(DnsTlsQueryMap::Response::success, r0.code);
+    ASSERT_EQ(DnsTlsQueryMap::Response::success, r1.code);
+    EXPECT_EQ(999, r0.response[0] << 8 | r0.response[1]);
+    EXPECT_EQ(888, r1.response[0] << 8 | r1.response[1]);
+    EXPECT_EQ(bytevec(r0.response.begin() + 2, r0.response.end()),
+              bytevec(r1.response.begin() + 2, r1.response.end()));
+
+    // Once answered, the query is sent again, and its failure is shared too.
+    auto f3 = map.recordQuery(makeSlice(makeQuestion(666, "example")));
+    auto f4 = map.recordQuery(makeSlice(makeQuestion(555, "example")));
+    EXPECT_FALSE(f3->joined);
+    EXPECT_TRUE(f4->joined);
+    map.clear();
+    EXPECT_EQ(DnsTlsQueryMap::Response::network_error, f2->result.get().code);
+    EXPECT_EQ(DnsTlsQueryMap::Response::network_error, f3->result.get().code);
+    EXPECT_EQ(DnsTlsQueryMap::Response::network_error, f4->result.get().code);
+}
+
+TEST(MpscQueueTest, Basic) {
+    MpscQueue<int> queue;
+    std::deque<int> out = {7};
+    queue.swap(out);
+    EXPECT_TRUE(out.empty());
+
+    // Only the push onto an empty queue asks for the consumer to be signalled.
+    EXPECT_TRUE(queue.push(1));
+    EXPECT_FALSE(queue.push(2));
+    EXPECT_FALSE(queue.push(3));
+    queue.swap(out);
+    // Newest first, as from LockedQueue.
+    EXPECT_THAT(out, testing::ElementsAre(3, 2, 1));
+    EXPECT_TRUE(queue.push(4));
+    queue.swap(out);
+    EXPECT_THAT(out, testing::ElementsAre(4));
+
+    // Items left in the queue are freed with it.
+    queue.push(5);
+}
+
+TEST(MpscQueueTest, Producers) {
+    constexpr int kProducers = 4;
+    constexpr int kItems = 10000;
+    MpscQueue<int> queue;
+    std::atomic<int> signals = 0;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&, p]() {
+            for (int i = 0; i < kItems; i++) {
+                if (queue.push(p * kItems + i)) signals++;
+            }
+        });
+    }
+    std::vector<bool> seen(kProducers * kItems);
+    std::vector<int> last(kProducers, -1);
+    int taken = 0;
+    int swaps = 0;
+    std::deque<int> out;
+    while (taken < kProducers * kItems) {
+        queue.swap(out);
+        if (out.empty()) continue;
+        swaps++;
+        // Each producer's items come out in the order it pushed them.
+        for (auto it = out.rbegin(); it != out.rend(); ++it) {
+            ASSERT_FALSE(seen[*it]);
+            seen[*it] = true;
+            EXPECT_LT(last[*it / kItems], *it);
+            last[*it / kItems] = *it;
+        }
+        taken += out.size();
+    }
+    for (auto& t : producers) t.join();
+    // One signal for each non-empty swap.
+    EXPECT_EQ(swaps, signals);
+}
+
 class DnsTlsSocketTest : public ResolvTestBase {
   protected:
     class MockDnsTlsSocketObserver : public IDnsTlsSocketObserver {
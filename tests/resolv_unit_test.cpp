@@ -1873,6 +1873,34 @@ TEST_F(ResolvCommonFunctionTest, GetCustTableByName) {
                 testing::UnorderedElementsAreArray({custAddrV4, custAddrV6}));
 }
 
+TEST_F(ResolvCommonFunctionTest, GetHostByAddrFromCustTable) {
+    const char custAddrV4[] = "1.2.3.4";
+    const char hostnameV4[] = "v4.example.com.";
+    const aidl::android::net::ResolverOptionsParcel& resolverOptions = {
+            {
+                    {custAddrV4, hostnameV4},
+            },
+            aidl::android::net::IDnsResolver::TC_MODE_DEFAULT};
+    const std::vector<int32_t>& transportTypes = {IDnsResolver::TRANSPORT_WIFI};
+    EXPECT_EQ(0, resolv_set_nameservers(TEST_NETID, servers, domains, params, resolverOptions,
+                                        transportTypes));
+    // Names are matched regardless of case, as in the hosts file.
+    EXPECT_THAT(getCustomizedTableByName(TEST_NETID, "V4.Example.COM."),
+                testing::ElementsAre(custAddrV4));
+
+    // Answered from the customized table: no DNS server is running.
+    in_addr v4addr;
+    ASSERT_EQ(1, inet_pton(AF_INET, custAddrV4, &v4addr));
+    hostent hbuf;
+    char tmpbuf[MAXPACKET];
+    hostent* hp = nullptr;
+    NetworkDnsEventReported event;
+    ASSERT_EQ(0, resolv_gethostbyaddr(&v4addr, sizeof(v4addr), AF_INET, &hbuf, tmpbuf,
+                                      sizeof(tmpbuf), &mNetcontext, &hp, &event));
+    ASSERT_NE(nullptr, hp);
+    EXPECT_STREQ(hostnameV4, hp->h_name);
+}
+
 TEST_F(ResolvCommonFunctionTest, GetNetworkTypesForNet) {
     const aidl::android::net::ResolverOptionsParcel& resolverOptions = {
             {} /* hosts */, aidl::android::net::IDnsResolver::TC_MODE_DEFAULT};
@@ -39,6 +39,7 @@ using android::base::Error;
 using android::base::Result;
 using android::base::unique_fd;
 using android::netdutils::Slice;
+using std::chrono::microseconds;
 
 namespace android::net {
 
@@ -141,6 +142,21 @@ bool TunForwarder::addForwardingRule(const std::array<std::string, 2>& from,
     return true;
 }
 
+bool TunForwarder::setImpairment(const std::array<std::string, 2>& from,
+                                 const Impairment& impairment) {
+    std::lock_guard guard(mLock);
+    if (from[0].find(':') == from[0].npos) {
+        auto k = v4pair::makePair(from);
+        if (!k.ok()) return false;
+        mLinksIpv4[k.value()].impairment = impairment;
+    } else {
+        auto k = v6pair::makePair(from);
+        if (!k.ok()) return false;
+        mLinksIpv6[k.value()].impairment = impairment;
+    }
+    return true;
+}
+
 unique_fd TunForwarder::createTun(const std::string& ifname) {
     unique_fd fd(open("/dev/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC));
     if (!fd.ok()) {
@@ -174,7 +190,10 @@ void TunForwarder::loop() {
                 {mTunFd.get(), POLLIN, 0},
         };
 
-        if (int ret = poll(wait_fd, std::size(wait_fd), kPollTimeoutMs); ret <= 0) {
+        const int delayedMs = writeDelayedPackets();
+        const int timeoutMs = delayedMs < 0 ? kPollTimeoutMs : delayedMs;
+        if (int ret = poll(wait_fd, std::size(wait_fd), timeoutMs);
+            ret < 0 || (ret == 0 && mDelayed.empty())) {
             break;
         }
 
@@ -189,7 +208,7 @@ void TunForwarder::loop() {
     }
 }
 
-void TunForwarder::handlePacket(int fd) const {
+void TunForwarder::handlePacket(int fd) {
     uint8_t buf[MAXMTU + TUN_HDRLEN];
 
     ssize_t readlen = read(fd, buf, std::size(buf));
@@ -208,15 +227,83 @@ void TunForwarder::handlePacket(int fd) const {
         return;
     }
 
+    // Looked up by the addresses the packet has before translation.
+    const std::optional<Clock::time_point> due = impair(tunPacket);
+
     // Change the packet's source/destination address and checksum.
     if (auto result = translatePacket(tunPacket); !result.ok()) {
         LOG(ERROR) << "translatePacket failed: " << result.error();
     }
 
+    if (!due) {
+        LOG(DEBUG) << "Dropping a packet of " << readlen << " bytes";
+        return;
+    }
+    if (*due > Clock::now()) {
+        mDelayed.push({*due, mNextSeq++, std::vector<uint8_t>(buf, buf + readlen)});
+        return;
+    }
+
     // Write the new packet to the fd, causing the kernel to receive it on the tun interface.
     write(fd, buf, readlen);
 }
 
+std::optional<TunForwarder::Clock::time_point> TunForwarder::impair(Slice tunPacket) {
+    const Clock::time_point now = Clock::now();
+    const tun_pi* const tunHeader = reinterpret_cast<tun_pi*>(tunPacket.base());
+    const Slice ipPacket = drop(tunPacket, TUN_HDRLEN);
+
+    std::lock_guard guard(mLock);
+    Link* link = nullptr;
+    if (ntohs(tunHeader->proto) == ETH_P_IP) {
+        const iphdr* const ipHeader = reinterpret_cast<iphdr*>(ipPacket.base());
+        if (auto it = mLinksIpv4.find(v4pair(ipHeader->saddr, ipHeader->daddr));
+            it != mLinksIpv4.end()) {
+            link = &it->second;
+        }
+    } else {
+        const ip6_hdr* const ipv6Header = reinterpret_cast<ip6_hdr*>(ipPacket.base());
+        if (auto it = mLinksIpv6.find({ipv6Header->ip6_src, ipv6Header->ip6_dst});
+            it != mLinksIpv6.end()) {
+            link = &it->second;
+        }
+    }
+    if (link == nullptr) return now;
+
+    const Impairment& impairment = link->impairment;
+    if (impairment.loss > 0 && std::bernoulli_distribution(impairment.loss)(mRng)) {
+        return std::nullopt;
+    }
+    Clock::time_point sent = now;
+    if (impairment.bandwidth > 0) {
+        sent = std::max(now, link->busyUntil) +
+               microseconds(ipPacket.size() * 1000000 / impairment.bandwidth);
+        link->busyUntil = sent;
+    }
+    if (impairment.reorder > 0 && std::bernoulli_distribution(impairment.reorder)(mRng)) {
+        return sent;
+    }
+    microseconds jitter(0);
+    if (impairment.jitter.count() > 0) {
+        jitter = microseconds(
+                std::uniform_int_distribution<int64_t>(0, impairment.jitter.count())(mRng));
+    }
+    return sent + impairment.delay + jitter;
+}
+
+int TunForwarder::writeDelayedPackets() {
+    const Clock::time_point now = Clock::now();
+    while (!mDelayed.empty() && mDelayed.top().deadline <= now) {
+        const std::vector<uint8_t>& data = mDelayed.top().data;
+        write(mTunFd.get(), data.data(), data.size());
+        mDelayed.pop();
+    }
+    if (mDelayed.empty()) return -1;
+    // Rounded up, so as not to wake up before the packet is due.
+    const auto wait = mDelayed.top().deadline - now;
+    return std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+}
+
 Result<void> TunForwarder::validatePacket(Slice tunPacket) const {
     if (tunPacket.size() < TUN_HDRLEN) {
         return Error() << "Too short for a tun header";
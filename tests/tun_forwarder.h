@@ -17,12 +17,19 @@
 
 #pragma once
 
+#include <chrono>
 #include <map>
+#include <optional>
+#include <mutex>
+#include <queue>
+#include <random>
 #include <thread>
+#include <vector>
 
 #include <netinet/ip.h>
 
 #include <android-base/result.h>
+#include <android-base/thread_annotations.h>
 #include <android-base/unique_fd.h>
 #include <netdutils/Slice.h>
 
@@ -31,14 +38,33 @@ namespace android::net {
 // Given a TUN interface fd, TunForwarder reads packets from the fd, changes their IP header
 // according to a set of forwarding rules (which can be set by addForwardingRule), and sends
 // new packets back to the fd. Only IPv4 and IPv6 packets with recognized source and destination
-// addresses are accepted; other packets are silently ignored.
+// addresses are accepted; other packets are silently ignored. The packets of a forwarding rule
+// can be impaired (see setImpairment) to emulate a slow or lossy link in that direction.
 class TunForwarder {
   public:
+    // How the packets of a forwarding rule are held back or dropped. The defaults forward them as
+    // soon as they are read.
+    struct Impairment {
+        std::chrono::microseconds delay{0};
+        // Each packet is delayed by up to |jitter| more, picked uniformly, which may reorder
+        // packets that follow each other closely.
+        std::chrono::microseconds jitter{0};
+        // Probabilities that a packet is dropped, and that it's sent ahead of the delay, and so of
+        // the packets delayed before it.
+        double loss = 0;
+        double reorder = 0;
+        // Bytes per second the direction can carry, or 0 for no limit. Packets queue behind one
+        // another for the time they take to send, before they are delayed.
+        uint64_t bandwidth = 0;
+    };
+
     TunForwarder(base::unique_fd tunFd);
     ~TunForwarder();
 
     bool addForwardingRule(const std::array<std::string, 2>& from,
                            const std::array<std::string, 2>& to);
+    // Impairs the packets that the rule from |from| forwards. Can be called while forwarding.
+    bool setImpairment(const std::array<std::string, 2>& from, const Impairment& impairment);
     bool startForwarding();
     bool stopForwarding();
 
@@ -70,8 +96,33 @@ class TunForwarder {
         bool operator<(const v6pair& o) const;
     };
 
+    using Clock = std::chrono::steady_clock;
+
+    struct Link {
+        Impairment impairment;
+        // When the packets sent so far are all out, with |impairment.bandwidth|.
+        Clock::time_point busyUntil;
+    };
+
+    struct DelayedPacket {
+        Clock::time_point deadline;
+        // Keeps the order of the packets due at the same time.
+        uint64_t seq;
+        std::vector<uint8_t> data;
+        bool operator>(const DelayedPacket& o) const {
+            return std::tie(deadline, seq) > std::tie(o.deadline, o.seq);
+        }
+    };
+
     void loop();
-    void handlePacket(int fd) const;
+    void handlePacket(int fd);
+
+    // Returns when to write the packet back to the tun, or nullopt to drop it. Expects a packet
+    // that passed validatePacket() and hasn't been translated yet.
+    std::optional<Clock::time_point> impair(netdutils::Slice tunPacket) EXCLUDES(mLock);
+    // Writes the delayed packets that are due, and returns how long to wait for the next one, or
+    // -1 if none is left.
+    int writeDelayedPackets();
 
     // Send a signal to terminate the loop thread.
     bool signalEventFd();
@@ -99,6 +150,15 @@ class TunForwarder {
     std::map<v4pair, v4pair> mRulesIpv4;
     std::map<v6pair, v6pair> mRulesIpv6;
 
+    std::mutex mLock;
+    std::map<v4pair, Link> mLinksIpv4 GUARDED_BY(mLock);
+    std::map<v6pair, Link> mLinksIpv6 GUARDED_BY(mLock);
+    std::mt19937 mRng GUARDED_BY(mLock){std::random_device{}()};
+    // Only used by the loop thread.
+    std::priority_queue<DelayedPacket, std::vector<DelayedPacket>, std::greater<DelayedPacket>>
+            mDelayed;
+    uint64_t mNextSeq = 0;
+
     static constexpr int kPollTimeoutMs = 5000;
 };
 
@@ -17,6 +17,10 @@
 
 #include "util.h"
 
+#include <arpa/nameser.h>
+#include <sched.h>
+#include <unistd.h>
+
 #include <android-base/format.h>
 #include <android-base/parseint.h>
 #include <server_configurable_flags/get_flags.h>
@@ -56,3 +60,42 @@ std::string timestampToString(const std::chrono::system_clock::time_point& ts) {
     int ms = duration_cast<milliseconds>(ts.time_since_epoch()).count() % 1000;
     return fmt::format("{}.{:03d}", buf, ms);
 }
+
+std::string getQueryCoalescingKey(std::span<const uint8_t> query) {
+    if (query.size() < NS_HFIXEDSZ) return "";
+    const uint8_t flags = query[2];
+    const uint16_t qdcount = (query[4] << 8) | query[5];
+    // QR and the opcode.
+    if ((flags & 0xf8) != (ns_o_query << 3) || qdcount != 1) return "";
+
+    std::string key(query.begin() + 2, query.end());
+    // Offsets in |key| are 2 less than in |query|. A question right after the header is never
+    // compressed.
+    size_t offset = NS_HFIXEDSZ - 2;
+    while (offset < key.size() && key[offset] != 0) {
+        const size_t len = static_cast<uint8_t>(key[offset]);
+        if (len > NS_MAXLABEL || key.size() - offset - 1 < len) return "";
+        for (size_t i = offset + 1; i <= offset + len; i++) {
+            if (key[i] >= 'A' && key[i] <= 'Z') key[i] += 'a' - 'A';
+        }
+        offset += 1 + len;
+    }
+    // The root label, QTYPE and QCLASS.
+    if (key.size() - std::min(offset, key.size()) < 1 + 2 * NS_INT16SZ) return "";
+    return key;
+}
+
+int pinToAllowedCore(size_t index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return -1;
+    const int count = CPU_COUNT(&allowed);
+    if (count == 0 || count < sysconf(_SC_NPROCESSORS_ONLN)) return -1;
+    int core = -1;
+    for (size_t seen = 0; seen <= index % count;) {
+        if (CPU_ISSET(++core, &allowed)) seen++;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0 ? core : -1;
+}
@@ -18,6 +18,7 @@
 #pragma once
 
 #include <chrono>
+#include <span>
 #include <string>
 
 #include <netinet/in.h>
@@ -37,6 +38,17 @@ int getExperimentFlagInt(const std::string& flagName, int defaultValue);
 // Convert time_point to readable string format "hr:min:sec.ms".
 std::string timestampToString(const std::chrono::system_clock::time_point& ts);
 
+// Returns what identifies the answer to |query| from a given server, which is all of it but the
+// ID, with the question name in lower case. Returns an empty string if |query| isn't a standard
+// query for a single question.
+std::string getQueryCoalescingKey(std::span<const uint8_t> query);
+
+// Pins the calling thread to the |index|th of the cores it may run on, modulo their number. A
+// thread that may only run on some of the online cores, as in a restricted cpuset, is left alone,
+// rather than pinned where the scheduler was asked not to put it. Returns the core, or -1 if the
+// thread wasn't pinned.
+int pinToAllowedCore(size_t index);
+
 // When sdk X release branch is created, aosp's sdk version would still be X-1,
 // internal would be X. Also there might be some different setting between real devices and
 // CF. Below is the example for the sdk related properties in later R development stage. (internal